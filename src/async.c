@@ -0,0 +1,383 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * async.c - variable reads and writes that don't block the caller
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "efivar.h"
+
+/*
+ * Requests go on a queue that a few worker threads take them from, each
+ * one making the ordinary blocking call, rate limit sleeps and all, and
+ * putting the result on a completion queue.  Each completion bumps an
+ * eventfd, so an event loop can poll efi_async_fd() along with everything
+ * else and call efi_async_dispatch() when it's readable.
+ *
+ * The kernel only lets one variable access reach the firmware at a time,
+ * so a second worker mostly helps by getting on with the next request
+ * while the first is asleep being rate limited.
+ */
+
+struct async_request {
+	list_t list;
+	efi_async_op_t op;
+	efi_guid_t guid;
+	char *name;
+	uint8_t *data;
+	size_t data_size;
+	uint32_t attributes;
+	mode_t mode;
+	int error;
+	void *user;
+};
+
+struct efi_async_ctx {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	list_t pending;
+	list_t done;
+	size_t ndone;
+	bool stopping;
+	int fd;
+	pthread_t *workers;
+	unsigned int nworkers;
+};
+
+static void
+async_request_free(struct async_request *req)
+{
+	free(req->name);
+	free(req->data);
+	free(req);
+}
+
+static void
+async_signal(efi_async_ctx_t *ctx)
+{
+	uint64_t one = 1;
+	ssize_t rc;
+
+	do {
+		rc = write(ctx->fd, &one, sizeof(one));
+	} while (rc < 0 && errno == EINTR);
+}
+
+#ifdef __linux__
+
+static void
+async_run(struct async_request *req)
+{
+	uint8_t *data = NULL;
+	uint8_t empty = 0;
+	int rc = -1;
+
+	switch (req->op) {
+	case EFI_ASYNC_GET:
+		rc = efi_get_variable(req->guid, req->name, &data,
+				      &req->data_size, &req->attributes);
+		break;
+	case EFI_ASYNC_SET:
+		rc = efi_set_variable(req->guid, req->name,
+				      req->data ? req->data : &empty,
+				      req->data_size, req->attributes,
+				      req->mode);
+		break;
+	case EFI_ASYNC_DEL:
+		rc = efi_del_variable(req->guid, req->name);
+		break;
+	}
+
+	req->error = rc < 0 ? errno : 0;
+	free(req->data);
+	req->data = NULL;
+	if (rc >= 0 && req->op == EFI_ASYNC_GET)
+		req->data = data;
+	else
+		req->data_size = 0;
+
+	/* nobody is ever going to look at this thread's error trace */
+	efi_error_clear();
+}
+
+static void *
+async_worker(void *arg)
+{
+	efi_async_ctx_t *ctx = arg;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (1) {
+		struct async_request *req;
+
+		while (!ctx->stopping && list_empty(&ctx->pending))
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		if (ctx->stopping)
+			break;
+
+		req = list_first_entry(&ctx->pending, struct async_request,
+				       list);
+		list_del(&req->list);
+		pthread_mutex_unlock(&ctx->lock);
+
+		async_run(req);
+
+		pthread_mutex_lock(&ctx->lock);
+		list_add_tail(&req->list, &ctx->done);
+		ctx->ndone++;
+		async_signal(ctx);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+static void
+async_stop(efi_async_ctx_t *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stopping = true;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	for (unsigned int i = 0; i < ctx->nworkers; i++)
+		pthread_join(ctx->workers[i], NULL);
+	ctx->nworkers = 0;
+}
+#endif
+
+int NONNULL(1) PUBLIC
+efi_async_new(efi_async_ctx_t **ctxp, unsigned int nworkers)
+{
+#ifdef __linux__
+	efi_async_ctx_t *ctx;
+	sigset_t all, old;
+	int rc;
+
+	if (nworkers == 0)
+		nworkers = 1;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	ctx->fd = -1;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->cond, NULL);
+	INIT_LIST_HEAD(&ctx->pending);
+	INIT_LIST_HEAD(&ctx->done);
+
+	ctx->workers = calloc(nworkers, sizeof(*ctx->workers));
+	if (!ctx->workers) {
+		efi_error("could not allocate memory");
+		goto err;
+	}
+
+	ctx->fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (ctx->fd < 0) {
+		efi_error("eventfd() failed");
+		goto err;
+	}
+
+	/* signals are the caller's business, not the workers' */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (unsigned int i = 0; i < nworkers; i++) {
+		rc = pthread_create(&ctx->workers[i], NULL, async_worker, ctx);
+		if (rc != 0) {
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			errno = rc;
+			efi_error("pthread_create() failed");
+			goto err;
+		}
+		ctx->nworkers++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	*ctxp = ctx;
+	return 0;
+err:
+	rc = errno;
+	efi_async_free(ctx);
+	errno = rc;
+	return -1;
+#else
+	(void)ctxp;
+	(void)nworkers;
+	efi_error("asynchronous variable access is not implemented");
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int NONNULL(1) PUBLIC
+efi_async_fd(efi_async_ctx_t *ctx)
+{
+	return ctx->fd;
+}
+
+static int
+async_submit(efi_async_ctx_t *ctx, efi_async_op_t op, efi_guid_t *guid,
+	     const char *name, const uint8_t *data, size_t data_size,
+	     uint32_t attributes, mode_t mode, void *user)
+{
+	struct async_request *req;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		goto err;
+	req->op = op;
+	req->guid = *guid;
+	req->attributes = attributes;
+	req->mode = mode;
+	req->user = user;
+	req->name = strdup(name);
+	if (!req->name)
+		goto err;
+	if (data_size) {
+		req->data = malloc(data_size);
+		if (!req->data)
+			goto err;
+		memcpy(req->data, data, data_size);
+		req->data_size = data_size;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	list_add_tail(&req->list, &ctx->pending);
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+err:
+	efi_error("could not allocate memory");
+	if (req)
+		async_request_free(req);
+	return -1;
+}
+
+int NONNULL(1, 3) PUBLIC
+efi_async_get_variable(efi_async_ctx_t *ctx, efi_guid_t guid,
+		       const char *name, void *user)
+{
+	return async_submit(ctx, EFI_ASYNC_GET, &guid, name, NULL, 0, 0, 0,
+			    user);
+}
+
+int NONNULL(1, 3) PUBLIC
+efi_async_set_variable(efi_async_ctx_t *ctx, efi_guid_t guid,
+		       const char *name, const uint8_t *data,
+		       size_t data_size, uint32_t attributes, mode_t mode,
+		       void *user)
+{
+	if (!data && data_size) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+	return async_submit(ctx, EFI_ASYNC_SET, &guid, name, data, data_size,
+			    attributes, mode, user);
+}
+
+int NONNULL(1, 3) PUBLIC
+efi_async_del_variable(efi_async_ctx_t *ctx, efi_guid_t guid,
+		       const char *name, void *user)
+{
+	return async_submit(ctx, EFI_ASYNC_DEL, &guid, name, NULL, 0, 0, 0,
+			    user);
+}
+
+int NONNULL(1, 3) PUBLIC
+efi_async_dispatch(efi_async_ctx_t *ctx, int timeout, efi_async_cb_t *cb)
+{
+	struct pollfd pfd = {
+		.fd = ctx->fd,
+		.events = POLLIN,
+	};
+	uint64_t count;
+	size_t ndone;
+	int calls = 0;
+	int rc;
+
+	pthread_mutex_lock(&ctx->lock);
+	ndone = ctx->ndone;
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (ndone == 0) {
+		rc = poll(&pfd, 1, timeout);
+		if (rc < 0 && errno != EINTR) {
+			efi_error("poll() failed");
+			return -1;
+		}
+	}
+
+	/*
+	 * Reset the eventfd before looking at the queue; anything that
+	 * finishes after this signals it again.
+	 */
+	while (read(ctx->fd, &count, sizeof(count)) < 0 && errno == EINTR)
+		;
+
+	pthread_mutex_lock(&ctx->lock);
+	ndone = ctx->ndone;
+	while (ndone--) {
+		struct async_request *req;
+
+		req = list_first_entry(&ctx->done, struct async_request, list);
+		list_del(&req->list);
+		ctx->ndone--;
+		pthread_mutex_unlock(&ctx->lock);
+
+		calls++;
+		rc = cb(req->op, &req->guid, req->name, req->error, req->data,
+			req->data_size, req->attributes, req->user);
+		async_request_free(req);
+
+		pthread_mutex_lock(&ctx->lock);
+		if (rc != 0) {
+			/* keep the fd readable for what's left */
+			if (ctx->ndone)
+				async_signal(ctx);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return calls;
+}
+
+void PUBLIC
+efi_async_free(efi_async_ctx_t *ctx)
+{
+	list_t *pos, *tmp;
+
+	if (!ctx)
+		return;
+
+#ifdef __linux__
+	async_stop(ctx);
+#endif
+
+	list_for_each_safe(pos, tmp, &ctx->pending)
+		async_request_free(list_entry(pos, struct async_request, list));
+	list_for_each_safe(pos, tmp, &ctx->done)
+		async_request_free(list_entry(pos, struct async_request, list));
+
+	if (ctx->fd >= 0)
+		close(ctx->fd);
+	free(ctx->workers);
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * cache.c - opt-in in-process cache of variable reads
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "efivar.h"
+#include "stats.h"
+
+/*
+ * Programs that poll BootOrder, BootCurrent, and the Boot#### entries can
+ * ask us to keep what they've read in memory.  Entries are dropped when
+ * inotify says the backing file changed, and efi_set_variable() and
+ * efi_del_variable() update the cache as they go.
+ *
+ * Nothing here can see the firmware changing a variable behind the
+ * kernel's back, and a write by another process that lands in the instant
+ * between one of our own writes and the cache update after it can be
+ * missed, so this is only for callers that can live with that.
+ *
+ * Entries are kept in an efi_guid_map_t keyed by guid and name, so a
+ * program that reads every variable there is doesn't make each lookup
+ * walk all the others.
+ */
+struct cache_entry {
+	uint8_t *data;
+	size_t data_size;
+	uint32_t attributes;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static efi_guid_map_t *cache_entries;
+static int cache_fd = -1;
+static uint64_t cache_hits;
+static uint64_t cache_misses;
+
+static struct cache_entry *
+cache_find(const efi_guid_t *guid, const char *name)
+{
+	void *entry;
+
+	if (!cache_entries ||
+	    efi_guid_map_get(cache_entries, guid, name, &entry) < 0)
+		return NULL;
+	return entry;
+}
+
+static void
+cache_entry_free(struct cache_entry *entry)
+{
+	free(entry->data);
+	free(entry);
+}
+
+static void
+cache_flush(void)
+{
+	void *entry;
+	size_t pos = 0;
+
+	if (!cache_entries)
+		return;
+
+	while (efi_guid_map_next(cache_entries, &pos, NULL, NULL, &entry))
+		cache_entry_free(entry);
+	efi_guid_map_free(cache_entries);
+	cache_entries = NULL;
+}
+
+static void
+cache_drop(const efi_guid_t *guid, const char *name)
+{
+	void *entry;
+
+	if (cache_entries &&
+	    efi_guid_map_del(cache_entries, guid, name, &entry) >= 0)
+		cache_entry_free(entry);
+}
+
+#ifdef __linux__
+/*
+ * Throw away everything inotify has told us about since the last time we
+ * looked.  Anything we can't pin to one variable flushes the lot.
+ */
+static void
+cache_drain_events(void)
+{
+	uint8_t buf[4096]
+		__attribute__((__aligned__(__alignof__(struct inotify_event))));
+	__typeof__(errno) errno_value = errno;
+
+	while (1) {
+		ssize_t len = read(cache_fd, buf, sizeof(buf));
+		size_t pos = 0;
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+
+		while (pos + sizeof(struct inotify_event) <= (size_t)len) {
+			struct inotify_event *ev = (void *)(buf + pos);
+			efi_guid_t guid;
+			ssize_t namelen;
+
+			pos += sizeof(*ev) + ev->len;
+			if (ev->len == 0 || (ev->mask & IN_Q_OVERFLOW)) {
+				cache_flush();
+				continue;
+			}
+
+			namelen = generic_parse_variable_entry(ev->name, &guid);
+			if (namelen <= 0)
+				continue;
+			ev->name[namelen] = '\0';
+			cache_drop(&guid, ev->name);
+		}
+	}
+	errno = errno_value;
+}
+#endif
+
+static void
+cache_store(const efi_guid_t *guid, const char *name, const uint8_t *data,
+	    size_t data_size, uint32_t attributes)
+{
+	struct cache_entry *entry, *old;
+	__typeof__(errno) errno_value = errno;
+
+	if (!cache_entries) {
+		cache_entries = efi_guid_map_new();
+		if (!cache_entries)
+			goto out;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		goto err;
+	entry->data = malloc(data_size ? data_size : 1);
+	if (!entry->data) {
+		free(entry);
+		goto err;
+	}
+	memcpy(entry->data, data, data_size);
+	entry->data_size = data_size;
+	entry->attributes = attributes;
+
+	/* replacing the value in place keeps the old key's storage */
+	old = cache_find(guid, name);
+	if (efi_guid_map_set(cache_entries, guid, name, entry) < 0) {
+		cache_entry_free(entry);
+		goto err;
+	}
+	if (old)
+		cache_entry_free(old);
+	goto out;
+err:
+	cache_drop(guid, name);
+out:
+	errno = errno_value;
+}
+
+/*
+ * Look a variable up in the cache.  Returns 1 and fills in whichever of
+ * data (as a new allocation the caller frees), data_size, and attributes
+ * are non-NULL if we have it, and 0 if we don't or the cache is off.
+ */
+int HIDDEN
+efi_cache_get(const efi_guid_t *guid, const char *name, uint8_t **data,
+	      size_t *data_size, uint32_t *attributes)
+{
+	struct cache_entry *entry;
+	int ret = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	if (cache_fd < 0)
+		goto out;
+
+#ifdef __linux__
+	cache_drain_events();
+#endif
+	entry = cache_find(guid, name);
+	if (!entry) {
+		cache_misses++;
+		stats_inc(variable_cache_misses);
+		goto out;
+	}
+
+	if (data) {
+		__typeof__(errno) errno_value = errno;
+
+		*data = malloc(entry->data_size ? entry->data_size : 1);
+		errno = errno_value;
+		if (!*data)
+			goto out;
+		memcpy(*data, entry->data, entry->data_size);
+	}
+	if (data_size)
+		*data_size = entry->data_size;
+	if (attributes)
+		*attributes = entry->attributes;
+	cache_hits++;
+	stats_inc(variable_cache_hits);
+	ret = 1;
+out:
+	pthread_mutex_unlock(&cache_lock);
+	return ret;
+}
+
+/*
+ * Remember something we just read from the backend.  This doesn't look
+ * at pending events: if the variable changed after we read it, the event
+ * for that is still queued and will drop this entry on the next lookup.
+ */
+void HIDDEN
+efi_cache_put(const efi_guid_t *guid, const char *name, const uint8_t *data,
+	      size_t data_size, uint32_t attributes)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (cache_fd >= 0)
+		cache_store(guid, name, data, data_size, attributes);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Write-through for a successful efi_set_variable().  Our own write has
+ * queued events for this variable; eat them first so they don't throw
+ * away what we're about to store.  Appends are just forgotten, since we'd
+ * have to guess what the firmware made of them.
+ */
+void HIDDEN
+efi_cache_set(const efi_guid_t *guid, const char *name, const uint8_t *data,
+	      size_t data_size, uint32_t attributes)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (cache_fd < 0)
+		goto out;
+
+#ifdef __linux__
+	cache_drain_events();
+#endif
+	if (attributes & EFI_VARIABLE_APPEND_WRITE)
+		cache_drop(guid, name);
+	else
+		cache_store(guid, name, data, data_size, attributes);
+out:
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void HIDDEN
+efi_cache_forget(const efi_guid_t *guid, const char *name)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (cache_fd >= 0)
+		cache_drop(guid, name);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Start caching, using watch_variables() to point an inotify instance at
+ * wherever the backend keeps its variables.
+ */
+int HIDDEN
+efi_cache_enable(int (*watch_variables)(int inotify_fd))
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	if (cache_fd >= 0)
+		goto out;
+
+#ifdef __linux__
+	cache_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (cache_fd < 0) {
+		efi_error("inotify_init1() failed");
+		ret = -1;
+		goto out;
+	}
+
+	if (watch_variables(cache_fd) < 0) {
+		__typeof__(errno) errno_value = errno;
+		efi_error("watch_variables() failed");
+		close(cache_fd);
+		cache_fd = -1;
+		errno = errno_value;
+		ret = -1;
+		goto out;
+	}
+	cache_hits = cache_misses = 0;
+#else
+	(void)watch_variables;
+	efi_error("variable caching is not implemented");
+	errno = ENOSYS;
+	ret = -1;
+#endif
+out:
+	pthread_mutex_unlock(&cache_lock);
+	return ret;
+}
+
+void PUBLIC
+efi_variable_cache_disable(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (cache_fd >= 0) {
+		cache_flush();
+		close(cache_fd);
+		cache_fd = -1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+int NONNULL(1, 2) PUBLIC
+efi_variable_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache_lock);
+	*hits = cache_hits;
+	*misses = cache_misses;
+	ret = cache_fd >= 0;
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+static void DESTRUCTOR
+cache_fini(void)
+{
+	efi_variable_cache_disable();
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -49,8 +49,12 @@
 /*  --------------------------------------------------------------------  */
 
 #include <stdint.h>
+#include <string.h>
 
-static uint32_t crc32_tab[] = {
+#include "efivar.h"
+#include "stats.h"
+
+static const uint32_t crc32_tab[] = {
 	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
 	0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
 	0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
@@ -105,20 +109,184 @@ static uint32_t crc32_tab[] = {
 	0x2d02ef8dL
 };
 
+/*
+ * Slice-by-8: crc32_slices[k][n] is the CRC of byte n followed by k zero
+ * bytes, so eight bytes can be folded in with eight independent lookups
+ * instead of eight dependent ones.  crc32_slices[0] is crc32_tab.  The
+ * tables are computed once when the library is loaded.
+ */
+static uint32_t crc32_slices[8][256];
+
+typedef uint32_t (*crc32_fn_t)(const unsigned char *s, unsigned long len,
+			       uint32_t val);
+
+static uint32_t
+crc32_bytes(const unsigned char *s, unsigned long len, uint32_t val)
+{
+	for (unsigned long i = 0; i < len; i++)
+		val = crc32_tab[(val ^ s[i]) & 0xff] ^ (val >> 8);
+	return val;
+}
+
+static inline uint32_t
+load_le32(const unsigned char *s)
+{
+	uint32_t val;
+
+	memcpy(&val, s, sizeof(val));
+	return le32_to_cpu(val);
+}
+
+static uint32_t
+crc32_slice8(const unsigned char *s, unsigned long len, uint32_t val)
+{
+	const uint32_t (*t)[256] = (const uint32_t (*)[256])crc32_slices;
+
+	while (len >= 8) {
+		uint32_t one = load_le32(s) ^ val;
+		uint32_t two = load_le32(s + 4);
+
+		val = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+		      t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+		      t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^
+		      t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		s += 8;
+		len -= 8;
+	}
+
+	return crc32_bytes(s, len, val);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+/*
+ * Carry-less multiply folding, as in Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction".  The constants are
+ * x^n mod P(x) for the (bit-reflected) polynomial 0xedb88320: k1/k2 fold
+ * 512 bits forward, k3/k4 fold 128 bits, and k5 and the Barrett pair
+ * reduce the last 64 bits down to 32.  len must be at least 64 and a
+ * multiple of 16.
+ */
+static uint32_t __attribute__((__target__("pclmul,sse4.1")))
+crc32_pclmul_blocks(const unsigned char *s, unsigned long len, uint32_t val)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, t1, t2, t3, t4;
+
+	x1 = _mm_loadu_si128((const __m128i *)(s + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(s + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(s + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(s + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)val));
+	s += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+			_mm_loadu_si128((const __m128i *)(s + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, t2),
+			_mm_loadu_si128((const __m128i *)(s + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, t3),
+			_mm_loadu_si128((const __m128i *)(s + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, t4),
+			_mm_loadu_si128((const __m128i *)(s + 0x30)));
+		s += 64;
+		len -= 64;
+	}
+
+	/* fold the four lanes into one */
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x2);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x3);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x4);
+
+	while (len >= 16) {
+		t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+			_mm_loadu_si128((const __m128i *)s));
+		s += 16;
+		len -= 16;
+	}
+
+	/* 128 bits down to 64 */
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t1);
+	t1 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, t1);
+
+	/* and Barrett reduction down to 32 */
+	t1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+	t1 = _mm_clmulepi64_si128(_mm_and_si128(t1, mask32), poly, 0x00);
+	x1 = _mm_xor_si128(x1, t1);
+
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t
+crc32_pclmul(const unsigned char *s, unsigned long len, uint32_t val)
+{
+	if (len >= 64) {
+		unsigned long blocks = len & ~15ul;
+
+		val = crc32_pclmul_blocks(s, blocks, val);
+		s += blocks;
+		len -= blocks;
+	}
+	return crc32_slice8(s, len, val);
+}
+#endif
+
+static crc32_fn_t crc32_impl = crc32_bytes;
+
+static void CONSTRUCTOR
+crc32_init(void)
+{
+	memcpy(crc32_slices[0], crc32_tab, sizeof(crc32_slices[0]));
+	for (unsigned int n = 0; n < 256; n++) {
+		uint32_t val = crc32_tab[n];
+
+		for (unsigned int k = 1; k < 8; k++) {
+			val = crc32_tab[val & 0xff] ^ (val >> 8);
+			crc32_slices[k][n] = val;
+		}
+	}
+	crc32_impl = crc32_slice8;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1"))
+		crc32_impl = crc32_pclmul;
+#endif
+}
+
 /* Return a 32-bit CRC of the contents of the buffer. */
 
 uint32_t
 crc32(const void *buf, unsigned long len, uint32_t seed)
 {
-	unsigned long i;
-	register uint32_t val;
-	const unsigned char *s = buf;
-
-	val = seed;
-	for (i = 0;  i < len;  i ++)
-		val = crc32_tab[(val ^ s[i]) & 0xff] ^ (val >> 8);
-
-	return val;
+	stats_add(crc32_bytes, len);
+	return crc32_impl(buf, len, seed);
 }
 
 // vim:fenc=utf-8:tw=75:noet
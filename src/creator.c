@@ -6,12 +6,15 @@
 
 #include "fix_coverity.h"
 
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -26,45 +29,92 @@
 #include "efiboot.h"
 #include "mntent_compat.h"
 
-static int NONNULL(1, 2, 3)
-find_file(const char * const filepath, char **devicep, char **relpathp)
-{
-	struct stat fsb = { 0, };
-	int rc;
-	int ret = -1;
-	FILE *mounts = NULL;
-	char linkbuf[PATH_MAX+1] = "";
-	ssize_t linklen = 0;
+/*
+ * Finding the mount a file is on means stat()ing the device of every
+ * mount in the table, and with a few hundred container mounts that adds
+ * up, so the block device mounts are kept for the life of the process,
+ * sorted by device.  On Linux /proc/self/mounts says POLLPRI whenever the
+ * table changes, so one is held open to check that before each lookup;
+ * elsewhere there's no such signal, so the table is read every time.
+ */
+struct mount_entry {
+	dev_t rdev;
+	size_t order;
+	char *devpath;
+	char *dir;
+	size_t dirlen;
+};
+
+static pthread_mutex_t mount_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mount_entry *mount_table;
+static size_t mount_table_n;
+static bool mount_table_valid;
+#ifdef __linux__
+static int mount_table_fd = -1;
+#endif
 
-	linklen = strlen(filepath);
-	if (linklen > PATH_MAX) {
-		errno = ENAMETOOLONG;
-		efi_error("filepath length exceeds PATH_MAX");
-		return -1;
+static void
+mount_table_free(void)
+{
+	for (size_t i = 0; i < mount_table_n; i++) {
+		free(mount_table[i].devpath);
+		free(mount_table[i].dir);
 	}
-	strcpy(linkbuf, filepath);
+	free(mount_table);
+	mount_table = NULL;
+	mount_table_n = 0;
+	mount_table_valid = false;
+}
 
-	do {
-		rc = stat(linkbuf, &fsb);
-		if (rc < 0)
-			return rc;
+static int
+mount_entry_cmp(const void *a, const void *b)
+{
+	const struct mount_entry *ma = a, *mb = b;
 
-		if (S_ISLNK(fsb.st_mode)) {
-			char tmp[PATH_MAX+1] = "";
-			ssize_t l;
+	if (ma->rdev != mb->rdev)
+		return ma->rdev < mb->rdev ? -1 : 1;
+	return ma->order < mb->order ? -1 : ma->order > mb->order;
+}
 
-			l = readlink(linkbuf, tmp, PATH_MAX);
-			if (l < 0) {
-				efi_error("readlink failed");
-				return -1;
-			}
-			tmp[l] = '\0';
-			linklen = l;
-			strcpy(linkbuf, tmp);
-		} else {
-			break;
-		}
-	} while (1);
+static int
+mount_table_add(struct mount_entry **table, size_t *n, size_t *size,
+		dev_t rdev, const char *devpath, const char *dir)
+{
+	struct mount_entry *me;
+
+	if (*n == *size) {
+		size_t new_size = *size ? *size * 2 : 64;
+
+		me = reallocarray(*table, new_size, sizeof(**table));
+		if (!me)
+			return -1;
+		*table = me;
+		*size = new_size;
+	}
+
+	me = &(*table)[*n];
+	me->rdev = rdev;
+	me->order = *n;
+	me->devpath = strdup(devpath);
+	me->dir = strdup(dir);
+	if (!me->devpath || !me->dir) {
+		free(me->devpath);
+		free(me->dir);
+		return -1;
+	}
+	me->dirlen = strlen(dir);
+	(*n)++;
+	return 0;
+}
+
+static int
+mount_table_read(void)
+{
+	struct mount_entry *table = NULL;
+	size_t n = 0, size = 0;
+	FILE *mounts;
+	struct mntent *me;
+	int ret = -1;
 
 	mounts = setmntent("/proc/self/mounts", "r");
 	if (mounts == NULL) {
@@ -72,30 +122,28 @@ find_file(const char * const filepath, char **devicep, char **relpathp)
 		return -1;
 	}
 
-	struct mntent *me;
 	while (1) {
 		char *devpath;
 		struct stat dsb = { 0, };
+		int rc;
 
 		errno = 0;
 		me = getmntent(mounts);
 		if (!me) {
 #ifdef __linux__
-			if (feof(mounts)) {
-#else
-			{
-#endif
-				errno = ENOENT;
-				efi_error("could not find mountpoint");
+			if (!feof(mounts)) {
+				efi_error("could not read /proc/self/mounts");
+				goto err;
 			}
-			goto err;
+#endif
+			break;
 		}
 
 		devpath = me->mnt_fsname;
 		if (devpath[0] != '/') {
 			if (asprintfa(&devpath, "/dev/%s", me->mnt_fsname) < 0) {
 				efi_error("could not allocate buffer");
-				return -1;
+				goto err;
 			}
 		}
 
@@ -112,49 +160,177 @@ find_file(const char * const filepath, char **devicep, char **relpathp)
 			continue;
 #endif
 
-		if (dsb.st_rdev == fsb.st_dev) {
-			ssize_t mntlen = strlen(me->mnt_dir);
-			if (mntlen >= linklen)
-				continue;
-			if (strncmp(linkbuf, me->mnt_dir, mntlen))
-				continue;
+		if (mount_table_add(&table, &n, &size, dsb.st_rdev, devpath,
+				    me->mnt_dir) < 0) {
+			errno = ENOMEM;
+			efi_error("could not allocate memory");
+			goto err;
+		}
+	}
 
-#ifdef __NetBSD__
-			/*
-			 * Use "raw" versions of devices because they shouldn't be kept
-			 * busy by drivers.
-			 */
-			if (strncmp(devpath, "/dev/dk", 7) == 0) {
-				if (asprintf(devicep, "/dev/r%s", devpath + 5) < 0)
-					*devicep = NULL;
-			} else {
-				*devicep = strdup(devpath);
-			}
+	qsort(table, n, sizeof(*table), mount_entry_cmp);
+	mount_table_free();
+	mount_table = table;
+	mount_table_n = n;
+	mount_table_valid = true;
+	table = NULL;
+	n = 0;
+	ret = 0;
+err:
+	for (size_t i = 0; i < n; i++) {
+		free(table[i].devpath);
+		free(table[i].dir);
+	}
+	free(table);
+	(void)endmntent(mounts);
+	return ret;
+}
+
+/*
+ * Make sure the cached table is current.  Call with mount_table_lock
+ * held.
+ */
+static int
+mount_table_refresh(void)
+{
+#ifdef __linux__
+	struct pollfd pfd = { .events = POLLPRI, };
+
+	if (mount_table_fd < 0) {
+		mount_table_fd = open("/proc/self/mounts", O_RDONLY|O_CLOEXEC);
+		mount_table_valid = false;
+	}
+	if (mount_table_fd >= 0) {
+		pfd.fd = mount_table_fd;
+		if (poll(&pfd, 1, 0) != 0)
+			mount_table_valid = false;
+	} else {
+		mount_table_valid = false;
+	}
 #else
-			*devicep = strdup(devpath);
+	mount_table_valid = false;
 #endif
+	if (mount_table_valid)
+		return 0;
+	return mount_table_read();
+}
 
-			if (!*devicep) {
-				errno = ENOMEM;
-				efi_error("strdup failed");
-				goto err;
-			}
-			*relpathp = strdup(linkbuf + mntlen);
-			if (!*relpathp) {
-				free(*devicep);
-				*devicep = NULL;
-				errno = ENOMEM;
-				efi_error("strdup failed");
-				goto err;
+/* The first mount of dev, in mount table order */
+static struct mount_entry *
+mount_table_find(dev_t dev)
+{
+	size_t lo = 0, hi = mount_table_n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (mount_table[mid].rdev < dev)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < mount_table_n ? &mount_table[lo] : NULL;
+}
+
+static void DESTRUCTOR
+mount_table_fini(void)
+{
+	mount_table_free();
+#ifdef __linux__
+	if (mount_table_fd >= 0)
+		close(mount_table_fd);
+	mount_table_fd = -1;
+#endif
+}
+
+static int NONNULL(1, 2, 3)
+find_file(const char * const filepath, char **devicep, char **relpathp)
+{
+	struct stat fsb = { 0, };
+	int rc;
+	int ret = -1;
+	char linkbuf[PATH_MAX+1] = "";
+	ssize_t linklen = 0;
+	struct mount_entry *me;
+
+	linklen = strlen(filepath);
+	if (linklen > PATH_MAX) {
+		errno = ENAMETOOLONG;
+		efi_error("filepath length exceeds PATH_MAX");
+		return -1;
+	}
+	strcpy(linkbuf, filepath);
+
+	do {
+		rc = stat(linkbuf, &fsb);
+		if (rc < 0)
+			return rc;
+
+		if (S_ISLNK(fsb.st_mode)) {
+			char tmp[PATH_MAX+1] = "";
+			ssize_t l;
+
+			l = readlink(linkbuf, tmp, PATH_MAX);
+			if (l < 0) {
+				efi_error("readlink failed");
+				return -1;
 			}
-			ret = 0;
+			tmp[l] = '\0';
+			linklen = l;
+			strcpy(linkbuf, tmp);
+		} else {
 			break;
 		}
+	} while (1);
+
+	pthread_mutex_lock(&mount_table_lock);
+	if (mount_table_refresh() < 0)
+		goto out;
+
+	me = mount_table_find(fsb.st_dev);
+	for (; me && me < mount_table + mount_table_n &&
+	       me->rdev == fsb.st_dev; me++) {
+		if ((ssize_t)me->dirlen >= linklen)
+			continue;
+		if (strncmp(linkbuf, me->dir, me->dirlen))
+			continue;
+
+#ifdef __NetBSD__
+		/*
+		 * Use "raw" versions of devices because they shouldn't be kept
+		 * busy by drivers.
+		 */
+		if (strncmp(me->devpath, "/dev/dk", 7) == 0) {
+			if (asprintf(devicep, "/dev/r%s", me->devpath + 5) < 0)
+				*devicep = NULL;
+		} else {
+			*devicep = strdup(me->devpath);
+		}
+#else
+		*devicep = strdup(me->devpath);
+#endif
+
+		if (!*devicep) {
+			errno = ENOMEM;
+			efi_error("strdup failed");
+			goto out;
+		}
+		*relpathp = strdup(linkbuf + me->dirlen);
+		if (!*relpathp) {
+			free(*devicep);
+			*devicep = NULL;
+			errno = ENOMEM;
+			efi_error("strdup failed");
+			goto out;
+		}
+		ret = 0;
+		goto out;
 	}
-err:
-	if (mounts) {
-		(void)endmntent(mounts);
-	}
+
+	errno = ENOENT;
+	efi_error("could not find mountpoint");
+out:
+	pthread_mutex_unlock(&mount_table_lock);
 	return ret;
 }
 
@@ -187,34 +363,70 @@ tilt_slashes(char *s)
 	return s;
 }
 
-ssize_t
-efi_va_generate_file_device_path_from_esp(uint8_t *buf, ssize_t size,
-				       const char *devpath, int partition,
-				       const char *relpath,
-				       uint32_t options, va_list ap)
+/*
+ * Everything in a file's device path up to the File() node: the path to
+ * the disk, and the HD() node for the partition, if any.
+ */
+static ssize_t
+generate_disk_device_path(uint8_t *buf, ssize_t size, const char *devpath,
+			  int partition, uint32_t options, va_list ap)
 {
 	ssize_t ret = -1, off = 0, sz;
 	struct device *dev = NULL;
+	efidp_builder_t *builder = NULL;
+	efidp dp = NULL;
+	uint8_t *node;
 	int fd = -1;
 	int saved_errno;
+	bool cacheable;
+	dev_t cache_dev = 0;
+	char cache_name[32];
 
 	debug("partition:%d", partition);
 
-	if (buf && size)
-		memset(buf, '\0', size);
-
 	fd = open(devpath, O_RDONLY);
 	if (fd < 0) {
 		efi_error("could not open device for ESP");
 		goto err;
 	}
 
+	/*
+	 * EDD 1.0 paths depend on an argument we don't key on, and writing
+	 * a signature is a side effect we can't skip.
+	 */
+	cacheable = devcache_enabled() &&
+		    !(options & (EFIBOOT_ABBREV_EDD10|
+				 EFIBOOT_OPTIONS_WRITE_SIGNATURE)) &&
+		    devcache_fd_dev(fd, &cache_dev) == 0;
+	if (cacheable) {
+		uint8_t *cached = NULL;
+		size_t cachedsz = 0;
+
+		snprintf(cache_name, sizeof(cache_name), "dp-%d-%08"PRIx32,
+			 partition, options);
+		if (devcache_get(cache_dev, cache_name, &cached, &cachedsz)) {
+			if (!buf || !size || (size_t)size >= cachedsz) {
+				if (buf && size)
+					memcpy(buf, cached, cachedsz);
+				free(cached);
+				ret = cachedsz;
+				goto err;
+			}
+			free(cached);
+		}
+	}
+
 	dev = device_get(devpath, fd, partition);
 	if (dev == NULL) {
 		efi_error("could not get ESP disk info");
 		goto err;
 	}
 
+	if (efidp_builder_new(&builder) < 0) {
+		efi_error("could not allocate device path builder");
+		goto err;
+	}
+
 	if (partition < 0) {
 		int disk_fd;
 
@@ -274,12 +486,15 @@ efi_va_generate_file_device_path_from_esp(uint8_t *buf, ssize_t size,
 	if ((options & EFIBOOT_ABBREV_EDD10)
 			&& (!(options & EFIBOOT_ABBREV_FILE)
 			    && !(options & EFIBOOT_ABBREV_HD))) {
-		sz = efidp_make_edd10(buf, size, dev->edd10_devicenum);
-		if (sz < 0) {
+		node = efidp_builder_reserve(builder, sizeof(efidp_edd10));
+		if (!node)
+			goto err;
+		sz = efidp_make_edd10(node, sizeof(efidp_edd10),
+				      dev->edd10_devicenum);
+		if (sz < 0 || efidp_builder_advance(builder, sz) < 0) {
 			efi_error("could not make EDD 1.0 device path");
 			goto err;
 		}
-		off = sz;
 	} else if (!(options & EFIBOOT_ABBREV_FILE)
 		   && !(options & EFIBOOT_ABBREV_HD)) {
 
@@ -288,12 +503,11 @@ efi_va_generate_file_device_path_from_esp(uint8_t *buf, ssize_t size,
 		 * symlink from /sys/dev/block/$major:$minor and get it
 		 * from there.
 		 */
-		sz = make_blockdev_path(buf, size, dev);
+		sz = make_blockdev_path(builder, dev);
 		if (sz < 0) {
 			efi_error("could not create device path");
 			goto err;
 		}
-		off += sz;
 	}
 
 	if ((!(options & EFIBOOT_ABBREV_FILE) && dev->part_name) ||
@@ -309,36 +523,45 @@ efi_va_generate_file_device_path_from_esp(uint8_t *buf, ssize_t size,
 			goto err;
 		}
 
-		sz = make_hd_dn(buf+off, size?size-off:0,
-				disk_fd, dev->part, options);
+		node = efidp_builder_reserve(builder, sizeof(efidp_hd));
+		if (!node) {
+			close(disk_fd);
+			goto err;
+		}
+		sz = make_hd_dn(node, sizeof(efidp_hd), disk_fd, dev->part,
+				options);
 		saved_errno = errno;
 		close(disk_fd);
 		errno = saved_errno;
-		if (sz < 0) {
+		if (sz < 0 || efidp_builder_advance(builder, sz) < 0) {
 			efi_error("could not make HD() DP node");
 			goto err;
 		}
-		off += sz;
 	}
 
-	char *filepath = strdupa(relpath);
-	tilt_slashes(filepath);
-	sz = efidp_make_file(buf+off, size?size-off:0, filepath);
-	if (sz < 0) {
-		efi_error("could not make File() DP node");
+	/*
+	 * The whole path gets made even when the caller only asked how big
+	 * it is, so it can go in the cache for when they come back for it.
+	 */
+	off = efidp_builder_size(builder);
+	if (efidp_builder_finish(builder, &dp) < 0)
 		goto err;
+	if (buf && size) {
+		if (size < off) {
+			errno = ENOSPC;
+			efi_error("device path is bigger than the buffer");
+			goto err;
+		}
+		memcpy(buf, dp, off);
 	}
-	off += sz;
 
-	sz = efidp_make_end_entire(buf+off, size?size-off:0);
-	if (sz < 0) {
-		efi_error("could not make EndEntire DP node");
-		goto err;
-	}
-	off += sz;
+	if (cacheable)
+		devcache_put(cache_dev, cache_name, (uint8_t *)dp, off);
 	ret = off;
 err:
 	saved_errno = errno;
+	free(dp);
+	efidp_builder_free(builder);
 	if (dev)
 		device_free(dev);
 	if (fd >= 0)
@@ -348,6 +571,53 @@ err:
 	return ret;
 }
 
+/*
+ * Add the File() and EndEntire nodes after the off bytes of disk path
+ * already in buf.
+ */
+static ssize_t
+append_file_device_path(uint8_t *buf, ssize_t size, ssize_t off,
+			const char *relpath)
+{
+	ssize_t sz;
+
+	char *filepath = strdupa(relpath);
+	tilt_slashes(filepath);
+	sz = efidp_make_file(buf+off, size?size-off:0, filepath);
+	if (sz < 0) {
+		efi_error("could not make File() DP node");
+		return -1;
+	}
+	off += sz;
+
+	sz = efidp_make_end_entire(buf+off, size?size-off:0);
+	if (sz < 0) {
+		efi_error("could not make EndEntire DP node");
+		return -1;
+	}
+	off += sz;
+	return off;
+}
+
+ssize_t
+efi_va_generate_file_device_path_from_esp(uint8_t *buf, ssize_t size,
+				       const char *devpath, int partition,
+				       const char *relpath,
+				       uint32_t options, va_list ap)
+{
+	ssize_t off;
+
+	if (buf && size)
+		memset(buf, '\0', size);
+
+	off = generate_disk_device_path(buf, size, devpath, partition,
+					options, ap);
+	if (off < 0)
+		return off;
+
+	return append_file_device_path(buf, size, off, relpath);
+}
+
 ssize_t NONNULL(3, 5) PUBLIC
 efi_generate_file_device_path_from_esp(uint8_t *buf, ssize_t size,
 				       const char *devpath, int partition,
@@ -377,6 +647,8 @@ get_part(char *devpath)
 	int fd;
 	int partition = -1;
 	struct device *dev = NULL;
+	dev_t cache_dev = 0;
+	bool cacheable;
 
 	fd = open(devpath, O_RDONLY);
 	if (fd < 0) {
@@ -384,6 +656,21 @@ get_part(char *devpath)
 		goto err;
 	}
 
+	cacheable = devcache_enabled() &&
+		    devcache_fd_dev(fd, &cache_dev) == 0;
+	if (cacheable) {
+		uint8_t *cached = NULL;
+		size_t cachedsz = 0;
+
+		if (devcache_get(cache_dev, "part", &cached, &cachedsz)) {
+			if (cachedsz == sizeof(partition))
+				memcpy(&partition, cached, sizeof(partition));
+			free(cached);
+			if (partition >= 0)
+				goto err;
+		}
+	}
+
 	dev = device_get(devpath, fd, -1);
 	if (dev == NULL) {
 		efi_error("could not get ESP disk info");
@@ -393,6 +680,9 @@ get_part(char *devpath)
 	partition = dev->part;
 	if (partition < 0)
 		partition = 0;
+	if (cacheable)
+		devcache_put(cache_dev, "part", (uint8_t *)&partition,
+			     sizeof(partition));
 err:
 	if (dev)
 		device_free(dev);
@@ -627,32 +917,446 @@ err:
 	return ret;
 }
 
-static ssize_t NONNULL(3, 4, 5, 6)
+/*
+ * One of these for each filesystem device seen by
+ * efi_generate_file_device_paths(), so that every file on it shares one
+ * device lookup, probe, and partition table read.
+ */
+struct disk_device_path {
+	char *child_devpath;
+	uint8_t *prefix;
+	ssize_t prefix_size;
+	int error;
+};
+
+/*
+ * Fill in disk's prefix: everything up to the File() node for files on
+ * partition of devpath.
+ */
+static int
+make_disk_prefix(struct disk_device_path *disk, const char *devpath,
+		 int partition, uint32_t options, va_list ap)
+{
+	ssize_t rc;
+
+	disk->prefix_size = generate_disk_device_path(NULL, 0, devpath,
+						      partition, options,
+						      ap);
+	if (disk->prefix_size < 0)
+		goto err;
+
+	disk->prefix = calloc(1, disk->prefix_size ? disk->prefix_size : 1);
+	if (!disk->prefix) {
+		efi_error("could not allocate memory");
+		goto err;
+	}
+
+	rc = generate_disk_device_path(disk->prefix, disk->prefix_size,
+				       devpath, partition, options, ap);
+	if (rc < 0)
+		goto err;
+	return 0;
+err:
+	disk->error = errno ? errno : EINVAL;
+	return -1;
+}
+
+static int
+make_disk_device_path(struct disk_device_path *disk, uint32_t options,
+		      va_list ap)
+{
+	char *parent_devpath = NULL;
+	const char *devpath;
+	int partition;
+	int rc;
+
+	rc = find_parent_devpath(disk->child_devpath, &parent_devpath);
+	if (rc < 0) {
+		efi_error("could not find parent device for file");
+		goto err;
+	}
+
+	partition = get_part(disk->child_devpath);
+	if (partition < 0) {
+		efi_error("Couldn't get partition number for %s",
+			  disk->child_devpath);
+		rc = -1;
+		goto err;
+	}
+
+	if (!strcmp(parent_devpath, "/dev/block"))
+		devpath = disk->child_devpath;
+	else
+		devpath = parent_devpath;
+
+	rc = make_disk_prefix(disk, devpath, partition, options, ap);
+err:
+	if (rc < 0)
+		disk->error = errno ? errno : EINVAL;
+	free(parent_devpath);
+	return rc;
+}
+
+/*
+ * Allocate the whole device path for relpath on disk into *dpp, and
+ * return its size.
+ */
+static ssize_t
+make_disk_file_device_path(struct disk_device_path *disk,
+			   const char *relpath, uint8_t **dpp)
+{
+	uint8_t *dp;
+	ssize_t sz;
+
+	*dpp = NULL;
+	if (disk->error) {
+		errno = disk->error;
+		return -1;
+	}
+
+	sz = append_file_device_path(NULL, 0, disk->prefix_size, relpath);
+	if (sz < 0)
+		return -1;
+
+	dp = calloc(1, sz);
+	if (!dp) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	memcpy(dp, disk->prefix, disk->prefix_size);
+	sz = append_file_device_path(dp, sz, disk->prefix_size, relpath);
+	if (sz < 0) {
+		free(dp);
+		return -1;
+	}
+	*dpp = dp;
+	return sz;
+}
+
+int NONNULL(1, 3, 4) HIDDEN
+va_generate_file_device_paths(const char * const *filepaths, size_t n,
+			      uint8_t **dps, ssize_t *dp_sizes,
+			      uint32_t options, va_list ap)
+{
+	struct disk_device_path *disks;
+	size_t ndisks = 0;
+	int first_error = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		dps[i] = NULL;
+		dp_sizes[i] = -1;
+	}
+
+	disks = calloc(n ? n : 1, sizeof(*disks));
+	if (!disks) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	sysfs_cache_hold();
+
+	for (size_t i = 0; i < n; i++) {
+		struct disk_device_path *disk = NULL;
+		char *child_devpath = NULL;
+		char *relpath = NULL;
+		ssize_t sz;
+		int rc;
+
+		rc = find_file(filepaths[i], &child_devpath, &relpath);
+		if (rc < 0) {
+			efi_error("could not canonicalize fs path \"%s\"",
+				  filepaths[i]);
+			goto next;
+		}
+
+		for (size_t j = 0; j < ndisks; j++) {
+			if (!strcmp(disks[j].child_devpath, child_devpath)) {
+				disk = &disks[j];
+				break;
+			}
+		}
+		if (!disk) {
+			disk = &disks[ndisks++];
+			disk->child_devpath = child_devpath;
+			child_devpath = NULL;
+			make_disk_device_path(disk, options, ap);
+		}
+		sz = make_disk_file_device_path(disk, relpath, &dps[i]);
+		if (sz < 0) {
+			efi_error("could not generate File DP for \"%s\"",
+				  filepaths[i]);
+			goto next;
+		}
+		dp_sizes[i] = sz;
+next:
+		if (dp_sizes[i] < 0 && !first_error)
+			first_error = errno ? errno : EINVAL;
+		free(child_devpath);
+		free(relpath);
+	}
+
+	sysfs_cache_release();
+
+	for (size_t j = 0; j < ndisks; j++) {
+		free(disks[j].child_devpath);
+		free(disks[j].prefix);
+	}
+	free(disks);
+
+	if (first_error) {
+		errno = first_error;
+		return -1;
+	}
+	return 0;
+}
+
+int NONNULL(1, 3, 4) PUBLIC
+efi_generate_file_device_paths(const char * const *filepaths, size_t n,
+			       uint8_t **dps, ssize_t *dp_sizes,
+			       uint32_t options, ...)
+{
+	va_list ap;
+	int rc;
+
+	va_start(ap, options);
+	rc = va_generate_file_device_paths(filepaths, n, dps, dp_sizes,
+					   options, ap);
+	va_end(ap);
+	return rc;
+}
+
+int NONNULL(1, 2, 3, 4) PUBLIC
+efi_generate_md_file_device_paths(const char * const filepath,
+				  uint8_t ***dpsp, ssize_t **dp_sizesp,
+				  size_t *np, uint32_t options, ...)
+{
+	struct md_member *members = NULL;
+	struct disk_device_path disk;
+	char *child_devpath = NULL;
+	char *relpath = NULL;
+	uint8_t **dps = NULL;
+	ssize_t *dp_sizes = NULL;
+	struct stat sb;
+	size_t n = 0;
+	int first_error = 0;
+	va_list ap;
+	int rc;
+
+	*dpsp = NULL;
+	*dp_sizesp = NULL;
+	*np = 0;
+
+	rc = find_file(filepath, &child_devpath, &relpath);
+	if (rc < 0) {
+		efi_error("could not canonicalize fs path \"%s\"", filepath);
+		goto err;
+	}
+
+	rc = stat(child_devpath, &sb);
+	if (rc < 0) {
+		efi_error("could not stat \"%s\"", child_devpath);
+		goto err;
+	}
+	if (!S_ISBLK(sb.st_mode)) {
+		rc = -1;
+		errno = ENOTBLK;
+		efi_error("\"%s\" is not a block device", child_devpath);
+		goto err;
+	}
+
+	sysfs_cache_hold();
+	rc = md_get_members(sb.st_rdev, &members, &n);
+	if (rc < 0) {
+		sysfs_cache_release();
+		efi_error("could not find the disks under \"%s\"",
+			  child_devpath);
+		goto err;
+	}
+
+	dps = calloc(n ? n : 1, sizeof(*dps));
+	dp_sizes = calloc(n ? n : 1, sizeof(*dp_sizes));
+	if (!dps || !dp_sizes) {
+		sysfs_cache_release();
+		efi_error("could not allocate memory");
+		rc = -1;
+		goto err;
+	}
+
+	va_start(ap, options);
+	for (size_t i = 0; i < n; i++) {
+		memset(&disk, 0, sizeof(disk));
+		dp_sizes[i] = -1;
+
+		if (make_disk_prefix(&disk, members[i].devpath,
+				     members[i].partition, options, ap) < 0 ||
+		    (dp_sizes[i] = make_disk_file_device_path(&disk, relpath,
+							      &dps[i])) < 0) {
+			efi_error("could not generate File DP on \"%s\"",
+				  members[i].devpath);
+			if (!first_error)
+				first_error = errno ? errno : EINVAL;
+		}
+		free(disk.prefix);
+	}
+	va_end(ap);
+	sysfs_cache_release();
+
+	*dpsp = dps;
+	*dp_sizesp = dp_sizes;
+	*np = n;
+	dps = NULL;
+	dp_sizes = NULL;
+	rc = 0;
+	if (first_error) {
+		errno = first_error;
+		rc = -1;
+	}
+err:
+	first_error = errno;
+	free(dps);
+	free(dp_sizes);
+	md_members_free(members, n);
+	free(child_devpath);
+	free(relpath);
+	errno = first_error;
+	return rc;
+}
+
+/*
+ * Addresses are strings in the usual notation for their family, and ""
+ * means the all-zeros address.  Returns 1 if there was an address, 0 if
+ * it was "", and -1 if it can't be parsed.
+ */
+static int NONNULL(1, 3, 4)
+parse_ip_addr(const char * const str, int family, uint8_t *addr,
+	      const char * const what)
+{
+	memset(addr, 0, family == AF_INET ? 4 : 16);
+	if (!str[0])
+		return 0;
+	if (inet_pton(family, str, addr) != 1) {
+		errno = EINVAL;
+		efi_error("could not parse %s address \"%s\"", what, str);
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Without a netmask or prefix length, use the one the interface has for
+ * the local address.
+ */
+static int NONNULL(1, 3)
+local_prefix_length(const char * const ifname, int family,
+		    const uint8_t *local, uint8_t *prefix_length)
+{
+	const struct net_addr *addr;
+	struct net_iface iface;
+
+	if (net_iface_get(ifname, &iface) < 0)
+		return -1;
+
+	addr = net_iface_find_addr(&iface, family, local);
+	if (addr)
+		*prefix_length = addr->prefix_length;
+	net_iface_free(&iface);
+
+	if (!addr) {
+		errno = EADDRNOTAVAIL;
+		efi_error("%s has no such local address", ifname);
+		return -1;
+	}
+	return 0;
+}
+
+static inline uint32_t
+ipv4_to_cpu(const uint8_t addr[4])
+{
+	uint32_t addr32;
+
+	memcpy(&addr32, addr, sizeof(addr32));
+	return ntohl(addr32);
+}
+
+static ssize_t NONNULL(3, 4, 5, 6, 7)
 make_ipv4_path(uint8_t *buf, ssize_t size,
-	       const char * const local_addr UNUSED,
-	       const char * const remote_addr UNUSED,
-	       const char * const gateway_addr UNUSED,
-	       const char * const netmask UNUSED,
-	       uint16_t local_port UNUSED,
-	       uint16_t remote_port UNUSED,
-	       uint16_t protocol UNUSED,
-	       uint8_t addr_origin UNUSED)
+	       const char * const ifname,
+	       const char * const local_addr,
+	       const char * const remote_addr,
+	       const char * const gateway_addr,
+	       const char * const netmask,
+	       uint16_t local_port,
+	       uint16_t remote_port,
+	       uint16_t protocol,
+	       uint8_t addr_origin)
 {
+	uint8_t local[4], remote[4], gateway[4], mask[4];
+	int have_local;
 	ssize_t ret;
 
-#if 0
-	if (local_addr == NULL || remote_addr == NULL ||
-	    gateway_addr == NULL || netmask == NULL) {
-		errno = EINVAL;
+	have_local = parse_ip_addr(local_addr, AF_INET, local, "local");
+	if (have_local < 0 ||
+	    parse_ip_addr(remote_addr, AF_INET, remote, "remote") < 0 ||
+	    parse_ip_addr(gateway_addr, AF_INET, gateway, "gateway") < 0)
 		return -1;
+
+	if (netmask[0] || !have_local) {
+		if (parse_ip_addr(netmask, AF_INET, mask, "netmask") < 0)
+			return -1;
+	} else {
+		uint8_t prefix_length = 0;
+		uint32_t mask32;
+
+		if (local_prefix_length(ifname, AF_INET, local,
+					&prefix_length) < 0)
+			return -1;
+		mask32 = prefix_length ? htonl(~0u << (32 - prefix_length)) : 0;
+		memcpy(mask, &mask32, sizeof(mask));
 	}
-#endif
-	ret = efidp_make_ipv4(buf, size, 0, 0, 0, 0, 0, 0, 0, 0);
+
+	ret = efidp_make_ipv4(buf, size, ipv4_to_cpu(local),
+			      ipv4_to_cpu(remote), ipv4_to_cpu(gateway),
+			      ipv4_to_cpu(mask), local_port, remote_port,
+			      protocol, addr_origin);
 	if (ret < 0)
 		efi_error("could not make ipv4 DP node");
 	return ret;
 }
 
+static ssize_t NONNULL(3, 4, 5, 6)
+make_ipv6_path(uint8_t *buf, ssize_t size,
+	       const char * const ifname,
+	       const char * const local_addr,
+	       const char * const remote_addr,
+	       const char * const gateway_addr,
+	       uint8_t prefix_length,
+	       uint16_t local_port,
+	       uint16_t remote_port,
+	       uint16_t protocol,
+	       uint8_t addr_origin)
+{
+	uint8_t local[16], remote[16], gateway[16];
+	int have_local;
+	ssize_t ret;
+
+	have_local = parse_ip_addr(local_addr, AF_INET6, local, "local");
+	if (have_local < 0 ||
+	    parse_ip_addr(remote_addr, AF_INET6, remote, "remote") < 0 ||
+	    parse_ip_addr(gateway_addr, AF_INET6, gateway, "gateway") < 0)
+		return -1;
+
+	if (have_local && !prefix_length &&
+	    local_prefix_length(ifname, AF_INET6, local, &prefix_length) < 0)
+		return -1;
+
+	ret = efidp_make_ipv6(buf, size, local, remote, local_port,
+			      remote_port, protocol, addr_origin,
+			      prefix_length, gateway);
+	if (ret < 0)
+		efi_error("could not make ipv6 DP node");
+	return ret;
+}
+
 ssize_t NONNULL(3, 4, 5, 6, 7) PUBLIC
 efi_generate_ipv4_device_path(uint8_t *buf, ssize_t size,
 			      const char * const ifname,
@@ -675,9 +1379,9 @@ efi_generate_ipv4_device_path(uint8_t *buf, ssize_t size,
 	}
 	off += sz;
 
-	sz = make_ipv4_path(buf+off, size?size-off:0, local_addr, remote_addr,
-			    gateway_addr, netmask, local_port, remote_port,
-			    protocol, addr_origin);
+	sz = make_ipv4_path(buf+off, size?size-off:0, ifname, local_addr,
+			    remote_addr, gateway_addr, netmask, local_port,
+			    remote_port, protocol, addr_origin);
 	if (sz < 0) {
 		efi_error("could not make IPV4 DP node");
 		return -1;
@@ -694,6 +1398,120 @@ efi_generate_ipv4_device_path(uint8_t *buf, ssize_t size,
 	return off;
 }
 
+ssize_t NONNULL(3, 4, 5, 6) PUBLIC
+efi_generate_ipv6_device_path(uint8_t *buf, ssize_t size,
+			      const char * const ifname,
+			      const char * const local_addr,
+			      const char * const remote_addr,
+			      const char * const gateway_addr,
+			      uint8_t prefix_length,
+			      uint16_t local_port,
+			      uint16_t remote_port,
+			      uint16_t protocol,
+			      uint8_t addr_origin)
+{
+	ssize_t off = 0;
+	ssize_t sz;
+
+	sz = make_mac_path(buf, size, ifname);
+	if (sz < 0) {
+		efi_error("could not make MAC DP node");
+		return -1;
+	}
+	off += sz;
+
+	sz = make_ipv6_path(buf+off, size?size-off:0, ifname, local_addr,
+			    remote_addr, gateway_addr, prefix_length,
+			    local_port, remote_port, protocol, addr_origin);
+	if (sz < 0) {
+		efi_error("could not make IPV6 DP node");
+		return -1;
+	}
+	off += sz;
+
+	sz = efidp_make_end_entire(buf+off, size?size-off:0);
+	if (sz < 0) {
+		efi_error("could not make EndEntire DP node");
+		return -1;
+	}
+	off += sz;
+
+	return off;
+}
+
+#define ISCSI_PORT	3260
+
+ssize_t NONNULL(3, 4, 5, 7) PUBLIC
+efi_generate_iscsi_device_path(uint8_t *buf, ssize_t size,
+			       const char * const ifname,
+			       const char * const local_addr,
+			       const char * const remote_addr,
+			       uint16_t remote_port,
+			       const char * const target_name,
+			       uint64_t lun,
+			       uint16_t tpgt,
+			       uint16_t options)
+{
+	bool is_ipv6 = strchr(remote_addr, ':') != NULL;
+	ssize_t off = 0;
+	ssize_t sz;
+
+	if (!remote_addr[0]) {
+		errno = EINVAL;
+		efi_error("an iSCSI path needs the target's address");
+		return -1;
+	}
+	if (!remote_port)
+		remote_port = ISCSI_PORT;
+
+	sz = make_mac_path(buf, size, ifname);
+	if (sz < 0) {
+		efi_error("could not make MAC DP node");
+		return -1;
+	}
+	off += sz;
+
+	/*
+	 * With no local address, it's up to the firmware to get one from
+	 * DHCP when it boots.
+	 */
+	if (is_ipv6)
+		sz = make_ipv6_path(buf+off, size?size-off:0, ifname,
+				    local_addr, remote_addr, "", 0, 0,
+				    remote_port, IPPROTO_TCP,
+				    local_addr[0] ? EFIDP_IPv6_ORIGIN_MANUAL
+						  : EFIDP_IPv6_ORIGIN_STATEFUL);
+	else
+		sz = make_ipv4_path(buf+off, size?size-off:0, ifname,
+				    local_addr, remote_addr, "", "", 0,
+				    remote_port, IPPROTO_TCP,
+				    local_addr[0] ? EFIDP_IPv4_ORIGIN_STATIC
+						  : EFIDP_IPv4_ORIGIN_DHCP);
+	if (sz < 0) {
+		efi_error("could not make %s DP node",
+			  is_ipv6 ? "IPV6" : "IPV4");
+		return -1;
+	}
+	off += sz;
+
+	sz = efidp_make_iscsi(buf+off, size?size-off:0, target_name, lun, tpgt,
+			      options, 0);
+	if (sz < 0) {
+		efi_error("could not make iSCSI DP node");
+		return -1;
+	}
+	off += sz;
+
+	sz = efidp_make_end_entire(buf+off, size?size-off:0);
+	if (sz < 0) {
+		efi_error("could not make EndEntire DP node");
+		return -1;
+	}
+	off += sz;
+
+	return off;
+}
+
 uint32_t PUBLIC
 efi_get_libefiboot_version(void)
 {
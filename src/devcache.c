@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * devcache.c - on-disk cache of resolved device paths
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#include "efiboot.h"
+#include "stats.h"
+
+/*
+ * Working out the device path for a file means probing its disk through
+ * sysfs and reading the partition table, and tools that get run over and
+ * over again by config management do that from scratch every time.  If
+ * LIBEFIBOOT_DEVICE_CACHE is set, what we worked out is kept in files
+ * under that directory (or /run/efivar if it's empty), one per device and
+ * question, so the next process can skip it.
+ *
+ * Every entry records the kernel's diskseq for the device and the mtime of
+ * udev's database file for it, which udev rewrites on every add and change
+ * event, so an entry goes stale whenever the disk is swapped, reprobed, or
+ * repartitioned.  Without a udev database there's nothing to tell us that
+ * happened, so we don't cache at all.
+ *
+ * Entries are only believed if they belong to root or to us and nobody
+ * else can write them.
+ */
+#define DEVCACHE_DEFAULT_DIR	"/run/efivar"
+#define DEVCACHE_UDEV_DATA	"/run/udev/data"
+#define DEVCACHE_MAGIC		0x43445045 /* "EPDC" */
+#define DEVCACHE_VERSION	1
+
+struct devcache_generation {
+	uint64_t diskseq;
+	int64_t udev_sec;
+	int64_t udev_nsec;
+};
+
+struct devcache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t dev;
+	struct devcache_generation gen;
+	uint64_t datasz;
+	uint32_t crc;
+	uint32_t reserved;
+};
+
+static const char *
+devcache_dir(void)
+{
+	const char *dir = getenv("LIBEFIBOOT_DEVICE_CACHE");
+
+	if (dir && !dir[0])
+		dir = DEVCACHE_DEFAULT_DIR;
+	return dir;
+}
+
+bool HIDDEN
+devcache_enabled(void)
+{
+#ifdef __linux__
+	return devcache_dir() != NULL;
+#else
+	return false;
+#endif
+}
+
+static int
+devcache_generation(dev_t dev, struct devcache_generation *gen)
+{
+	char path[PATH_MAX];
+	char buf[32];
+	struct stat statbuf;
+	ssize_t rc;
+	int fd;
+
+	memset(gen, 0, sizeof(*gen));
+
+	snprintf(path, sizeof(path), DEVCACHE_UDEV_DATA "/b%u:%u",
+		 major(dev), minor(dev));
+	if (stat(path, &statbuf) < 0)
+		return -1;
+	gen->udev_sec = statbuf.st_mtim.tv_sec;
+	gen->udev_nsec = statbuf.st_mtim.tv_nsec;
+
+	/* diskseq is new in 5.15; the udev mtime will have to do without */
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/diskseq",
+		 major(dev), minor(dev));
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		rc = read(fd, buf, sizeof(buf) - 1);
+		if (rc > 0) {
+			buf[rc] = '\0';
+			gen->diskseq = strtoull(buf, NULL, 10);
+		}
+		close(fd);
+	}
+
+	return 0;
+}
+
+/*
+ * The same device number device_get() goes by: the device itself for
+ * device nodes, and the filesystem it's on for anything else.
+ */
+int HIDDEN
+devcache_fd_dev(int fd, dev_t *dev)
+{
+	struct stat statbuf;
+
+	if (fstat(fd, &statbuf) < 0)
+		return -1;
+	if (S_ISBLK(statbuf.st_mode) || S_ISCHR(statbuf.st_mode))
+		*dev = statbuf.st_rdev;
+	else if (S_ISREG(statbuf.st_mode))
+		*dev = statbuf.st_dev;
+	else
+		return -1;
+	return 0;
+}
+
+static int
+devcache_path(char *path, size_t pathsz, dev_t dev, const char *name)
+{
+	const char *dir = devcache_dir();
+	int rc;
+
+	if (!dir)
+		return -1;
+	rc = snprintf(path, pathsz, "%s/%u:%u-%s", dir,
+		      major(dev), minor(dev), name);
+	if (rc < 0 || (size_t)rc >= pathsz)
+		return -1;
+	return 0;
+}
+
+/*
+ * Look name up for dev.  Returns 1 and a new allocation in *data if it's
+ * there and still good, and 0 otherwise.  Never sets an error.
+ */
+int HIDDEN
+devcache_get(dev_t dev, const char *name, uint8_t **data, size_t *datasz)
+{
+	struct devcache_generation gen;
+	struct devcache_header *hdr;
+	char path[PATH_MAX];
+	struct stat statbuf;
+	uint8_t *buf = NULL;
+	size_t bufsz = 0;
+	int error = errno;
+	int ret = 0;
+	int fd;
+
+	if (!devcache_enabled())
+		return 0;
+	if (devcache_path(path, sizeof(path), dev, name) < 0)
+		return 0;
+	if (devcache_generation(dev, &gen) < 0)
+		goto out;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+	if (fd < 0)
+		goto out;
+	if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) ||
+	    (statbuf.st_uid != 0 && statbuf.st_uid != geteuid()) ||
+	    (statbuf.st_mode & (S_IWGRP|S_IWOTH)) ||
+	    read_file(fd, &buf, &bufsz) < 0) {
+		close(fd);
+		goto out;
+	}
+	close(fd);
+
+	/* read_file() counts the NUL it adds */
+	bufsz -= 1;
+	hdr = (struct devcache_header *)buf;
+	if (bufsz < sizeof(*hdr) ||
+	    hdr->magic != DEVCACHE_MAGIC ||
+	    hdr->version != DEVCACHE_VERSION ||
+	    hdr->dev != (uint64_t)dev ||
+	    memcmp(&hdr->gen, &gen, sizeof(gen)) ||
+	    hdr->datasz != bufsz - sizeof(*hdr) ||
+	    hdr->crc != efi_crc32(buf + sizeof(*hdr), hdr->datasz)) {
+		debug("%s is stale", path);
+		goto out;
+	}
+
+	*data = malloc(hdr->datasz ? hdr->datasz : 1);
+	if (!*data)
+		goto out;
+	memcpy(*data, buf + sizeof(*hdr), hdr->datasz);
+	*datasz = hdr->datasz;
+	debug("using %s", path);
+	ret = 1;
+out:
+	if (ret)
+		stats_inc(devcache_hits);
+	else
+		stats_inc(devcache_misses);
+	free(buf);
+	errno = error;
+	return ret;
+}
+
+/*
+ * Remember data as the answer to name for dev.  This is only ever an
+ * optimization, so anything going wrong just means we don't.
+ */
+void HIDDEN
+devcache_put(dev_t dev, const char *name, const uint8_t *data,
+	     size_t datasz)
+{
+	struct devcache_header hdr;
+	char path[PATH_MAX];
+	char tmppath[PATH_MAX];
+	int error = errno;
+	bool ok;
+	int fd;
+
+	if (!devcache_enabled())
+		return;
+	if (devcache_path(path, sizeof(path), dev, name) < 0)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (devcache_generation(dev, &hdr.gen) < 0)
+		goto out;
+	hdr.magic = DEVCACHE_MAGIC;
+	hdr.version = DEVCACHE_VERSION;
+	hdr.dev = dev;
+	hdr.datasz = datasz;
+	hdr.crc = efi_crc32(data, datasz);
+
+	if (mkdir(devcache_dir(), 0755) < 0 && errno != EEXIST)
+		goto out;
+	if (snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path)
+	    >= (int)sizeof(tmppath))
+		goto out;
+	fd = mkstemp(tmppath);
+	if (fd < 0)
+		goto out;
+
+	ok = fchmod(fd, 0644) == 0 &&
+	     write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+	     write(fd, data, datasz) == (ssize_t)datasz;
+	if (close(fd) < 0)
+		ok = false;
+	if (!ok || rename(tmppath, path) < 0) {
+		unlink(tmppath);
+		goto out;
+	}
+	debug("wrote %s", path);
+out:
+	errno = error;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * devcache.h - on-disk cache of resolved device paths
+ */
+#ifndef _EFIBOOT_DEVCACHE_H
+#define _EFIBOOT_DEVCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+extern bool HIDDEN devcache_enabled(void);
+extern int HIDDEN devcache_fd_dev(int fd, dev_t *dev);
+extern int HIDDEN devcache_get(dev_t dev, const char *name,
+			       uint8_t **data, size_t *datasz);
+extern void HIDDEN devcache_put(dev_t dev, const char *name,
+				const uint8_t *data, size_t datasz);
+
+#endif /* _EFIBOOT_DEVCACHE_H */
+
+// vim:fenc=utf-8:tw=75:noet
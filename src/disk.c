@@ -172,34 +172,27 @@ get_partition_info(int fd, uint32_t options,
 		   partition_signature_t *signature, uint8_t *mbr_type,
 		   uint8_t *signature_type)
 {
+	struct partition_table pt;
 	legacy_mbr *mbr;
-	void *mbr_sector;
-	size_t mbr_size;
-	off_t offset UNUSED;
-	int this_bytes_read = 0;
 	int gpt_invalid=0, mbr_invalid=0;
 	int rc=0;
-	int sector_size = get_sector_size(fd);
 
-	mbr_size = lcm(sizeof(*mbr), sector_size);
-	if ((rc = posix_memalign(&mbr_sector, sector_size, mbr_size)) != 0) {
-		efi_error("posix_memalign failed");
-		goto error;
+	/* the MBR and the GPT both come out of the same read */
+	if (partition_table_init(fd, &pt) < 0) {
+		efi_error("could not read partition table");
+		return -1;
 	}
-	memset(mbr_sector, '\0', mbr_size);
 
-	offset = lseek(fd, 0, SEEK_SET);
-	this_bytes_read = read(fd, mbr_sector, mbr_size);
-	if (this_bytes_read < (ssize_t)sizeof(*mbr)) {
+	mbr = partition_table_mbr(&pt);
+	if (!mbr) {
 		efi_error("short read trying to read mbr data");
 		rc = -1;
-		goto error_free_mbr;
+		goto error;
 	}
-	mbr = (legacy_mbr *)mbr_sector;
 	gpt_invalid = gpt_disk_get_partition_info(
-	    fd, part, start, size, &signature->gpt_signature, mbr_type,
+	    fd, &pt, part, start, size, &signature->gpt_signature, mbr_type,
 	    signature_type, (options & EFIBOOT_OPTIONS_IGNORE_PMBR_ERR) ? 1 : 0,
-	    sector_size);
+	    pt.sector_size);
 	if (gpt_invalid < 0) {
 		mbr_invalid = msdos_disk_get_partition_info(
 		    fd, (options & EFIBOOT_OPTIONS_WRITE_SIGNATURE) ? 1 : 0,
@@ -208,13 +201,12 @@ get_partition_info(int fd, uint32_t options,
 		if (mbr_invalid < 0) {
 			efi_error("neither MBR nor GPT is valid");
 			rc = -1;
-			goto error_free_mbr;
+			goto error;
 		}
 		efi_error_clear();
 	}
- error_free_mbr:
-	free(mbr_sector);
  error:
+	partition_table_fini(&pt);
 	return rc;
 }
 
@@ -84,6 +84,30 @@ _format_acpi_hid_ex(unsigned char *buf, size_t size,
 	format_helper(_format_acpi_hid_ex, buf, size, off, "AcpiEx", dp,\
 		      hidstr, cidstr, uidstr)
 
+/*
+ * PciRoot() and PcieRoot() start nearly every path there is, so they get
+ * done here without the rest of _format_acpi_dn().
+ */
+ssize_t
+_format_acpi_hid_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	ssize_t off = 0;
+
+	switch (dp->acpi_hid.hid) {
+	case EFIDP_ACPI_PCI_ROOT_HID:
+		format_lit(buf, size, off, "PciRoot(");
+		break;
+	case EFIDP_ACPI_PCIE_ROOT_HID:
+		format_lit(buf, size, off, "PcieRoot(");
+		break;
+	default:
+		return _format_acpi_dn(buf, size, dp);
+	}
+	format_0x64(buf, size, off, dp->acpi_hid.uid);
+	format_lit(buf, size, off, ")");
+	return off;
+}
+
 ssize_t
 _format_acpi_dn(unsigned char *buf, size_t size, const_efidp dp)
 {
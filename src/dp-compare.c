@@ -0,0 +1,303 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * libefivar - library for the manipulation of EFI variables
+ * Copyright 2012-2015 Red Hat, Inc.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "efivar.h"
+
+/*
+ * Comparing device paths for what they point at rather than byte for
+ * byte.  Each instance is compared from the node the firmware would
+ * match a short form path on: the first HD() node if there is one, since
+ * its partition signature is what finds the disk, and otherwise the
+ * first Uri(), UsbWwid(), or UsbClass() node.  So "HD(...)/File(...)"
+ * is the same as the full path down to that partition.  After that:
+ *
+ *   - HD() nodes with a GUID or MBR signature are the same partition no
+ *     matter what they say about where it starts or how big it is.
+ *   - File() names are compared the way FAT does, ignoring ASCII case,
+ *     and with '/' the same as '\'.
+ *   - Anything else has to be the same bytes.
+ *
+ * efidp_hash() hashes exactly what efidp_compare() looks at, so equal
+ * paths always hash the same.
+ */
+
+#define FNV1A_64_INIT	0xcbf29ce484222325ull
+#define FNV1A_64_PRIME	0x100000001b3ull
+
+static inline uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV1A_64_PRIME;
+	}
+	return hash;
+}
+
+static inline bool
+is_end(const_efidp dn)
+{
+	return dn->type == EFIDP_END_TYPE;
+}
+
+/* a node too short to step over ends the path, rather than looping */
+static inline const_efidp
+next_node(const_efidp dn)
+{
+	if (dn->length < sizeof(efidp_header) || is_end(dn))
+		return NULL;
+	return (const_efidp)((const uint8_t *)dn + dn->length);
+}
+
+static int
+anchor_rank(const_efidp dn)
+{
+	if (dn->type == EFIDP_MEDIA_TYPE && dn->subtype == EFIDP_MEDIA_HD)
+		return 3;
+	if (dn->type == EFIDP_MESSAGE_TYPE && dn->subtype == EFIDP_MSG_URI)
+		return 2;
+	if (dn->type == EFIDP_MESSAGE_TYPE &&
+	    (dn->subtype == EFIDP_MSG_USB_WWID ||
+	     dn->subtype == EFIDP_MSG_USB_CLASS))
+		return 1;
+	return 0;
+}
+
+/* where comparing the instance that starts at dn begins */
+static const_efidp
+instance_start(const_efidp dn)
+{
+	const_efidp best = dn;
+	int best_rank = 0;
+
+	for (const_efidp n = dn; n && !is_end(n); n = next_node(n)) {
+		int rank = anchor_rank(n);
+
+		if (rank > best_rank) {
+			best = n;
+			best_rank = rank;
+			if (rank == 3)
+				break;
+		}
+	}
+	return best;
+}
+
+/* the instance after the one dn is in, or NULL at the end */
+static const_efidp
+next_instance(const_efidp dn)
+{
+	while (dn && !is_end(dn))
+		dn = next_node(dn);
+	if (!dn || dn->subtype != EFIDP_END_INSTANCE ||
+	    dn->length < sizeof(efidp_header))
+		return NULL;
+	return instance_start((const_efidp)((const uint8_t *)dn + dn->length));
+}
+
+static inline size_t
+node_data_size(const_efidp dn)
+{
+	return dn->length > sizeof(efidp_header)
+		? dn->length - sizeof(efidp_header) : 0;
+}
+
+static inline const uint8_t *
+node_data(const_efidp dn)
+{
+	return (const uint8_t *)dn + sizeof(efidp_header);
+}
+
+/*
+ * The part of an HD() node that says which partition it is.  Without a
+ * signature, all there is is where it is.
+ */
+static size_t
+hd_key(const_efidp dn, uint8_t key[32])
+{
+	efidp_hd hd;
+	size_t n = 0;
+
+	if (dn->length < sizeof(hd))
+		return 0;
+	memcpy(&hd, dn, sizeof(hd));
+
+	key[n++] = hd.signature_type;
+	switch (hd.signature_type) {
+	case EFIDP_HD_SIGNATURE_GUID:
+		memcpy(key + n, hd.signature, 16);
+		n += 16;
+		break;
+	case EFIDP_HD_SIGNATURE_MBR:
+		memcpy(key + n, hd.signature, 4);
+		n += 4;
+		memcpy(key + n, &hd.partition_number,
+		       sizeof(hd.partition_number));
+		n += sizeof(hd.partition_number);
+		break;
+	default:
+		memcpy(key + n, &hd.partition_number,
+		       sizeof(hd.partition_number));
+		n += sizeof(hd.partition_number);
+		memcpy(key + n, &hd.start, sizeof(hd.start));
+		n += sizeof(hd.start);
+		memcpy(key + n, &hd.size, sizeof(hd.size));
+		n += sizeof(hd.size);
+		break;
+	}
+	return n;
+}
+
+/* File() name characters, up to the NUL; *i is in bytes */
+static inline bool
+file_next_char(const_efidp dn, size_t *i, uint16_t *c)
+{
+	const uint8_t *data = node_data(dn);
+	size_t size = node_data_size(dn);
+
+	if (*i + 1 >= size)
+		return false;
+	*c = data[*i] | data[*i + 1] << 8;
+	if (*c == 0)
+		return false;
+	*i += 2;
+
+	if (*c >= 'a' && *c <= 'z')
+		*c -= 'a' - 'A';
+	else if (*c == '/')
+		*c = '\\';
+	return true;
+}
+
+static int
+file_cmp(const_efidp a, const_efidp b)
+{
+	size_t ai = 0, bi = 0;
+
+	while (true) {
+		uint16_t ac = 0, bc = 0;
+		bool amore = file_next_char(a, &ai, &ac);
+		bool bmore = file_next_char(b, &bi, &bc);
+
+		if (!amore || !bmore)
+			return amore - bmore;
+		if (ac != bc)
+			return ac < bc ? -1 : 1;
+	}
+}
+
+static int
+bytes_cmp(const void *a, size_t alen, const void *b, size_t blen)
+{
+	int rc;
+
+	rc = memcmp(a, b, alen < blen ? alen : blen);
+	if (rc)
+		return rc;
+	return alen < blen ? -1 : alen > blen ? 1 : 0;
+}
+
+static int
+node_cmp(const_efidp a, const_efidp b)
+{
+	if (a->type != b->type)
+		return a->type < b->type ? -1 : 1;
+	if (a->subtype != b->subtype)
+		return a->subtype < b->subtype ? -1 : 1;
+
+	if (a->type == EFIDP_END_TYPE)
+		return 0;
+
+	if (a->type == EFIDP_MEDIA_TYPE && a->subtype == EFIDP_MEDIA_HD) {
+		uint8_t akey[32], bkey[32];
+		size_t alen = hd_key(a, akey);
+		size_t blen = hd_key(b, bkey);
+
+		if (alen && blen)
+			return bytes_cmp(akey, alen, bkey, blen);
+	}
+
+	if (a->type == EFIDP_MEDIA_TYPE && a->subtype == EFIDP_MEDIA_FILE)
+		return file_cmp(a, b);
+
+	return bytes_cmp(node_data(a), node_data_size(a),
+			 node_data(b), node_data_size(b));
+}
+
+static uint64_t
+node_hash(uint64_t hash, const_efidp dn)
+{
+	hash = hash_bytes(hash, &dn->type, 1);
+	hash = hash_bytes(hash, &dn->subtype, 1);
+
+	if (dn->type == EFIDP_END_TYPE)
+		return hash;
+
+	if (dn->type == EFIDP_MEDIA_TYPE && dn->subtype == EFIDP_MEDIA_HD) {
+		uint8_t key[32];
+		size_t len = hd_key(dn, key);
+
+		if (len)
+			return hash_bytes(hash, key, len);
+	}
+
+	if (dn->type == EFIDP_MEDIA_TYPE && dn->subtype == EFIDP_MEDIA_FILE) {
+		size_t i = 0;
+		uint16_t c;
+
+		while (file_next_char(dn, &i, &c))
+			hash = hash_bytes(hash, &c, sizeof(c));
+		return hash;
+	}
+
+	return hash_bytes(hash, node_data(dn), node_data_size(dn));
+}
+
+int NONNULL(1, 2) PUBLIC
+efidp_compare(const_efidp dp0, const_efidp dp1)
+{
+	const_efidp a = instance_start(dp0);
+	const_efidp b = instance_start(dp1);
+
+	while (a && b) {
+		int rc = node_cmp(a, b);
+
+		if (rc)
+			return rc;
+
+		if (is_end(a)) {
+			a = next_instance(a);
+			b = next_instance(b);
+		} else {
+			a = next_node(a);
+			b = next_node(b);
+		}
+	}
+	return a ? 1 : b ? -1 : 0;
+}
+
+uint64_t NONNULL(1) PUBLIC
+efidp_hash(const_efidp dp)
+{
+	uint64_t hash = FNV1A_64_INIT;
+	const_efidp dn = instance_start(dp);
+
+	while (dn) {
+		hash = node_hash(hash, dn);
+		dn = is_end(dn) ? next_instance(dn) : next_node(dn);
+	}
+	return hash;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -22,6 +22,19 @@ format_edd10_guid(unsigned char *buf, size_t size,
 	return off;
 }
 
+ssize_t
+_format_pci_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	ssize_t off = 0;
+
+	format_lit(buf, size, off, "Pci(");
+	format_0x64(buf, size, off, dp->pci.device);
+	format_lit(buf, size, off, ",");
+	format_0x64(buf, size, off, dp->pci.function);
+	format_lit(buf, size, off, ")");
+	return off;
+}
+
 ssize_t
 _format_hw_dn(unsigned char *buf, size_t size, const_efidp dp)
 {
@@ -29,8 +42,7 @@ _format_hw_dn(unsigned char *buf, size_t size, const_efidp dp)
 	ssize_t off = 0;
 	switch (dp->subtype) {
 	case EFIDP_HW_PCI:
-		format(buf, size, off, "Pci", "Pci(0x%"PRIx32",0x%"PRIx32")",
-		       dp->pci.device, dp->pci.function);
+		format_helper_2(_format_pci_dn, buf, size, off, dp);
 		break;
 	case EFIDP_HW_PCCARD:
 		format(buf, size, off, "PcCard", "PcCard(0x%"PRIx32")",
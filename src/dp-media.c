@@ -13,40 +13,61 @@
 
 #include "efivar.h"
 
+ssize_t
+_format_hd_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	ssize_t off = 0;
+
+	format_lit(buf, size, off, "HD(");
+	format_d64(buf, size, off, (int32_t)dp->hd.partition_number);
+	switch (dp->hd.signature_type) {
+	case EFIDP_HD_SIGNATURE_MBR:
+		format_lit(buf, size, off, ",MBR,");
+		format_0x64(buf, size, off,
+			    (uint32_t)dp->hd.signature[0] |
+			    ((uint32_t)dp->hd.signature[1] << 8) |
+			    ((uint32_t)dp->hd.signature[2] << 16) |
+			    ((uint32_t)dp->hd.signature[3] << 24));
+		break;
+	case EFIDP_HD_SIGNATURE_GUID:
+		format_lit(buf, size, off, ",GPT,");
+		format_guid(buf, size, off, "HD", dp->hd.signature);
+		break;
+	default:
+		format_lit(buf, size, off, ",");
+		format_d64(buf, size, off, dp->hd.signature_type);
+		format_lit(buf, size, off, ",");
+		format_hex(buf, size, off, "HD", dp->hd.signature,
+			   sizeof(dp->hd.signature));
+		break;
+	}
+	format_lit(buf, size, off, ",");
+	format_0x64(buf, size, off, dp->hd.start);
+	format_lit(buf, size, off, ",");
+	format_0x64(buf, size, off, dp->hd.size);
+	format_lit(buf, size, off, ")");
+	return off;
+}
+
+ssize_t
+_format_file_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	size_t limit = (efidp_node_size(dp) - offsetof(efidp_file, name)) / 2;
+	ssize_t off = 0;
+
+	format_lit(buf, size, off, "File(");
+	format_ucs2(buf, size, off, "File", dp->file.name, limit);
+	format_lit(buf, size, off, ")");
+	return off;
+}
+
 ssize_t
 _format_media_dn(unsigned char *buf, size_t size, const_efidp dp)
 {
 	ssize_t off = 0;
 	switch (dp->subtype) {
 	case EFIDP_MEDIA_HD:
-		format(buf, size, off, "HD", "HD(%d,", dp->hd.partition_number);
-		switch (dp->hd.signature_type) {
-		case EFIDP_HD_SIGNATURE_MBR:
-			format(buf, size, off, "HD",
-			       "MBR,0x%"PRIx32",0x%"PRIx64",0x%"PRIx64")",
-			       (uint32_t)dp->hd.signature[0] |
-			       ((uint32_t)dp->hd.signature[1] << 8) |
-			       ((uint32_t)dp->hd.signature[2] << 16) |
-			       ((uint32_t)dp->hd.signature[3] << 24),
-			       dp->hd.start, dp->hd.size);
-			break;
-		case EFIDP_HD_SIGNATURE_GUID:
-			format(buf, size, off, "HD", "GPT,");
-			format_guid(buf, size, off, "HD", dp->hd.signature);
-			format(buf, size, off, "HD",
-			       ",0x%"PRIx64",0x%"PRIx64")",
-			       dp->hd.start, dp->hd.size);
-			break;
-		default:
-			format(buf, size, off, "HD", "%d,",
-			       dp->hd.signature_type);
-			format_hex(buf, size, off, "HD", dp->hd.signature,
-				   sizeof(dp->hd.signature));
-			format(buf, size, off, "HD",
-			       ",0x%"PRIx64",0x%"PRIx64")",
-			       dp->hd.start, dp->hd.size);
-			break;
-		}
+		format_helper_2(_format_hd_dn, buf, size, off, dp);
 		break;
 	case EFIDP_MEDIA_CDROM:
 		format(buf, size, off, "CDROM",
@@ -57,14 +78,9 @@ _format_media_dn(unsigned char *buf, size_t size, const_efidp dp)
 	case EFIDP_MEDIA_VENDOR:
 		format_vendor(buf, size, off, "VenMedia", dp);
 		break;
-	case EFIDP_MEDIA_FILE: {
-		size_t limit = (efidp_node_size(dp)
-				- offsetof(efidp_file, name)) / 2;
-		format(buf, size, off, "File", "File(");
-		format_ucs2(buf, size, off, "File", dp->file.name, limit);
-		format(buf, size, off, "File", ")");
+	case EFIDP_MEDIA_FILE:
+		format_helper_2(_format_file_dn, buf, size, off, dp);
 		break;
-			       }
 	case EFIDP_MEDIA_PROTOCOL:
 		format(buf, size, off, "Media", "Media(");
 		format_guid(buf, size, off, "Media",
@@ -86,11 +86,12 @@ format_ipv6_addr_helper(unsigned char *buf, size_t size, const char *dp_type,
 			format(buf, size, off, "dp_type", "::");
 			i += largest_zero_block_size -1;
 			continue;
-		} else if (i > 0) {
+		} else if (i > 0 && largest_zero_block_offset +
+					largest_zero_block_size != i) {
 			format(buf, size, off, "dp_type", ":");
 		}
 
-		format(buf, size, off, "dp_type", "%x", ip[i]);
+		format(buf, size, off, "dp_type", "%x", ntohs(ip[i]));
 	}
 
 	format(buf, size, off, "dp_type", "]");
@@ -297,6 +298,68 @@ format_usb_class(unsigned char *buf, size_t size,
 	return off;
 }
 
+ssize_t
+_format_scsi_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	ssize_t off = 0;
+
+	format_lit(buf, size, off, "SCSI(");
+	format_d64(buf, size, off, dp->scsi.target);
+	format_lit(buf, size, off, ",");
+	format_d64(buf, size, off, dp->scsi.lun);
+	format_lit(buf, size, off, ")");
+	return off;
+}
+
+ssize_t
+_format_usb_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	ssize_t off = 0;
+
+	format_lit(buf, size, off, "USB(");
+	format_d64(buf, size, off, dp->usb.parent_port);
+	format_lit(buf, size, off, ",");
+	format_d64(buf, size, off, dp->usb.interface);
+	format_lit(buf, size, off, ")");
+	return off;
+}
+
+ssize_t
+_format_sata_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	ssize_t off = 0;
+
+	format_lit(buf, size, off, "Sata(");
+	format_d64(buf, size, off, dp->sata.hba_port);
+	format_lit(buf, size, off, ",");
+	format_d64(buf, size, off, dp->sata.port_multiplier_port);
+	format_lit(buf, size, off, ",");
+	format_d64(buf, size, off, dp->sata.lun);
+	format_lit(buf, size, off, ")");
+	return off;
+}
+
+ssize_t
+_format_nvme_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	char eui[sizeof(dp->nvme.ieee_eui_64) * 3];
+	ssize_t off = 0;
+
+	for (size_t i = 0; i < sizeof(dp->nvme.ieee_eui_64); i++) {
+		eui[i * 3] = digits[dp->nvme.ieee_eui_64[i] >> 4];
+		eui[i * 3 + 1] = digits[dp->nvme.ieee_eui_64[i] & 0xf];
+		eui[i * 3 + 2] = '-';
+	}
+
+	format_lit(buf, size, off, "NVMe(");
+	format_0x64(buf, size, off, dp->nvme.namespace_id);
+	format_lit(buf, size, off, ",");
+	format_str(buf, size, off, eui, sizeof(eui) - 1);
+	format_lit(buf, size, off, ")");
+	return off;
+}
+
 ssize_t
 _format_message_dn(unsigned char *buf, size_t size, const_efidp dp)
 {
@@ -308,8 +371,7 @@ _format_message_dn(unsigned char *buf, size_t size, const_efidp dp)
 			      dp->atapi.lun);
 		break;
 	case EFIDP_MSG_SCSI:
-		format(buf, size, off, "SCSI", "SCSI(%d,%d)",
-			      dp->scsi.target, dp->scsi.lun);
+		format_helper_2(_format_scsi_dn, buf, size, off, dp);
 		break;
 	case EFIDP_MSG_FIBRECHANNEL:
 		format(buf, size, off, "Fibre", "Fibre(%"PRIx64",%"PRIx64")",
@@ -326,15 +388,14 @@ _format_message_dn(unsigned char *buf, size_t size, const_efidp dp)
 			      dp->firewire.guid);
 		break;
 	case EFIDP_MSG_USB:
-		format(buf, size, off, "USB", "USB(%d,%d)",
-			      dp->usb.parent_port, dp->usb.interface);
+		format_helper_2(_format_usb_dn, buf, size, off, dp);
 		break;
 	case EFIDP_MSG_I2O:
 		format(buf, size, off, "I2O", "I2O(%d)", dp->i2o.target);
 		break;
 	case EFIDP_MSG_INFINIBAND:
 		format(buf, size, off, "Infiniband",
-		       "Infiniband(%08x,%"PRIx64"%"PRIx64",%"PRIx64",%"PRIu64",%"PRIu64")",
+		       "Infiniband(%08x,%016"PRIx64"%016"PRIx64",%"PRIx64",%"PRIu64",%"PRIu64")",
 		       dp->infiniband.resource_flags,
 		       dp->infiniband.port_gid[1],
 		       dp->infiniband.port_gid[0],
@@ -354,14 +415,28 @@ _format_message_dn(unsigned char *buf, size_t size, const_efidp dp)
 		format(buf, size, off, "IPv4", "IPv4(");
 		format_ipv4_addr(buf, size, off,
 				 a->local_ipv4_addr, a->local_port);
+		format(buf, size, off, "IPv4", "<->");
 		format_ipv4_addr(buf, size, off,
 				 a->remote_ipv4_addr, a->remote_port);
-		format(buf, size, off, "IPv4", ",%hx,%hhx)",
+		format(buf, size, off, "IPv4", ",%hx,%hhx",
 		       a->protocol, a->static_ip_addr);
+		/*
+		 * Nodes from before UEFI 2.0 stop here; newer ones also
+		 * carry the gateway and the subnet mask.
+		 */
+		if (efidp_node_size(dp) >= (ssize_t)sizeof(efidp_ipv4_addr)) {
+			format(buf, size, off, "IPv4", ",");
+			format_ipv4_addr(buf, size, off,
+					 a->gateway, -1);
+			format(buf, size, off, "IPv4", ",");
+			format_ipv4_addr(buf, size, off,
+					 a->netmask, -1);
+		}
+		format(buf, size, off, "IPv4", ")");
 		break;
 			     }
 	case EFIDP_MSG_VENDOR: {
-		struct {
+		static const struct {
 			efi_guid_t guid;
 			char label[40];
 			ssize_t (*formatter)(unsigned char *buf, size_t size,
@@ -384,15 +459,14 @@ _format_message_dn(unsigned char *buf, size_t size, const_efidp dp)
 			{ .guid = EFIDP_MSG_SAS_GUID,
 			  .label = "",
 			  .formatter = format_sas },
-			{ .guid = efi_guid_empty,
-			  .label = "" }
 		};
-		char *label = NULL;
+		const char *label = NULL;
 		ssize_t (*formatter)(unsigned char *buf, size_t size,
 			const char *dp_type UNUSED,
 			const_efidp dp) = NULL;
 
-		for (int i = 0; !efi_guid_is_zero(&subtypes[i].guid); i++) {
+		for (size_t i = 0; i < sizeof(subtypes) / sizeof(subtypes[0]);
+		     i++) {
 			if (efi_guid_cmp(&subtypes[i].guid,
 					  &dp->msg_vendor.vendor_guid))
 				continue;
@@ -429,30 +503,44 @@ _format_message_dn(unsigned char *buf, size_t size, const_efidp dp)
 		unsigned char *addr0 = NULL;
 		unsigned char *addr1 = NULL;
 		ssize_t tmpoff = 0;
-		ssize_t sz;
+		ssize_t sz0, sz1;
 
-		sz = format_ipv6_addr(addr0, 0, tmpoff, a->local_ipv6_addr,
-				      a->local_port);
-		if (sz < 0)
+		sz0 = format_ipv6_addr(addr0, 0, tmpoff, a->local_ipv6_addr,
+				       a->local_port);
+		if (sz0 < 0)
 			return -1;
-		addr0 = alloca(sz+1);
+		addr0 = alloca(sz0+1);
 		tmpoff = 0;
-		sz = format_ipv6_addr(addr1, 0, tmpoff, a->remote_ipv6_addr,
-				      a->remote_port);
-		if (sz < 0)
+		sz1 = format_ipv6_addr(addr1, 0, tmpoff, a->remote_ipv6_addr,
+				       a->remote_port);
+		if (sz1 < 0)
 			return -1;
-		addr1 = alloca(sz+1);
+		addr1 = alloca(sz1+1);
 
 		tmpoff = 0;
-		format_ipv6_addr(addr0, sz, tmpoff, a->local_ipv6_addr,
+		format_ipv6_addr(addr0, sz0+1, tmpoff, a->local_ipv6_addr,
 				 a->local_port);
 
 		tmpoff = 0;
-		format_ipv6_addr(addr1, sz, tmpoff, a->remote_ipv6_addr,
+		format_ipv6_addr(addr1, sz1+1, tmpoff, a->remote_ipv6_addr,
 				 a->remote_port);
 
-		format(buf, size, off, "IPv6", "IPv6(%s<->%s,%hx,%hhx)",
+		format(buf, size, off, "IPv6", "IPv6(%s<->%s,%hx,%hhx",
 		       addr0, addr1, a->protocol, a->ip_addr_origin);
+		/*
+		 * UEFI 2.4 added the prefix length and the gateway.
+		 */
+		if (efidp_node_size(dp) >=
+		    (ssize_t)offsetof(efidp_ipv6_addr, gateway_ipv6_addr) + 16) {
+			format(buf, size, off, "IPv6", ",%hhu,",
+			       a->prefix_length);
+			format_ipv6_addr(buf, size, off,
+					 (const uint8_t *)dp +
+					 offsetof(efidp_ipv6_addr,
+						  gateway_ipv6_addr),
+					 -1);
+		}
+		format(buf, size, off, "IPv6", ")");
 		break;
 			     }
 	case EFIDP_MSG_UART: {
@@ -494,9 +582,7 @@ _format_message_dn(unsigned char *buf, size_t size, const_efidp dp)
 		format(buf, size, off, "Unit", "Unit(%d)", dp->lun.lun);
 		break;
 	case EFIDP_MSG_SATA:
-		format(buf, size, off, "Sata", "Sata(%d,%d,%d)",
-			    dp->sata.hba_port, dp->sata.port_multiplier_port,
-			    dp->sata.lun);
+		format_helper_2(_format_sata_dn, buf, size, off, dp);
 		break;
 	case EFIDP_MSG_ISCSI: {
 		ssize_t sz = efidp_node_size(dp)
@@ -517,14 +603,18 @@ _format_message_dn(unsigned char *buf, size_t size, const_efidp dp)
 		memcpy(&lun, dp->iscsi.lun, sizeof (lun));
 
 		format(buf, size, off, "iSCSI",
-			      "iSCSI(%s,%d,0x%"PRIx64",%s,%s,%s,%s)",
+			      "iSCSI(%s,%d,0x%"PRIx64",%s,%s,%s,",
 			      target_name, dp->iscsi.tpgt,
 			      be64_to_cpu(lun),
 			      (dp->iscsi.options >> EFIDP_ISCSI_HEADER_DIGEST_SHIFT) & EFIDP_ISCSI_HEADER_CRC32 ? "CRC32" : "None",
 			      (dp->iscsi.options >> EFIDP_ISCSI_DATA_DIGEST_SHIFT) & EFIDP_ISCSI_DATA_CRC32 ? "CRC32" : "None",
 			      (dp->iscsi.options >> EFIDP_ISCSI_AUTH_SHIFT) & EFIDP_ISCSI_AUTH_NONE ? "None" : \
-				      (dp->iscsi.options >> EFIDP_ISCSI_CHAP_SHIFT) & EFIDP_ISCSI_CHAP_UNI ? "CHAP_UNI" : "CHAP_BI",
-			      dp->iscsi.protocol == 0 ? "TCP" : "Unknown");
+				      (dp->iscsi.options >> EFIDP_ISCSI_CHAP_SHIFT) & EFIDP_ISCSI_CHAP_UNI ? "CHAP_UNI" : "CHAP_BI");
+		if (dp->iscsi.protocol == 0)
+			format(buf, size, off, "iSCSI", "TCP)");
+		else
+			format(buf, size, off, "iSCSI", "%hu)",
+			       dp->iscsi.protocol);
 		break;
 			      }
 	case EFIDP_MSG_VLAN:
@@ -534,13 +624,7 @@ _format_message_dn(unsigned char *buf, size_t size, const_efidp dp)
 		format_sas(buf, size, NULL, dp);
 		break;
 	case EFIDP_MSG_NVME:
-		format(buf, size, off, "NVMe", "NVMe(0x%"PRIx32","
-			   "%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X)",
-			   dp->nvme.namespace_id, dp->nvme.ieee_eui_64[0],
-			   dp->nvme.ieee_eui_64[1], dp->nvme.ieee_eui_64[2],
-			   dp->nvme.ieee_eui_64[3], dp->nvme.ieee_eui_64[4],
-			   dp->nvme.ieee_eui_64[5], dp->nvme.ieee_eui_64[6],
-			   dp->nvme.ieee_eui_64[7]);
+		format_helper_2(_format_nvme_dn, buf, size, off, dp);
 		break;
 	case EFIDP_MSG_URI: {
 		ssize_t sz = efidp_node_size(dp) - offsetof(efidp_uri, uri);
@@ -651,9 +735,9 @@ efidp_make_ipv4(uint8_t *buf, ssize_t size, uint32_t local, uint32_t remote,
 	if (size && sz == req) {
 		*((uint32_t *)ipv4->local_ipv4_addr) = htonl(local);
 		*((uint32_t *)ipv4->remote_ipv4_addr) = htonl(remote);
-		ipv4->local_port = htons(local_port);
-		ipv4->remote_port = htons(remote_port);
-		ipv4->protocol = htons(protocol);
+		ipv4->local_port = local_port;
+		ipv4->remote_port = remote_port;
+		ipv4->protocol = protocol;
 		ipv4->static_ip_addr = 0;
 		if (is_static)
 			ipv4->static_ip_addr = 1;
@@ -667,6 +751,81 @@ efidp_make_ipv4(uint8_t *buf, ssize_t size, uint32_t local, uint32_t remote,
 	return sz;
 }
 
+/*
+ * The node is the 60 bytes UEFI 2.4 and later describe, with the 16 byte
+ * gateway address at the end; efidp_ipv6_addr only has room for the first
+ * byte of it.
+ */
+ssize_t PUBLIC
+efidp_make_ipv6(uint8_t *buf, ssize_t size, const uint8_t *local,
+		const uint8_t *remote, uint16_t local_port,
+		uint16_t remote_port, uint16_t protocol, uint8_t addr_origin,
+		uint8_t prefix_length, const uint8_t *gateway)
+{
+	efidp_ipv6_addr *ipv6 = (efidp_ipv6_addr *)buf;
+	ssize_t req = offsetof(efidp_ipv6_addr, gateway_ipv6_addr) + 16;
+	ssize_t sz = efidp_make_generic(buf, size, EFIDP_MESSAGE_TYPE,
+					EFIDP_MSG_IPv6, req);
+	if (size && sz == req) {
+		memset(buf + sizeof(efidp_header), 0,
+		       req - sizeof(efidp_header));
+		if (local)
+			memcpy(ipv6->local_ipv6_addr, local, 16);
+		if (remote)
+			memcpy(ipv6->remote_ipv6_addr, remote, 16);
+		ipv6->local_port = local_port;
+		ipv6->remote_port = remote_port;
+		ipv6->protocol = protocol;
+		ipv6->ip_addr_origin = addr_origin;
+		ipv6->prefix_length = prefix_length;
+		if (gateway)
+			memcpy(buf + offsetof(efidp_ipv6_addr,
+					      gateway_ipv6_addr),
+			       gateway, 16);
+	}
+
+	if (sz < 0)
+		efi_error("efidp_make_generic failed");
+
+	return sz;
+}
+
+ssize_t NONNULL(3) PUBLIC
+efidp_make_iscsi(uint8_t *buf, ssize_t size, const char *target_name,
+		 uint64_t lun, uint16_t tpgt, uint16_t options,
+		 uint16_t protocol)
+{
+	efidp_iscsi *iscsi = (efidp_iscsi *)buf;
+	size_t name_len = strlen(target_name);
+	ssize_t req, sz;
+
+	if (name_len > EFIDP_ISCSI_MAX_TARGET_NAME_LEN) {
+		errno = EINVAL;
+		efi_error("iSCSI target name is %zu bytes; the most is %d",
+			  name_len, EFIDP_ISCSI_MAX_TARGET_NAME_LEN);
+		return -1;
+	}
+
+	req = offsetof(efidp_iscsi, target_name) + name_len;
+	sz = efidp_make_generic(buf, size, EFIDP_MESSAGE_TYPE,
+				EFIDP_MSG_ISCSI, req);
+	if (size && sz == req) {
+		uint64_t be_lun = cpu_to_be64(lun);
+
+		iscsi->protocol = protocol;
+		iscsi->options = options;
+		memcpy(iscsi->lun, &be_lun, sizeof(be_lun));
+		iscsi->tpgt = tpgt;
+		memcpy(buf + offsetof(efidp_iscsi, target_name), target_name,
+		       name_len);
+	}
+
+	if (sz < 0)
+		efi_error("efidp_make_generic failed");
+
+	return sz;
+}
+
 ssize_t PUBLIC
 efidp_make_scsi(uint8_t *buf, ssize_t size, uint16_t target, uint16_t lun)
 {
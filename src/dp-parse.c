@@ -0,0 +1,2114 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * dp-parse.c - turn the text form of device paths back into device paths
+ */
+
+#include "fix_coverity.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "efivar.h"
+
+/*
+ * Turning text back into device paths.  This accepts what
+ * efidp_format_device_path() prints: each node's name is looked up in
+ * one sorted table, and its arguments are picked apart in place and
+ * written straight into the caller's buffer, so nothing gets allocated
+ * and nothing gets copied twice.  Like the efidp_make_*() functions,
+ * passing a size of 0 just says how big the result would be.
+ *
+ * A few of the formats can't be undone exactly.  Where that's so, the
+ * comment by the parser says what we do instead.
+ */
+
+/* a piece of the input; never NUL terminated */
+struct dp_text {
+	const char *s;
+	size_t len;
+};
+
+struct dp_node_parser;
+typedef ssize_t (dp_parse_fn)(uint8_t *buf, ssize_t size,
+			      const struct dp_node_parser *np,
+			      struct dp_text *args);
+
+struct dp_node_parser {
+	const char *name;
+	uint8_t type;
+	uint8_t subtype;
+	dp_parse_fn *parse;
+	uint32_t value;		/* HID, USB class, BBS device type... */
+	efi_guid_t guid;	/* for the vendor nodes with their own name */
+};
+
+static bool
+text_eq(const struct dp_text *t, const char *s)
+{
+	size_t len = strlen(s);
+
+	return t->len == len && !memcmp(t->s, s, len);
+}
+
+static int
+parse_error(const struct dp_node_parser *np, const struct dp_text *t,
+	    const char *what)
+{
+	errno = EINVAL;
+	efi_error("%s(): invalid %s \"%.*s\"", np->name, what,
+		  (int)t->len, t->s);
+	return -1;
+}
+
+/*
+ * Splits the next argument off the front of args, at the first comma
+ * that isn't inside parentheses.  Returns 0 when there aren't any more.
+ */
+static int
+text_next_arg(struct dp_text *args, struct dp_text *arg)
+{
+	int depth = 0;
+	size_t i;
+
+	if (!args->s)
+		return 0;
+
+	for (i = 0; i < args->len; i++) {
+		if (args->s[i] == '(')
+			depth++;
+		else if (args->s[i] == ')')
+			depth--;
+		else if (args->s[i] == ',' && depth == 0)
+			break;
+	}
+
+	arg->s = args->s;
+	arg->len = i;
+	if (i < args->len) {
+		args->s += i + 1;
+		args->len -= i + 1;
+	} else {
+		args->s = NULL;
+		args->len = 0;
+	}
+	return 1;
+}
+
+static int
+hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Numbers are decimal unless they start with 0x, except where the
+ * formatter prints bare hex, and then they're always hex.
+ */
+static int
+text_number(const struct dp_text *t, bool hex, uint64_t max, uint64_t *valp)
+{
+	const char *s = t->s;
+	size_t len = t->len;
+	uint64_t val = 0;
+	unsigned int base = 10;
+
+	if (len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+		s += 2;
+		len -= 2;
+		base = 16;
+	} else if (hex) {
+		base = 16;
+	}
+	if (!len)
+		return -1;
+
+	for (size_t i = 0; i < len; i++) {
+		int digit = base == 16 ? hex_value(s[i])
+				       : (s[i] >= '0' && s[i] <= '9') ?
+						s[i] - '0' : -1;
+
+		if (digit < 0)
+			return -1;
+		if (val > (max - digit) / base)
+			return -1;
+		val = val * base + digit;
+	}
+
+	*valp = val;
+	return 0;
+}
+
+/*
+ * A 32-bit field the formatter prints with %d, so that values with the
+ * top bit set come out negative; those go back to the same bits.
+ */
+static int
+text_int32(const struct dp_text *t, uint64_t *valp)
+{
+	struct dp_text abs = *t;
+	uint64_t val;
+
+	if (!t->len || t->s[0] != '-')
+		return text_number(t, false, UINT32_MAX, valp);
+
+	abs.s++;
+	abs.len--;
+	if (text_number(&abs, false, (uint64_t)INT32_MAX + 1, &val) < 0 ||
+	    val == 0)
+		return -1;
+	*valp = (uint32_t)-(uint32_t)val;
+	return 0;
+}
+
+static bool
+text_is_number(const struct dp_text *t)
+{
+	uint64_t val;
+
+	return text_number(t, false, UINT64_MAX, &val) == 0;
+}
+
+static int
+text_guid(const struct dp_text *t, efi_guid_t *guid)
+{
+	if (t->len != GUID_STR_LEN)
+		return -1;
+	return decode_guid_text(t->s, guid);
+}
+
+/*
+ * Hex bytes, either run together or with sep between each pair of
+ * digits.  Returns how many there are; out can be NULL to just count,
+ * and at most max are allowed.
+ */
+static ssize_t
+text_hex_bytes(const struct dp_text *t, char sep, uint8_t *out, size_t max)
+{
+	size_t stride = sep ? 3 : 2;
+	size_t n;
+
+	if (!t->len)
+		return 0;
+	if ((t->len + (sep ? 1 : 0)) % stride)
+		return -1;
+
+	n = (t->len + (sep ? 1 : 0)) / stride;
+	if (n > max)
+		return -1;
+
+	for (size_t i = 0; i < n; i++) {
+		const char *s = t->s + i * stride;
+		int hi = hex_value(s[0]);
+		int lo = hex_value(s[1]);
+
+		if (hi < 0 || lo < 0)
+			return -1;
+		if (sep && i + 1 < n && s[2] != sep)
+			return -1;
+		if (out)
+			out[i] = hi << 4 | lo;
+	}
+	return n;
+}
+
+/*
+ * UTF-8 to UCS-2, decoded the same way utf8_to_ucs2() does.  Returns the
+ * number of characters, not counting the NUL we always add; out can be
+ * NULL to just count.
+ */
+static size_t
+text_ucs2(const struct dp_text *t, uint8_t *out)
+{
+	const unsigned char *s = (const unsigned char *)t->s;
+	size_t i = 0, j = 0;
+
+	while (i < t->len) {
+		uint16_t c;
+
+		if ((s[i] & 0xe0) == 0xe0 && !(s[i] & 0x10) &&
+		    i + 2 < t->len) {
+			c = ((s[i] & 0x0f) << 12) | ((s[i+1] & 0x3f) << 6) |
+			    (s[i+2] & 0x3f);
+			i += 3;
+		} else if ((s[i] & 0xc0) == 0xc0 && !(s[i] & 0x20) &&
+			   i + 1 < t->len) {
+			c = ((s[i] & 0x1f) << 6) | (s[i+1] & 0x3f);
+			i += 2;
+		} else {
+			c = s[i] & 0x7f;
+			i += 1;
+		}
+		if (out) {
+			out[j * 2] = c & 0xff;
+			out[j * 2 + 1] = c >> 8;
+		}
+		j++;
+	}
+	if (out) {
+		out[j * 2] = 0;
+		out[j * 2 + 1] = 0;
+	}
+	return j;
+}
+
+/*
+ * Pulls one argument off args for each character of spec, and fails
+ * unless that's all of them:
+ *
+ *   1 2 4 8	a number that fits in that many bytes, into a uint64_t
+ *   x1 ... x8	the same, but hex even without 0x
+ *   d		a 32-bit number that may be negative, into a uint64_t
+ *   g		a GUID, into an efi_guid_t
+ *   s		anything, into a struct dp_text
+ *
+ * Arguments after a '|' can be left off; their destinations aren't
+ * touched, except that a missing 's' comes back empty.  Returns how many
+ * arguments there were.
+ */
+static int
+scan_args(const struct dp_node_parser *np, struct dp_text *args,
+	  const char *spec, ...)
+{
+	bool optional = false;
+	int n = 0;
+	va_list ap;
+	int rc = -1;
+
+	va_start(ap, spec);
+	for (; *spec; spec++) {
+		struct dp_text arg;
+		bool hex = false;
+
+		if (*spec == '|') {
+			optional = true;
+			continue;
+		}
+		if (*spec == 'x') {
+			hex = true;
+			spec++;
+		}
+
+		if (!text_next_arg(args, &arg)) {
+			if (!optional) {
+				errno = EINVAL;
+				efi_error("%s(): too few arguments", np->name);
+				goto out;
+			}
+			if (*spec == 's') {
+				struct dp_text *t = va_arg(ap, struct dp_text *);
+
+				t->s = NULL;
+				t->len = 0;
+			} else {
+				(void)va_arg(ap, void *);
+			}
+			continue;
+		}
+		n++;
+
+		switch (*spec) {
+		case '1':
+		case '2':
+		case '4':
+		case '8': {
+			uint64_t *val = va_arg(ap, uint64_t *);
+			unsigned int bits = (*spec - '0') * 8;
+			uint64_t max = bits == 64 ? UINT64_MAX
+						  : (1ull << bits) - 1;
+
+			if (text_number(&arg, hex, max, val) < 0) {
+				parse_error(np, &arg, "number");
+				goto out;
+			}
+			break;
+		}
+		case 'd':
+			if (text_int32(&arg, va_arg(ap, uint64_t *)) < 0) {
+				parse_error(np, &arg, "number");
+				goto out;
+			}
+			break;
+		case 'g':
+			if (text_guid(&arg, va_arg(ap, efi_guid_t *)) < 0) {
+				parse_error(np, &arg, "GUID");
+				goto out;
+			}
+			break;
+		case 's':
+			*va_arg(ap, struct dp_text *) = arg;
+			break;
+		}
+	}
+
+	if (args->s) {
+		errno = EINVAL;
+		efi_error("%s(): too many arguments", np->name);
+		goto out;
+	}
+	rc = n;
+out:
+	va_end(ap);
+	return rc;
+}
+
+static ssize_t
+make_node(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  size_t req)
+{
+	if (req > UINT16_MAX) {
+		errno = EOVERFLOW;
+		efi_error("%s() node is too big", np->name);
+		return -1;
+	}
+	return efidp_make_generic(buf, size, np->type, np->subtype, req);
+}
+
+/*
+ * Nodes that are only known by number: Path(type,subtype,hex) and the
+ * per-type HardwarePath(), AcpiPath(), Msg(), MediaPath(), and BbsPath().
+ */
+static ssize_t
+parse_raw(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	uint64_t type = np->type, subtype;
+	struct dp_text data;
+	ssize_t n, sz, req;
+	int rc;
+
+	if (np->type)
+		rc = scan_args(np, args, "1|s", &subtype, &data);
+	else
+		rc = scan_args(np, args, "11|s", &type, &subtype, &data);
+	if (rc < 0)
+		return -1;
+
+	n = text_hex_bytes(&data, 0, NULL, UINT16_MAX);
+	if (n < 0)
+		return parse_error(np, &data, "data");
+
+	req = sizeof(efidp_header) + n;
+	if (req > UINT16_MAX) {
+		errno = EOVERFLOW;
+		efi_error("%s() node is too big", np->name);
+		return -1;
+	}
+	sz = efidp_make_generic(buf, size, type, subtype, req);
+	if (size && sz == req)
+		text_hex_bytes(&data, 0, buf + sizeof(efidp_header), n);
+	return sz;
+}
+
+/* VenHw(), VenMsg(), VenMedia(), and the named ones like VenVt100() */
+static ssize_t
+parse_vendor(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	     struct dp_text *args)
+{
+	efi_guid_t guid = np->guid;
+	struct dp_text data;
+	ssize_t n, sz, req;
+	int rc;
+
+	if (efi_guid_is_zero(&np->guid))
+		rc = scan_args(np, args, "g|s", &guid, &data);
+	else
+		rc = scan_args(np, args, "|s", &data);
+	if (rc < 0)
+		return -1;
+
+	n = text_hex_bytes(&data, 0, NULL, UINT16_MAX);
+	if (n < 0)
+		return parse_error(np, &data, "vendor data");
+
+	req = sizeof(efidp_hw_vendor) + n;
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp_hw_vendor *vend = (efidp_hw_vendor *)buf;
+
+		memcpy(&vend->vendor_guid, &guid, sizeof(guid));
+		text_hex_bytes(&data, 0, vend->vendor_data, n);
+	}
+	return sz;
+}
+
+/* Media(), FvFile(), FvVol(), and NVDIMM(): one GUID is all there is */
+static ssize_t
+parse_guid_node(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+		struct dp_text *args)
+{
+	efi_guid_t guid;
+	ssize_t req = sizeof(efidp_protocol);
+	ssize_t sz;
+
+	if (scan_args(np, args, "g", &guid) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req)
+		memcpy(&((efidp)buf)->protocol.protocol_guid, &guid,
+		       sizeof(guid));
+	return sz;
+}
+
+/*
+ * Hardware
+ */
+static ssize_t
+parse_pci(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	uint64_t device, function;
+
+	if (scan_args(np, args, "11", &device, &function) < 0)
+		return -1;
+	return efidp_make_pci(buf, size, device, function);
+}
+
+static ssize_t
+parse_pccard(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	     struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_pccard);
+	uint64_t function;
+	ssize_t sz;
+
+	if (scan_args(np, args, "1", &function) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req)
+		((efidp)buf)->pccard.function = function;
+	return sz;
+}
+
+static ssize_t
+parse_mmio(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_mmio);
+	uint64_t memory_type, start, end;
+	ssize_t sz;
+
+	if (scan_args(np, args, "488", &memory_type, &start, &end) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->mmio.memory_type = memory_type;
+		dp->mmio.starting_address = start;
+		dp->mmio.ending_address = end;
+	}
+	return sz;
+}
+
+static ssize_t
+parse_edd10(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	    struct dp_text *args)
+{
+	uint64_t hardware_device;
+
+	if (scan_args(np, args, "4", &hardware_device) < 0)
+		return -1;
+	return efidp_make_edd10(buf, size, hardware_device);
+}
+
+static ssize_t
+parse_controller(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+		 struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_controller);
+	uint64_t controller;
+	ssize_t sz;
+
+	if (scan_args(np, args, "4", &controller) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req)
+		((efidp)buf)->controller.controller = controller;
+	return sz;
+}
+
+static ssize_t
+parse_bmc(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_bmc);
+	uint64_t interface_type, base_addr;
+	ssize_t sz;
+
+	if (scan_args(np, args, "18", &interface_type, &base_addr) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->bmc.interface_type = interface_type;
+		dp->bmc.base_addr = base_addr;
+	}
+	return sz;
+}
+
+/*
+ * ACPI
+ */
+
+/*
+ * PciRoot(), PcieRoot(), AcpiContainer(), EmbeddedController(),
+ * Floppy(), Keyboard(), Serial(), and NvRoot() are all one HID.  A UID
+ * that isn't a number means the formatter found it as a string in an
+ * extended node.
+ */
+static ssize_t
+parse_acpi_hid_named(uint8_t *buf, ssize_t size,
+		     const struct dp_node_parser *np, struct dp_text *args)
+{
+	struct dp_text uidstr;
+	uint64_t uid = 0;
+	int rc;
+
+	rc = scan_args(np, args, "|s", &uidstr);
+	if (rc < 0)
+		return -1;
+	if (rc > 0 && text_number(&uidstr, false, UINT32_MAX, &uid) < 0) {
+		char str[uidstr.len + 1];
+
+		memcpy(str, uidstr.s, uidstr.len);
+		str[uidstr.len] = '\0';
+		return efidp_make_acpi_hid_ex(buf, size, np->value, 0, 0,
+					      NULL, str, NULL);
+	}
+	return efidp_make_acpi_hid(buf, size, np->value, uid);
+}
+
+static ssize_t
+parse_acpi_hid(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	       struct dp_text *args)
+{
+	uint64_t hid, uid;
+
+	if (scan_args(np, args, "44", &hid, &uid) < 0)
+		return -1;
+	return efidp_make_acpi_hid(buf, size, hid, uid);
+}
+
+/*
+ * AcpiEx(hid,cid,uid) and AcpiExp(hid,cid,uid): each of them is either a
+ * number or the string that goes in the node instead.
+ */
+static ssize_t
+parse_acpi_hid_ex(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+		  struct dp_text *args)
+{
+	struct dp_text fields[3];
+	uint64_t vals[3] = { 0, 0, 0 };
+	size_t lens[3] = { 0, 0, 0 };
+
+	if (scan_args(np, args, "sss", &fields[0], &fields[1],
+		      &fields[2]) < 0)
+		return -1;
+
+	for (int i = 0; i < 3; i++) {
+		if (text_is_number(&fields[i])) {
+			if (text_number(&fields[i], false, UINT32_MAX,
+					&vals[i]) < 0)
+				return parse_error(np, &fields[i], "number");
+		} else {
+			lens[i] = fields[i].len + 1;
+		}
+	}
+
+	char hidstr[lens[0] + 1], cidstr[lens[1] + 1], uidstr[lens[2] + 1];
+	char *strs[3] = { hidstr, cidstr, uidstr };
+
+	for (int i = 0; i < 3; i++) {
+		if (lens[i]) {
+			memcpy(strs[i], fields[i].s, fields[i].len);
+			strs[i][fields[i].len] = '\0';
+		}
+	}
+
+	return efidp_make_acpi_hid_ex(buf, size, vals[0], vals[2], vals[1],
+				      lens[0] ? hidstr : NULL,
+				      lens[2] ? uidstr : NULL,
+				      lens[1] ? cidstr : NULL);
+}
+
+static ssize_t
+parse_acpi_adr(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	       struct dp_text *args)
+{
+	struct dp_text all = *args, arg;
+	ssize_t n = 0, req, sz;
+	uint64_t adr;
+
+	/* AcpiAdr() is a node with no _ADRs in it, which prints that way */
+	while (text_next_arg(&all, &arg)) {
+		if (text_number(&arg, false, UINT32_MAX, &adr) < 0)
+			return parse_error(np, &arg, "_ADR");
+		n++;
+	}
+
+	req = sizeof(efidp_acpi_adr) + n * sizeof(uint32_t);
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp_acpi_adr *adrdp = (efidp_acpi_adr *)buf;
+		uint32_t val;
+
+		for (ssize_t i = 0; text_next_arg(args, &arg); i++) {
+			text_number(&arg, false, UINT32_MAX, &adr);
+			val = adr;
+			memcpy(&adrdp->adr[i], &val, sizeof(val));
+		}
+	}
+	return sz;
+}
+
+/*
+ * NvDimm() on its own is the _ADR node under NvRoot().  The formatter
+ * also prints that node's NvDimm()s right after NvRoot(), before the
+ * same _ADR node shows up again as AcpiAdr(); the path parser skips
+ * those.
+ */
+static ssize_t
+parse_nvdimm_adr(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+		 struct dp_text *args)
+{
+	uint64_t node_controller, socket, memory_controller, channel, dimm;
+	ssize_t req = sizeof(efidp_acpi_adr) + sizeof(uint32_t);
+	ssize_t sz;
+
+	if (scan_args(np, args, "22111", &node_controller, &socket,
+		      &memory_controller, &channel, &dimm) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		uint32_t adr = efidp_encode_bitfield_(node_controller,
+				EFIDP_ACPI_ADR_NVDIMM_NODE_CONTROLLER_SHIFT,
+				EFIDP_ACPI_ADR_NVDIMM_NODE_CONTROLLER_MASK) |
+			efidp_encode_bitfield_(socket,
+				EFIDP_ACPI_ADR_NVDIMM_SOCKET_ID_SHIFT,
+				EFIDP_ACPI_ADR_NVDIMM_SOCKET_ID_MASK) |
+			efidp_encode_bitfield_(memory_controller,
+				EFIDP_ACPI_ADR_NVDIMM_MEMORY_CONTROLLER_SHIFT,
+				EFIDP_ACPI_ADR_NVDIMM_MEMORY_CONTROLLER_MASK) |
+			efidp_encode_bitfield_(channel,
+				EFIDP_ACPI_ADR_NVDIMM_MEMORY_CHANNEL_SHIFT,
+				EFIDP_ACPI_ADR_NVDIMM_MEMORY_CHANNEL_MASK) |
+			efidp_encode_bitfield_(dimm,
+				EFIDP_ACPI_ADR_NVDIMM_DIMM_SHIFT,
+				EFIDP_ACPI_ADR_NVDIMM_DIMM_MASK);
+
+		memcpy(((efidp_acpi_adr *)buf)->adr, &adr, sizeof(adr));
+	}
+	return sz;
+}
+
+/*
+ * Messaging
+ */
+static ssize_t
+parse_atapi(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	    struct dp_text *args)
+{
+	uint64_t primary, slave, lun;
+
+	if (scan_args(np, args, "112", &primary, &slave, &lun) < 0)
+		return -1;
+	return efidp_make_atapi(buf, size, primary, slave, lun);
+}
+
+static ssize_t
+parse_scsi(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	uint64_t target, lun;
+
+	if (scan_args(np, args, "22", &target, &lun) < 0)
+		return -1;
+	return efidp_make_scsi(buf, size, target, lun);
+}
+
+/* Fibre() is printed the same for both kinds; this makes the old one */
+static ssize_t
+parse_fibre(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	    struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_fc);
+	uint64_t wwn, lun;
+	ssize_t sz;
+
+	if (scan_args(np, args, "x8x8", &wwn, &lun) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->fc.reserved = 0;
+		dp->fc.wwn = cpu_to_le64(wwn);
+		dp->fc.lun = cpu_to_le64(lun);
+	}
+	return sz;
+}
+
+static ssize_t
+parse_1394(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_1394);
+	uint64_t guid;
+	ssize_t sz;
+
+	if (scan_args(np, args, "8", &guid) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->firewire.reserved = 0;
+		dp->firewire.guid = guid;
+	}
+	return sz;
+}
+
+static ssize_t
+parse_usb(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_usb);
+	uint64_t parent_port, interface;
+	ssize_t sz;
+
+	if (scan_args(np, args, "11", &parent_port, &interface) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->usb.parent_port = parent_port;
+		dp->usb.interface = interface;
+	}
+	return sz;
+}
+
+static ssize_t
+parse_i2o(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_i2o);
+	uint64_t target;
+	ssize_t sz;
+
+	if (scan_args(np, args, "d", &target) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req)
+		((efidp)buf)->i2o.target = target;
+	return sz;
+}
+
+/*
+ * The port GID is printed as its two halves, each 16 digits.  Before
+ * version 39 the halves weren't padded, so shorter text can't always be
+ * split the way it was printed; the last 16 digits are taken to be the
+ * low half.
+ */
+static ssize_t
+parse_infiniband(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+		 struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_infiniband);
+	uint64_t flags, gid[2] = { 0, 0 }, ioc_guid, target_port_id, device_id;
+	struct dp_text gidstr;
+	ssize_t sz;
+
+	if (scan_args(np, args, "x4sx888", &flags, &gidstr, &ioc_guid,
+		      &target_port_id, &device_id) < 0)
+		return -1;
+
+	if (gidstr.len > 32)
+		return parse_error(np, &gidstr, "port GID");
+	if (gidstr.len > 16) {
+		struct dp_text hi = { gidstr.s, gidstr.len - 16 };
+		struct dp_text lo = { gidstr.s + hi.len, 16 };
+
+		if (text_number(&hi, true, UINT64_MAX, &gid[1]) < 0 ||
+		    text_number(&lo, true, UINT64_MAX, &gid[0]) < 0)
+			return parse_error(np, &gidstr, "port GID");
+	} else if (text_number(&gidstr, true, UINT64_MAX, &gid[0]) < 0) {
+		return parse_error(np, &gidstr, "port GID");
+	}
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->infiniband.resource_flags = flags;
+		dp->infiniband.port_gid[0] = gid[0];
+		dp->infiniband.port_gid[1] = gid[1];
+		dp->infiniband.ioc_guid = ioc_guid;
+		dp->infiniband.target_port_id = target_port_id;
+		dp->infiniband.device_id = device_id;
+	}
+	return sz;
+}
+
+static ssize_t
+parse_mac(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	uint8_t mac_addr[32] = { 0, };
+	struct dp_text addr;
+	uint64_t if_type;
+	ssize_t n;
+
+	if (scan_args(np, args, "s1", &addr, &if_type) < 0)
+		return -1;
+
+	n = text_hex_bytes(&addr, 0, mac_addr, sizeof(mac_addr));
+	if (n <= 0)
+		return parse_error(np, &addr, "MAC address");
+
+	return efidp_make_mac_addr(buf, size, if_type, mac_addr,
+				   sizeof(mac_addr));
+}
+
+/* a.b.c.d, with no leading zeroes, which %hhu never prints */
+static int
+text_ipv4(const struct dp_text *t, uint8_t addr[4])
+{
+	const char *s = t->s, *end = t->s + t->len;
+
+	for (int i = 0; i < 4; i++) {
+		struct dp_text octet = { s, 0 };
+		uint64_t val;
+
+		while (s < end && *s != '.')
+			s++;
+		octet.len = s - octet.s;
+		if ((octet.len > 1 && octet.s[0] == '0') ||
+		    text_number(&octet, false, UINT8_MAX, &val) < 0)
+			return -1;
+		addr[i] = val;
+
+		if (i < 3) {
+			if (s == end)
+				return -1;
+			s++;
+		}
+	}
+	return s == end ? 0 : -1;
+}
+
+/* a.b.c.d[:port] */
+static int
+text_ipv4_port(const struct dp_text *t, uint8_t addr[4], uint64_t *port)
+{
+	struct dp_text a = *t, p;
+	const char *colon = memchr(t->s, ':', t->len);
+
+	*port = 0;
+	if (colon) {
+		a.len = colon - t->s;
+		p.s = colon + 1;
+		p.len = t->len - a.len - 1;
+		if ((p.len > 1 && p.s[0] == '0') ||
+		    text_number(&p, false, UINT16_MAX, port) < 0)
+			return -1;
+	}
+	return text_ipv4(&a, addr);
+}
+
+/* find "<->" in t, or return NULL */
+static const char *
+text_arrow(const struct dp_text *t)
+{
+	for (size_t i = 0; i + 3 <= t->len; i++)
+		if (!memcmp(t->s + i, "<->", 3))
+			return t->s + i;
+	return NULL;
+}
+
+/*
+ * The local and remote addresses are separated by "<->".  Older versions
+ * printed them with nothing in between, so without one, every place the
+ * pair could be split is tried, and it has to come apart exactly one way.
+ * A gateway and subnet mask may follow the protocol and static flag.
+ * Ports and protocols are stored just as they're printed.
+ */
+static ssize_t
+parse_ipv4(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_ipv4_addr);
+	uint8_t local[4], remote[4], gateway[4] = { 0, }, netmask[4] = { 0, };
+	uint64_t local_port = 0, remote_port = 0, protocol, is_static;
+	struct dp_text addrs, l, r;
+	struct dp_text gw = { NULL, 0 }, mask = { NULL, 0 };
+	const char *arrow;
+	int found = 0;
+	ssize_t sz;
+
+	if (scan_args(np, args, "sx2x1|ss", &addrs, &protocol, &is_static,
+		      &gw, &mask) < 0)
+		return -1;
+
+	arrow = text_arrow(&addrs);
+	if (arrow) {
+		l.s = addrs.s;
+		l.len = arrow - addrs.s;
+		r.s = arrow + 3;
+		r.len = addrs.len - l.len - 3;
+		if (!text_ipv4_port(&l, local, &local_port) &&
+		    !text_ipv4_port(&r, remote, &remote_port))
+			found = 1;
+	} else {
+		for (size_t i = 7; i + 7 <= addrs.len; i++) {
+			uint8_t la[4], ra[4];
+			uint64_t lp, rp;
+
+			l.s = addrs.s;
+			l.len = i;
+			r.s = addrs.s + i;
+			r.len = addrs.len - i;
+			if (text_ipv4_port(&l, la, &lp) < 0 ||
+			    text_ipv4_port(&r, ra, &rp) < 0)
+				continue;
+			if (found++)
+				break;
+			memcpy(local, la, sizeof(local));
+			memcpy(remote, ra, sizeof(remote));
+			local_port = lp;
+			remote_port = rp;
+		}
+	}
+	if (found != 1)
+		return parse_error(np, &addrs, "addresses");
+
+	if (gw.s && text_ipv4(&gw, gateway) < 0)
+		return parse_error(np, &gw, "gateway");
+	if (mask.s && text_ipv4(&mask, netmask) < 0)
+		return parse_error(np, &mask, "subnet mask");
+	if (gw.s && !mask.s)
+		return parse_error(np, &gw, "gateway without a subnet mask");
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp_ipv4_addr *ipv4 = (efidp_ipv4_addr *)buf;
+
+		memset(buf + sizeof(efidp_header), 0,
+		       req - sizeof(efidp_header));
+		memcpy(ipv4->local_ipv4_addr, local, sizeof(local));
+		memcpy(ipv4->remote_ipv4_addr, remote, sizeof(remote));
+		ipv4->local_port = local_port;
+		ipv4->remote_port = remote_port;
+		ipv4->protocol = protocol;
+		ipv4->static_ip_addr = is_static;
+		memcpy(ipv4->gateway, gateway, sizeof(gateway));
+		memcpy(ipv4->netmask, netmask, sizeof(netmask));
+	}
+	return sz;
+}
+
+/* [a:b::c], with each group stored in network order */
+static int
+text_ipv6(const struct dp_text *t, uint8_t addr[16])
+{
+	uint16_t groups[8] = { 0, };
+	const char *s = t->s + 1, *end = t->s + t->len - 1;
+	int n = 0, gap = -1;
+
+	if (t->len < 4 || t->s[0] != '[' || *end != ']')
+		return -1;
+
+	if (end - s >= 2 && s[0] == ':' && s[1] == ':') {
+		gap = 0;
+		s += 2;
+	}
+	while (s < end) {
+		struct dp_text group = { s, 0 };
+		uint64_t val;
+
+		if (n == 8)
+			return -1;
+		while (s < end && *s != ':')
+			s++;
+		group.len = s - group.s;
+		if (group.len > 4 ||
+		    text_number(&group, true, UINT16_MAX, &val) < 0)
+			return -1;
+		groups[n++] = htons(val);
+
+		if (s < end) {
+			s++;
+			if (s < end && *s == ':') {
+				if (gap >= 0)
+					return -1;
+				gap = n;
+				s++;
+			} else if (s == end) {
+				return -1;
+			}
+		}
+	}
+
+	if (gap >= 0) {
+		int tail = n - gap;
+
+		if (n == 8)
+			return -1;
+		memmove(&groups[8 - tail], &groups[gap],
+			tail * sizeof(groups[0]));
+		memset(&groups[gap], 0, (8 - n) * sizeof(groups[0]));
+	} else if (n != 8) {
+		return -1;
+	}
+
+	memcpy(addr, groups, sizeof(groups));
+	return 0;
+}
+
+/* [addr]:port */
+static int
+text_ipv6_port(const struct dp_text *t, uint8_t addr[16], uint64_t *port)
+{
+	const char *close = memchr(t->s, ']', t->len);
+	struct dp_text a, p;
+
+	if (!close || close + 1 == t->s + t->len || close[1] != ':')
+		return -1;
+
+	a.s = t->s;
+	a.len = close + 1 - t->s;
+	p.s = close + 2;
+	p.len = t->len - a.len - 1;
+	if (text_number(&p, false, UINT16_MAX, port) < 0)
+		return -1;
+	return text_ipv6(&a, addr);
+}
+
+/*
+ * The prefix length and gateway are optional; with them the node is the
+ * full UEFI 2.4 one, the same as efidp_make_ipv6() makes.
+ */
+static ssize_t
+parse_ipv6(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_ipv6_addr);
+	uint8_t local[16], remote[16], gateway[16] = { 0, };
+	uint64_t local_port, remote_port, protocol, origin, prefix = 0;
+	struct dp_text addrs, l, r, gw = { NULL, 0 };
+	const char *arrow;
+	ssize_t sz;
+
+	if (scan_args(np, args, "sx2x1|1s", &addrs, &protocol, &origin,
+		      &prefix, &gw) < 0)
+		return -1;
+
+	arrow = text_arrow(&addrs);
+	if (!arrow)
+		return parse_error(np, &addrs, "addresses");
+
+	l.s = addrs.s;
+	l.len = arrow - addrs.s;
+	r.s = arrow + 3;
+	r.len = addrs.len - l.len - 3;
+	if (text_ipv6_port(&l, local, &local_port) < 0 ||
+	    text_ipv6_port(&r, remote, &remote_port) < 0)
+		return parse_error(np, &addrs, "addresses");
+
+	if (gw.s) {
+		if (text_ipv6(&gw, gateway) < 0)
+			return parse_error(np, &gw, "gateway");
+		req = offsetof(efidp_ipv6_addr, gateway_ipv6_addr) +
+		      sizeof(gateway);
+	}
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp_ipv6_addr *ipv6 = (efidp_ipv6_addr *)buf;
+
+		memset(buf + sizeof(efidp_header), 0,
+		       req - sizeof(efidp_header));
+		memcpy(ipv6->local_ipv6_addr, local, sizeof(local));
+		memcpy(ipv6->remote_ipv6_addr, remote, sizeof(remote));
+		ipv6->local_port = local_port;
+		ipv6->remote_port = remote_port;
+		ipv6->protocol = protocol;
+		ipv6->ip_addr_origin = origin;
+		ipv6->prefix_length = prefix;
+		if (gw.s)
+			memcpy(buf + offsetof(efidp_ipv6_addr,
+					      gateway_ipv6_addr),
+			       gateway, sizeof(gateway));
+	}
+	return sz;
+}
+
+static ssize_t
+parse_uart_flow_control(uint8_t *buf, ssize_t size,
+			const struct dp_node_parser *np, struct dp_text *args)
+{
+	static const char * const labels[] = { "None", "Hardware", "XonXoff" };
+	ssize_t req = sizeof(efidp_uart_flow_control);
+	struct dp_text arg;
+	uint64_t map = UINT64_MAX;
+	ssize_t sz;
+
+	if (scan_args(np, args, "s", &arg) < 0)
+		return -1;
+
+	for (unsigned int i = 0; i < sizeof(labels) / sizeof(labels[0]); i++)
+		if (text_eq(&arg, labels[i]))
+			map = i;
+	if (map == UINT64_MAX &&
+	    text_number(&arg, false, UINT32_MAX, &map) < 0)
+		return parse_error(np, &arg, "flow control");
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp_uart_flow_control *fc = (efidp_uart_flow_control *)buf;
+
+		memcpy(&fc->vendor_guid, &np->guid, sizeof(np->guid));
+		fc->flow_control_map = map;
+	}
+	return sz;
+}
+
+/*
+ * SAS(address,lun,rtp,NoTopology) or
+ * SAS(address,lun,rtp,SAS|SATA,Internal|External,Direct|Expanded,bay).
+ * The formatter's labels don't quite cover every device type, so SAS and
+ * SATA are taken at their word here.  This always makes the vendor node;
+ * SAS Ex nodes print the same way.
+ */
+static ssize_t
+parse_sas(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_sas);
+	uint64_t address, lun, rtp, bay = 0;
+	struct dp_text type, location, connect;
+	uint8_t topology = 0;
+	int rc;
+	ssize_t sz;
+
+	rc = scan_args(np, args, "x8x8x2s|ss2", &address, &lun, &rtp, &type,
+		       &location, &connect, &bay);
+	if (rc < 0)
+		return -1;
+
+	if (text_eq(&type, "NoTopology")) {
+		if (rc != 4)
+			return parse_error(np, &type, "topology");
+	} else {
+		bool sata = text_eq(&type, "SATA");
+		bool external = text_eq(&location, "External");
+		uint8_t device;
+
+		if ((!sata && !text_eq(&type, "SAS")) || rc < 6 ||
+		    (!external && !text_eq(&location, "Internal")) ||
+		    (!text_eq(&connect, "Direct") &&
+		     !text_eq(&connect, "Expanded")) ||
+		    (rc == 7 && bay == 0))
+			return parse_error(np, &type, "topology");
+
+		device = external ? (sata ? EFIDP_SAS_DEVICE_SATA_EXTERNAL
+					  : EFIDP_SAS_DEVICE_SAS_EXTERNAL)
+				  : (sata ? EFIDP_SAS_DEVICE_SATA_INTERNAL
+					  : EFIDP_SAS_DEVICE_SAS_INTERNAL);
+		topology = EFIDP_SAS_TOPOLOGY_NEXTBYTE |
+			   device << EFIDP_SAS_DEVICE_SHIFT;
+		if (text_eq(&connect, "Expanded"))
+			topology |= EFIDP_SAS_CONNECT_EXPANDER
+				    << EFIDP_SAS_CONNECT_SHIFT;
+		if (bay > 0)
+			bay--;
+	}
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp_sas *sas = (efidp_sas *)buf;
+
+		memcpy(&sas->vendor_guid, &np->guid, sizeof(np->guid));
+		sas->reserved = 0;
+		sas->sas_address = cpu_to_le64(address);
+		sas->lun = cpu_to_le64(lun);
+		sas->device_topology_info = topology;
+		sas->drive_bay_id = bay;
+		sas->rtp = rtp;
+	}
+	return sz;
+}
+
+static ssize_t
+parse_uart(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	static const char parity_labels[] = "DNEOMS";
+	static const char * const stop_labels[] = { "D", "1", "1.5", "2" };
+	ssize_t req = sizeof(efidp_uart);
+	uint64_t baud_rate, data_bits, parity = UINT64_MAX, stop = UINT64_MAX;
+	struct dp_text parity_text, stop_text;
+	ssize_t sz;
+
+	if (scan_args(np, args, "81ss", &baud_rate, &data_bits, &parity_text,
+		      &stop_text) < 0)
+		return -1;
+
+	if (parity_text.len == 1) {
+		const char *p = memchr(parity_labels, parity_text.s[0],
+				       sizeof(parity_labels) - 1);
+		if (p)
+			parity = p - parity_labels;
+	}
+	if (parity == UINT64_MAX &&
+	    text_number(&parity_text, false, UINT8_MAX, &parity) < 0)
+		return parse_error(np, &parity_text, "parity");
+
+	for (unsigned int i = 0; i < 4; i++)
+		if (text_eq(&stop_text, stop_labels[i]))
+			stop = i;
+	if (stop == UINT64_MAX &&
+	    text_number(&stop_text, false, UINT8_MAX, &stop) < 0)
+		return parse_error(np, &stop_text, "stop bits");
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->uart.reserved = 0;
+		dp->uart.baud_rate = baud_rate;
+		dp->uart.data_bits = data_bits;
+		dp->uart.parity = parity;
+		dp->uart.stop_bits = stop;
+	}
+	return sz;
+}
+
+/*
+ * UsbAudio() and friends know their class, and the 254 ones their
+ * subclass too.  UsbClass() only prints the subclass and protocol, so it
+ * takes the class as an extra first argument if it's given one, the way
+ * the UEFI spec writes it, and vendor specific (0xff) if not.
+ */
+static ssize_t
+parse_usb_class(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+		struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_usb_class);
+	uint64_t vendor_id, product_id, class = np->value, subclass, protocol;
+	uint64_t extra = UINT64_MAX;
+	ssize_t sz;
+	int rc;
+
+	if (np->value == 0) {
+		rc = scan_args(np, args, "x2x211|1", &vendor_id, &product_id,
+			       &subclass, &protocol, &extra);
+		if (rc < 0)
+			return -1;
+		class = 0xff;
+		if (rc == 5) {
+			class = subclass;
+			subclass = protocol;
+			protocol = extra;
+		}
+	} else if (np->value > 0xff) {
+		class = EFIDP_USB_CLASS_254;
+		subclass = np->value & 0xff;
+		if (scan_args(np, args, "221", &vendor_id, &product_id,
+			      &protocol) < 0)
+			return -1;
+	} else {
+		if (scan_args(np, args, "2211", &vendor_id, &product_id,
+			      &subclass, &protocol) < 0)
+			return -1;
+	}
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->usb_class.vendor_id = vendor_id;
+		dp->usb_class.product_id = product_id;
+		dp->usb_class.device_class = class;
+		dp->usb_class.device_subclass = subclass;
+		dp->usb_class.device_protocol = protocol;
+	}
+	return sz;
+}
+
+static ssize_t
+parse_usb_wwid(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	       struct dp_text *args)
+{
+	uint64_t vendor_id, product_id, interface;
+	struct dp_text serial;
+	ssize_t req, sz;
+
+	if (scan_args(np, args, "x2x22s", &vendor_id, &product_id,
+		      &interface, &serial) < 0)
+		return -1;
+
+	req = offsetof(efidp_usb_wwid, serial_number) +
+	      (text_ucs2(&serial, NULL) + 1) * sizeof(uint16_t);
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->usb_wwid.interface = interface;
+		dp->usb_wwid.vendor_id = vendor_id;
+		dp->usb_wwid.product_id = product_id;
+		text_ucs2(&serial,
+			  buf + offsetof(efidp_usb_wwid, serial_number));
+	}
+	return sz;
+}
+
+static ssize_t
+parse_lun(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_lun);
+	uint64_t lun;
+	ssize_t sz;
+
+	if (scan_args(np, args, "1", &lun) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req)
+		((efidp)buf)->lun.lun = lun;
+	return sz;
+}
+
+static ssize_t
+parse_sata(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	uint64_t hba_port, port_multiplier_port, lun;
+
+	if (scan_args(np, args, "222", &hba_port, &port_multiplier_port,
+		      &lun) < 0)
+		return -1;
+	return efidp_make_sata(buf, size, hba_port, port_multiplier_port, lun);
+}
+
+static ssize_t
+parse_iscsi(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	    struct dp_text *args)
+{
+	uint64_t tpgt, lun;
+	struct dp_text name, header, data, auth, protocol_text;
+	uint64_t protocol = 0;
+	uint16_t options = 0;
+	ssize_t req, sz;
+
+	if (scan_args(np, args, "s28ssss", &name, &tpgt, &lun, &header,
+		      &data, &auth, &protocol_text) < 0)
+		return -1;
+
+	if (name.len > EFIDP_ISCSI_MAX_TARGET_NAME_LEN)
+		return parse_error(np, &name, "target name");
+
+	if (text_eq(&header, "CRC32"))
+		options |= EFIDP_ISCSI_HEADER_CRC32
+			   << EFIDP_ISCSI_HEADER_DIGEST_SHIFT;
+	else if (!text_eq(&header, "None"))
+		return parse_error(np, &header, "header digest");
+
+	if (text_eq(&data, "CRC32"))
+		options |= EFIDP_ISCSI_DATA_CRC32
+			   << EFIDP_ISCSI_DATA_DIGEST_SHIFT;
+	else if (!text_eq(&data, "None"))
+		return parse_error(np, &data, "data digest");
+
+	if (text_eq(&auth, "None"))
+		options |= EFIDP_ISCSI_AUTH_NONE << EFIDP_ISCSI_AUTH_SHIFT;
+	else if (text_eq(&auth, "CHAP_UNI"))
+		options |= EFIDP_ISCSI_CHAP_UNI << EFIDP_ISCSI_CHAP_SHIFT;
+	else if (!text_eq(&auth, "CHAP_BI"))
+		return parse_error(np, &auth, "authentication");
+
+	/*
+	 * Before version 39 every protocol but TCP was printed as
+	 * "Unknown", so which one it was is gone; 1 is as good as any.
+	 */
+	if (text_eq(&protocol_text, "Unknown"))
+		protocol = 1;
+	else if (!text_eq(&protocol_text, "TCP") &&
+		 (text_number(&protocol_text, false, UINT16_MAX,
+			      &protocol) < 0 ||
+		  protocol == 0))
+		return parse_error(np, &protocol_text, "protocol");
+
+	req = offsetof(efidp_iscsi, target_name) + name.len;
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+		uint64_t be_lun = cpu_to_be64(lun);
+
+		dp->iscsi.protocol = protocol;
+		dp->iscsi.options = options;
+		memcpy(dp->iscsi.lun, &be_lun, sizeof(be_lun));
+		dp->iscsi.tpgt = tpgt;
+		memcpy(buf + offsetof(efidp_iscsi, target_name), name.s,
+		       name.len);
+	}
+	return sz;
+}
+
+static ssize_t
+parse_vlan(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_vlan);
+	uint64_t vlan_id;
+	ssize_t sz;
+
+	if (scan_args(np, args, "2", &vlan_id) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req)
+		((efidp)buf)->vlan.vlan_id = vlan_id;
+	return sz;
+}
+
+static ssize_t
+parse_nvme(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	uint8_t eui[8];
+	uint64_t namespace_id;
+	struct dp_text euistr;
+
+	if (scan_args(np, args, "4s", &namespace_id, &euistr) < 0)
+		return -1;
+	if (text_hex_bytes(&euistr, '-', eui, sizeof(eui)) != sizeof(eui))
+		return parse_error(np, &euistr, "EUI-64");
+	return efidp_make_nvme(buf, size, namespace_id, eui);
+}
+
+/* Uri() and the iSCSI target name are raw bytes, with no NUL */
+static ssize_t
+parse_uri(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	struct dp_text uri = *args;
+	ssize_t req = sizeof(efidp_uri) + uri.len;
+	ssize_t sz;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req && uri.len)
+		memcpy(buf + sizeof(efidp_uri), uri.s, uri.len);
+	return sz;
+}
+
+static ssize_t
+parse_ufs(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_ufs);
+	uint64_t target_id, lun;
+	ssize_t sz;
+
+	if (scan_args(np, args, "11", &target_id, &lun) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->ufs.target_id = target_id;
+		dp->ufs.lun = lun;
+	}
+	return sz;
+}
+
+/* SD() and eMMC() are both a one byte slot number */
+static ssize_t
+parse_slot(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_sd);
+	uint64_t slot;
+	ssize_t sz;
+
+	if (scan_args(np, args, "1", &slot) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req)
+		((efidp)buf)->sd.slot_number = slot;
+	return sz;
+}
+
+/* Bluetooth(), BluetoothLE(), and Wi-Fi() print bytes with colons */
+static ssize_t
+parse_bt(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	 struct dp_text *args)
+{
+	uint8_t addr[32] = { 0, };
+	size_t addrlen = np->subtype == EFIDP_MSG_WIFI ? 32 : 6;
+	ssize_t req = sizeof(efidp_header) + addrlen;
+	uint64_t addr_type = 0;
+	struct dp_text addrstr;
+	ssize_t n, sz;
+
+	if (np->subtype == EFIDP_MSG_BTLE) {
+		if (scan_args(np, args, "s1", &addrstr, &addr_type) < 0)
+			return -1;
+		req++;
+	} else if (scan_args(np, args, "s", &addrstr) < 0) {
+		return -1;
+	}
+
+	n = text_hex_bytes(&addrstr, ':', addr, addrlen);
+	if (n < 0 || (np->subtype != EFIDP_MSG_WIFI && (size_t)n != addrlen))
+		return parse_error(np, &addrstr, "address");
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		memcpy(buf + sizeof(efidp_header), addr, addrlen);
+		if (np->subtype == EFIDP_MSG_BTLE)
+			((efidp)buf)->btle.addr_type = addr_type;
+	}
+	return sz;
+}
+
+/* Dns(a.b.c.d,...) or Dns([a::b],...); all the same family */
+static ssize_t
+parse_dns(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	struct dp_text all = *args, arg;
+	efi_ip_addr_t addr;
+	bool is_ipv6 = args->len && args->s[0] == '[';
+	ssize_t n = 0, req, sz;
+
+	if (!args->len)
+		all.s = NULL;
+	while (text_next_arg(&all, &arg)) {
+		int rc = is_ipv6 ? text_ipv6(&arg, addr.v6.addr)
+				 : text_ipv4(&arg, addr.v4.addr);
+		if (rc < 0)
+			return parse_error(np, &arg, "address");
+		n++;
+	}
+
+	req = offsetof(efidp_dns, addrs) + n * sizeof(efi_ip_addr_t);
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		uint8_t *out = buf + offsetof(efidp_dns, addrs);
+
+		((efidp)buf)->dns.is_ipv6 = is_ipv6;
+		all = *args;
+		if (!args->len)
+			all.s = NULL;
+		while (text_next_arg(&all, &arg)) {
+			memset(&addr, 0, sizeof(addr));
+			if (is_ipv6)
+				text_ipv6(&arg, addr.v6.addr);
+			else
+				text_ipv4(&arg, addr.v4.addr);
+			memcpy(out, &addr, sizeof(addr));
+			out += sizeof(addr);
+		}
+	}
+	return sz;
+}
+
+/*
+ * Media
+ */
+static ssize_t
+parse_hd(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	 struct dp_text *args)
+{
+	uint8_t signature[16] = { 0, };
+	uint64_t num, start, part_size, sigtype, mbr_sig;
+	uint8_t format = 0;
+	struct dp_text type, sig;
+	efi_guid_t guid;
+
+	if (scan_args(np, args, "dss88", &num, &type, &sig, &start,
+		      &part_size) < 0)
+		return -1;
+
+	if (text_eq(&type, "MBR")) {
+		if (text_number(&sig, false, UINT32_MAX, &mbr_sig) < 0)
+			return parse_error(np, &sig, "MBR signature");
+		for (int i = 0; i < 4; i++)
+			signature[i] = mbr_sig >> (i * 8);
+		sigtype = EFIDP_HD_SIGNATURE_MBR;
+		format = EFIDP_HD_FORMAT_PCAT;
+	} else if (text_eq(&type, "GPT")) {
+		if (text_guid(&sig, &guid) < 0)
+			return parse_error(np, &sig, "GPT signature");
+		memcpy(signature, &guid, sizeof(guid));
+		sigtype = EFIDP_HD_SIGNATURE_GUID;
+		format = EFIDP_HD_FORMAT_GPT;
+	} else if (text_number(&type, false, UINT8_MAX, &sigtype) < 0 ||
+		   text_hex_bytes(&sig, 0, signature,
+				  sizeof(signature)) != sizeof(signature)) {
+		return parse_error(np, &type, "signature");
+	}
+
+	return efidp_make_hd(buf, size, num, start, part_size, signature,
+			     format, sigtype);
+}
+
+static ssize_t
+parse_cdrom(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	    struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_cdrom);
+	uint64_t entry, rba, sectors;
+	ssize_t sz;
+
+	if (scan_args(np, args, "d88", &entry, &rba, &sectors) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->cdrom.boot_catalog_entry = entry;
+		dp->cdrom.partition_rba = rba;
+		dp->cdrom.sectors = sectors;
+	}
+	return sz;
+}
+
+/* File() takes everything up to its closing parenthesis, commas and all */
+static ssize_t
+parse_file(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	   struct dp_text *args)
+{
+	struct dp_text name = *args;
+	ssize_t req, sz;
+
+	req = offsetof(efidp_file, name) +
+	      (text_ucs2(&name, NULL) + 1) * sizeof(uint16_t);
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req)
+		text_ucs2(&name, buf + offsetof(efidp_file, name));
+	return sz;
+}
+
+static ssize_t
+parse_offset(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	     struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_relative_offset);
+	uint64_t first, last;
+	ssize_t sz;
+
+	if (scan_args(np, args, "88", &first, &last) < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->relative_offset.reserved = 0;
+		dp->relative_offset.first_byte = first;
+		dp->relative_offset.last_byte = last;
+	}
+	return sz;
+}
+
+/* VirtualDisk() and the like know their GUID; Ramdisk() says it */
+static ssize_t
+parse_ramdisk(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	      struct dp_text *args)
+{
+	ssize_t req = sizeof(efidp_ramdisk);
+	efi_guid_t guid = np->guid;
+	uint64_t start, end, instance;
+	ssize_t sz;
+	int rc;
+
+	if (efi_guid_is_zero(&np->guid))
+		rc = scan_args(np, args, "882g", &start, &end, &instance,
+			       &guid);
+	else
+		rc = scan_args(np, args, "882", &start, &end, &instance);
+	if (rc < 0)
+		return -1;
+
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+
+		dp->ramdisk.start_addr = start;
+		dp->ramdisk.end_addr = end;
+		memcpy(&dp->ramdisk.disk_type_guid, &guid, sizeof(guid));
+		dp->ramdisk.instance_number = instance;
+	}
+	return sz;
+}
+
+/*
+ * BIOS Boot Specification
+ */
+static ssize_t
+parse_bbs(uint8_t *buf, ssize_t size, const struct dp_node_parser *np,
+	  struct dp_text *args)
+{
+	static const char * const types[] = {
+		"", "Floppy", "HD", "CDROM", "PCMCIA", "USB", "Network"
+	};
+	struct dp_text type, description;
+	uint64_t device_type = UINT64_MAX, status;
+	ssize_t req, sz;
+
+	if (scan_args(np, args, "ss2", &type, &description, &status) < 0)
+		return -1;
+
+	for (unsigned int i = 1; i < sizeof(types) / sizeof(types[0]); i++)
+		if (text_eq(&type, types[i]))
+			device_type = i;
+	if (device_type == UINT64_MAX &&
+	    text_number(&type, false, UINT16_MAX, &device_type) < 0)
+		return parse_error(np, &type, "device type");
+
+	req = offsetof(efidp_bios_boot, description) + description.len + 1;
+	sz = make_node(buf, size, np, req);
+	if (size && sz == req) {
+		efidp dp = (efidp)buf;
+		uint8_t *desc = buf + offsetof(efidp_bios_boot, description);
+
+		dp->bios_boot.device_type = device_type;
+		dp->bios_boot.status = status;
+		memcpy(desc, description.s, description.len);
+		desc[description.len] = '\0';
+	}
+	return sz;
+}
+
+#define HW(name, subtype, fn)		\
+	{ name, EFIDP_HARDWARE_TYPE, (subtype), (fn), 0, {0} }
+#define ACPI(name, subtype, fn, hid)	\
+	{ name, EFIDP_ACPI_TYPE, (subtype), (fn), (hid), {0} }
+#define MSG(name, subtype, fn)		\
+	{ name, EFIDP_MESSAGE_TYPE, (subtype), (fn), 0, {0} }
+#define MSG_VENDOR(name, fn, guid)	\
+	{ name, EFIDP_MESSAGE_TYPE, EFIDP_MSG_VENDOR, (fn), 0, guid }
+#define USB_CLASS(name, class)		\
+	{ name, EFIDP_MESSAGE_TYPE, EFIDP_MSG_USB_CLASS, parse_usb_class, \
+	  (class), {0} }
+#define MEDIA(name, subtype, fn)	\
+	{ name, EFIDP_MEDIA_TYPE, (subtype), (fn), 0, {0} }
+#define RAMDISK(name, guid)		\
+	{ name, EFIDP_MEDIA_TYPE, EFIDP_MEDIA_RAMDISK, parse_ramdisk, 0, guid }
+
+/*
+ * Sorted by name, in strcmp() order, for bsearch().  The 254 class
+ * entries have the subclass in the low byte and a bit above it set, so
+ * that they don't look like a class.
+ */
+static const struct dp_node_parser dp_node_parsers[] = {
+	ACPI("Acpi", EFIDP_ACPI_HID, parse_acpi_hid, 0),
+	ACPI("AcpiAdr", EFIDP_ACPI_ADR, parse_acpi_adr, 0),
+	ACPI("AcpiContainer", EFIDP_ACPI_HID, parse_acpi_hid_named,
+	     EFIDP_ACPI_CONTAINER_0A05_HID),
+	ACPI("AcpiEx", EFIDP_ACPI_HID_EX, parse_acpi_hid_ex, 0),
+	ACPI("AcpiExp", EFIDP_ACPI_HID_EX, parse_acpi_hid_ex, 0),
+	ACPI("AcpiPath", 0, parse_raw, 0),
+	MSG("Ata", EFIDP_MSG_ATAPI, parse_atapi),
+	{ "BBS", EFIDP_BIOS_BOOT_TYPE, EFIDP_BIOS_BOOT, parse_bbs, 0, {0} },
+	HW("BMC", EFIDP_HW_BMC, parse_bmc),
+	{ "BbsPath", EFIDP_BIOS_BOOT_TYPE, 0, parse_raw, 0, {0} },
+	MSG("Bluetooth", EFIDP_MSG_BT, parse_bt),
+	MSG("BluetoothLE", EFIDP_MSG_BTLE, parse_bt),
+	MEDIA("CDROM", EFIDP_MEDIA_CDROM, parse_cdrom),
+	HW("Ctrl", EFIDP_HW_CONTROLLER, parse_controller),
+	MSG_VENDOR("DebugPort", parse_vendor, EFIDP_MSG_DEBUGPORT_GUID),
+	MSG("Dns", EFIDP_MSG_DNS, parse_dns),
+	HW("EDD10", EFIDP_HW_VENDOR, parse_edd10),
+	ACPI("EmbeddedController", EFIDP_ACPI_HID, parse_acpi_hid_named,
+	     EFIDP_ACPI_EC_HID),
+	MSG("Fibre", EFIDP_MSG_FIBRECHANNEL, parse_fibre),
+	MEDIA("File", EFIDP_MEDIA_FILE, parse_file),
+	ACPI("Floppy", EFIDP_ACPI_HID, parse_acpi_hid_named,
+	     EFIDP_ACPI_FLOPPY_HID),
+	MEDIA("FvFile", EFIDP_MEDIA_FIRMWARE_FILE, parse_guid_node),
+	MEDIA("FvVol", EFIDP_MEDIA_FIRMWARE_VOLUME, parse_guid_node),
+	MEDIA("HD", EFIDP_MEDIA_HD, parse_hd),
+	HW("HardwarePath", 0, parse_raw),
+	MSG("I1394", EFIDP_MSG_1394, parse_1394),
+	MSG("I2O", EFIDP_MSG_I2O, parse_i2o),
+	MSG("IPv4", EFIDP_MSG_IPv4, parse_ipv4),
+	MSG("IPv6", EFIDP_MSG_IPv6, parse_ipv6),
+	MSG("Infiniband", EFIDP_MSG_INFINIBAND, parse_infiniband),
+	ACPI("Keyboard", EFIDP_ACPI_HID, parse_acpi_hid_named,
+	     EFIDP_ACPI_KEYBOARD_HID),
+	MSG("MAC", EFIDP_MSG_MAC_ADDR, parse_mac),
+	MEDIA("Media", EFIDP_MEDIA_PROTOCOL, parse_guid_node),
+	MEDIA("MediaPath", 0, parse_raw),
+	HW("MemoryMapped", EFIDP_HW_MMIO, parse_mmio),
+	MSG("Msg", 0, parse_raw),
+	MSG("NVDIMM", EFIDP_MSG_NVDIMM, parse_guid_node),
+	MSG("NVMe", EFIDP_MSG_NVME, parse_nvme),
+	ACPI("NvDimm", EFIDP_ACPI_ADR, parse_nvdimm_adr, 0),
+	ACPI("NvRoot", EFIDP_ACPI_HID, parse_acpi_hid_named,
+	     EFIDP_ACPI_NVDIMM_HID),
+	MEDIA("Offset", EFIDP_MEDIA_RELATIVE_OFFSET, parse_offset),
+	{ "Path", 0, 0, parse_raw, 0, {0} },
+	HW("PcCard", EFIDP_HW_PCCARD, parse_pccard),
+	HW("Pci", EFIDP_HW_PCI, parse_pci),
+	ACPI("PciRoot", EFIDP_ACPI_HID, parse_acpi_hid_named,
+	     EFIDP_ACPI_PCI_ROOT_HID),
+	ACPI("PcieRoot", EFIDP_ACPI_HID, parse_acpi_hid_named,
+	     EFIDP_ACPI_PCIE_ROOT_HID),
+	RAMDISK("PersistentVirtualCD", EFIDP_PERSISTENT_VIRTUAL_CD_GUID),
+	RAMDISK("PersistentVirtualDisk", EFIDP_PERSISTENT_VIRTUAL_DISK_GUID),
+	RAMDISK("Ramdisk", {0}),
+	MSG_VENDOR("SAS", parse_sas, EFIDP_MSG_SAS_GUID),
+	MSG("SCSI", EFIDP_MSG_SCSI, parse_scsi),
+	MSG("SD", EFIDP_MSG_SD, parse_slot),
+	MSG("Sata", EFIDP_MSG_SATA, parse_sata),
+	ACPI("Serial", EFIDP_ACPI_HID, parse_acpi_hid_named,
+	     EFIDP_ACPI_SERIAL_HID),
+	MSG("UFS", EFIDP_MSG_UFS, parse_ufs),
+	MSG("USB", EFIDP_MSG_USB, parse_usb),
+	MSG("Uart", EFIDP_MSG_UART, parse_uart),
+	MSG_VENDOR("UartFlowControl", parse_uart_flow_control,
+		   EFIDP_MSG_UART_GUID),
+	MSG("Unit", EFIDP_MSG_LUN, parse_lun),
+	MSG("Uri", EFIDP_MSG_URI, parse_uri),
+	USB_CLASS("UsbAudio", EFIDP_USB_CLASS_AUDIO),
+	USB_CLASS("UsbCDCControl", EFIDP_USB_CLASS_CDC_CONTROL),
+	USB_CLASS("UsbCDCData", EFIDP_USB_CLASS_CDC_DATA),
+	USB_CLASS("UsbClass", 0),
+	USB_CLASS("UsbDeviceFirmwareUpdate",
+		  0x100 | EFIDP_USB_SUBCLASS_FW_UPDATE),
+	USB_CLASS("UsbDiagnostic", EFIDP_USB_CLASS_DIAGNOSTIC),
+	USB_CLASS("UsbHID", EFIDP_USB_CLASS_HID),
+	USB_CLASS("UsbHub", EFIDP_USB_CLASS_HUB),
+	USB_CLASS("UsbImage", EFIDP_USB_CLASS_IMAGE),
+	USB_CLASS("UsbIrdaBridge", 0x100 | EFIDP_USB_SUBCLASS_IRDA_BRIDGE),
+	USB_CLASS("UsbMassStorage", EFIDP_USB_CLASS_MASS_STORAGE),
+	USB_CLASS("UsbPrinter", EFIDP_USB_CLASS_PRINTER),
+	USB_CLASS("UsbSmartCard", EFIDP_USB_CLASS_SMARTCARD),
+	USB_CLASS("UsbTestAndMeasurement",
+		  0x100 | EFIDP_USB_SUBCLASS_TEST_AND_MEASURE),
+	USB_CLASS("UsbVideo", EFIDP_USB_CLASS_VIDEO),
+	USB_CLASS("UsbWireless", EFIDP_USB_CLASS_WIRELESS),
+	MSG("UsbWwid", EFIDP_MSG_USB_WWID, parse_usb_wwid),
+	HW("VenHw", EFIDP_HW_VENDOR, parse_vendor),
+	MEDIA("VenMedia", EFIDP_MEDIA_VENDOR, parse_vendor),
+	MSG("VenMsg", EFIDP_MSG_VENDOR, parse_vendor),
+	MSG_VENDOR("VenPcAnsi", parse_vendor, EFIDP_PC_ANSI_GUID),
+	MSG_VENDOR("VenUtf8", parse_vendor, EFIDP_VT_UTF8_GUID),
+	MSG_VENDOR("VenVt100", parse_vendor, EFIDP_VT_100_GUID),
+	MSG_VENDOR("VenVt100Plus", parse_vendor, EFIDP_VT_100_PLUS_GUID),
+	RAMDISK("VirtualCD", EFIDP_VIRTUAL_CD_GUID),
+	RAMDISK("VirtualDisk", EFIDP_VIRTUAL_DISK_GUID),
+	MSG("Vlan", EFIDP_MSG_VLAN, parse_vlan),
+	MSG("Wi-Fi", EFIDP_MSG_WIFI, parse_bt),
+	MSG("eMMC", EFIDP_MSG_EMMC, parse_slot),
+	MSG("iSCSI", EFIDP_MSG_ISCSI, parse_iscsi),
+};
+
+static int
+dp_node_parser_cmp(const void *keyp, const void *entryp)
+{
+	const struct dp_text *key = keyp;
+	const struct dp_node_parser *np = entryp;
+	int rc;
+
+	rc = strncmp(key->s, np->name, key->len);
+	if (rc)
+		return rc;
+	return np->name[key->len] ? -1 : 0;
+}
+
+/*
+ * Parses the node at *textp, leaves *textp just past its closing
+ * parenthesis, and points *npp at what it was.
+ */
+static ssize_t
+parse_node(const char **textp, uint8_t *buf, ssize_t size,
+	   const struct dp_node_parser **npp)
+{
+	const struct dp_node_parser *np;
+	const char *s = *textp;
+	struct dp_text name = { s, 0 }, args;
+	int depth = 1;
+	ssize_t sz;
+
+	while (*s && *s != '(' && *s != '/' && *s != ',')
+		s++;
+	name.len = s - name.s;
+	if (*s != '(') {
+		errno = EINVAL;
+		efi_error("expected a device path node at \"%s\"", *textp);
+		return -1;
+	}
+
+	np = bsearch(&name, dp_node_parsers,
+		     sizeof(dp_node_parsers) / sizeof(dp_node_parsers[0]),
+		     sizeof(dp_node_parsers[0]), dp_node_parser_cmp);
+	if (!np) {
+		errno = EINVAL;
+		efi_error("unknown device path node type \"%.*s\"",
+			  (int)name.len, name.s);
+		return -1;
+	}
+
+	args.s = ++s;
+	while (*s) {
+		if (*s == '(')
+			depth++;
+		else if (*s == ')' && --depth == 0)
+			break;
+		s++;
+	}
+	if (!*s) {
+		errno = EINVAL;
+		efi_error("%.*s() is missing its ')'", (int)name.len, name.s);
+		return -1;
+	}
+	args.len = s - args.s;
+	if (!args.len)
+		args.s = NULL;
+
+	sz = np->parse(buf, size, np, &args);
+	if (sz < 0) {
+		efi_error("could not parse %.*s()", (int)name.len, name.s);
+		return -1;
+	}
+
+	*textp = s + 1;
+	*npp = np;
+	return sz;
+}
+
+ssize_t NONNULL(1) PUBLIC
+efidp_parse_device_node(unsigned char *path, efidp out, size_t size)
+{
+	const struct dp_node_parser *np;
+	const char *s = (const char *)path;
+	ssize_t sz;
+
+	if (size && !out) {
+		errno = EINVAL;
+		efi_error("%s was called with nonzero size and NULL buffer",
+			  __func__);
+		return -1;
+	}
+
+	sz = parse_node(&s, (uint8_t *)out, size, &np);
+	if (sz < 0)
+		return -1;
+	if (*s) {
+		errno = EINVAL;
+		efi_error("trailing text after device path node: \"%s\"", s);
+		return -1;
+	}
+	return sz;
+}
+
+static ssize_t
+make_end(uint8_t *buf, ssize_t size, uint8_t subtype)
+{
+	return efidp_make_generic(buf, size, EFIDP_END_TYPE, subtype,
+				  sizeof(efidp_header));
+}
+
+ssize_t NONNULL(1) PUBLIC
+efidp_parse_device_path(unsigned char *path, efidp out, size_t size)
+{
+	const char *s = (const char *)path;
+	uint8_t *buf = (uint8_t *)out;
+	ssize_t off = 0;
+	ssize_t sz;
+
+	if (size && !out) {
+		errno = EINVAL;
+		efi_error("%s was called with nonzero size and NULL buffer",
+			  __func__);
+		return -1;
+	}
+
+#define remaining() (size ? (ssize_t)size - off : 0)
+#define at_end() ({							\
+		if (size && (size_t)off >= size) {			\
+			errno = ENOSPC;					\
+			efi_error("device path is bigger than size limit"); \
+			return -1;					\
+		}							\
+		size ? buf + off : NULL;				\
+	})
+
+	while (*s) {
+		const struct dp_node_parser *np;
+
+		sz = parse_node(&s, at_end(), remaining(), &np);
+		if (sz < 0)
+			return -1;
+		off += sz;
+
+		/* what the formatter shows of the _ADR node after NvRoot() */
+		if (np->value == EFIDP_ACPI_NVDIMM_HID) {
+			while (!strncmp(s, "NvDimm(", 7)) {
+				const char *close = strchr(s, ')');
+
+				if (!close)
+					break;
+				s = close + 1;
+				if (!strncmp(s, ",NvDimm(", 8))
+					s++;
+			}
+		}
+
+		if (*s == '/') {
+			s++;
+		} else if (*s == ',') {
+			sz = make_end(at_end(), remaining(), EFIDP_END_INSTANCE);
+			if (sz < 0)
+				return -1;
+			off += sz;
+			s++;
+		} else if (*s) {
+			errno = EINVAL;
+			efi_error("expected '/' or ',' at \"%s\"", s);
+			return -1;
+		}
+		if ((s[-1] == '/' || s[-1] == ',') && !*s) {
+			errno = EINVAL;
+			efi_error("device path ends with '%c'", s[-1]);
+			return -1;
+		}
+	}
+
+	sz = make_end(at_end(), remaining(), EFIDP_END_ENTIRE);
+	if (sz < 0)
+		return -1;
+#undef remaining
+#undef at_end
+	return off + sz;
+}
+
+// vim:fenc=utf-8:tw=75:noet
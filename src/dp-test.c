@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * dp-test.c - check that device paths survive formatting and parsing
+ */
+
+#include "fix_coverity.h"
+
+#include <arpa/inet.h>
+#include <efiboot.h>
+#include <efivar.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROGRAM_NAME "dp-test"
+
+/*
+ * Print the text form of dp and its bytes in hex, then parse the text
+ * back and make sure it gives the same bytes and comes out the same way
+ * again.
+ */
+static int
+check_path(const uint8_t *dp, ssize_t dpsz)
+{
+	unsigned char *text = NULL, *text2 = NULL;
+	uint8_t *dp2 = NULL;
+	ssize_t sz, sz2;
+	int rc = -1;
+
+	if (efidp_format_device_path_alloc(&text, (const_efidp)dp, dpsz) < 0) {
+		warnx("could not format device path");
+		goto out;
+	}
+	printf("%s\n", text);
+	for (ssize_t i = 0; i < dpsz; i++)
+		printf("%02hhx", dp[i]);
+	printf("\n");
+
+	sz = efidp_parse_device_path(text, NULL, 0);
+	if (sz < 0) {
+		warnx("could not parse \"%s\"", text);
+		goto out;
+	}
+	dp2 = calloc(1, sz);
+	if (!dp2)
+		err(1, "could not allocate memory");
+	sz2 = efidp_parse_device_path(text, (efidp)dp2, sz);
+	if (sz2 < 0 ||
+	    efidp_format_device_path_alloc(&text2, (const_efidp)dp2, sz2) < 0) {
+		warnx("could not parse \"%s\"", text);
+		goto out;
+	}
+	if (strcmp((char *)text, (char *)text2)) {
+		warnx("\"%s\" came back as \"%s\"", text, text2);
+		goto out;
+	}
+	if (sz2 != dpsz || memcmp(dp, dp2, dpsz)) {
+		warnx("\"%s\" parses back to different bytes", text);
+		goto out;
+	}
+	rc = 0;
+out:
+	free(text);
+	free(text2);
+	free(dp2);
+	return rc;
+}
+
+static int
+check_text(char *text)
+{
+	uint8_t *dp;
+	ssize_t sz;
+	int rc;
+
+	sz = efidp_parse_device_path((unsigned char *)text, NULL, 0);
+	if (sz < 0) {
+		warnx("could not parse \"%s\"", text);
+		return -1;
+	}
+	dp = calloc(1, sz);
+	if (!dp)
+		err(1, "could not allocate memory");
+	sz = efidp_parse_device_path((unsigned char *)text, (efidp)dp, sz);
+	if (sz < 0) {
+		warnx("could not parse \"%s\"", text);
+		free(dp);
+		return -1;
+	}
+	rc = check_path(dp, sz);
+	free(dp);
+	return rc;
+}
+
+/*
+ * Text that's ambiguous or malformed has to be turned down.
+ */
+static int
+check_rejected(const char *text)
+{
+	if (efidp_parse_device_path((unsigned char *)text, NULL, 0) >= 0) {
+		warnx("\"%s\" should not have parsed", text);
+		return -1;
+	}
+	printf("rejected %s\n", text);
+	return 0;
+}
+
+/*
+ * Nodes made with the efidp_make_* functions for network paths, so the
+ * bytes they write are pinned down as well as the parser's.
+ */
+static int
+check_made_nodes(void)
+{
+	uint8_t local6[16], remote6[16], gateway6[16];
+	uint8_t buf[1024];
+	ssize_t off = 0, sz;
+	int rc = 0;
+
+	sz = efidp_make_ipv4(buf, sizeof(buf), 0xc0a80102, 0xc0a80101,
+			     0xc0a801fe, 0xffffff00, 1234, 3260, 6, 1);
+	if (sz < 0)
+		err(1, "could not make IPv4() node");
+	off += sz;
+	sz = efidp_make_end_entire(buf + off, sizeof(buf) - off);
+	if (sz < 0)
+		err(1, "could not make End node");
+	off += sz;
+	if (check_path(buf, off) < 0)
+		rc = -1;
+
+	if (inet_pton(AF_INET6, "2001:db8::2", local6) != 1 ||
+	    inet_pton(AF_INET6, "2001:db8::1", remote6) != 1 ||
+	    inet_pton(AF_INET6, "2001:db8::fe", gateway6) != 1)
+		errx(1, "could not parse IPv6 addresses");
+	off = 0;
+	sz = efidp_make_ipv6(buf, sizeof(buf), local6, remote6, 1234, 3260,
+			     6, EFIDP_IPv6_ORIGIN_MANUAL, 64, gateway6);
+	if (sz < 0)
+		err(1, "could not make IPv6() node");
+	off += sz;
+	sz = efidp_make_end_entire(buf + off, sizeof(buf) - off);
+	if (sz < 0)
+		err(1, "could not make End node");
+	off += sz;
+	if (check_path(buf, off) < 0)
+		rc = -1;
+
+	return rc;
+}
+
+static void __attribute__((__noreturn__))
+usage(int ret)
+{
+	FILE *out = ret == 0 ? stdout : stderr;
+	fprintf(out,
+		"Usage: %s [OPTION...] [PATH...]\n"
+		"  -m, --make                        check nodes made by efidp_make_*()\n"
+		"  -r, --reject=<path>               check that <path> does not parse\n"
+		"Help options:\n"
+		"  -?, --help                        Show this help message\n"
+		"      --usage                       Display brief usage message\n",
+		PROGRAM_NAME);
+	exit(ret);
+}
+
+int main(int argc, char *argv[])
+{
+	bool make = false;
+	char *sopts = "mr:?";
+	struct option lopts[] = {
+		{"help", no_argument, 0, '?'},
+		{"make", no_argument, 0, 'm'},
+		{"reject", required_argument, 0, 'r'},
+		{"usage", no_argument, 0, 0},
+		{0, 0, 0, 0},
+	};
+	int c;
+	int i;
+	int rc = 0;
+
+	while ((c = getopt_long(argc, argv, sopts, lopts, &i)) != -1) {
+		switch (c) {
+		case 'm':
+			make = true;
+			break;
+		case 'r':
+			if (check_rejected(optarg) < 0)
+				rc = 1;
+			break;
+		case '?':
+			usage(EXIT_SUCCESS);
+			break;
+		case 0:
+			if (strcmp(lopts[i].name, "usage"))
+				usage(EXIT_SUCCESS);
+			break;
+		}
+	}
+
+	if (make && check_made_nodes() < 0)
+		rc = 1;
+	for (i = optind; i < argc; i++) {
+		if (check_text(argv[i]) < 0)
+			rc = 1;
+	}
+	return rc;
+}
+
+// vim:fenc=utf-8:tw=75:noet
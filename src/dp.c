@@ -284,6 +284,563 @@ efidp_append_instance(const_efidp dp, const_efidp dpi, efidp *out)
 
 }
 
+struct efidp_builder {
+	uint8_t *buf;
+	size_t size;
+	size_t len;	/* not counting the End Entire node */
+};
+
+int NONNULL(1) PUBLIC
+efidp_builder_new(efidp_builder_t **builder)
+{
+	efidp_builder_t *new;
+
+	new = calloc(1, sizeof(*new));
+	if (!new) {
+		efi_error("allocation failed");
+		return -1;
+	}
+	*builder = new;
+	return 0;
+}
+
+uint8_t NONNULL(1) PUBLIC
+*efidp_builder_reserve(efidp_builder_t *builder, size_t size)
+{
+	size_t need, newsize;
+	uint8_t *newbuf;
+
+	if (ADD(builder->len, size, &need) ||
+	    ADD(need, sizeof(end_entire), &need)) {
+		errno = EOVERFLOW;
+		efi_error("arithmetic overflow computing allocation size");
+		return NULL;
+	}
+
+	if (need > builder->size) {
+		newsize = builder->size ? builder->size : 256;
+		while (newsize < need) {
+			if (MUL(newsize, 2, &newsize)) {
+				errno = EOVERFLOW;
+				efi_error("arithmetic overflow computing allocation size");
+				return NULL;
+			}
+		}
+
+		newbuf = realloc(builder->buf, newsize);
+		if (!newbuf) {
+			efi_error("allocation failed");
+			return NULL;
+		}
+		builder->buf = newbuf;
+		builder->size = newsize;
+	}
+
+	return builder->buf + builder->len;
+}
+
+int NONNULL(1) PUBLIC
+efidp_builder_advance(efidp_builder_t *builder, size_t size)
+{
+	if (!builder->buf ||
+	    size > builder->size - builder->len - sizeof(end_entire)) {
+		errno = EINVAL;
+		efi_error("advancing past reserved space");
+		return -1;
+	}
+	builder->len += size;
+	return 0;
+}
+
+static int
+builder_append(efidp_builder_t *builder, const void *data, size_t size)
+{
+	uint8_t *p;
+
+	p = efidp_builder_reserve(builder, size);
+	if (!p)
+		return -1;
+	memcpy(p, data, size);
+	builder->len += size;
+	return 0;
+}
+
+int NONNULL(1, 2) PUBLIC
+efidp_builder_append_node(efidp_builder_t *builder, const_efidp dn)
+{
+	ssize_t sz;
+
+	if (efidp_type(dn) == EFIDP_END_TYPE &&
+	    efidp_subtype(dn) == EFIDP_END_ENTIRE) {
+		errno = EINVAL;
+		efi_error("efidp_builder_finish() adds the End Entire node");
+		return -1;
+	}
+
+	sz = efidp_node_size(dn);
+	if (sz < 0) {
+		efi_error("efidp_node_size(dn) returned error");
+		return -1;
+	}
+
+	return builder_append(builder, dn, sz);
+}
+
+int NONNULL(1, 2) PUBLIC
+efidp_builder_append_path(efidp_builder_t *builder, const_efidp dp)
+{
+	const_efidp le = dp;
+	ssize_t sz;
+	int rc;
+
+	sz = efidp_size(dp);
+	if (sz < 0) {
+		efi_error("efidp_size(dp) returned error");
+		return -1;
+	}
+
+	while (!(efidp_type(le) == EFIDP_END_TYPE &&
+		 efidp_subtype(le) == EFIDP_END_ENTIRE)) {
+		rc = efidp_get_next_end(le, &le);
+		if (rc < 0) {
+			efi_error("efidp_get_next_end() returned error");
+			return -1;
+		}
+	}
+	sz -= efidp_size(le);
+
+	return builder_append(builder, dp, sz);
+}
+
+int NONNULL(1, 2) PUBLIC
+efidp_builder_append_instance(efidp_builder_t *builder, const_efidp dp)
+{
+	static const efidp_header end_instance = {
+		.type = EFIDP_END_TYPE,
+		.subtype = EFIDP_END_INSTANCE,
+		.length = 4
+	};
+
+	if (builder->len &&
+	    builder_append(builder, &end_instance, sizeof(end_instance)) < 0)
+		return -1;
+
+	return efidp_builder_append_path(builder, dp);
+}
+
+ssize_t NONNULL(1) PUBLIC
+efidp_builder_size(efidp_builder_t *builder)
+{
+	return builder->len;
+}
+
+ssize_t NONNULL(1, 2) PUBLIC
+efidp_builder_finish(efidp_builder_t *builder, efidp *out)
+{
+	ssize_t sz;
+
+	if (builder_append(builder, &end_entire, sizeof(end_entire)) < 0)
+		return -1;
+
+	*out = (efidp)builder->buf;
+	sz = builder->len;
+	builder->buf = NULL;
+	builder->size = 0;
+	builder->len = 0;
+	return sz;
+}
+
+void PUBLIC
+efidp_builder_free(efidp_builder_t *builder)
+{
+	if (!builder)
+		return;
+	free(builder->buf);
+	free(builder);
+}
+
+struct efidp_index_kind {
+	uint32_t key;		/* type << 8 | subtype */
+	int32_t first;		/* -1 if the slot is empty */
+};
+
+struct efidp_index {
+	const_efidp dp;
+	size_t count;
+	size_t size;
+	unsigned int instances;
+	int32_t *next;		/* the next node of the same kind, or -1 */
+	struct efidp_index_kind *kinds;
+	size_t kinds_mask;
+	efidp_index_entry_t entries[];
+};
+
+/*
+ * The same limits efidp_is_valid() has, but on every node, not just the
+ * first one.
+ */
+static int
+index_check_node(const efidp_header *hdr, size_t remaining)
+{
+	if (remaining < sizeof(efidp_header)) {
+		errno = EINVAL;
+		efi_error("device path has no End Entire node");
+		return -1;
+	}
+	if (hdr->length < sizeof(efidp_header)) {
+		errno = EINVAL;
+		efi_error("device path node is shorter than its header");
+		return -1;
+	}
+	if (hdr->length > remaining) {
+		errno = EINVAL;
+		efi_error("device path node length overruns buffer");
+		return -1;
+	}
+
+	switch (hdr->type) {
+	case EFIDP_HARDWARE_TYPE:
+		if (hdr->subtype != EFIDP_HW_VENDOR && hdr->length > 1024)
+			goto invalid;
+		break;
+	case EFIDP_ACPI_TYPE:
+		if (hdr->length > 1024)
+			goto invalid;
+		break;
+	case EFIDP_MESSAGE_TYPE:
+		if (hdr->subtype != EFIDP_MSG_VENDOR && hdr->length > 1024)
+			goto invalid;
+		break;
+	case EFIDP_MEDIA_TYPE:
+		if (hdr->subtype != EFIDP_MEDIA_VENDOR && hdr->length > 1024)
+			goto invalid;
+		break;
+	case EFIDP_BIOS_BOOT_TYPE:
+		break;
+	case EFIDP_END_TYPE:
+		if (hdr->length > 4)
+			goto invalid;
+		break;
+	default:
+		errno = EINVAL;
+		efi_error("invalid device path node type %d", hdr->type);
+		return -1;
+	}
+	return 0;
+invalid:
+	errno = EINVAL;
+	efi_error("invalid device path node {0x%02hhx,0x%02hhx} length %d",
+		  hdr->type, hdr->subtype, hdr->length);
+	return -1;
+}
+
+/*
+ * Walks the path, filling in index's entries if there is one, and
+ * returns how many nodes there are.
+ */
+static ssize_t
+index_walk(const_efidp dp, size_t limit, efidp_index_t *index)
+{
+	unsigned int instance = 0;
+	size_t off = 0, n = 0;
+
+	while (true) {
+		const efidp_header *hdr =
+			(const efidp_header *)((const uint8_t *)dp + off);
+
+		if (index_check_node(hdr, limit - off) < 0)
+			return -1;
+		if (n >= INT32_MAX) {
+			errno = EOVERFLOW;
+			efi_error("device path has too many nodes");
+			return -1;
+		}
+
+		if (index) {
+			efidp_index_entry_t *entry = &index->entries[n];
+
+			entry->offset = off;
+			entry->length = hdr->length;
+			entry->type = hdr->type;
+			entry->subtype = hdr->subtype;
+			entry->instance = instance;
+		}
+		n++;
+		off += hdr->length;
+
+		if (hdr->type == EFIDP_END_TYPE) {
+			if (hdr->subtype == EFIDP_END_ENTIRE)
+				break;
+			if (hdr->subtype == EFIDP_END_INSTANCE)
+				instance++;
+		}
+	}
+
+	if (index) {
+		index->size = off;
+		index->instances = instance + 1;
+	}
+	return n;
+}
+
+static inline struct efidp_index_kind *
+index_kind(const efidp_index_t *index, uint32_t key)
+{
+	size_t slot = (key * 2654435761u) & index->kinds_mask;
+
+	while (index->kinds[slot].first >= 0 && index->kinds[slot].key != key)
+		slot = (slot + 1) & index->kinds_mask;
+	return &index->kinds[slot];
+}
+
+int NONNULL(1, 3) PUBLIC
+efidp_index_new(const_efidp dp, ssize_t limit, efidp_index_t **index)
+{
+	efidp_index_t *new;
+	size_t nkinds = 16, sz, entries_sz, next_sz, kinds_sz;
+	ssize_t count;
+
+	if (limit < 0)
+		limit = INT_MAX;
+
+	count = index_walk(dp, limit, NULL);
+	if (count < 0)
+		return -1;
+
+	while (nkinds < (size_t)count * 2)
+		nkinds *= 2;
+
+	if (MUL((size_t)count, sizeof(efidp_index_entry_t), &entries_sz) ||
+	    MUL((size_t)count, sizeof(int32_t), &next_sz) ||
+	    MUL(nkinds, sizeof(struct efidp_index_kind), &kinds_sz) ||
+	    ADD(sizeof(*new), entries_sz, &sz) ||
+	    ADD(sz, next_sz, &sz) ||
+	    ADD(sz, kinds_sz, &sz)) {
+		errno = EOVERFLOW;
+		efi_error("arithmetic overflow computing allocation size");
+		return -1;
+	}
+
+	new = malloc(sz);
+	if (!new) {
+		efi_error("allocation failed");
+		return -1;
+	}
+	new->dp = dp;
+	new->count = count;
+	new->next = (int32_t *)&new->entries[count];
+	new->kinds = (struct efidp_index_kind *)&new->next[count];
+	new->kinds_mask = nkinds - 1;
+	for (size_t i = 0; i < nkinds; i++)
+		new->kinds[i].first = -1;
+
+	index_walk(dp, limit, new);
+
+	/*
+	 * Going backwards leaves each kind's first node in the table, and
+	 * each node pointing at the next one after it.
+	 */
+	for (ssize_t i = count - 1; i >= 0; i--) {
+		const efidp_index_entry_t *entry = &new->entries[i];
+		struct efidp_index_kind *kind;
+		uint32_t key = entry->type << 8 | entry->subtype;
+
+		kind = index_kind(new, key);
+		new->next[i] = kind->first;
+		kind->key = key;
+		kind->first = i;
+	}
+
+	*index = new;
+	return 0;
+}
+
+size_t NONNULL(1) PUBLIC
+efidp_index_count(const efidp_index_t *index)
+{
+	return index->count;
+}
+
+unsigned int NONNULL(1) PUBLIC
+efidp_index_instances(const efidp_index_t *index)
+{
+	return index->instances;
+}
+
+ssize_t NONNULL(1) PUBLIC
+efidp_index_size(const efidp_index_t *index)
+{
+	return index->size;
+}
+
+const efidp_index_entry_t NONNULL(1) PUBLIC
+*efidp_index_entry(const efidp_index_t *index, size_t n)
+{
+	if (n >= index->count) {
+		errno = EINVAL;
+		efi_error("node %zu is past the end of the device path", n);
+		return NULL;
+	}
+	return &index->entries[n];
+}
+
+const_efidp NONNULL(1) PUBLIC
+efidp_index_node(const efidp_index_t *index, size_t n)
+{
+	if (n >= index->count) {
+		errno = EINVAL;
+		efi_error("node %zu is past the end of the device path", n);
+		return NULL;
+	}
+	return (const_efidp)((const uint8_t *)index->dp +
+			     index->entries[n].offset);
+}
+
+ssize_t NONNULL(1) PUBLIC
+efidp_index_find(const efidp_index_t *index, uint8_t type, uint8_t subtype)
+{
+	struct efidp_index_kind *kind;
+
+	kind = index_kind(index, type << 8 | subtype);
+	if (kind->first < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	return kind->first;
+}
+
+ssize_t NONNULL(1) PUBLIC
+efidp_index_find_next(const efidp_index_t *index, size_t n)
+{
+	if (n >= index->count) {
+		errno = EINVAL;
+		efi_error("node %zu is past the end of the device path", n);
+		return -1;
+	}
+	if (index->next[n] < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	return index->next[n];
+}
+
+void PUBLIC
+efidp_index_free(efidp_index_t *index)
+{
+	free(index);
+}
+
+ssize_t
+_format_bios_boot_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	static const char * const types[] = {
+		"", "Floppy", "HD", "CDROM", "PCMCIA", "USB", "Network", ""
+	};
+	ssize_t off = 0;
+
+	if (dp->subtype != EFIDP_BIOS_BOOT) {
+		format(buf, size, off, "BbsPath", "BbsPath(%d,", dp->subtype);
+		format_hex(buf, size, off, "BbsPath", (uint8_t *)dp+4,
+			   efidp_node_size(dp)-4);
+		format(buf, size, off, "BbsPath", ")");
+		return off;
+	}
+
+	if (dp->bios_boot.device_type > 0 && dp->bios_boot.device_type < 7) {
+		format(buf, size, off, "BBS", "BBS(%s,%s,0x%"PRIx32")",
+		       types[dp->bios_boot.device_type],
+		       dp->bios_boot.description, dp->bios_boot.status);
+	} else {
+		format(buf, size, off, "BBS", "BBS(%d,%s,0x%"PRIx32")",
+		       dp->bios_boot.device_type,
+		       dp->bios_boot.description, dp->bios_boot.status);
+	}
+	return off;
+}
+
+static ssize_t
+format_unknown_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	ssize_t off = 0;
+
+	format(buf, size, off, "Path", "Path(%d,%d,", dp->type, dp->subtype);
+	format_hex(buf, size, off, "Path", (uint8_t *)dp + 4,
+		   efidp_node_size(dp) - 4);
+	format(buf, size, off, "Path", ")");
+	return off;
+}
+
+static ssize_t
+format_end_dn(unsigned char *buf, size_t size, const_efidp dp)
+{
+	ssize_t off = 0;
+
+	if (dp->subtype == EFIDP_END_INSTANCE)
+		format_lit(buf, size, off, ",");
+	return off;
+}
+
+typedef ssize_t (*dn_formatter_t)(unsigned char *buf, size_t size,
+				  const_efidp dp);
+
+/*
+ * Which formatter does each node: the one for its (type, subtype) if it
+ * has its own, or otherwise the one for its type.
+ */
+static const struct {
+	dn_formatter_t type;
+	dn_formatter_t subtypes[0x20];
+} dn_formatters[EFIDP_BIOS_BOOT_TYPE + 1] = {
+	[EFIDP_HARDWARE_TYPE] = {
+		.type = _format_hw_dn,
+		.subtypes = {
+			[EFIDP_HW_PCI] = _format_pci_dn,
+		},
+	},
+	[EFIDP_ACPI_TYPE] = {
+		.type = _format_acpi_dn,
+		.subtypes = {
+			[EFIDP_ACPI_HID] = _format_acpi_hid_dn,
+		},
+	},
+	[EFIDP_MESSAGE_TYPE] = {
+		.type = _format_message_dn,
+		.subtypes = {
+			[EFIDP_MSG_SCSI] = _format_scsi_dn,
+			[EFIDP_MSG_USB] = _format_usb_dn,
+			[EFIDP_MSG_SATA] = _format_sata_dn,
+			[EFIDP_MSG_NVME] = _format_nvme_dn,
+		},
+	},
+	[EFIDP_MEDIA_TYPE] = {
+		.type = _format_media_dn,
+		.subtypes = {
+			[EFIDP_MEDIA_HD] = _format_hd_dn,
+			[EFIDP_MEDIA_FILE] = _format_file_dn,
+		},
+	},
+	[EFIDP_BIOS_BOOT_TYPE] = {
+		.type = _format_bios_boot_dn,
+	},
+};
+
+static inline dn_formatter_t
+dn_formatter(const_efidp dp)
+{
+	dn_formatter_t fn = NULL;
+
+	if (dp->type == EFIDP_END_TYPE)
+		return format_end_dn;
+	if (dp->type < sizeof(dn_formatters) / sizeof(dn_formatters[0])) {
+		if (dp->subtype < sizeof(dn_formatters[0].subtypes)
+				  / sizeof(dn_formatters[0].subtypes[0]))
+			fn = dn_formatters[dp->type].subtypes[dp->subtype];
+		if (!fn)
+			fn = dn_formatters[dp->type].type;
+	}
+	return fn ? fn : format_unknown_dn;
+}
+
 ssize_t PUBLIC
 efidp_format_device_path(unsigned char *buf, size_t size, const_efidp dp,
 			 ssize_t limit)
@@ -310,72 +867,16 @@ efidp_format_device_path(unsigned char *buf, size_t size, const_efidp dp,
 		} else {
 			if (dp->type == EFIDP_END_TYPE) {
 				if (dp->type == EFIDP_END_INSTANCE) {
-					format(buf, size, off, "\b", ",");
+					format_lit(buf, size, off, ",");
 				} else {
 					return off+1;
 				}
 			} else {
-				format(buf, size, off, "\b", "/");
+				format_lit(buf, size, off, "/");
 			}
 		}
 
-		switch (dp->type) {
-		case EFIDP_HARDWARE_TYPE:
-			format_hw_dn(buf, size, off, dp);
-			break;
-		case EFIDP_ACPI_TYPE:
-			format_acpi_dn(buf, size, off, dp);
-			break;
-		case EFIDP_MESSAGE_TYPE:
-			format_message_dn(buf, size, off, dp);
-			break;
-		case EFIDP_MEDIA_TYPE:
-			format_media_dn(buf, size, off, dp);
-			break;
-		case EFIDP_BIOS_BOOT_TYPE: {
-			char *types[] = {"", "Floppy", "HD", "CDROM", "PCMCIA",
-					 "USB", "Network", "" };
-
-			if (dp->subtype != EFIDP_BIOS_BOOT) {
-				format(buf, size, off, "BbsPath",
-				       "BbsPath(%d,", dp->subtype);
-				format_hex(buf, size, off, "BbsPath",
-					   (uint8_t *)dp+4,
-					   efidp_node_size(dp)-4);
-				format(buf, size, off, "BbsPath", ")");
-				break;
-			}
-
-			if (dp->bios_boot.device_type > 0 &&
-					dp->bios_boot.device_type < 7) {
-				format(buf, size, off, "BBS",
-				       "BBS(%s,%s,0x%"PRIx32")",
-				       types[dp->bios_boot.device_type],
-				       dp->bios_boot.description,
-				       dp->bios_boot.status);
-			} else {
-				format(buf, size, off, "BBS",
-				       "BBS(%d,%s,0x%"PRIx32")",
-				       dp->bios_boot.device_type,
-				       dp->bios_boot.description,
-				       dp->bios_boot.status);
-			}
-			break;
-					   }
-		case EFIDP_END_TYPE:
-			if (dp->subtype == EFIDP_END_INSTANCE) {
-				format(buf, size, off, "End", ",");
-				break;
-			}
-			break;
-		default:
-			format(buf, size, off, "Path",
-				    "Path(%d,%d,", dp->type, dp->subtype);
-			format_hex(buf, size, off, "Path", (uint8_t *)dp + 4,
-				   efidp_node_size(dp) - 4);
-			format(buf, size, off, "Path", ")");
-			break;
-		}
+		format_helper_2(dn_formatter(dp), buf, size, off, dp);
 
 		if (limit)
 			limit -= efidp_node_size(dp);
@@ -389,21 +890,49 @@ efidp_format_device_path(unsigned char *buf, size_t size, const_efidp dp,
 	return off+1;
 }
 
-ssize_t PUBLIC
-efidp_parse_device_node(unsigned char *path UNUSED,
-			efidp out UNUSED, size_t size UNUSED)
+/*
+ * Most callers size the string with one efidp_format_device_path() call
+ * and then fill it in with another, which formats everything twice.
+ * Start with a buffer that's usually big enough instead, and only go
+ * around again if it wasn't.
+ */
+ssize_t NONNULL(1) PUBLIC
+efidp_format_device_path_alloc(unsigned char **bufp, const_efidp dp,
+			       ssize_t limit)
 {
-	efi_error("not implented");
-	errno = -ENOSYS;
-	return -1;
-}
+	unsigned char *buf = NULL, *newbuf;
+	ssize_t size = 256;
+	ssize_t rc;
 
-ssize_t PUBLIC
-efidp_parse_device_path(unsigned char *path UNUSED, efidp out UNUSED,
-			size_t size UNUSED)
-{
-	efi_error("not implented");
-	errno = -ENOSYS;
+	*bufp = NULL;
+	if (!dp)
+		return -1;
+
+	for (int tries = 0; tries < 2; tries++) {
+		newbuf = realloc(buf, size);
+		if (!newbuf) {
+			efi_error("could not allocate memory");
+			free(buf);
+			return -1;
+		}
+		buf = newbuf;
+
+		rc = efidp_format_device_path(buf, size, dp, limit);
+		if (rc < 0) {
+			efi_error("could not format device path");
+			free(buf);
+			return rc;
+		}
+		if (rc <= size) {
+			*bufp = buf;
+			return rc;
+		}
+		size = rc;
+	}
+
+	free(buf);
+	errno = EINVAL;
+	efi_error("device path formatting is not repeatable");
 	return -1;
 }
 
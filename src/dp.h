@@ -18,10 +18,12 @@
 		if ((buf) != NULL && (size) > 0) {			\
 			_inbuf = (buf) + (off);				\
 			_insize = (size) - (off);			\
+			if (_insize < 0) {				\
+				_inbuf = NULL;				\
+				_insize = 0;				\
+			}						\
 		}							\
-		if ((off) >= 0 &&					\
-		    ((buf == NULL && _insize == 0) ||			\
-		     (buf != NULL && _insize >= 0))) {			\
+		if ((off) >= 0) {					\
 			ssize_t _x = 0;					\
 			_x = snprintf(_inbuf, _insize, fmt, ## args);	\
 			if (_x < 0) {					\
@@ -35,6 +37,81 @@
 		off;							\
 	})
 
+/*
+ * format() costs a trip through snprintf() for every fragment, which is
+ * most of the time spent turning a device path into text.  These do the
+ * common cases - a string we already have, and integers in decimal or
+ * hex - by hand, with the same results: as much as fits is written and
+ * NUL-terminated, and off counts all of it whether it fit or not.
+ */
+static inline void UNUSED
+format_bytes_helper(unsigned char *buf, size_t size, ssize_t *off,
+		    const char *str, size_t len)
+{
+	if (buf != NULL && size > 0) {
+		ssize_t room = (ssize_t)(size - *off);
+		size_t n;
+
+		if (room > 0) {
+			n = len < (size_t)room ? len : (size_t)room - 1;
+			memcpy(buf + *off, str, n);
+			buf[*off + n] = '\0';
+		}
+	}
+	*off += len;
+}
+
+#define format_str(buf, size, off, str, len)				\
+	format_bytes_helper((buf), (size), &(off), (str), (len))
+
+#define format_lit(buf, size, off, str)					\
+	format_str(buf, size, off, str, sizeof(str) - 1)
+
+/* "%"PRIx64, or "0x%"PRIx64 with prefix */
+static inline void UNUSED
+format_x64_helper(unsigned char *buf, size_t size, ssize_t *off,
+		  uint64_t val, bool prefix)
+{
+	char tmp[2 + 16];
+	char *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = "0123456789abcdef"[val & 0xf];
+		val >>= 4;
+	} while (val);
+	if (prefix) {
+		*--p = 'x';
+		*--p = '0';
+	}
+	format_bytes_helper(buf, size, off, p, tmp + sizeof(tmp) - p);
+}
+
+#define format_x64(buf, size, off, val)					\
+	format_x64_helper((buf), (size), &(off), (val), false)
+#define format_0x64(buf, size, off, val)				\
+	format_x64_helper((buf), (size), &(off), (val), true)
+
+/* "%"PRId64 */
+static inline void UNUSED
+format_d64_helper(unsigned char *buf, size_t size, ssize_t *off,
+		  int64_t sval)
+{
+	char tmp[20];
+	char *p = tmp + sizeof(tmp);
+	uint64_t val = sval < 0 ? -(uint64_t)sval : (uint64_t)sval;
+
+	do {
+		*--p = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	if (sval < 0)
+		*--p = '-';
+	format_bytes_helper(buf, size, off, p, tmp + sizeof(tmp) - p);
+}
+
+#define format_d64(buf, size, off, val)					\
+	format_d64_helper((buf), (size), &(off), (val))
+
 #define format_helper(fn, buf, size, off, dp_type, args...) ({		\
 		ssize_t _x;						\
 		_x = (fn)(((buf)+(off)),				\
@@ -45,31 +122,14 @@
 		(off) += _x;						\
 	})
 
-#define onstack(buf, len) ({						\
-		char *__newbuf = alloca(len);				\
-		memcpy(__newbuf, buf, len);				\
-		free(buf);						\
-		(void *)__newbuf;					\
-	})
-
 #define format_guid(buf, size, off, dp_type, guid) ({			\
-		int _rc;						\
-		char *_guidstr = NULL;					\
+		char _guidstr[GUID_STR_LEN + 1];			\
 		efi_guid_t _guid;					\
-		const efi_guid_t * const _guid_p = &_guid;		\
 									\
 		memmove(&_guid, guid, sizeof(_guid));			\
-		_rc = efi_guid_to_str(_guid_p, &_guidstr);		\
-		if (_rc < 0) {						\
-			efi_error("could not build %s GUID DP string",	\
-				  dp_type);				\
-		} else {						\
-			_guidstr = onstack(_guidstr,			\
-					   strlen(_guidstr)+1);		\
-			_rc = format(buf, size, off, dp_type, "%s",	\
-				     _guidstr);				\
-		}							\
-		_rc;							\
+		encode_guid_text(&_guid, _guidstr);			\
+		format_str(buf, size, off, _guidstr, GUID_STR_LEN);	\
+		off;							\
 	})
 
 static inline ssize_t UNUSED
@@ -77,12 +137,20 @@ format_hex_helper(unsigned char *buf, size_t size, const char *dp_type,
 		  char *separator, int stride, const void * const addr,
 		  const size_t len)
 {
+	const unsigned char *p = addr;
+	size_t seplen = separator ? strlen(separator) : 0;
 	ssize_t off = 0;
+
+	(void)dp_type;
 	for (size_t i = 0; i < len; i++) {
-		if (i && separator && stride > 0 && i % stride == 0)
-			format(buf, size, off, dp_type, "%s", separator);
-		format(buf, size, off, dp_type, "%02x",
-		       *((const unsigned char * const )addr+i));
+		char hex[2] = {
+			"0123456789abcdef"[p[i] >> 4],
+			"0123456789abcdef"[p[i] & 0xf],
+		};
+
+		if (i && seplen && stride > 0 && i % stride == 0)
+			format_str(buf, size, off, separator, seplen);
+		format_str(buf, size, off, hex, 2);
 	}
 	return off;
 }
@@ -119,20 +187,14 @@ format_vendor_helper(unsigned char *buf, size_t size, char *label,
 	format_helper(format_vendor_helper, buf, size, off, label, dp)
 
 #define format_ucs2(buf, size, off, dp_type, str, len) ({		\
-		uint16_t *_ucs2buf;					\
-		uint32_t _ucs2size = sizeof(uint16_t) * len;		\
-		_ucs2buf = alloca(_ucs2size);				\
-		if (_ucs2buf == NULL)					\
-			return -1;					\
-		memset(_ucs2buf, '\0', _ucs2size);			\
-		memcpy(_ucs2buf, str, _ucs2size - sizeof(uint16_t));	\
-		unsigned char *_asciibuf;				\
-		_asciibuf = ucs2_to_utf8(_ucs2buf, (len) - 1);		\
-		if (_asciibuf == NULL)					\
-			return -1;					\
-		_asciibuf = onstack(_asciibuf, (len));			\
-		format(buf, size, off, dp_type, "%s", _asciibuf);	\
-       })
+		size_t _utf8size = (len) * 3 + 1;			\
+		unsigned char *_utf8buf = alloca(_utf8size);		\
+		ssize_t _utf8len;					\
+		_utf8len = ucs2_to_utf8_buf(_utf8buf, _utf8size, (str),	\
+					    (len) ? (ssize_t)(len) - 1 : 0); \
+		format_str(buf, size, off, (char *)_utf8buf, _utf8len);	\
+		off;							\
+	})
 
 #define format_array(buf, size, off, dp_type, fmt, type, addr, len) ({	\
 		for (size_t _i = 0; _i < len; _i++) {			\
@@ -150,6 +212,19 @@ extern ssize_t _format_message_dn(unsigned char *buf, size_t size, const_efidp d
 extern ssize_t _format_media_dn(unsigned char *buf, size_t size, const_efidp dp);
 extern ssize_t _format_bios_boot_dn(unsigned char *buf, size_t size, const_efidp dp);
 
+/*
+ * The nodes that show up in nearly every path, which don't need
+ * everything the per-type formatters above do.
+ */
+extern ssize_t _format_pci_dn(unsigned char *buf, size_t size, const_efidp dp);
+extern ssize_t _format_acpi_hid_dn(unsigned char *buf, size_t size, const_efidp dp);
+extern ssize_t _format_scsi_dn(unsigned char *buf, size_t size, const_efidp dp);
+extern ssize_t _format_usb_dn(unsigned char *buf, size_t size, const_efidp dp);
+extern ssize_t _format_sata_dn(unsigned char *buf, size_t size, const_efidp dp);
+extern ssize_t _format_nvme_dn(unsigned char *buf, size_t size, const_efidp dp);
+extern ssize_t _format_hd_dn(unsigned char *buf, size_t size, const_efidp dp);
+extern ssize_t _format_file_dn(unsigned char *buf, size_t size, const_efidp dp);
+
 #define format_helper_2(name, buf, size, off, dp) ({			\
 		ssize_t _sz;						\
 		_sz = name(((buf)+(off)),				\
@@ -10,6 +10,12 @@
 #include "efivar.h"
 #include <efivar/efiboot.h>
 
+/* efi_generate_file_device_paths(), for callers that have a va_list */
+extern int HIDDEN va_generate_file_device_paths(const char * const *filepaths,
+						size_t n, uint8_t **dps,
+						ssize_t *dp_sizes,
+						uint32_t options, va_list ap);
+
 #endif /* !PRIVATE_EFIBOOT_H_ */
 
 // vim:fenc=utf-8:tw=75:noet
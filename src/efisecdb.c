@@ -11,6 +11,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -21,6 +22,7 @@
 #include <sys/mman.h>
 
 #include "efisec.h"
+#include "pe-hash.h"
 
 #define PROGRAM_NAME "efisecdb"
 
@@ -150,6 +152,8 @@ usage(int status)
 		"  -h, --hash=<hash>         hash value to add (\n"
 		"  -t, --type=<hash-type>    hash type to add (\"help\" lists options)\n"
 		"  -c, --certificate=<file>  certificate file to add\n"
+		"  -p, --add-pe-hash=<file>  PE image whose Authenticode hash to add\n"
+		"  -u, --update-for=<file>   only output what must be appended to <file>\n"
 		"  -L, --list-guids          list well known guids\n",
 		PROGRAM_NAME);
 	exit(status);
@@ -168,11 +172,16 @@ typedef struct {
 	efi_secdb_type_t algorithm;
 	uint8_t *data;
 	size_t datasz;
+
+	/* for --add-pe-hash, data is filled in from here later */
+	char *pe_file;
+	int pe_errno;
+	const char *pe_error;
 } action_t;
 #define for_each_action(pos, head) list_for_each(pos, head)
 #define for_each_action_safe(pos, n, head) list_for_each_safe(pos, n, head)
 
-static void
+static action_t *
 add_action(list_t *list, action_type_t action_type, const efi_guid_t *owner,
 	   efi_secdb_type_t algorithm, uint8_t *data, size_t datasz)
 {
@@ -190,6 +199,7 @@ add_action(list_t *list, action_type_t action_type, const efi_guid_t *owner,
 	action->data = data;
 	action->datasz = datasz;
 	list_add_tail(&action->list, list);
+	return action;
 }
 
 static void
@@ -252,63 +262,377 @@ list_guids(void)
 	}
 }
 
+static void
+hash_pe_file(action_t *action)
+{
+	struct stat sb;
+	uint8_t *map;
+	int fd;
+
+	fd = open(action->pe_file, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		action->pe_error = "could not open";
+		goto err;
+	}
+	if (fstat(fd, &sb) < 0) {
+		action->pe_error = "could not stat";
+		goto err_close;
+	}
+	if (!S_ISREG(sb.st_mode) || sb.st_size == 0) {
+		errno = EINVAL;
+		action->pe_error = "could not hash";
+		goto err_close;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		action->pe_error = "could not map";
+		goto err_close;
+	}
+	close(fd);
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+	action->data = malloc(SHA256_DIGEST_SIZE);
+	if (!action->data) {
+		action->pe_error = "could not allocate memory for";
+		goto err_unmap;
+	}
+	if (pe_hash_sha256(map, sb.st_size, action->data) < 0) {
+		action->pe_error = "could not find a valid PE image in";
+		goto err_unmap;
+	}
+	action->datasz = SHA256_DIGEST_SIZE;
+	munmap(map, sb.st_size);
+	return;
+
+err_unmap:
+	action->pe_errno = errno;
+	munmap(map, sb.st_size);
+	return;
+err_close:
+	action->pe_errno = errno;
+	close(fd);
+	return;
+err:
+	action->pe_errno = errno;
+}
+
+/*
+ * Run worker(arg) on a thread per CPU, but no more than n of them.  This
+ * thread does its share too, and all of it if we get no help.
+ */
+static void
+run_workers(void *(*worker)(void *), void *arg, size_t n)
+{
+	pthread_t *workers = NULL;
+	unsigned int nworkers = 0;
+	long ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	if ((size_t)ncpus > n)
+		ncpus = n;
+	if (ncpus > 1)
+		workers = calloc(ncpus - 1, sizeof(*workers));
+
+	for (long i = 0; workers && i < ncpus - 1; i++) {
+		if (pthread_create(&workers[i], NULL, worker, arg))
+			break;
+		nworkers++;
+	}
+	debug("running %zd jobs on %u threads", n, nworkers + 1);
+	worker(arg);
+	for (unsigned int i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+}
+
+struct pe_hash_queue {
+	action_t **actions;
+	size_t n;
+	size_t next;
+};
+
+static void *
+pe_hash_worker(void *arg)
+{
+	struct pe_hash_queue *queue = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) <
+	       queue->n)
+		hash_pe_file(queue->actions[i]);
+	return NULL;
+}
+
+/*
+ * Signing pipelines hand us PE images by the thousand, so hash them all
+ * at once on a thread per CPU before processing the actions in order.
+ * The images are mapped rather than read so the hashing works directly
+ * out of the page cache.
+ */
+static void
+hash_pe_files(list_t *actions)
+{
+	struct pe_hash_queue queue = { 0, };
+	list_t *pos;
+
+	for_each_action(pos, actions) {
+		if (list_entry(pos, action_t, list)->pe_file)
+			queue.n++;
+	}
+	if (queue.n == 0)
+		return;
+
+	queue.actions = calloc(queue.n, sizeof(*queue.actions));
+	if (!queue.actions)
+		err(1, "could not allocate memory");
+	queue.n = 0;
+	for_each_action(pos, actions) {
+		action_t *action = list_entry(pos, action_t, list);
+
+		if (action->pe_file)
+			queue.actions[queue.n++] = action;
+	}
+
+	run_workers(pe_hash_worker, &queue, queue.n);
+
+	for (size_t i = 0; i < queue.n; i++) {
+		action_t *action = queue.actions[i];
+
+		if (action->pe_error) {
+			errno = action->pe_errno;
+			err(1, "%s \"%s\"", action->pe_error, action->pe_file);
+		}
+	}
+	free(queue.actions);
+}
+
+typedef struct {
+	const char *name;
+	efi_secdb_t *secdb;
+	bool bad;		// it's not a database we can parse
+	const char *error;	// or what else went wrong with it
+	int error_errno;
+} input_file_t;
+
+/*
+ * Parse input->name into input->secdb, which has to be there already.
+ * There's nothing to report here; an input that didn't work out has
+ * bad or error set.
+ */
+static void
+parse_input_file(input_file_t *input)
+{
+	int infd = -1;
+	uint8_t *siglist = NULL;
+	size_t siglistsz = 0;
+	bool mapped = false;
+	struct stat sb;
+	const char *infile = input->name;
+	int rc;
+
+	debug("adding input file %s", infile);
+	infd = open(infile, O_RDONLY);
+	if (infd < 0) {
+		input->error = "could not open";
+		goto err;
+	}
+
+	/*
+	 * Pipes and such get read a signature at a time.  That can't
+	 * fix up bad list sizes or skip a variable's attributes, so
+	 * files we can map get the whole file treatment without being
+	 * copied into memory first.  Mapping them privately is fine
+	 * since efi_secdb_parse() only writes when it's correcting
+	 * things for itself.
+	 */
+	if (fstat(infd, &sb) < 0) {
+		input->error = "could not stat";
+		goto err_close;
+	}
+	if (!S_ISREG(sb.st_mode)) {
+		rc = efi_secdb_parse_fd(infd, &input->secdb);
+		close(infd);
+		if (rc < 0)
+			input->bad = true;
+		return;
+	}
+
+	siglistsz = sb.st_size;
+	if (siglistsz > 0) {
+		siglist = mmap(NULL, siglistsz, PROT_READ|PROT_WRITE,
+			       MAP_PRIVATE, infd, 0);
+		if (siglist == MAP_FAILED)
+			siglist = NULL;
+		else
+			mapped = true;
+	}
+	if (!mapped) {
+		rc = read_file(infd, &siglist, &siglistsz);
+		if (rc < 0) {
+			input->error = "could not read";
+			goto err_close;
+		}
+		siglistsz -= 1;
+	}
+	close(infd);
+
+	rc = efi_secdb_parse(siglist, siglistsz, &input->secdb);
+	efi_error_clear();
+	if (rc < 0) {
+		/* haaaack city */
+		debug("*****************************");
+		debug(" starting over with offset 4");
+		debug("*****************************");
+		if (siglistsz > 4 && !(*(uint32_t *)siglist & ~0x7ffu))
+			rc = efi_secdb_parse(&siglist[4], siglistsz-4,
+					     &input->secdb);
+		if (rc < 0)
+			input->bad = true;
+	}
+	if (mapped)
+		munmap(siglist, siglistsz);
+	else
+		xfree(siglist);
+	return;
+
+err_close:
+	input->error_errno = errno;
+	close(infd);
+	return;
+err:
+	input->error_errno = errno;
+}
+
+struct parse_queue {
+	input_file_t *inputs;
+	size_t n;
+	size_t next;
+};
+
+static void *
+parse_worker(void *arg)
+{
+	struct parse_queue *queue = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) <
+	       queue->n)
+		parse_input_file(&queue->inputs[i]);
+	return NULL;
+}
+
 /*
+ * With more than one input, each file is parsed into a secdb of its own
+ * on a thread per CPU, and then they're merged into *secdb in the order
+ * they were given, which comes out the same as parsing them all into it
+ * one after another.
+ *
  * The return value here is the UNIX shell convention, 0 is success, > 0 is
  * failure.
  */
 static int
 parse_input_files(list_t *infiles, efi_secdb_t **secdb, bool dump)
 {
+	struct parse_queue queue = { 0, };
 	int status = 0;
 	list_t *pos, *tmp;
-	int rc;
+	size_t n = 0;
 
-	for_each_ptr_safe(pos, tmp, infiles) {
-		int infd = -1;
-		uint8_t *siglist = NULL;
-		size_t siglistsz = 0;
-		char *infile;
-		ptrlist_t *entry = list_entry(pos, ptrlist_t, list);
+	for_each_ptr(pos, infiles)
+		queue.n++;
+	if (queue.n == 0)
+		return 0;
 
-		infile = entry->ptr;
+	queue.inputs = calloc(queue.n, sizeof(*queue.inputs));
+	if (!queue.inputs)
+		err(1, "could not allocate memory");
+	queue.n = 0;
+	for_each_ptr(pos, infiles) {
+		input_file_t *input = &queue.inputs[queue.n++];
 
-		debug("adding input file %s entry:%p", infile, entry);
-		infd = open(infile, O_RDONLY);
-		if (infd < 0)
-			err(1, "could not open \"%s\"", infile);
+		input->name = list_entry(pos, ptrlist_t, list)->ptr;
+		input->secdb = *secdb;
+	}
+	for (size_t i = 0; queue.n > 1 && i < queue.n; i++) {
+		input_file_t *input = &queue.inputs[i];
 
-		rc = read_file(infd, &siglist, &siglistsz);
-		if (rc < 0)
-			err(1, "could not read \"%s\"", infile);
-		siglistsz -= 1;
-		close(infd);
+		input->secdb = efi_secdb_new();
+		if (!input->secdb)
+			err(1, "could not allocate memory");
+		input->secdb->flags = (*secdb)->flags;
+	}
 
-		rc = efi_secdb_parse(siglist, siglistsz, secdb);
-		efi_error_clear();
-		if (rc < 0) {
-			/* haaaack city */
-			debug("*****************************");
-			debug(" starting over with offset 4");
-			debug("*****************************");
-			if (siglistsz > 4 && !(*(uint32_t *)siglist & ~0x7ffu))
-				rc = efi_secdb_parse(&siglist[4], siglistsz-4,
-						     secdb);
-			if (rc < 0) {
-				secdb_warnx("could not parse input file \"%s\"", infile);
-				if (!dump)
-					exit(1);
-				status = 1;
-				break;
-			}
+	run_workers(parse_worker, &queue, queue.n);
+
+	for_each_ptr_safe(pos, tmp, infiles) {
+		ptrlist_t *entry = list_entry(pos, ptrlist_t, list);
+		input_file_t *input = &queue.inputs[n++];
+
+		if (input->error) {
+			errno = input->error_errno;
+			err(1, "%s \"%s\"", input->error, input->name);
+		}
+		/* whatever parsed before it went wrong gets kept */
+		if (input->secdb != *secdb &&
+		    efi_secdb_merge(*secdb, input->secdb) < 0)
+			secdb_err(1, "could not merge input file \"%s\"",
+				  input->name);
+		if (input->bad) {
+			secdb_warnx("could not parse input file \"%s\"",
+				    input->name);
+			if (!dump)
+				exit(1);
+			status = 1;
+			break;
 		}
-		xfree(siglist);
 		list_del(&entry->list);
 		free(entry);
 	}
 
+	for (size_t i = 0; i < queue.n; i++) {
+		if (queue.inputs[i].secdb != *secdb)
+			efi_secdb_free(queue.inputs[i].secdb);
+	}
+	free(queue.inputs);
+
 	return status;
 }
 
+/*
+ * Replace secdb with just what has to be appended to the database in
+ * updatefile to turn it into secdb, so it can be written with
+ * EFI_VARIABLE_APPEND_WRITE instead of rewriting the whole variable.
+ */
+static void
+make_update(char *updatefile)
+{
+	efi_secdb_t *current = NULL, *update = NULL;
+	list_t updatefiles;
+	int rc;
+
+	current = efi_secdb_new();
+	if (!current)
+		err(1, "could not allocate memory");
+
+	INIT_LIST_HEAD(&updatefiles);
+	ptrlist_add(&updatefiles, updatefile);
+	parse_input_files(&updatefiles, &current, false);
+
+	rc = efi_secdb_diff(current, secdb, &update);
+	efi_secdb_free(current);
+	if (rc < 0)
+		secdb_err(1, "could not compute update for \"%s\"", updatefile);
+	if (rc > 0)
+		secdb_errx(1, "\"%s\" has entries the output doesn't, which can't be removed by appending\n",
+			   updatefile);
+
+	efi_secdb_free(secdb);
+	secdb = update;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -329,8 +653,9 @@ main(int argc, char *argv[])
 	bool sort_descending = false;
 	int status = 0;
 	char *outfile = NULL;
+	char *updatefile = NULL;
 
-	const char sopts[] = ":aAc:dfg:h:i:Lo:rs:t:v?";
+	const char sopts[] = ":aAc:dfg:h:i:Lo:p:rs:t:u:v?";
 	const struct option lopts[] = {
 		{"add", no_argument, NULL, 'a' },
 		{"annotate", no_argument, NULL, 'A' },
@@ -342,9 +667,11 @@ main(int argc, char *argv[])
 		{"infile", required_argument, NULL, 'i' },
 		{"list-guids", no_argument, NULL, 'L' },
 		{"outfile", required_argument, NULL, 'o' },
+		{"add-pe-hash", required_argument, NULL, 'p' },
 		{"remove", no_argument, NULL, 'r' },
 		{"sort", required_argument, NULL, 's' },
 		{"type", required_argument, NULL, 't' },
+		{"update-for", required_argument, NULL, 'u' },
 		{"verbose", no_argument, NULL, 'v' },
 		{"usage", no_argument, NULL, '?' },
 		{"help", no_argument, NULL, '?' },
@@ -447,6 +774,19 @@ main(int argc, char *argv[])
 				secdb_errx(1, "--outfile requires a value");
 			outfile = optarg;
 			break;
+		case 'p':
+			if (optarg == NULL)
+				secdb_errx(1, "--add-pe-hash requires a value");
+			if (hash_index >= 0 &&
+			    hash_params[hash_index].algorithm != SHA256)
+				secdb_errx(1, "PE images can only be hashed with sha256");
+			debug("%s hash of PE image %s",
+			      mode == ADD ? "adding" : "removing", optarg);
+			if (mode == ADD)
+				wants_add_actions = true;
+			add_action(&actions, mode, &owner, SHA256, NULL,
+				   0)->pe_file = optarg;
+			break;
 		case 'r':
 			mode = REMOVE;
 			break;
@@ -483,6 +823,13 @@ sort_err:
 				secdb_errx(1, "--type requires a value");
 			set_hash_parameters(optarg, &hash_index);
 			break;
+		case 'u':
+			if (updatefile)
+				secdb_errx(1, "--update-for cannot be used multiple times.");
+			if (optarg == NULL)
+				secdb_errx(1, "--update-for requires a value");
+			updatefile = optarg;
+			break;
 		case 'v':
 			if (optarg) {
 				long v;
@@ -518,6 +865,8 @@ sort_err:
 	if (list_empty(&infiles) && !wants_add_actions)
 		errx(1, "no input files or database additions");
 
+	hash_pe_files(&actions);
+
 	secdb = efi_secdb_new();
 	if (!secdb)
 		err(1, "could not allocate memory");
@@ -551,6 +900,9 @@ sort_err:
 		}
 	}
 
+	if (status == 0 && updatefile)
+		make_update(updatefile);
+
 	if (dump)
 		secdb_dump(secdb, annotate);
 
@@ -0,0 +1,908 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * efivar-bench.c - microbenchmarks for libefivar, libefiboot, and libefisec
+ *
+ * This is linked against the library objects rather than the shared
+ * libraries, so it can time internals like GPT parsing and UCS-2
+ * conversion that aren't exported.  Variable benchmarks run against
+ * whatever EFIVARFS_PATH points at, which has to be set to a scratch
+ * directory, or against LIBEFIVAR_OPS=memory; see tests/run-bench.
+ */
+
+#include "fix_coverity.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "efiboot.h"
+#include "efisec.h"
+#include "ucs2.h"
+
+#define PROGRAM_NAME "efivar-bench"
+
+/*
+ * Bumped whenever a benchmark's workload changes, so old and new results
+ * aren't compared as if they measured the same thing.
+ */
+#define BENCH_FORMAT_VERSION 1
+
+#define BENCH_VARIABLES		256
+#define BENCH_VARIABLE_SIZE	64
+#define BENCH_GPT_PARTITIONS	16
+#define BENCH_GPT_ENTRIES	128
+#define BENCH_GPT_SECTORS	(64 * 1024)	// 32MiB, sparse
+#define BENCH_SECDB_ENTRIES	1024
+
+static const efi_guid_t bench_guid =
+	EFI_GUID(0x6c4b7f1e, 0x4b8d, 0x4c6a, 0x9d1e, 0x2b, 0x5e, 0x0f, 0x1a,
+		 0x7c, 0x3d);
+
+typedef struct {
+	const char *name;
+	int (*setup)(void);
+	/* returns the number of bytes processed, or -1 on error */
+	int64_t (*run)(uint64_t iterations);
+	void (*teardown)(void);
+} bench_t;
+
+static int verbosity = 0;
+
+/*
+ * The same pseudo-random sequence every run, so every run does the same
+ * work.
+ */
+static uint64_t prng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t
+prng(void)
+{
+	prng_state ^= prng_state << 13;
+	prng_state ^= prng_state >> 7;
+	prng_state ^= prng_state << 17;
+	return prng_state;
+}
+
+static void
+prng_fill(uint8_t *buf, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		buf[i] = prng() & 0xff;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * variables
+ */
+static uint8_t variable_data[BENCH_VARIABLE_SIZE];
+
+#define VARIABLE_ATTRIBUTES (EFI_VARIABLE_NON_VOLATILE |	\
+			     EFI_VARIABLE_BOOTSERVICE_ACCESS |	\
+			     EFI_VARIABLE_RUNTIME_ACCESS)
+
+static void
+variable_name(char name[16], unsigned int n)
+{
+	snprintf(name, 16, "Bench%04u", n);
+}
+
+static int
+variables_setup(void)
+{
+	const char *ops = getenv("LIBEFIVAR_OPS");
+	char name[16];
+
+	if (!getenv("EFIVARFS_PATH") && !(ops && !strcmp(ops, "memory")))
+		errx(1, "EFIVARFS_PATH must be set to a scratch directory");
+
+	prng_fill(variable_data, sizeof(variable_data));
+	for (unsigned int i = 0; i < BENCH_VARIABLES; i++) {
+		variable_name(name, i);
+		if (efi_set_variable(bench_guid, name, variable_data,
+				     sizeof(variable_data),
+				     VARIABLE_ATTRIBUTES, 0600) < 0) {
+			warn("could not create %s", name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+variables_teardown(void)
+{
+	char name[16];
+
+	for (unsigned int i = 0; i < BENCH_VARIABLES; i++) {
+		variable_name(name, i);
+		efi_del_variable(bench_guid, name);
+	}
+}
+
+static int64_t
+variables_enumerate(uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		efi_varname_iter_t *iter = NULL;
+		efi_guid_t *guid = NULL;
+		char *name = NULL;
+		unsigned int found = 0;
+		int rc;
+
+		if (efi_varname_iter_new(&iter) < 0)
+			return -1;
+		while ((rc = efi_varname_iter_next(iter, &guid, &name)) > 0)
+			found += 1;
+		efi_varname_iter_free(iter);
+		if (rc < 0 || found < BENCH_VARIABLES)
+			return -1;
+	}
+	return 0;
+}
+
+static int64_t
+variables_get(uint64_t iterations)
+{
+	char name[16];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		uint8_t *data = NULL;
+		size_t data_size = 0;
+		uint32_t attributes = 0;
+
+		variable_name(name, i % BENCH_VARIABLES);
+		if (efi_get_variable(bench_guid, name, &data, &data_size,
+				     &attributes) < 0)
+			return -1;
+		free(data);
+	}
+	return iterations * sizeof(variable_data);
+}
+
+static int64_t
+variables_get_into(uint64_t iterations)
+{
+	uint8_t buf[BENCH_VARIABLE_SIZE];
+	char name[16];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		size_t data_size = 0;
+		uint32_t attributes = 0;
+
+		variable_name(name, i % BENCH_VARIABLES);
+		if (efi_get_variable_into(bench_guid, name, buf, sizeof(buf),
+					  &data_size, &attributes) < 0)
+			return -1;
+	}
+	return iterations * sizeof(buf);
+}
+
+static int64_t
+variables_set(uint64_t iterations)
+{
+	char name[16];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		variable_name(name, i % BENCH_VARIABLES);
+		variable_data[0] = i & 0xff;
+		if (efi_set_variable(bench_guid, name, variable_data,
+				     sizeof(variable_data),
+				     VARIABLE_ATTRIBUTES, 0600) < 0)
+			return -1;
+	}
+	return iterations * sizeof(variable_data);
+}
+
+/*
+ * GPT
+ */
+static int gpt_fd = -1;
+
+static void
+gpt_write_header(uint8_t *sector, uint64_t my_lba, uint64_t alternate_lba,
+		 uint64_t entries_lba, uint32_t entries_crc)
+{
+	gpt_header *gpt = (gpt_header *)sector;
+
+	memset(gpt, 0, sizeof(*gpt));
+	gpt->magic = cpu_to_le64(GPT_HEADER_MAGIC);
+	gpt->revision = cpu_to_le32(GPT_HEADER_REVISION_V1_00);
+	gpt->header_size = cpu_to_le32(92);
+	gpt->my_lba = cpu_to_le64(my_lba);
+	gpt->alternate_lba = cpu_to_le64(alternate_lba);
+	gpt->first_usable_lba = cpu_to_le64(34);
+	gpt->last_usable_lba = cpu_to_le64(BENCH_GPT_SECTORS - 34);
+	memcpy(&gpt->disk_guid, &bench_guid, sizeof(bench_guid));
+	gpt->partition_entry_lba = cpu_to_le64(entries_lba);
+	gpt->num_partition_entries = cpu_to_le32(BENCH_GPT_ENTRIES);
+	gpt->sizeof_partition_entry = cpu_to_le32(sizeof(gpt_entry));
+	gpt->partition_entry_array_crc32 = cpu_to_le32(entries_crc);
+	gpt->header_crc32 = cpu_to_le32(efi_crc32(gpt, 92));
+}
+
+static int
+gpt_setup(void)
+{
+	const efi_guid_t esp = PARTITION_SYSTEM_GUID;
+	const char *tmpdir = getenv("TMPDIR");
+	static gpt_entry ptes[BENCH_GPT_ENTRIES];
+	const size_t ptes_size = sizeof(ptes);
+	const uint64_t lastlba = BENCH_GPT_SECTORS - 1;
+	const uint64_t part_size = (BENCH_GPT_SECTORS - 68) /
+				   BENCH_GPT_PARTITIONS;
+	uint8_t sector[GPT_BLOCK_SIZE];
+	legacy_mbr *pmbr = (legacy_mbr *)sector;
+	char path[PATH_MAX];
+	uint32_t entries_crc;
+
+	snprintf(path, sizeof(path), "%s/efivar-bench-XXXXXX",
+		 tmpdir ? tmpdir : "/tmp");
+	gpt_fd = mkstemp(path);
+	if (gpt_fd < 0) {
+		warn("could not create %s", path);
+		return -1;
+	}
+	unlink(path);
+
+	memset(ptes, 0, sizeof(ptes));
+	for (unsigned int i = 0; i < BENCH_GPT_PARTITIONS; i++) {
+		memcpy(&ptes[i].partition_type_guid,
+		       i == 0 ? &esp : &bench_guid, sizeof(efi_guid_t));
+		prng_fill((uint8_t *)&ptes[i].unique_partition_guid,
+			  sizeof(efi_guid_t));
+		ptes[i].starting_lba = cpu_to_le64(34 + i * part_size);
+		ptes[i].ending_lba = cpu_to_le64(34 + (i + 1) * part_size - 1);
+		utf8_to_ucs2(ptes[i].partition_name,
+			     sizeof(ptes[i].partition_name), true,
+			     (const unsigned char *)"bench partition");
+	}
+	entries_crc = efi_crc32(ptes, ptes_size);
+
+	if (ftruncate(gpt_fd, BENCH_GPT_SECTORS * GPT_BLOCK_SIZE) < 0)
+		goto err;
+
+	memset(sector, 0, sizeof(sector));
+	pmbr->partition[0].os_type = EFI_PMBR_OSTYPE_EFI_GPT;
+	pmbr->partition[0].starting_lba = cpu_to_le32(1);
+	pmbr->partition[0].size_in_lba = cpu_to_le32(lastlba);
+	pmbr->magic = cpu_to_le16(MSDOS_MBR_MAGIC);
+	if (pwrite(gpt_fd, sector, sizeof(sector), 0) != sizeof(sector))
+		goto err;
+
+	gpt_write_header(sector, 1, lastlba, 2, entries_crc);
+	if (pwrite(gpt_fd, sector, sizeof(sector), GPT_BLOCK_SIZE)
+	    != sizeof(sector) ||
+	    pwrite(gpt_fd, ptes, ptes_size, 2 * GPT_BLOCK_SIZE)
+	    != (ssize_t)ptes_size)
+		goto err;
+
+	gpt_write_header(sector, lastlba, 1, lastlba - 32, entries_crc);
+	if (pwrite(gpt_fd, ptes, ptes_size, (lastlba - 32) * GPT_BLOCK_SIZE)
+	    != (ssize_t)ptes_size ||
+	    pwrite(gpt_fd, sector, sizeof(sector), lastlba * GPT_BLOCK_SIZE)
+	    != sizeof(sector))
+		goto err;
+
+	return 0;
+err:
+	warn("could not write GPT image");
+	close(gpt_fd);
+	gpt_fd = -1;
+	return -1;
+}
+
+static void
+gpt_teardown(void)
+{
+	efi_gpt_cache_flush();
+	if (gpt_fd >= 0)
+		close(gpt_fd);
+	gpt_fd = -1;
+}
+
+static int64_t
+gpt_parse_common(uint64_t iterations, bool cached)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		uint64_t start = 0, size = 0;
+		efi_guid_t signature;
+		uint8_t mbr_type = 0, signature_type = 0;
+
+		if (!cached)
+			efi_gpt_cache_flush();
+		if (gpt_disk_get_partition_info(gpt_fd, NULL,
+				i % BENCH_GPT_PARTITIONS + 1, &start, &size,
+				&signature, &mbr_type, &signature_type,
+				0, GPT_BLOCK_SIZE) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int64_t
+gpt_parse(uint64_t iterations)
+{
+	return gpt_parse_common(iterations, false);
+}
+
+static int64_t
+gpt_parse_cached(uint64_t iterations)
+{
+	return gpt_parse_common(iterations, true);
+}
+
+/*
+ * device paths
+ */
+static uint8_t dp_buf[1024];
+static ssize_t dp_size;
+static unsigned char dp_text[1024];
+
+static ssize_t
+dp_generate_one(uint8_t *buf, ssize_t size)
+{
+	static char filename[] = "\\EFI\\bench\\shimx64.efi";
+	uint8_t eui[8] = { 0x00, 0x25, 0x38, 0xb5, 0x71, 0xb0, 0x5d, 0x21 };
+	uint8_t *signature = (uint8_t *)&bench_guid;
+	ssize_t off = 0, sz;
+
+#define dp_append(expr) ({						\
+		sz = (expr);						\
+		if (sz < 0)						\
+			return -1;					\
+		off += sz;						\
+	})
+	dp_append(efidp_make_acpi_hid(buf + off, size ? size - off : 0,
+				      EFIDP_ACPI_PCIE_ROOT_HID, 0));
+	dp_append(efidp_make_pci(buf + off, size ? size - off : 0, 0x1d, 0));
+	dp_append(efidp_make_nvme(buf + off, size ? size - off : 0, 1, eui));
+	dp_append(efidp_make_hd(buf + off, size ? size - off : 0, 1, 2048,
+				1228800, signature, EFIDP_HD_FORMAT_GPT,
+				EFIDP_HD_SIGNATURE_GUID));
+	dp_append(efidp_make_file(buf + off, size ? size - off : 0,
+				  filename));
+#undef dp_append
+	/* this one's a macro that brings its own semicolon */
+	sz = efidp_make_end_entire(buf + off, size ? size - off : 0)
+	if (sz < 0)
+		return -1;
+	return off + sz;
+}
+
+static int
+dp_setup(void)
+{
+	dp_size = dp_generate_one(dp_buf, sizeof(dp_buf));
+	if (dp_size < 0) {
+		warn("could not generate device path");
+		return -1;
+	}
+	if (efidp_format_device_path(dp_text, sizeof(dp_text),
+				     (const_efidp)dp_buf, dp_size) < 0) {
+		warn("could not format device path");
+		return -1;
+	}
+	return 0;
+}
+
+static int64_t
+dp_generate(uint64_t iterations)
+{
+	uint8_t buf[1024];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (dp_generate_one(buf, sizeof(buf)) < 0)
+			return -1;
+	}
+	return iterations * dp_size;
+}
+
+static int64_t
+dp_format(uint64_t iterations)
+{
+	unsigned char buf[1024];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (efidp_format_device_path(buf, sizeof(buf),
+					     (const_efidp)dp_buf,
+					     dp_size) < 0)
+			return -1;
+	}
+	return iterations * dp_size;
+}
+
+static int64_t
+dp_parse(uint64_t iterations)
+{
+	uint8_t buf[1024];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (efidp_parse_device_path(dp_text, (efidp)buf,
+					    sizeof(buf)) < 0)
+			return -1;
+	}
+	return iterations * dp_size;
+}
+
+/*
+ * What matching a boot entry does: check the path, then look for its HD()
+ * and File() nodes.
+ */
+static int64_t
+dp_index(uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		efidp_index_t *index = NULL;
+
+		if (efidp_index_new((const_efidp)dp_buf, dp_size, &index) < 0)
+			return -1;
+		if (efidp_index_find(index, EFIDP_MEDIA_TYPE,
+				     EFIDP_MEDIA_HD) < 0 ||
+		    efidp_index_find(index, EFIDP_MEDIA_TYPE,
+				     EFIDP_MEDIA_FILE) < 0) {
+			efidp_index_free(index);
+			return -1;
+		}
+		efidp_index_free(index);
+	}
+	return iterations * dp_size;
+}
+
+/*
+ * signature lists
+ */
+static efi_sha256_hash_t *secdb_hashes;
+static efi_secdb_t *secdb_parsed;
+static void *secdb_blob;
+static size_t secdb_blobsz;
+static void *secdb_outbuf;
+
+static efi_secdb_t *
+secdb_build(void)
+{
+	efi_secdb_t *secdb;
+
+	secdb = efi_secdb_new();
+	if (!secdb)
+		return NULL;
+	for (size_t i = 0; i < BENCH_SECDB_ENTRIES; i++) {
+		if (efi_secdb_add_entry(secdb, &bench_guid, SHA256,
+					(efi_secdb_data_t *)&secdb_hashes[i],
+					sizeof(secdb_hashes[i])) < 0) {
+			efi_secdb_free(secdb);
+			return NULL;
+		}
+	}
+	return secdb;
+}
+
+static int
+secdb_setup(void)
+{
+	efi_secdb_t *secdb;
+
+	secdb_hashes = calloc(BENCH_SECDB_ENTRIES, sizeof(*secdb_hashes));
+	if (!secdb_hashes)
+		goto err;
+	prng_fill((uint8_t *)secdb_hashes,
+		  BENCH_SECDB_ENTRIES * sizeof(*secdb_hashes));
+
+	secdb = secdb_build();
+	if (!secdb)
+		goto err;
+	if (efi_secdb_realize(secdb, &secdb_blob, &secdb_blobsz) < 0) {
+		efi_secdb_free(secdb);
+		goto err;
+	}
+	efi_secdb_free(secdb);
+
+	secdb_outbuf = malloc(secdb_blobsz);
+	if (!secdb_outbuf)
+		goto err;
+	if (efi_secdb_parse(secdb_blob, secdb_blobsz, &secdb_parsed) < 0)
+		goto err;
+	return 0;
+err:
+	warn("could not build signature list");
+	return -1;
+}
+
+static void
+secdb_teardown(void)
+{
+	if (secdb_parsed)
+		efi_secdb_free(secdb_parsed);
+	secdb_parsed = NULL;
+	free(secdb_outbuf);
+	secdb_outbuf = NULL;
+	free(secdb_blob);
+	secdb_blob = NULL;
+	free(secdb_hashes);
+	secdb_hashes = NULL;
+}
+
+static int64_t
+secdb_parse(uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		efi_secdb_t *secdb = NULL;
+
+		if (efi_secdb_parse(secdb_blob, secdb_blobsz, &secdb) < 0)
+			return -1;
+		efi_secdb_free(secdb);
+	}
+	return iterations * secdb_blobsz;
+}
+
+static int64_t
+secdb_parse_view(uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		efi_secdb_t *secdb = NULL;
+
+		if (efi_secdb_parse_view(secdb_blob, secdb_blobsz,
+					 &secdb) < 0)
+			return -1;
+		efi_secdb_free(secdb);
+	}
+	return iterations * secdb_blobsz;
+}
+
+static int64_t
+secdb_realize(uint64_t iterations)
+{
+	size_t outsize = 0;
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (efi_secdb_realize_into(secdb_parsed, secdb_outbuf,
+					   secdb_blobsz, &outsize) < 0)
+			return -1;
+	}
+	return iterations * secdb_blobsz;
+}
+
+/*
+ * Adding in an order that isn't sorted means the first realize has to
+ * sort everything.
+ */
+static int64_t
+secdb_sort(uint64_t iterations)
+{
+	size_t outsize = 0;
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		efi_secdb_t *secdb = secdb_build();
+		int rc;
+
+		if (!secdb)
+			return -1;
+		rc = efi_secdb_realize_into(secdb, secdb_outbuf, secdb_blobsz,
+					    &outsize);
+		efi_secdb_free(secdb);
+		if (rc < 0)
+			return -1;
+	}
+	return iterations * secdb_blobsz;
+}
+
+/*
+ * UCS-2
+ */
+static const unsigned char ucs2_ascii[] =
+	"Linux Boot Manager (systemd-boot) on NVMe disk, partition 1 of 4";
+static const unsigned char ucs2_mixed[] =
+	"Gestionnaire de d\xc3\xa9marrage \xe2\x80\x94 \xc3\x89lectronique";
+static uint16_t ucs2_ascii_buf[sizeof(ucs2_ascii)];
+static uint16_t ucs2_mixed_buf[sizeof(ucs2_mixed)];
+
+static int
+ucs2_setup(void)
+{
+	if (utf8_to_ucs2(ucs2_ascii_buf, sizeof(ucs2_ascii_buf), true,
+			 ucs2_ascii) < 0 ||
+	    utf8_to_ucs2(ucs2_mixed_buf, sizeof(ucs2_mixed_buf), true,
+			 ucs2_mixed) < 0) {
+		warnx("could not convert UCS-2 test strings");
+		return -1;
+	}
+	return 0;
+}
+
+static int64_t
+ucs2_to_utf8_common(uint64_t iterations, const uint16_t *s, size_t len)
+{
+	unsigned char buf[256];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (ucs2_to_utf8_buf(buf, sizeof(buf), s, -1) < 0)
+			return -1;
+	}
+	return iterations * len;
+}
+
+static int64_t
+utf8_to_ucs2_common(uint64_t iterations, const unsigned char *s, size_t len)
+{
+	uint16_t buf[256];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (utf8_to_ucs2(buf, sizeof(buf), true, s) < 0)
+			return -1;
+	}
+	return iterations * len;
+}
+
+static int64_t
+ucs2_to_utf8_ascii(uint64_t iterations)
+{
+	return ucs2_to_utf8_common(iterations, ucs2_ascii_buf,
+				   sizeof(ucs2_ascii) - 1);
+}
+
+static int64_t
+ucs2_to_utf8_mixed(uint64_t iterations)
+{
+	return ucs2_to_utf8_common(iterations, ucs2_mixed_buf,
+				   sizeof(ucs2_mixed) - 1);
+}
+
+static int64_t
+utf8_to_ucs2_ascii(uint64_t iterations)
+{
+	return utf8_to_ucs2_common(iterations, ucs2_ascii,
+				   sizeof(ucs2_ascii) - 1);
+}
+
+static int64_t
+utf8_to_ucs2_mixed(uint64_t iterations)
+{
+	return utf8_to_ucs2_common(iterations, ucs2_mixed,
+				   sizeof(ucs2_mixed) - 1);
+}
+
+/*
+ * Names are part of the output format; don't rename things, add new ones.
+ */
+static const bench_t benchmarks[] = {
+	{ "variables.enumerate", variables_setup, variables_enumerate,
+	  variables_teardown },
+	{ "variables.get", variables_setup, variables_get,
+	  variables_teardown },
+	{ "variables.get_into", variables_setup, variables_get_into,
+	  variables_teardown },
+	{ "variables.set", variables_setup, variables_set,
+	  variables_teardown },
+	{ "gpt.parse", gpt_setup, gpt_parse, gpt_teardown },
+	{ "gpt.parse_cached", gpt_setup, gpt_parse_cached, gpt_teardown },
+	{ "dp.generate", dp_setup, dp_generate, NULL },
+	{ "dp.format", dp_setup, dp_format, NULL },
+	{ "dp.parse", dp_setup, dp_parse, NULL },
+	{ "dp.index", dp_setup, dp_index, NULL },
+	{ "esl.parse", secdb_setup, secdb_parse, secdb_teardown },
+	{ "esl.parse_view", secdb_setup, secdb_parse_view, secdb_teardown },
+	{ "esl.realize", secdb_setup, secdb_realize, secdb_teardown },
+	{ "esl.sort", secdb_setup, secdb_sort, secdb_teardown },
+	{ "ucs2.to_utf8.ascii", ucs2_setup, ucs2_to_utf8_ascii, NULL },
+	{ "ucs2.to_utf8.mixed", ucs2_setup, ucs2_to_utf8_mixed, NULL },
+	{ "ucs2.from_utf8.ascii", ucs2_setup, utf8_to_ucs2_ascii, NULL },
+	{ "ucs2.from_utf8.mixed", ucs2_setup, utf8_to_ucs2_mixed, NULL },
+};
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/*
+ * Like show_errors(), but stdout is where the results go.
+ */
+static void
+report_errors(void)
+{
+	char *filename = NULL, *function = NULL, *message = NULL;
+	int line = 0, error = 0;
+
+	for (unsigned int i = 0;
+	     efi_error_get(i, &filename, &function, &line, &message,
+			   &error) > 0; i++)
+		fprintf(stderr, " %s:%d %s(): %s: %s\n", filename, line,
+			function, strerror(error), message);
+	efi_error_clear();
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Find an iteration count that takes at least min_ns, then time it
+ * repeats times.  Reported times are per iteration, the fastest and the
+ * median of the repeats; the fastest is the one to compare, the median
+ * says how noisy it was.
+ */
+static int
+run_one(const bench_t *bench, uint64_t min_ns, unsigned int repeats,
+	bool first)
+{
+	uint64_t iterations = 1, elapsed = 0, start;
+	uint64_t samples[repeats];
+	int64_t bytes = 0;
+
+	if (bench->setup && bench->setup() < 0)
+		goto err;
+
+	/* warm up, and find out what it costs */
+	while (1) {
+		start = now_ns();
+		bytes = bench->run(iterations);
+		elapsed = now_ns() - start;
+		if (bytes < 0)
+			goto err;
+		if (elapsed >= min_ns || iterations >= (1ull << 40))
+			break;
+		if (elapsed < min_ns / 16)
+			iterations *= 16;
+		else
+			iterations = iterations * min_ns / elapsed + 1;
+	}
+
+	for (unsigned int i = 0; i < repeats; i++) {
+		start = now_ns();
+		bytes = bench->run(iterations);
+		samples[i] = now_ns() - start;
+		if (bytes < 0)
+			goto err;
+	}
+	qsort(samples, repeats, sizeof(samples[0]), compare_u64);
+
+	if (bench->teardown)
+		bench->teardown();
+
+	printf("%s\n    {\"name\": \"%s\", \"iterations\": %"PRIu64
+	       ", \"repeats\": %u, \"ns_per_op\": %.1f"
+	       ", \"ns_per_op_median\": %.1f, \"bytes_per_op\": %"PRIu64"}",
+	       first ? "" : ",", bench->name, iterations, repeats,
+	       (double)samples[0] / iterations,
+	       (double)samples[repeats / 2] / iterations,
+	       (uint64_t)bytes / iterations);
+	fflush(stdout);
+	if (verbosity >= 1)
+		fprintf(stderr, "%s: %.1fns/op\n", bench->name,
+			(double)samples[0] / iterations);
+	return 0;
+err:
+	warnx("benchmark %s failed", bench->name);
+	report_errors();
+	if (bench->teardown)
+		bench->teardown();
+	return -1;
+}
+
+static void __attribute__((__noreturn__))
+usage(int ret)
+{
+	FILE *out = ret == 0 ? stdout : stderr;
+	fprintf(out,
+		"Usage: %s [OPTION...] [BENCHMARK...]\n"
+		"  -l, --list                        list benchmarks and exit\n"
+		"  -r, --repeats N                   time each benchmark N times\n"
+		"  -t, --min-time MS                 run each timing for at least MS milliseconds\n"
+		"  -v, --verbose                     be more verbose\n"
+		"Benchmark names may end in '*' to match a prefix.\n"
+		"Help options:\n"
+		"  -?, --help                        Show this help message\n"
+		"      --usage                       Display brief usage message\n",
+		PROGRAM_NAME);
+	exit(ret);
+}
+
+static bool
+selected(const bench_t *bench, int argc, char *argv[])
+{
+	if (argc == 0)
+		return true;
+	for (int i = 0; i < argc; i++) {
+		size_t len = strlen(argv[i]);
+
+		if (len && argv[i][len - 1] == '*') {
+			if (!strncmp(bench->name, argv[i], len - 1))
+				return true;
+		} else if (!strcmp(bench->name, argv[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long repeats = 5;
+	unsigned long min_ms = 100;
+	bool list = false;
+	bool first = true;
+	char *sopts = "lr:t:v?";
+	struct option lopts[] = {
+		{"help", no_argument, 0, '?'},
+		{"list", no_argument, 0, 'l'},
+		{"min-time", required_argument, 0, 't'},
+		{"repeats", required_argument, 0, 'r'},
+		{"usage", no_argument, 0, 0},
+		{"verbose", no_argument, 0, 'v'},
+		{0, 0, 0, 0},
+	};
+	int failed = 0;
+	int c;
+	int i;
+
+	while ((c = getopt_long(argc, argv, sopts, lopts, &i)) != -1) {
+		switch (c) {
+		case 'l':
+			list = true;
+			break;
+		case 'r':
+			errno = 0;
+			repeats = strtoul(optarg, NULL, 0);
+			if (errno || repeats == 0 || repeats > 1000)
+				errx(1, "invalid argument for -r: %s", optarg);
+			break;
+		case 't':
+			errno = 0;
+			min_ms = strtoul(optarg, NULL, 0);
+			if (errno || min_ms > 60000)
+				errx(1, "invalid argument for -t: %s", optarg);
+			break;
+		case 'v':
+			verbosity += 1;
+			break;
+		case '?':
+			usage(EXIT_SUCCESS);
+			break;
+		case 0:
+			if (strcmp(lopts[i].name, "usage"))
+				usage(EXIT_SUCCESS);
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (list) {
+		for (size_t n = 0; n < NBENCHMARKS; n++)
+			printf("%s\n", benchmarks[n].name);
+		return 0;
+	}
+
+	printf("{\n  \"format\": %d,\n  \"version\": %d,\n  \"benchmarks\": [",
+	       BENCH_FORMAT_VERSION, LIBEFIVAR_VERSION);
+	for (size_t n = 0; n < NBENCHMARKS; n++) {
+		if (!selected(&benchmarks[n], argc, argv))
+			continue;
+		if (run_one(&benchmarks[n], min_ms * 1000000ull, repeats,
+			    first) < 0) {
+			failed += 1;
+			continue;
+		}
+		first = false;
+	}
+	printf("\n  ]\n}\n");
+
+	return failed ? 1 : 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -17,6 +17,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fnmatch.h>
 #include <string.h>
 #include <limits.h>
 
@@ -35,6 +36,12 @@ extern int optind, opterr, optopt;
 #define ACTION_PRINT_DEC	0x20
 #define ACTION_IMPORT		0x40
 #define ACTION_EXPORT		0x80
+#define ACTION_EXPORT_ALL	0x100
+#define ACTION_IMPORT_ALL	0x200
+#define ACTION_WATCH		0x400
+#define ACTION_BATCH		0x800
+#define ACTION_SAVE_INDEX	0x1000
+#define ACTION_COMPARE_INDEX	0x2000
 
 #define EDIT_APPEND	0
 #define EDIT_WRITE	1
@@ -42,6 +49,10 @@ extern int optind, opterr, optopt;
 #define SHOW_VERBOSE	0
 #define SHOW_DECIMAL	1
 
+#define FORMAT_TEXT	0
+#define FORMAT_JSON	1
+#define FORMAT_CBOR	2
+
 #define PROGRAM_NAME "efivar"
 
 static const char *attribute_names[] = {
@@ -55,6 +66,244 @@ static const char *attribute_names[] = {
 	""
 };
 
+static int output_format = FORMAT_TEXT;
+
+/*
+ * --format=json and --format=cbor are meant to be read by other programs,
+ * often for every variable on the system, so they skip stdio and go out
+ * through one buffer that's written when it fills up.
+ */
+static uint8_t outbuf[65536];
+static size_t outbuf_len;
+
+static void
+out_write_all(const uint8_t *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t rc = write(STDOUT_FILENO, buf, len);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "Could not write output");
+		}
+		buf += rc;
+		len -= rc;
+	}
+}
+
+static void
+out_flush(void)
+{
+	out_write_all(outbuf, outbuf_len);
+	outbuf_len = 0;
+}
+
+static inline uint8_t *
+out_reserve(size_t len)
+{
+	if (len > sizeof(outbuf) - outbuf_len)
+		out_flush();
+	return outbuf + outbuf_len;
+}
+
+static void
+out_write(const void *buf, size_t len)
+{
+	if (len > sizeof(outbuf)) {
+		out_flush();
+		out_write_all(buf, len);
+		return;
+	}
+	memcpy(out_reserve(len), buf, len);
+	outbuf_len += len;
+}
+
+static inline void
+out_byte(uint8_t c)
+{
+	*out_reserve(1) = c;
+	outbuf_len += 1;
+}
+
+static void
+out_str(const char *str)
+{
+	out_write(str, strlen(str));
+}
+
+static void
+out_json_string(const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	out_byte('"');
+	for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			out_byte('\\');
+			out_byte(*c);
+		} else if (*c < 0x20) {
+			uint8_t *buf = out_reserve(6);
+
+			memcpy(buf, "\\u00", 4);
+			buf[4] = hex[*c >> 4];
+			buf[5] = hex[*c & 0xf];
+			outbuf_len += 6;
+		} else {
+			out_byte(*c);
+		}
+	}
+	out_byte('"');
+}
+
+static void
+out_base64(const uint8_t *data, size_t data_size)
+{
+	static const char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+
+	for (i = 0; i + 3 <= data_size; i += 3) {
+		uint32_t v = data[i] << 16 | data[i+1] << 8 | data[i+2];
+		uint8_t *buf = out_reserve(4);
+
+		buf[0] = b64[v >> 18];
+		buf[1] = b64[(v >> 12) & 0x3f];
+		buf[2] = b64[(v >> 6) & 0x3f];
+		buf[3] = b64[v & 0x3f];
+		outbuf_len += 4;
+	}
+	if (i < data_size) {
+		uint32_t v = data[i] << 16;
+		uint8_t *buf;
+
+		if (i + 1 < data_size)
+			v |= data[i+1] << 8;
+		buf = out_reserve(4);
+		buf[0] = b64[v >> 18];
+		buf[1] = b64[(v >> 12) & 0x3f];
+		buf[2] = i + 1 < data_size ? b64[(v >> 6) & 0x3f] : '=';
+		buf[3] = '=';
+		outbuf_len += 4;
+	}
+}
+
+/*
+ * The head of a CBOR data item (RFC 8949): the major type and either the
+ * value or the length.
+ */
+static void
+out_cbor_head(uint8_t major, uint64_t value)
+{
+	uint8_t *buf = out_reserve(9);
+	size_t n;
+
+	if (value < 24) {
+		buf[0] = major << 5 | value;
+		outbuf_len += 1;
+		return;
+	}
+
+	if (value <= UINT8_MAX) {
+		buf[0] = major << 5 | 24;
+		n = 1;
+	} else if (value <= UINT16_MAX) {
+		buf[0] = major << 5 | 25;
+		n = 2;
+	} else if (value <= UINT32_MAX) {
+		buf[0] = major << 5 | 26;
+		n = 4;
+	} else {
+		buf[0] = major << 5 | 27;
+		n = 8;
+	}
+	for (size_t i = 0; i < n; i++)
+		buf[n - i] = (value >> (8 * i)) & 0xff;
+	outbuf_len += n + 1;
+}
+
+static void
+out_cbor_text(const char *str)
+{
+	size_t len = strlen(str);
+
+	out_cbor_head(3, len);
+	out_write(str, len);
+}
+
+/*
+ * One variable as a JSON object on a line of its own, or as a CBOR map in
+ * a CBOR sequence (RFC 8742), with the same keys either way.  --watch
+ * adds an "event" key, and leaves out the attributes and data of
+ * variables that are gone; with no name, the record is just the event.
+ */
+static void
+show_variable_event(const char *event, const efi_guid_t *guid,
+		    const char *name, uint32_t attributes,
+		    const uint8_t *data, size_t data_size)
+{
+	char guidstr[GUID_STR_LEN + 1];
+	bool first = true;
+
+	if (name)
+		efi_guid_to_str_buf(guid, guidstr, sizeof(guidstr));
+
+	if (output_format == FORMAT_JSON) {
+		char attrstr[sizeof(",\"attributes\":4294967295")];
+
+		out_byte('{');
+		if (event) {
+			out_str("\"event\":\"");
+			out_str(event);
+			out_byte('"');
+			first = false;
+		}
+		if (name) {
+			out_str(first ? "\"guid\":\"" : ",\"guid\":\"");
+			out_str(guidstr);
+			out_str("\",\"name\":");
+			out_json_string(name);
+		}
+		if (data) {
+			snprintf(attrstr, sizeof(attrstr),
+				 ",\"attributes\":%"PRIu32, attributes);
+			out_str(attrstr);
+			out_str(",\"data\":\"");
+			out_base64(data, data_size);
+			out_byte('"');
+		}
+		out_str("}\n");
+	} else {
+		out_cbor_head(5, !!event + (name ? 2 : 0) + (data ? 2 : 0));
+		if (event) {
+			out_cbor_text("event");
+			out_cbor_text(event);
+		}
+		if (name) {
+			out_cbor_text("guid");
+			out_cbor_text(guidstr);
+			out_cbor_text("name");
+			out_cbor_text(name);
+		}
+		if (data) {
+			out_cbor_text("attributes");
+			out_cbor_head(0, attributes);
+			out_cbor_text("data");
+			out_cbor_head(2, data_size);
+			out_write(data, data_size);
+		}
+	}
+}
+
+static inline void
+show_variable_record(const efi_guid_t *guid, const char *name,
+		     uint32_t attributes, const uint8_t *data,
+		     size_t data_size)
+{
+	show_variable_event(NULL, guid, name, attributes,
+			    data ? data : (const uint8_t *)"", data_size);
+}
+
 static inline void
 validate_name(const char *name)
 {
@@ -83,14 +332,59 @@ err:
 	}
 }
 
+/*
+ * Structured listings are for collectors that want everything, so they
+ * read every variable and not just the names.
+ */
+static void
+list_all_variable_records(void)
+{
+	efi_variable_snapshot_t *snapshot = NULL;
+	size_t n;
+
+	if (efi_variables_snapshot(&snapshot) < 0) {
+		fprintf(stderr, "efivar: error listing variables: %s\n",
+			strerror(errno));
+		show_errors();
+		exit(1);
+	}
+
+	n = efi_variables_snapshot_count(snapshot);
+	for (size_t i = 0; i < n; i++) {
+		efi_variable_t *var = efi_variables_snapshot_get(snapshot, i);
+		uint64_t attributes = 0;
+		uint8_t *data = NULL;
+		size_t data_size = 0;
+		efi_guid_t *guid;
+
+		efi_variable_get_guid(var, &guid);
+		efi_variable_get_attributes(var, &attributes);
+		efi_variable_get_data(var, &data, &data_size);
+		show_variable_record(guid, (char *)efi_variable_get_name(var),
+				     attributes & 0xffffffff, data,
+				     data_size);
+	}
+	out_flush();
+	efi_variables_snapshot_free(snapshot);
+}
+
 static void
 list_all_variables(void)
 {
 	efi_guid_t *guid = NULL;
 	char *name = NULL;
+	char guidstr[GUID_STR_LEN + 1];
 	int rc;
-	while ((rc = efi_get_next_variable_name(&guid, &name)) > 0)
-		 printf(GUID_FORMAT "-%s\n", GUID_FORMAT_ARGS(guid), name);
+
+	if (output_format != FORMAT_TEXT) {
+		list_all_variable_records();
+		return;
+	}
+
+	while ((rc = efi_get_next_variable_name(&guid, &name)) > 0) {
+		efi_guid_to_str_buf(guid, guidstr, sizeof(guidstr));
+		printf("%s-%s\n", guidstr, name);
+	}
 
 	if (rc < 0) {
 		fprintf(stderr, "efivar: error listing variables: %s\n", strerror(errno));
@@ -161,11 +455,54 @@ bad_name:
 	*name = name_buf;
 }
 
+/*
+ * The offset, hex, and |text| columns for --print, rendered a line at a
+ * time into the output buffer.
+ */
+static void
+show_variable_hex(const uint8_t *data, size_t data_size)
+{
+	for (uint32_t index = 0; index < data_size; index += 16) {
+		size_t n = data_size - index < 16 ? data_size - index : 16;
+		char *p = (char *)out_reserve(HEXDUMP_LINE_MAX);
+		char *line = p;
+
+		for (int d = 7; d >= 0; d--)
+			*p++ = hexdump_pairs[((index >> (4 * d)) & 0xf) * 2 + 1];
+		*p++ = ' ';
+		*p++ = ' ';
+		for (size_t i = 0; i < 16; i++) {
+			if (i < n) {
+				memcpy(p, &hexdump_pairs[data[index + i] * 2], 2);
+				p[2] = ' ';
+			} else {
+				memset(p, ' ', 3);
+			}
+			p += 3;
+			if (i % 8 == 7)
+				*p++ = ' ';
+		}
+		*p++ = '|';
+		for (size_t i = 0; i < 16; i++)
+			*p++ = i < n ? hexdump_char(data[index + i]) : ' ';
+		*p++ = '|';
+		*p++ = '\n';
+		outbuf_len += p - line;
+	}
+	out_flush();
+}
+
 static void
 show_variable_data(efi_guid_t guid, const char *name, uint32_t attributes,
 		   uint8_t *data, size_t data_size,
 		   int display_type)
 {
+	if (output_format != FORMAT_TEXT) {
+		show_variable_record(&guid, name, attributes, data, data_size);
+		out_flush();
+		return;
+	}
+
 	if (display_type == SHOW_VERBOSE) {
 		printf("GUID: "GUID_FORMAT "\n", GUID_FORMAT_ARGS(&guid));
 		printf("Name: \"%s\"\n", name);
@@ -175,38 +512,8 @@ show_variable_data(efi_guid_t guid, const char *name, uint32_t attributes,
 				printf("\t%s\n", attribute_names[i]);
 		}
 		printf("Value:\n");
-
-		uint32_t index = 0;
-		while (index < data_size) {
-			char charbuf[] = "................";
-			printf("%08x  ", index);
-			/* print the hex values, and render the ascii bits into
-			 * charbuf */
-			while (index < data_size) {
-				printf("%02x ", data[index]);
-				if (index % 8 == 7)
-					printf(" ");
-				if (safe_to_print(data[index]))
-					charbuf[index % 16] = data[index];
-				index++;
-				if (index % 16 == 0)
-					break;
-			}
-
-			/* If we're above data_size, finish out the line with
-			 * space, and also finish out charbuf with space */
-			while (index >= data_size && index % 16 != 0) {
-				if (index % 8 == 7)
-					printf(" ");
-				printf("   ");
-				charbuf[index % 16] = ' ';
-
-				index++;
-				if (index % 16 == 0)
-					break;
-			}
-			printf("|%s|\n", charbuf);
-		}
+		fflush(stdout);
+		show_variable_hex(data, data_size);
 	} else if (display_type == SHOW_DECIMAL) {
 		uint32_t index = 0;
 		while (index < data_size) {
@@ -261,34 +568,17 @@ show_variable(char *guid_name, int display_type)
 static void
 save_variable_data(efi_variable_t *var, char *outfile, bool dmpstore)
 {
-	FILE *out = NULL;
-	ssize_t sz;
-	uint8_t *data = NULL;
-	size_t datasz = 0;
-	ssize_t (*export)(efi_variable_t *var, uint8_t *data, size_t size) =
-		dmpstore ? efi_variable_export_dmpstore : efi_variable_export;
+	ssize_t (*export)(efi_variable_t *var, int fd) =
+		dmpstore ? efi_variable_export_dmpstore_fd
+			 : efi_variable_export_fd;
+	int fd;
 
-	out = fopen(outfile, "w");
-	if (!out)
+	fd = open(outfile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0)
 		err(1, "Could not open \"%s\" for writing", outfile);
 
-	sz = export(var, data, datasz);
-	data = calloc(sz, 1);
-	if (!data)
-		err(1, "Could not allocate memory");
-	datasz = sz;
-
-	sz = export(var, data, datasz);
-	if (sz < 0)
-		err(1, "Could not format data");
-	datasz = sz;
-
-	sz = fwrite(data, 1, datasz, out);
-	if (sz < (ssize_t)datasz)
+	if (export(var, fd) < 0 || close(fd) < 0)
 		err(1, "Could not write to \"%s\"", outfile);
-
-	fflush(out);
-	fclose(out);
 }
 
 static void
@@ -339,6 +629,573 @@ save_variable(char *guid_name, char *outfile, bool dmpstore)
 		free(data);
 }
 
+/*
+ * --name can also be a pattern, which is a GUID, or * for any GUID, then a
+ * dash and a glob(7) pattern for the name, like "*-Boot*" or
+ * "{global}-Boot????".  Anything with a glob character in it is taken to
+ * be one.
+ */
+static bool
+is_name_pattern(const char *guid_name)
+{
+	return guid_name && strpbrk(guid_name, "*?[") != NULL;
+}
+
+typedef struct {
+	efi_guid_t guid;
+	char *name;
+	bool done;
+	int error;
+	uint8_t *data;
+	size_t data_size;
+	uint32_t attributes;
+} pattern_match_t;
+
+static int
+pattern_match_done(efi_async_op_t op UNUSED, const efi_guid_t *guid UNUSED,
+		   const char *name UNUSED, int error, const uint8_t *data,
+		   size_t data_size, uint32_t attributes, void *user)
+{
+	pattern_match_t *match = user;
+
+	match->done = true;
+	match->error = error;
+	if (error)
+		return 0;
+
+	match->data = malloc(data_size ? data_size : 1);
+	if (!match->data) {
+		match->error = errno;
+		return 0;
+	}
+	memcpy(match->data, data, data_size);
+	match->data_size = data_size;
+	match->attributes = attributes;
+	return 0;
+}
+
+static void
+read_match(pattern_match_t *match)
+{
+	match->done = true;
+	if (efi_get_variable(match->guid, match->name, &match->data,
+			     &match->data_size, &match->attributes) < 0)
+		match->error = errno;
+}
+
+/*
+ * Split a pattern into its GUID and the glob for the name.  The glob can
+ * be a single character, like "*", which parse_name() wouldn't take as a
+ * name.  Returns the glob, which points into pattern.
+ */
+static const char *
+split_pattern(const char *pattern, efi_guid_t *guid, bool *any_guid)
+{
+	unsigned int guid_len = sizeof("84be9c3e-8a32-42c0-891c-4cd3b072becc");
+	char guid_buf[guid_len];
+	const char *dash;
+
+	*any_guid = false;
+	if (pattern[0] == '*') {
+		*any_guid = true;
+		dash = pattern + 1;
+	} else if (pattern[0] == '{') {
+		const char *right = strchr(pattern, '}');
+		size_t len;
+
+		if (!right)
+			goto bad_pattern;
+		dash = right + 1;
+		len = dash - pattern;
+		if (len >= guid_len)
+			goto bad_pattern;
+		memcpy(guid_buf, pattern, len);
+		guid_buf[len] = '\0';
+		if (efi_id_guid_to_guid(guid_buf, guid) < 0)
+			goto bad_pattern;
+	} else {
+		if (strlen(pattern) < guid_len)
+			goto bad_pattern;
+		dash = pattern + guid_len - 1;
+		memcpy(guid_buf, pattern, guid_len - 1);
+		guid_buf[guid_len - 1] = '\0';
+		if (text_to_guid(guid_buf, guid) < 0)
+			goto bad_pattern;
+	}
+	if (dash[0] != '-' || dash[1] == '\0')
+		goto bad_pattern;
+	return dash + 1;
+
+bad_pattern:
+	fprintf(stderr, "efivar: invalid pattern \"%s\"\n", pattern);
+	show_errors();
+	exit(1);
+}
+
+/*
+ * Find every variable pattern matches, in the order they're listed, and
+ * exit if there aren't any.  Returns how many there are.
+ */
+static size_t
+find_matches(const char *pattern, pattern_match_t **matchesp)
+{
+	pattern_match_t *matches = NULL;
+	efi_guid_t guid = efi_guid_empty;
+	efi_guid_t *varguid = NULL;
+	const char *glob;
+	char *varname = NULL;
+	bool any_guid;
+	size_t n = 0, size = 0;
+	int rc;
+
+	glob = split_pattern(pattern, &guid, &any_guid);
+
+	while ((rc = efi_get_next_variable_name(&varguid, &varname)) > 0) {
+		if (!any_guid && efi_guid_cmp(varguid, &guid))
+			continue;
+		if (fnmatch(glob, varname, 0))
+			continue;
+
+		if (n == size) {
+			pattern_match_t *new_matches;
+
+			size = size ? size * 2 : 64;
+			new_matches = reallocarray(matches, size,
+						   sizeof(*matches));
+			if (!new_matches)
+				err(1, "Could not allocate memory");
+			matches = new_matches;
+		}
+		memset(&matches[n], 0, sizeof(matches[n]));
+		matches[n].guid = *varguid;
+		matches[n].name = strdup(varname);
+		if (!matches[n].name)
+			err(1, "Could not allocate memory");
+		n++;
+	}
+	if (rc < 0) {
+		fprintf(stderr, "efivar: error listing variables: %s\n",
+			strerror(errno));
+		show_errors();
+		exit(1);
+	}
+	if (n == 0)
+		errx(1, "no variables match \"%s\"", pattern);
+
+	*matchesp = matches;
+	return n;
+}
+
+/*
+ * Read all n matches at once on a few threads, calling cb for each
+ * variable in the order they were listed as soon as it and everything
+ * before it have been read.  Variables that go away in the meantime are
+ * skipped.  Frees matches, and returns how many were passed to cb, or -1
+ * after saying why if one couldn't be read.
+ */
+static ssize_t
+for_each_match(pattern_match_t *matches, size_t n,
+	       void (*cb)(pattern_match_t *match, void *closure),
+	       void *closure)
+{
+	efi_async_ctx_t *ctx = NULL;
+	size_t shown = 0, next = 0;
+	ssize_t rc = -1;
+	long nworkers;
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1)
+		nworkers = 1;
+	if (nworkers > 8)
+		nworkers = 8;
+	if ((size_t)nworkers > n)
+		nworkers = n;
+	if (n > 1 && efi_async_new(&ctx, nworkers) < 0) {
+		/* then we just read them here, one at a time */
+		efi_error_clear();
+		ctx = NULL;
+	}
+	for (size_t i = 0; ctx && i < n; i++) {
+		if (efi_async_get_variable(ctx, matches[i].guid,
+					   matches[i].name, &matches[i]) < 0) {
+			warn("Could not read \"%s\"", matches[i].name);
+			goto out;
+		}
+	}
+
+	while (next < n) {
+		pattern_match_t *match = &matches[next];
+
+		if (!ctx)
+			read_match(match);
+		else if (!match->done &&
+			 efi_async_dispatch(ctx, -1, pattern_match_done) < 0) {
+			warn("Could not read variables");
+			goto out;
+		}
+		if (!match->done)
+			continue;
+
+		if (match->error == 0) {
+			cb(match, closure);
+			shown++;
+		} else if (match->error != ENOENT) {
+			errno = match->error;
+			warn("Could not read \"%s\"", match->name);
+			goto out;
+		}
+		free(match->data);
+		free(match->name);
+		next++;
+	}
+	rc = shown;
+out:
+	efi_async_free(ctx);
+	for (; next < n; next++) {
+		free(matches[next].data);
+		free(matches[next].name);
+	}
+	free(matches);
+	return rc;
+}
+
+static void
+show_match(pattern_match_t *match, void *closure)
+{
+	int display_type = *(int *)closure;
+
+	if (output_format == FORMAT_TEXT && display_type == SHOW_DECIMAL)
+		printf(GUID_FORMAT "-%s\n", GUID_FORMAT_ARGS(&match->guid),
+		       match->name);
+	show_variable_data(match->guid, match->name, match->attributes,
+			   match->data, match->data_size, display_type);
+	if (output_format == FORMAT_TEXT)
+		printf("\n");
+}
+
+static void
+show_variables(const char *pattern, int display_type)
+{
+	pattern_match_t *matches = NULL;
+	size_t n;
+
+	n = find_matches(pattern, &matches);
+	if (for_each_match(matches, n, show_match, &display_type) < 0)
+		exit(1);
+}
+
+struct save_matches {
+	efi_variable_archive_t *archive;
+	int fd;
+	bool dmpstore;
+	const char *outfile;
+};
+
+static void
+save_match(pattern_match_t *match, void *closure)
+{
+	struct save_matches *save = closure;
+	efi_variable_t *var;
+	int rc;
+
+	var = efi_variable_alloc();
+	if (!var)
+		err(1, "Could not allocate memory");
+	efi_variable_set_name(var, (unsigned char *)match->name);
+	efi_variable_set_guid(var, &match->guid);
+	efi_variable_set_attributes(var, match->attributes);
+	efi_variable_set_data(var, match->data, match->data_size);
+
+	if (save->dmpstore)
+		rc = efi_variable_export_dmpstore_fd(var, save->fd) < 0 ? -1 : 0;
+	else
+		rc = efi_variable_archive_add(save->archive, var);
+	efi_variable_free(var, false);
+	if (rc < 0) {
+		fprintf(stderr, "efivar: could not write \"%s\": %s\n",
+			save->outfile, strerror(errno));
+		show_errors();
+		unlink(save->outfile);
+		exit(1);
+	}
+}
+
+/*
+ * A pattern can match any number of variables, so they go to an archive
+ * like --export-all makes, or with --dmpstore, one record after another
+ * the way dmpstore -s saves them.  outfile isn't touched unless something
+ * matches.
+ */
+static void
+save_variables(const char *pattern, const char *outfile, bool dmpstore)
+{
+	struct save_matches save = {
+		.dmpstore = dmpstore,
+		.outfile = outfile,
+	};
+	pattern_match_t *matches = NULL;
+	size_t n;
+
+	n = find_matches(pattern, &matches);
+
+	save.fd = open(outfile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (save.fd < 0)
+		err(1, "Could not open \"%s\" for writing", outfile);
+	if (!dmpstore && efi_variable_archive_create(save.fd,
+						     &save.archive) < 0)
+		goto err;
+
+	if (for_each_match(matches, n, save_match, &save) < 0) {
+		efi_variable_archive_free(save.archive);
+		close(save.fd);
+		unlink(outfile);
+		exit(1);
+	}
+
+	if (!dmpstore && efi_variable_archive_finish(save.archive) < 0)
+		goto err;
+	if (close(save.fd) < 0) {
+		save.fd = -1;
+		goto err;
+	}
+	efi_variable_archive_free(save.archive);
+	return;
+err:
+	fprintf(stderr, "efivar: could not write \"%s\": %s\n", outfile,
+		strerror(errno));
+	show_errors();
+	if (save.fd >= 0)
+		close(save.fd);
+	unlink(outfile);
+	exit(1);
+}
+
+static void
+export_all_variables(const char *outfile)
+{
+	efi_variable_snapshot_t *snapshot = NULL;
+	efi_variable_archive_t *archive = NULL;
+	size_t n;
+	int fd;
+
+	if (efi_variables_snapshot(&snapshot) < 0) {
+		fprintf(stderr, "efivar: could not read variables: %s\n",
+			strerror(errno));
+		show_errors();
+		exit(1);
+	}
+
+	fd = open(outfile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd < 0)
+		err(1, "Could not open \"%s\" for writing", outfile);
+
+	if (efi_variable_archive_create(fd, &archive) < 0)
+		goto err;
+	n = efi_variables_snapshot_count(snapshot);
+	for (size_t i = 0; i < n; i++) {
+		efi_variable_t *var = efi_variables_snapshot_get(snapshot, i);
+
+		if (efi_variable_archive_add(archive, var) < 0)
+			goto err;
+	}
+	if (efi_variable_archive_finish(archive) < 0 || close(fd) < 0) {
+		fd = -1;
+		goto err;
+	}
+
+	efi_variable_archive_free(archive);
+	efi_variables_snapshot_free(snapshot);
+	return;
+err:
+	fprintf(stderr, "efivar: could not write \"%s\": %s\n", outfile,
+		strerror(errno));
+	show_errors();
+	if (fd >= 0)
+		close(fd);
+	unlink(outfile);
+	exit(1);
+}
+
+static void
+save_index(const char *outfile)
+{
+	int fd;
+
+	fd = open(outfile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd < 0)
+		err(1, "Could not open \"%s\" for writing", outfile);
+
+	if (efi_variables_index_save(fd) < 0 || close(fd) < 0) {
+		fprintf(stderr, "efivar: could not write \"%s\": %s\n",
+			outfile, strerror(errno));
+		show_errors();
+		unlink(outfile);
+		exit(1);
+	}
+}
+
+static int
+show_index_change(efi_variable_index_change_t change, const efi_guid_t *guid,
+		  const char *name, void *closure UNUSED)
+{
+	static const char *changes[] = {
+		[EFI_VARIABLE_INDEX_ADDED] = "added",
+		[EFI_VARIABLE_INDEX_CHANGED] = "changed",
+		[EFI_VARIABLE_INDEX_DELETED] = "deleted",
+	};
+	char guidstr[GUID_STR_LEN + 1];
+
+	efi_guid_to_str_buf(guid, guidstr, sizeof(guidstr));
+	printf("%s-%s %s\n", guidstr, name, changes[change]);
+	return 0;
+}
+
+/*
+ * Like diff(1), exits 0 if nothing changed, 1 if something did, and 2 if
+ * we couldn't tell.
+ */
+static int
+compare_index(const char *infile)
+{
+	int fd, rc;
+
+	fd = open(infile, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		warn("Could not open \"%s\"", infile);
+		return 2;
+	}
+
+	rc = efi_variables_index_compare(fd, show_index_change, NULL);
+	close(fd);
+	if (rc < 0) {
+		fprintf(stderr, "efivar: could not compare against \"%s\": %s\n",
+			infile, strerror(errno));
+		show_errors();
+		return 2;
+	}
+	return rc ? 1 : 0;
+}
+
+/*
+ * Set every variable in the archive.  Some of them (anything volatile or
+ * authenticated, to start with) can't be, so that's a warning and an exit
+ * status rather than giving up on the rest.
+ */
+static int
+import_all_variables(const char *infile)
+{
+	efi_variable_archive_t *archive = NULL;
+	efi_variable_t *var = NULL;
+	int status = 0;
+	int rc;
+	int fd;
+
+	fd = open(infile, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		err(1, "Could not open \"%s\"", infile);
+
+	if (efi_variable_archive_open(fd, &archive) < 0)
+		goto err;
+	while ((rc = efi_variable_archive_next(archive, &var)) > 0) {
+		char *name = (char *)efi_variable_get_name(var);
+		char guidstr[GUID_STR_LEN + 1];
+		uint64_t attributes = 0;
+		uint8_t *data = NULL;
+		size_t data_size = 0;
+		efi_guid_t *guid;
+
+		efi_variable_get_guid(var, &guid);
+		efi_variable_get_attributes(var, &attributes);
+		efi_variable_get_data(var, &data, &data_size);
+
+		if (efi_set_variable(*guid, name, data, data_size,
+				     attributes & 0xffffffff, 0644) < 0) {
+			efi_guid_to_str_buf(guid, guidstr, sizeof(guidstr));
+			fprintf(stderr, "efivar: could not set %s-%s: %s\n",
+				guidstr, name, strerror(errno));
+			show_errors();
+			status = 1;
+		}
+		efi_variable_free(var, true);
+		var = NULL;
+	}
+	if (rc < 0)
+		goto err;
+
+	efi_variable_archive_free(archive);
+	close(fd);
+	return status;
+err:
+	fprintf(stderr, "efivar: could not read \"%s\": %s\n", infile,
+		strerror(errno));
+	show_errors();
+	exit(1);
+}
+
+static int
+show_change(efi_variable_watch_event_t event, const efi_guid_t *guid,
+	    const char *name, const uint8_t *data, size_t data_size,
+	    uint32_t attributes, void *closure UNUSED)
+{
+	static const char *events[] = {
+		[EFI_VARIABLE_WATCH_CHANGED] = "changed",
+		[EFI_VARIABLE_WATCH_DELETED] = "deleted",
+		[EFI_VARIABLE_WATCH_OVERFLOW] = "overflow",
+	};
+	char guidstr[GUID_STR_LEN + 1];
+
+	if (output_format != FORMAT_TEXT) {
+		show_variable_event(events[event], guid, name, attributes,
+				    data, data_size);
+		return 0;
+	}
+
+	if (event == EFI_VARIABLE_WATCH_OVERFLOW) {
+		fflush(stdout);
+		warnx("too many changes at once; some of them were missed");
+		return 0;
+	}
+
+	efi_guid_to_str_buf(guid, guidstr, sizeof(guidstr));
+	if (!data) {
+		printf("%s-%s %s\n", guidstr, name,
+		       event == EFI_VARIABLE_WATCH_DELETED
+			? "deleted" : "changed, but could not be read");
+		return 0;
+	}
+	printf("%s-%s changed\n", guidstr, name);
+	show_variable_data(*guid, name, attributes, (uint8_t *)data,
+			   data_size, SHOW_VERBOSE);
+	return 0;
+}
+
+/*
+ * Print each variable as it changes, until something goes wrong.
+ */
+static void NORETURN
+watch_variables(void)
+{
+	efi_variable_watch_t *watch = NULL;
+
+	if (efi_variable_watch_new(&watch) < 0) {
+		fprintf(stderr, "efivar: could not watch variables: %s\n",
+			strerror(errno));
+		show_errors();
+		exit(1);
+	}
+
+	while (efi_variable_watch_dispatch(watch, -1, show_change, NULL) >= 0) {
+		out_flush();
+		fflush(stdout);
+	}
+
+	fprintf(stderr, "efivar: error watching variables: %s\n",
+		strerror(errno));
+	show_errors();
+	efi_variable_watch_free(watch);
+	exit(1);
+}
+
 static void
 edit_variable(const char *guid_name, void *data, size_t data_size,
 	      uint32_t attrib, int edit_type)
@@ -432,6 +1289,123 @@ err:
 	exit(1);
 }
 
+static void
+delete_variable(const char *guid_name)
+{
+	efi_guid_t guid = efi_guid_empty;
+	char *name = NULL;
+
+	parse_name(guid_name, &name, &guid);
+	if (!name || efi_guid_is_empty(&guid)) {
+		fprintf(stderr, "efivar: could not parse variable name.\n");
+		show_errors();
+		exit(1);
+	}
+
+	if (efi_del_variable(guid, name) < 0) {
+		fprintf(stderr, "efivar: %s\n", strerror(errno));
+		show_errors();
+		exit(1);
+	}
+	free(name);
+}
+
+/*
+ * Run one command per line from infile ("-" for stdin), all in this one
+ * process, so the backend is only probed once:
+ *
+ *   list
+ *   print <guid-name>
+ *   write <guid-name> <datafile> [attributes]
+ *   append <guid-name> <datafile> [attributes]
+ *   delete <guid-name>
+ *   export <guid-name> <file>
+ *
+ * Blank lines and lines starting with # are skipped.  The first command
+ * that fails ends the batch, the same as it would running efivar once
+ * per command under "set -e".
+ */
+static void
+run_batch(const char *infile, uint32_t default_attributes, bool dmpstore)
+{
+	FILE *in = stdin;
+	char *line = NULL;
+	size_t linesz = 0;
+	unsigned int lineno = 0;
+
+	if (strcmp(infile, "-")) {
+		in = fopen(infile, "r");
+		if (!in)
+			err(1, "Could not open \"%s\"", infile);
+	}
+
+	while (getline(&line, &linesz, in) >= 0) {
+		char *argv[5] = { NULL, };
+		char *saveptr = NULL;
+		char *arg;
+		int argc = 0;
+
+		lineno++;
+		for (arg = strtok_r(line, " \t\r\n", &saveptr);
+		     arg && argc < 5;
+		     arg = strtok_r(NULL, " \t\r\n", &saveptr))
+			argv[argc++] = arg;
+		if (argc == 0 || argv[0][0] == '#')
+			continue;
+
+#define batch_args(min, max)						\
+		if (argc < (min) + 1 || argc > (max) + 1)		\
+			errx(1, "%s:%u: wrong number of arguments to %s", \
+			     infile, lineno, argv[0])
+
+		if (!strcmp(argv[0], "list")) {
+			batch_args(0, 0);
+			list_all_variables();
+		} else if (!strcmp(argv[0], "print")) {
+			batch_args(1, 1);
+			show_variable(argv[1], SHOW_VERBOSE);
+		} else if (!strcmp(argv[0], "write") ||
+			   !strcmp(argv[0], "append")) {
+			uint32_t attributes = default_attributes;
+			uint8_t *data = NULL;
+			size_t data_size = 0;
+
+			batch_args(2, 3);
+			if (argc == 4) {
+				char *end = NULL;
+
+				errno = 0;
+				attributes = strtoul(argv[3], &end, 10);
+				if (errno || !*argv[3] || *end)
+					errx(1, "%s:%u: invalid attributes \"%s\"",
+					     infile, lineno, argv[3]);
+			}
+			prepare_data(argv[2], &data, &data_size);
+			edit_variable(argv[1], data, data_size, attributes,
+				      argv[0][0] == 'w' ? EDIT_WRITE
+						      : EDIT_APPEND);
+			munmap(data, data_size);
+		} else if (!strcmp(argv[0], "delete")) {
+			batch_args(1, 1);
+			delete_variable(argv[1]);
+		} else if (!strcmp(argv[0], "export")) {
+			batch_args(2, 2);
+			save_variable(argv[1], argv[2], dmpstore);
+		} else {
+			errx(1, "%s:%u: unknown command \"%s\"", infile,
+			     lineno, argv[0]);
+		}
+#undef batch_args
+		fflush(stdout);
+	}
+	if (ferror(in))
+		err(1, "Could not read \"%s\"", infile);
+
+	free(line);
+	if (in != stdin)
+		fclose(in);
+}
+
 static void __attribute__((__noreturn__))
 usage(int ret)
 {
@@ -439,18 +1413,30 @@ usage(int ret)
 	fprintf(out,
 		"Usage: %s [OPTION...]\n"
 		"  -A, --attributes=<attributes>     attributes to use on append\n"
+		"  -b, --batch=<file>                run the commands in <file>, or stdin if\n"
+		"                                    it's \"-\", one per line\n"
 		"  -l, --list                        list current variables\n"
 		"  -p, --print                       print variable specified by --name\n"
 		"  -D, --dmpstore                    use DMPSTORE format when exporting\n"
+		"  -F, --format=<format>             print and list as text (the default),\n"
+		"                                    json, or cbor\n"
 		"  -d, --print-decimal               print variable in decimal values specified\n"
 		"                                    by --name\n"
 		"  -n, --name=<guid-name>            variable to manipulate, in the form\n"
 		"                                    8be4df61-93ca-11d2-aa0d-00e098032b8c-Boot0000\n"
+		"                                    or, to print or export all that match,\n"
+		"                                    a pattern like \"*-Boot*\" or \"{global}-Boot????\"\n"
 		"  -a, --append                      append to variable specified by --name\n"
 		"  -f, --datafile=<file>             load or save variable contents from <file>\n"
 		"  -e, --export=<file>               export variable to <file>\n"
 		"  -i, --import=<file>               import variable from <file\n"
+		"  -E, --export-all=<file>           export every variable to archive <file>\n"
+		"  -I, --import-all=<file>           set every variable in archive <file>\n"
 		"  -L, --list-guids                  show internal guid list\n"
+		"  -s, --save-index=<file>           save an index of every variable to <file>\n"
+		"  -c, --compare-index=<file>        list the variables that changed since\n"
+		"                                    --save-index wrote <file>\n"
+		"  -W, --watch                       print variables as they change\n"
 		"  -w, --write                       write to variable specified by --name\n\n"
 		"Help options:\n"
 		"  -?, --help                        Show this help message\n"
@@ -475,22 +1461,29 @@ int main(int argc, char *argv[])
 	uint32_t attributes = EFI_VARIABLE_NON_VOLATILE
 			      | EFI_VARIABLE_BOOTSERVICE_ACCESS
 			      | EFI_VARIABLE_RUNTIME_ACCESS;
-	char *sopts = "aA:Dde:f:i:Llpn:vw?";
+	char *sopts = "aA:b:c:DdE:e:F:f:I:i:Llpn:s:vWw?";
 	struct option lopts[] = {
 		{"append", no_argument, 0, 'a'},
 		{"attributes", required_argument, 0, 'A'},
+		{"batch", required_argument, 0, 'b'},
+		{"compare-index", required_argument, 0, 'c'},
 		{"datafile", required_argument, 0, 'f'},
 		{"dmpstore", no_argument, 0, 'D'},
 		{"export", required_argument, 0, 'e'},
+		{"export-all", required_argument, 0, 'E'},
+		{"format", required_argument, 0, 'F'},
 		{"help", no_argument, 0, '?'},
 		{"import", required_argument, 0, 'i'},
+		{"import-all", required_argument, 0, 'I'},
 		{"list", no_argument, 0, 'l'},
 		{"list-guids", no_argument, 0, 'L'},
 		{"name", required_argument, 0, 'n'},
 		{"print", no_argument, 0, 'p'},
 		{"print-decimal", no_argument, 0, 'd'},
+		{"save-index", required_argument, 0, 's'},
 		{"usage", no_argument, 0, 0},
 		{"verbose", no_argument, 0, 'v'},
+		{"watch", no_argument, 0, 'W'},
 		{"write", no_argument, 0, 'w'},
 		{0, 0, 0, 0}
 	};
@@ -506,19 +1499,46 @@ int main(int argc, char *argv[])
 			case 'a':
 				action |= ACTION_APPEND;
 				break;
+			case 'b':
+				action |= ACTION_BATCH;
+				infile = optarg;
+				break;
+			case 'c':
+				action |= ACTION_COMPARE_INDEX;
+				infile = optarg;
+				break;
 			case 'D':
 				dmpstore = true;
 				break;
 			case 'd':
 				action |= ACTION_PRINT_DEC;
 				break;
+			case 'E':
+				action |= ACTION_EXPORT_ALL;
+				outfile = optarg;
+				break;
 			case 'e':
 				action |= ACTION_EXPORT;
 				outfile = optarg;
 				break;
+			case 'F':
+				if (!strcmp(optarg, "text"))
+					output_format = FORMAT_TEXT;
+				else if (!strcmp(optarg, "json"))
+					output_format = FORMAT_JSON;
+				else if (!strcmp(optarg, "cbor"))
+					output_format = FORMAT_CBOR;
+				else
+					errx(1, "invalid output format \"%s\"",
+					     optarg);
+				break;
 			case 'f':
 				datafile = optarg;
 				break;
+			case 'I':
+				action |= ACTION_IMPORT_ALL;
+				infile = optarg;
+				break;
 			case 'i':
 				action |= ACTION_IMPORT;
 				infile = optarg;
@@ -535,9 +1555,16 @@ int main(int argc, char *argv[])
 			case 'p':
 				action |= ACTION_PRINT;
 				break;
+			case 's':
+				action |= ACTION_SAVE_INDEX;
+				outfile = optarg;
+				break;
 			case 'v':
 				verbose += 1;
 				break;
+			case 'W':
+				action |= ACTION_WATCH;
+				break;
 			case 'w':
 				action |= ACTION_WRITE;
 				break;
@@ -561,10 +1588,16 @@ int main(int argc, char *argv[])
 			list_all_variables();
 			break;
 		case ACTION_PRINT:
-			show_variable(guid_name, SHOW_VERBOSE);
+			if (is_name_pattern(guid_name))
+				show_variables(guid_name, SHOW_VERBOSE);
+			else
+				show_variable(guid_name, SHOW_VERBOSE);
 			break;
 		case ACTION_PRINT_DEC | ACTION_PRINT:
-			show_variable(guid_name, SHOW_DECIMAL);
+			if (is_name_pattern(guid_name))
+				show_variables(guid_name, SHOW_DECIMAL);
+			else
+				show_variable(guid_name, SHOW_DECIMAL);
 			break;
 		case ACTION_APPEND | ACTION_PRINT:
 			prepare_data(datafile, &data, &data_size);
@@ -592,7 +1625,11 @@ int main(int argc, char *argv[])
 			break;
 					}
 		case ACTION_EXPORT:
-			if (datafile) {
+			if (is_name_pattern(guid_name)) {
+				if (datafile)
+					errx(1, "--datafile cannot be used with a --name pattern");
+				save_variables(guid_name, outfile, dmpstore);
+			} else if (datafile) {
 				char *name = NULL;
 				efi_guid_t guid = efi_guid_zero;
 				efi_variable_t *var;
@@ -653,13 +1690,12 @@ int main(int argc, char *argv[])
 						err(1, "Could not open \"%s\" for writing",
 						    datafile);
 
-					rc = fwrite(data, data_size, 1, out);
+					rc = fwrite(data, 1, data_size, out);
 					if (rc < (long)data_size)
 						err(1, "Could not write to \"%s\"",
 						    datafile);
 
 					fclose(out);
-					free(guid_name);
 				}
 				if (action & ACTION_PRINT)
 					show_variable_data(*guid, name,
@@ -687,6 +1723,21 @@ int main(int argc, char *argv[])
 				efi_variable_free(var, false);
 				break;
 			}
+		case ACTION_EXPORT_ALL:
+			export_all_variables(outfile);
+			break;
+		case ACTION_IMPORT_ALL:
+			return import_all_variables(infile);
+		case ACTION_SAVE_INDEX:
+			save_index(outfile);
+			break;
+		case ACTION_COMPARE_INDEX:
+			return compare_index(infile);
+		case ACTION_WATCH:
+			watch_variables();
+		case ACTION_BATCH:
+			run_batch(infile, attributes, dmpstore);
+			break;
 		case ACTION_USAGE:
 		default:
 			usage(EXIT_FAILURE);
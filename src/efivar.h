@@ -26,6 +26,7 @@
 #include "gpt.h"
 #include "disk.h"
 #include "linux.h"
+#include "devcache.h"
 #include "crc32.h"
 #include "hexdump.h"
 #include "path-helpers.h"
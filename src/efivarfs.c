@@ -8,13 +8,16 @@
 
 #ifdef __linux__
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/magic.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -23,6 +26,8 @@
 #include <unistd.h>
 
 #include "efivar.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <linux/fs.h>
 
@@ -100,10 +105,54 @@ efivarfs_probe(void)
 	return 0;
 }
 
-#define make_efivarfs_path(str, guid, name) ({				\
-		asprintf(str, "%s%s-" GUID_FORMAT, get_efivarfs_path(),	\
-			name, GUID_FORMAT_ARGS(&(guid)));		\
-	})
+/*
+ * Build "<efivarfs>/<name>-<guid>" into path, which is pathsz bytes long.
+ * Returns the length of the path, or -1 with errno set to ENAMETOOLONG.
+ */
+static ssize_t
+format_efivarfs_path(char *path, size_t pathsz, efi_guid_t *guid,
+		     const char *name)
+{
+	const char *dir = get_efivarfs_path();
+	size_t dirlen = strlen(dir);
+	size_t namelen = strlen(name);
+	size_t len = dirlen + namelen + 1 + GUID_STR_LEN;
+
+	if (len >= pathsz) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memcpy(path, dir, dirlen);
+	memcpy(path + dirlen, name, namelen);
+	path[dirlen + namelen] = '-';
+	encode_guid_text(guid, path + dirlen + namelen + 1);
+	path[len] = '\0';
+	return len;
+}
+
+static int
+make_efivarfs_path_(char **str, efi_guid_t *guid, const char *name)
+{
+	size_t pathsz = strlen(get_efivarfs_path()) + strlen(name) + 1 +
+			GUID_STR_LEN + 1;
+	char *path = malloc(pathsz);
+	ssize_t len;
+
+	if (!path)
+		return -1;
+
+	len = format_efivarfs_path(path, pathsz, guid, name);
+	if (len < 0) {
+		free(path);
+		return -1;
+	}
+	*str = path;
+	return len;
+}
+
+#define make_efivarfs_path(str, guid, name) \
+	make_efivarfs_path_(str, &(guid), name)
 
 static int
 efivarfs_set_fd_immutable(int fd, int immutable)
@@ -180,6 +229,159 @@ efivarfs_set_immutable(char *path, int immutable)
 	return rc;
 }
 
+/*
+ * Apply a whole transaction at once: open everything that already exists
+ * and clear any immutable flags in one pass, then do all the writes and
+ * unlinks back to back, then put the flags back.  That keeps the window
+ * where only some of the changes have landed as short as we can make it.
+ */
+struct efivarfs_txn_file {
+	char *path;
+	int rfd;
+	struct stat rfd_stat;
+	unsigned long orig_attrs;
+	int restore_immutable_fd;
+	int wfd;
+};
+
+static int
+efivarfs_apply_transaction(efi_variable_transaction_t *txn, size_t *applied)
+{
+	struct efivarfs_txn_file *files;
+	__typeof__(errno) errno_value;
+	int ret = -1;
+
+	*applied = 0;
+
+	files = calloc(txn->n_ops, sizeof(*files));
+	if (!files && txn->n_ops) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	for (size_t i = 0; i < txn->n_ops; i++) {
+		files[i].rfd = -1;
+		files[i].restore_immutable_fd = -1;
+		files[i].wfd = -1;
+	}
+
+	for (size_t i = 0; i < txn->n_ops; i++) {
+		struct transaction_op *op = &txn->ops[i];
+		struct efivarfs_txn_file *file = &files[i];
+
+		if (make_efivarfs_path(&file->path, op->guid, op->name) < 0) {
+			file->path = NULL;
+			efi_error("make_efivarfs_path failed");
+			goto err;
+		}
+
+		file->rfd = open(file->path, O_RDONLY|O_CLOEXEC);
+		if (file->rfd < 0) {
+			if (op->existed) {
+				efi_error("open(%s) failed", file->path);
+				goto err;
+			}
+			continue;
+		}
+		if (fstat(file->rfd, &file->rfd_stat) < 0) {
+			efi_error("fstat(%s) failed", file->path);
+			goto err;
+		}
+		if (efivarfs_make_fd_mutable(file->rfd,
+					     &file->orig_attrs) == 0 &&
+		    (file->orig_attrs & FS_IMMUTABLE_FL))
+			file->restore_immutable_fd = file->rfd;
+	}
+
+	for (; *applied < txn->n_ops; *applied += 1) {
+		struct transaction_op *op = &txn->ops[*applied];
+		struct efivarfs_txn_file *file = &files[*applied];
+		size_t bufsize = sizeof(op->attributes) + op->data_size;
+		int open_wflags = O_WRONLY|O_CLOEXEC;
+
+		if (!op->buf) {
+			if (unlink(file->path) < 0) {
+				efi_error("unlink(%s) failed", file->path);
+				goto err;
+			}
+			/* nothing left to put the flags back on */
+			file->restore_immutable_fd = -1;
+			continue;
+		}
+
+		if (op->attributes & EFI_VARIABLE_APPEND_WRITE)
+			open_wflags |= O_APPEND;
+		if (file->rfd < 0)
+			open_wflags |= O_CREAT|O_EXCL;
+
+		file->wfd = open(file->path, open_wflags, op->mode);
+		if (file->wfd < 0) {
+			efi_error("failed to %s %s",
+				  file->rfd < 0 ? "create" : "open",
+				  file->path);
+			goto err;
+		}
+
+		if (file->rfd < 0) {
+			if (efivarfs_make_fd_mutable(file->wfd,
+						     &file->orig_attrs) == 0 &&
+			    (file->orig_attrs & FS_IMMUTABLE_FL))
+				file->restore_immutable_fd = file->wfd;
+		} else {
+			struct stat wfd_stat;
+
+			if (fstat(file->wfd, &wfd_stat) < 0) {
+				efi_error("fstat(%s) failed", file->path);
+				goto err;
+			}
+			if (file->rfd_stat.st_dev != wfd_stat.st_dev ||
+			    file->rfd_stat.st_ino != wfd_stat.st_ino) {
+				errno = EINVAL;
+				efi_error("%s was replaced underneath us",
+					  file->path);
+				goto err;
+			}
+		}
+
+		if (write(file->wfd, op->buf, bufsize) == -1) {
+			efi_error("writing to %s failed", file->path);
+			goto err;
+		}
+	}
+
+	ret = 0;
+err:
+	errno_value = errno;
+
+	/* if the one that failed was a create, don't leave it behind */
+	if (ret < 0 && *applied < txn->n_ops) {
+		struct efivarfs_txn_file *file = &files[*applied];
+
+		if (txn->ops[*applied].buf && file->rfd < 0 &&
+		    file->wfd >= 0) {
+			if (unlink(file->path) < 0)
+				efi_error("failed to unlink %s", file->path);
+			file->restore_immutable_fd = -1;
+		}
+	}
+
+	for (size_t i = 0; i < txn->n_ops; i++) {
+		struct efivarfs_txn_file *file = &files[i];
+
+		if (file->restore_immutable_fd >= 0)
+			ioctl(file->restore_immutable_fd, FS_IOC_SETFLAGS,
+			      &file->orig_attrs);
+		if (file->wfd >= 0)
+			close(file->wfd);
+		if (file->rfd >= 0)
+			close(file->rfd);
+		free(file->path);
+	}
+	free(files);
+
+	errno = errno_value;
+	return ret;
+}
+
 static int
 efivarfs_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
 {
@@ -214,28 +416,177 @@ err:
 	return ret;
 }
 
+/*
+ * Read a variable straight into the caller's buffer: one readv() puts the
+ * attributes in *attributes and the data in buf, with a spare byte after
+ * it so we can tell if the variable didn't fit.  If it doesn't fit, the
+ * read will have updated the inode size, so fstat() gives the real size.
+ */
 static int
-efivarfs_get_variable_attributes(efi_guid_t guid, const char *name,
-			    uint32_t *attributes)
+efivarfs_get_variable_into(efi_guid_t guid, const char *name, uint8_t *buf,
+			   size_t bufsz, size_t *data_size,
+			   uint32_t *attributes)
 {
+	__typeof__(errno) errno_value;
+	char path[PATH_MAX];
+	struct stat statbuf;
+	uint32_t ret_attributes = 0;
+	uint8_t spare;
+	struct iovec iov[] = {
+		{ .iov_base = &ret_attributes,
+		  .iov_len = sizeof(ret_attributes), },
+		{ .iov_base = buf, .iov_len = bufsz, },
+		{ .iov_base = &spare, .iov_len = sizeof(spare), },
+	};
+	ssize_t sz;
 	int ret = -1;
+	int fd = -1;
+	int rc;
+
+	tracepoint(libefivar, get_variable_entry, &guid, name);
+
+	if (format_efivarfs_path(path, sizeof(path), &guid, name) < 0) {
+		efi_error("variable path is too long");
+		goto err;
+	}
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		efi_error("open(%s)", path);
+		goto err;
+	}
 
-	uint8_t *data;
-	size_t data_size;
-	uint32_t attribs;
+	/* if efivarfs already knows it won't fit, don't bother the
+	 * firmware with a read */
+	rc = fstat(fd, &statbuf);
+	if (rc < 0) {
+		efi_error("fstat(%s) failed", path);
+		goto err;
+	}
+	if (statbuf.st_size > (off_t)sizeof(ret_attributes) &&
+	    (size_t)statbuf.st_size - sizeof(ret_attributes) > bufsz) {
+		*data_size = statbuf.st_size - sizeof(ret_attributes);
+		errno = ENOSPC;
+		goto err;
+	}
 
-	ret = efi_get_variable(guid, name, &data, &data_size, &attribs);
-	if (ret < 0) {
-		efi_error("efi_get_variable failed");
-		return ret;
+	efi_ratelimit();
+	sz = readv(fd, iov, sizeof(iov) / sizeof(iov[0]));
+	if (sz < 0) {
+		efi_error("readv(%s) failed", path);
+		goto err;
+	}
+	if ((size_t)sz < sizeof(ret_attributes)) {
+		errno = EIO;
+		efi_error("short read of %s", path);
+		goto err;
+	}
+
+	sz -= sizeof(ret_attributes);
+	if ((size_t)sz > bufsz) {
+		rc = fstat(fd, &statbuf);
+		if (rc < 0) {
+			efi_error("fstat(%s) failed", path);
+			goto err;
+		}
+		*data_size = bufsz + 1;
+		if (statbuf.st_size > (off_t)(sizeof(ret_attributes) + bufsz))
+			*data_size = statbuf.st_size - sizeof(ret_attributes);
+		errno = ENOSPC;
+		goto err;
 	}
 
-	*attributes = attribs;
-	if (data)
-		free(data);
+	*attributes = ret_attributes;
+	*data_size = sz;
+	stats_inc(efivarfs_reads);
+	stats_add(efivarfs_read_bytes, sz);
+	ret = 0;
+err:
+	errno_value = errno;
+	tracepoint(libefivar, get_variable_return, &guid, name, ret,
+		   ret < 0 ? 0 : *data_size);
+	if (fd >= 0)
+		close(fd);
+	errno = errno_value;
 	return ret;
 }
 
+/*
+ * The attributes are the first four bytes of the file, so that's all we
+ * read; there's no reason to copy all of db or MokList out to userland to
+ * look at them.  Once the read has happened the inode size is current, so
+ * if size isn't NULL we fstat() afterwards and hand that back too.
+ */
+static int
+efivarfs_get_variable_header(efi_guid_t guid, const char *name,
+			     size_t *size, uint32_t *attributes)
+{
+	__typeof__(errno) errno_value;
+	char path[PATH_MAX];
+	struct stat statbuf;
+	uint32_t ret_attributes = 0;
+	ssize_t sz;
+	int ret = -1;
+	int fd = -1;
+
+	if (format_efivarfs_path(path, sizeof(path), &guid, name) < 0) {
+		efi_error("variable path is too long");
+		goto err;
+	}
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		efi_error("open(%s)", path);
+		goto err;
+	}
+
+	efi_ratelimit();
+	sz = pread(fd, &ret_attributes, sizeof(ret_attributes), 0);
+	if (sz < 0) {
+		efi_error("pread(%s) failed", path);
+		goto err;
+	}
+	if ((size_t)sz < sizeof(ret_attributes)) {
+		errno = EIO;
+		efi_error("short read of %s", path);
+		goto err;
+	}
+
+	if (size) {
+		if (fstat(fd, &statbuf) < 0) {
+			efi_error("fstat(%s) failed", path);
+			goto err;
+		}
+		*size = 0;
+		if (statbuf.st_size > (off_t)sizeof(ret_attributes))
+			*size = statbuf.st_size - sizeof(ret_attributes);
+	}
+	*attributes = ret_attributes;
+	stats_inc(efivarfs_reads);
+	stats_add(efivarfs_read_bytes, sizeof(ret_attributes));
+	ret = 0;
+err:
+	errno_value = errno;
+	if (fd >= 0)
+		close(fd);
+	errno = errno_value;
+	return ret;
+}
+
+static int
+efivarfs_get_variable_attributes(efi_guid_t guid, const char *name,
+			    uint32_t *attributes)
+{
+	return efivarfs_get_variable_header(guid, name, NULL, attributes);
+}
+
+static int
+efivarfs_get_variable_info(efi_guid_t guid, const char *name, size_t *size,
+			   uint32_t *attributes)
+{
+	return efivarfs_get_variable_header(guid, name, size, attributes);
+}
+
 static int
 efivarfs_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 		  size_t *data_size, uint32_t *attributes)
@@ -248,16 +599,8 @@ efivarfs_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 	int fd = -1;
 	char *path = NULL;
 	int rc;
-	int ratelimit;
 
-	/*
-	 * The kernel rate limiter hits us if we go faster than 100 efi
-	 * variable reads per second as non-root.  So if we're not root, just
-	 * delay this long after each read.  The user is not going to notice.
-	 *
-	 * 1s / 100 = 10000us.
-	 */
-	ratelimit = geteuid() == 0 ? 0 : 10000;
+	tracepoint(libefivar, get_variable_entry, &guid, name);
 
 	rc = make_efivarfs_path(&path, guid, name);
 	if (rc < 0) {
@@ -271,14 +614,14 @@ efivarfs_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 		goto err;
 	}
 
-	usleep(ratelimit);
+	efi_ratelimit();
 	rc = read(fd, &ret_attributes, sizeof (ret_attributes));
 	if (rc < 0) {
 		efi_error("read failed");
 		goto err;
 	}
 
-	usleep(ratelimit);
+	efi_ratelimit();
 	rc = read_file(fd, &ret_data, &size);
 	if (rc < 0) {
 		efi_error("read_file failed");
@@ -288,10 +631,14 @@ efivarfs_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 	*attributes = ret_attributes;
 	*data = ret_data;
 	*data_size = size - 1; // read_file pads out 1 extra byte to NUL it */
+	stats_inc(efivarfs_reads);
+	stats_add(efivarfs_read_bytes, size - 1);
 
 	ret = 0;
 err:
 	errno_value = errno;
+	tracepoint(libefivar, get_variable_return, &guid, name, ret,
+		   ret < 0 ? 0 : size - 1);
 
 	if (fd >= 0)
 		close(fd);
@@ -313,10 +660,14 @@ efivarfs_del_variable(efi_guid_t guid, const char *name)
 		return -1;
 	}
 
+	tracepoint(libefivar, del_variable_entry, &guid, name);
 	efivarfs_set_immutable(path, 0);
 	rc = unlink(path);
 	if (rc < 0)
 		efi_error("unlink failed");
+	else
+		stats_inc(efivarfs_deletes);
+	tracepoint(libefivar, del_variable_return, &guid, name, rc);
 
 	__typeof__(errno) errno_value = errno;
 	free(path);
@@ -358,6 +709,9 @@ efivarfs_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 		return -1;
 	}
 
+	tracepoint(libefivar, set_variable_entry, &guid, name, data_size,
+		   attributes);
+
 	alloc_size = sizeof (attributes) + data_size;
 	buf = malloc(alloc_size);
 	if (buf == NULL) {
@@ -449,10 +803,13 @@ efivarfs_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 	}
 
 	/* we're done */
+	stats_inc(efivarfs_writes);
+	stats_add(efivarfs_write_bytes, data_size);
 	ret = 0;
 
 err:
 	save_errno = errno;
+	tracepoint(libefivar, set_variable_return, &guid, name, ret);
 
 	/* if we're exiting with error and created the file, remove it */
 	if (ret == -1 && rfd == -1 && wfd != -1 && unlink(path) == -1)
@@ -484,6 +841,31 @@ efivarfs_append_variable(efi_guid_t guid, const char *name, uint8_t *data,
 	return rc;
 }
 
+static int
+efivarfs_varname_iter_open(struct efi_varname_iter *iter)
+{
+	int rc;
+	rc = generic_varname_iter_open(get_efivarfs_path(), iter);
+	if (rc < 0)
+		efi_error("generic_varname_iter_open failed");
+	return rc;
+}
+
+static int
+efivarfs_watch_variables(int inotify_fd)
+{
+	const char *path = get_efivarfs_path();
+	int wd;
+
+	wd = inotify_add_watch(inotify_fd, path,
+			       IN_MODIFY|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|
+			       IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|
+			       IN_UNMOUNT);
+	if (wd < 0)
+		efi_error("inotify_add_watch(%s) failed", path);
+	return wd;
+}
+
 static int
 efivarfs_get_next_variable_name(efi_guid_t **guid, char **name)
 {
@@ -494,6 +876,148 @@ efivarfs_get_next_variable_name(efi_guid_t **guid, char **name)
 	return rc;
 }
 
+/*
+ * Finish off the snapshot entry whose raw file contents, attributes and
+ * all, are the filesize bytes just reserved at buf.
+ */
+static int
+efivarfs_snapshot_finish(efi_variable_snapshot_t *snapshot, uint8_t *buf,
+			 size_t filesize)
+{
+	uint32_t attributes;
+
+	if (filesize < sizeof(attributes)) {
+		errno = EINVAL;
+		efi_error("variable file is too short (%zu bytes)", filesize);
+		return -1;
+	}
+
+	memcpy(&attributes, buf, sizeof(attributes));
+	stats_inc(efivarfs_reads);
+	stats_add(efivarfs_read_bytes, filesize - sizeof(attributes));
+	return snapshot_entry_commit(snapshot, attributes, sizeof(attributes),
+				     filesize - sizeof(attributes));
+}
+
+/*
+ * Read one variable file straight into the snapshot arena.  efivarfs
+ * hands back the whole variable on every read(), so one read of at least
+ * st_size bytes gets the attributes and data in a single trip to the
+ * firmware.
+ */
+static int
+efivarfs_snapshot_read(efi_variable_snapshot_t *snapshot, int fd,
+		       size_t size_hint)
+{
+	size_t bufsize = size_hint > sizeof(uint32_t) ? size_hint + 1 : 4096;
+	size_t filesize = 0;
+	uint8_t *buf;
+	ssize_t sz;
+
+	efi_ratelimit();
+	while (1) {
+		buf = snapshot_entry_reserve(snapshot, bufsize);
+		if (!buf)
+			return -1;
+
+		sz = read(fd, buf + filesize, bufsize - filesize);
+		if (sz < 0 && errno == EAGAIN) {
+			sched_yield();
+			continue;
+		} else if (sz < 0) {
+			efi_error("read failed");
+			return -1;
+		}
+		filesize += sz;
+		if (sz == 0 || filesize < bufsize)
+			break;
+		if (MUL(bufsize, 2, &bufsize)) {
+			errno = EOVERFLOW;
+			efi_error("arithmetic overflow computing read size");
+			return -1;
+		}
+	}
+
+	return efivarfs_snapshot_finish(snapshot, buf, filesize);
+}
+
+/*
+ * Read the variable named entry, in the directory dfd, into the snapshot
+ * with open(), fstat(), and read().  If it's gone, that's fine.
+ */
+static int
+efivarfs_snapshot_one(efi_variable_snapshot_t *snapshot, int dfd,
+		      const char *entry, efi_guid_t *guid, size_t namelen)
+{
+	__typeof__(errno) errno_value;
+	struct stat statbuf;
+	int fd;
+	int rc;
+
+	fd = openat(dfd, entry, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		/* it went away while we were looking; that's fine */
+		if (errno == ENOENT)
+			return 0;
+		efi_error("openat(%s) failed", entry);
+		return -1;
+	}
+
+	rc = fstat(fd, &statbuf);
+	if (rc < 0) {
+		efi_error("fstat(%s) failed", entry);
+		errno_value = errno;
+		close(fd);
+		errno = errno_value;
+		return -1;
+	}
+
+	rc = snapshot_entry_start(snapshot, guid, entry, namelen);
+	if (rc >= 0) {
+		rc = efivarfs_snapshot_read(snapshot, fd, statbuf.st_size);
+		if (rc < 0)
+			snapshot_entry_abort(snapshot);
+	}
+	errno_value = errno;
+	close(fd);
+	errno = errno_value;
+	if (rc < 0) {
+		efi_error("could not read %s", entry);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+efivarfs_snapshot_variables(efi_variable_snapshot_t *snapshot)
+{
+	const char *path = get_efivarfs_path();
+	struct efi_varname_iter iter = { .dfd = -1, };
+	int ret = -1;
+
+	if (generic_varname_iter_open(path, &iter) < 0)
+		return -1;
+
+	while (1) {
+		ssize_t namelen;
+
+		namelen = generic_varname_iter_next_entry(&iter);
+		if (namelen == 0)
+			break;
+		if (namelen < 0)
+			goto out;
+
+		if (efivarfs_snapshot_one(snapshot, iter.dfd, iter.entry,
+					  &iter.guid, namelen) < 0)
+			goto out;
+	}
+
+	ret = 0;
+out:
+	generic_varname_iter_close(&iter);
+	return ret;
+}
+
 static int
 efivarfs_chmod_variable(efi_guid_t guid, const char *name, mode_t mode)
 {
@@ -520,10 +1044,16 @@ struct efi_var_operations efivarfs_ops = {
 	.append_variable = efivarfs_append_variable,
 	.del_variable = efivarfs_del_variable,
 	.get_variable = efivarfs_get_variable,
+	.get_variable_into = efivarfs_get_variable_into,
 	.get_variable_attributes = efivarfs_get_variable_attributes,
+	.get_variable_info = efivarfs_get_variable_info,
 	.get_variable_size = efivarfs_get_variable_size,
 	.get_next_variable_name = efivarfs_get_next_variable_name,
 	.chmod_variable = efivarfs_chmod_variable,
+	.snapshot_variables = efivarfs_snapshot_variables,
+	.varname_iter_open = efivarfs_varname_iter_open,
+	.watch_variables = efivarfs_watch_variables,
+	.apply_transaction = efivarfs_apply_transaction,
 };
 
 #else
@@ -543,10 +1073,15 @@ struct efi_var_operations efivarfs_ops = {
 	.append_variable = NULL,
 	.del_variable = NULL,
 	.get_variable = NULL,
+	.get_variable_into = NULL,
 	.get_variable_attributes = NULL,
 	.get_variable_size = NULL,
 	.get_next_variable_name = NULL,
 	.chmod_variable = NULL,
+	.snapshot_variables = NULL,
+	.varname_iter_open = NULL,
+	.watch_variables = NULL,
+	.apply_transaction = NULL,
 };
 
 #endif /* __linux__ */
@@ -0,0 +1,477 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * efivarstat.c - statistics over a pile of exported variables
+ */
+#include "fix_coverity.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "efisec.h"
+#include <efivar/efiboot.h>
+
+#define PROGRAM_NAME "efivarstat"
+
+#define LOAD_OPTION_ACTIVE	0x00000001
+#define MAX_JOBS		64
+#define DESC_BUCKETS		1024
+
+extern char *optarg;
+extern int optind, opterr, optopt;
+
+/*
+ * Each worker keeps its own counts and adds them to the totals when it's
+ * done, so the only thing they share while running is the description
+ * table.
+ */
+struct stats {
+	uint64_t files;
+	uint64_t bad_files;
+	uint64_t archives;
+	uint64_t variables;
+	uint64_t bytes;
+	uint64_t boot_entries;
+	uint64_t boot_active;
+	uint64_t boot_invalid;
+	uint64_t bootorders;
+	uint64_t bootorder_entries;
+	uint64_t bootorder_max;
+	uint64_t db;
+	uint64_t db_sigs;
+	uint64_t dbx;
+	uint64_t dbx_sigs;
+	uint64_t dbx_min;
+	uint64_t dbx_max;
+	uint64_t secdb_invalid;
+};
+
+struct desc_count {
+	struct desc_count *next;
+	uint64_t count;
+	char desc[];
+};
+
+static char **paths;
+static size_t n_paths;
+static size_t n_paths_allocated;
+static size_t next_path;
+static int verbose;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats totals;
+static struct desc_count *descs[DESC_BUCKETS];
+static size_t n_descs;
+
+static int
+add_path(const char *fpath, const struct stat *sb, int typeflag,
+	 struct FTW *ftwbuf UNUSED)
+{
+	if (typeflag != FTW_F || !S_ISREG(sb->st_mode))
+		return 0;
+
+	if (n_paths == n_paths_allocated) {
+		size_t n = n_paths_allocated ? n_paths_allocated * 2 : 1024;
+		char **new_paths = reallocarray(paths, n, sizeof(*paths));
+
+		if (!new_paths)
+			err(1, "could not allocate memory");
+		paths = new_paths;
+		n_paths_allocated = n;
+	}
+	paths[n_paths] = strdup(fpath);
+	if (!paths[n_paths])
+		err(1, "could not allocate memory");
+	n_paths++;
+	return 0;
+}
+
+static void
+count_desc(efi_load_option *opt, size_t size)
+{
+	unsigned char desc[1024];
+	struct desc_count *dc;
+	uint32_t hash = 5381;
+	ssize_t len;
+
+	len = efi_loadopt_desc_r(opt, size, desc, sizeof(desc));
+	if (len < 0)
+		return;
+	if ((size_t)len >= sizeof(desc))
+		len = strlen((const char *)desc);
+
+	for (ssize_t i = 0; i < len; i++)
+		hash = hash * 33 + desc[i];
+	hash %= DESC_BUCKETS;
+
+	pthread_mutex_lock(&lock);
+	for (dc = descs[hash]; dc; dc = dc->next) {
+		if (!strcmp(dc->desc, (const char *)desc)) {
+			dc->count++;
+			goto out;
+		}
+	}
+
+	dc = malloc(sizeof(*dc) + len + 1);
+	if (!dc)
+		goto out;
+	memcpy(dc->desc, desc, len + 1);
+	dc->count = 1;
+	dc->next = descs[hash];
+	descs[hash] = dc;
+	n_descs++;
+out:
+	pthread_mutex_unlock(&lock);
+}
+
+static efi_secdb_visitor_status_t
+count_sig(unsigned int listnum UNUSED, unsigned int signum UNUSED,
+	  const efi_guid_t * const owner UNUSED,
+	  const efi_secdb_type_t algorithm UNUSED,
+	  const void * const header UNUSED, const size_t headersz UNUSED,
+	  const efi_secdb_data_t * const data UNUSED,
+	  const size_t datasz UNUSED, void *closure)
+{
+	uint64_t *nsigs = closure;
+
+	*nsigs += 1;
+	return CONTINUE;
+}
+
+static void
+count_secdb(struct stats *stats, const char *name, uint8_t *data,
+	    size_t size)
+{
+	efi_secdb_t *secdb = NULL;
+	uint64_t nsigs = 0;
+	bool dbx = !strcmp(name, "dbx");
+
+	if (efi_secdb_parse_view(data, size, &secdb) < 0 ||
+	    efi_secdb_visit_entries(secdb, count_sig, &nsigs) < 0) {
+		stats->secdb_invalid++;
+		efi_secdb_free(secdb);
+		efi_error_clear();
+		return;
+	}
+	efi_secdb_free(secdb);
+
+	if (dbx) {
+		stats->dbx++;
+		stats->dbx_sigs += nsigs;
+		if (stats->dbx == 1 || nsigs < stats->dbx_min)
+			stats->dbx_min = nsigs;
+		if (nsigs > stats->dbx_max)
+			stats->dbx_max = nsigs;
+	} else {
+		stats->db++;
+		stats->db_sigs += nsigs;
+	}
+}
+
+static bool
+is_boot_entry(const char *name)
+{
+	if (strlen(name) != 8 || strncmp(name, "Boot", 4))
+		return false;
+	for (int i = 4; i < 8; i++) {
+		if (!isxdigit(name[i]))
+			return false;
+	}
+	return true;
+}
+
+static void
+count_variable(struct stats *stats, efi_variable_t *var)
+{
+	const char *name = (const char *)efi_variable_get_name(var);
+	efi_guid_t *guid = NULL;
+	uint8_t *data = NULL;
+	size_t size = 0;
+
+	efi_variable_get_guid(var, &guid);
+	efi_variable_get_data(var, &data, &size);
+	stats->variables++;
+	stats->bytes += size;
+
+	if (!efi_guid_cmp(guid, &efi_guid_global)) {
+		if (is_boot_entry(name)) {
+			efi_load_option *opt = (efi_load_option *)data;
+
+			stats->boot_entries++;
+			if (!efi_loadopt_is_valid(opt, size)) {
+				stats->boot_invalid++;
+				return;
+			}
+			if (efi_loadopt_attrs(opt) & LOAD_OPTION_ACTIVE)
+				stats->boot_active++;
+			count_desc(opt, size);
+		} else if (!strcmp(name, "BootOrder")) {
+			uint64_t n = size / sizeof(uint16_t);
+
+			stats->bootorders++;
+			stats->bootorder_entries += n;
+			if (n > stats->bootorder_max)
+				stats->bootorder_max = n;
+		}
+	} else if (!efi_guid_cmp(guid, &efi_guid_security) &&
+		   (!strcmp(name, "db") || !strcmp(name, "dbx"))) {
+		count_secdb(stats, name, data, size);
+	}
+}
+
+/*
+ * One file is either an archive or one or more exported variables back to
+ * back.  Exports are read where they're mapped rather than copied.
+ */
+static void
+count_file(struct stats *stats, const char *path)
+{
+	efi_variable_archive_t *archive = NULL;
+	efi_variable_t *var = NULL;
+	struct stat sb;
+	uint8_t *map;
+	size_t offset = 0;
+	int fd, rc;
+
+	stats->files++;
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &sb) < 0 || sb.st_size == 0)
+		goto bad;
+
+	if (efi_variable_archive_open(fd, &archive) == 0) {
+		stats->archives++;
+		while ((rc = efi_variable_archive_next(archive, &var)) > 0) {
+			count_variable(stats, var);
+			efi_variable_free(var, true);
+		}
+		efi_variable_archive_free(archive);
+		close(fd);
+		if (rc < 0)
+			goto bad;
+		return;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	fd = -1;
+	if (map == MAP_FAILED)
+		goto bad;
+
+	while (offset < (size_t)sb.st_size) {
+		ssize_t sz = efi_variable_import_view(map + offset,
+						      sb.st_size - offset,
+						      &var);
+		if (sz <= 0)
+			break;
+		count_variable(stats, var);
+		efi_variable_free(var, true);
+		offset += sz;
+	}
+	munmap(map, sb.st_size);
+	if (offset == 0)
+		goto bad;
+	return;
+bad:
+	if (fd >= 0)
+		close(fd);
+	if (verbose)
+		warnx("could not read \"%s\"", path);
+	stats->bad_files++;
+	efi_error_clear();
+}
+
+static void *
+worker(void *arg UNUSED)
+{
+	struct stats stats;
+	size_t n;
+
+	memset(&stats, 0, sizeof(stats));
+	while ((n = __atomic_fetch_add(&next_path, 1, __ATOMIC_RELAXED))
+	       < n_paths)
+		count_file(&stats, paths[n]);
+
+	pthread_mutex_lock(&lock);
+	if (stats.dbx &&
+	    (totals.dbx == 0 || stats.dbx_min < totals.dbx_min))
+		totals.dbx_min = stats.dbx_min;
+	if (stats.dbx_max > totals.dbx_max)
+		totals.dbx_max = stats.dbx_max;
+	if (stats.bootorder_max > totals.bootorder_max)
+		totals.bootorder_max = stats.bootorder_max;
+	totals.files += stats.files;
+	totals.bad_files += stats.bad_files;
+	totals.archives += stats.archives;
+	totals.variables += stats.variables;
+	totals.bytes += stats.bytes;
+	totals.boot_entries += stats.boot_entries;
+	totals.boot_active += stats.boot_active;
+	totals.boot_invalid += stats.boot_invalid;
+	totals.bootorders += stats.bootorders;
+	totals.bootorder_entries += stats.bootorder_entries;
+	totals.db += stats.db;
+	totals.db_sigs += stats.db_sigs;
+	totals.dbx += stats.dbx;
+	totals.dbx_sigs += stats.dbx_sigs;
+	totals.secdb_invalid += stats.secdb_invalid;
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+static int
+desc_count_cmp(const void *ap, const void *bp)
+{
+	const struct desc_count *a = *(const struct desc_count **)ap;
+	const struct desc_count *b = *(const struct desc_count **)bp;
+
+	if (a->count != b->count)
+		return a->count < b->count ? 1 : -1;
+	return strcmp(a->desc, b->desc);
+}
+
+static void
+show_stats(unsigned long top)
+{
+	struct desc_count **sorted;
+	size_t n = 0;
+
+	printf("files: %"PRIu64" (%"PRIu64" archives, %"PRIu64" unreadable)\n",
+	       totals.files, totals.archives, totals.bad_files);
+	printf("variables: %"PRIu64" (%"PRIu64" bytes)\n",
+	       totals.variables, totals.bytes);
+	printf("Boot####: %"PRIu64" (%"PRIu64" active, %"PRIu64" invalid)\n",
+	       totals.boot_entries, totals.boot_active, totals.boot_invalid);
+	printf("BootOrder: %"PRIu64" (%.1f entries average, %"PRIu64" most)\n",
+	       totals.bootorders,
+	       totals.bootorders ? (double)totals.bootorder_entries
+				   / totals.bootorders : 0.0,
+	       totals.bootorder_max);
+	printf("db: %"PRIu64" (%"PRIu64" signatures)\n",
+	       totals.db, totals.db_sigs);
+	printf("dbx: %"PRIu64" (%"PRIu64" signatures, %"PRIu64" fewest, %"PRIu64" most)\n",
+	       totals.dbx, totals.dbx_sigs, totals.dbx_min, totals.dbx_max);
+	if (totals.secdb_invalid)
+		printf("invalid db/dbx: %"PRIu64"\n", totals.secdb_invalid);
+
+	if (!top || !n_descs)
+		return;
+
+	sorted = calloc(n_descs, sizeof(*sorted));
+	if (!sorted)
+		err(1, "could not allocate memory");
+	for (size_t i = 0; i < DESC_BUCKETS; i++) {
+		for (struct desc_count *dc = descs[i]; dc; dc = dc->next)
+			sorted[n++] = dc;
+	}
+	qsort(sorted, n, sizeof(*sorted), desc_count_cmp);
+
+	printf("boot entry descriptions:\n");
+	for (size_t i = 0; i < n && i < top; i++)
+		printf("%10"PRIu64"  %s\n", sorted[i]->count, sorted[i]->desc);
+	free(sorted);
+}
+
+static void NORETURN
+usage(int status)
+{
+	fprintf(status == 0 ? stdout : stderr,
+		"Usage: %s [OPTION...] <file|directory>...\n"
+		"  -j, --jobs=<n>            read with <n> threads (default: one per CPU)\n"
+		"  -n, --top=<n>             show the <n> most common boot entry descriptions\n"
+		"  -v, --verbose             report files that can't be read (twice or more\n"
+		"                            for library debugging)\n"
+		"  -?, --help                show this help\n",
+		PROGRAM_NAME);
+	exit(status);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pthread_t threads[MAX_JOBS];
+	unsigned long top = 10;
+	long jobs = 0;
+	int c, i;
+
+	const char sopts[] = "j:n:v?";
+	const struct option lopts[] = {
+		{"jobs", required_argument, NULL, 'j' },
+		{"top", required_argument, NULL, 'n' },
+		{"verbose", no_argument, NULL, 'v' },
+		{"help", no_argument, NULL, '?' },
+		{"usage", no_argument, NULL, '?' },
+		{NULL, 0, NULL, '\0' }
+	};
+
+	while ((c = getopt_long(argc, argv, sopts, lopts, &i)) != -1) {
+		char *end = NULL;
+
+		switch (c) {
+		case 'j':
+			jobs = strtol(optarg, &end, 10);
+			if (!*optarg || *end || jobs < 1)
+				errx(1, "invalid job count \"%s\"", optarg);
+			break;
+		case 'n':
+			top = strtoul(optarg, &end, 10);
+			if (!*optarg || *end)
+				errx(1, "invalid count \"%s\"", optarg);
+			break;
+		case 'v':
+			verbose += 1;
+			break;
+		case '?':
+			usage(optopt ? 1 : 0);
+			break;
+		}
+	}
+	if (optind == argc)
+		usage(1);
+
+	/* -v is ours; anything past that is for the libraries */
+	if (verbose > 1)
+		efi_set_verbose(verbose - 1, stderr);
+
+	for (; optind < argc; optind++) {
+		if (nftw(argv[optind], add_path, 64, FTW_PHYS) < 0)
+			err(1, "could not read \"%s\"", argv[optind]);
+	}
+
+	if (jobs == 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+	if ((size_t)jobs > n_paths)
+		jobs = n_paths ? n_paths : 1;
+
+	/* the last one's us */
+	for (i = 0; i < jobs - 1; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+			break;
+	}
+	worker(NULL);
+	while (i-- > 0)
+		pthread_join(threads[i], NULL);
+
+	show_stats(top);
+
+	for (size_t n = 0; n < n_paths; n++)
+		free(paths[n]);
+	free(paths);
+	return 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
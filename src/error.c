@@ -8,11 +8,13 @@
 #include "fix_coverity.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/param.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "efiboot.h"
@@ -25,16 +27,82 @@
 #  include <sys/random.h>
 #endif
 
+/*
+ * Errors are pushed constantly on paths that then recover, such as each
+ * device probe that doesn't match, so pushing one mustn't allocate.  Each
+ * thread gets a fixed table of entries, allocated the first time it needs
+ * one; when it fills up, new errors are dropped, so the first ones, which
+ * are usually the root cause, are kept, and nothing efi_error_get() has
+ * handed out gets overwritten until the entry is popped or cleared.
+ * filename, function, and the formatted message are copied into fixed
+ * slots in each entry and truncated if they don't fit.
+ *
+ * Formatting is most of what's left, and it can be turned off at build
+ * time with EFIVAR_NO_ERROR_MESSAGES or at run time by setting
+ * LIBEFIVAR_ERROR_MESSAGES=0, in which case the message is just the
+ * unformatted fmt string.
+ */
+#define ERROR_TABLE_SIZE	64
+#define ERROR_FILENAME_SIZE	128
+#define ERROR_FUNCTION_SIZE	64
+#define ERROR_MESSAGE_SIZE	256
+
 typedef struct {
 	int error;
-	char *filename;
-	char *function;
 	int line;
-	char *message;
+	const char *message;
+	char filename[ERROR_FILENAME_SIZE];
+	char function[ERROR_FUNCTION_SIZE];
+	char message_buf[ERROR_MESSAGE_SIZE];
 } error_table_entry;
 
-static _Thread_local error_table_entry *error_table;
-static _Thread_local unsigned int current;
+typedef struct {
+	unsigned int count;
+	error_table_entry entries[ERROR_TABLE_SIZE];
+} error_table_t;
+
+static _Thread_local error_table_t *error_table;
+static pthread_key_t error_table_key;
+static pthread_once_t error_table_once = PTHREAD_ONCE_INIT;
+static bool error_table_key_valid;
+
+#ifdef EFIVAR_NO_ERROR_MESSAGES
+static const bool format_messages = false;
+#else
+static bool format_messages = true;
+#endif
+
+static void
+error_table_key_init(void)
+{
+	error_table_key_valid = !pthread_key_create(&error_table_key, free);
+}
+
+static error_table_t *
+get_error_table(void)
+{
+	if (error_table)
+		return error_table;
+
+	error_table = calloc(1, sizeof(*error_table));
+	if (!error_table)
+		return NULL;
+
+	/* a thread's table is freed when it exits */
+	pthread_once(&error_table_once, error_table_key_init);
+	if (error_table_key_valid)
+		pthread_setspecific(error_table_key, error_table);
+	return error_table;
+}
+
+static void
+copy_truncated(char *dst, size_t size, const char *src)
+{
+	size_t len = strnlen(src, size - 1);
+
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
 
 int PUBLIC NONNULL(2, 3, 4, 5, 6)
 efi_error_get(unsigned int n,
@@ -45,39 +113,26 @@ efi_error_get(unsigned int n,
 	      int *error
 	      )
 {
+	error_table_entry *et;
+
 	if (!filename || !function || !line || !message || !error) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (n >= current)
+	if (!error_table || n >= error_table->count)
 		return 0;
 
-	*filename = error_table[n].filename;
-	*function = error_table[n].function;
-	*line = error_table[n].line;
-	*message = error_table[n].message;
-	*error = error_table[n].error;
+	et = &error_table->entries[n];
+	*filename = (char *)et->filename;
+	*function = (char *)et->function;
+	*line = et->line;
+	*message = (char *)et->message;
+	*error = et->error;
 
 	return 1;
 }
 
-static inline UNUSED void
-clear_error_entry(error_table_entry *et)
-{
-	if (!et)
-		return;
-
-	if (et->filename)
-		free(et->filename);
-	if (et->function)
-		free(et->function);
-	if (et->message)
-		free(et->message);
-
-	memset(et, '\0', sizeof(*et));
-}
-
 int PUBLIC NONNULL(1, 2, 5) PRINTF(5, 6)
 efi_error_set(const char *filename,
 	      const char *function,
@@ -85,65 +140,47 @@ efi_error_set(const char *filename,
 	      int error,
 	      const char *fmt, ...)
 {
-	error_table_entry et = { 0, };
-	error_table_entry *table;
-	char *tmp;
-
-	table = realloc(error_table, sizeof(et) * (current +1));
-	if (!table)
-		goto err;
-	error_table = table;
-
-	et.error = error;
-	et.line = line;
-	tmp = filename ? strdup(filename) : NULL;
-	if (!tmp)
-		goto err;
-	et.filename = tmp;
-
-	tmp = function ? strdup(function) : NULL;
-	if (!tmp)
-		goto err;
-	et.function = tmp;
-
-	if (fmt) {
-		int rc;
-		int saved_errno;
+	error_table_t *table;
+	error_table_entry *et;
+
+	table = get_error_table();
+	if (!table) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (table->count == ERROR_TABLE_SIZE)
+		return table->count;
+	et = &table->entries[table->count];
+
+	et->error = error;
+	copy_truncated(et->filename, sizeof(et->filename), filename);
+	copy_truncated(et->function, sizeof(et->function), function);
+	et->line = line;
+	et->message = fmt;
+
+	if (fmt && format_messages) {
+		int saved_errno = errno;
 		va_list ap;
 
-		tmp = NULL;
 		va_start(ap, fmt);
-		rc = vasprintf(&tmp, fmt, ap);
-		saved_errno = errno;
+		vsnprintf(et->message_buf, sizeof(et->message_buf), fmt, ap);
 		va_end(ap);
 		errno = saved_errno;
-		if (rc < 0)
-			goto err;
-		et.message = tmp;
+		et->message = et->message_buf;
 	}
 
-	memcpy(&error_table[current], &et, sizeof(et));
-	current += 1;
-	return current;
-err:
-	if (et.filename)
-		free(et.filename);
-	if (et.function)
-		free(et.function);
-	if (et.message)
-		free(et.message);
-	errno = ENOMEM;
-	return -1;
+	table->count += 1;
+	return table->count;
 }
 
 void PUBLIC
 efi_error_pop(void)
 {
-	if (current <= 0)
+	if (!error_table || error_table->count == 0)
 		return;
 
-	current -= 1;
-	clear_error_entry(&error_table[current]);
+	error_table->count -= 1;
 }
 
 static int efi_verbose;
@@ -161,12 +198,152 @@ efi_set_loglevel(int level)
 }
 
 #ifdef HAVE_GLIBC
+/*
+ * Where debug output goes once it's been formatted.  The strace sink is
+ * the original behavior: everything goes out 32 bytes at a time, either
+ * to the error log if it's verbose enough or to /dev/null, so it's
+ * readable in strace output even when nobody asked for it.  The buffered
+ * sink drops what isn't verbose enough and batches the rest into large
+ * writes, and the binary sink batches every line, whatever its level, as
+ * an efi_log_record_t.  Batches go out when the buffer fills and when the
+ * sink is changed or the library is unloaded.
+ */
+#define LOGBUF_SIZE	65536
+
+static efi_log_sink_t log_sink = EFI_LOG_SINK_STRACE;
+static int log_sink_fd = -1;
+static bool log_sink_fd_owned;
+static uint8_t logbuf[LOGBUF_SIZE]
+	__attribute__((__aligned__(__alignof__(efi_log_record_t))));
+static size_t logbuf_len;
+static ssize_t logbuf_record = -1;
+
+static void
+logbuf_flush(void)
+{
+	FILE *log = efi_errlog ? efi_errlog : stderr;
+	size_t len = logbuf_record >= 0 ? (size_t)logbuf_record : logbuf_len;
+	size_t pos = 0;
+
+	if (log_sink == EFI_LOG_SINK_BUFFERED) {
+		if (len)
+			fwrite(logbuf, 1, len, log);
+		fflush(log);
+	} else {
+		int fd = log_sink_fd >= 0 ? log_sink_fd : fileno(log);
+
+		while (pos < len) {
+			ssize_t sz = write(fd, logbuf + pos, len - pos);
+
+			if (sz < 0 && errno == EINTR)
+				continue;
+			if (sz <= 0)
+				break;
+			pos += sz;
+		}
+	}
+
+	/* a record that's still being written moves to the front */
+	memmove(logbuf, logbuf + len, logbuf_len - len);
+	logbuf_len -= len;
+	if (logbuf_record >= 0)
+		logbuf_record = 0;
+}
+
+static void
+logbuf_end_record(bool truncated)
+{
+	efi_log_record_t *rec = (efi_log_record_t *)(logbuf + logbuf_record);
+
+	rec->size = logbuf_len - logbuf_record;
+	if (truncated)
+		rec->flags |= EFI_LOG_RECORD_TRUNCATED;
+	logbuf_record = -1;
+
+	/* the next one starts aligned */
+	while (logbuf_len % __alignof__(efi_log_record_t))
+		logbuf[logbuf_len++] = '\0';
+	if (logbuf_len > LOGBUF_SIZE - sizeof(*rec))
+		logbuf_flush();
+}
+
+static void
+logbuf_add_records(const char *buf, size_t size)
+{
+	size_t pos = 0;
+
+	while (pos < size) {
+		const char *nl;
+		size_t len;
+
+		if (logbuf_record < 0) {
+			struct timespec ts;
+			efi_log_record_t *rec;
+
+			if (logbuf_len + sizeof(*rec) > LOGBUF_SIZE)
+				logbuf_flush();
+			clock_gettime(CLOCK_REALTIME, &ts);
+			rec = (efi_log_record_t *)(logbuf + logbuf_len);
+			memset(rec, 0, sizeof(*rec));
+			rec->level = log_level;
+			rec->tid = gettid();
+			rec->timestamp = (uint64_t)ts.tv_sec * 1000000000
+					 + ts.tv_nsec;
+			logbuf_record = logbuf_len;
+			logbuf_len += sizeof(*rec);
+		}
+
+		nl = memchr(buf + pos, '\n', size - pos);
+		len = (nl ? (size_t)(nl - buf) : size) - pos;
+		if (logbuf_len + len > LOGBUF_SIZE) {
+			if (logbuf_record > 0)
+				logbuf_flush();
+			if (logbuf_len + len > LOGBUF_SIZE) {
+				/* one line the size of the buffer */
+				len = LOGBUF_SIZE - logbuf_len;
+				memcpy(logbuf + logbuf_len, buf + pos, len);
+				logbuf_len += len;
+				logbuf_end_record(true);
+				pos += len;
+				continue;
+			}
+		}
+		memcpy(logbuf + logbuf_len, buf + pos, len);
+		logbuf_len += len;
+		pos += len;
+		if (nl) {
+			logbuf_end_record(false);
+			pos += 1;
+		}
+	}
+}
+
 static ssize_t
 dbglog_write(void *cookie, const char *buf, size_t size)
 {
 	FILE *log = efi_errlog ? efi_errlog : stderr;
 	ssize_t ret = 0;
 
+	if (log_sink == EFI_LOG_SINK_BINARY) {
+		logbuf_add_records(buf, size);
+		return size;
+	}
+
+	if (log_sink == EFI_LOG_SINK_BUFFERED) {
+		if (efi_get_verbose() < log_level)
+			return size;
+		while ((size_t)ret < size) {
+			size_t sz = MIN(size - ret, LOGBUF_SIZE - logbuf_len);
+
+			memcpy(logbuf + logbuf_len, buf + ret, sz);
+			logbuf_len += sz;
+			ret += sz;
+			if (logbuf_len == LOGBUF_SIZE)
+				logbuf_flush();
+		}
+		return ret;
+	}
+
 	while (ret < (ssize_t)size) {
 		/*
 		 * This is limited to 32 characters per write because if
@@ -197,6 +374,55 @@ dbglog_write(void *cookie, const char *buf, size_t size)
 	return ret;
 }
 
+/*
+ * Push out whatever the current sink is holding on to; anything still in
+ * the FILE's own buffer has to be flushed first.
+ */
+static void
+log_sink_finish(void)
+{
+	if (logbuf_record >= 0)
+		logbuf_end_record(true);
+	if (logbuf_len)
+		logbuf_flush();
+	if (log_sink_fd_owned)
+		close(log_sink_fd);
+	log_sink_fd = -1;
+	log_sink_fd_owned = false;
+}
+#endif
+
+int PUBLIC
+efi_set_log_sink(efi_log_sink_t sink, int fd)
+{
+#ifdef HAVE_GLIBC
+	if (sink != EFI_LOG_SINK_STRACE && sink != EFI_LOG_SINK_BUFFERED &&
+	    sink != EFI_LOG_SINK_BINARY) {
+		errno = EINVAL;
+		efi_error("invalid log sink %d", sink);
+		return -1;
+	}
+
+	if (efi_dbglog) {
+		flockfile(efi_dbglog);
+		fflush(efi_dbglog);
+	}
+	log_sink_finish();
+	log_sink = sink;
+	log_sink_fd = fd;
+	if (efi_dbglog)
+		funlockfile(efi_dbglog);
+	return 0;
+#else
+	(void)sink;
+	(void)fd;
+	errno = ENOSYS;
+	efi_error("log sinks are not implemented");
+	return -1;
+#endif
+}
+
+#ifdef HAVE_GLIBC
 static int
 dbglog_seek(void *cookie UNUSED, off64_t *offset, int whence)
 {
@@ -213,6 +439,7 @@ dbglog_seek(void *cookie UNUSED, off64_t *offset, int whence)
 static int
 dbglog_close(void *cookie UNUSED)
 {
+	log_sink_finish();
 	if (efi_dbglog_fd >= 0) {
 		close(efi_dbglog_fd);
 		efi_dbglog_fd = -1;
@@ -231,31 +458,61 @@ dbglog_close(void *cookie UNUSED)
 void PUBLIC
 efi_error_clear(void)
 {
-	if (error_table) {
-		for (unsigned int i = 0; i < current; i++) {
-			error_table_entry *et = &error_table[i];
-
-			clear_error_entry(et);
-		}
-		free(error_table);
-	}
-	error_table = NULL;
-	current = 0;
+	if (error_table)
+		error_table->count = 0;
 }
 
 void DESTRUCTOR
 efi_error_fini(void)
 {
-	efi_error_clear();
+	if (error_table_key_valid) {
+		pthread_key_delete(error_table_key);
+		error_table_key_valid = false;
+	}
+	free(error_table);
+	error_table = NULL;
 	if (efi_dbglog) {
 		fclose(efi_dbglog);
 		efi_dbglog = NULL;
 	}
 }
 
+#ifdef HAVE_GLIBC
+/*
+ * LIBEFIVAR_LOG=strace, buffered, or binary:<path>, to pick a sink
+ * without the program having to know about them.
+ */
+static void
+log_sink_from_env(void)
+{
+	char *sink = getenv("LIBEFIVAR_LOG");
+
+	if (!sink)
+		return;
+
+	if (!strcmp(sink, "buffered")) {
+		log_sink = EFI_LOG_SINK_BUFFERED;
+	} else if (!strncmp(sink, "binary:", 7) && sink[7]) {
+		int fd = open(sink + 7, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,
+			      0600);
+		if (fd < 0)
+			return;
+		log_sink = EFI_LOG_SINK_BINARY;
+		log_sink_fd = fd;
+		log_sink_fd_owned = true;
+	}
+}
+#endif
+
 static void CONSTRUCTOR
 efi_error_init(void)
 {
+#ifndef EFIVAR_NO_ERROR_MESSAGES
+	char *messages = getenv("LIBEFIVAR_ERROR_MESSAGES");
+
+	if (messages && !strcmp(messages, "0"))
+		format_messages = false;
+#endif
 #ifdef HAVE_GLIBC
 	ssize_t bytes;
 	cookie_io_functions_t io_funcs = {
@@ -273,6 +530,8 @@ efi_error_init(void)
 		efi_dbglog_cookie = 0;
 
 	efi_dbglog = fopencookie((void *)efi_dbglog_cookie, "a", io_funcs);
+
+	log_sink_from_env();
 #endif
 }
 
@@ -285,6 +544,15 @@ efi_get_logfile(void)
 void PUBLIC
 efi_set_verbose(int verbosity, FILE *errlog)
 {
+#ifdef HAVE_GLIBC
+	if (log_sink == EFI_LOG_SINK_BUFFERED && efi_dbglog) {
+		flockfile(efi_dbglog);
+		fflush(efi_dbglog);
+		if (logbuf_len)
+			logbuf_flush();
+		funlockfile(efi_dbglog);
+	}
+#endif
 	efi_verbose = verbosity;
 	if (errlog)
 		efi_errlog = errlog;
@@ -33,8 +33,29 @@ struct esl_iter {
 
 	size_t nmemb;
 	unsigned int i;
+
+	/*
+	 * set once a list's header proves all nmemb of its entries are in
+	 * bounds, so we can just step through them
+	 */
+	bool fast;
+	size_t ss;
+	efi_guid_t type;
+
+	/* only used by iterators from esl_iter_new_fd() */
+	int fd;
+	off_t offset;
+	uint8_t *buf;
+	size_t bufsz;
+	efi_signature_list_t esl;
 };
 
+/*
+ * Streaming iterators only ever hold one signature (or one list's header)
+ * at a time, and anything bigger than this is garbage anyway.
+ */
+#define ESL_ITER_FD_MAX_CHUNK	(1024 * 1024)
+
 int NONNULL(1, 2)
 esl_iter_new(esl_iter **iter, uint8_t *buf, size_t len)
 {
@@ -63,10 +84,161 @@ esl_iter_new(esl_iter **iter, uint8_t *buf, size_t len)
 	}
 
 	(*iter)->i = -1;
+	(*iter)->fd = -1;
+
+	return 0;
+}
+
+int NONNULL(1)
+esl_iter_new_fd(esl_iter **iter, int fd)
+{
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	*iter = calloc(1, sizeof(esl_iter));
+	if (!*iter) {
+		efi_error("memory allocation failed for %zd bytes", sizeof(esl_iter));
+		return -1;
+	}
+	(*iter)->fd = fd;
+
+	return 0;
+}
+
+/*
+ * read exactly len bytes, unless we hit the end of the file first; returns
+ * how many we got, or -1 on error
+ */
+static ssize_t
+esl_iter_fd_read(esl_iter *iter, void *buf, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len) {
+		ssize_t rc = read(iter->fd, (uint8_t *)buf + pos, len - pos);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			efi_error("could not read security database");
+			return -1;
+		}
+		if (rc == 0)
+			break;
+		pos += rc;
+	}
+	iter->offset += pos;
+	return pos;
+}
+
+static int
+esl_iter_fd_fill(esl_iter *iter, size_t len)
+{
+	ssize_t rc;
+
+	if (len > ESL_ITER_FD_MAX_CHUNK) {
+		efi_error("EFI_SIGNATURE_LIST at 0x%jx has a %zd byte element",
+			  (intmax_t)iter->offset, len);
+		errno = EINVAL;
+		return -1;
+	}
+	if (len > iter->bufsz) {
+		uint8_t *buf = realloc(iter->buf, len);
+
+		if (!buf) {
+			efi_error("memory allocation failed for %zd bytes", len);
+			return -1;
+		}
+		iter->buf = buf;
+		iter->bufsz = len;
+	}
 
+	rc = esl_iter_fd_read(iter, iter->buf, len);
+	if (rc < 0)
+		return -1;
+	if ((size_t)rc < len) {
+		efi_error("EFI_SIGNATURE_LIST is truncated at 0x%jx",
+			  (intmax_t)iter->offset);
+		errno = EINVAL;
+		return -1;
+	}
 	return 0;
 }
 
+/*
+ * The same thing esl_iter_next() does, but reading each list header and
+ * each signature from the file as we get to it.  There's no going back to
+ * fix a list's size up, so malformed lists are just errors, and they're
+ * EINVAL rather than EOVERFLOW so nobody tries.
+ */
+static esl_iter_status_t
+esl_iter_fd_next(esl_iter *iter, efi_guid_t *type, efi_guid_t *owner,
+		 uint8_t **data, size_t *len)
+{
+	static const efi_signature_list_t zero_esl;
+	esl_iter_status_t status = ESL_ITER_NEW_DATA;
+	efi_signature_list_t *esl = &iter->esl;
+	efi_signature_data_t *esd;
+
+	iter->line += 1;
+
+	while (iter->i == iter->nmemb) {
+		size_t listsz;
+		ssize_t rc;
+
+		rc = esl_iter_fd_read(iter, esl, sizeof(*esl));
+		if (rc < 0)
+			return ESL_ITER_ERROR;
+		/* zeros past the last list are the end, same as for buffers */
+		if (rc == 0 || ((size_t)rc == sizeof(*esl) &&
+				!memcmp(esl, &zero_esl, sizeof(*esl))))
+			return ESL_ITER_DONE;
+		if ((size_t)rc < sizeof(*esl)) {
+			efi_error("EFI_SIGNATURE_LIST is truncated at 0x%jx",
+				  (intmax_t)iter->offset);
+			errno = EINVAL;
+			return ESL_ITER_ERROR;
+		}
+
+		listsz = esl->signature_list_size;
+		debug("list size:%"PRIu32" header size:%"PRIu32" data size:%"PRIu32,
+		      esl->signature_list_size, esl->signature_header_size,
+		      esl->signature_size);
+		if (listsz < sizeof(*esl) + esl->signature_header_size ||
+		    esl->signature_size <= sizeof(efi_guid_t) ||
+		    (listsz - sizeof(*esl) - esl->signature_header_size)
+		    % esl->signature_size != 0) {
+			efi_error("EFI_SIGNATURE_LIST at 0x%jx is malformed",
+				  (intmax_t)(iter->offset - sizeof(*esl)));
+			errno = EINVAL;
+			return ESL_ITER_ERROR;
+		}
+
+		if (esl->signature_header_size &&
+		    esl_iter_fd_fill(iter, esl->signature_header_size) < 0)
+			return ESL_ITER_ERROR;
+
+		iter->i = 0;
+		iter->nmemb = (listsz - sizeof(*esl) - esl->signature_header_size)
+			      / esl->signature_size;
+		debug("iter->nmemb:%zd", iter->nmemb);
+		status = ESL_ITER_NEW_LIST;
+	}
+
+	if (esl_iter_fd_fill(iter, esl->signature_size) < 0)
+		return ESL_ITER_ERROR;
+	iter->i += 1;
+
+	esd = (efi_signature_data_t *)iter->buf;
+	*type = esl->signature_type;
+	*owner = esd->signature_owner;
+	*data = esd->signature_data;
+	*len = esl->signature_size - sizeof(esd->signature_owner);
+	return status;
+}
+
 int NONNULL(1)
 esl_iter_end(esl_iter *iter)
 {
@@ -76,6 +248,7 @@ esl_iter_end(esl_iter *iter)
 	}
 	if (iter->iter)
 		esl_list_iter_end(iter->iter);
+	free(iter->buf);
 	free(iter);
 	return 0;
 }
@@ -95,6 +268,9 @@ esl_iter_next_with_size_correction(esl_iter *iter, efi_guid_t *type,
 		return -EINVAL;
 	}
 
+	if (iter->fd >= 0)
+		return esl_iter_fd_next(iter, type, owner, data, len);
+
 	if (iter->iter == NULL) {
 		efi_error("iter->iter is NULL");
 		errno = EINVAL;
@@ -105,6 +281,16 @@ esl_iter_next_with_size_correction(esl_iter *iter, efi_guid_t *type,
 
 	iter->i += 1;
 
+	if (iter->i != iter->nmemb && iter->fast) {
+		iter->esd = (efi_signature_data_t *)((uint8_t *)iter->esd
+						     + iter->ss);
+		*type = iter->type;
+		*owner = iter->esd->signature_owner;
+		*data = iter->esd->signature_data;
+		*len = iter->ss - sizeof(iter->esd->signature_owner);
+		return status;
+	}
+
 	if (iter->i == iter->nmemb) {
 		debug("Getting next efi_signature_data_t (correct_size:%d)", correct_size);
 		iter->i = 0;
@@ -170,6 +356,16 @@ esl_iter_next_with_size_correction(esl_iter *iter, efi_guid_t *type,
 
 		iter->nmemb = (sls - sizeof(efi_signature_list_t) - slh) / ss;
 		debug("iter->nmemb:%zd", iter->nmemb);
+
+		/*
+		 * esl_list_iter_next() has made sure the list fits in the
+		 * buffer, so if its header does too, so do all its entries.
+		 */
+		iter->fast = iter->nmemb > 0 &&
+			     sls >= sizeof(efi_signature_list_t) + slh &&
+			     ss >= sizeof(efi_guid_t);
+		iter->ss = ss;
+		iter->type = *type;
 	} else {
 		uint8_t *buf = NULL;
 		size_t bufsz;
@@ -261,6 +457,9 @@ struct esl_list_iter {
 intptr_t NONNULL(1)
 esd_get_esl_offset(esl_iter *iter)
 {
+	if (iter->fd >= 0)
+		return iter->offset;
+
 	uint64_t esd = (uintptr_t)iter->esd;
 	uint64_t esl = (uintptr_t)iter->iter->buf;
 
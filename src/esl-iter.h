@@ -23,6 +23,18 @@ typedef struct esl_iter esl_iter;
 extern int esl_iter_new(esl_iter **iter, uint8_t *buf, size_t len)
         __attribute__((__nonnull__(1, 2)));
 
+/*
+ * esl_iter_new_fd - create a new iterator that reads an efi security
+ * database from fd as it goes, holding no more than one signature of it
+ * at a time.
+ * iter: pointer to a NULL esl_iter pointer.
+ * fd: where to read the security database from; the caller closes it.
+ *
+ * returns 0 on success, negative on error, sets errno.
+ */
+extern int esl_iter_new_fd(esl_iter **iter, int fd)
+        __attribute__((__nonnull__(1)));
+
 /*
  * esl_iter_end - destroy the iterator created by esl_iter_new()
  * iter: the iterator being destroyed
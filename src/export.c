@@ -6,13 +6,26 @@
 
 #include "fix_coverity.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "efivar.h"
 
 #define EFIVAR_MAGIC 0xf3df1597u
+#define EFIVAR_ARCHIVE_MAGIC 0xf3df1598u
+#define EFIVAR_ARCHIVE_INDEX_MAGIC 0xf3df1599u
+
+/*
+ * No real variable comes near these, and they keep a corrupt record from
+ * costing us gigabytes before we've read enough to know it's corrupt.
+ */
+#define EFIVAR_ARCHIVE_MAX_NAME_LEN ((NAME_MAX + 1) * sizeof(uint16_t))
+#define EFIVAR_ARCHIVE_MAX_DATA_LEN (64 * 1024 * 1024)
 
 #define ATTRS_UNSET 0xa5a5a5a5a5a5a5a5
 #define ATTRS_MASK 0xffffffff
@@ -46,11 +59,42 @@
 #error wtf
 #endif
 
-ssize_t NONNULL(1, 3)
-efi_variable_import_dmpstore(uint8_t *data, size_t size,
-			     efi_variable_t **var_out)
+/*
+ * Where the pieces of one exported variable are in a buffer, once its
+ * sizes and crc have been checked.
+ */
+struct export_record {
+	uint64_t attrs;
+	const uint8_t *guid;
+	const uint8_t *name;		/* UCS-2 */
+	uint32_t namesz;		/* in bytes */
+	const uint8_t *data;
+	uint32_t datasz;
+	size_t size;			/* of the whole record */
+};
+
+static int
+check_record_crc(const uint8_t *data, size_t size)
+{
+	uint32_t crc;
+
+	crc = efi_crc32(data, size - sizeof(uint32_t));
+	debug("efi_crc32(%p, %zu) -> 0x%"PRIx32", expected 0x%"PRIx32,
+	      data, size - sizeof(uint32_t), crc,
+	      *(uint32_t*)(data + size - sizeof(uint32_t)));
+
+	if (memcmp(data + size - sizeof(uint32_t), &crc, sizeof(uint32_t))) {
+		errno = EINVAL;
+		efi_error("crc32 did not match");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+parse_dmpstore_record(const uint8_t *data, size_t size,
+		      struct export_record *rec)
 {
-	efi_variable_t var;
 	uint32_t namesz;
 	uint32_t datasz;
 	size_t min = sizeof (uint32_t)		/* name size */
@@ -65,9 +109,8 @@ efi_variable_import_dmpstore(uint8_t *data, size_t size,
 		  + sizeof (efi_guid_t)		/* guid */
 		  + sizeof (uint32_t)		/* attr */
 		  + sizeof (uint32_t);		/* crc32 */
-	uint8_t *ptr = data;
-	uint32_t crc;
-	int saved_errno;
+	const uint8_t *ptr = data;
+	uint32_t attrs;
 
 	if (size <= min) {
 etoosmall:
@@ -77,8 +120,6 @@ etoosmall:
 		return -1;
 	}
 
-	memset(&var, 0, sizeof(var));
-
 	namesz = *(uint32_t *)ptr;
 	debug("namesz:%"PRIu32, namesz);
 	ptr += sizeof(uint32_t);
@@ -125,70 +166,30 @@ overflow:
 		return -1;
 	}
 
-	crc = efi_crc32(data, size - sizeof(uint32_t));
-	debug("efi_crc32(%p, %zu) -> 0x%"PRIx32", expected 0x%"PRIx32,
-	      data, size - sizeof(uint32_t), crc,
-	      *(uint32_t*)(data + size - sizeof(uint32_t)));
-
-	if (memcmp(data + size - sizeof(uint32_t),
-		    &crc, sizeof(uint32_t))) {
-		errno = EINVAL;
-		efi_error("crc32 did not match");
+	if (check_record_crc(data, size) < 0)
 		return -1;
-	}
 
-	var.name = ucs2_to_utf8(ptr, -1);
-	if (!var.name)
-		goto oom;
+	rec->name = ptr;
+	rec->namesz = namesz;
 	ptr += namesz;
 
-	var.guid = malloc(sizeof (efi_guid_t));
-	if (!var.guid)
-		goto oom;
-	memcpy(var.guid, ptr, sizeof (efi_guid_t));
+	rec->guid = ptr;
 	ptr += sizeof (efi_guid_t);
 
-	var.attrs = *(uint32_t *)ptr;
+	memcpy(&attrs, ptr, sizeof(attrs));
+	rec->attrs = attrs;
 	ptr += sizeof(uint32_t);
 
-	var.data_size = datasz;
-	var.data = malloc(datasz);
-	if (!var.data) {
-		efi_error("Could not allocate %"PRIu32" bytes", datasz);
-		goto oom;
-	}
-	memcpy(var.data, ptr, datasz);
-
-	if (!*var_out) {
-		*var_out =malloc(sizeof (var));
-		if (!*var_out)
-			goto oom;
-		memcpy(*var_out, &var, sizeof (var));
-	} else {
-		return -1;
-	}
-	return size;
-oom:
-	saved_errno = errno;
-
-	if (var.guid)
-		free(var.guid);
-
-	if (var.name)
-		free(var.name);
-
-	if (var.data)
-		free(var.data);
-
-	errno = saved_errno;
-	efi_error("Could not allocate memory");
-	return -1;
+	rec->data = ptr;
+	rec->datasz = datasz;
+	rec->size = size;
+	return 0;
 }
 
-ssize_t NONNULL(1, 3)
-efi_variable_import_efivar(uint8_t *data, size_t datasz, efi_variable_t **var_out)
+static int
+parse_efivar_record(const uint8_t *data, size_t datasz,
+		    struct export_record *rec)
 {
-	efi_variable_t var;
 	size_t min = sizeof (uint32_t) * 2	/* magic */
 		   + sizeof (uint32_t)		/* version */
 		   + sizeof (uint64_t)		/* attr */
@@ -197,9 +198,15 @@ efi_variable_import_efivar(uint8_t *data, size_t datasz, efi_variable_t **var_ou
 		   + sizeof (uint16_t)		/* two bytes of name */
 		   + 1				/* one byte of data */
 		   + 4;				/* crc32 */
-	uint32_t crc;
-	uint8_t *ptr = data;
+	size_t recsz = sizeof (uint32_t)	/* magic */
+		     + sizeof (uint32_t)	/* version */
+		     + sizeof (uint64_t)	/* attr */
+		     + sizeof (efi_guid_t)	/* guid */
+		     + sizeof (uint32_t) * 2	/* name_len and data_len */
+		     + sizeof (uint32_t);	/* crc32 */
+	const uint8_t *ptr = data;
 	uint32_t magic = EFIVAR_MAGIC;
+	uint32_t name_len, data_len;
 	int test;
 
 	errno = EINVAL;
@@ -217,97 +224,123 @@ efi_variable_import_efivar(uint8_t *data, size_t datasz, efi_variable_t **var_ou
 	ptr += sizeof (uint32_t);
 
 	debug("test version");
-	if (*(uint32_t *)ptr == 1) {
-		ptr += sizeof (uint32_t);
-		debug("version 1");
+	if (*(uint32_t *)ptr != 1)
+		return -1;
+	ptr += sizeof (uint32_t);
+	debug("version 1");
 
-		var.attrs = *(uint64_t *)ptr;
-		ptr += sizeof (uint64_t);
-		debug("var.attrs:0x%08"PRIx64, var.attrs);
+	memcpy(&rec->attrs, ptr, sizeof(rec->attrs));
+	ptr += sizeof (uint64_t);
+	debug("attrs:0x%08"PRIx64, rec->attrs);
 
-		var.guid = malloc(sizeof (efi_guid_t));
-		if (!var.guid)
-			return -1;
-		*var.guid = *(efi_guid_t *)ptr;
-		ptr += sizeof (efi_guid_t);
-		debug("var.guid:"GUID_FORMAT, GUID_FORMAT_ARGS(var.guid));
-
-		uint32_t name_len = *(uint32_t *)ptr;
-		ptr += sizeof (uint32_t);
-		debug("name_len:%"PRIu32, name_len);
-
-		uint32_t data_len = *(uint32_t *)ptr;
-		ptr += sizeof (uint32_t);
-		debug("data_len:%"PRIu32, data_len);
-
-		min -= 3;
-		min += name_len;
-		min += data_len;
-
-		if (name_len < 2 ||
-		    name_len > (datasz - data_len) ||
-		    data_len < 1 ||
-		    data_len > (datasz - name_len)) {
-			int saved_errno = errno;
-			free(var.guid);
-			errno = saved_errno;
-			return -1;
-		}
+	rec->guid = ptr;
+	ptr += sizeof (efi_guid_t);
 
-		crc = efi_crc32(data, datasz - sizeof(uint32_t));
-		debug("efi_crc32(%p, %zu) -> 0x%"PRIx32", expected 0x%"PRIx32,
-		      data, datasz - sizeof(uint32_t), crc,
-		      *(uint32_t*)(data + datasz - sizeof(uint32_t)));
+	name_len = *(uint32_t *)ptr;
+	ptr += sizeof (uint32_t);
+	debug("name_len:%"PRIu32, name_len);
 
-		if (memcmp(data + datasz - sizeof (uint32_t), &crc,
-			   sizeof (uint32_t))) {
-			free(var.guid);
-			errno = EINVAL;
-			efi_error("crc32 did not match");
-			return -1;
-		}
+	data_len = *(uint32_t *)ptr;
+	ptr += sizeof (uint32_t);
+	debug("data_len:%"PRIu32, data_len);
 
-		var.name = calloc(1, name_len + 1);
-		if (!var.name) {
-			int saved_errno = errno;
-			free(var.guid);
-			errno = saved_errno;
-			return -1;
-		}
+	if (name_len < 2 || data_len < 1 ||
+	    ADD(recsz, name_len, &recsz) || ADD(recsz, data_len, &recsz) ||
+	    recsz > datasz) {
+		errno = EINVAL;
+		efi_error("name_len or data_len is invalid");
+		return -1;
+	}
 
-		uint16_t *wname = (uint16_t *)ptr;
-		for (uint32_t i = 0; i < name_len; i++)
-			var.name[i] = wname[i] & 0xff;
-		ptr += name_len;
-		debug("name:%s", var.name);
-
-		var.data_size = data_len;
-		var.data = malloc(data_len);
-		if (!var.data) {
-			int saved_errno = errno;
-			free(var.guid);
-			free(var.name);
-			errno = saved_errno;
-			return -1;
-		}
-		memcpy(var.data, ptr, data_len);
-
-		if (!*var_out) {
-			*var_out =malloc(sizeof (var));
-			if (!*var_out) {
-				int saved_errno = errno;
-				free(var.guid);
-				free(var.name);
-				free(var.data);
-				errno = saved_errno;
-				return -1;
-			}
+	if (check_record_crc(data, recsz) < 0)
+		return -1;
+
+	rec->name = ptr;
+	rec->namesz = name_len;
+	ptr += name_len;
+
+	rec->data = ptr;
+	rec->datasz = data_len;
+	rec->size = recsz;
+	return 0;
+}
+
+/*
+ * Make a variable out of rec.  Imports copy everything; views keep
+ * pointing at the data and put the guid in the same allocation as the
+ * efi_variable_t, so all they allocate apart from that is the UTF-8 name.
+ */
+static ssize_t
+import_record(const struct export_record *rec, efi_variable_t **var_out,
+	      bool view)
+{
+	efi_variable_t *var;
+	unsigned char *name;
+
+	name = ucs2_to_utf8(rec->name, rec->namesz / sizeof(uint16_t));
+	if (!name)
+		goto oom;
+
+	if (view) {
+		var = calloc(1, sizeof(*var) + sizeof(efi_guid_t));
+		if (!var)
+			goto oom;
+		var->guid = (efi_guid_t *)(var + 1);
+		var->data = (uint8_t *)rec->data;
+		var->borrowed = true;
+	} else {
+		var = calloc(1, sizeof(*var));
+		if (!var)
+			goto oom;
+		var->guid = malloc(sizeof(efi_guid_t));
+		var->data = malloc(rec->datasz);
+		if (!var->guid || !var->data) {
+			free(var->guid);
+			free(var->data);
+			free(var);
+			goto oom;
 		}
-		memcpy(*var_out, &var, sizeof (var));
+		memcpy(var->data, rec->data, rec->datasz);
+	}
+	memcpy(var->guid, rec->guid, sizeof(efi_guid_t));
+	var->name = name;
+	var->attrs = rec->attrs;
+	var->data_size = rec->datasz;
+	debug("var.guid:"GUID_FORMAT, GUID_FORMAT_ARGS(var->guid));
+	debug("name:%s", var->name);
+
+	if (*var_out) {
+		memcpy(*var_out, var, sizeof(*var));
+		free(var);
 	} else {
-		return -1;
+		*var_out = var;
 	}
-	return min;
+	return rec->size;
+oom:
+	free(name);
+	efi_error("Could not allocate memory");
+	return -1;
+}
+
+ssize_t NONNULL(1, 3)
+efi_variable_import_dmpstore(uint8_t *data, size_t size,
+			     efi_variable_t **var_out)
+{
+	struct export_record rec;
+
+	if (parse_dmpstore_record(data, size, &rec) < 0)
+		return -1;
+	return import_record(&rec, var_out, false);
+}
+
+ssize_t NONNULL(1, 3)
+efi_variable_import_efivar(uint8_t *data, size_t datasz, efi_variable_t **var_out)
+{
+	struct export_record rec;
+
+	if (parse_efivar_record(data, datasz, &rec) < 0)
+		return -1;
+	return import_record(&rec, var_out, false);
 }
 
 ssize_t NONNULL(1, 3) PUBLIC
@@ -323,6 +356,44 @@ efi_variable_import(uint8_t *data, size_t size, efi_variable_t **var_out)
 	return rc;
 }
 
+ssize_t NONNULL(1, 3) PUBLIC
+efi_variable_import_view(const uint8_t *data, size_t size,
+			 efi_variable_t **var_out)
+{
+	struct export_record rec;
+
+	*var_out = NULL;
+	if (parse_efivar_record(data, size, &rec) < 0 &&
+	    parse_dmpstore_record(data, size, &rec) < 0)
+		return -1;
+	return import_record(&rec, var_out, true);
+}
+
+int NONNULL(1) PUBLIC
+efi_variable_own(efi_variable_t *var)
+{
+	efi_guid_t *guid;
+	uint8_t *data;
+
+	if (!var->borrowed)
+		return 0;
+
+	guid = malloc(sizeof(*guid));
+	data = malloc(var->data_size ? var->data_size : 1);
+	if (!guid || !data) {
+		free(guid);
+		free(data);
+		efi_error("Could not allocate memory");
+		return -1;
+	}
+	memcpy(guid, var->guid, sizeof(*guid));
+	memcpy(data, var->data, var->data_size);
+	var->guid = guid;
+	var->data = data;
+	var->borrowed = false;
+	return 0;
+}
+
 ssize_t NONNULL(1) PUBLIC
 efi_variable_export_dmpstore(efi_variable_t *var, uint8_t *data, size_t datasz)
 {
@@ -591,6 +662,508 @@ overflow:
 	return needed;
 }
 
+static int
+writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t rc = writev(fd, iov, iovcnt);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			efi_error("writev failed");
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write var to fd in either format in one go: the name is converted once,
+ * the crc is run over the pieces where they are, and it all goes out in
+ * one writev() rather than being assembled in a buffer first.
+ */
+static ssize_t
+variable_export_fd(efi_variable_t *var, int fd, bool dmpstore)
+{
+	uint8_t pre[sizeof(uint32_t) * 2 + sizeof(uint64_t)
+		    + sizeof(efi_guid_t) + sizeof(uint32_t) * 2];
+	uint8_t post[sizeof(efi_guid_t) + sizeof(uint32_t)];
+	uint32_t namesz, datasz, attrs32, crc;
+	struct iovec iov[5];
+	uint16_t *name;
+	ssize_t chars;
+	size_t total = 0;
+	uint8_t *ptr;
+	int iovcnt = 0;
+	int rc;
+
+	if (!var || !var->name || !var->data || !var->guid) {
+		errno = EINVAL;
+		efi_error("var is incomplete");
+		return -1;
+	}
+	if (var->data_size > UINT32_MAX) {
+		errno = EOVERFLOW;
+		efi_error("variable data is too large to export");
+		return -1;
+	}
+	datasz = var->data_size;
+
+	name = calloc(utf8size(var->name, -1), sizeof(uint16_t));
+	if (!name) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	chars = utf8_to_ucs2(name, utf8size(var->name, -1) * sizeof(uint16_t),
+			     true, var->name);
+	if (chars < 0) {
+		free(name);
+		efi_error("UTF-8 to UCS-2 conversion failed");
+		return -1;
+	}
+	namesz = chars * sizeof(uint16_t);
+
+	ptr = pre;
+	if (!dmpstore) {
+		*(uint32_t *)ptr = EFIVAR_MAGIC;
+		ptr += sizeof(uint32_t);
+		*(uint32_t *)ptr = 1;
+		ptr += sizeof(uint32_t);
+		memcpy(ptr, &var->attrs, sizeof(var->attrs));
+		ptr += sizeof(var->attrs);
+		memcpy(ptr, var->guid, sizeof(efi_guid_t));
+		ptr += sizeof(efi_guid_t);
+	}
+	memcpy(ptr, &namesz, sizeof(namesz));
+	ptr += sizeof(namesz);
+	memcpy(ptr, &datasz, sizeof(datasz));
+	ptr += sizeof(datasz);
+
+	iov[iovcnt].iov_base = pre;
+	iov[iovcnt++].iov_len = ptr - pre;
+	iov[iovcnt].iov_base = name;
+	iov[iovcnt++].iov_len = namesz;
+	if (dmpstore) {
+		attrs32 = var->attrs & ATTRS_MASK;
+		memcpy(post, var->guid, sizeof(efi_guid_t));
+		memcpy(post + sizeof(efi_guid_t), &attrs32, sizeof(attrs32));
+		iov[iovcnt].iov_base = post;
+		iov[iovcnt++].iov_len = sizeof(post);
+	}
+	iov[iovcnt].iov_base = var->data;
+	iov[iovcnt++].iov_len = datasz;
+
+	crc = ~0u;
+	for (int i = 0; i < iovcnt; i++) {
+		crc = crc32(iov[i].iov_base, iov[i].iov_len, crc);
+		total += iov[i].iov_len;
+	}
+	crc ^= ~0u;
+	iov[iovcnt].iov_base = &crc;
+	iov[iovcnt++].iov_len = sizeof(crc);
+	total += sizeof(crc);
+
+	rc = writev_all(fd, iov, iovcnt);
+	free(name);
+	if (rc < 0)
+		return -1;
+	return total;
+}
+
+ssize_t NONNULL(1) PUBLIC
+efi_variable_export_fd(efi_variable_t *var, int fd)
+{
+	return variable_export_fd(var, fd, false);
+}
+
+ssize_t NONNULL(1) PUBLIC
+efi_variable_export_dmpstore_fd(efi_variable_t *var, int fd)
+{
+	return variable_export_fd(var, fd, true);
+}
+
+/*
+ * An archive is a whole variable store in one file:
+ * struct {
+ *	uint32_t magic;
+ *	uint32_t version;
+ *	uint8_t records[];	// each one exactly what efi_variable_export()
+ *				// makes, crc32 and all
+ *	struct {
+ *		uint32_t magic;
+ *		uint32_t reserved;
+ *		uint64_t count;
+ *		uint64_t offsets[count];
+ *		uint32_t crc32;
+ *		uint64_t offset;	// of the index itself
+ *	} index;
+ * }
+ *
+ * The index goes at the end so an archive can be written as the variables
+ * are read, and the last eight bytes say where it is for anybody who wants
+ * to seek.  Reading one front to back just checks the index against what
+ * it found, which also catches an archive that got cut short.
+ */
+struct efi_variable_archive {
+	int fd;
+	bool writing;
+	bool done;
+	uint64_t offset;
+	uint64_t size;		// where it ends, or 0 if we can't tell
+	uint64_t *offsets;
+	size_t n_offsets;
+	size_t n_offsets_allocated;
+};
+
+static int
+archive_write(efi_variable_archive_t *archive, const void *buf, size_t size)
+{
+	const uint8_t *pos = buf;
+
+	while (size > 0) {
+		ssize_t rc = write(archive->fd, pos, size);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			efi_error("write failed");
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+		archive->offset += rc;
+	}
+	return 0;
+}
+
+static int
+archive_read(efi_variable_archive_t *archive, void *buf, size_t size)
+{
+	uint8_t *pos = buf;
+
+	while (size > 0) {
+		ssize_t rc = read(archive->fd, pos, size);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			efi_error("read failed");
+			return -1;
+		}
+		if (rc == 0) {
+			errno = EINVAL;
+			efi_error("archive is truncated");
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+		archive->offset += rc;
+	}
+	return 0;
+}
+
+static int
+archive_add_offset(efi_variable_archive_t *archive, uint64_t offset)
+{
+	if (archive->n_offsets == archive->n_offsets_allocated) {
+		size_t n = archive->n_offsets_allocated ?
+			   archive->n_offsets_allocated * 2 : 64;
+		uint64_t *offsets;
+
+		offsets = reallocarray(archive->offsets, n, sizeof(*offsets));
+		if (!offsets) {
+			efi_error("could not allocate memory");
+			return -1;
+		}
+		archive->offsets = offsets;
+		archive->n_offsets_allocated = n;
+	}
+	archive->offsets[archive->n_offsets++] = offset;
+	return 0;
+}
+
+static efi_variable_archive_t *
+archive_new(int fd, bool writing)
+{
+	efi_variable_archive_t *archive;
+
+	archive = calloc(1, sizeof(*archive));
+	if (!archive) {
+		efi_error("could not allocate memory");
+		return NULL;
+	}
+	archive->fd = fd;
+	archive->writing = writing;
+	return archive;
+}
+
+int NONNULL(2) PUBLIC
+efi_variable_archive_create(int fd, efi_variable_archive_t **archivep)
+{
+	efi_variable_archive_t *archive;
+	uint32_t hdr[2] = { EFIVAR_ARCHIVE_MAGIC, 1 };
+
+	archive = archive_new(fd, true);
+	if (!archive)
+		return -1;
+	if (archive_write(archive, hdr, sizeof(hdr)) < 0) {
+		efi_variable_archive_free(archive);
+		return -1;
+	}
+	*archivep = archive;
+	return 0;
+}
+
+int NONNULL(1, 2) PUBLIC
+efi_variable_archive_add(efi_variable_archive_t *archive, efi_variable_t *var)
+{
+	uint64_t offset = archive->offset;
+	ssize_t sz;
+
+	if (!archive->writing || archive->done) {
+		errno = EINVAL;
+		efi_error("archive is not open for writing");
+		return -1;
+	}
+
+	sz = efi_variable_export_fd(var, archive->fd);
+	if (sz < 0)
+		return -1;
+	archive->offset += sz;
+
+	return archive_add_offset(archive, offset);
+}
+
+int NONNULL(1) PUBLIC
+efi_variable_archive_finish(efi_variable_archive_t *archive)
+{
+	uint64_t offset = archive->offset;
+	size_t indexsz;
+	uint8_t *index, *ptr;
+	uint32_t crc;
+	int rc;
+
+	if (!archive->writing || archive->done) {
+		errno = EINVAL;
+		efi_error("archive is not open for writing");
+		return -1;
+	}
+
+	indexsz = sizeof(uint32_t) * 2 + sizeof(uint64_t)
+		  + sizeof(uint64_t) * archive->n_offsets
+		  + sizeof(uint32_t) + sizeof(uint64_t);
+	ptr = index = calloc(1, indexsz);
+	if (!index) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	*(uint32_t *)ptr = EFIVAR_ARCHIVE_INDEX_MAGIC;
+	ptr += sizeof(uint32_t) * 2;
+	*(uint64_t *)ptr = archive->n_offsets;
+	ptr += sizeof(uint64_t);
+	memcpy(ptr, archive->offsets, sizeof(uint64_t) * archive->n_offsets);
+	ptr += sizeof(uint64_t) * archive->n_offsets;
+	crc = efi_crc32(index, ptr - index);
+	memcpy(ptr, &crc, sizeof(crc));
+	ptr += sizeof(crc);
+	memcpy(ptr, &offset, sizeof(offset));
+
+	rc = archive_write(archive, index, indexsz);
+	free(index);
+	if (rc < 0)
+		return -1;
+	archive->done = true;
+	return 0;
+}
+
+int NONNULL(2) PUBLIC
+efi_variable_archive_open(int fd, efi_variable_archive_t **archivep)
+{
+	efi_variable_archive_t *archive;
+	uint32_t hdr[2];
+	struct stat sb;
+	off_t pos;
+
+	archive = archive_new(fd, false);
+	if (!archive)
+		return -1;
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos >= 0 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+	    sb.st_size > pos)
+		archive->size = sb.st_size - pos;
+	if (archive_read(archive, hdr, sizeof(hdr)) < 0)
+		goto err;
+	if (hdr[0] != EFIVAR_ARCHIVE_MAGIC) {
+		errno = EINVAL;
+		efi_error("MAGIC for archive format did not match.");
+		goto err;
+	}
+	if (hdr[1] != 1) {
+		errno = EINVAL;
+		efi_error("unknown archive version %"PRIu32, hdr[1]);
+		goto err;
+	}
+	*archivep = archive;
+	return 0;
+err:
+	efi_variable_archive_free(archive);
+	return -1;
+}
+
+/*
+ * Check the index we've just hit against the records we read before it.
+ */
+static int
+archive_read_index(efi_variable_archive_t *archive)
+{
+	uint64_t offset = archive->offset - sizeof(uint32_t);
+	uint32_t magic = EFIVAR_ARCHIVE_INDEX_MAGIC;
+	size_t indexsz, crcsz;
+	uint8_t *index, *ptr;
+	uint32_t reserved, crc;
+	uint64_t count;
+	int ret = -1;
+
+	if (archive_read(archive, &reserved, sizeof(reserved)) < 0 ||
+	    archive_read(archive, &count, sizeof(count)) < 0)
+		return -1;
+	if (count != archive->n_offsets) {
+		errno = EINVAL;
+		efi_error("archive index has %"PRIu64" entries but %zd were found",
+			  count, archive->n_offsets);
+		return -1;
+	}
+
+	crcsz = sizeof(uint32_t) * 2 + sizeof(uint64_t)
+		+ sizeof(uint64_t) * count;
+	indexsz = crcsz + sizeof(uint32_t) + sizeof(uint64_t);
+	ptr = index = malloc(indexsz);
+	if (!index) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	memcpy(ptr, &magic, sizeof(magic));
+	ptr += sizeof(magic);
+	memcpy(ptr, &reserved, sizeof(reserved));
+	ptr += sizeof(reserved);
+	memcpy(ptr, &count, sizeof(count));
+	ptr += sizeof(count);
+	if (archive_read(archive, ptr, indexsz - (ptr - index)) < 0)
+		goto out;
+
+	crc = efi_crc32(index, crcsz);
+	if (memcmp(&crc, index + crcsz, sizeof(crc)) ||
+	    memcmp(&offset, index + crcsz + sizeof(crc), sizeof(offset)) ||
+	    memcmp(ptr, archive->offsets, sizeof(uint64_t) * count)) {
+		errno = EINVAL;
+		efi_error("archive index does not match its contents");
+		goto out;
+	}
+	archive->done = true;
+	ret = 0;
+out:
+	free(index);
+	return ret;
+}
+
+int NONNULL(1, 2) PUBLIC
+efi_variable_archive_next(efi_variable_archive_t *archive,
+			  efi_variable_t **var)
+{
+	uint8_t hdr[sizeof(uint32_t) * 2 + sizeof(uint64_t) + sizeof(efi_guid_t)
+		    + sizeof(uint32_t) * 2];
+	uint64_t offset = archive->offset;
+	uint32_t name_len, data_len;
+	uint8_t *buf;
+	size_t bufsz;
+	ssize_t rc;
+
+	if (archive->writing) {
+		errno = EINVAL;
+		efi_error("archive is not open for reading");
+		return -1;
+	}
+	if (archive->done)
+		return 0;
+
+	if (archive_read(archive, hdr, sizeof(uint32_t)) < 0)
+		return -1;
+	if (*(uint32_t *)hdr == EFIVAR_ARCHIVE_INDEX_MAGIC)
+		return archive_read_index(archive) < 0 ? -1 : 0;
+	if (*(uint32_t *)hdr != EFIVAR_MAGIC) {
+		errno = EINVAL;
+		efi_error("bad record at offset %"PRIu64, offset);
+		return -1;
+	}
+	if (archive_read(archive, hdr + sizeof(uint32_t),
+			 sizeof(hdr) - sizeof(uint32_t)) < 0)
+		return -1;
+
+	memcpy(&name_len, hdr + sizeof(hdr) - sizeof(uint32_t) * 2,
+	       sizeof(name_len));
+	memcpy(&data_len, hdr + sizeof(hdr) - sizeof(uint32_t),
+	       sizeof(data_len));
+	if (name_len > EFIVAR_ARCHIVE_MAX_NAME_LEN ||
+	    data_len > EFIVAR_ARCHIVE_MAX_DATA_LEN) {
+		errno = EINVAL;
+		efi_error("bad record at offset %"PRIu64, offset);
+		return -1;
+	}
+	if (archive->size &&
+	    (archive->offset > archive->size ||
+	     archive->size - archive->offset <
+	     (uint64_t)name_len + data_len + sizeof(uint32_t))) {
+		errno = EINVAL;
+		efi_error("archive is truncated");
+		return -1;
+	}
+	bufsz = sizeof(hdr) + (size_t)name_len + data_len + sizeof(uint32_t);
+	buf = malloc(bufsz);
+	if (!buf) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	memcpy(buf, hdr, sizeof(hdr));
+	if (archive_read(archive, buf + sizeof(hdr), bufsz - sizeof(hdr)) < 0) {
+		free(buf);
+		return -1;
+	}
+
+	*var = NULL;
+	rc = efi_variable_import_efivar(buf, bufsz, var);
+	free(buf);
+	if (rc < 0) {
+		efi_error("bad record at offset %"PRIu64, offset);
+		return -1;
+	}
+	if (archive_add_offset(archive, offset) < 0) {
+		efi_variable_free(*var, true);
+		*var = NULL;
+		return -1;
+	}
+	return 1;
+}
+
+void PUBLIC
+efi_variable_archive_free(efi_variable_archive_t *archive)
+{
+	if (!archive)
+		return;
+	free(archive->offsets);
+	free(archive);
+}
+
 efi_variable_t PUBLIC *
 efi_variable_alloc(void)
 {
@@ -605,17 +1178,17 @@ efi_variable_alloc(void)
 void PUBLIC
 efi_variable_free(efi_variable_t *var, int free_data)
 {
-	if (!var)
+	if (!var || var->pooled)
 		return;
 
 	if (free_data) {
-		if (var->guid)
+		if (var->guid && !var->borrowed)
 			free(var->guid);
 
 		if (var->name)
 			free(var->name);
 
-		if (var->data && var->data_size)
+		if (var->data && var->data_size && !var->borrowed)
 			free(var->data);
 	}
 
@@ -676,7 +1249,7 @@ efi_variable_set_data(efi_variable_t *var, uint8_t *data, size_t size)
 ssize_t NONNULL(1, 2, 3) PUBLIC
 efi_variable_get_data(efi_variable_t *var, uint8_t **data, size_t *size)
 {
-	if (var->data || !var->data_size) {
+	if (!var->data || !var->data_size) {
 		errno = ENOENT;
 		return -1;
 	}
@@ -727,4 +1300,227 @@ efi_variable_realize(efi_variable_t *var)
 				var->data_size, attrs, 0600);
 }
 
+/*
+ * A pool bump-allocates out of chunks that are only ever released all at
+ * once.  Anything too big to share a chunk gets one to itself, which goes
+ * behind the one being filled so the rest of it isn't wasted.  Resetting
+ * keeps the ordinary chunks around for reuse, so a pool that's reset
+ * between batches settles down to not calling malloc() at all.
+ */
+#define POOL_CHUNK_SIZE	(64 * 1024)
+
+struct pool_chunk {
+	struct pool_chunk *next;
+	size_t size;
+	size_t used;
+	uint8_t data[];
+};
+
+struct efi_variable_pool {
+	struct pool_chunk *chunks;
+	struct pool_chunk *spare;
+};
+
+static void
+free_pool_chunks(struct pool_chunk *chunk)
+{
+	while (chunk) {
+		struct pool_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+}
+
+static void *
+pool_alloc(efi_variable_pool_t *pool, size_t size)
+{
+	struct pool_chunk *chunk = pool->chunks;
+	size_t offset, chunksz;
+
+	if (chunk) {
+		offset = ALIGN_UP(chunk->used, _Alignof(efi_variable_t));
+		if (offset <= chunk->size && chunk->size - offset >= size) {
+			chunk->used = offset + size;
+			return chunk->data + offset;
+		}
+	}
+
+	if (size > POOL_CHUNK_SIZE / 4) {
+		if (ADD(sizeof(*chunk), size, &chunksz)) {
+			errno = EOVERFLOW;
+			efi_error("arithmetic overflow computing allocation size");
+			return NULL;
+		}
+		chunk = malloc(chunksz);
+		if (!chunk) {
+			efi_error("could not allocate %zu bytes", chunksz);
+			return NULL;
+		}
+		chunk->size = size;
+		if (pool->chunks) {
+			chunk->next = pool->chunks->next;
+			pool->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			pool->chunks = chunk;
+		}
+	} else if (pool->spare) {
+		chunk = pool->spare;
+		pool->spare = chunk->next;
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+	} else {
+		chunk = malloc(sizeof(*chunk) + POOL_CHUNK_SIZE);
+		if (!chunk) {
+			efi_error("could not allocate %zu bytes",
+				  sizeof(*chunk) + POOL_CHUNK_SIZE);
+			return NULL;
+		}
+		chunk->size = POOL_CHUNK_SIZE;
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+	}
+	chunk->used = size;
+	return chunk->data;
+}
+
+int NONNULL(1) PUBLIC
+efi_variable_pool_new(efi_variable_pool_t **poolp)
+{
+	efi_variable_pool_t *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	*poolp = pool;
+	return 0;
+}
+
+efi_variable_t NONNULL(1) PUBLIC *
+efi_variable_pool_alloc(efi_variable_pool_t *pool)
+{
+	efi_variable_t *var;
+
+	var = pool_alloc(pool, sizeof(*var));
+	if (!var)
+		return NULL;
+
+	memset(var, 0, sizeof(*var));
+	var->attrs = ATTRS_UNSET;
+	var->pooled = true;
+	return var;
+}
+
+/*
+ * The variable, its guid, its name, and its data all go in one piece of
+ * the pool, in that order.
+ */
+ssize_t NONNULL(1, 2, 4) PUBLIC
+efi_variable_pool_import(efi_variable_pool_t *pool, const uint8_t *data,
+			 size_t size, efi_variable_t **var_out)
+{
+	struct export_record rec;
+	efi_variable_t *var;
+	size_t namelen, needed;
+	uint8_t *ptr;
+
+	if (parse_efivar_record(data, size, &rec) < 0 &&
+	    parse_dmpstore_record(data, size, &rec) < 0)
+		return -1;
+
+	namelen = ucs2_to_utf8_buf(NULL, 0, rec.name,
+				   rec.namesz / sizeof(uint16_t));
+	if (ADD(sizeof(*var) + sizeof(efi_guid_t) + 1, namelen, &needed) ||
+	    ADD(needed, rec.datasz, &needed)) {
+		errno = EOVERFLOW;
+		efi_error("arithmetic overflow computing allocation size");
+		return -1;
+	}
+
+	ptr = pool_alloc(pool, needed);
+	if (!ptr)
+		return -1;
+
+	var = (efi_variable_t *)ptr;
+	ptr += sizeof(*var);
+	memset(var, 0, sizeof(*var));
+	var->pooled = true;
+	var->attrs = rec.attrs;
+
+	var->guid = (efi_guid_t *)ptr;
+	memcpy(var->guid, rec.guid, sizeof(efi_guid_t));
+	ptr += sizeof(efi_guid_t);
+
+	var->name = ptr;
+	ucs2_to_utf8_buf(var->name, namelen + 1, rec.name,
+			 rec.namesz / sizeof(uint16_t));
+	ptr += namelen + 1;
+
+	var->data = ptr;
+	var->data_size = rec.datasz;
+	memcpy(var->data, rec.data, rec.datasz);
+
+	debug("var.guid:"GUID_FORMAT, GUID_FORMAT_ARGS(var->guid));
+	debug("name:%s", var->name);
+
+	*var_out = var;
+	return rec.size;
+}
+
+ssize_t NONNULL(1, 2, 3) PUBLIC
+efi_variable_pool_export(efi_variable_pool_t *pool, efi_variable_t *var,
+			 uint8_t **data)
+{
+	ssize_t needed, rc;
+	uint8_t *buf;
+
+	needed = efi_variable_export(var, NULL, 0);
+	if (needed < 0)
+		return -1;
+
+	buf = pool_alloc(pool, needed);
+	if (!buf)
+		return -1;
+
+	rc = efi_variable_export(var, buf, needed);
+	if (rc < 0)
+		return -1;
+
+	*data = buf;
+	return rc;
+}
+
+void NONNULL(1) PUBLIC
+efi_variable_pool_reset(efi_variable_pool_t *pool)
+{
+	struct pool_chunk *chunk = pool->chunks;
+
+	while (chunk) {
+		struct pool_chunk *next = chunk->next;
+
+		if (chunk->size == POOL_CHUNK_SIZE) {
+			chunk->next = pool->spare;
+			pool->spare = chunk;
+		} else {
+			free(chunk);
+		}
+		chunk = next;
+	}
+	pool->chunks = NULL;
+}
+
+void PUBLIC
+efi_variable_pool_free(efi_variable_pool_t *pool)
+{
+	if (!pool)
+		return;
+
+	free_pool_chunks(pool->chunks);
+	free_pool_chunks(pool->spare);
+	free(pool);
+}
+
 // vim:fenc=utf-8:tw=75:noet
@@ -12,111 +12,280 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-static DIR *dir;
+/*
+ * Both efivarfs and the legacy sysfs interface name their entries
+ * "Name-8be4df61-93ca-11d2-aa0d-00e098032b8c".  Returns the length of
+ * the "Name" part and fills in guid, 0 if this entry isn't a variable at
+ * all (".", "..", "new_var", etc.), or -1 if the guid doesn't parse.
+ */
+static inline ssize_t UNUSED
+generic_parse_variable_entry(const char *entry, efi_guid_t *guid)
+{
+	static const size_t guidlen = sizeof("8be4df61-93ca-11d2-aa0d-00e098032b8c") - 1;
+	size_t namelen = strlen(entry);
+
+	/* a proper entry must have space for a guid, a dash, and
+	 * the variable name */
+	if (namelen < guidlen + 2)
+		return 0;
+
+	if (decode_guid_text(entry + namelen - guidlen, guid) < 0) {
+		errno = EINVAL;
+		efi_error("decode_guid_text failed");
+		return -1;
+	}
+
+	return namelen - guidlen - 1;
+}
+
+#if defined(__linux__)
+/*
+ * A directory with a few hundred variables in it is one or two
+ * getdents64() calls with a buffer this size, rather than one libc
+ * readdir() refill per handful of entries.
+ */
+#define GENERIC_DENTS_BUFFER_SIZE	32768
+
+struct generic_linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+static inline bool UNUSED
+generic_varname_iter_is_open(struct efi_varname_iter *iter)
+{
+#if defined(__linux__)
+	return iter->dents != NULL;
+#else
+	return iter->dir != NULL;
+#endif
+}
 
 static inline int UNUSED
-generic_get_next_variable_name(const char *path, efi_guid_t **guid, char **name)
+generic_varname_iter_open(const char *path, struct efi_varname_iter *iter)
 {
-	static char ret_name[NAME_MAX+1];
-	static efi_guid_t ret_guid;
+	int fd;
 
-	if (!guid || !name) {
-		errno = EINVAL;
-		efi_error("invalid arguments");
+	fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0) {
+		efi_error("open(%s) failed", path);
 		return -1;
 	}
 
-	/* if only one of guid and name are null, there's no "next" variable,
-	 * because the current variable is invalid. */
-	if ((*guid == NULL && *name != NULL) ||
-			(*guid != NULL && *name == NULL)) {
-		errno = EINVAL;
-		efi_error("invalid arguments");
+#if defined(__linux__)
+	iter->dents = malloc(GENERIC_DENTS_BUFFER_SIZE);
+	if (!iter->dents) {
+		__typeof__(errno) errno_value = errno;
+		efi_error("could not allocate memory");
+		close(fd);
+		errno = errno_value;
+		return -1;
+	}
+	iter->dents_pos = 0;
+	iter->dents_len = 0;
+#else
+	iter->dir = fdopendir(fd);
+	if (!iter->dir) {
+		__typeof__(errno) errno_value = errno;
+		efi_error("fdopendir(%s) failed", path);
+		close(fd);
+		errno = errno_value;
 		return -1;
 	}
+#endif
+	iter->dfd = fd;
+	iter->entry = NULL;
 
-	/* if dir is NULL, we're also starting over */
-	if (!dir) {
-		dir = opendir(path);
-		if (!dir) {
-			efi_error("opendir(%s) failed", path);
-			return -1;
-		}
+	return 0;
+}
 
-		int fd = dirfd(dir);
-		if (fd < 0) {
-			__typeof__(errno) errno_value = errno;
-			efi_error("dirfd failed");
-			closedir(dir);
-			errno = errno_value;
-			return -1;
+static inline void UNUSED
+generic_varname_iter_close(struct efi_varname_iter *iter)
+{
+	if (!generic_varname_iter_is_open(iter))
+		return;
+
+	__typeof__(errno) errno_value = errno;
+#if defined(__linux__)
+	close(iter->dfd);
+	free(iter->dents);
+	iter->dents = NULL;
+#else
+	closedir(iter->dir);
+	iter->dir = NULL;
+#endif
+	iter->dfd = -1;
+	iter->entry = NULL;
+	errno = errno_value;
+}
+
+/*
+ * Returns the next raw directory entry name, or NULL with errno set to 0
+ * at the end of the directory and to something else on error.
+ */
+static inline const char * UNUSED
+generic_varname_iter_readdir(struct efi_varname_iter *iter)
+{
+#if defined(__linux__)
+	struct generic_linux_dirent64 *de;
+
+	if (iter->dents_pos >= iter->dents_len) {
+		long rc;
+
+		do {
+			rc = syscall(SYS_getdents64, iter->dfd, iter->dents,
+				     GENERIC_DENTS_BUFFER_SIZE);
+		} while (rc < 0 && errno == EINTR);
+		if (rc < 0) {
+			efi_error("getdents64() failed");
+			return NULL;
 		}
-		int flags = fcntl(fd, F_GETFD);
-		if (flags < 0) {
-			efi_error("fcntl(fd, F_GETFD) failed");
-		} else {
-			flags |= FD_CLOEXEC;
-			if (fcntl(fd, F_SETFD, flags) < 0)
-				efi_error("fcntl(fd, F_SETFD, flags | FD_CLOEXEC) failed");
+		if (rc == 0) {
+			errno = 0;
+			return NULL;
 		}
+		iter->dents_pos = 0;
+		iter->dents_len = rc;
+	}
 
-		*guid = NULL;
-		*name = NULL;
+	de = (struct generic_linux_dirent64 *)(iter->dents + iter->dents_pos);
+	iter->dents_pos += de->d_reclen;
+	return de->d_name;
+#else
+	struct dirent *de;
+
+	errno = 0;
+	de = readdir(iter->dir);
+	if (!de) {
+		if (errno)
+			efi_error("readdir() failed");
+		return NULL;
 	}
+	return de->d_name;
+#endif
+}
 
-	struct dirent *de = NULL;
-	char *guidtext = "8be4df61-93ca-11d2-aa0d-00e098032b8c";
-	size_t guidlen = strlen(guidtext);
+/*
+ * Advances iter to the next directory entry that names a variable, and
+ * points iter->entry at its full name and fills in iter->guid.  Returns
+ * the length of the variable name part of iter->entry, 0 once we've run
+ * out, and -1 on error.  The directory is left open either way, and
+ * iter->dfd can be used to open the entry.
+ */
+static inline ssize_t UNUSED
+generic_varname_iter_next_entry(struct efi_varname_iter *iter)
+{
+	if (!generic_varname_iter_is_open(iter)) {
+		errno = EINVAL;
+		efi_error("iterator is not open");
+		return -1;
+	}
 
 	while (1) {
-		de = readdir(dir);
-		if (de == NULL) {
-			closedir(dir);
-			dir = NULL;
-			return 0;
+		const char *entry;
+		ssize_t namelen;
+
+		entry = generic_varname_iter_readdir(iter);
+		if (!entry) {
+			iter->entry = NULL;
+			return errno ? -1 : 0;
 		}
-		/* a proper entry must have space for a guid, a dash, and
-		 * the variable name */
-		size_t namelen = strlen(de->d_name);
-		if (namelen < guidlen + 2)
-			continue;
 
-		int rc = text_to_guid(de->d_name +namelen -guidlen, &ret_guid);
-		if (rc < 0) {
-			closedir(dir);
-			dir = NULL;
-			errno = EINVAL;
-			efi_error("text_to_guid failed");
+		namelen = generic_parse_variable_entry(entry, &iter->guid);
+		if (namelen == 0)
+			continue;
+		if (namelen < 0)
 			return -1;
-		}
 
-		strncpy(ret_name, de->d_name, sizeof(ret_name));
-		ret_name[namelen - guidlen - 1] = '\0';
+		iter->entry = entry;
+		return namelen;
+	}
+}
+
+/*
+ * Advances iter to the next variable.  Returns 1 and points guid and name
+ * at buffers in iter if there is one, 0 once we've run out, and -1 on
+ * error.  Either way the directory is closed once we stop returning 1.
+ */
+static inline int UNUSED
+generic_varname_iter_next(struct efi_varname_iter *iter, efi_guid_t **guid,
+			  char **name)
+{
+	ssize_t namelen;
 
-		*guid = &ret_guid;
-		*name = ret_name;
-		break;
+	namelen = generic_varname_iter_next_entry(iter);
+	if (namelen <= 0) {
+		generic_varname_iter_close(iter);
+		return namelen < 0 ? -1 : 0;
 	}
 
+	memcpy(iter->name, iter->entry, namelen);
+	iter->name[namelen] = '\0';
+
+	*guid = &iter->guid;
+	*name = iter->name;
 	return 1;
 }
 
+static struct efi_varname_iter next_variable_name_iter;
+
+static inline int UNUSED
+generic_get_next_variable_name(const char *path, efi_guid_t **guid, char **name)
+{
+	if (!guid || !name) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+
+	/* if only one of guid and name are null, there's no "next" variable,
+	 * because the current variable is invalid. */
+	if ((*guid == NULL && *name != NULL) ||
+			(*guid != NULL && *name == NULL)) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+
+	/* if the directory isn't open, we're also starting over */
+	if (!generic_varname_iter_is_open(&next_variable_name_iter)) {
+		if (generic_varname_iter_open(path,
+					      &next_variable_name_iter) < 0)
+			return -1;
+
+		*guid = NULL;
+		*name = NULL;
+	}
+
+	return generic_varname_iter_next(&next_variable_name_iter, guid, name);
+}
+
 static void DESTRUCTOR close_dir(void);
 static void DESTRUCTOR
 close_dir(void)
 {
-	if (dir != NULL) {
-		closedir(dir);
-		dir = NULL;
-	}
+	generic_varname_iter_close(&next_variable_name_iter);
 }
 
 /* this is a simple read/delete/write implementation of "update".  Good luck.
- * -- pjones */
+ * -- pjones
+ *
+ * The old contents are read straight into the front of the buffer we
+ * write back, so the new data only has to be copied in after it, and if
+ * the write fails after the delete we've still got enough to put the
+ * variable back the way it was.
+ */
 static int UNUSED FLATTEN
 generic_append_variable(efi_guid_t guid, const char *name,
 		       uint8_t *new_data, size_t new_data_size,
@@ -125,9 +294,36 @@ generic_append_variable(efi_guid_t guid, const char *name,
 	int rc;
 	uint8_t *data = NULL;
 	size_t data_size = 0;
+	size_t bufsz;
 	uint32_t attributes = 0;
+	__typeof__(errno) errno_value;
+
+	rc = efi_get_variable_size(guid, name, &data_size);
+	while (rc >= 0) {
+		uint8_t *newbuf;
+
+		if (ADD(data_size, new_data_size, &bufsz)) {
+			free(data);
+			errno = EOVERFLOW;
+			efi_error("variable would be too large");
+			return -1;
+		}
+		newbuf = realloc(data, bufsz ? bufsz : 1);
+		if (!newbuf) {
+			free(data);
+			efi_error("could not allocate memory");
+			return -1;
+		}
+		data = newbuf;
+
+		/* if it grew since we asked, try again with the new size */
+		rc = efi_get_variable_into(guid, name, data, bufsz - new_data_size,
+					   &data_size, &attributes);
+		if (rc >= 0 || errno != ENOSPC)
+			break;
+		rc = 0;
+	}
 
-	rc = efi_get_variable(guid, name, &data, &data_size, &attributes);
 	if (rc >= 0) {
 		if ((attributes | EFI_VARIABLE_APPEND_WRITE) !=
 				(new_attributes | EFI_VARIABLE_APPEND_WRITE)) {
@@ -135,33 +331,36 @@ generic_append_variable(efi_guid_t guid, const char *name,
 			errno = EINVAL;
 			return -1;
 		}
-		uint8_t *d = malloc(data_size + new_data_size);
-		size_t ds = data_size + new_data_size;
-		memcpy(d, data, data_size);
-		memcpy(d + data_size, new_data, new_data_size);
+		memcpy(data + data_size, new_data, new_data_size);
 		attributes &= ~EFI_VARIABLE_APPEND_WRITE;
 		rc = efi_del_variable(guid, name);
 		if (rc < 0) {
 			efi_error("efi_del_variable failed");
 			free(data);
-			free(d);
 			return rc;
 		}
-		/* if this doesn't work, we accidentally deleted.  There's
-		 * really not much to do about it, so return the error and
-		 * let our caller attempt to clean up :/
-		 */
-		rc = efi_set_variable(guid, name, d, ds, attributes, 0600);
-		if (rc < 0)
+		rc = efi_set_variable(guid, name, data,
+				      data_size + new_data_size, attributes,
+				      0600);
+		if (rc < 0) {
+			errno_value = errno;
 			efi_error("efi_set_variable failed");
-		free(d);
+			/* we deleted it; at least try to put it back */
+			if (efi_set_variable(guid, name, data, data_size,
+					     attributes, 0600) < 0)
+				efi_error("could not restore %s", name);
+			errno = errno_value;
+		}
 		free(data);
 	} else if (rc < 0 && errno == ENOENT) {
+		free(data);
 		data = new_data;
 		data_size = new_data_size;
 		attributes = new_attributes & ~EFI_VARIABLE_APPEND_WRITE;
 		rc = efi_set_variable(guid, name, data, data_size,
 				      attributes, 0600);
+	} else {
+		free(data);
 	}
 	if (rc < 0)
 		efi_error("efi_set_variable failed");
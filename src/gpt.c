@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +25,8 @@
 
 #include "efivar.h"
 #include "linux.h"
+#include "stats.h"
+#include "trace.h"
 
 #ifndef BLKGETLASTSECT
 #define BLKGETLASTSECT _IO(0x12,108) /* get last sector of block device */
@@ -104,16 +107,128 @@ read_lastoddsector(int fd, void *buffer, size_t count)
 	return !rc;
 }
 
+/*
+ * Finding the partition table reads the PMBR, primary header, and
+ * primary entries from the front of the disk and, sometimes, the
+ * alternate entries and header from the back.  On anything where each
+ * request is a network round trip that's what dominates, so read each
+ * end of the disk with a single request and let read_lba() copy out of
+ * that.  The windows cover the usual 16kB of entries; anything outside
+ * them is read the slow way.
+ */
+#define PARTITION_TABLE_PTE_BYTES 16384
+
+static void
+partition_table_window(int fd, struct partition_table *pt,
+		       unsigned int which, uint64_t lba, uint64_t nblocks)
+{
+	size_t len = nblocks * pt->sector_size;
+	void *buf = NULL;
+	ssize_t bytesread;
+
+	if (posix_memalign(&buf, pt->sector_size, len))
+		return;
+
+	bytesread = pread(fd, buf, len, lba * pt->sector_size);
+	if (bytesread < 0 || (size_t)bytesread != len) {
+		free(buf);
+		return;
+	}
+	stats_inc(gpt_reads);
+	stats_add(gpt_read_bytes, bytesread);
+
+	pt->window[which].lba = lba;
+	pt->window[which].nblocks = nblocks;
+	pt->window[which].buf = buf;
+}
+
+/*
+ * The alternate window, or 0 blocks if the disk is too small for it not
+ * to overlap the primary one.
+ */
+static uint64_t
+partition_table_alternate_blocks(const struct partition_table *pt)
+{
+	uint64_t nblocks = pt->pte_blocks + 1;
+
+	if (pt->lastlba + 1 <= 2 * (pt->pte_blocks + 2))
+		return 0;
+	return nblocks;
+}
+
+static void
+partition_table_alternate(int fd, struct partition_table *pt)
+{
+	uint64_t nblocks = partition_table_alternate_blocks(pt);
+
+	if (nblocks && !pt->window[1].buf)
+		partition_table_window(fd, pt, 1, pt->lastlba + 1 - nblocks,
+				       nblocks);
+}
+
+int HIDDEN
+partition_table_init(int fd, struct partition_table *pt)
+{
+	memset(pt, 0, sizeof(*pt));
+	pt->sector_size = get_sector_size(fd);
+	if (pt->sector_size <= 0) {
+		errno = EINVAL;
+		efi_error("could not get sector size");
+		return -1;
+	}
+
+	pt->lastlba = last_lba(fd);
+	pt->pte_blocks = (PARTITION_TABLE_PTE_BYTES + pt->sector_size - 1)
+			 / pt->sector_size;
+
+	/* PMBR, primary header, primary entries */
+	partition_table_window(fd, pt, 0, 0,
+			       MIN(pt->pte_blocks + 2, pt->lastlba + 1));
+	if (!pt->window[0].buf)
+		partition_table_window(fd, pt, 0, 0, 1);
+	return 0;
+}
+
+void HIDDEN
+partition_table_fini(struct partition_table *pt)
+{
+	for (unsigned int i = 0; i < 2; i++)
+		free(pt->window[i].buf);
+	memset(pt, 0, sizeof(*pt));
+}
+
+legacy_mbr HIDDEN *
+partition_table_mbr(const struct partition_table *pt)
+{
+	if (!pt->window[0].buf || pt->window[0].lba != 0)
+		return NULL;
+	return (legacy_mbr *)pt->window[0].buf;
+}
+
 static ssize_t
-read_lba(int fd, uint64_t lba, void *buffer, size_t bytes)
+read_lba(int fd, const struct partition_table *pt, uint64_t lba,
+	 void *buffer, size_t bytes)
 {
-	int sector_size = get_sector_size(fd);
+	int sector_size = pt ? pt->sector_size : get_sector_size(fd);
 	off_t offset = lba * sector_size;
 	ssize_t bytesread;
 	void *iobuf;
 	size_t iobuf_size;
 	int rc;
-	off_t new_offset;
+
+	for (unsigned int i = 0; pt && i < 2; i++) {
+		uint64_t start = pt->window[i].lba;
+		uint64_t end = start + pt->window[i].nblocks;
+
+		if (!pt->window[i].buf || lba < start || lba >= end ||
+		    bytes > (end - lba) * sector_size)
+			continue;
+
+		memcpy(buffer,
+		       pt->window[i].buf + (lba - start) * sector_size,
+		       bytes);
+		return bytes;
+	}
 
 	iobuf_size = lcm(bytes, sector_size);
 	rc = posix_memalign(&iobuf, sector_size, iobuf_size);
@@ -121,12 +236,13 @@ read_lba(int fd, uint64_t lba, void *buffer, size_t bytes)
 		return rc;
 	memset(iobuf, 0, bytes);
 
-	new_offset = lseek(fd, offset, SEEK_SET);
-	if (new_offset == (off_t)-1) {
+	bytesread = pread(fd, iobuf, iobuf_size, offset);
+	if (bytesread < 0) {
 		free(iobuf);
 		return 0;
 	}
-	bytesread = read(fd, iobuf, iobuf_size);
+	stats_inc(gpt_reads);
+	stats_add(gpt_read_bytes, bytesread);
 	memcpy(buffer, iobuf, bytes);
 	free(iobuf);
 
@@ -150,7 +266,8 @@ read_lba(int fd, uint64_t lba, void *buffer, size_t bytes)
  * Notes: remember to free pte when you're done!
  */
 static gpt_entry *
-alloc_read_gpt_entries(int fd, uint32_t nptes, uint32_t ptesz, uint64_t ptelba)
+alloc_read_gpt_entries(int fd, const struct partition_table *pt,
+		       uint32_t nptes, uint32_t ptesz, uint64_t ptelba)
 {
 	gpt_entry *pte;
 	size_t count = nptes * ptesz;
@@ -163,7 +280,7 @@ alloc_read_gpt_entries(int fd, uint32_t nptes, uint32_t ptesz, uint64_t ptelba)
 		return NULL;
 
 	memset(pte, 0, count);
-	if (!read_lba(fd, ptelba, pte, count)) {
+	if (!read_lba(fd, pt, ptelba, pte, count)) {
 		free(pte);
 		return NULL;
 	}
@@ -180,7 +297,7 @@ alloc_read_gpt_entries(int fd, uint32_t nptes, uint32_t ptesz, uint64_t ptelba)
  * Note: remember to free gpt when finished with it.
  */
 static gpt_header *
-alloc_read_gpt_header(int fd, uint64_t lba)
+alloc_read_gpt_header(int fd, const struct partition_table *pt, uint64_t lba)
 {
 	gpt_header *gpt;
 
@@ -190,7 +307,7 @@ alloc_read_gpt_header(int fd, uint64_t lba)
 		return NULL;
 
 	memset(gpt, 0, sizeof (*gpt));
-	if (!read_lba(fd, lba, gpt, sizeof (gpt_header))) {
+	if (!read_lba(fd, pt, lba, gpt, sizeof (gpt_header))) {
 		free(gpt);
 		return NULL;
 	}
@@ -266,17 +383,17 @@ check_lba(uint64_t lba, uint64_t lastlba, char *name)
  * If valid, returns pointers to newly allocated GPT header and PTEs.
  */
 static int
-is_gpt_valid(int fd, uint64_t lba,
+is_gpt_valid(int fd, const struct partition_table *pt, uint64_t lba,
 	     gpt_header ** gpt, gpt_entry ** ptes,
 	     uint32_t logical_block_size)
 {
 	int rc = 0;		/* default to not valid */
 	uint32_t crc, origcrc;
-	uint64_t max_device_lba = last_lba(fd);
+	uint64_t max_device_lba = pt->lastlba;
 
 	if (!gpt || !ptes)
 		return 0;
-	if (!(*gpt = alloc_read_gpt_header(fd, lba)))
+	if (!(*gpt = alloc_read_gpt_header(fd, pt, lba)))
 		return 0;
 
 	/* Check the GUID Partition Table magic */
@@ -387,7 +504,8 @@ err:
 		goto err;
 	}
 
-	if (!(*ptes = alloc_read_gpt_entries(fd, nptes, ptesz, ptelba))) {
+	if (!(*ptes = alloc_read_gpt_entries(fd, pt, nptes, ptesz,
+					      ptelba))) {
 		free(*gpt);
 		*gpt = NULL;
 		return 0;
@@ -503,20 +621,23 @@ compare_gpts(gpt_header *pgpt, gpt_header *agpt, uint64_t lastlba)
  * @fd  is an open file descriptor to the whole disk
  * @gpt is a GPT header ptr, filled on return.
  * @ptes is a PTEs ptr, filled on return.
+ * @check_alternate says to read and compare the alternate GPT even when
+ *  the primary is valid, which only matters for the warnings it gives.
  * Description: Returns 1 if valid, 0 on error.
  * If valid, returns pointers to newly allocated GPT header and PTEs.
  * Validity depends on finding either the Primary GPT header and PTEs valid,
  * or the Alternate GPT header and PTEs valid, and the PMBR valid.
  */
 static int
-find_valid_gpt(int fd, gpt_header ** gpt, gpt_entry ** ptes,
-	       int ignore_pmbr_err, int logical_block_size)
+find_valid_gpt(int fd, struct partition_table *pt, gpt_header ** gpt,
+	       gpt_entry ** ptes, int ignore_pmbr_err, int logical_block_size,
+	       int check_alternate)
 {
 	int good_pgpt = 0, good_agpt = 0, good_pmbr = 0;
 	gpt_header *pgpt = NULL, *agpt = NULL;
 	gpt_entry *pptes = NULL, *aptes = NULL;
 	legacy_mbr *legacymbr = NULL;
-	uint64_t lastlba;
+	uint64_t lastlba = pt->lastlba;
 	int ret = -1;
 
 	errno = EINVAL;
@@ -524,19 +645,25 @@ find_valid_gpt(int fd, gpt_header ** gpt, gpt_entry ** ptes,
 	if (!gpt || !ptes)
 		return -1;
 
-	lastlba = last_lba(fd);
-	good_pgpt = is_gpt_valid(fd, GPT_PRIMARY_PARTITION_TABLE_LBA,
+	tracepoint(libefiboot, find_valid_gpt_entry, fd, check_alternate);
+	if (check_alternate)
+		partition_table_alternate(fd, pt);
+	good_pgpt = is_gpt_valid(fd, pt, GPT_PRIMARY_PARTITION_TABLE_LBA,
 				 &pgpt, &pptes, logical_block_size);
-	if (good_pgpt) {
-		good_agpt = is_gpt_valid(fd,
+	if (good_pgpt && !check_alternate) {
+		/* the primary wins anyway; the alternate is only compared */
+	} else if (good_pgpt) {
+		good_agpt = is_gpt_valid(fd, pt,
 					 le64_to_cpu(pgpt->alternate_lba),
 					 &agpt, &aptes, logical_block_size);
 		if (!good_agpt) {
-			good_agpt = is_gpt_valid(fd, lastlba, &agpt, &aptes,
+			good_agpt = is_gpt_valid(fd, pt, lastlba,
+						 &agpt, &aptes,
 						 logical_block_size);
 		}
 	} else {
-		good_agpt = is_gpt_valid(fd, lastlba, &agpt, &aptes,
+		partition_table_alternate(fd, pt);
+		good_agpt = is_gpt_valid(fd, pt, lastlba, &agpt, &aptes,
 					 logical_block_size);
 	}
 
@@ -549,7 +676,8 @@ find_valid_gpt(int fd, gpt_header ** gpt, gpt_entry ** ptes,
 	legacymbr = malloc(sizeof (*legacymbr));
 	if (legacymbr) {
 		memset(legacymbr, 0, sizeof (*legacymbr));
-		read_lba(fd, 0, (uint8_t *) legacymbr, sizeof (*legacymbr));
+		read_lba(fd, pt, 0, (uint8_t *) legacymbr,
+			 sizeof (*legacymbr));
 		good_pmbr = is_pmbr_valid(legacymbr);
 		free(legacymbr);
 		legacymbr=NULL;
@@ -602,9 +730,183 @@ find_valid_gpt(int fd, gpt_header ** gpt, gpt_entry ** ptes,
 		*gpt = NULL;
 		*ptes = NULL;
 	}
+	tracepoint(libefiboot, find_valid_gpt_return, fd, ret);
 	return ret;
 }
 
+/*
+ * Building a device path for each partition on a disk would otherwise
+ * re-read and re-checksum both GPTs every time, so keep the parsed
+ * tables around.  Entries are keyed by the device, its size, the sector
+ * size, and whether we were told to ignore a bad PMBR, and are only
+ * reused if the primary header on the disk still reads back exactly as
+ * it did, which is one sector read instead of the whole dance above.
+ * Anything that rewrites the partition table changes the header CRCs,
+ * so that's enough to notice it.
+ */
+#define GPT_CACHE_MAX 32
+
+struct gpt_cache_entry {
+	list_t list;
+	dev_t dev;
+	ino_t ino;
+	uint64_t lastlba;
+	int logical_block_size;
+	int ignore_pmbr_err;
+	gpt_header primary;
+	gpt_header *gpt;
+	gpt_entry *ptes;
+	size_t ptes_size;
+};
+
+static pthread_mutex_t gpt_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static DEF_LIST_HEAD(gpt_cache);
+static unsigned int gpt_cache_entries;
+
+static void
+gpt_cache_entry_free(struct gpt_cache_entry *entry)
+{
+	list_del(&entry->list);
+	gpt_cache_entries -= 1;
+	free(entry->gpt);
+	free(entry->ptes);
+	free(entry);
+}
+
+static int
+gpt_dup(const gpt_header *gpt, const gpt_entry *ptes, size_t ptes_size,
+	gpt_header **gptp, gpt_entry **ptesp)
+{
+	*gptp = malloc(sizeof(*gpt));
+	*ptesp = malloc(ptes_size ? ptes_size : 1);
+	if (!*gptp || !*ptesp) {
+		free(*gptp);
+		free(*ptesp);
+		*gptp = NULL;
+		*ptesp = NULL;
+		return -1;
+	}
+	memcpy(*gptp, gpt, sizeof(*gpt));
+	memcpy(*ptesp, ptes, ptes_size);
+	return 0;
+}
+
+static int
+find_valid_gpt_cached(int fd, struct partition_table *pt, gpt_header **gpt,
+		      gpt_entry **ptes, int ignore_pmbr_err,
+		      int logical_block_size)
+{
+	struct gpt_cache_entry *entry = NULL;
+	/* comparing against the alternate only ever gives us warnings */
+	int check_alternate = efi_get_verbose() >= 1;
+	struct stat statbuf;
+	gpt_header primary;
+	uint64_t lastlba;
+	list_t *pos;
+	int rc;
+
+	if (fstat(fd, &statbuf) < 0)
+		return find_valid_gpt(fd, pt, gpt, ptes, ignore_pmbr_err,
+				      logical_block_size, check_alternate);
+	if (S_ISBLK(statbuf.st_mode)) {
+		statbuf.st_dev = statbuf.st_rdev;
+		statbuf.st_ino = 0;
+	}
+
+	lastlba = pt->lastlba;
+	memset(&primary, 0, sizeof(primary));
+	if (!read_lba(fd, pt, GPT_PRIMARY_PARTITION_TABLE_LBA, &primary,
+		      sizeof(primary)))
+		return find_valid_gpt(fd, pt, gpt, ptes, ignore_pmbr_err,
+				      logical_block_size, check_alternate);
+
+	pthread_mutex_lock(&gpt_cache_lock);
+	list_for_each(pos, &gpt_cache) {
+		struct gpt_cache_entry *e;
+
+		e = list_entry(pos, struct gpt_cache_entry, list);
+		if (e->dev != statbuf.st_dev || e->ino != statbuf.st_ino ||
+		    e->lastlba != lastlba ||
+		    e->logical_block_size != logical_block_size ||
+		    e->ignore_pmbr_err != ignore_pmbr_err)
+			continue;
+		if (memcmp(&e->primary, &primary, sizeof(primary))) {
+			gpt_cache_entry_free(e);
+			break;
+		}
+		entry = e;
+		break;
+	}
+	if (entry) {
+		list_del(&entry->list);
+		list_add(&entry->list, &gpt_cache);
+		rc = gpt_dup(entry->gpt, entry->ptes, entry->ptes_size,
+			     gpt, ptes);
+		pthread_mutex_unlock(&gpt_cache_lock);
+		if (rc < 0)
+			efi_error("could not allocate memory");
+		else
+			errno = 0;
+		stats_inc(gpt_cache_hits);
+		return rc;
+	}
+	pthread_mutex_unlock(&gpt_cache_lock);
+	stats_inc(gpt_cache_misses);
+
+	rc = find_valid_gpt(fd, pt, gpt, ptes, ignore_pmbr_err,
+			    logical_block_size, check_alternate);
+	if (rc < 0)
+		return rc;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return rc;
+	entry->dev = statbuf.st_dev;
+	entry->ino = statbuf.st_ino;
+	entry->lastlba = lastlba;
+	entry->logical_block_size = logical_block_size;
+	entry->ignore_pmbr_err = ignore_pmbr_err;
+	memcpy(&entry->primary, &primary, sizeof(primary));
+	entry->ptes_size = (size_t)le32_to_cpu((*gpt)->num_partition_entries) *
+			   le32_to_cpu((*gpt)->sizeof_partition_entry);
+	if (gpt_dup(*gpt, *ptes, entry->ptes_size,
+		    &entry->gpt, &entry->ptes) < 0) {
+		free(entry);
+		errno = 0;
+		return rc;
+	}
+
+	pthread_mutex_lock(&gpt_cache_lock);
+	list_add(&entry->list, &gpt_cache);
+	gpt_cache_entries += 1;
+	if (gpt_cache_entries > GPT_CACHE_MAX)
+		gpt_cache_entry_free(list_entry(gpt_cache.prev,
+						struct gpt_cache_entry,
+						list));
+	pthread_mutex_unlock(&gpt_cache_lock);
+
+	errno = 0;
+	return rc;
+}
+
+void PUBLIC
+efi_gpt_cache_flush(void)
+{
+	list_t *pos, *tmp;
+
+	pthread_mutex_lock(&gpt_cache_lock);
+	list_for_each_safe(pos, tmp, &gpt_cache)
+		gpt_cache_entry_free(list_entry(pos, struct gpt_cache_entry,
+						list));
+	pthread_mutex_unlock(&gpt_cache_lock);
+}
+
+static void DESTRUCTOR
+gpt_cache_fini(void)
+{
+	efi_gpt_cache_flush();
+}
+
 
 /************************************************************
  * gpt_disk_get_partition_info()
@@ -617,18 +919,27 @@ find_valid_gpt(int fd, gpt_header ** gpt, gpt_entry ** ptes,
  *  non-zero on failure
  *
  ************************************************************/
-int NONNULL(3, 4, 5, 6, 7) HIDDEN
-gpt_disk_get_partition_info(int fd, uint32_t num, uint64_t * start,
-			    uint64_t * size, efi_guid_t *signature,
-			    uint8_t * mbr_type, uint8_t * signature_type,
-			    int ignore_pmbr_error, int logical_block_size)
+int NONNULL(4, 5, 6, 7, 8) HIDDEN
+gpt_disk_get_partition_info(int fd, struct partition_table *pt, uint32_t num,
+			    uint64_t * start, uint64_t * size,
+			    efi_guid_t *signature, uint8_t * mbr_type,
+			    uint8_t * signature_type, int ignore_pmbr_error,
+			    int logical_block_size)
 {
+	struct partition_table local_pt;
 	gpt_header *gpt = NULL;
 	gpt_entry *ptes = NULL, *p;
 	int rc = 0;
 
-	rc = find_valid_gpt(fd, &gpt, &ptes, ignore_pmbr_error,
-			    logical_block_size);
+	if (!pt) {
+		if (partition_table_init(fd, &local_pt) < 0)
+			return -1;
+		pt = &local_pt;
+	}
+	rc = find_valid_gpt_cached(fd, pt, &gpt, &ptes, ignore_pmbr_error,
+				   logical_block_size);
+	if (pt == &local_pt)
+		partition_table_fini(&local_pt);
 	if (rc < 0)
 		return rc;
 
@@ -656,13 +967,17 @@ gpt_disk_get_partition_info(int fd, uint32_t num, uint64_t * start,
 int HIDDEN
 gpt_disk_find_partition_num(int fd, uint64_t start, int logical_block_size)
 {
+	struct partition_table pt;
 	gpt_header *gpt = NULL;
 	gpt_entry *ptes = NULL;
 	int rc = 0;
 	unsigned int i = 0;
 
-	rc = find_valid_gpt(fd, &gpt, &ptes, /*ignore_pmbr_error=*/0,
-			    logical_block_size);
+	if (partition_table_init(fd, &pt) < 0)
+		return -1;
+	rc = find_valid_gpt_cached(fd, &pt, &gpt, &ptes,
+				   /*ignore_pmbr_error=*/0, logical_block_size);
+	partition_table_fini(&pt);
 	if (rc < 0)
 		return rc;
 
@@ -144,12 +144,36 @@ typedef union {
 	uint32_t mbr_signature;
 } partition_signature_t;
 
+/*
+ * The front of a disk read in one go, along with its back end once
+ * anything wants the alternate GPT, so the MBR and GPT code can look at
+ * the same sectors without reading them again.
+ */
+struct partition_table {
+	struct {
+		uint64_t lba;
+		uint64_t nblocks;
+		uint8_t *buf;
+	} window[2];
+	int sector_size;
+	uint64_t lastlba;
+	uint64_t pte_blocks;
+};
+
 /* Functions */
-extern int NONNULL(3, 4, 5, 6, 7) HIDDEN
-gpt_disk_get_partition_info (int fd, uint32_t num, uint64_t *start,
-			     uint64_t *size, efi_guid_t *signature,
-			     uint8_t *mbr_type, uint8_t *signature_type,
-			     int ignore_pmbr_error, int logical_sector_size);
+extern int HIDDEN partition_table_init(int fd, struct partition_table *pt);
+extern void HIDDEN partition_table_fini(struct partition_table *pt);
+/* NULL if the first sector couldn't be read */
+extern legacy_mbr HIDDEN *
+partition_table_mbr(const struct partition_table *pt);
+
+/* pt can be NULL, in which case the disk is read just for this */
+extern int NONNULL(4, 5, 6, 7, 8) HIDDEN
+gpt_disk_get_partition_info (int fd, struct partition_table *pt,
+			     uint32_t num, uint64_t *start, uint64_t *size,
+			     efi_guid_t *signature, uint8_t *mbr_type,
+			     uint8_t *signature_type, int ignore_pmbr_error,
+			     int logical_sector_size);
 extern int HIDDEN
 gpt_disk_find_partition_num(int fd, uint64_t start, int logical_block_size);
 
@@ -8,11 +8,16 @@
 
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "efivar.h"
 
-#define GUID_LENGTH_WITH_NUL 37
+#define GUID_LENGTH_WITH_NUL (GUID_STR_LEN + 1)
 
 extern const efi_guid_t efi_guid_zero;
 
@@ -41,73 +46,248 @@ efi_str_to_guid(const char *s, efi_guid_t *guid)
 int NONNULL(1) PUBLIC
 efi_guid_to_str(const efi_guid_t *guid, char **sp)
 {
-	char *ret = NULL;
-	int rc = -1;
+	char *ret;
 
-	if (!sp) {
-		rc = snprintf(NULL, 0, GUID_FORMAT, GUID_FORMAT_ARGS(guid));
-	} else if (sp && *sp) {
-		rc = snprintf(*sp, GUID_LENGTH_WITH_NUL, GUID_FORMAT,
-			      GUID_FORMAT_ARGS(guid));
-	} else {
-		rc = asprintf(&ret, GUID_FORMAT, GUID_FORMAT_ARGS(guid));
-		if (rc >= 0)
-			*sp = ret;
-	}
-	if (rc < 0)
+	if (!sp)
+		return GUID_LENGTH_WITH_NUL - 1;
+
+	ret = *sp ? *sp : malloc(GUID_LENGTH_WITH_NUL);
+	if (!ret) {
 		efi_error("Could not format guid");
-	return rc;
+		return -1;
+	}
+
+	encode_guid_text(guid, ret);
+	ret[GUID_LENGTH_WITH_NUL - 1] = '\0';
+	*sp = ret;
+	return GUID_LENGTH_WITH_NUL - 1;
 }
 
-static int NONNULL(1, 2)
-cmpguidp(const void *p1, const void *p2)
+int NONNULL(1, 2) PUBLIC
+efi_guid_to_str_buf(const efi_guid_t *guid, char *buf, size_t bufsz)
+{
+	if (bufsz < GUID_LENGTH_WITH_NUL) {
+		errno = ENOSPC;
+		efi_error("guid buffer is too small");
+		return -1;
+	}
+
+	encode_guid_text(guid, buf);
+	buf[GUID_LENGTH_WITH_NUL - 1] = '\0';
+	return GUID_LENGTH_WITH_NUL - 1;
+}
+
+/*
+ * Guids that aren't built in can come from a database made by
+ * "makeguids -D", named by LIBEFIVAR_GUID_DB.  It gets mapped the first
+ * time anything misses the built in tables, and looking things up in it
+ * works the same way as in those: one perfect hash probe, and no copying
+ * or dynamic linker calls.
+ */
+static struct {
+	const uint8_t *map;
+	size_t size;
+	uint32_t nguids;
+	uint32_t nbuckets;
+	uint32_t nslots;
+	const struct efivar_guid_db_entry *entries;
+	const uint16_t *guid_seeds;
+	const uint16_t *guid_slots;
+	const uint16_t *name_seeds;
+	const uint16_t *name_slots;
+	const char *strtab;
+	uint32_t strsz;
+} guid_db;
+static pthread_once_t guid_db_once = PTHREAD_ONCE_INIT;
+
+static bool
+guid_db_range_ok(uint32_t off, uint64_t len, size_t size)
+{
+	return off % 4 == 0 && off <= size && len <= size - off;
+}
+
+static int
+guid_db_parse(const uint8_t *map, size_t size)
+{
+	const struct efivar_guid_db_header *hdr = (const void *)map;
+	uint32_t nbuckets, nslots;
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, EFIVAR_GUID_DB_MAGIC, sizeof(hdr->magic)) ||
+	    le32_to_cpu(hdr->version) != EFIVAR_GUID_DB_VERSION)
+		return -1;
+
+	guid_db.nguids = le32_to_cpu(hdr->nguids);
+	nbuckets = le32_to_cpu(hdr->nbuckets);
+	nslots = le32_to_cpu(hdr->nslots);
+	guid_db.strsz = le32_to_cpu(hdr->strsz);
+	if (nbuckets == 0 || nslots == 0 || guid_db.strsz == 0 ||
+	    !guid_db_range_ok(le32_to_cpu(hdr->entries),
+			      (uint64_t)guid_db.nguids *
+			      sizeof(struct efivar_guid_db_entry), size) ||
+	    !guid_db_range_ok(le32_to_cpu(hdr->guid_seeds),
+			      nbuckets * sizeof(uint16_t), size) ||
+	    !guid_db_range_ok(le32_to_cpu(hdr->name_seeds),
+			      nbuckets * sizeof(uint16_t), size) ||
+	    !guid_db_range_ok(le32_to_cpu(hdr->guid_slots),
+			      nslots * sizeof(uint16_t), size) ||
+	    !guid_db_range_ok(le32_to_cpu(hdr->name_slots),
+			      nslots * sizeof(uint16_t), size) ||
+	    le32_to_cpu(hdr->strtab) > size ||
+	    guid_db.strsz > size - le32_to_cpu(hdr->strtab))
+		return -1;
+
+	guid_db.entries = (const void *)(map + le32_to_cpu(hdr->entries));
+	guid_db.guid_seeds = (const void *)(map + le32_to_cpu(hdr->guid_seeds));
+	guid_db.guid_slots = (const void *)(map + le32_to_cpu(hdr->guid_slots));
+	guid_db.name_seeds = (const void *)(map + le32_to_cpu(hdr->name_seeds));
+	guid_db.name_slots = (const void *)(map + le32_to_cpu(hdr->name_slots));
+	guid_db.strtab = (const char *)map + le32_to_cpu(hdr->strtab);
+	if (guid_db.strtab[guid_db.strsz - 1] != '\0')
+		return -1;
+
+	guid_db.nbuckets = nbuckets;
+	guid_db.nslots = nslots;
+	return 0;
+}
+
+static void
+guid_db_load(void)
+{
+	const char *path = getenv("LIBEFIVAR_GUID_DB");
+	struct stat sb;
+	void *map;
+	int fd;
+
+	if (!path || !*path)
+		return;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		debug("could not open guid database \"%s\": %m", path);
+		return;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size <= 0) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		debug("could not map guid database \"%s\": %m", path);
+		return;
+	}
+
+	if (guid_db_parse(map, sb.st_size) < 0) {
+		debug("\"%s\" is not a valid guid database", path);
+		memset(&guid_db, 0, sizeof(guid_db));
+		munmap(map, sb.st_size);
+		return;
+	}
+	guid_db.map = map;
+	guid_db.size = sb.st_size;
+}
+
+static void DESTRUCTOR
+guid_db_fini(void)
+{
+	if (guid_db.map)
+		munmap((void *)guid_db.map, guid_db.size);
+	memset(&guid_db, 0, sizeof(guid_db));
+}
+
+static const struct efivar_guid_db_entry *
+guid_db_find(bool by_name, const void *key, size_t len)
 {
-	struct efivar_guidname *gn1 = (struct efivar_guidname *)p1;
-	struct efivar_guidname *gn2 = (struct efivar_guidname *)p2;
+	const uint16_t *seeds, *slots;
+	uint32_t bucket, slot, idx;
+
+	pthread_once(&guid_db_once, guid_db_load);
+	if (!guid_db.map)
+		return NULL;
+
+	seeds = by_name ? guid_db.name_seeds : guid_db.guid_seeds;
+	slots = by_name ? guid_db.name_slots : guid_db.guid_slots;
+
+	bucket = efivar_guidname_hash_key(key, len, 0) % guid_db.nbuckets;
+	slot = efivar_guidname_hash_key(key, len,
+					le16_to_cpu(seeds[bucket]))
+	       % guid_db.nslots;
+	idx = le16_to_cpu(slots[slot]);
+	if (idx == 0 || idx > guid_db.nguids)
+		return NULL;
+	return &guid_db.entries[idx - 1];
+}
 
-	return efi_guid_cmp_(&gn1->guid, &gn2->guid);
+static const char *
+guid_db_str(uint32_t off)
+{
+	off = le32_to_cpu(off);
+	return off < guid_db.strsz ? &guid_db.strtab[off] : "";
 }
 
 static int NONNULL(1, 2)
-cmpnamep(const void *p1, const void *p2)
+guid_db_guid_to_names(const efi_guid_t *guid, const char **symbol,
+		      const char **name)
 {
-	struct efivar_guidname *gn1 = (struct efivar_guidname *)p1;
-	struct efivar_guidname *gn2 = (struct efivar_guidname *)p2;
+	const struct efivar_guid_db_entry *entry;
 
-	return strncmp(gn1->name, gn2->name, sizeof(gn1->name));
+	entry = guid_db_find(false, guid, sizeof(*guid));
+	if (!entry || efi_guid_cmp_(&entry->guid, guid))
+		return -1;
+	*symbol = guid_db_str(entry->symbol);
+	if (name)
+		*name = guid_db_str(entry->name);
+	return 0;
 }
 
 static int NONNULL(1, 2)
-_get_common_guidname(const efi_guid_t *guid, struct efivar_guidname **result)
+guid_db_name_to_guid(const char *name, efi_guid_t *guid)
 {
-	struct efivar_guidname key;
-	memset(&key, '\0', sizeof(key));
-	memcpy(&key.guid, guid, sizeof(*guid));
-
-	struct efivar_guidname *tmp;
-	tmp = bsearch(&key,
-		      &efi_well_known_guids[0],
-		      efi_n_well_known_guids,
-		      sizeof(efi_well_known_guids[0]),
-		      cmpguidp);
-	if (!tmp) {
-		*result = NULL;
-		errno = ENOENT;
-		efi_error("GUID is not in common GUID list");
+	const struct efivar_guid_db_entry *entry;
+
+	entry = guid_db_find(true, name, strlen(name));
+	if (!entry || strcmp(guid_db_str(entry->name), name))
 		return -1;
+	memcpy(guid, &entry->guid, sizeof(*guid));
+	return 0;
+}
+
+/*
+ * Both the built in table's entries and the database's strings stay put
+ * for as long as the library is loaded, so this just points at them.
+ */
+static int NONNULL(1, 2)
+_get_common_guidname(const efi_guid_t *guid, const char **symbol,
+		     const char **name)
+{
+	ssize_t idx;
+
+	idx = efivar_guidname_hash_find(&efi_well_known_guids_hash,
+					guid, sizeof(*guid));
+	if (idx >= 0 && (uint64_t)idx < efi_n_well_known_guids &&
+	    !efi_guid_cmp_(&efi_well_known_guids[idx].guid, guid)) {
+		*symbol = efi_well_known_guids[idx].symbol;
+		if (name)
+			*name = efi_well_known_guids[idx].name;
+		return 0;
 	}
 
-	*result = tmp;
-	return 0;
+	if (guid_db_guid_to_names(guid, symbol, name) >= 0)
+		return 0;
+
+	errno = ENOENT;
+	efi_error("GUID is not in common GUID list");
+	return -1;
 }
 
 int NONNULL(1, 2) PUBLIC
 efi_guid_to_name(efi_guid_t *guid, char **name)
 {
-	struct efivar_guidname *result;
-	int rc = _get_common_guidname(guid, &result);
+	const char *symbol, *result;
+	int rc = _get_common_guidname(guid, &symbol, &result);
 	if (rc >= 0) {
-		*name = strndup(result->name, sizeof(result->name) -1);
+		*name = strdup(result);
 		return *name ? (int)strlen(*name) : -1;
 	}
 	rc = efi_guid_to_str(guid, name);
@@ -119,10 +299,10 @@ efi_guid_to_name(efi_guid_t *guid, char **name)
 int NONNULL(1, 2) PUBLIC
 efi_guid_to_symbol(efi_guid_t *guid, char **symbol)
 {
-	struct efivar_guidname *result;
-	int rc = _get_common_guidname(guid, &result);
+	const char *result;
+	int rc = _get_common_guidname(guid, &result, NULL);
 	if (rc >= 0) {
-		*symbol = strndup(result->symbol, sizeof(result->symbol) -1);
+		*symbol = strdup(result);
 		return *symbol ? (int)strlen(*symbol) : -1;
 	}
 	efi_error_clear();
@@ -133,22 +313,21 @@ efi_guid_to_symbol(efi_guid_t *guid, char **symbol)
 int NONNULL(1) PUBLIC
 efi_guid_to_id_guid(const efi_guid_t *guid, char **sp)
 {
-	struct efivar_guidname *result = NULL;
+	const char *symbol = NULL;
 	char *ret = NULL;
 	int rc;
 
-	rc = _get_common_guidname(guid, &result);
+	rc = _get_common_guidname(guid, &symbol, NULL);
 	if (rc >= 0) {
 		if (!sp) {
 			return snprintf(NULL, 0, "{%s}",
-					result->symbol + strlen("efi_guid_"));
+					symbol + strlen("efi_guid_"));
 		} else if (sp && *sp) {
 			return snprintf(*sp, GUID_LENGTH_WITH_NUL + 2, "{%s}",
-					result->symbol + strlen("efi_guid_"));
+					symbol + strlen("efi_guid_"));
 		}
 
-		rc = asprintf(&ret, "{%s}",
-				result->symbol + strlen("efi_guid_"));
+		rc = asprintf(&ret, "{%s}", symbol + strlen("efi_guid_"));
 		if (rc >= 0)
 			*sp = ret;
 		return rc;
@@ -166,15 +345,30 @@ efi_guid_to_id_guid(const efi_guid_t *guid, char **sp)
 	return rc;
 }
 
-int NONNULL(1, 2) PUBLIC
-efi_symbol_to_guid(const char *symbol, efi_guid_t *guid)
+static void *self_dlh;
+static pthread_once_t self_dlh_once = PTHREAD_ONCE_INIT;
+
+static void
+self_dlh_open(void)
 {
-	void *dlh = dlopen(NULL, RTLD_LAZY);
-	if (!dlh)
+	self_dlh = dlopen(NULL, RTLD_LAZY);
+}
+
+/*
+ * Anything else that's a symbol somewhere in the process, such as the
+ * aliases makeguids emits.  dlopen(NULL) is the main program, which
+ * doesn't go away, so the handle is kept rather than opened every time.
+ */
+static int NONNULL(1, 2)
+dl_symbol_to_guid(const char *symbol, efi_guid_t *guid)
+{
+	void *sym;
+
+	pthread_once(&self_dlh_once, self_dlh_open);
+	if (!self_dlh)
 		return -1;
 
-	void *sym = dlsym(dlh, symbol);
-	dlclose(dlh);
+	sym = dlsym(self_dlh, symbol);
 	if (!sym)
 		return -1;
 
@@ -182,6 +376,16 @@ efi_symbol_to_guid(const char *symbol, efi_guid_t *guid)
 	return 0;
 }
 
+int NONNULL(1, 2) PUBLIC
+efi_symbol_to_guid(const char *symbol, efi_guid_t *guid)
+{
+	if (!strncmp(symbol, "efi_guid_", strlen("efi_guid_")) &&
+	    guid_db_name_to_guid(symbol + strlen("efi_guid_"), guid) >= 0)
+		return 0;
+
+	return dl_symbol_to_guid(symbol, guid);
+}
+
 int NONNULL(1, 2) PUBLIC
 efi_name_to_guid(const char *name, efi_guid_t *guid)
 {
@@ -201,14 +405,13 @@ efi_name_to_guid(const char *name, efi_guid_t *guid)
 
 	key.name[sizeof(key.name) - 1] = '\0';
 
-	struct efivar_guidname *result;
-	result = bsearch(&key,
-			 &efi_well_known_names[0],
-			 efi_n_well_known_names,
-			 sizeof(efi_well_known_names[0]),
-			 cmpnamep);
-	if (result != NULL) {
-		memcpy(guid, &result->guid, sizeof(*guid));
+	ssize_t idx;
+	idx = efivar_guidname_hash_find(&efi_well_known_names_hash,
+					key.name, strlen(key.name));
+	if (idx >= 0 && (uint64_t)idx < efi_n_well_known_names &&
+	    !strncmp(efi_well_known_names[idx].name, key.name,
+		     sizeof(key.name))) {
+		memcpy(guid, &efi_well_known_names[idx].guid, sizeof(*guid));
 		return 0;
 	}
 
@@ -216,11 +419,17 @@ efi_name_to_guid(const char *name, efi_guid_t *guid)
 	if (rc >= 0)
 		return 0;
 
+	rc = guid_db_name_to_guid(key.name, guid);
+	if (rc >= 0) {
+		efi_error_clear();
+		return 0;
+	}
+
 	char tmpname[sizeof(key.name) + 9];
 	strcpy(tmpname, "efi_guid_");
 	memmove(tmpname+9, key.name, sizeof(key.name) - 9);
 
-	rc = efi_symbol_to_guid(tmpname, guid);
+	rc = dl_symbol_to_guid(tmpname, guid);
 	if (rc >= 0)
 		return rc;
 
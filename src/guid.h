@@ -22,6 +22,9 @@
 	(guidp)->e[0], (guidp)->e[1], (guidp)->e[2], (guidp)->e[3],		\
 	(guidp)->e[4], (guidp)->e[5]
 
+/* strlen("84be9c3e-8a32-42c0-891c-4cd3b072becc") */
+#define GUID_STR_LEN 36
+
 static inline int
 real_isspace(char c)
 {
@@ -51,33 +54,91 @@ check_sanity(const char *text, size_t len)
 	return 0;
 }
 
-static inline int
-check_segment_sanity(const char *text, size_t len)
+/*
+ * Hex digit values plus one, indexed by character, so that anything that
+ * isn't a hex digit comes out as -1 once the one is taken off.  That lets
+ * us or every digit of a guid together and check them all at once at the
+ * end, instead of branching on each one.
+ */
+static const uint8_t guid_hex_values[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/* where each byte's two digits start in
+ * 84be9c3e-8a32-42c0-891c-4cd3b072becc */
+static const uint8_t guid_hex_offsets[16] = {
+	0, 2, 4, 6, 9, 11, 14, 16, 19, 21, 24, 26, 28, 30, 32, 34
+};
+
+/*
+ * Decode exactly 36 characters of "84be9c3e-8a32-42c0-891c-4cd3b072becc"
+ * at text, which need not be NUL terminated.  Returns -1 with errno set
+ * to EINVAL if it isn't a guid.
+ */
+static inline int NONNULL(1, 2) UNUSED
+decode_guid_text(const char *text, efi_guid_t *guid)
 {
-	for(unsigned int i = 0; i < len; i++) {
-		if (text[i] >= '0' && text[i] <= '9')
-			continue;
-		/* "| 0x20" is tolower() without having to worry about
-		 * locale concerns, since we know everything here must
-		 * be within traditional ascii space. */
-		if ((text[i] | 0x20) >= 'a' && (text[i] | 0x20) <= 'f')
-			continue;
+	const unsigned char *t = (const unsigned char *)text;
+	uint8_t bytes[16];
+	int bad;
+
+	bad = (t[8] ^ '-') | (t[13] ^ '-') | (t[18] ^ '-') | (t[23] ^ '-');
+	for (unsigned int i = 0; i < sizeof(bytes); i++) {
+		int hi = guid_hex_values[t[guid_hex_offsets[i]]] - 1;
+		int lo = guid_hex_values[t[guid_hex_offsets[i] + 1]] - 1;
+
+		bad |= (hi | lo) & ~0xf;
+		bytes[i] = (uint8_t)((hi << 4) | (lo & 0xf));
+	}
+	if (bad) {
 		errno = EINVAL;
 		return -1;
 	}
+
+	guid->a = cpu_to_le32((uint32_t)bytes[0] << 24 |
+			      (uint32_t)bytes[1] << 16 |
+			      (uint32_t)bytes[2] << 8 | bytes[3]);
+	guid->b = cpu_to_le16((uint16_t)(bytes[4] << 8 | bytes[5]));
+	guid->c = cpu_to_le16((uint16_t)(bytes[6] << 8 | bytes[7]));
+	guid->d = cpu_to_be16((uint16_t)(bytes[8] << 8 | bytes[9]));
+	memcpy(guid->e, &bytes[10], sizeof(guid->e));
+
 	return 0;
 }
 
+/*
+ * Write the 36 characters of "84be9c3e-8a32-42c0-891c-4cd3b072becc" for
+ * guid at text, without a NUL.  This is the inverse of
+ * decode_guid_text(), and doesn't go anywhere near printf().
+ */
+static inline void NONNULL(1, 2) UNUSED
+encode_guid_text(const efi_guid_t *guid, char *text)
+{
+	static const char digits[] = "0123456789abcdef";
+	uint32_t a = le32_to_cpu(guid->a);
+	uint16_t b = le16_to_cpu(guid->b);
+	uint16_t c = le16_to_cpu(guid->c);
+	uint16_t d = be16_to_cpu(guid->d);
+	uint8_t bytes[16] = {
+		a >> 24, a >> 16, a >> 8, a,
+		b >> 8, b, c >> 8, c, d >> 8, d,
+		guid->e[0], guid->e[1], guid->e[2],
+		guid->e[3], guid->e[4], guid->e[5],
+	};
+
+	text[8] = text[13] = text[18] = text[23] = '-';
+	for (unsigned int i = 0; i < sizeof(bytes); i++) {
+		text[guid_hex_offsets[i]] = digits[bytes[i] >> 4];
+		text[guid_hex_offsets[i] + 1] = digits[bytes[i] & 0xf];
+	}
+}
+
 static inline int UNUSED
 text_to_guid(const char *text, efi_guid_t *guid)
 {
-	/* these variables represent the length of the /string/ they hold,
-	 * not the interpreted length of the value from them.  Mostly the
-	 * names make it more obvious to verify that my bounds checking is
-	 * correct. */
-	char eightbytes[9] = "";
-	char fourbytes[5] = "";
-	char twobytes[3] = "";
 	size_t textlen = strlen(text);
 	size_t guidlen = strlen("84be9c3e-8a32-42c0-891c-4cd3b072becc");
 
@@ -93,81 +154,7 @@ text_to_guid(const char *text, efi_guid_t *guid)
 	if (check_sanity(text, textlen) < 0)
 		return -1;
 
-	/* 84be9c3e-8a32-42c0-891c-4cd3b072becc
-	 * ^ */
-	memcpy(eightbytes, text, 8);
-	if (check_segment_sanity(eightbytes, 8) < 0)
-		return -1;
-	guid->a = (uint32_t)strtoul(eightbytes, NULL, 16);
-	guid->a = cpu_to_le32(guid->a);
-
-	/* 84be9c3e-8a32-42c0-891c-4cd3b072becc
-	 *	  ^ */
-	memcpy(fourbytes, text+9, 4);
-	if (check_segment_sanity(fourbytes, 4) < 0)
-		return -1;
-	guid->b = (uint16_t)strtoul(fourbytes, NULL, 16);
-	guid->b = cpu_to_le16(guid->b);
-
-	/* 84be9c3e-8a32-42c0-891c-4cd3b072becc
-	 *	       ^ */
-	memcpy(fourbytes, text+14, 4);
-	if (check_segment_sanity(fourbytes, 4) < 0)
-		return -1;
-	guid->c = (uint16_t)strtoul(fourbytes, NULL, 16);
-	guid->c = cpu_to_le16(guid->c);
-
-	/* 84be9c3e-8a32-42c0-891c-4cd3b072becc
-	 *		    ^ */
-	memcpy(fourbytes, text+19, 4);
-	if (check_segment_sanity(fourbytes, 4) < 0)
-		return -1;
-	guid->d = (uint16_t)strtoul(fourbytes, NULL, 16);
-	guid->d = cpu_to_be16(guid->d);
-
-	/* 84be9c3e-8a32-42c0-891c-4cd3b072becc
-	 *			 ^ */
-	memcpy(twobytes, text+24, 2);
-	if (check_segment_sanity(twobytes, 2) < 0)
-		return -1;
-	guid->e[0] = (uint8_t)strtoul(twobytes, NULL, 16);
-
-	/* 84be9c3e-8a32-42c0-891c-4cd3b072becc
-	 *			   ^ */
-	memcpy(twobytes, text+26, 2);
-	if (check_segment_sanity(twobytes, 2) < 0)
-		return -1;
-	guid->e[1] = (uint8_t)strtoul(twobytes, NULL, 16);
-
-	/* 84be9c3e-8a32-42c0-891c-4cd3b072becc
-	 *			     ^ */
-	memcpy(twobytes, text+28, 2);
-	if (check_segment_sanity(twobytes, 2) < 0)
-		return -1;
-	guid->e[2] = (uint8_t)strtoul(twobytes, NULL, 16);
-
-	/* 84be9c3e-8a32-42c0-891c-4cd3b072becc
-	 *			       ^ */
-	memcpy(twobytes, text+30, 2);
-	if (check_segment_sanity(twobytes, 2) < 0)
-		return -1;
-	guid->e[3] = (uint8_t)strtoul(twobytes, NULL, 16);
-
-	/* 84be9c3e-8a32-42c0-891c-4cd3b072becc
-	 *				 ^ */
-	memcpy(twobytes, text+32, 2);
-	if (check_segment_sanity(twobytes, 2) < 0)
-		return -1;
-	guid->e[4] = (uint8_t)strtoul(twobytes, NULL, 16);
-
-	/* 84be9c3e-8a32-42c0-891c-4cd3b072becc
-	 *				   ^ */
-	memcpy(twobytes, text+34, 2);
-	if (check_segment_sanity(twobytes, 2) < 0)
-		return -1;
-	guid->e[5] = (uint8_t)strtoul(twobytes, NULL, 16);
-
-	return 0;
+	return decode_guid_text(text, guid);
 }
 
 #ifndef EFIVAR_GUIDS_H
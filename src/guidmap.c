@@ -0,0 +1,348 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * guidmap.c - hash maps keyed by GUID, or by GUID and name
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "efivar.h"
+
+/*
+ * Open addressing with linear probing, over slots that carry their key's
+ * hash so most mismatches never look at the GUID or the name.  Deletes
+ * leave tombstones, which is what lets a walk delete as it goes; they're
+ * swept out whenever the table is rebuilt.
+ *
+ * Names live in an arena of chunks instead of an allocation each, and
+ * deleted ones are only given back when the table is rebuilt, which also
+ * happens once the arena is mostly garbage.
+ */
+#define GUID_MAP_MIN_SLOTS	16
+#define GUID_MAP_CHUNK_SIZE	4096
+#define GUID_MAP_EMPTY		0
+#define GUID_MAP_TOMBSTONE	1
+
+struct guid_map_slot {
+	uint32_t hash;
+	uint32_t namelen;
+	efi_guid_t guid;
+	const char *name;
+	void *value;
+};
+
+struct guid_map_chunk {
+	struct guid_map_chunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct efi_guid_map {
+	struct guid_map_slot *slots;
+	size_t nslots;
+	size_t nused;
+	size_t ntombstones;
+	struct guid_map_chunk *chunks;
+	size_t name_bytes;
+	size_t wasted_bytes;
+};
+
+/*
+ * A GUID is already about as random as keys get, so folding its two
+ * halves together and finishing with a 64-bit mixer is plenty; names
+ * are run through FNV-1a on the way.  0 and 1 mean empty and deleted,
+ * so real hashes are kept clear of them.
+ */
+static inline uint32_t
+guid_map_hash(const efi_guid_t *guid, const char *name, size_t namelen)
+{
+	const uint8_t *p = (const uint8_t *)name;
+	uint64_t lo, hi, h;
+	uint32_t ret;
+
+	memcpy(&lo, guid, sizeof(lo));
+	memcpy(&hi, (const uint8_t *)guid + sizeof(lo), sizeof(hi));
+	h = (lo * 0x9e3779b97f4a7c15ull) ^ hi;
+	for (size_t i = 0; i < namelen; i++)
+		h = (h ^ p[i]) * 0x100000001b3ull;
+
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebull;
+	h ^= h >> 31;
+
+	ret = (uint32_t)h;
+	return ret > GUID_MAP_TOMBSTONE ? ret : ret + 2;
+}
+
+static const char *
+guid_map_strdup(struct guid_map_chunk **chunks, const char *name,
+		size_t namelen)
+{
+	struct guid_map_chunk *chunk = *chunks;
+	char *ret;
+
+	if (!chunk || chunk->size - chunk->used < namelen + 1) {
+		size_t size = MAX((size_t)GUID_MAP_CHUNK_SIZE, namelen + 1);
+
+		chunk = malloc(sizeof(*chunk) + size);
+		if (!chunk)
+			return NULL;
+		chunk->used = 0;
+		chunk->size = size;
+		chunk->next = *chunks;
+		*chunks = chunk;
+	}
+
+	ret = chunk->data + chunk->used;
+	memcpy(ret, name, namelen);
+	ret[namelen] = '\0';
+	chunk->used += namelen + 1;
+	return ret;
+}
+
+static void
+guid_map_free_chunks(struct guid_map_chunk *chunk)
+{
+	while (chunk) {
+		struct guid_map_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+}
+
+static struct guid_map_slot *
+guid_map_find(const efi_guid_map_t *map, const efi_guid_t *guid,
+	      const char *name, size_t namelen, uint32_t hash)
+{
+	size_t mask = map->nslots - 1;
+	size_t i;
+
+	if (!map->nslots)
+		return NULL;
+
+	for (i = hash & mask; map->slots[i].hash != GUID_MAP_EMPTY;
+	     i = (i + 1) & mask) {
+		struct guid_map_slot *slot = &map->slots[i];
+
+		if (slot->hash == hash && slot->namelen == namelen &&
+		    !memcmp(&slot->guid, guid, sizeof(*guid)) &&
+		    !memcmp(slot->name, name, namelen))
+			return slot;
+	}
+	return NULL;
+}
+
+/*
+ * Build the table over with room for at least nused live entries at no
+ * more than half full, sweeping out the tombstones and moving the names
+ * into a fresh arena.  If that can't be allocated, the old table stays.
+ */
+static int
+guid_map_rebuild(efi_guid_map_t *map, size_t nused)
+{
+	struct guid_map_chunk *chunks = NULL;
+	struct guid_map_slot *slots;
+	size_t nslots = GUID_MAP_MIN_SLOTS;
+
+	while (nslots < nused * 2)
+		nslots <<= 1;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (!slots)
+		return -1;
+
+	for (size_t i = 0; i < map->nslots; i++) {
+		struct guid_map_slot *old = &map->slots[i];
+		size_t j;
+
+		if (old->hash <= GUID_MAP_TOMBSTONE)
+			continue;
+
+		for (j = old->hash & (nslots - 1); slots[j].hash;
+		     j = (j + 1) & (nslots - 1))
+			;
+		slots[j] = *old;
+		slots[j].name = guid_map_strdup(&chunks, old->name,
+						old->namelen);
+		if (!slots[j].name) {
+			guid_map_free_chunks(chunks);
+			free(slots);
+			return -1;
+		}
+	}
+
+	guid_map_free_chunks(map->chunks);
+	free(map->slots);
+	map->chunks = chunks;
+	map->slots = slots;
+	map->nslots = nslots;
+	map->ntombstones = 0;
+	map->wasted_bytes = 0;
+	return 0;
+}
+
+efi_guid_map_t PUBLIC *
+efi_guid_map_new(void)
+{
+	efi_guid_map_t *map;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		efi_error("could not allocate memory");
+	return map;
+}
+
+void PUBLIC
+efi_guid_map_free(efi_guid_map_t *map)
+{
+	if (!map)
+		return;
+
+	guid_map_free_chunks(map->chunks);
+	free(map->slots);
+	free(map);
+}
+
+int NONNULL(1, 2) PUBLIC
+efi_guid_map_set(efi_guid_map_t *map, const efi_guid_t *guid,
+		 const char *name, void *value)
+{
+	struct guid_map_slot *slot;
+	size_t namelen, i;
+	uint32_t hash;
+
+	if (!name)
+		name = "";
+	namelen = strlen(name);
+	if (namelen > UINT32_MAX) {
+		errno = EINVAL;
+		efi_error("name is too long");
+		return -1;
+	}
+
+	hash = guid_map_hash(guid, name, namelen);
+	slot = guid_map_find(map, guid, name, namelen, hash);
+	if (slot) {
+		slot->value = value;
+		return 0;
+	}
+
+	if (((map->nused + map->ntombstones + 1) * 4 > map->nslots * 3 ||
+	     (map->wasted_bytes > GUID_MAP_CHUNK_SIZE &&
+	      map->wasted_bytes > map->name_bytes)) &&
+	    guid_map_rebuild(map, map->nused + 1) < 0) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	for (i = hash & (map->nslots - 1);
+	     map->slots[i].hash > GUID_MAP_TOMBSTONE;
+	     i = (i + 1) & (map->nslots - 1))
+		;
+	slot = &map->slots[i];
+	slot->name = guid_map_strdup(&map->chunks, name, namelen);
+	if (!slot->name) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	if (slot->hash == GUID_MAP_TOMBSTONE)
+		map->ntombstones--;
+	slot->hash = hash;
+	slot->namelen = namelen;
+	slot->guid = *guid;
+	slot->value = value;
+	map->nused++;
+	map->name_bytes += namelen + 1;
+	return 0;
+}
+
+int NONNULL(1, 2) PUBLIC
+efi_guid_map_get(const efi_guid_map_t *map, const efi_guid_t *guid,
+		 const char *name, void **value)
+{
+	struct guid_map_slot *slot;
+	size_t namelen;
+
+	if (!name)
+		name = "";
+	namelen = strlen(name);
+
+	slot = guid_map_find(map, guid, name, namelen,
+			     guid_map_hash(guid, name, namelen));
+	if (!slot) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (value)
+		*value = slot->value;
+	return 0;
+}
+
+int NONNULL(1, 2) PUBLIC
+efi_guid_map_del(efi_guid_map_t *map, const efi_guid_t *guid,
+		 const char *name, void **value)
+{
+	struct guid_map_slot *slot;
+	size_t namelen;
+
+	if (!name)
+		name = "";
+	namelen = strlen(name);
+
+	slot = guid_map_find(map, guid, name, namelen,
+			     guid_map_hash(guid, name, namelen));
+	if (!slot) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (value)
+		*value = slot->value;
+
+	/* the name stays where it is until the next rebuild */
+	slot->hash = GUID_MAP_TOMBSTONE;
+	slot->value = NULL;
+	map->nused--;
+	map->ntombstones++;
+	map->name_bytes -= slot->namelen + 1;
+	map->wasted_bytes += slot->namelen + 1;
+	return 0;
+}
+
+size_t NONNULL(1) PUBLIC
+efi_guid_map_count(const efi_guid_map_t *map)
+{
+	return map->nused;
+}
+
+int NONNULL(1, 2) PUBLIC
+efi_guid_map_next(const efi_guid_map_t *map, size_t *pos,
+		  const efi_guid_t **guid, const char **name, void **value)
+{
+	for (; *pos < map->nslots; (*pos)++) {
+		struct guid_map_slot *slot = &map->slots[*pos];
+
+		if (slot->hash <= GUID_MAP_TOMBSTONE)
+			continue;
+
+		if (guid)
+			*guid = &slot->guid;
+		if (name)
+			*name = slot->name;
+		if (value)
+			*value = slot->value;
+		(*pos)++;
+		return 1;
+	}
+	return 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -8,13 +8,111 @@
 
 #include <ctype.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "compiler.h"
 #include "util.h"
 
+/*
+ * The two hex digits for every byte value, so a dumper can emit a byte
+ * with one lookup.
+ */
+static const char UNUSED hexdump_pairs[] =
+	"000102030405060708090a0b0c0d0e0f"
+	"101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f"
+	"303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f"
+	"505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f"
+	"707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f"
+	"909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+	"b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+	"d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+	"f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static inline char UNUSED
+hexdump_char(uint8_t c)
+{
+	return safe_to_print(c) ? (char)c : '.';
+}
+
+/*
+ * The longest line hexdump_line() writes: 16 digits of offset, the hex
+ * and text columns, and the spaces between them.
+ */
+#define HEXDUMP_LINE_MAX	96
+
+/*
+ * hexdump_line(): render a whole line of a dump into buf, without the
+ * newline: the display offset, the hex for up to 16 bytes, and the
+ * |text| for them, laid out the same as prepare_hex() and
+ * prepare_text() do.  position says where in the line the first byte
+ * goes; pad fills the text column out to its full width.  Stores the
+ * number of bytes of data used in *used and returns the line length.
+ */
+static inline size_t UNUSED
+hexdump_line(char *buf, const uint8_t *data, unsigned long size,
+	     unsigned long position, unsigned long display_offset, bool pad,
+	     unsigned long *used)
+{
+	unsigned long before = position % 16;
+	unsigned long n = (before + size >= 16) ? 16 - before : size;
+	int digits = 8;
+	char *p = buf;
+	unsigned long i;
+
+	while (digits < 16 && (display_offset >> (4 * digits)) != 0)
+		digits++;
+	for (int d = digits - 1; d >= 0; d--)
+		*p++ = hexdump_pairs[((display_offset >> (4 * d)) & 0xf) * 2 + 1];
+	*p++ = ' ';
+	*p++ = ' ';
+
+	for (i = 0; i < 16; i++) {
+		if (i < before || i >= before + n) {
+			*p++ = ' ';
+			*p++ = ' ';
+		} else {
+			memcpy(p, &hexdump_pairs[data[i - before] * 2], 2);
+			p += 2;
+		}
+		if (i != 15)
+			*p++ = ' ';
+		if (i == 7)
+			*p++ = ' ';
+	}
+	*p++ = ' ';
+	*p++ = ' ';
+
+	if (n > 0) {
+		for (i = 0; i < before; i++)
+			*p++ = ' ';
+		*p++ = '|';
+		for (i = 0; i < n; i++)
+			*p++ = hexdump_char(data[i]);
+		*p++ = '|';
+	}
+	if (pad) {
+		size_t textsz = n > 0 ? before + n + 2 : 0;
+
+		for (i = textsz; i < 18; i++)
+			*p++ = ' ';
+	}
+
+	*used = n;
+	return p - buf;
+}
+
 /*
  * prepare_hex(): writes the address of the region being dumped and the hex
  * representation into a line buffer
@@ -95,32 +193,62 @@ prepare_text(void *data, size_t size, char *buf, int position)
 /*
  * variadic fhexdump formatted
  * think of it as: fprintf(f, %s%s\n", vformat(fmt, ap), hexdump(data,size));
+ *
+ * Lines are rendered into one buffer and written out when it fills up.
  */
 static inline void UNUSED
 vfhexdumpf(FILE *f, const char *const fmt, uint8_t *data, unsigned long size,
            size_t at, va_list ap)
 {
+	char outbuf[16384];
+	size_t outlen = 0;
+	char *prefix = NULL;
+	size_t prefixsz = 0;
 	unsigned long display_offset = at;
 	unsigned long offset = 0;
+	va_list aq;
+	int rc;
+
+	va_copy(aq, ap);
+	rc = vsnprintf(NULL, 0, fmt, aq);
+	va_end(aq);
+	if (rc < 0)
+		return;
+	if (rc > 0) {
+		prefixsz = rc;
+		prefix = malloc(prefixsz + 1);
+		if (!prefix)
+			return;
+		va_copy(aq, ap);
+		vsnprintf(prefix, prefixsz + 1, fmt, aq);
+		va_end(aq);
+	}
 
 	while (offset < size) {
-		char hexbuf[49];
-		char txtbuf[19];
 		unsigned long sz;
 
-		sz = prepare_hex(data+offset, size-offset, hexbuf,
-				 (unsigned long)data+offset);
-		if (sz == 0)
-			return;
+		if (outlen + prefixsz + HEXDUMP_LINE_MAX + 1 > sizeof(outbuf)) {
+			fwrite(outbuf, 1, outlen, f);
+			outlen = 0;
+		}
+		if (prefixsz + HEXDUMP_LINE_MAX + 1 > sizeof(outbuf))
+			fwrite(prefix, 1, prefixsz, f);
+		else if (prefixsz) {
+			memcpy(outbuf + outlen, prefix, prefixsz);
+			outlen += prefixsz;
+		}
 
-		prepare_text(data+offset, size-offset, txtbuf,
-			     (unsigned long)data+offset);
-		vfprintf(f, fmt, ap);
-		fprintf(f, "%08lx  %s  %s\n", display_offset, hexbuf, txtbuf);
+		outlen += hexdump_line(outbuf + outlen, data + offset,
+				       size - offset,
+				       (unsigned long)data + offset,
+				       display_offset, false, &sz);
+		outbuf[outlen++] = '\n';
 
 		display_offset += sz;
 		offset += sz;
 	}
+	fwrite(outbuf, 1, outlen, f);
+	free(prefix);
 	fflush(f);
 }
 
@@ -19,11 +19,46 @@ extern "C" {
 #define EFIBOOT_OPTIONS_WRITE_SIGNATURE	0x00000020
 #define EFIBOOT_OPTIONS_IGNORE_PMBR_ERR	0x00000040
 
+/*
+ * If LIBEFIBOOT_DEVICE_CACHE is set in the environment, the disk part of
+ * generated device paths is remembered across processes in that
+ * directory (/run/efivar if it's empty), and reused until udev sees the
+ * disk change.
+ */
 extern ssize_t efi_generate_file_device_path(uint8_t *buf, ssize_t size,
 					     const char * const filepath,
 					     uint32_t options, ...)
 	__attribute__((__nonnull__ (3)));
 
+/*
+ * Generate device paths for n files at once, sharing the work for files
+ * on the same device.  Each dps[i] is allocated and dp_sizes[i] set to
+ * its size, or NULL and -1 if that one failed.  Returns 0 if they all
+ * worked and -1 otherwise.
+ */
+extern int efi_generate_file_device_paths(const char * const *filepaths,
+					  size_t n, uint8_t **dps,
+					  ssize_t *dp_sizes,
+					  uint32_t options, ...)
+	__attribute__((__nonnull__ (1, 3, 4)))
+	__attribute__((__visibility__ ("default")));
+
+/*
+ * For a file on an md RAID1 array or a partition of one, such as an ESP
+ * mirrored across two disks, generate a device path for each disk the
+ * array is on, pointing at that disk's copy of the file, since the
+ * firmware doesn't know about md and can boot from whichever disk still
+ * works.  *dps and *dp_sizes are allocated arrays of *n entries, filled
+ * in the way efi_generate_file_device_paths() does; free each of *dps
+ * and both arrays.  Returns 0 if every member worked and -1 otherwise.
+ */
+extern int efi_generate_md_file_device_paths(const char * const filepath,
+					     uint8_t ***dps,
+					     ssize_t **dp_sizes, size_t *n,
+					     uint32_t options, ...)
+	__attribute__((__nonnull__ (1, 2, 3, 4)))
+	__attribute__((__visibility__ ("default")));
+
 extern ssize_t efi_generate_file_device_path_from_esp(uint8_t *buf,
 						      ssize_t size,
 						      const char *devpath,
@@ -47,6 +82,50 @@ extern ssize_t efi_generate_ipv4_device_path(uint8_t *buf, ssize_t size,
 	__attribute__((__nonnull__ (3,4,5,6,7)))
 	__attribute__((__visibility__ ("default")));
 
+/*
+ * Network boot paths are the NIC's PciRoot()/Pci() nodes (when it has
+ * them) and its MAC() node, followed by an IPv4() or IPv6() node.
+ * Addresses are strings, and "" is the all-zeros address.  An empty
+ * netmask or a zero prefix_length with a local address given means the
+ * one the interface has for that address.  Ports and protocols are in
+ * host byte order.
+ *
+ * While efi_sysfs_cache_enable() is in effect, what the system says about
+ * its interfaces is looked up once, and each NIC's MAC() path is made
+ * once, until efi_sysfs_cache_disable().
+ */
+extern ssize_t efi_generate_ipv6_device_path(uint8_t *buf, ssize_t size,
+					     const char * const ifname,
+					     const char * const local_addr,
+					     const char * const remote_addr,
+					     const char * const gateway_addr,
+					     uint8_t prefix_length,
+					     uint16_t local_port,
+					     uint16_t remote_port,
+					     uint16_t protocol,
+					     uint8_t addr_origin)
+	__attribute__((__nonnull__ (3,4,5,6)))
+	__attribute__((__visibility__ ("default")));
+
+/*
+ * An iSCSI() path to target_name at remote_addr, which can be IPv4 or
+ * IPv6.  With local_addr "", the firmware gets its address from DHCP,
+ * and otherwise it's static, with the interface's netmask or prefix
+ * length for it.  remote_port 0 means 3260, and options are the
+ * EFIDP_ISCSI_* bits.
+ */
+extern ssize_t efi_generate_iscsi_device_path(uint8_t *buf, ssize_t size,
+					      const char * const ifname,
+					      const char * const local_addr,
+					      const char * const remote_addr,
+					      uint16_t remote_port,
+					      const char * const target_name,
+					      uint64_t lun,
+					      uint16_t tpgt,
+					      uint16_t options)
+	__attribute__((__nonnull__ (3,4,5,7)))
+	__attribute__((__visibility__ ("default")));
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -20,12 +20,91 @@ extern ssize_t efi_loadopt_create(uint8_t *buf, ssize_t size,
 				  size_t optional_data_size)
 	__attribute__((__nonnull__ (6)));
 
+/*
+ * A builder writes load options one after another into a buffer that
+ * grows as it needs to, working out each one's size only once.
+ * efi_loadopt_builder_add() takes a device path that's already been
+ * made; efi_loadopt_builder_add_file() makes one for filepath the way
+ * efi_generate_file_device_path() does, and
+ * efi_loadopt_builder_add_files() does that for n files at once, sharing
+ * the work for files on the same disk, with descriptions[i] and, if the
+ * arrays aren't NULL, optional_data[i] and optional_data_sizes[i] for
+ * each.  The options and any arguments after them are the ones the
+ * device path generators take.  Nothing is added unless everything
+ * works.
+ *
+ * The _add() calls return the index of the first new option, for
+ * efi_loadopt_builder_get(), which returns the finished option, ready to
+ * be written as a Boot#### variable, and sets *size to its size.  It's
+ * only good until the next call that adds to the builder.
+ */
+typedef struct efi_loadopt_builder efi_loadopt_builder_t;
+
+extern int efi_loadopt_builder_new(efi_loadopt_builder_t **builder)
+	__attribute__((__nonnull__ (1)))
+	__attribute__((__visibility__ ("default")));
+extern ssize_t efi_loadopt_builder_add(efi_loadopt_builder_t *builder,
+				       uint32_t attributes, const_efidp dp,
+				       ssize_t dp_size,
+				       const unsigned char *description,
+				       const uint8_t *optional_data,
+				       size_t optional_data_size)
+	__attribute__((__nonnull__ (1, 5)))
+	__attribute__((__visibility__ ("default")));
+extern ssize_t efi_loadopt_builder_add_file(efi_loadopt_builder_t *builder,
+					    uint32_t attributes,
+					    const char *filepath,
+					    const unsigned char *description,
+					    const uint8_t *optional_data,
+					    size_t optional_data_size,
+					    uint32_t options, ...)
+	__attribute__((__nonnull__ (1, 3, 4)))
+	__attribute__((__visibility__ ("default")));
+extern ssize_t efi_loadopt_builder_add_files(efi_loadopt_builder_t *builder,
+					     size_t n,
+					     const char * const *filepaths,
+					     const unsigned char * const *descriptions,
+					     uint32_t attributes,
+					     const uint8_t * const *optional_data,
+					     const size_t *optional_data_sizes,
+					     uint32_t options, ...)
+	__attribute__((__nonnull__ (1, 3, 4)))
+	__attribute__((__visibility__ ("default")));
+extern size_t efi_loadopt_builder_count(efi_loadopt_builder_t *builder)
+	__attribute__((__nonnull__ (1)))
+	__attribute__((__visibility__ ("default")));
+extern efi_load_option *efi_loadopt_builder_get(efi_loadopt_builder_t *builder,
+						size_t n, size_t *size)
+	__attribute__((__nonnull__ (1, 3)))
+	__attribute__((__visibility__ ("default")));
+extern void efi_loadopt_builder_reset(efi_loadopt_builder_t *builder)
+	__attribute__((__nonnull__ (1)))
+	__attribute__((__visibility__ ("default")));
+extern void efi_loadopt_builder_free(efi_loadopt_builder_t *builder)
+	__attribute__((__visibility__ ("default")));
+
 extern efidp efi_loadopt_path(efi_load_option *opt, ssize_t limit)
 	__attribute__((__nonnull__ (1)));
 extern const unsigned char * efi_loadopt_desc(efi_load_option *opt,
 					      ssize_t limit)
 	__attribute__((__visibility__ ("default")))
 	__attribute__((__nonnull__ (1)));
+
+/*
+ * Re-entrant versions of efi_loadopt_desc().  efi_loadopt_desc_r()
+ * writes the UTF-8 description into buf and returns its length the way
+ * snprintf() does; efi_loadopt_desc_ucs2() just returns where the UCS-2
+ * description is in opt, which may not be 2-byte aligned, and sets *len to
+ * its length in characters, not counting the NUL.
+ */
+extern ssize_t efi_loadopt_desc_r(efi_load_option *opt, ssize_t limit,
+				  unsigned char *buf, size_t bufsz)
+	__attribute__((__visibility__ ("default")))
+	__attribute__((__nonnull__ (1)));
+extern const void * efi_loadopt_desc_ucs2(efi_load_option *opt,
+					  ssize_t limit, size_t *len)
+	__attribute__((__visibility__ ("default")))
+	__attribute__((__nonnull__ (1, 3)));
 extern uint32_t efi_loadopt_attrs(efi_load_option *opt)
 	__attribute__((__nonnull__ (1)))
 	__attribute__((__visibility__ ("default")));
@@ -63,6 +142,91 @@ extern int efi_loadopt_is_valid(efi_load_option *opt, size_t size)
 	__attribute__((__nonnull__ (1)))
 	__attribute__((__visibility__ ("default")));
 
+/*
+ * One entry from efi_loadopt_entries().  If the variable couldn't be
+ * read, data is NULL and error is the errno that said why (ENOENT for
+ * entries the order names that don't exist).  If it was read but isn't
+ * a valid load option, valid is 0 and only the number, data, and
+ * data_size are filled in.  Everything else points into data or into
+ * allocations freed with the entry.
+ */
+typedef struct {
+	uint16_t number;
+	int valid;
+	int error;
+	uint32_t attributes;
+	const unsigned char *description;
+	const unsigned char *path;
+	const uint8_t *optional_data;
+	size_t optional_data_size;
+	efi_load_option *data;
+	size_t data_size;
+} efi_loadopt_entry_t;
+
+/*
+ * Read every <kind>#### variable named in <kind>Order, where kind is
+ * "Boot", "Driver", or "SysPrep", and decode them into an array in that
+ * order.  The variables are read by several threads at once.  A missing
+ * order variable is an empty list.
+ */
+extern int efi_loadopt_entries(const char *kind,
+			       efi_loadopt_entry_t **entries,
+			       size_t *n_entries)
+	__attribute__((__nonnull__ (1, 2, 3)))
+	__attribute__((__visibility__ ("default")));
+extern void efi_loadopt_entries_free(efi_loadopt_entry_t *entries,
+				     size_t n_entries)
+	__attribute__((__visibility__ ("default")));
+
+/*
+ * Which <kind>#### numbers are in use, found by listing the variables
+ * once, and counting anything in <kind>Order as well.
+ * efi_loadopt_slot_alloc() hands out the lowest free number and marks it
+ * used, failing with ENOSPC once there aren't any; nothing is written
+ * until the caller creates the variable.  efi_loadopt_slot_release()
+ * gives a number back.
+ */
+typedef struct efi_loadopt_slots efi_loadopt_slots_t;
+
+extern int efi_loadopt_slots_scan(const char *kind,
+				  efi_loadopt_slots_t **slots)
+	__attribute__((__nonnull__ (1, 2)))
+	__attribute__((__visibility__ ("default")));
+extern int efi_loadopt_slot_used(efi_loadopt_slots_t *slots,
+				 uint16_t number)
+	__attribute__((__nonnull__ (1)))
+	__attribute__((__visibility__ ("default")));
+extern int efi_loadopt_slot_alloc(efi_loadopt_slots_t *slots,
+				  uint16_t *number)
+	__attribute__((__nonnull__ (1, 2)))
+	__attribute__((__visibility__ ("default")));
+extern void efi_loadopt_slot_release(efi_loadopt_slots_t *slots,
+				     uint16_t number)
+	__attribute__((__nonnull__ (1)))
+	__attribute__((__visibility__ ("default")));
+extern void efi_loadopt_slots_free(efi_loadopt_slots_t *slots)
+	__attribute__((__visibility__ ("default")));
+
+/*
+ * Change <kind>Order, writing it only if that changes it.  These return
+ * 1 if it was written and 0 if it was already right.
+ * efi_loadopt_order_insert() moves number to position, or adds it there
+ * if it isn't in the order yet; a position past the end means the end.
+ * efi_loadopt_order_remove() takes it out.  Both fail with EAGAIN if the
+ * order changed while they were working on it.
+ */
+extern int efi_loadopt_order_set(const char *kind, const uint16_t *order,
+				 size_t n)
+	__attribute__((__nonnull__ (1)))
+	__attribute__((__visibility__ ("default")));
+extern int efi_loadopt_order_insert(const char *kind, uint16_t number,
+				    size_t position)
+	__attribute__((__nonnull__ (1)))
+	__attribute__((__visibility__ ("default")));
+extern int efi_loadopt_order_remove(const char *kind, uint16_t number)
+	__attribute__((__nonnull__ (1)))
+	__attribute__((__visibility__ ("default")));
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
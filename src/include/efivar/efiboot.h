@@ -27,6 +27,27 @@ extern "C" {
 extern uint32_t efi_get_libefiboot_version(void)
 	__attribute__((__visibility__("default")));
 
+/*
+ * Partition tables read while generating device paths are cached per
+ * disk.  A changed primary GPT header is noticed on its own; this drops
+ * everything, e.g. after repartitioning a disk in a way that might not.
+ */
+extern void efi_gpt_cache_flush(void)
+	__attribute__((__visibility__("default")));
+
+/*
+ * sysfs reads made while probing a device are remembered for the rest of
+ * that lookup, and so are the nodes made for the disk in front of a
+ * partition's HD().  Enabling this keeps them for the life of the
+ * process, or until it's disabled again, which is worthwhile when
+ * generating paths for many partitions or devices that share a parent
+ * and nothing is being hotplugged.
+ */
+extern void efi_sysfs_cache_enable(void)
+	__attribute__((__visibility__("default")));
+extern void efi_sysfs_cache_disable(void)
+	__attribute__((__visibility__("default")));
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
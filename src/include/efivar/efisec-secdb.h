@@ -57,6 +57,58 @@ extern int efi_secdb_set_bool(efi_secdb_t *secdb,
 extern int efi_secdb_parse(uint8_t *data,
 			   size_t datasz,
 			   efi_secdb_t **secdbp);
+/*
+ * Like efi_secdb_parse(), but reading the database from fd as it goes, so
+ * only one signature of it is ever in memory that isn't in the secdb.
+ * Malformed lists can't be corrected since we can't go back, so they're
+ * an error.
+ */
+extern int efi_secdb_parse_fd(int fd, efi_secdb_t **secdbp);
+/*
+ * Like efi_secdb_parse(), but without copying anything: signatures are
+ * used where they are in data, duplicates and all, so data must not
+ * change or go away before the secdb is freed.  Adding or deleting copies
+ * just the sublists that change.  Malformed lists can't be corrected in
+ * place, so they're an error.
+ */
+extern int efi_secdb_parse_view(const uint8_t *data,
+				size_t datasz,
+				efi_secdb_t **secdbp);
+/*
+ * Returns 1 if secdb has a signature of this algorithm with this data,
+ * and this owner if owner isn't NULL, 0 if it doesn't, and -1 on error.
+ */
+extern int efi_secdb_has_entry(efi_secdb_t *secdb,
+			       const efi_guid_t *owner,
+			       efi_secdb_type_t algorithm,
+			       efi_secdb_data_t *data,
+			       size_t datasz);
+/*
+ * efi_secdb_has_entry() with any owner.  Each sublist is hashed the first
+ * time it's asked about, so checking many binaries against one dbx costs
+ * about the same per check no matter how big it is.
+ */
+extern int efi_secdb_contains(efi_secdb_t *secdb,
+			      efi_secdb_type_t algorithm,
+			      efi_secdb_data_t *data,
+			      size_t datasz);
+/*
+ * Make *updatep a new secdb holding just the signatures in target that
+ * current doesn't have, so that writing it to a variable holding current
+ * with EFI_VARIABLE_APPEND_WRITE leaves target there.  An append can't
+ * take anything away, so this returns 1 if current has signatures target
+ * doesn't, 0 if it doesn't, and -1 on error.
+ */
+extern int efi_secdb_diff(efi_secdb_t *current,
+			  efi_secdb_t *target,
+			  efi_secdb_t **updatep);
+/*
+ * Add copies of src's signatures to dst as if src's lists had been parsed
+ * into it, so parsing several databases each into its own secdb and
+ * merging them in order gives the same secdb as parsing them all into
+ * one.  src isn't changed.
+ */
+extern int efi_secdb_merge(efi_secdb_t *dst, efi_secdb_t *src);
 extern int efi_secdb_add_entry(efi_secdb_t *secdb,
 			       const efi_guid_t *owner,
 			       efi_secdb_type_t algorithm,
@@ -71,6 +123,14 @@ extern int efi_secdb_realize(efi_secdb_t *secdb,
 			     /* caller owns out */
 			     void **out,
 			     size_t *outsize);
+/*
+ * Realize into buf without allocating.  If it doesn't fit, this fails
+ * with errno set to ENOSPC and *outsize set to the size needed.
+ */
+extern int efi_secdb_realize_into(efi_secdb_t *secdb,
+				  void *buf,
+				  size_t bufsz,
+				  size_t *outsize);
 extern void efi_secdb_free(efi_secdb_t *secdb);
 
 typedef enum {
@@ -94,6 +154,64 @@ extern int efi_secdb_visit_entries(efi_secdb_t *secdb,
 				   efi_secdb_visitor_t *visitor,
 				   void *closure);
 
+/*
+ * The parts of an X.509 certificate that say whose it is, all pointing
+ * into the certificate.  issuer and subject are whole DER Names, tag and
+ * length included, so one certificate's issuer compares byte for byte
+ * with its signer's subject; serial is the INTEGER's contents; and
+ * spki_sha256 is the SHA-256 of the whole DER SubjectPublicKeyInfo, the
+ * same as a "pin-sha256" key pin.
+ */
+typedef struct {
+	const efi_guid_t *owner;
+	const uint8_t *der;
+	size_t der_size;
+	const uint8_t *serial;
+	size_t serial_size;
+	const uint8_t *issuer;
+	size_t issuer_size;
+	const uint8_t *subject;
+	size_t subject_size;
+	const uint8_t *spki;
+	size_t spki_size;
+	efi_sha256_hash_t spki_sha256;
+} efi_x509_cert_t;
+
+typedef enum {
+	EFI_X509_SUBJECT,
+	EFI_X509_ISSUER,
+	EFI_X509_SERIAL,
+	EFI_X509_SPKI_SHA256,
+	MAX_EFI_X509_FIELD
+} efi_x509_field_t;
+
+/*
+ * Fill in cert from the DER certificate at der, with no owner.  Nothing
+ * is checked past the fields being where a certificate keeps them, and
+ * nothing is copied, so der has to stay around.  Returns 0, or -1 with
+ * errno set to EINVAL if it isn't a certificate.
+ */
+extern int efi_x509_parse(const uint8_t *der, size_t dersz,
+			  efi_x509_cert_t *cert);
+/*
+ * Find the X509_CERT signatures in secdb whose field is value.  Start
+ * with *pos set to 0; each call sets *cert to the next match and returns
+ * 1, and then returns 0 once there aren't any more.  Certificates that
+ * can't be parsed are never found.
+ *
+ * The first call indexes every certificate in secdb, and the index is
+ * kept until secdb is changed, so later lookups cost about the same no
+ * matter how many certificates there are.  *cert is good until then as
+ * well.  Lookups against an index that's already built don't change
+ * anything, so threads can share a secdb once one lookup has been done.
+ */
+extern int efi_secdb_find_cert(efi_secdb_t *secdb,
+			       efi_x509_field_t field,
+			       const void *value,
+			       size_t valuesz,
+			       size_t *pos,
+			       const efi_x509_cert_t **cert);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -476,6 +476,17 @@ typedef struct {
 #define EFIDP_IPv6_ORIGIN_AUTOCONF	0x01
 #define EFIDP_IPv6_ORIGIN_STATEFUL	0x02
 
+/*
+ * Addresses are 16 bytes in network byte order, or NULL for ::; ports and
+ * the protocol are in host byte order.  This makes the full 60 byte node,
+ * including the gateway address.
+ */
+extern ssize_t efidp_make_ipv6(uint8_t *buf, ssize_t size,
+			       const uint8_t *local, const uint8_t *remote,
+			       uint16_t local_port, uint16_t remote_port,
+			       uint16_t protocol, uint8_t addr_origin,
+			       uint8_t prefix_length, const uint8_t *gateway);
+
 #define EFIDP_MSG_VLAN		0x14
 typedef struct {
 	efidp_header	header;
@@ -637,6 +648,13 @@ typedef struct {
 
 #define EFIDP_ISCSI_MAX_TARGET_NAME_LEN		223
 
+/* lun is in host byte order; options are the EFIDP_ISCSI_* bits above */
+extern ssize_t efidp_make_iscsi(uint8_t *buf, ssize_t size,
+				const char *target_name, uint64_t lun,
+				uint16_t tpgt, uint16_t options,
+				uint16_t protocol)
+	__attribute__((__nonnull__ (3)));
+
 #define EFIDP_MSG_NVME		0x17
 typedef struct {
 	efidp_header	header;
@@ -894,6 +912,39 @@ extern int efidp_append_path(const_efidp dp0, const_efidp dp1, efidp *out);
 extern int efidp_append_node(const_efidp dp, const_efidp dn, efidp *out);
 extern int efidp_append_instance(const_efidp dp, const_efidp dpi, efidp *out);
 
+/*
+ * A device path that grows in place, for building one a node at a time
+ * without copying everything for each node.  The _append() calls work
+ * like the efidp_append_*() ones above.  To use the efidp_make_*()
+ * functions, ask for space with efidp_builder_reserve(), which returns
+ * NULL on error and is good until the next call, make the node there,
+ * and then efidp_builder_advance() over it.  efidp_builder_finish() adds
+ * the End Entire node and hands over the path, to be freed with free(),
+ * leaving the builder empty again.
+ */
+typedef struct efidp_builder efidp_builder_t;
+
+extern int efidp_builder_new(efidp_builder_t **builder)
+			__attribute__((__nonnull__ (1)));
+extern uint8_t *efidp_builder_reserve(efidp_builder_t *builder, size_t size)
+			__attribute__((__nonnull__ (1)));
+extern int efidp_builder_advance(efidp_builder_t *builder, size_t size)
+			__attribute__((__nonnull__ (1)));
+extern int efidp_builder_append_node(efidp_builder_t *builder,
+				     const_efidp dn)
+			__attribute__((__nonnull__ (1, 2)));
+extern int efidp_builder_append_path(efidp_builder_t *builder,
+				     const_efidp dp)
+			__attribute__((__nonnull__ (1, 2)));
+extern int efidp_builder_append_instance(efidp_builder_t *builder,
+					 const_efidp dp)
+			__attribute__((__nonnull__ (1, 2)));
+extern ssize_t efidp_builder_size(efidp_builder_t *builder)
+			__attribute__((__nonnull__ (1)));
+extern ssize_t efidp_builder_finish(efidp_builder_t *builder, efidp *out)
+			__attribute__((__nonnull__ (1, 2)));
+extern void efidp_builder_free(efidp_builder_t *builder);
+
 #if defined(__clang__)
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpointer-bool-conversion"
@@ -1195,6 +1246,61 @@ efidp_is_valid(const_efidp dp, ssize_t limit)
 	return 1;
 }
 
+/*
+ * Checks a whole device path once, and makes an index of where each of
+ * its nodes is, so they can be looked at again without walking the path.
+ * Entry n is node n, counting the End nodes; instance is which instance
+ * it's in, from 0.  efidp_index_find() returns the number of the first
+ * node with that type and subtype, and efidp_index_find_next() the next
+ * one of the same kind after node n; both are -1 with errno set to
+ * ENOENT when there isn't one.  The path has to stay around as long as
+ * the index does.
+ */
+typedef struct {
+	size_t offset;
+	uint16_t length;
+	uint8_t type;
+	uint8_t subtype;
+	unsigned int instance;
+} efidp_index_entry_t;
+
+typedef struct efidp_index efidp_index_t;
+
+extern int efidp_index_new(const_efidp dp, ssize_t limit,
+			   efidp_index_t **index)
+			__attribute__((__nonnull__ (1, 3)));
+extern size_t efidp_index_count(const efidp_index_t *index)
+			__attribute__((__nonnull__ (1)));
+extern unsigned int efidp_index_instances(const efidp_index_t *index)
+			__attribute__((__nonnull__ (1)));
+extern ssize_t efidp_index_size(const efidp_index_t *index)
+			__attribute__((__nonnull__ (1)));
+extern const efidp_index_entry_t *efidp_index_entry(const efidp_index_t *index,
+						    size_t n)
+			__attribute__((__nonnull__ (1)));
+extern const_efidp efidp_index_node(const efidp_index_t *index, size_t n)
+			__attribute__((__nonnull__ (1)));
+extern ssize_t efidp_index_find(const efidp_index_t *index,
+				uint8_t type, uint8_t subtype)
+			__attribute__((__nonnull__ (1)));
+extern ssize_t efidp_index_find_next(const efidp_index_t *index, size_t n)
+			__attribute__((__nonnull__ (1)));
+extern void efidp_index_free(efidp_index_t *index);
+
+/*
+ * Compares device paths for whether they point at the same thing, the
+ * way firmware would match them, and returns <0, 0, or >0 like memcmp().
+ * A short form path starting at an HD() node is the same as the full
+ * path to that partition, HD() nodes are compared by their partition
+ * signatures, and File() names ignore ASCII case and which way their
+ * slashes lean.  Paths that compare equal always have the same
+ * efidp_hash().  Both expect paths that have passed efidp_is_valid().
+ */
+extern int efidp_compare(const_efidp dp0, const_efidp dp1)
+			__attribute__((__nonnull__ (1, 2)));
+extern uint64_t efidp_hash(const_efidp dp)
+			__attribute__((__nonnull__ (1)));
+
 /* and now, printing and parsing */
 extern ssize_t efidp_parse_device_node(unsigned char *path,
 				       efidp out, size_t size);
@@ -1202,6 +1308,13 @@ extern ssize_t efidp_parse_device_path(unsigned char *path,
 				       efidp out, size_t size);
 extern ssize_t efidp_format_device_path(unsigned char *buf, size_t size,
 					const_efidp dp, ssize_t limit);
+/*
+ * Like efidp_format_device_path(), but into a new allocation in *bufp
+ * that the caller frees, normally in one pass.
+ */
+extern ssize_t efidp_format_device_path_alloc(unsigned char **bufp,
+					      const_efidp dp, ssize_t limit)
+	__attribute__((__nonnull__ (1)));
 extern ssize_t efidp_make_vendor(uint8_t *buf, ssize_t size, uint8_t type,
 				 uint8_t subtype,  efi_guid_t vendor_guid,
 				 void *data, size_t data_size);
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * efivar-guidmap.h - hash maps keyed by GUID, or by GUID and name
+ */
+
+#ifndef EFIVAR_GUIDMAP_H_
+#define EFIVAR_GUIDMAP_H_ 1
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * An efi_guid_map_t maps a GUID and an optional name, such as a
+ * variable's, to a pointer the caller owns.  A NULL name is the same key
+ * as "".  The map keeps its own copies of the names, so the caller's
+ * don't need to stay around.
+ *
+ * efi_guid_map_get() and efi_guid_map_del() return 0 on success and -1
+ * with errno set to ENOENT if the key isn't there, without recording an
+ * error, since missing keys are usually expected.
+ *
+ * efi_guid_map_next() walks the map in no particular order, starting
+ * with *pos set to 0, and returns 1 for each entry and then 0.  The
+ * entry it just returned may be deleted during the walk, but anything
+ * added may or may not be seen, and may cause others to be seen twice.
+ */
+typedef struct efi_guid_map efi_guid_map_t;
+
+extern efi_guid_map_t *efi_guid_map_new(void);
+extern void efi_guid_map_free(efi_guid_map_t *map);
+extern int efi_guid_map_set(efi_guid_map_t *map, const efi_guid_t *guid,
+			    const char *name, void *value)
+			    __attribute__((__nonnull__ (1, 2)));
+extern int efi_guid_map_get(const efi_guid_map_t *map, const efi_guid_t *guid,
+			    const char *name, void **value)
+			    __attribute__((__nonnull__ (1, 2)));
+extern int efi_guid_map_del(efi_guid_map_t *map, const efi_guid_t *guid,
+			    const char *name, void **value)
+			    __attribute__((__nonnull__ (1, 2)));
+extern size_t efi_guid_map_count(const efi_guid_map_t *map)
+			    __attribute__((__nonnull__ (1)));
+extern int efi_guid_map_next(const efi_guid_map_t *map, size_t *pos,
+			     const efi_guid_t **guid, const char **name,
+			     void **value)
+			     __attribute__((__nonnull__ (1, 2)));
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* !EFIVAR_GUIDMAP_H_ */
+
+// vim:fenc=utf-8:tw=75:noet
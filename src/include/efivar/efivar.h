@@ -37,17 +37,53 @@ extern int efi_get_variable_size(efi_guid_t guid, const char *name,
 extern int efi_get_variable_attributes(efi_guid_t, const char *name,
 				       uint32_t *attributes)
 				__attribute__((__nonnull__ (2, 3)));
+/*
+ * Get a variable's data size and attributes together, without reading
+ * its data.
+ */
+extern int efi_get_variable_info(efi_guid_t guid, const char *name,
+				 size_t *size, uint32_t *attributes)
+				__attribute__((__nonnull__ (2, 3, 4)));
 extern int efi_get_variable_exists(efi_guid_t, const char *name)
 				__attribute__((__nonnull__ (2)));
 extern int efi_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 			    size_t *data_size, uint32_t *attributes)
 				__attribute__((__nonnull__ (2, 3, 4, 5)));
+/*
+ * Read a variable into buf without allocating.  If it doesn't fit, this
+ * fails with errno set to ENOSPC and *data_size set to the size needed.
+ */
+extern int efi_get_variable_into(efi_guid_t guid, const char *name,
+				 uint8_t *buf, size_t bufsz, size_t *data_size,
+				 uint32_t *attributes)
+				__attribute__((__nonnull__ (2, 5, 6)));
 extern int efi_del_variable(efi_guid_t guid, const char *name)
 				__attribute__((__nonnull__ (2)));
 extern int efi_set_variable(efi_guid_t guid, const char *name,
 			    uint8_t *data, size_t data_size,
 			    uint32_t attributes, mode_t mode)
 				__attribute__((__nonnull__ (2, 3)));
+/*
+ * Set a variable only if that would change it, to spare the flash.
+ * Returns 1 if it was written and 0 if it already held data with
+ * attributes.  Appends and authenticated writes are always written.
+ */
+extern int efi_set_variable_if_changed(efi_guid_t guid, const char *name,
+				       const uint8_t *data, size_t data_size,
+				       uint32_t attributes, mode_t mode)
+				__attribute__((__nonnull__ (2)));
+/*
+ * The same, but only if the variable currently holds old_data with
+ * old_attributes, or doesn't exist if old_data is NULL; otherwise this
+ * fails with errno set to EAGAIN.  The check and the write are not
+ * atomic with respect to other writers.
+ */
+extern int efi_set_variable_cas(efi_guid_t guid, const char *name,
+				const uint8_t *old_data, size_t old_data_size,
+				uint32_t old_attributes,
+				const uint8_t *data, size_t data_size,
+				uint32_t attributes, mode_t mode)
+				__attribute__((__nonnull__ (2)));
 extern int efi_append_variable(efi_guid_t guid, const char *name,
 			       uint8_t *data, size_t data_size,
 			       uint32_t attributes)
@@ -57,10 +93,181 @@ extern int efi_get_next_variable_name(efi_guid_t **guid, char **name)
 extern int efi_chmod_variable(efi_guid_t guid, const char *name, mode_t mode)
 			      __attribute__((__nonnull__ (2)));
 
+/*
+ * Like efi_get_next_variable_name(), but each iterator has its own
+ * position and buffers, so iterators can be used from several threads
+ * or nested inside one another.  guid and name stay valid until the next
+ * call to efi_varname_iter_next() or efi_varname_iter_free().
+ */
+typedef struct efi_varname_iter efi_varname_iter_t;
+
+extern int efi_varname_iter_new(efi_varname_iter_t **iter)
+			      __attribute__((__nonnull__ (1)));
+extern int efi_varname_iter_next(efi_varname_iter_t *iter, efi_guid_t **guid,
+				 char **name)
+			      __attribute__((__nonnull__ (1, 2, 3)));
+extern void efi_varname_iter_free(efi_varname_iter_t *iter);
+extern int efi_get_variable_read_budget(unsigned int *available,
+					unsigned int *burst)
+			      __attribute__((__nonnull__ (1, 2)));
+
+/*
+ * Opt-in cache of efi_get_variable() results, dropped as the backing
+ * files change.  efi_variable_cache_stats() returns 1 if the cache is on.
+ */
+extern int efi_variable_cache_enable(void);
+extern void efi_variable_cache_disable(void);
+extern int efi_variable_cache_stats(uint64_t *hits, uint64_t *misses)
+			      __attribute__((__nonnull__ (1, 2)));
+
+/*
+ * Counters for everything libefivar and libefiboot have done in this
+ * process, summed over all its threads.  They only ever go up.  Pass
+ * sizeof(efi_stats_t); fields added later go at the end, and a caller
+ * built against an older, shorter efi_stats_t just gets the ones it knows
+ * about.
+ */
+typedef struct {
+	uint64_t efivarfs_reads;
+	uint64_t efivarfs_read_bytes;
+	uint64_t efivarfs_writes;
+	uint64_t efivarfs_write_bytes;
+	uint64_t efivarfs_deletes;
+	uint64_t vars_reads;
+	uint64_t vars_read_bytes;
+	uint64_t vars_writes;
+	uint64_t vars_write_bytes;
+	uint64_t vars_deletes;
+	uint64_t ratelimit_sleeps;
+	uint64_t ratelimit_sleep_us;
+	uint64_t variable_cache_hits;
+	uint64_t variable_cache_misses;
+	uint64_t sysfs_lookups;		/* made by device probes */
+	uint64_t sysfs_cache_hits;
+	uint64_t gpt_reads;
+	uint64_t gpt_read_bytes;
+	uint64_t gpt_cache_hits;
+	uint64_t gpt_cache_misses;
+	uint64_t devcache_hits;
+	uint64_t devcache_misses;
+	uint64_t crc32_bytes;
+	uint64_t variable_writes_skipped; /* by efi_set_variable_if_changed() */
+} efi_stats_t;
+
+extern int efi_get_stats(efi_stats_t *stats, size_t size)
+			      __attribute__((__nonnull__ (1)));
+
+/*
+ * Find out which variables change, as they change.  Poll
+ * efi_variable_watch_fd() for input, or just call
+ * efi_variable_watch_dispatch(), which waits up to timeout milliseconds
+ * (forever if it's negative) and then calls cb once for each variable
+ * that changed, with what it contains now.  data is NULL for deleted
+ * variables and for ones that changed but can't be read.  After
+ * EFI_VARIABLE_WATCH_OVERFLOW, guid and name are NULL and some changes
+ * were missed.  If cb returns nonzero, dispatching stops and the rest
+ * wait for the next call.  Returns how many times cb was called.
+ */
+typedef struct efi_variable_watch efi_variable_watch_t;
+
+typedef enum {
+	EFI_VARIABLE_WATCH_CHANGED = 1,
+	EFI_VARIABLE_WATCH_DELETED = 2,
+	EFI_VARIABLE_WATCH_OVERFLOW = 3,
+} efi_variable_watch_event_t;
+
+typedef int (efi_variable_watch_cb_t)(efi_variable_watch_event_t event,
+				      const efi_guid_t *guid,
+				      const char *name,
+				      const uint8_t *data, size_t data_size,
+				      uint32_t attributes, void *closure);
+
+extern int efi_variable_watch_new(efi_variable_watch_t **watch)
+			      __attribute__((__nonnull__ (1)));
+extern int efi_variable_watch_fd(efi_variable_watch_t *watch)
+			      __attribute__((__nonnull__ (1)));
+extern int efi_variable_watch_dispatch(efi_variable_watch_t *watch,
+				       int timeout,
+				       efi_variable_watch_cb_t *cb,
+				       void *closure)
+			      __attribute__((__nonnull__ (1, 3)));
+extern void efi_variable_watch_free(efi_variable_watch_t *watch);
+
+/*
+ * Get, set, and delete variables without blocking.  Requests are carried
+ * out by nworkers threads (one if it's 0) in the order they're submitted,
+ * though with more than one worker they can finish out of order; the
+ * workers sleep through any rate limiting so the caller doesn't have to.  Poll efi_async_fd()
+ * for input, or just call efi_async_dispatch(), which waits up to timeout
+ * milliseconds (forever if it's negative) and then calls cb once for each
+ * request that has finished.  error is 0 on success and an errno value
+ * otherwise; data is only valid during the call.  If cb returns nonzero,
+ * dispatching stops and the rest wait for the next call.  Returns how
+ * many times cb was called.  efi_async_free() waits for requests that
+ * have started and drops the rest without calling cb.
+ */
+typedef struct efi_async_ctx efi_async_ctx_t;
+
+typedef enum {
+	EFI_ASYNC_GET = 1,
+	EFI_ASYNC_SET = 2,
+	EFI_ASYNC_DEL = 3,
+} efi_async_op_t;
+
+typedef int (efi_async_cb_t)(efi_async_op_t op, const efi_guid_t *guid,
+			     const char *name, int error,
+			     const uint8_t *data, size_t data_size,
+			     uint32_t attributes, void *user);
+
+extern int efi_async_new(efi_async_ctx_t **ctx, unsigned int nworkers)
+			      __attribute__((__nonnull__ (1)));
+extern int efi_async_fd(efi_async_ctx_t *ctx)
+			      __attribute__((__nonnull__ (1)));
+extern int efi_async_get_variable(efi_async_ctx_t *ctx, efi_guid_t guid,
+				  const char *name, void *user)
+			      __attribute__((__nonnull__ (1, 3)));
+extern int efi_async_set_variable(efi_async_ctx_t *ctx, efi_guid_t guid,
+				  const char *name, const uint8_t *data,
+				  size_t data_size, uint32_t attributes,
+				  mode_t mode, void *user)
+			      __attribute__((__nonnull__ (1, 3)));
+extern int efi_async_del_variable(efi_async_ctx_t *ctx, efi_guid_t guid,
+				  const char *name, void *user)
+			      __attribute__((__nonnull__ (1, 3)));
+extern int efi_async_dispatch(efi_async_ctx_t *ctx, int timeout,
+			      efi_async_cb_t *cb)
+			      __attribute__((__nonnull__ (1, 3)));
+extern void efi_async_free(efi_async_ctx_t *ctx);
+
+/*
+ * Queue up several variable changes and apply them together.  Nothing is
+ * written until efi_variable_transaction_commit(), which checks every
+ * change first and, if one of them fails partway through, puts back the
+ * ones that had already been made.
+ */
+typedef struct efi_variable_transaction efi_variable_transaction_t;
+
+extern int efi_variable_transaction_new(efi_variable_transaction_t **txn)
+			      __attribute__((__nonnull__ (1)));
+extern int efi_variable_transaction_set(efi_variable_transaction_t *txn,
+					efi_guid_t guid, const char *name,
+					uint8_t *data, size_t data_size,
+					uint32_t attributes, mode_t mode)
+			      __attribute__((__nonnull__ (1, 3)));
+extern int efi_variable_transaction_del(efi_variable_transaction_t *txn,
+					efi_guid_t guid, const char *name)
+			      __attribute__((__nonnull__ (1, 3)));
+extern int efi_variable_transaction_commit(efi_variable_transaction_t *txn)
+			      __attribute__((__nonnull__ (1)));
+extern void efi_variable_transaction_free(efi_variable_transaction_t *txn);
+
 extern int efi_str_to_guid(const char *s, efi_guid_t *guid)
 			  __attribute__((__nonnull__ (1, 2)));
 extern int efi_guid_to_str(const efi_guid_t *guid, char **sp)
 			  __attribute__((__nonnull__ (1)));
+extern int efi_guid_to_str_buf(const efi_guid_t *guid, char *buf,
+			       size_t bufsz)
+			  __attribute__((__nonnull__ (1, 2)));
 extern int efi_guid_to_id_guid(const efi_guid_t *guid, char **sp)
 			      __attribute__((__nonnull__ (1)));
 extern int efi_guid_to_symbol(efi_guid_t *guid, char **symbol)
@@ -84,12 +291,32 @@ typedef struct efi_variable efi_variable_t;
 extern ssize_t efi_variable_import(uint8_t *data, size_t size,
 				efi_variable_t **var)
 			__attribute__((__nonnull__ (1, 3)));
+/*
+ * Like efi_variable_import(), but the variable's data stays where it is
+ * in data, which has to outlive it until efi_variable_own() is called to
+ * give it a copy of its own.  Release it with efi_variable_free(var, 1)
+ * either way.
+ */
+extern ssize_t efi_variable_import_view(const uint8_t *data, size_t size,
+					efi_variable_t **var)
+			__attribute__((__nonnull__ (1, 3)));
+extern int efi_variable_own(efi_variable_t *var)
+			__attribute__((__nonnull__ (1)));
 extern ssize_t efi_variable_export(efi_variable_t *var, uint8_t *data,
 				size_t size)
 			__attribute__((__nonnull__ (1)));
 extern ssize_t efi_variable_export_dmpstore(efi_variable_t *var, uint8_t *data,
 				size_t size)
 			__attribute__((__nonnull__ (1)));
+/*
+ * Export straight to fd in one pass, without asking for the size first.
+ * These return the number of bytes written, or -1 on error, in which
+ * case some of them may have been written anyway.
+ */
+extern ssize_t efi_variable_export_fd(efi_variable_t *var, int fd)
+			__attribute__((__nonnull__ (1)));
+extern ssize_t efi_variable_export_dmpstore_fd(efi_variable_t *var, int fd)
+			__attribute__((__nonnull__ (1)));
 
 extern efi_variable_t *efi_variable_alloc(void)
 			__attribute__((__visibility__ ("default")));
@@ -121,6 +348,96 @@ extern int efi_variable_get_attributes(efi_variable_t *var, uint64_t *attrs)
 extern int efi_variable_realize(efi_variable_t *var)
 			__attribute__((__nonnull__ (1)));
 
+/*
+ * Read every variable at once.  The efi_variable_t entries in a snapshot
+ * all live in storage owned by the snapshot; use the efi_variable_get_*()
+ * accessors on them, but don't pass them to efi_variable_free().
+ */
+typedef struct efi_variable_snapshot efi_variable_snapshot_t;
+
+extern int efi_variables_snapshot(efi_variable_snapshot_t **snapshot)
+			__attribute__((__nonnull__ (1)));
+extern size_t efi_variables_snapshot_count(efi_variable_snapshot_t *snapshot)
+			__attribute__((__nonnull__ (1)));
+extern efi_variable_t *efi_variables_snapshot_get(efi_variable_snapshot_t *snapshot,
+						  size_t n)
+			__attribute__((__nonnull__ (1)));
+extern void efi_variables_snapshot_free(efi_variable_snapshot_t *snapshot);
+
+/*
+ * A pool holds any number of variables, names, and data in a few large
+ * allocations, and gives them all back at once.  Variables from
+ * efi_variable_pool_alloc() and efi_variable_pool_import() are used like
+ * any other, but efi_variable_free() leaves them alone.
+ * efi_variable_pool_export() allocates its buffer from the pool, too.
+ * efi_variable_pool_reset() releases everything in the pool but keeps
+ * the memory for what comes next.
+ */
+typedef struct efi_variable_pool efi_variable_pool_t;
+
+extern int efi_variable_pool_new(efi_variable_pool_t **pool)
+			__attribute__((__nonnull__ (1)));
+extern efi_variable_t *efi_variable_pool_alloc(efi_variable_pool_t *pool)
+			__attribute__((__nonnull__ (1)));
+extern ssize_t efi_variable_pool_import(efi_variable_pool_t *pool,
+					const uint8_t *data, size_t size,
+					efi_variable_t **var)
+			__attribute__((__nonnull__ (1, 2, 4)));
+extern ssize_t efi_variable_pool_export(efi_variable_pool_t *pool,
+					efi_variable_t *var, uint8_t **data)
+			__attribute__((__nonnull__ (1, 2, 3)));
+extern void efi_variable_pool_reset(efi_variable_pool_t *pool)
+			__attribute__((__nonnull__ (1)));
+extern void efi_variable_pool_free(efi_variable_pool_t *pool);
+
+/*
+ * Write a small index of every variable (its guid, name, attributes,
+ * size, and the SHA-256 of its data) to fd, and later compare what's there
+ * now against it.  The comparison only reads a variable's data when its
+ * size and attributes are the same as before.  cb is called for each
+ * difference, and if it returns nonzero, or is NULL, the comparison
+ * stops there.  efi_variables_index_compare() returns the number of
+ * differences it found, so 0 means nothing has changed.
+ */
+typedef enum {
+	EFI_VARIABLE_INDEX_ADDED = 1,
+	EFI_VARIABLE_INDEX_CHANGED = 2,
+	EFI_VARIABLE_INDEX_DELETED = 3,
+} efi_variable_index_change_t;
+
+typedef int (efi_variable_index_cb_t)(efi_variable_index_change_t change,
+				      const efi_guid_t *guid,
+				      const char *name, void *closure);
+
+extern int efi_variables_index_save(int fd);
+extern int efi_variables_index_compare(int fd, efi_variable_index_cb_t *cb,
+				       void *closure);
+
+/*
+ * A whole set of variables in one stream, written with
+ * efi_variable_archive_create(), _add() for each variable, and _finish(),
+ * and read back with efi_variable_archive_open() and _next(), which
+ * returns 1 and a new variable to free with efi_variable_free(var, 1),
+ * 0 at the end, and -1 on error.  None of them close fd.
+ */
+typedef struct efi_variable_archive efi_variable_archive_t;
+
+extern int efi_variable_archive_create(int fd,
+				       efi_variable_archive_t **archive)
+			__attribute__((__nonnull__ (2)));
+extern int efi_variable_archive_add(efi_variable_archive_t *archive,
+				    efi_variable_t *var)
+			__attribute__((__nonnull__ (1, 2)));
+extern int efi_variable_archive_finish(efi_variable_archive_t *archive)
+			__attribute__((__nonnull__ (1)));
+extern int efi_variable_archive_open(int fd,
+				     efi_variable_archive_t **archive)
+			__attribute__((__nonnull__ (2)));
+extern int efi_variable_archive_next(efi_variable_archive_t *archive,
+				     efi_variable_t **var)
+			__attribute__((__nonnull__ (1, 2)));
+extern void efi_variable_archive_free(efi_variable_archive_t *archive);
+
 #ifndef EFIVAR_BUILD_ENVIRONMENT
 extern int efi_error_get(unsigned int n,
 			 char ** const filename,
@@ -200,6 +517,38 @@ extern int efi_get_verbose(void)
 extern FILE * efi_get_logfile(void)
 	__attribute__((__visibility__("default")));
 
+/*
+ * Where the library's debug output goes.  EFI_LOG_SINK_STRACE, the
+ * default, writes 32 bytes at a time so it's readable in strace even when
+ * it's not verbose enough to be shown.  EFI_LOG_SINK_BUFFERED only keeps
+ * what efi_set_verbose() says to show, and writes it to the error log in
+ * large batches.  EFI_LOG_SINK_BINARY batches every line as an
+ * efi_log_record_t followed by its text, to fd or, if fd is -1, the error
+ * log.  The buffered sinks are flushed when the sink changes and when the
+ * library is unloaded.  LIBEFIVAR_LOG=buffered or binary:<path> picks one
+ * from the environment.
+ */
+typedef enum {
+	EFI_LOG_SINK_STRACE = 0,
+	EFI_LOG_SINK_BUFFERED,
+	EFI_LOG_SINK_BINARY,
+} efi_log_sink_t;
+
+#define EFI_LOG_RECORD_TRUNCATED	0x1
+
+typedef struct {
+	uint32_t size;		/* of the whole record, padding excluded */
+	int32_t level;
+	uint32_t tid;
+	uint32_t flags;
+	uint64_t timestamp;	/* CLOCK_REALTIME, in nanoseconds */
+	/* followed by size - sizeof(efi_log_record_t) bytes of text,
+	 * without a newline or NUL, then padding to 8 bytes */
+} efi_log_record_t;
+
+extern int efi_set_log_sink(efi_log_sink_t sink, int fd)
+	__attribute__((__visibility__("default")));
+
 extern uint32_t efi_get_libefivar_version(void)
 	__attribute__((__visibility__("default")));
 
@@ -208,6 +557,7 @@ extern uint32_t efi_get_libefivar_version(void)
 #endif
 
 #include <efivar/efivar-dp.h>
+#include <efivar/efivar-guidmap.h>
 #include <efivar/efivar-time.h>
 
 #endif /* EFIVAR_H */
@@ -8,6 +8,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -15,6 +16,7 @@
 #include <unistd.h>
 
 #include "efivar.h"
+#include "stats.h"
 
 static int default_probe(void)
 {
@@ -26,13 +28,29 @@ struct efi_var_operations default_ops = {
 		.probe = default_probe,
 	};
 
-struct efi_var_operations *ops = NULL;
+/*
+ * Picking a backend means probing for efivarfs and sysfs, which programs
+ * that only want GUIDs or device paths from us have no use for, so it
+ * waits until something asks for a variable.
+ */
+static struct efi_var_operations *var_ops = NULL;
+static pthread_once_t ops_once = PTHREAD_ONCE_INIT;
+
+static void libefivar_init(void);
+
+static inline struct efi_var_operations *
+get_ops(void)
+{
+	pthread_once(&ops_once, libefivar_init);
+	return var_ops;
+}
 
 VERSION(_efi_set_variable, _efi_set_variable@libefivar.so.0)
 int NONNULL(2, 3) PUBLIC
 _efi_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 		  size_t data_size, uint32_t attributes)
 {
+	struct efi_var_operations *ops = get_ops();
 	int rc;
 	if (!ops->set_variable) {
 		efi_error("set_variable() is not implemented");
@@ -40,8 +58,12 @@ _efi_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 		return -1;
 	}
 	rc = ops->set_variable(guid, name, data, data_size, attributes, 0600);
-	if (rc < 0)
+	if (rc < 0) {
 		efi_error("ops->set_variable() failed");
+		efi_cache_forget(&guid, name);
+	} else {
+		efi_cache_set(&guid, name, data, data_size, attributes);
+	}
 	return rc;
 }
 
@@ -50,6 +72,7 @@ int NONNULL(2, 3) PUBLIC
 _efi_set_variable_variadic(efi_guid_t guid, const char *name, uint8_t *data,
 			   size_t data_size, uint32_t attributes, ...)
 {
+	struct efi_var_operations *ops = get_ops();
 	int rc;
 	if (!ops->set_variable) {
 		efi_error("set_variable() is not implemented");
@@ -57,8 +80,12 @@ _efi_set_variable_variadic(efi_guid_t guid, const char *name, uint8_t *data,
 		return -1;
 	}
 	rc = ops->set_variable(guid, name, data, data_size, attributes, 0600);
-	if (rc < 0)
+	if (rc < 0) {
 		efi_error("ops->set_variable() failed");
+		efi_cache_forget(&guid, name);
+	} else {
+		efi_cache_set(&guid, name, data, data_size, attributes);
+	}
 	return rc;
 }
 
@@ -67,6 +94,7 @@ int NONNULL(2, 3) PUBLIC
 _efi_set_variable_mode(efi_guid_t guid, const char *name, uint8_t *data,
 		       size_t data_size, uint32_t attributes, mode_t mode)
 {
+	struct efi_var_operations *ops = get_ops();
 	int rc;
 	if (!ops->set_variable) {
 		efi_error("set_variable() is not implemented");
@@ -74,10 +102,13 @@ _efi_set_variable_mode(efi_guid_t guid, const char *name, uint8_t *data,
 		return -1;
 	}
 	rc = ops->set_variable(guid, name, data, data_size, attributes, mode);
-	if (rc < 0)
+	if (rc < 0) {
 		efi_error("ops->set_variable() failed");
-	else
+		efi_cache_forget(&guid, name);
+	} else {
+		efi_cache_set(&guid, name, data, data_size, attributes);
 		efi_error_clear();
+	}
 	return rc;
 }
 
@@ -86,11 +117,159 @@ efi_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 		 size_t data_size, uint32_t attributes, mode_t mode)
 	ALIAS(_efi_set_variable_mode);
 
+/*
+ * Writes whose data isn't what ends up stored, so comparing against what's
+ * there can't tell us anything.
+ */
+#define UNCOMPARABLE_WRITE (EFI_VARIABLE_APPEND_WRITE |			\
+			    EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS |		\
+			    EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS | \
+			    EFI_VARIABLE_ENHANCED_AUTHENTICATED_ACCESS)
+
+/*
+ * Whether the variable holds exactly data and attributes.  Returns 1 if
+ * it does, 0 if it doesn't or doesn't exist, and -1 on error.  The size
+ * and attributes are looked at first, which with efivarfs doesn't copy
+ * the data out of the kernel; only if they match is the data read.
+ */
+static int
+variable_matches(efi_guid_t guid, const char *name, const uint8_t *data,
+		 size_t data_size, uint32_t attributes)
+{
+	size_t cur_size = 0;
+	uint32_t cur_attributes = 0;
+	uint8_t *buf;
+	int ret = -1;
+	int rc;
+
+	rc = efi_get_variable_info(guid, name, &cur_size, &cur_attributes);
+	if (rc < 0) {
+		if (errno != ENOENT)
+			return -1;
+		efi_error_clear();
+		return 0;
+	}
+	if (cur_size != data_size || cur_attributes != attributes)
+		return 0;
+
+	buf = malloc(data_size ? data_size : 1);
+	if (!buf) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	rc = efi_get_variable_into(guid, name, buf, data_size, &cur_size,
+				   &cur_attributes);
+	if (rc < 0) {
+		/* it changed under us, so it doesn't match */
+		if (errno == ENOENT || errno == ENOSPC) {
+			efi_error_clear();
+			ret = 0;
+		}
+	} else {
+		ret = cur_size == data_size && cur_attributes == attributes &&
+		      !memcmp(buf, data, data_size);
+	}
+	free(buf);
+	return ret;
+}
+
+int NONNULL(2) PUBLIC
+efi_set_variable_if_changed(efi_guid_t guid, const char *name,
+			    const uint8_t *data, size_t data_size,
+			    uint32_t attributes, mode_t mode)
+{
+	uint8_t empty = 0;
+	int rc;
+
+	if (!data && data_size) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+
+	if (!(attributes & UNCOMPARABLE_WRITE)) {
+		rc = variable_matches(guid, name, data, data_size, attributes);
+		if (rc < 0) {
+			efi_error("could not read current value");
+			return -1;
+		}
+		if (rc > 0) {
+			stats_inc(variable_writes_skipped);
+			return 0;
+		}
+	}
+
+	rc = efi_set_variable(guid, name, data ? (uint8_t *)data : &empty,
+			      data_size, attributes, mode);
+	if (rc < 0) {
+		efi_error("efi_set_variable() failed");
+		return -1;
+	}
+	return 1;
+}
+
+int NONNULL(2) PUBLIC
+efi_set_variable_cas(efi_guid_t guid, const char *name,
+		     const uint8_t *old_data, size_t old_data_size,
+		     uint32_t old_attributes,
+		     const uint8_t *data, size_t data_size,
+		     uint32_t attributes, mode_t mode)
+{
+	uint8_t empty = 0;
+	int rc;
+
+	if (!data && data_size) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+
+	if (old_data) {
+		rc = variable_matches(guid, name, old_data, old_data_size,
+				      old_attributes);
+	} else {
+		rc = efi_get_variable_exists(guid, name);
+		if (rc < 0 && errno == ENOENT) {
+			efi_error_clear();
+			rc = 1;
+		} else if (rc >= 0) {
+			rc = 0;
+		}
+	}
+	if (rc < 0) {
+		efi_error("could not read current value");
+		return -1;
+	}
+	if (rc == 0) {
+		errno = EAGAIN;
+		efi_error("variable does not hold the expected value");
+		return -1;
+	}
+
+	if (old_data && old_data_size == data_size &&
+	    old_attributes == attributes &&
+	    !(attributes & UNCOMPARABLE_WRITE) &&
+	    (data_size == 0 || !memcmp(old_data, data, data_size))) {
+		stats_inc(variable_writes_skipped);
+		return 0;
+	}
+
+	rc = efi_set_variable(guid, name, data ? (uint8_t *)data : &empty,
+			      data_size, attributes, mode);
+	if (rc < 0) {
+		efi_error("efi_set_variable() failed");
+		return -1;
+	}
+	return 1;
+}
+
 int NONNULL(2, 3) PUBLIC
 efi_append_variable(efi_guid_t guid, const char *name, uint8_t *data,
 			size_t data_size, uint32_t attributes)
 {
+	struct efi_var_operations *ops = get_ops();
 	int rc;
+	efi_cache_forget(&guid, name);
 	if (!ops->append_variable) {
 		rc = generic_append_variable(guid, name, data, data_size,
 					     attributes);
@@ -111,6 +290,7 @@ efi_append_variable(efi_guid_t guid, const char *name, uint8_t *data,
 int NONNULL(2) PUBLIC
 efi_del_variable(efi_guid_t guid, const char *name)
 {
+	struct efi_var_operations *ops = get_ops();
 	int rc;
 	if (!ops->del_variable) {
 		efi_error("del_variable() is not implemented");
@@ -118,6 +298,7 @@ efi_del_variable(efi_guid_t guid, const char *name)
 		return -1;
 	}
 	rc = ops->del_variable(guid, name);
+	efi_cache_forget(&guid, name);
 	if (rc < 0)
 		efi_error("ops->del_variable() failed");
 	else
@@ -129,15 +310,84 @@ int NONNULL(2, 3, 4, 5) PUBLIC
 efi_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 		  size_t *data_size, uint32_t *attributes)
 {
+	struct efi_var_operations *ops = get_ops();
 	int rc;
 	if (!ops->get_variable) {
 		efi_error("get_variable() is not implemented");
 		errno = ENOSYS;
 		return -1;
 	}
+	if (efi_cache_get(&guid, name, data, data_size, attributes)) {
+		efi_error_clear();
+		return 0;
+	}
 	rc = ops->get_variable(guid, name, data, data_size, attributes);
-	if (rc < 0)
+	if (rc < 0) {
 		efi_error("ops->get_variable failed");
+	} else {
+		efi_cache_put(&guid, name, *data, *data_size, *attributes);
+		efi_error_clear();
+	}
+	return rc;
+}
+
+static int
+generic_get_variable_into(efi_guid_t guid, const char *name, uint8_t *buf,
+			  size_t bufsz, size_t *data_size, uint32_t *attributes)
+{
+	uint8_t *data = NULL;
+	size_t size = 0;
+	uint32_t attrs = 0;
+	int rc;
+
+	rc = efi_get_variable(guid, name, &data, &size, &attrs);
+	if (rc < 0)
+		return rc;
+
+	*data_size = size;
+	if (size > bufsz) {
+		free(data);
+		errno = ENOSPC;
+		return -1;
+	}
+	if (size)
+		memcpy(buf, data, size);
+	*attributes = attrs;
+	free(data);
+	return 0;
+}
+
+/*
+ * This goes straight to the backend rather than through the cache: it's
+ * meant for loops that want to avoid allocating, and a cache hit would
+ * mean copying anyway.
+ */
+int NONNULL(2, 5, 6) PUBLIC
+efi_get_variable_into(efi_guid_t guid, const char *name, uint8_t *buf,
+		      size_t bufsz, size_t *data_size, uint32_t *attributes)
+{
+	struct efi_var_operations *ops = get_ops();
+	int rc;
+
+	if (!buf && bufsz) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+
+	if (!ops->get_variable_into) {
+		rc = generic_get_variable_into(guid, name, buf, bufsz,
+					       data_size, attributes);
+		if (rc < 0)
+			efi_error("generic_get_variable_into() failed");
+		else
+			efi_error_clear();
+		return rc;
+	}
+	rc = ops->get_variable_into(guid, name, buf, bufsz, data_size,
+				    attributes);
+	if (rc < 0)
+		efi_error("ops->get_variable_into() failed");
 	else
 		efi_error_clear();
 	return rc;
@@ -147,12 +397,17 @@ int NONNULL(2, 3) PUBLIC
 efi_get_variable_attributes(efi_guid_t guid, const char *name,
 			    uint32_t *attributes)
 {
+	struct efi_var_operations *ops = get_ops();
 	int rc;
 	if (!ops->get_variable_attributes) {
 		efi_error("get_variable_attributes() is not implemented");
 		errno = ENOSYS;
 		return -1;
 	}
+	if (efi_cache_get(&guid, name, NULL, NULL, attributes)) {
+		efi_error_clear();
+		return 0;
+	}
 	rc = ops->get_variable_attributes(guid, name, attributes);
 	if (rc < 0)
 		efi_error("ops->get_variable_attributes() failed");
@@ -161,6 +416,34 @@ efi_get_variable_attributes(efi_guid_t guid, const char *name,
 	return rc;
 }
 
+int NONNULL(2, 3, 4) PUBLIC
+efi_get_variable_info(efi_guid_t guid, const char *name, size_t *size,
+		      uint32_t *attributes)
+{
+	struct efi_var_operations *ops = get_ops();
+	int rc;
+
+	if (efi_cache_get(&guid, name, NULL, size, attributes)) {
+		efi_error_clear();
+		return 0;
+	}
+	if (!ops->get_variable_info) {
+		rc = efi_get_variable_size(guid, name, size);
+		if (rc >= 0)
+			rc = efi_get_variable_attributes(guid, name,
+							 attributes);
+		if (rc < 0)
+			efi_error("could not get variable size and attributes");
+		return rc;
+	}
+	rc = ops->get_variable_info(guid, name, size, attributes);
+	if (rc < 0)
+		efi_error("ops->get_variable_info() failed");
+	else
+		efi_error_clear();
+	return rc;
+}
+
 int NONNULL(2) PUBLIC
 efi_get_variable_exists(efi_guid_t guid, const char *name)
 {
@@ -171,12 +454,17 @@ efi_get_variable_exists(efi_guid_t guid, const char *name)
 int NONNULL(2, 3) PUBLIC
 efi_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
 {
+	struct efi_var_operations *ops = get_ops();
 	int rc;
 	if (!ops->get_variable_size) {
 		efi_error("get_variable_size() is not implemented");
 		errno = ENOSYS;
 		return -1;
 	}
+	if (efi_cache_get(&guid, name, NULL, size, NULL)) {
+		efi_error_clear();
+		return 0;
+	}
 	rc = ops->get_variable_size(guid, name, size);
 	if (rc < 0)
 		efi_error("ops->get_variable_size() failed");
@@ -188,6 +476,7 @@ efi_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
 int NONNULL(1, 2) PUBLIC
 efi_get_next_variable_name(efi_guid_t **guid, char **name)
 {
+	struct efi_var_operations *ops = get_ops();
 	int rc;
 	if (!ops->get_next_variable_name) {
 		efi_error("get_next_variable_name() is not implemented");
@@ -202,9 +491,119 @@ efi_get_next_variable_name(efi_guid_t **guid, char **name)
 	return rc;
 }
 
+int PUBLIC
+efi_variable_cache_enable(void)
+{
+	struct efi_var_operations *ops = get_ops();
+	int rc;
+	if (!ops->watch_variables) {
+		efi_error("watch_variables() is not implemented");
+		errno = ENOSYS;
+		return -1;
+	}
+	rc = efi_cache_enable(ops->watch_variables);
+	if (rc < 0)
+		efi_error("efi_cache_enable() failed");
+	else
+		efi_error_clear();
+	return rc;
+}
+
+int NONNULL(1) PUBLIC
+efi_variable_watch_new(efi_variable_watch_t **watchp)
+{
+	struct efi_var_operations *ops = get_ops();
+	int rc;
+	if (!ops->watch_variables) {
+		efi_error("watch_variables() is not implemented");
+		errno = ENOSYS;
+		return -1;
+	}
+	rc = efi_watch_new(ops->watch_variables, watchp);
+	if (rc < 0)
+		efi_error("efi_watch_new() failed");
+	else
+		efi_error_clear();
+	return rc;
+}
+
+int NONNULL(1) PUBLIC
+efi_varname_iter_new(efi_varname_iter_t **iterp)
+{
+	struct efi_var_operations *ops = get_ops();
+	efi_varname_iter_t *iter;
+	int rc;
+
+	if (!ops->varname_iter_open) {
+		efi_error("varname_iter_open() is not implemented");
+		errno = ENOSYS;
+		return -1;
+	}
+
+	iter = calloc(1, sizeof(*iter));
+	if (!iter) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	rc = ops->varname_iter_open(iter);
+	if (rc < 0) {
+		__typeof__(errno) errno_value = errno;
+		efi_error("ops->varname_iter_open() failed");
+		free(iter);
+		errno = errno_value;
+		return -1;
+	}
+
+	efi_error_clear();
+	*iterp = iter;
+	return 0;
+}
+
+int NONNULL(1, 2, 3) PUBLIC
+efi_varname_iter_next(efi_varname_iter_t *iter, efi_guid_t **guid,
+		      char **name)
+{
+	int rc;
+
+	if (iter->next) {
+		rc = iter->next(iter, guid, name);
+		if (rc < 0)
+			efi_error("iter->next() failed");
+		else
+			efi_error_clear();
+		return rc;
+	}
+
+	/* once it's run out, it stays run out */
+	if (!generic_varname_iter_is_open(iter))
+		return 0;
+
+	rc = generic_varname_iter_next(iter, guid, name);
+	if (rc < 0)
+		efi_error("generic_varname_iter_next() failed");
+	else
+		efi_error_clear();
+	return rc;
+}
+
+void PUBLIC
+efi_varname_iter_free(efi_varname_iter_t *iter)
+{
+	if (!iter)
+		return;
+
+	if (iter->close)
+		iter->close(iter);
+	else
+		generic_varname_iter_close(iter);
+	free(iter);
+}
+
 int NONNULL(2) PUBLIC
 efi_chmod_variable(efi_guid_t guid, const char *name, mode_t mode)
 {
+	struct efi_var_operations *ops = get_ops();
 	int rc;
 	if (!ops->chmod_variable) {
 		efi_error("chmod_variable() is not implemented");
@@ -219,23 +618,581 @@ efi_chmod_variable(efi_guid_t guid, const char *name, mode_t mode)
 	return rc;
 }
 
+static int
+snapshot_grow(efi_variable_snapshot_t *snapshot, size_t size)
+{
+	size_t needed, new_size;
+	uint8_t *new_arena;
+
+	if (ADD(snapshot->arena_used, size, &needed)) {
+		errno = EOVERFLOW;
+		efi_error("arithmetic overflow computing arena size");
+		return -1;
+	}
+	if (needed <= snapshot->arena_size)
+		return 0;
+
+	new_size = snapshot->arena_size ? snapshot->arena_size : 65536;
+	while (new_size < needed) {
+		if (MUL(new_size, 2, &new_size)) {
+			errno = EOVERFLOW;
+			efi_error("arithmetic overflow computing arena size");
+			return -1;
+		}
+	}
+
+	new_arena = realloc(snapshot->arena, new_size);
+	if (!new_arena) {
+		efi_error("could not allocate %zu bytes", new_size);
+		return -1;
+	}
+	snapshot->arena = new_arena;
+	snapshot->arena_size = new_size;
+	return 0;
+}
+
+int HIDDEN
+snapshot_entry_start(efi_variable_snapshot_t *snapshot,
+		     const efi_guid_t *guid, const char *name, size_t namelen)
+{
+	struct snapshot_entry *entry;
+
+	if (snapshot->n_entries == snapshot->n_entries_allocated) {
+		size_t n = snapshot->n_entries_allocated ?
+			   snapshot->n_entries_allocated * 2 : 64;
+		struct snapshot_entry *entries;
+		size_t sz;
+
+		if (MUL(n, sizeof(*entries), &sz)) {
+			errno = EOVERFLOW;
+			efi_error("arithmetic overflow computing entry table size");
+			return -1;
+		}
+		entries = realloc(snapshot->entries, sz);
+		if (!entries) {
+			efi_error("could not allocate %zu entries", n);
+			return -1;
+		}
+		snapshot->entries = entries;
+		snapshot->n_entries_allocated = n;
+	}
+
+	snapshot->entry_start = snapshot->arena_used;
+	if (snapshot_grow(snapshot, sizeof(*guid) + namelen + 1) < 0)
+		return -1;
+
+	entry = &snapshot->entries[snapshot->n_entries];
+	memset(entry, 0, sizeof(*entry));
+
+	entry->guid_offset = snapshot->arena_used;
+	memcpy(snapshot->arena + snapshot->arena_used, guid, sizeof(*guid));
+	snapshot->arena_used += sizeof(*guid);
+
+	entry->name_offset = snapshot->arena_used;
+	memcpy(snapshot->arena + snapshot->arena_used, name, namelen);
+	snapshot->arena[snapshot->arena_used + namelen] = '\0';
+	snapshot->arena_used += namelen + 1;
+
+	entry->data_offset = snapshot->arena_used;
+	return 0;
+}
+
+/*
+ * Returns space for "size" bytes at the end of the current entry.  The
+ * pointer is only good until the next call, since the arena may move.
+ */
+uint8_t HIDDEN *
+snapshot_entry_reserve(efi_variable_snapshot_t *snapshot, size_t size)
+{
+	struct snapshot_entry *entry = &snapshot->entries[snapshot->n_entries];
+
+	snapshot->arena_used = entry->data_offset;
+	if (snapshot_grow(snapshot, size) < 0)
+		return NULL;
+	return snapshot->arena + entry->data_offset;
+}
+
+/*
+ * Finishes the current entry.  The first data_skip bytes of whatever was
+ * reserved are dropped (efivarfs puts the attributes there), and
+ * data_size bytes after that are the variable's data.
+ */
+int HIDDEN
+snapshot_entry_commit(efi_variable_snapshot_t *snapshot, uint32_t attributes,
+		      size_t data_skip, size_t data_size)
+{
+	struct snapshot_entry *entry = &snapshot->entries[snapshot->n_entries];
+
+	entry->data_offset += data_skip;
+	entry->data_size = data_size;
+	entry->attributes = attributes;
+	snapshot->arena_used = entry->data_offset + data_size;
+	snapshot->n_entries += 1;
+	return 0;
+}
+
+void HIDDEN
+snapshot_entry_abort(efi_variable_snapshot_t *snapshot)
+{
+	snapshot->arena_used = snapshot->entry_start;
+}
+
+int HIDDEN
+snapshot_add_variable(efi_variable_snapshot_t *snapshot,
+		      const efi_guid_t *guid, const char *name,
+		      uint32_t attributes, const uint8_t *data,
+		      size_t data_size)
+{
+	uint8_t *buf;
+
+	if (snapshot_entry_start(snapshot, guid, name, strlen(name)) < 0)
+		return -1;
+
+	buf = snapshot_entry_reserve(snapshot, data_size);
+	if (!buf) {
+		snapshot_entry_abort(snapshot);
+		return -1;
+	}
+	memcpy(buf, data, data_size);
+
+	return snapshot_entry_commit(snapshot, attributes, 0, data_size);
+}
+
+static int
+generic_snapshot_variables(efi_variable_snapshot_t *snapshot)
+{
+	efi_guid_t *guid = NULL;
+	char *name = NULL;
+	int rc;
+
+	while ((rc = efi_get_next_variable_name(&guid, &name)) > 0) {
+		uint8_t *data = NULL;
+		size_t data_size = 0;
+		uint32_t attributes = 0;
+
+		rc = efi_get_variable(*guid, name, &data, &data_size,
+				      &attributes);
+		if (rc < 0) {
+			if (errno == ENOENT)
+				continue;
+			efi_error("efi_get_variable() failed");
+			break;
+		}
+
+		rc = snapshot_add_variable(snapshot, guid, name, attributes,
+					   data, data_size);
+		free(data);
+		if (rc < 0)
+			break;
+	}
+
+	if (rc < 0) {
+		/* run the iterator out so the next walk starts over */
+		__typeof__(errno) errno_value = errno;
+		while (efi_get_next_variable_name(&guid, &name) > 0)
+			;
+		errno = errno_value;
+	}
+	return rc;
+}
+
+/*
+ * Lay the efi_variable_t array out after everything else in the arena,
+ * now that nothing will move any more.
+ */
+static int
+snapshot_finalize(efi_variable_snapshot_t *snapshot)
+{
+	size_t vars_offset = ALIGN_UP(snapshot->arena_used,
+				      _Alignof(efi_variable_t));
+	size_t vars_size;
+	uint8_t *arena;
+
+	if (MUL(snapshot->n_entries, sizeof(efi_variable_t), &vars_size) ||
+	    ADD(vars_offset, vars_size, &vars_size)) {
+		errno = EOVERFLOW;
+		efi_error("arithmetic overflow computing arena size");
+		return -1;
+	}
+
+	arena = realloc(snapshot->arena, vars_size ? vars_size : 1);
+	if (!arena) {
+		efi_error("could not allocate %zu bytes", vars_size);
+		return -1;
+	}
+	snapshot->arena = arena;
+	snapshot->arena_size = snapshot->arena_used = vars_size;
+	snapshot->vars = (efi_variable_t *)(arena + vars_offset);
+
+	for (size_t i = 0; i < snapshot->n_entries; i++) {
+		struct snapshot_entry *entry = &snapshot->entries[i];
+		efi_variable_t *var = &snapshot->vars[i];
+
+		memset(var, 0, sizeof(*var));
+		var->guid = (efi_guid_t *)(arena + entry->guid_offset);
+		var->name = arena + entry->name_offset;
+		var->data = arena + entry->data_offset;
+		var->data_size = entry->data_size;
+		var->attrs = entry->attributes;
+		var->borrowed = true;
+	}
+
+	free(snapshot->entries);
+	snapshot->entries = NULL;
+	snapshot->n_entries_allocated = 0;
+	return 0;
+}
+
+void PUBLIC
+efi_variables_snapshot_free(efi_variable_snapshot_t *snapshot)
+{
+	if (!snapshot)
+		return;
+
+	free(snapshot->entries);
+	free(snapshot->arena);
+	free(snapshot);
+}
+
+int NONNULL(1) PUBLIC
+efi_variables_snapshot(efi_variable_snapshot_t **snapshotp)
+{
+	struct efi_var_operations *ops = get_ops();
+	efi_variable_snapshot_t *snapshot;
+	int rc;
+
+	snapshot = calloc(1, sizeof(*snapshot));
+	if (!snapshot) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	if (ops->snapshot_variables) {
+		rc = ops->snapshot_variables(snapshot);
+		if (rc < 0)
+			efi_error("ops->snapshot_variables() failed");
+	} else {
+		rc = generic_snapshot_variables(snapshot);
+		if (rc < 0)
+			efi_error("generic_snapshot_variables() failed");
+	}
+
+	if (rc >= 0)
+		rc = snapshot_finalize(snapshot);
+
+	if (rc < 0) {
+		__typeof__(errno) errno_value = errno;
+		efi_variables_snapshot_free(snapshot);
+		errno = errno_value;
+		return -1;
+	}
+
+	efi_error_clear();
+	*snapshotp = snapshot;
+	return 0;
+}
+
+size_t NONNULL(1) PUBLIC
+efi_variables_snapshot_count(efi_variable_snapshot_t *snapshot)
+{
+	return snapshot->n_entries;
+}
+
+efi_variable_t NONNULL(1) PUBLIC *
+efi_variables_snapshot_get(efi_variable_snapshot_t *snapshot, size_t n)
+{
+	if (n >= snapshot->n_entries) {
+		errno = ENOENT;
+		return NULL;
+	}
+	return &snapshot->vars[n];
+}
+
+int NONNULL(1) PUBLIC
+efi_variable_transaction_new(efi_variable_transaction_t **txnp)
+{
+	efi_variable_transaction_t *txn;
+
+	txn = calloc(1, sizeof(*txn));
+	if (!txn) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	*txnp = txn;
+	return 0;
+}
+
+void PUBLIC
+efi_variable_transaction_free(efi_variable_transaction_t *txn)
+{
+	if (!txn)
+		return;
+
+	for (size_t i = 0; i < txn->n_ops; i++) {
+		free(txn->ops[i].name);
+		free(txn->ops[i].buf);
+		free(txn->ops[i].old_data);
+	}
+	free(txn->ops);
+	free(txn);
+}
+
+static struct transaction_op *
+transaction_add_op(efi_variable_transaction_t *txn, const efi_guid_t *guid,
+		   const char *name)
+{
+	struct transaction_op *op;
+	size_t namelen = strlen(name);
+
+	if (namelen == 0 || namelen > 1024) {
+		errno = EINVAL;
+		efi_error("invalid variable name length %zu", namelen);
+		return NULL;
+	}
+
+	/* one change per variable, so rolling back is unambiguous */
+	for (size_t i = 0; i < txn->n_ops; i++) {
+		if (!memcmp(&txn->ops[i].guid, guid, sizeof(*guid)) &&
+		    !strcmp(txn->ops[i].name, name)) {
+			errno = EEXIST;
+			efi_error("variable %s is already in this transaction",
+				  name);
+			return NULL;
+		}
+	}
+
+	if (txn->n_ops == txn->n_ops_allocated) {
+		size_t n = txn->n_ops_allocated ? txn->n_ops_allocated * 2 : 4;
+		size_t size;
+		struct transaction_op *new_ops;
+
+		if (MUL(n, sizeof(*new_ops), &size)) {
+			errno = EOVERFLOW;
+			efi_error("too many operations");
+			return NULL;
+		}
+		new_ops = realloc(txn->ops, size);
+		if (!new_ops) {
+			efi_error("could not allocate memory");
+			return NULL;
+		}
+		txn->ops = new_ops;
+		txn->n_ops_allocated = n;
+	}
+
+	op = &txn->ops[txn->n_ops];
+	memset(op, 0, sizeof(*op));
+	op->name = strdup(name);
+	if (!op->name) {
+		efi_error("could not allocate memory");
+		return NULL;
+	}
+	memcpy(&op->guid, guid, sizeof(*guid));
+	txn->n_ops += 1;
+	return op;
+}
+
+int NONNULL(1, 3) PUBLIC
+efi_variable_transaction_set(efi_variable_transaction_t *txn,
+			     efi_guid_t guid, const char *name,
+			     uint8_t *data, size_t data_size,
+			     uint32_t attributes, mode_t mode)
+{
+	struct transaction_op *op;
+	size_t bufsize;
+	uint8_t *buf;
+
+	if (!data && data_size) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+
+	if (ADD(data_size, sizeof(attributes), &bufsize)) {
+		errno = EOVERFLOW;
+		efi_error("data_size too large (%zu)", data_size);
+		return -1;
+	}
+
+	buf = malloc(bufsize);
+	if (!buf) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	op = transaction_add_op(txn, &guid, name);
+	if (!op) {
+		__typeof__(errno) errno_value = errno;
+		free(buf);
+		errno = errno_value;
+		return -1;
+	}
+
+	op->buf = buf;
+	op->data_size = data_size;
+	op->attributes = attributes;
+	op->mode = mode;
+	memcpy(buf, &attributes, sizeof(attributes));
+	if (data_size)
+		memcpy(transaction_op_data(op), data, data_size);
+
+	return 0;
+}
+
+int NONNULL(1, 3) PUBLIC
+efi_variable_transaction_del(efi_variable_transaction_t *txn,
+			     efi_guid_t guid, const char *name)
+{
+	if (!transaction_add_op(txn, &guid, name))
+		return -1;
+	return 0;
+}
+
+/*
+ * Undo ops [0, n) in reverse order.  This is best effort: if putting
+ * something back fails there's nothing more useful to do than carry on
+ * with the rest.
+ */
+static void
+transaction_rollback(efi_variable_transaction_t *txn, size_t n)
+{
+	struct efi_var_operations *ops = get_ops();
+	__typeof__(errno) errno_value = errno;
+
+	while (n--) {
+		struct transaction_op *op = &txn->ops[n];
+		int rc;
+
+		if (op->existed)
+			rc = ops->set_variable(op->guid, op->name,
+					       op->old_data,
+					       op->old_data_size,
+					       op->old_attributes &
+					       ~EFI_VARIABLE_APPEND_WRITE,
+					       0644);
+		else if (op->buf)
+			rc = ops->del_variable(op->guid, op->name);
+		else
+			continue;
+		if (rc < 0)
+			efi_error("could not roll back %s", op->name);
+	}
+
+	errno = errno_value;
+}
+
+static int
+generic_apply_transaction(efi_variable_transaction_t *txn, size_t *applied)
+{
+	struct efi_var_operations *ops = get_ops();
+
+	for (*applied = 0; *applied < txn->n_ops; *applied += 1) {
+		struct transaction_op *op = &txn->ops[*applied];
+		int rc;
+
+		if (op->buf)
+			rc = ops->set_variable(op->guid, op->name,
+					       transaction_op_data(op),
+					       op->data_size, op->attributes,
+					       op->mode);
+		else
+			rc = ops->del_variable(op->guid, op->name);
+		if (rc < 0) {
+			efi_error("could not %s %s",
+				  op->buf ? "set" : "delete", op->name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Apply everything queued in txn.  First we read what's there now, both
+ * to check that every delete has something to delete and so we can put
+ * it back; nothing has been written at that point.  Then the backend
+ * applies the changes back to back, and if one fails, the ones before it
+ * are undone.
+ */
+int NONNULL(1) PUBLIC
+efi_variable_transaction_commit(efi_variable_transaction_t *txn)
+{
+	struct efi_var_operations *ops = get_ops();
+	size_t applied = 0;
+	int rc;
+
+	if (!ops->set_variable || !ops->del_variable || !ops->get_variable) {
+		efi_error("set_variable(), del_variable(), or get_variable() "
+			  "is not implemented");
+		errno = ENOSYS;
+		return -1;
+	}
+
+	for (size_t i = 0; i < txn->n_ops; i++) {
+		struct transaction_op *op = &txn->ops[i];
+
+		free(op->old_data);
+		op->old_data = NULL;
+		op->existed = false;
+
+		rc = ops->get_variable(op->guid, op->name, &op->old_data,
+				       &op->old_data_size,
+				       &op->old_attributes);
+		if (rc >= 0) {
+			op->existed = true;
+		} else if (errno != ENOENT) {
+			efi_error("could not read %s", op->name);
+			return -1;
+		} else if (!op->buf) {
+			efi_error("cannot delete %s: it does not exist",
+				  op->name);
+			return -1;
+		}
+	}
+
+	if (ops->apply_transaction) {
+		rc = ops->apply_transaction(txn, &applied);
+		if (rc < 0)
+			efi_error("ops->apply_transaction() failed");
+	} else {
+		rc = generic_apply_transaction(txn, &applied);
+		if (rc < 0)
+			efi_error("generic_apply_transaction() failed");
+	}
+	if (rc < 0)
+		transaction_rollback(txn, applied);
+
+	for (size_t i = 0; i < txn->n_ops; i++) {
+		struct transaction_op *op = &txn->ops[i];
+
+		if (rc >= 0 && op->buf)
+			efi_cache_set(&op->guid, op->name,
+				      transaction_op_data(op), op->data_size,
+				      op->attributes);
+		else
+			efi_cache_forget(&op->guid, op->name);
+	}
+
+	if (rc >= 0)
+		efi_error_clear();
+	return rc;
+}
+
 int PUBLIC
 efi_variables_supported(void)
 {
+	struct efi_var_operations *ops = get_ops();
 	if (ops == &default_ops)
 		return 0;
 	return 1;
 }
 
-static void CONSTRUCTOR libefivar_init(void);
-
-static void CONSTRUCTOR
+static void
 libefivar_init(void)
 {
+	/* lib-backends.h is generated from EFIVAR_BACKENDS in the Makefile */
 	struct efi_var_operations *ops_list[] = {
-		&efivarfs_ops,
-		&vars_ops,
-		&ioctl_ops,
+#include "lib-backends.h"
 		&default_ops,
 		NULL
 	};
@@ -252,7 +1209,7 @@ libefivar_init(void)
 		if (ops_name != NULL) {
 			if (!strcmp(ops_list[i]->name, ops_name) ||
 					!strcmp(ops_list[i]->name, "default")) {
-				ops = ops_list[i];
+				var_ops = ops_list[i];
 				break;
 			}
 		} else {
@@ -261,7 +1218,7 @@ libefivar_init(void)
 				efi_error("ops_list[%d]->probe() failed", i);
 			} else {
 				efi_error_clear();
-				ops = ops_list[i];
+				var_ops = ops_list[i];
 				break;
 			}
 		}
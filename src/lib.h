@@ -11,16 +11,46 @@
 #include <limits.h>
 #include <sys/types.h>
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #include <efivar/efivar-types.h>
 
+#include "compiler.h"
+
 struct efi_variable {
 	uint64_t attrs;
 	efi_guid_t *guid;
 	unsigned char *name;
 	uint8_t *data;
 	size_t data_size;
+	bool borrowed;	// guid and data aren't ours; see efi_variable_own()
+	bool pooled;	// everything, us included, belongs to an efi_variable_pool_t
+};
+
+struct efi_variable_snapshot;
+struct efi_variable_transaction;
+struct efi_variable_watch;
+
+struct efi_varname_iter {
+	int dfd;
+#if defined(__linux__)
+	/* getdents64() batch buffer, and how far through it we are */
+	uint8_t *dents;
+	size_t dents_pos;
+	size_t dents_len;
+#else
+	DIR *dir;
+#endif
+	const char *entry;
+	efi_guid_t guid;
+	char name[NAME_MAX+1];
+
+	/* for backends that don't keep their variables in a directory */
+	int (*next)(struct efi_varname_iter *iter, efi_guid_t **guid,
+		    char **name);
+	void (*close)(struct efi_varname_iter *iter);
+	void *priv;
 };
 
 struct efi_var_operations {
@@ -31,22 +61,120 @@ struct efi_var_operations {
 	int (*del_variable)(efi_guid_t guid, const char *name);
 	int (*get_variable)(efi_guid_t guid, const char *name, uint8_t **data,
 			    size_t *data_size, uint32_t *attributes);
+	int (*get_variable_into)(efi_guid_t guid, const char *name,
+				 uint8_t *buf, size_t bufsz, size_t *data_size,
+				 uint32_t *attributes);
 	int (*get_variable_attributes)(efi_guid_t guid, const char *name,
 				       uint32_t *attributes);
 	int (*get_variable_size)(efi_guid_t guid, const char *name,
 				 size_t *size);
+	int (*get_variable_info)(efi_guid_t guid, const char *name,
+				 size_t *size, uint32_t *attributes);
 	int (*get_next_variable_name)(efi_guid_t **guid, char **name);
 	int (*append_variable)(efi_guid_t guid, const char *name,
 			       uint8_t *data, size_t data_size,
 			       uint32_t attributes);
 	int (*chmod_variable)(efi_guid_t guid, const char *name, mode_t mode);
+	int (*snapshot_variables)(struct efi_variable_snapshot *snapshot);
+	int (*varname_iter_open)(struct efi_varname_iter *iter);
+	int (*watch_variables)(int inotify_fd);
+	int (*apply_transaction)(struct efi_variable_transaction *txn,
+				 size_t *applied);
 };
 
 typedef unsigned long efi_status_t;
 
+/*
+ * A snapshot is built in one arena: each variable's guid, name, and data
+ * are appended to it as they're read, and the efi_variable_t array that
+ * points into it is only laid out once everything has been read, so that
+ * growing the arena never has to fix up pointers.
+ */
+struct snapshot_entry {
+	size_t guid_offset;
+	size_t name_offset;
+	size_t data_offset;
+	size_t data_size;
+	uint32_t attributes;
+};
+
+struct efi_variable_snapshot {
+	uint8_t *arena;
+	size_t arena_size;
+	size_t arena_used;
+
+	struct snapshot_entry *entries;
+	size_t n_entries;
+	size_t n_entries_allocated;
+	size_t entry_start;
+
+	struct efi_variable *vars;
+};
+
+extern int HIDDEN snapshot_entry_start(struct efi_variable_snapshot *snapshot,
+				       const efi_guid_t *guid,
+				       const char *name, size_t namelen);
+extern uint8_t HIDDEN *snapshot_entry_reserve(struct efi_variable_snapshot *snapshot,
+					      size_t size);
+extern int HIDDEN snapshot_entry_commit(struct efi_variable_snapshot *snapshot,
+					uint32_t attributes,
+					size_t data_skip, size_t data_size);
+extern void HIDDEN snapshot_entry_abort(struct efi_variable_snapshot *snapshot);
+extern int HIDDEN snapshot_add_variable(struct efi_variable_snapshot *snapshot,
+					const efi_guid_t *guid,
+					const char *name, uint32_t attributes,
+					const uint8_t *data, size_t data_size);
+
+/*
+ * Each queued set keeps its data behind a 4-byte attributes header, which
+ * is exactly what efivarfs wants written, so applying a transaction there
+ * doesn't have to allocate anything.  A delete has no buf.
+ */
+struct transaction_op {
+	efi_guid_t guid;
+	char *name;
+	uint8_t *buf;
+	size_t data_size;
+	uint32_t attributes;
+	mode_t mode;
+
+	/* what was there before we started, for rolling back */
+	bool existed;
+	uint8_t *old_data;
+	size_t old_data_size;
+	uint32_t old_attributes;
+};
+
+#define transaction_op_data(op) ((op)->buf + sizeof((op)->attributes))
+
+struct efi_variable_transaction {
+	struct transaction_op *ops;
+	size_t n_ops;
+	size_t n_ops_allocated;
+};
+
+extern void HIDDEN efi_ratelimit(void);
+
+extern int HIDDEN efi_cache_enable(int (*watch_variables)(int inotify_fd));
+extern int HIDDEN efi_cache_get(const efi_guid_t *guid, const char *name,
+				uint8_t **data, size_t *data_size,
+				uint32_t *attributes);
+extern void HIDDEN efi_cache_put(const efi_guid_t *guid, const char *name,
+				 const uint8_t *data, size_t data_size,
+				 uint32_t attributes);
+extern void HIDDEN efi_cache_set(const efi_guid_t *guid, const char *name,
+				 const uint8_t *data, size_t data_size,
+				 uint32_t attributes);
+extern void HIDDEN efi_cache_forget(const efi_guid_t *guid, const char *name);
+
+extern int HIDDEN efi_watch_new(int (*watch_variables)(int inotify_fd),
+				struct efi_variable_watch **watchp);
+
 extern struct efi_var_operations vars_ops;
 extern struct efi_var_operations efivarfs_ops;
 extern struct efi_var_operations ioctl_ops;
+extern struct efi_var_operations memory_ops;
+extern struct efi_var_operations varstore_ops;
 
 #endif /* LIBEFIVAR_LIB_H */
 
@@ -28,13 +28,14 @@ parse_acpi_hid_uid(struct device *dev, const char *fmt, ...)
 	debug("entry");
 
 	va_start(ap, fmt);
-	rc = vasprintfa(&path, fmt, ap);
+	rc = arena_vasprintf(&dev->arena, &path, fmt, ap);
 	va_end(ap);
 	debug("path:%s rc:%d", path, rc);
 	if (rc < 0 || path == NULL)
 		return -1;
 
-	rc = read_sysfs_file(&fbuf, "%s/firmware_node/path", path);
+	rc = read_sysfs_file(&dev->arena, &fbuf,
+			     "%s/firmware_node/path", path);
 	if (rc > 0 && fbuf) {
 		size_t l = strlen(fbuf);
 		if (l > 1) {
@@ -44,7 +45,8 @@ parse_acpi_hid_uid(struct device *dev, const char *fmt, ...)
 		}
 	}
 
-	rc = read_sysfs_file(&fbuf, "%s/firmware_node/hid", path);
+	rc = read_sysfs_file(&dev->arena, &fbuf,
+			     "%s/firmware_node/hid", path);
 	if (rc < 0 || fbuf == NULL) {
 		efi_error("could not read %s/firmware_node/hid", path);
 		return -1;
@@ -78,7 +80,8 @@ hid_err:
 
 	errno = 0;
 	fbuf = NULL;
-	rc = read_sysfs_file(&fbuf, "%s/firmware_node/uid", path);
+	rc = read_sysfs_file(&dev->arena, &fbuf,
+			     "%s/firmware_node/uid", path);
 	if ((rc < 0 && errno != ENOENT) || (rc > 0 && fbuf == NULL)) {
 		efi_error("could not read %s/firmware_node/uid", path);
 		return -1;
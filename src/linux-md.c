@@ -6,10 +6,12 @@
 
 #include "fix_coverity.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdint.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
 #include "efiboot.h"
@@ -71,6 +73,185 @@ make_part_name(struct device *dev)
 	return ret;
 }
 
+/*
+ * The last and second-to-last components of a sysfs block device link,
+ * e.g. "sda1" and "sda" for ../../devices/.../block/sda/sda1.
+ */
+static int
+link_names(char *link, char **name, char **parent)
+{
+	char *slash;
+
+	slash = strrchr(link, '/');
+	if (!slash || !slash[1])
+		return -1;
+	*name = slash + 1;
+	if (parent) {
+		*slash = '\0';
+		slash = strrchr(link, '/');
+		*parent = slash ? slash + 1 : link;
+	}
+	return 0;
+}
+
+/*
+ * Which partition the block device /sys/class/block/name is, or 0 if
+ * it's a whole disk.
+ */
+static int
+block_partition(struct arena *arena, const char *name)
+{
+	uint8_t *buf = NULL;
+	char *path;
+	int part = 0;
+	ssize_t rc;
+
+	if (arena_asprintf(arena, &path, "class/block/%s/partition", name) < 0)
+		return -1;
+	if (sysfs_accessat(path, F_OK) < 0)
+		return 0;
+	rc = sysfs_read_fileat(arena, path, &buf);
+	if (rc <= 0 || !buf || sscanf((char *)buf, "%d", &part) != 1)
+		return -1;
+	return part;
+}
+
+/*
+ * Find the disks a file on the md RAID1 array (or a partition of it)
+ * devnum is mirrored on, and what partition of each disk holds the copy
+ * of it, all from one look at /sys/block/mdN/slaves/.  Members are
+ * either partitions, so the copy is that partition, or whole disks with
+ * the array's partition table on them, so it's the same partition the
+ * array's is.
+ */
+int HIDDEN
+md_get_members(dev_t devnum, struct md_member **membersp, size_t *np)
+{
+	struct arena arena = { 0, };
+	struct md_member *members = NULL;
+	size_t n = 0, size = 0;
+	char *link = NULL, *name, *mdname;
+	uint8_t *level = NULL;
+	struct dirent *de;
+	DIR *d = NULL;
+	int mdpart;
+	int rc;
+
+	rc = sysfs_readlink(&arena, &link, "dev/block/%u:%u",
+			    major(devnum), minor(devnum));
+	if (rc < 0 || !link)
+		goto err;
+
+	if (link_names(link, &name, NULL) < 0) {
+		errno = EINVAL;
+		efi_error("could not parse sysfs link \"%s\"", link);
+		goto err;
+	}
+	mdpart = block_partition(&arena, name);
+	if (mdpart < 0) {
+		efi_error("could not get partition number for %s", name);
+		goto err;
+	}
+	mdname = name;
+	if (mdpart && link_names(link, &name, &mdname) < 0) {
+		errno = EINVAL;
+		efi_error("could not find the md device for %s", name);
+		goto err;
+	}
+	debug("md device:%s partition:%d", mdname, mdpart);
+
+	rc = read_sysfs_file(&arena, &level, "block/%s/md/level", mdname);
+	if (rc <= 0 || !level) {
+		errno = ENOTBLK;
+		efi_error("%s is not an md device", mdname);
+		goto err;
+	}
+	level[strcspn((char *)level, "\n")] = '\0';
+	if (strcmp((char *)level, "raid1")) {
+		errno = EINVAL;
+		efi_error("%s is %s, not a mirror", mdname, (char *)level);
+		goto err;
+	}
+
+	d = sysfs_opendir(&arena, "block/%s/slaves/", mdname);
+	if (!d)
+		goto err;
+
+	while ((de = readdir(d)) != NULL) {
+		char *memberlink = NULL, *disk = NULL;
+		struct md_member *member;
+		int part;
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		part = block_partition(&arena, de->d_name);
+		if (part < 0) {
+			efi_error("could not get partition number for %s",
+				  de->d_name);
+			goto err;
+		}
+		if (part) {
+			rc = sysfs_readlink(&arena, &memberlink,
+					    "class/block/%s", de->d_name);
+			if (rc < 0 || !memberlink ||
+			    link_names(memberlink, &name, &disk) < 0) {
+				errno = EINVAL;
+				efi_error("could not find disk for %s",
+					  de->d_name);
+				goto err;
+			}
+		} else {
+			disk = de->d_name;
+			part = mdpart;
+		}
+
+		if (n == size) {
+			size_t newsize = size ? size * 2 : 4;
+			struct md_member *newmembers;
+
+			newmembers = reallocarray(members, newsize,
+						  sizeof(*members));
+			if (!newmembers) {
+				efi_error("could not allocate memory");
+				goto err;
+			}
+			members = newmembers;
+			size = newsize;
+		}
+		member = &members[n];
+		member->partition = part;
+		if (asprintf(&member->devpath, "/dev/%s", disk) < 0) {
+			efi_error("could not allocate memory");
+			goto err;
+		}
+		n++;
+		debug("member %zu: %s partition %d", n, member->devpath, part);
+	}
+	closedir(d);
+	arena_free(&arena);
+
+	*membersp = members;
+	*np = n;
+	return 0;
+err:
+	rc = errno;
+	if (d)
+		closedir(d);
+	md_members_free(members, n);
+	arena_free(&arena);
+	errno = rc;
+	return -1;
+}
+
+void HIDDEN
+md_members_free(struct md_member *members, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		free(members[i].devpath);
+	free(members);
+}
+
 static enum interface_type md_iftypes[] = { md, unknown };
 
 struct dev_probe HIDDEN md_parser = {
@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * libefiboot - library for the manipulation of EFI boot variables
+ * Copyright 2012-2019 Red Hat, Inc.
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <ifaddrs.h>
+#include <inttypes.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include "efiboot.h"
+
+/*
+ * What we know about the network interfaces, for making MAC(), IPv4(),
+ * and IPv6() nodes.
+ *
+ * This all comes from one getifaddrs() call, which is a single netlink
+ * dump of every link and address on the system, rather than a socket and
+ * a pair of ioctls per interface.  While the sysfs cache is active the
+ * snapshot is kept until the cache is flushed, so making paths for every
+ * NIC on a machine only asks the kernel once.  Otherwise every lookup
+ * takes a new one.
+ */
+
+struct net_snapshot {
+	struct net_iface *ifaces;
+	size_t n_ifaces;
+};
+
+static pthread_mutex_t net_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct net_snapshot net_snapshot;
+static unsigned int net_snapshot_gen;
+
+static void
+net_snapshot_free(struct net_snapshot *snap)
+{
+	for (size_t i = 0; i < snap->n_ifaces; i++)
+		free(snap->ifaces[i].addrs);
+	free(snap->ifaces);
+	snap->ifaces = NULL;
+	snap->n_ifaces = 0;
+}
+
+static struct net_iface *
+net_snapshot_find(struct net_snapshot *snap, const char *ifname)
+{
+	for (size_t i = 0; i < snap->n_ifaces; i++)
+		if (!strcmp(snap->ifaces[i].name, ifname))
+			return &snap->ifaces[i];
+	return NULL;
+}
+
+static struct net_iface *
+net_snapshot_add_iface(struct net_snapshot *snap, const char *ifname)
+{
+	struct net_iface *iface, *ifaces;
+
+	iface = net_snapshot_find(snap, ifname);
+	if (iface)
+		return iface;
+
+	if (strlen(ifname) >= sizeof(iface->name))
+		return NULL;
+
+	ifaces = realloc(snap->ifaces, sizeof(*ifaces) * (snap->n_ifaces + 1));
+	if (!ifaces)
+		return NULL;
+	snap->ifaces = ifaces;
+
+	iface = &snap->ifaces[snap->n_ifaces++];
+	memset(iface, 0, sizeof(*iface));
+	strcpy(iface->name, ifname);
+	return iface;
+}
+
+static uint8_t
+prefix_length(const uint8_t *mask, size_t len)
+{
+	uint8_t n = 0;
+
+	for (size_t i = 0; i < len; i++)
+		n += __builtin_popcount(mask[i]);
+	return n;
+}
+
+static int
+net_iface_add_addr(struct net_iface *iface, const struct ifaddrs *ifa)
+{
+	struct net_addr *addrs, *addr;
+	const uint8_t *data, *mask = NULL;
+	size_t len;
+
+	if (ifa->ifa_addr->sa_family == AF_INET) {
+		data = (const uint8_t *)
+			&((const struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+		if (ifa->ifa_netmask)
+			mask = (const uint8_t *)&((const struct sockaddr_in *)
+					ifa->ifa_netmask)->sin_addr;
+		len = 4;
+	} else {
+		data = (const uint8_t *)
+			&((const struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+		if (ifa->ifa_netmask)
+			mask = (const uint8_t *)&((const struct sockaddr_in6 *)
+					ifa->ifa_netmask)->sin6_addr;
+		len = 16;
+	}
+
+	addrs = realloc(iface->addrs, sizeof(*addrs) * (iface->n_addrs + 1));
+	if (!addrs)
+		return -1;
+	iface->addrs = addrs;
+
+	addr = &iface->addrs[iface->n_addrs++];
+	memset(addr, 0, sizeof(*addr));
+	addr->family = ifa->ifa_addr->sa_family;
+	memcpy(addr->addr, data, len);
+	if (mask)
+		addr->prefix_length = prefix_length(mask, len);
+	return 0;
+}
+
+static int
+net_snapshot_take(struct net_snapshot *snap)
+{
+	struct ifaddrs *ifas = NULL;
+	int rc;
+
+	memset(snap, 0, sizeof(*snap));
+
+	rc = getifaddrs(&ifas);
+	if (rc < 0) {
+		efi_error("could not list network interfaces");
+		return -1;
+	}
+
+	for (struct ifaddrs *ifa = ifas; ifa; ifa = ifa->ifa_next) {
+		struct net_iface *iface;
+		int family;
+
+		if (!ifa->ifa_addr)
+			continue;
+		family = ifa->ifa_addr->sa_family;
+		if (family != AF_PACKET && family != AF_INET &&
+		    family != AF_INET6)
+			continue;
+
+		iface = net_snapshot_add_iface(snap, ifa->ifa_name);
+		if (!iface)
+			goto err;
+
+		if (family == AF_PACKET) {
+			/*
+			 * glibc hands back a sockaddr_ll with room for
+			 * addresses longer than sll_addr, so go by sll_halen
+			 * rather than sizeof(sll_addr).
+			 */
+			const struct sockaddr_ll *sll =
+				(const struct sockaddr_ll *)ifa->ifa_addr;
+			size_t len = MIN(sll->sll_halen,
+					 sizeof(iface->hw_addr));
+
+			iface->index = sll->sll_ifindex;
+			iface->hw_type = sll->sll_hatype;
+			iface->hw_addr_len = len;
+			memcpy(iface->hw_addr, (const uint8_t *)sll +
+			       offsetof(struct sockaddr_ll, sll_addr), len);
+		} else if (net_iface_add_addr(iface, ifa) < 0) {
+			goto err;
+		}
+	}
+	freeifaddrs(ifas);
+
+	debug("found %zu network interfaces", snap->n_ifaces);
+	return 0;
+err:
+	efi_error("could not allocate memory");
+	freeifaddrs(ifas);
+	net_snapshot_free(snap);
+	return -1;
+}
+
+static int
+net_iface_copy(struct net_iface *dst, const struct net_iface *src)
+{
+	*dst = *src;
+	dst->addrs = NULL;
+	if (src->n_addrs) {
+		dst->addrs = calloc(src->n_addrs, sizeof(*dst->addrs));
+		if (!dst->addrs) {
+			efi_error("could not allocate memory");
+			return -1;
+		}
+		memcpy(dst->addrs, src->addrs,
+		       src->n_addrs * sizeof(*dst->addrs));
+	}
+	return 0;
+}
+
+/*
+ * Fill in iface with a copy of what the snapshot says about ifname; free
+ * it with net_iface_free().
+ */
+int HIDDEN
+net_iface_get(const char *ifname, struct net_iface *iface)
+{
+	struct net_snapshot snap;
+	struct net_iface *found;
+	unsigned int gen;
+	int rc = -1;
+
+	gen = sysfs_cache_generation();
+	if (gen == 0) {
+		if (net_snapshot_take(&snap) < 0)
+			return -1;
+		found = net_snapshot_find(&snap, ifname);
+		if (found)
+			rc = net_iface_copy(iface, found);
+		net_snapshot_free(&snap);
+		goto out;
+	}
+
+	pthread_mutex_lock(&net_snapshot_lock);
+	if (net_snapshot_gen != gen) {
+		pthread_mutex_unlock(&net_snapshot_lock);
+
+		if (net_snapshot_take(&snap) < 0)
+			return -1;
+
+		pthread_mutex_lock(&net_snapshot_lock);
+		net_snapshot_free(&net_snapshot);
+		net_snapshot = snap;
+		net_snapshot_gen = gen;
+	}
+	found = net_snapshot_find(&net_snapshot, ifname);
+	if (found)
+		rc = net_iface_copy(iface, found);
+	pthread_mutex_unlock(&net_snapshot_lock);
+out:
+	if (!found) {
+		errno = ENODEV;
+		efi_error("no network interface named \"%s\"", ifname);
+	}
+	return rc;
+}
+
+void HIDDEN
+net_iface_free(struct net_iface *iface)
+{
+	free(iface->addrs);
+	iface->addrs = NULL;
+	iface->n_addrs = 0;
+}
+
+/*
+ * The interface's address that matches addr, or if addr is NULL, its
+ * first one of that family.
+ */
+const struct net_addr HIDDEN *
+net_iface_find_addr(const struct net_iface *iface, int family,
+		    const uint8_t *addr)
+{
+	size_t len = family == AF_INET ? 4 : 16;
+
+	for (size_t i = 0; i < iface->n_addrs; i++) {
+		const struct net_addr *a = &iface->addrs[i];
+
+		if (a->family == family &&
+		    (!addr || !memcmp(a->addr, addr, len)))
+			return a;
+	}
+	return NULL;
+}
+
+static void DESTRUCTOR
+net_snapshot_fini(void)
+{
+	pthread_mutex_lock(&net_snapshot_lock);
+	net_snapshot_free(&net_snapshot);
+	net_snapshot_gen = 0;
+	pthread_mutex_unlock(&net_snapshot_lock);
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -6,9 +6,12 @@
 
 #include "fix_coverity.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/param.h>
 #include <unistd.h>
@@ -38,7 +41,207 @@
  * /sys/class/block/nvme0n1/eui looks like:
  * $ cat /sys/class/block/nvme0n1/eui
  * 00 25 38 53 5a 16 1d a9
+ *
+ * That's a read (or, on older kernels, a hunt through device/device/...)
+ * for every namespace we look at.  So while the sysfs cache is active,
+ * the first lookup instead reads every namespace's eui from under
+ * /sys/class/nvme/nvmeN/ and /sys/class/nvme-subsystem/nvme-subsysN/ in
+ * one go, and the rest just look it up.  A namespace with no eui there
+ * isn't in the map, and gets looked for the old way.
+ */
+
+struct nvme_ns_info {
+	int32_t ctrl_id;
+	int32_t ns_id;
+	uint8_t eui[8];
+};
+
+static pthread_mutex_t nvme_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nvme_ns_info *nvme_map;
+static size_t nvme_map_len;
+static unsigned int nvme_map_gen;
+
+static int
+parse_eui(const uint8_t *filebuf, ssize_t len, uint8_t eui[8])
+{
+	int rc;
+
+	if (len < 23) {
+		errno = EINVAL;
+		return -1;
+	}
+	rc = sscanf((const char *)filebuf,
+		    "%02hhx %02hhx %02hhx %02hhx "
+		    "%02hhx %02hhx %02hhx %02hhx",
+		    &eui[0], &eui[1], &eui[2], &eui[3],
+		    &eui[4], &eui[5], &eui[6], &eui[7]);
+	if (rc < 8) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+nvme_ns_cmp(const void *a, const void *b)
+{
+	const struct nvme_ns_info *nsa = a, *nsb = b;
+
+	if (nsa->ctrl_id != nsb->ctrl_id)
+		return nsa->ctrl_id < nsb->ctrl_id ? -1 : 1;
+	if (nsa->ns_id != nsb->ns_id)
+		return nsa->ns_id < nsb->ns_id ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Add the nvme%dn%d namespaces in the directory pfd; ones named
+ * nvme%dc%dn%d are the paths under a multipath namespace, and the
+ * namespace itself is in the subsystem.
  */
+static int
+nvme_map_scan_parent(int pfd, struct nvme_ns_info **map, size_t *len,
+		     size_t *size)
+{
+	struct dirent *de;
+	DIR *d;
+
+	d = fdopendir(pfd);
+	if (!d) {
+		close(pfd);
+		return 0;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		struct nvme_ns_info ns = { 0, };
+		uint8_t filebuf[64];
+		char euipath[NAME_MAX + sizeof("/eui")];
+		int end = -1;
+		ssize_t rc;
+		int fd;
+
+		sscanf(de->d_name, "nvme%dn%d%n", &ns.ctrl_id, &ns.ns_id,
+		       &end);
+		if (end < 0 || de->d_name[end] != '\0')
+			continue;
+
+		snprintf(euipath, sizeof(euipath), "%s/eui", de->d_name);
+		fd = openat(dirfd(d), euipath, O_RDONLY|O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		rc = read(fd, filebuf, sizeof(filebuf) - 1);
+		close(fd);
+		if (rc < 0)
+			continue;
+		filebuf[rc] = '\0';
+		if (parse_eui(filebuf, rc, ns.eui) < 0)
+			continue;
+
+		if (*len == *size) {
+			size_t newsize = *size ? *size * 2 : 32;
+			struct nvme_ns_info *newmap;
+
+			newmap = reallocarray(*map, newsize, sizeof(**map));
+			if (!newmap) {
+				closedir(d);
+				return -1;
+			}
+			*map = newmap;
+			*size = newsize;
+		}
+		(*map)[(*len)++] = ns;
+	}
+	closedir(d);
+	return 0;
+}
+
+static int
+nvme_map_scan_class(const char *class, const char *prefix,
+		    struct nvme_ns_info **map, size_t *len, size_t *size)
+{
+	struct dirent *de;
+	DIR *d;
+	int rc = 0;
+
+	d = opendir(class);
+	if (!d)
+		return 0;
+
+	while (rc >= 0 && (de = readdir(d)) != NULL) {
+		int pfd;
+
+		if (strncmp(de->d_name, prefix, strlen(prefix)))
+			continue;
+		pfd = openat(dirfd(d), de->d_name,
+			     O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (pfd < 0)
+			continue;
+		rc = nvme_map_scan_parent(pfd, map, len, size);
+	}
+	closedir(d);
+	return rc;
+}
+
+/*
+ * Find ctrl_id/ns_id in the map, (re)building it first if the sysfs
+ * cache has been flushed since it was made.  Returns 1 and fills in eui
+ * if it's there, 0 if it isn't or we're not keeping a map right now.
+ */
+static int
+nvme_map_lookup(int32_t ctrl_id, int32_t ns_id, uint8_t eui[8])
+{
+	struct nvme_ns_info key = { .ctrl_id = ctrl_id, .ns_id = ns_id };
+	struct nvme_ns_info *map = NULL, *found;
+	size_t len = 0, size = 0;
+	unsigned int gen;
+	int ret = 0;
+
+	gen = sysfs_cache_generation();
+	if (gen == 0)
+		return 0;
+
+	pthread_mutex_lock(&nvme_map_lock);
+	if (nvme_map_gen != gen) {
+		pthread_mutex_unlock(&nvme_map_lock);
+
+		if (nvme_map_scan_class("/sys/class/nvme", "nvme",
+					&map, &len, &size) < 0 ||
+		    nvme_map_scan_class("/sys/class/nvme-subsystem",
+					"nvme-subsys", &map, &len, &size) < 0) {
+			free(map);
+			return 0;
+		}
+		if (len)
+			qsort(map, len, sizeof(*map), nvme_ns_cmp);
+		debug("found %zu namespaces with an eui", len);
+
+		pthread_mutex_lock(&nvme_map_lock);
+		free(nvme_map);
+		nvme_map = map;
+		nvme_map_len = len;
+		nvme_map_gen = gen;
+	}
+
+	found = nvme_map_len ? bsearch(&key, nvme_map, nvme_map_len,
+				       sizeof(*nvme_map), nvme_ns_cmp) : NULL;
+	if (found) {
+		memcpy(eui, found->eui, sizeof(found->eui));
+		ret = 1;
+	}
+	pthread_mutex_unlock(&nvme_map_lock);
+	return ret;
+}
+
+static void DESTRUCTOR
+nvme_map_fini(void)
+{
+	pthread_mutex_lock(&nvme_map_lock);
+	free(nvme_map);
+	nvme_map = NULL;
+	nvme_map_len = 0;
+	nvme_map_gen = 0;
+	pthread_mutex_unlock(&nvme_map_lock);
+}
 
 static ssize_t
 parse_nvme(struct device *dev, const char *path, const char *root UNUSED)
@@ -123,28 +326,25 @@ parse_nvme(struct device *dev, const char *path, const char *root UNUSED)
 	 * now fish the eui out of sysfs is there is one...
 	 */
 	debug("looking for the eui");
+	uint8_t eui[8];
+	if (nvme_map_lookup(ctrl_id, ns_id, eui) > 0) {
+		dev->nvme_info.has_eui = 1;
+		memcpy(dev->nvme_info.eui, eui, sizeof(eui));
+		goto done;
+	}
+
 	char *euipath = NULL;
-	rc = read_sysfs_file(&filebuf, "class/block/nvme%dn%d/eui", ctrl_id, ns_id);
+	rc = read_sysfs_file(&dev->arena, &filebuf,
+			     "class/block/nvme%dn%d/eui", ctrl_id, ns_id);
 	if (rc < 0 && (errno == ENOENT || errno == ENOTDIR)) {
-		rc = find_device_file(&euipath, "eui", "class/block/nvme%dn%d", ctrl_id, ns_id);
+		rc = find_device_file(&dev->arena, &euipath, "eui",
+				      "class/block/nvme%dn%d", ctrl_id, ns_id);
 		if (rc >= 0 && euipath != NULL)
-			rc = read_sysfs_file(&filebuf, "%s", euipath);
+			rc = read_sysfs_file(&dev->arena, &filebuf, "%s", euipath);
 	}
 	if (rc >= 0 && filebuf != NULL) {
-	        uint8_t eui[8];
-	        if (rc < 23) {
-	                errno = EINVAL;
-	                return -1;
-	        }
-	        rc = sscanf((char *)filebuf,
-	                    "%02hhx %02hhx %02hhx %02hhx "
-	                    "%02hhx %02hhx %02hhx %02hhx",
-	                    &eui[0], &eui[1], &eui[2], &eui[3],
-	                    &eui[4], &eui[5], &eui[6], &eui[7]);
-	        if (rc < 8) {
-	                errno = EINVAL;
+	        if (parse_eui(filebuf, rc, eui) < 0)
 	                return -1;
-	        }
 		debug("eui is %02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx",
 		      eui[0], eui[1], eui[2], eui[3],
 		      eui[4], eui[5], eui[6], eui[7]);
@@ -152,6 +352,7 @@ parse_nvme(struct device *dev, const char *path, const char *root UNUSED)
 	        memcpy(dev->nvme_info.eui, eui, sizeof(eui));
 	}
 
+done:
 	debug("current:'%s' sz:%zd", current, current - path);
 	return current - path;
 }
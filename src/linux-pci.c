@@ -79,13 +79,15 @@ parse_pci(struct device *dev, const char *path, const char *root)
 	                return -1;
 	        }
 	        tmp[current - root] = '\0';
-	        rc = sysfs_stat(&statbuf, "class/block/%s/driver", tmp);
+	        rc = sysfs_stat(&dev->arena, &statbuf,
+	                        "class/block/%s/driver", tmp);
 	        if (rc < 0 && errno == ENOENT) {
 	                debug("No driver link for /sys/class/block/%s", tmp);
 	                debug("Assuming this is just a buggy platform core driver");
 	                dev->pci_dev[i].driverlink = NULL;
 	        } else {
-	                rc = sysfs_readlink(&linkbuf, "class/block/%s/driver", tmp);
+	                rc = sysfs_readlink(&dev->arena, &linkbuf,
+	                                    "class/block/%s/driver", tmp);
 	                if (rc < 0 || !linkbuf) {
 	                        efi_error("Could not find driver for pci device %s", tmp);
 	                        free(tmp);
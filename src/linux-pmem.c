@@ -103,7 +103,7 @@ parse_pmem(struct device *dev, const char *path, const char *root UNUSED)
 	/*
 	 * but the UUID we really do need to have.
 	 */
-	rc = read_sysfs_file(&filebuf,
+	rc = read_sysfs_file(&dev->arena, &filebuf,
 	                     "class/block/%s/device/namespace", dev->disk_name);
 	if ((rc < 0 && errno == ENOENT) || filebuf == NULL)
 	        return -1;
@@ -114,7 +114,8 @@ parse_pmem(struct device *dev, const char *path, const char *root UNUSED)
 
 	filebuf = NULL;
 	debug("nvdimm namespace is '%s'", namespace);
-	rc = read_sysfs_file(&filebuf, "bus/nd/devices/%s/uuid", namespace);
+	rc = read_sysfs_file(&dev->arena, &filebuf,
+	                     "bus/nd/devices/%s/uuid", namespace);
 	free(namespace);
 	if (rc < 0 || filebuf == NULL)
 	        return -1;
@@ -125,7 +126,8 @@ parse_pmem(struct device *dev, const char *path, const char *root UNUSED)
 	        return -1;
 
 	filebuf = NULL;
-	rc = read_sysfs_file(&filebuf, "class/block/%s/device/uuid",
+	rc = read_sysfs_file(&dev->arena, &filebuf,
+	                     "class/block/%s/device/uuid",
 	                     dev->disk_name);
 	if (rc < 0 || filebuf == NULL)
 	        return -1;
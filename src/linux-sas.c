@@ -17,7 +17,8 @@
 static int
 get_port_expander_sas_address(uint64_t *sas_address, uint32_t scsi_host,
 	                      uint32_t local_port_id,
-	                      uint32_t remote_port_id, uint32_t remote_scsi_target)
+	                      uint32_t remote_port_id, uint32_t remote_scsi_target,
+	                      struct device *dev)
 {
 	uint8_t *filebuf = NULL;
 	int rc;
@@ -44,7 +45,7 @@ get_port_expander_sas_address(uint64_t *sas_address, uint32_t scsi_host,
 
 	debug("looking for /sys/class/scsi_host/host%d/device/port-%d:%d/expander-%d:%d/sas_device/expander-%d:%d/sas_address",
 	      scsi_host, scsi_host, port_id, scsi_host, remote_scsi_target, scsi_host, remote_scsi_target);
-	rc = read_sysfs_file(&filebuf,
+	rc = read_sysfs_file(&dev->arena, &filebuf,
 	                     "class/scsi_host/host%d/device/port-%d:%d/expander-%d:%d/sas_device/expander-%d:%d/sas_address",
 	                     scsi_host, scsi_host, port_id, scsi_host, remote_scsi_target, scsi_host, remote_scsi_target);
 	if (rc < 0 || filebuf == NULL) {
@@ -59,7 +60,7 @@ get_port_expander_sas_address(uint64_t *sas_address, uint32_t scsi_host,
 	      scsi_host, remote_scsi_target, remote_port_id,
 	      scsi_host, remote_scsi_target, remote_port_id,
 	      scsi_host, remote_scsi_target, remote_port_id);
-	rc = read_sysfs_file(&filebuf,
+	rc = read_sysfs_file(&dev->arena, &filebuf,
 	                     "class/scsi_host/host%d/device/port-%d:%d/expander-%d:%d/port-%d:%d:%d/end_device-%d:%d:%d/sas_device/end_device-%d:%d:%d/sas_address",
 	                     scsi_host,
 	                     scsi_host, local_port_id,
@@ -86,7 +87,7 @@ get_local_sas_address(uint64_t *sas_address, struct device *dev)
 	int rc;
 	char *filebuf = NULL;
 
-	rc = read_sysfs_file(&filebuf,
+	rc = read_sysfs_file(&dev->arena, &filebuf,
 	                     "class/block/%s/device/sas_address",
 	                     dev->disk_name);
 	if (rc < 0 || filebuf == NULL)
@@ -166,7 +167,7 @@ parse_sas(struct device *dev, const char *path, const char *root UNUSED)
 	 * validating all this junk.
 	 */
 	debug("looking for /sys/class/scsi_host/host%d/host_sas_address", scsi_host);
-	rc = sysfs_stat(&statbuf,
+	rc = sysfs_stat(&dev->arena, &statbuf,
 	                "class/scsi_host/host%d/host_sas_address",
 	                scsi_host);
 	/*
@@ -184,7 +185,7 @@ parse_sas(struct device *dev, const char *path, const char *root UNUSED)
 	         * have such a device in front of me right now.
 	         */
 	        debug("looking for /sys/class/sas_host/host%d", scsi_host);
-	        rc = sysfs_stat(&statbuf,
+	        rc = sysfs_stat(&dev->arena, &statbuf,
 	                        "class/sas_host/host%d", scsi_host);
 	        if (rc < 0) {
 	                debug("didn't find it.");
@@ -199,7 +200,7 @@ parse_sas(struct device *dev, const char *path, const char *root UNUSED)
 	        rc = get_port_expander_sas_address(&sas_address, scsi_host,
 	                                           local_port_id,
 	                                           remote_port_id,
-	                                           remote_scsi_target);
+	                                           remote_scsi_target, dev);
 	        if (rc < 0) {
 	                debug("Couldn't find port expander sas address");
 	                return 0;
@@ -56,7 +56,7 @@ sysfs_sata_get_port_info(uint32_t print_id, struct device *dev)
 	uint8_t *buf = NULL;
 	int rc;
 
-	d = sysfs_opendir("class/ata_device/");
+	d = sysfs_opendir(&dev->arena, "class/ata_device/");
 	if (!d) {
 	        efi_error("could not open /sys/class/ata_device/");
 	        return -1;
@@ -100,7 +100,8 @@ sysfs_sata_get_port_info(uint32_t print_id, struct device *dev)
 	}
 	closedir(d);
 
-	rc = read_sysfs_file(&buf, "class/ata_port/ata%d/port_no",
+	rc = read_sysfs_file(&dev->arena, &buf,
+	                     "class/ata_port/ata%d/port_no",
 	                     print_id);
 	if (rc <= 0 || buf == NULL)
 	        return -1;
@@ -13,6 +13,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <net/if.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
@@ -21,12 +22,11 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __linux__
-#include <linux/ethtool.h>
 #include <linux/version.h>
-#include <linux/sockios.h>
 #include <scsi/scsi.h>
 #include <sys/sysmacros.h>
 #include <sys/utsname.h>
@@ -42,6 +42,8 @@
 #endif
 
 #include "efiboot.h"
+#include "stats.h"
+#include "trace.h"
 
 #if defined(__OpenBSD__) || defined(__NetBSD__)
 
@@ -69,6 +71,8 @@ int HIDDEN
 find_parent_devpath(const char * const child, char **parent)
 {
 #ifdef __linux__
+	struct arena arena = { 0, };
+	struct path_seg segs[2];
 	int ret;
 	char *node;
 	char *linkbuf;
@@ -80,29 +84,23 @@ find_parent_devpath(const char * const child, char **parent)
 	node++;
 
 	/* look up full path symlink */
-	ret = sysfs_readlink(&linkbuf, "class/block/%s", node);
+	ret = sysfs_readlink(&arena, &linkbuf, "class/block/%s", node);
 	if (ret < 0 || !linkbuf)
-	        return ret;
+	        goto out;
 
-	/* strip child */
-	node = strrchr(linkbuf, '/');
-	if (!node)
-	        return -1;
-	*node = '\0';
-
-	/* read parent */
-	node = strrchr(linkbuf, '/');
-	if (!node)
-	        return -1;
-	*node = '\0';
-	node++;
+	/* the parent is the segment before the child */
+	ret = -1;
+	if (path_last_segments(linkbuf, segs, 2) < 2 ||
+	    path_seg_is(&segs[1], "/"))
+	        goto out;
 
 	/* write out new path */
-	ret = asprintf(parent, "/dev/%s", node);
-	if (ret < 0)
-	        return ret;
-
-	return 0;
+	ret = asprintf(parent, "/dev/" PATH_SEG_FMT, PATH_SEG_ARG(&segs[1]));
+	if (ret >= 0)
+	        ret = 0;
+out:
+	arena_free(&arena);
+	return ret;
 #elif defined(__OpenBSD__) || defined(__NetBSD__)
 	int n;
 
@@ -265,12 +263,14 @@ set_disk_and_part_name(struct device *dev)
 {
 #ifdef __linux__
 	int rc = -1;
-	char *ultimate = pathseg(dev->link, -1);
-	char *penultimate = pathseg(dev->link, -2);
-	char *approximate = pathseg(dev->link, -3);
-	char *proximate = pathseg(dev->link, -4);
-	char *psl5 = pathseg(dev->link, -5);
+	struct path_seg segs[5];
+	const struct path_seg *ultimate = &segs[0];
+	const struct path_seg *penultimate = &segs[1];
+	const struct path_seg *approximate = &segs[2];
+	const struct path_seg *proximate = &segs[3];
+	const struct path_seg *psl5 = &segs[4];
 
+	path_last_segments(dev->link, segs, 5);
 
 	/*
 	 * devlinks look something like:
@@ -280,15 +280,15 @@ set_disk_and_part_name(struct device *dev)
 	errno = 0;
 	debug("dev->disk_name:%p dev->part_name:%p", dev->disk_name, dev->part_name);
 	debug("dev->part:%d", dev->part);
-	debug("ultimate:'%s'", ultimate ? : "");
-	debug("penultimate:'%s'", penultimate ? : "");
-	debug("approximate:'%s'", approximate ? : "");
-	debug("proximate:'%s'", proximate ? : "");
-	debug("psl5:'%s'", psl5 ? : "");
-
-	if (ultimate && penultimate &&
-	    ((proximate && !strcmp(proximate, "nvme")) ||
-	     (approximate && !strcmp(approximate, "block")))) {
+	debug("ultimate:'"PATH_SEG_FMT"'", PATH_SEG_ARG(ultimate));
+	debug("penultimate:'"PATH_SEG_FMT"'", PATH_SEG_ARG(penultimate));
+	debug("approximate:'"PATH_SEG_FMT"'", PATH_SEG_ARG(approximate));
+	debug("proximate:'"PATH_SEG_FMT"'", PATH_SEG_ARG(proximate));
+	debug("psl5:'"PATH_SEG_FMT"'", PATH_SEG_ARG(psl5));
+
+	if (ultimate->pos && penultimate->pos &&
+	    (path_seg_is(proximate, "nvme") ||
+	     path_seg_is(approximate, "block"))) {
 	        /*
 	         * 259:1 -> ../../devices/pci0000:00/0000:00:1d.0/0000:05:00.0/nvme/nvme0/nvme0n1/nvme0n1p1
 	         * 8:1 -> ../../devices/pci0000:00/0000:00:17.0/ata2/host1/target1:0:0/1:0:0:0/block/sda/sda1
@@ -296,19 +296,22 @@ set_disk_and_part_name(struct device *dev)
 	         * 252:1 -> ../../devices/pci0000:00/0000:00:07.0/virtio2/block/vda/vda1
 	         * 259:3 -> ../../devices/LNXSYSTM:00/LNXSYBUS:00/ACPI0012:00/ndbus0/region11/btt11.0/block/pmem11s/pmem11s1
 	         */
-	        set_disk_name(dev, "%s", penultimate);
-	        set_part_name(dev, "%s", ultimate);
-	        debug("disk:%s part:%s", penultimate, ultimate);
+	        set_disk_name(dev, PATH_SEG_FMT, PATH_SEG_ARG(penultimate));
+	        set_part_name(dev, PATH_SEG_FMT, PATH_SEG_ARG(ultimate));
+	        debug("disk:"PATH_SEG_FMT" part:"PATH_SEG_FMT,
+		      PATH_SEG_ARG(penultimate), PATH_SEG_ARG(ultimate));
 		rc = 0;
-	} else if (ultimate && approximate && !strcmp(approximate, "nvme")) {
+	} else if (ultimate->pos && path_seg_is(approximate, "nvme")) {
 	        /*
 	         * 259:0 -> ../../devices/pci0000:00/0000:00:1d.0/0000:05:00.0/nvme/nvme0/nvme0n1
 	         */
-	        set_disk_name(dev, "%s", ultimate);
-	        set_part_name(dev, "%sp%d", ultimate, dev->part);
-	        debug("disk:%s part:%sp%d", ultimate, ultimate, dev->part);
+	        set_disk_name(dev, PATH_SEG_FMT, PATH_SEG_ARG(ultimate));
+	        set_part_name(dev, PATH_SEG_FMT "p%d", PATH_SEG_ARG(ultimate),
+			      dev->part);
+	        debug("disk:"PATH_SEG_FMT" part:"PATH_SEG_FMT"p%d",
+		      PATH_SEG_ARG(ultimate), PATH_SEG_ARG(ultimate), dev->part);
 		rc = 0;
-	} else if (ultimate && penultimate && !strcmp(penultimate, "block")) {
+	} else if (ultimate->pos && path_seg_is(penultimate, "block")) {
 	        /*
 	         * 253:0 -> ../../devices/virtual/block/dm-0 (... I guess)
 	         * 8:0 -> ../../devices/pci0000:00/0000:00:17.0/ata2/host1/target1:0:0/1:0:0:0/block/sda
@@ -318,19 +321,22 @@ set_disk_and_part_name(struct device *dev)
 	         * 259:0 -> ../../devices/LNXSYSTM:00/LNXSYBUS:00/ACPI0012:00/ndbus0/region9/btt9.0/block/pmem9s
 	         * 259:1 -> ../../devices/LNXSYSTM:00/LNXSYBUS:00/ACPI0012:00/ndbus0/region11/btt11.0/block/pmem11s
 	         */
-	        set_disk_name(dev, "%s", ultimate);
-	        set_part_name(dev, "%s%d", ultimate, dev->part);
-	        debug("disk:%s part:%s%d", ultimate, ultimate, dev->part);
+	        set_disk_name(dev, PATH_SEG_FMT, PATH_SEG_ARG(ultimate));
+	        set_part_name(dev, PATH_SEG_FMT "%d", PATH_SEG_ARG(ultimate),
+			      dev->part);
+	        debug("disk:"PATH_SEG_FMT" part:"PATH_SEG_FMT"%d",
+		      PATH_SEG_ARG(ultimate), PATH_SEG_ARG(ultimate), dev->part);
 		rc = 0;
-	} else if (ultimate && approximate && !strcmp(approximate, "mtd")) {
+	} else if (ultimate->pos && path_seg_is(approximate, "mtd")) {
 	        /*
 	         * 31:0 -> ../../devices/platform/1e000000.palmbus/1e000b00.spi/spi_master/spi32766/spi32766.0/mtd/mtd0/mtdblock0
 	         */
-	        set_disk_name(dev, "%s", ultimate);
-	        debug("disk:%s", ultimate);
+	        set_disk_name(dev, PATH_SEG_FMT, PATH_SEG_ARG(ultimate));
+	        debug("disk:"PATH_SEG_FMT, PATH_SEG_ARG(ultimate));
 		rc = 0;
-	} else if ((proximate && ultimate && !strcmp(proximate, "nvme-fabrics")) ||
-		    (approximate && ultimate && !strcmp(approximate, "nvme-subsystem"))) {
+	} else if (ultimate->pos &&
+		   (path_seg_is(proximate, "nvme-fabrics") ||
+		    path_seg_is(approximate, "nvme-subsystem"))) {
 		/*
 		 * 259:0 ->../../devices/virtual/nvme-fabrics/ctl/nvme0/nvme0n1
 		 *				 ^ proximate            ^ ultimate
@@ -339,11 +345,12 @@ set_disk_and_part_name(struct device *dev)
 		 *                                ^ approximate  ^ penultimate
 		 *                                                   ultimate ^
 		 */
-		set_disk_name(dev, "%s", ultimate);
-		debug("disk:%s", ultimate);
+		set_disk_name(dev, PATH_SEG_FMT, PATH_SEG_ARG(ultimate));
+		debug("disk:"PATH_SEG_FMT, PATH_SEG_ARG(ultimate));
 		rc = 0;
-	} else if ((psl5 && penultimate && ultimate && !strcmp(psl5, "nvme-fabrics")) ||
-		   (proximate && penultimate && ultimate && !strcmp(proximate, "nvme-subsystem"))) {
+	} else if (penultimate->pos && ultimate->pos &&
+		   (path_seg_is(psl5, "nvme-fabrics") ||
+		    path_seg_is(proximate, "nvme-subsystem"))) {
 		/*
 		 * 259:1 -> ../../devices/virtual/nvme-fabrics/ctl/nvme0/nvme0n1/nvme0n1p1
 		 *                                ^psl5                  ^ penultimate
@@ -353,9 +360,10 @@ set_disk_and_part_name(struct device *dev)
 		 *                                ^ proximate                 ^ penultimate
 		 *                                                           ultimate ^
 		 */
-		set_disk_name(dev, "%s", penultimate);
-		set_part_name(dev, "%s", ultimate);
-		debug("disk:%s part:%s", penultimate, ultimate);
+		set_disk_name(dev, PATH_SEG_FMT, PATH_SEG_ARG(penultimate));
+		set_part_name(dev, PATH_SEG_FMT, PATH_SEG_ARG(ultimate));
+		debug("disk:"PATH_SEG_FMT" part:"PATH_SEG_FMT,
+		      PATH_SEG_ARG(penultimate), PATH_SEG_ARG(ultimate));
 		rc = 0;
 	}
 
@@ -460,26 +468,14 @@ set_disk_and_part_name(struct device *dev)
 #endif
 }
 
+/*
+ * linux-probes.h is generated from EFIBOOT_PROBES in the Makefile, in
+ * the order EFIBOOT_ALL_PROBES gives there.  pmem needs to be before
+ * PCI, so if it provides root it'll be found first.
+ */
 static struct dev_probe *dev_probes[] = {
 #ifdef __linux__
-	/*
-	 * pmem needs to be before PCI, so if it provides root it'll
-	 * be found first.
-	 */
-	&pmem_parser,
-	&acpi_root_parser,
-	&pci_root_parser,
-	&soc_root_parser,
-	&virtual_root_parser,
-	&pci_parser,
-	&virtblk_parser,
-	&sas_parser,
-	&sata_parser,
-	&nvme_parser,
-	&ata_parser,
-	&scsi_parser,
-	&i2o_parser,
-	&emmc_parser,
+#include "linux-probes.h"
 #endif
 	NULL
 };
@@ -525,6 +521,8 @@ device_free(struct device *dev)
 	if (dev->pci_dev)
 	        free(dev->pci_dev);
 
+	arena_free(&dev->arena);
+
 	memset(dev, 0, sizeof(*dev));
 	free(dev);
 }
@@ -554,25 +552,578 @@ print_dev_dp_node(struct device *dev, struct dev_probe *probe)
 	if (sz < 0)
 		return;
 	dpsz += sz;
-	bufsz = efidp_format_device_path(NULL, 0,
-					 (const_efidp)dp, dpsz);
+	bufsz = efidp_format_device_path_alloc(&buf, (const_efidp)dp, dpsz);
 	if (bufsz <= 0)
 		return;
 
-	buf = alloca(bufsz);
+	debug("Device path node is %s", buf);
+	free(buf);
+}
+
+/*
+ * Chunks are big enough that an ordinary lookup only needs one or two;
+ * anything bigger than a chunk gets one of its own.
+ */
+#define ARENA_CHUNK_SIZE	16384
+#define ARENA_ALIGN		__alignof__(max_align_t)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	uint8_t data[] __attribute__((__aligned__(ARENA_ALIGN)));
+};
+
+static struct arena_chunk *
+arena_grow(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t chunksz = MAX(size, (size_t)ARENA_CHUNK_SIZE);
+
+	chunk = malloc(sizeof(*chunk) + chunksz);
+	if (!chunk)
+		return NULL;
+	chunk->size = chunksz;
+	chunk->used = 0;
+
+	/*
+	 * Keep allocating from the current chunk if this one is just for
+	 * something big.
+	 */
+	if (arena->chunks && chunksz > ARENA_CHUNK_SIZE) {
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+	} else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	arena->nchunks += 1;
+	arena->reserved += chunksz;
+	return chunk;
+}
+
+/*
+ * Find size bytes of free space, without handing it out.  As long as size
+ * fits in a chunk, a following arena_alloc() of no more than *room bytes
+ * returns the same place.
+ */
+static uint8_t *
+arena_reserve(struct arena *arena, size_t size, size_t *room)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	size_t used;
+
+	if (chunk) {
+		used = ALIGN_UP(chunk->used, ARENA_ALIGN);
+		if (used <= chunk->size && chunk->size - used >= size) {
+			*room = chunk->size - used;
+			return chunk->data + used;
+		}
+	}
+
+	chunk = arena_grow(arena, size);
+	if (!chunk)
+		return NULL;
+	*room = chunk->size;
+	return chunk->data;
+}
+
+void HIDDEN *
+arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t room = 0;
+	uint8_t *ret;
+
+	if (size == 0)
+		size = 1;
+	ret = arena_reserve(arena, size, &room);
+	if (!ret) {
+		efi_error("could not allocate %zd bytes", size);
+		return NULL;
+	}
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+		if (ret >= chunk->data && ret < chunk->data + chunk->size) {
+			chunk->used = ret - chunk->data + size;
+			break;
+		}
+	}
+	arena->used += size;
+	return ret;
+}
+
+int HIDDEN
+arena_vasprintf(struct arena *arena, char **str, const char *fmt, va_list ap)
+{
+	size_t room = 0;
+	char *buf;
+	va_list aq;
+	int rc;
+
+	*str = NULL;
+	buf = (char *)arena_reserve(arena, 1, &room);
 	if (!buf)
-		return;
+		return -1;
 
-	bufsz = efidp_format_device_path(buf, bufsz,
-			(const_efidp)dp, dpsz);
-	if (bufsz <= 0)
+	va_copy(aq, ap);
+	rc = vsnprintf(buf, room, fmt, aq);
+	va_end(aq);
+	if (rc < 0)
+		return -1;
+
+	/*
+	 * If it didn't fit, all that happened was some scribbling on space
+	 * we hadn't handed out yet.
+	 */
+	buf = arena_alloc(arena, rc + 1);
+	if (!buf)
+		return -1;
+	if ((size_t)rc >= room)
+		vsnprintf(buf, rc + 1, fmt, ap);
+
+	*str = buf;
+	return rc;
+}
+
+int HIDDEN
+arena_asprintf(struct arena *arena, char **str, const char *fmt, ...)
+{
+	va_list ap;
+	int rc;
+
+	va_start(ap, fmt);
+	rc = arena_vasprintf(arena, str, fmt, ap);
+	va_end(ap);
+	return rc;
+}
+
+void HIDDEN
+arena_free(struct arena *arena)
+{
+	struct arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	memset(arena, 0, sizeof(*arena));
+}
+
+/*
+ * Probing one device reads the same handful of sysfs links and
+ * attributes several times over, and generating paths for every
+ * namespace on a controller walks the same PCI hierarchy once per
+ * namespace.  So while a lookup is in progress (or for the whole process,
+ * if asked) remember what we read, keyed by the path under /sys, and do
+ * the reads relative to one /sys directory fd instead of re-resolving
+ * "/sys/..." every time.
+ */
+enum sysfs_cache_kind {
+	SYSFS_READLINK,
+	SYSFS_READ,
+	SYSFS_ACCESS,
+	SYSFS_STAT,
+	BLOCKDEV_PATH,	/* not a read; see make_blockdev_path() */
+	NETDEV_PATH,	/* not a read; see make_mac_path() */
+};
+
+struct sysfs_cache_entry {
+	list_t list;
+	enum sysfs_cache_kind kind;
+	int mode;
+	ssize_t rc;
+	int error;
+	uint8_t *data;
+	size_t datasz;
+	char path[];
+};
+
+static pthread_mutex_t sysfs_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static DEF_LIST_HEAD(sysfs_cache);
+static unsigned int sysfs_cache_holds;
+static bool sysfs_cache_persistent;
+static unsigned int sysfs_cache_gen = 1;
+static int sysfs_dirfd = -1;
+
+static int
+get_sysfs_dirfd(void)
+{
+	if (sysfs_dirfd < 0)
+		sysfs_dirfd = open("/sys", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	return sysfs_dirfd;
+}
+
+static bool
+sysfs_cache_active(void)
+{
+	return sysfs_cache_holds > 0 || sysfs_cache_persistent;
+}
+
+static struct sysfs_cache_entry *
+sysfs_cache_find(enum sysfs_cache_kind kind, int mode, const char *path)
+{
+	list_t *pos;
+
+	list_for_each(pos, &sysfs_cache) {
+		struct sysfs_cache_entry *entry;
+
+		entry = list_entry(pos, struct sysfs_cache_entry, list);
+		if (entry->kind == kind && entry->mode == mode &&
+		    !strcmp(entry->path, path))
+			return entry;
+	}
+	return NULL;
+}
+
+static void
+sysfs_cache_add(enum sysfs_cache_kind kind, int mode, const char *path,
+		ssize_t rc, int error, const uint8_t *data, size_t datasz)
+{
+	struct sysfs_cache_entry *entry;
+	size_t pathsz = strlen(path) + 1;
+
+	entry = calloc(1, sizeof(*entry) + pathsz);
+	if (!entry)
 		return;
+	if (datasz) {
+		entry->data = malloc(datasz);
+		if (!entry->data) {
+			free(entry);
+			return;
+		}
+		memcpy(entry->data, data, datasz);
+	}
+	entry->kind = kind;
+	entry->mode = mode;
+	entry->rc = rc;
+	entry->error = error;
+	entry->datasz = datasz;
+	memcpy(entry->path, path, pathsz);
+	list_add(&entry->list, &sysfs_cache);
+}
 
-	debug("Device path node is %s", buf);
+static void
+sysfs_cache_flush(void)
+{
+	list_t *pos, *tmp;
+
+	if (++sysfs_cache_gen == 0)
+		sysfs_cache_gen = 1;
+
+	list_for_each_safe(pos, tmp, &sysfs_cache) {
+		struct sysfs_cache_entry *entry;
+
+		entry = list_entry(pos, struct sysfs_cache_entry, list);
+		list_del(&entry->list);
+		free(entry->data);
+		free(entry);
+	}
 }
 
-struct device HIDDEN
-*device_get(const char *devpath, int fd, int partition)
+/*
+ * Look path up in the cache; returns true and fills in rc, errno, and
+ * whichever of data/datasz are wanted if it's there.  data is copied into
+ * arena, with a NUL after it.
+ */
+static bool
+sysfs_cache_get(enum sysfs_cache_kind kind, int mode, const char *path,
+		ssize_t *rc, struct arena *arena, uint8_t **data,
+		size_t *datasz)
+{
+	struct sysfs_cache_entry *entry;
+	bool found = false;
+
+	stats_inc(sysfs_lookups);
+	pthread_mutex_lock(&sysfs_cache_lock);
+	if (!sysfs_cache_active())
+		goto out;
+	entry = sysfs_cache_find(kind, mode, path);
+	if (!entry)
+		goto out;
+
+	if (data && entry->datasz) {
+		*data = arena_alloc(arena, entry->datasz + 1);
+		if (!*data)
+			goto out;
+		memcpy(*data, entry->data, entry->datasz);
+		(*data)[entry->datasz] = '\0';
+	}
+	if (datasz)
+		*datasz = entry->datasz;
+	*rc = entry->rc;
+	errno = entry->error;
+	found = true;
+	stats_inc(sysfs_cache_hits);
+out:
+	pthread_mutex_unlock(&sysfs_cache_lock);
+	return found;
+}
+
+static void
+sysfs_cache_put(enum sysfs_cache_kind kind, int mode, const char *path,
+		ssize_t rc, const uint8_t *data, size_t datasz)
+{
+	int error = errno;
+
+	pthread_mutex_lock(&sysfs_cache_lock);
+	if (sysfs_cache_active() && !sysfs_cache_find(kind, mode, path))
+		sysfs_cache_add(kind, mode, path, rc, rc < 0 ? error : 0,
+				data, datasz);
+	pthread_mutex_unlock(&sysfs_cache_lock);
+	errno = error;
+}
+
+/*
+ * For things kept alongside the cache rather than in it: 0 if nothing
+ * should be remembered right now, and otherwise a number that changes
+ * every time the cache is flushed.
+ */
+unsigned int HIDDEN
+sysfs_cache_generation(void)
+{
+	unsigned int gen = 0;
+
+	pthread_mutex_lock(&sysfs_cache_lock);
+	if (sysfs_cache_active())
+		gen = sysfs_cache_gen;
+	pthread_mutex_unlock(&sysfs_cache_lock);
+	return gen;
+}
+
+void HIDDEN
+sysfs_cache_hold(void)
+{
+	pthread_mutex_lock(&sysfs_cache_lock);
+	sysfs_cache_holds += 1;
+	pthread_mutex_unlock(&sysfs_cache_lock);
+}
+
+void HIDDEN
+sysfs_cache_release(void)
+{
+	int error = errno;
+
+	pthread_mutex_lock(&sysfs_cache_lock);
+	if (sysfs_cache_holds > 0)
+		sysfs_cache_holds -= 1;
+	if (!sysfs_cache_active())
+		sysfs_cache_flush();
+	pthread_mutex_unlock(&sysfs_cache_lock);
+	errno = error;
+}
+
+void PUBLIC
+efi_sysfs_cache_enable(void)
+{
+	pthread_mutex_lock(&sysfs_cache_lock);
+	sysfs_cache_persistent = true;
+	pthread_mutex_unlock(&sysfs_cache_lock);
+}
+
+void PUBLIC
+efi_sysfs_cache_disable(void)
+{
+	pthread_mutex_lock(&sysfs_cache_lock);
+	sysfs_cache_persistent = false;
+	if (!sysfs_cache_active())
+		sysfs_cache_flush();
+	pthread_mutex_unlock(&sysfs_cache_lock);
+}
+
+static void DESTRUCTOR
+sysfs_cache_fini(void)
+{
+	pthread_mutex_lock(&sysfs_cache_lock);
+	sysfs_cache_flush();
+	if (sysfs_dirfd >= 0) {
+		close(sysfs_dirfd);
+		sysfs_dirfd = -1;
+	}
+	pthread_mutex_unlock(&sysfs_cache_lock);
+}
+
+/*
+ * readlink("/sys/<path>") into a NUL-terminated string allocated from
+ * arena; returns what readlink() would.
+ */
+ssize_t HIDDEN
+sysfs_readlinkat(struct arena *arena, const char *path, char **linkbuf)
+{
+	size_t room = 0;
+	uint8_t *data = NULL;
+	ssize_t rc;
+	int dfd;
+
+	*linkbuf = NULL;
+	if (sysfs_cache_get(SYSFS_READLINK, 0, path, &rc, arena, &data,
+			    NULL)) {
+		if (rc >= 0 && !data)
+			data = arena_alloc(arena, 1);
+		if (data)
+			*linkbuf = (char *)data;
+		return rc;
+	}
+
+	dfd = get_sysfs_dirfd();
+	if (dfd < 0)
+		return -1;
+	data = arena_reserve(arena, PATH_MAX + 1, &room);
+	if (!data)
+		return -1;
+	rc = readlinkat(dfd, path, (char *)data, PATH_MAX);
+	if (rc < PATH_MAX)
+		sysfs_cache_put(SYSFS_READLINK, 0, path, rc, data,
+				rc > 0 ? rc : 0);
+	if (rc >= 0) {
+		data = arena_alloc(arena, rc + 1);
+		data[rc] = '\0';
+		*linkbuf = (char *)data;
+	}
+	return rc;
+}
+
+/*
+ * Read "/sys/<path>" straight into arena, the way get_file() would;
+ * returns the size including the NUL we put after it.
+ */
+ssize_t HIDDEN
+sysfs_read_fileat(struct arena *arena, const char *path, uint8_t **result)
+{
+	uint8_t *buf;
+	size_t room = 0;
+	size_t len = 0;
+	ssize_t rc = 0;
+	int error;
+	int dfd;
+	int fd;
+
+	*result = NULL;
+	if (sysfs_cache_get(SYSFS_READ, 0, path, &rc, arena, result, NULL)) {
+		if (rc < 0)
+			efi_error("could not open file \"/sys/%s\" for reading",
+				  path);
+		return rc;
+	}
+
+	dfd = get_sysfs_dirfd();
+	if (dfd < 0)
+		return -1;
+	fd = openat(dfd, path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		efi_error("could not open file \"/sys/%s\" for reading",
+			  path);
+		sysfs_cache_put(SYSFS_READ, 0, path, -1, NULL, 0);
+		return -1;
+	}
+
+	/*
+	 * sysfs attributes are at most a page, so this nearly always fits
+	 * in what's left of the current chunk.
+	 */
+	buf = arena_reserve(arena, 4096 + 1, &room);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+	while (len < room - 1) {
+		rc = read(fd, buf + len, room - 1 - len);
+		if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (rc <= 0)
+			break;
+		len += rc;
+	}
+	if (rc < 0) {
+		buf = NULL;
+	} else if (len < room - 1) {
+		buf = arena_alloc(arena, len + 1);
+		buf[len] = '\0';
+	} else {
+		uint8_t *big = NULL;
+		size_t bigsz = 0;
+
+		buf = NULL;
+		if (lseek(fd, 0, SEEK_SET) == 0 &&
+		    read_file(fd, &big, &bigsz) == 0) {
+			len = bigsz - 1;
+			buf = arena_alloc(arena, bigsz);
+			if (buf)
+				memcpy(buf, big, bigsz);
+		}
+		free(big);
+	}
+	error = errno;
+	close(fd);
+	errno = error;
+
+	if (!buf) {
+		efi_error("could not read file \"/sys/%s\"", path);
+		return -1;
+	}
+
+	sysfs_cache_put(SYSFS_READ, 0, path, len + 1, buf, len + 1);
+	*result = buf;
+	return len + 1;
+}
+
+int HIDDEN
+sysfs_accessat(const char *path, int mode)
+{
+	ssize_t rc;
+	int dfd;
+
+	if (sysfs_cache_get(SYSFS_ACCESS, mode, path, &rc, NULL, NULL, NULL))
+		return rc;
+
+	dfd = get_sysfs_dirfd();
+	if (dfd < 0)
+		return -1;
+	rc = faccessat(dfd, path, mode, 0);
+	sysfs_cache_put(SYSFS_ACCESS, mode, path, rc, NULL, 0);
+	return rc;
+}
+
+int HIDDEN
+sysfs_statat(struct arena *arena, const char *path, struct stat *statbuf)
+{
+	uint8_t *data = NULL;
+	ssize_t rc;
+	int dfd;
+
+	if (sysfs_cache_get(SYSFS_STAT, 0, path, &rc, arena, &data, NULL)) {
+		if (rc >= 0 && data)
+			memcpy(statbuf, data, sizeof(*statbuf));
+		return rc;
+	}
+
+	dfd = get_sysfs_dirfd();
+	if (dfd < 0)
+		return -1;
+	rc = fstatat(dfd, path, statbuf, 0);
+	sysfs_cache_put(SYSFS_STAT, 0, path, rc, (uint8_t *)statbuf,
+			rc < 0 ? 0 : sizeof(*statbuf));
+	return rc;
+}
+
+static inline int64_t
+timespec_diff_us(const struct timespec *start, const struct timespec *end)
+{
+	return (int64_t)(end->tv_sec - start->tv_sec) * 1000000 +
+	       (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * The probes can't usefully run in parallel: each one starts parsing the
+ * device link where the one before it stopped, and fills in parts of dev
+ * the later ones look at.  Most of the ones that don't match give up on
+ * the link text alone, and the SCSI-ish ones that have to look in sysfs
+ * to tell themselves apart go through the sysfs cache above, as do the
+ * matching probe's own reads.  So all we do here is say where the time
+ * went when asked to be verbose.
+ */
+static struct device
+*device_get_(const char *devpath, int fd, int partition)
 {
 	struct device *dev;
 	char *linkbuf = NULL, *tmpbuf = NULL;
@@ -621,7 +1172,8 @@ struct device HIDDEN
 #ifdef __linux__
 	(void)devpath;
 
-	rc = sysfs_readlink(&linkbuf, "dev/block/%"PRIu64":%"PRIu32,
+	rc = sysfs_readlink(&dev->arena, &linkbuf,
+	                    "dev/block/%"PRIu64":%"PRIu32,
 	                    dev->major, dev->minor);
 	if (rc < 0 || !linkbuf) {
 	        efi_error("readlink of /sys/dev/block/%"PRIu64":%"PRIu32" failed",
@@ -642,7 +1194,8 @@ struct device HIDDEN
 #endif
 
 	if (dev->part == -1) {
-	        rc = read_sysfs_file(&tmpbuf, "dev/block/%s/partition", dev->link);
+	        rc = read_sysfs_file(&dev->arena, &tmpbuf,
+	                             "dev/block/%s/partition", dev->link);
 	        if (rc < 0 || !tmpbuf) {
 	                efi_error("device has no /partition node; not a partition");
 	        } else {
@@ -660,7 +1213,8 @@ struct device HIDDEN
 	debug("dev->disk_name: %s", dev->disk_name);
 	debug("dev->part_name: %s", dev->part_name);
 
-	rc = sysfs_readlink(&tmpbuf, "block/%s/device", dev->disk_name);
+	rc = sysfs_readlink(&dev->arena, &tmpbuf, "block/%s/device",
+	                    dev->disk_name);
 	if (rc < 0 || !tmpbuf) {
 	        debug("readlink of /sys/block/%s/device failed",
 	                  dev->disk_name);
@@ -695,21 +1249,23 @@ struct device HIDDEN
 	 */
 
 	char *filepath = NULL;
-	rc = find_device_file(&filepath, "driver", "block/%s", dev->disk_name);
+	rc = find_device_file(&dev->arena, &filepath, "driver", "block/%s",
+			      dev->disk_name);
 	if (rc >= 0) {
-		rc = sysfs_readlink(&tmpbuf, "%s", filepath);
+		rc = sysfs_readlink(&dev->arena, &tmpbuf, "%s", filepath);
 	        if (rc < 0 || !tmpbuf) {
 			efi_error("readlink of /sys/%s failed", filepath);
 	                goto err;
 	        }
 
-	        linkbuf = pathseg(tmpbuf, -1);
-	        if (!linkbuf) {
+	        struct path_seg driver;
+
+	        if (!path_last_segments(tmpbuf, &driver, 1)) {
 	                efi_error("could not get segment -1 of \"%s\"", tmpbuf);
 	                goto err;
 	        }
 
-	        dev->driver = strdup(linkbuf);
+	        dev->driver = strndup(driver.pos, driver.len);
 	} else {
 		dev->driver = strdup("");
 	}
@@ -722,6 +1278,9 @@ struct device HIDDEN
 	const char *current = dev->link;
 	bool needs_root = true;
 	int last_successful_probe = -1;
+	bool timing = efi_get_verbose() >= 1;
+	struct timespec probe_start;
+	int64_t probe_total_us = 0;
 
 	debug("searching for device nodes in %s", dev->link);
 	for (i = 0;
@@ -738,7 +1297,20 @@ struct device HIDDEN
 	        }
 
 	        debug("trying %s", probe->name);
+	        if (timing)
+	                clock_gettime(CLOCK_MONOTONIC, &probe_start);
+	        tracepoint(libefiboot, dev_probe_entry, probe->name, current);
 	        pos = probe->parse(dev, current, dev->link);
+	        tracepoint(libefiboot, dev_probe_return, probe->name, pos);
+	        if (timing) {
+	                struct timespec probe_end;
+	                int64_t us;
+
+	                clock_gettime(CLOCK_MONOTONIC, &probe_end);
+	                us = timespec_diff_us(&probe_start, &probe_end);
+	                probe_total_us += us;
+	                debug("%s took %"PRId64"us", probe->name, us);
+	        }
 	        if (pos < 0) {
 	                efi_error("parsing %s failed", probe->name);
 	                goto err;
@@ -801,6 +1373,11 @@ slash_err:
 	        }
 	}
 
+	if (timing)
+	        debug("probes took %"PRId64"us in total", probe_total_us);
+	debug("probing used %zd bytes in %u arena chunks",
+	      dev->arena.used, dev->arena.nchunks);
+
 	if (dev->interface_type == unknown &&
 	    !(dev->flags & DEV_ABBREV_ONLY) &&
 	    !strcmp(current, "block/")) {
@@ -815,97 +1392,255 @@ err:
 	return NULL;
 }
 
-int HIDDEN
-make_blockdev_path(uint8_t *buf, ssize_t size, struct device *dev)
+struct device HIDDEN
+*device_get(const char *devpath, int fd, int partition)
+{
+	struct device *dev;
+
+	sysfs_cache_hold();
+	dev = device_get_(devpath, fd, partition);
+	sysfs_cache_release();
+
+	return dev;
+}
+
+/*
+ * Every partition on a disk gets the same nodes in front of its HD(), so
+ * while the sysfs cache is active those are kept in it too, keyed by the
+ * disk's name, and paths for the rest of its partitions (or namespaces,
+ * or md members' partitions) are a copy instead of a trip through every
+ * probe again.
+ */
+static bool
+blockdev_path_cache_get(struct efidp_builder *builder, const char *disk_name,
+			ssize_t *sz)
+{
+	struct sysfs_cache_entry *entry;
+	bool found = false;
+	uint8_t *buf;
+
+	pthread_mutex_lock(&sysfs_cache_lock);
+	if (!sysfs_cache_active())
+		goto out;
+	entry = sysfs_cache_find(BLOCKDEV_PATH, 0, disk_name);
+	if (!entry)
+		goto out;
+
+	found = true;
+	*sz = -1;
+	if (entry->datasz) {
+		buf = efidp_builder_reserve(builder, entry->datasz);
+		if (!buf)
+			goto out;
+		memcpy(buf, entry->data, entry->datasz);
+		if (efidp_builder_advance(builder, entry->datasz) < 0)
+			goto out;
+	}
+	*sz = entry->datasz;
+out:
+	pthread_mutex_unlock(&sysfs_cache_lock);
+	return found;
+}
+
+/*
+ * Each probe's nodes are sized first and then made right where they go
+ * in builder's buffer, so nothing gets made twice or copied.
+ */
+ssize_t HIDDEN
+make_blockdev_path(struct efidp_builder *builder, struct device *dev)
 {
 	ssize_t off = 0;
+	uint8_t *end;
+
+	debug("entry");
 
-	debug("entry buf:%p size:%zd", buf, size);
+	if (dev->disk_name &&
+	    blockdev_path_cache_get(builder, dev->disk_name, &off)) {
+		debug("= %zd (cached)", off);
+		return off;
+	}
 
 	for (unsigned int i = 0; dev->probes[i] &&
 	                         dev->probes[i]->parse; i++) {
 	        struct dev_probe *probe = dev->probes[i];
+	        uint8_t *buf;
 	        ssize_t sz;
 
 	        if (!probe->create)
 	                continue;
 
-	        sz = probe->create(dev, buf + off, size ? size - off : 0, 0);
+	        sz = probe->create(dev, NULL, 0, 0);
 	        if (sz < 0) {
 	                efi_error("could not create %s device path",
 	                          probe->name);
 	                return sz;
 	        }
+	        if (sz == 0)
+	                continue;
+
+	        buf = efidp_builder_reserve(builder, sz);
+	        if (!buf)
+	                return -1;
+
+	        sz = probe->create(dev, buf, sz, 0);
+	        if (sz < 0 || efidp_builder_advance(builder, sz) < 0) {
+	                efi_error("could not create %s device path",
+	                          probe->name);
+	                return -1;
+	        }
 	        off += sz;
 	}
 
+	/* what we just made is the last off bytes before the end */
+	end = efidp_builder_reserve(builder, 0);
+	if (dev->disk_name && end)
+		sysfs_cache_put(BLOCKDEV_PATH, 0, dev->disk_name, off,
+				end - off, off);
+
 	debug("= %zd", off);
 
 	return off;
 }
 
-ssize_t HIDDEN
-make_mac_path(uint8_t *buf, ssize_t size, const char * const ifname)
-{
+/*
+ * A NIC's PciRoot()/Pci() nodes and its MAC() node don't change while the
+ * sysfs cache is active either, so they're kept in it keyed by the
+ * interface name, and every IPv4(), IPv6(), and iSCSI() path for it after
+ * the first starts with a copy.
+ */
 #ifdef __linux__
-	struct ifreq ifr;
-	struct ethtool_drvinfo drvinfo = { 0, };
-	int fd = -1, rc;
-	ssize_t ret = -1, sz, off = 0;
-	char busname[PATH_MAX+1] = "";
-	struct device dev;
-
-	memset(&dev, 0, sizeof (dev));
-	dev.interface_type = network;
-	dev.ifname = strdupa(ifname);
-	if (!dev.ifname)
+static struct dev_probe *net_probes[] = {
+	&pci_root_parser,
+	&pci_parser,
+	NULL
+};
+
+static int
+make_mac_path_(struct efidp_builder *builder, const char * const ifname)
+{
+	struct net_iface iface;
+	struct device *dev;
+	const char *current;
+	char *linkbuf;
+	uint8_t *buf;
+	ssize_t sz;
+	int ret = -1;
+
+	if (net_iface_get(ifname, &iface) < 0)
 	        return -1;
 
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+	        efi_error("could not allocate memory");
+	        goto err;
+	}
+
 	/*
 	 * find the device link, which looks like:
 	 * ../../devices/$PCI_STUFF/net/$IFACE
 	 */
-	rc = sysfs_readlink(&dev.link, "class/net/%s", ifname);
-	if (rc < 0 || !dev.link)
+	sz = sysfs_readlink(&dev->arena, &linkbuf, "class/net/%s", ifname);
+	if (sz < 0 || !linkbuf)
+	        goto err;
+	dev->link = strdup(linkbuf);
+	if (!dev->link) {
+	        efi_error("could not allocate memory");
 	        goto err;
+	}
 
-	memset(&ifr, 0, sizeof (ifr));
-	strncpy(ifr.ifr_name, ifname, IF_NAMESIZE);
-	ifr.ifr_name[IF_NAMESIZE-1] = '\0';
-	drvinfo.cmd = ETHTOOL_GDRVINFO;
-	ifr.ifr_data = (caddr_t)&drvinfo;
+	/*
+	 * If it isn't on PCI, or we can't tell where its root is, all we
+	 * can say is what its MAC address is.
+	 */
+	current = dev->link;
+	for (unsigned int i = 0; net_probes[i]; i++) {
+	        ssize_t pos;
+
+	        pos = net_probes[i]->parse(dev, current, dev->link);
+	        if (pos <= 0) {
+	                if (pos < 0)
+	                        debug("parsing %s failed; making MAC() only",
+	                              net_probes[i]->name);
+	                break;
+	        }
+	        current += pos;
+	        dev->n_probes = i + 1;
+	}
 
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (fd < 0)
-	        goto err;
+	for (unsigned int i = 0; i < dev->n_probes; i++) {
+	        struct dev_probe *probe = net_probes[i];
 
-	rc = ioctl(fd, SIOCETHTOOL, &ifr);
-	if (rc < 0)
+	        sz = probe->create(dev, NULL, 0, 0);
+	        if (sz <= 0) {
+	                if (sz < 0)
+	                        goto create_err;
+	                continue;
+	        }
+	        buf = efidp_builder_reserve(builder, sz);
+	        if (!buf)
+	                goto err;
+	        sz = probe->create(dev, buf, sz, 0);
+	        if (sz < 0 || efidp_builder_advance(builder, sz) < 0) {
+create_err:
+	                efi_error("could not create %s device path",
+	                          probe->name);
+	                goto err;
+	        }
+	}
+
+	sz = efidp_make_mac_addr(NULL, 0, iface.hw_type, iface.hw_addr,
+	                         sizeof(iface.hw_addr));
+	buf = efidp_builder_reserve(builder, sz);
+	if (!buf)
+	        goto err;
+	sz = efidp_make_mac_addr(buf, sz, iface.hw_type, iface.hw_addr,
+	                         sizeof(iface.hw_addr));
+	if (sz < 0 || efidp_builder_advance(builder, sz) < 0)
 	        goto err;
 
-	strncpy(busname, drvinfo.bus_info, PATH_MAX);
+	ret = 0;
+err:
+	device_free(dev);
+	net_iface_free(&iface);
+	return ret;
+}
+#endif
 
-	rc = ioctl(fd, SIOCGIFHWADDR, &ifr);
-	if (rc < 0)
-	        goto err;
+ssize_t HIDDEN
+make_mac_path(uint8_t *buf, ssize_t size, const char * const ifname)
+{
+#ifdef __linux__
+	struct efidp_builder *builder = NULL;
+	struct arena arena = { 0, };
+	uint8_t *data = NULL;
+	size_t datasz = 0;
+	ssize_t ret = -1, rc;
+
+	if (!sysfs_cache_get(NETDEV_PATH, 0, ifname, &rc, &arena, &data,
+	                     &datasz)) {
+	        if (efidp_builder_new(&builder) < 0) {
+	                efi_error("could not allocate memory");
+	                return -1;
+	        }
+	        if (make_mac_path_(builder, ifname) < 0)
+	                goto err;
 
-	sz = pci_parser.create(&dev, buf, size, off);
-	if (sz < 0)
-	        goto err;
-	off += sz;
+	        datasz = efidp_builder_size(builder);
+	        data = efidp_builder_reserve(builder, 0) - datasz;
+	        sysfs_cache_put(NETDEV_PATH, 0, ifname, datasz, data, datasz);
+	}
 
-	sz = efidp_make_mac_addr(buf+off, size?size-off:0,
-	                         ifr.ifr_ifru.ifru_hwaddr.sa_family,
-	                         (uint8_t *)ifr.ifr_ifru.ifru_hwaddr.sa_data,
-	                         sizeof(ifr.ifr_ifru.ifru_hwaddr.sa_data));
-	if (sz < 0)
+	if (size && (size_t)size < datasz) {
+	        errno = ENOSPC;
+	        efi_error("total size is bigger than size limit");
 	        goto err;
-
-	off += sz;
-	ret = off;
+	}
+	if (size)
+	        memcpy(buf, data, datasz);
+	ret = datasz;
 err:
-	if (fd >= 0)
-	        close(fd);
+	efidp_builder_free(builder);
+	arena_free(&arena);
 	return ret;
 #else
 	(void)buf;
@@ -917,15 +1652,15 @@ err:
 }
 
 /************************************************************
- * get_sector_size
+ * probe_sector_size
  * Requires:
  *  - filedes is an open file descriptor, suitable for reading
  * Modifies: nothing
  * Returns:
  *  sector size, or 512.
  ************************************************************/
-int UNUSED
-get_sector_size(int filedes)
+static int
+probe_sector_size(int filedes)
 {
 #ifdef __OpenBSD__
 	struct disklabel dl;
@@ -967,8 +1702,11 @@ get_sector_size(int filedes)
  *		   is 2.5.x, x>4, or
  *		   is > 2.5
  */
-static int
-kernel_has_blkgetsize64(void)
+static pthread_once_t blkgetsize64_once = PTHREAD_ONCE_INIT;
+static int blkgetsize64_ok;
+
+static void
+check_blkgetsize64(void)
 {
 	int major=0, minor=0, patch=0, parsed;
 	int rc;
@@ -977,25 +1715,35 @@ kernel_has_blkgetsize64(void)
 	memset(&u, 0, sizeof(u));
 	rc = uname(&u);
 	if (rc)
-		return 0;
+		return;
 
 	parsed = sscanf(u.release, "%d.%d.%d", &major, &minor, &patch);
 	/* If the kernel is 2.4.15-2.4.18 and 2.5.0-2.5.3, i.e. the problem
 	 * kernels, then this will get 3 answers.  If it doesn't, it isn't. */
-	if (parsed != 3)
-		return 1;
+	if (parsed != 3) {
+		blkgetsize64_ok = 1;
+		return;
+	}
 
 	if (major == 2 && minor == 5 && patch < 4)
-		return 0;
+		return;
 	if (major == 2 && minor == 4 && patch >= 15 && patch <= 18)
-		return 0;
-	return 1;
+		return;
+	blkgetsize64_ok = 1;
+}
+
+static int
+kernel_has_blkgetsize64(void)
+{
+	/* the kernel isn't going to change underneath us */
+	pthread_once(&blkgetsize64_once, check_blkgetsize64);
+	return blkgetsize64_ok;
 }
 
 #endif
 
 /************************************************************
- * get_disk_size_in_sectors
+ * probe_disk_size_in_sectors
  * Requires:
  *  - filedes is an open file descriptor, suitable for reading
  * Modifies: nothing
@@ -1009,8 +1757,8 @@ kernel_has_blkgetsize64(void)
  *  which returns the number of 512-byte sectors, not the size of
  *  the disk in bytes. Fixed in kernels 2.4.18-pre8 and 2.5.4-pre3.
  ************************************************************/
-uint64_t HIDDEN
-get_disk_size_in_sectors(int filedes)
+static uint64_t
+probe_disk_size_in_sectors(int filedes)
 {
 	uint64_t size;
 
@@ -1029,11 +1777,10 @@ get_disk_size_in_sectors(int filedes)
 
 	size = dl.d_secperunit;
 #elif defined(__linux__)
-	if (kernel_has_blkgetsize64()) {
-		long disk_size = 0;
-		if (ioctl(filedes, BLKGETSIZE, &disk_size) < 0)
-			return 0;
+	long disk_size = 0;
 
+	if (kernel_has_blkgetsize64() &&
+	    ioctl(filedes, BLKGETSIZE, &disk_size) == 0) {
 		size = disk_size;
 	} else {
 		uint64_t size_in_bytes = get_disk_size_in_bytes(filedes);
@@ -1055,8 +1802,8 @@ get_disk_size_in_sectors(int filedes)
 	return size;
 }
 
-uint64_t HIDDEN
-get_disk_size_in_bytes(int filedes)
+static uint64_t
+probe_disk_size_in_bytes(int filedes)
 {
 	uint64_t size;
 
@@ -1076,8 +1823,15 @@ get_disk_size_in_bytes(int filedes)
 		return 0;
 	size = disk_size;
 #elif defined(__linux__)
-	if (ioctl(filedes, BLKGETSIZE64, &size) < 0)
-		return 0;
+	if (ioctl(filedes, BLKGETSIZE64, &size) < 0) {
+		struct stat statbuf;
+
+		/* a disk image rather than a disk */
+		if (fstat(filedes, &statbuf) < 0 ||
+		    !S_ISREG(statbuf.st_mode))
+			return 0;
+		size = statbuf.st_size;
+	}
 #elif defined(__DragonFly__) || defined(__FreeBSD__)
 	struct partinfo partinfo;
 	if (ioctl(filedes, DIOCGPART, &partinfo) == -1)
@@ -1091,4 +1845,121 @@ get_disk_size_in_bytes(int filedes)
 	return size;
 }
 
+/*
+ * Partition table code asks for the same disk's sector size and size over
+ * and over while making one device path, so while the sysfs cache is
+ * held or enabled the answers are kept by device, and forgotten along
+ * with everything else in it.  Disk images aren't devices, and aren't
+ * cached.
+ */
+enum disk_geometry_field {
+	GEOMETRY_SECTOR_SIZE,
+	GEOMETRY_SECTORS,
+	GEOMETRY_BYTES,
+	GEOMETRY_N_FIELDS
+};
+
+struct disk_geometry {
+	dev_t dev;
+	uint64_t values[GEOMETRY_N_FIELDS];
+};
+
+#define GEOMETRY_CACHE_SIZE	8
+
+static pthread_mutex_t geometry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct disk_geometry geometry_cache[GEOMETRY_CACHE_SIZE];
+static size_t geometry_cache_len;
+static size_t geometry_cache_next;
+static unsigned int geometry_cache_gen;
+
+static struct disk_geometry *
+geometry_find(dev_t dev)
+{
+	for (size_t i = 0; i < geometry_cache_len; i++)
+		if (geometry_cache[i].dev == dev)
+			return &geometry_cache[i];
+	return NULL;
+}
+
+static uint64_t
+disk_geometry(int filedes, enum disk_geometry_field field)
+{
+	struct disk_geometry *geom;
+	unsigned int gen;
+	struct stat sb;
+	uint64_t val = 0;
+
+	gen = sysfs_cache_generation();
+	if (gen != 0 && fstat(filedes, &sb) == 0 &&
+	    (S_ISBLK(sb.st_mode) || S_ISCHR(sb.st_mode))) {
+		pthread_mutex_lock(&geometry_lock);
+		if (geometry_cache_gen != gen) {
+			geometry_cache_len = 0;
+			geometry_cache_next = 0;
+			geometry_cache_gen = gen;
+		}
+		geom = geometry_find(sb.st_rdev);
+		if (geom)
+			val = geom->values[field];
+		pthread_mutex_unlock(&geometry_lock);
+		if (val)
+			return val;
+	} else {
+		gen = 0;
+	}
+
+	switch (field) {
+	case GEOMETRY_SECTOR_SIZE:
+		val = probe_sector_size(filedes);
+		break;
+	case GEOMETRY_SECTORS:
+		val = probe_disk_size_in_sectors(filedes);
+		break;
+	case GEOMETRY_BYTES:
+		val = probe_disk_size_in_bytes(filedes);
+		break;
+	case GEOMETRY_N_FIELDS:
+		break;
+	}
+
+	/* a failed ioctl shouldn't stick */
+	if (gen == 0 || val == 0)
+		return val;
+
+	pthread_mutex_lock(&geometry_lock);
+	if (geometry_cache_gen == gen) {
+		geom = geometry_find(sb.st_rdev);
+		if (!geom) {
+			geom = &geometry_cache[geometry_cache_next];
+			geometry_cache_next = (geometry_cache_next + 1) %
+					      GEOMETRY_CACHE_SIZE;
+			if (geometry_cache_len < GEOMETRY_CACHE_SIZE)
+				geometry_cache_len++;
+			memset(geom, 0, sizeof(*geom));
+			geom->dev = sb.st_rdev;
+		}
+		geom->values[field] = val;
+	}
+	pthread_mutex_unlock(&geometry_lock);
+	return val;
+}
+
+int HIDDEN
+get_sector_size(int filedes)
+{
+	return disk_geometry(filedes, GEOMETRY_SECTOR_SIZE);
+}
+
+uint64_t HIDDEN
+get_disk_size_in_sectors(int filedes)
+{
+	return disk_geometry(filedes, GEOMETRY_SECTORS);
+}
+
+uint64_t HIDDEN
+get_disk_size_in_bytes(int filedes)
+{
+	return disk_geometry(filedes, GEOMETRY_BYTES);
+}
+
 // vim:fenc=utf-8:tw=75:noet
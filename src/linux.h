@@ -7,7 +7,9 @@
 #ifndef _EFIBOOT_LINUX_H
 #define _EFIBOOT_LINUX_H
 
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -109,6 +111,28 @@ enum interface_type {
 
 struct dev_probe;
 
+/*
+ * Scratch memory for one device lookup.  The paths the probes format and
+ * whatever they read out of sysfs are carved out of a few big chunks,
+ * and all of it goes away at once when the device is freed.
+ */
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks;
+	unsigned int nchunks;
+	size_t used;
+	size_t reserved;
+};
+
+extern void HIDDEN *arena_alloc(struct arena *arena, size_t size);
+extern int HIDDEN arena_vasprintf(struct arena *arena, char **str,
+				  const char *fmt, va_list ap);
+extern int HIDDEN arena_asprintf(struct arena *arena, char **str,
+				 const char *fmt, ...)
+	__attribute__((__format__(printf, 3, 4)));
+extern void HIDDEN arena_free(struct arena *arena);
+
 struct device {
 	enum interface_type interface_type;
 	uint32_t flags;
@@ -119,6 +143,8 @@ struct device {
 	struct dev_probe **probes;
 	unsigned int n_probes;
 
+	struct arena arena;
+
 	union {
 		struct {
 			struct stat stat;
@@ -159,8 +185,9 @@ extern int HIDDEN set_part(struct device *dev, int value);
 extern int HIDDEN set_part_name(struct device *dev, const char * const fmt, ...);
 extern int HIDDEN set_disk_name(struct device *dev, const char * const fmt, ...);
 extern bool HIDDEN is_pata(struct device *dev);
-extern int HIDDEN make_blockdev_path(uint8_t *buf, ssize_t size,
-				     struct device *dev);
+struct efidp_builder;
+extern ssize_t HIDDEN make_blockdev_path(struct efidp_builder *builder,
+					 struct device *dev);
 extern int HIDDEN parse_acpi_hid_uid(struct device *dev, const char *fmt, ...);
 extern int HIDDEN eb_nvme_ns_id(int fd, uint32_t *ns_id);
 
@@ -171,94 +198,131 @@ extern uint64_t HIDDEN get_disk_size_in_bytes(int filedes);
 extern int HIDDEN find_parent_devpath(const char * const child,
 				      char **parent);
 
+/* where a copy of a file on an md mirror lives on one of its disks */
+struct md_member {
+	char *devpath;
+	int partition;
+};
+
+extern int HIDDEN md_get_members(dev_t devnum, struct md_member **members,
+				 size_t *n);
+extern void HIDDEN md_members_free(struct md_member *members, size_t n);
+
+/* an address on a network interface, in network byte order */
+struct net_addr {
+	int family;		/* AF_INET or AF_INET6 */
+	uint8_t addr[16];
+	uint8_t prefix_length;
+};
+
+struct net_iface {
+	char name[16];		/* IF_NAMESIZE, with the NUL */
+	int index;
+	uint16_t hw_type;	/* ARPHRD_* */
+	size_t hw_addr_len;
+	uint8_t hw_addr[32];	/* zero past hw_addr_len */
+	struct net_addr *addrs;
+	size_t n_addrs;
+};
+
+extern int HIDDEN net_iface_get(const char *ifname, struct net_iface *iface);
+extern void HIDDEN net_iface_free(struct net_iface *iface);
+extern const struct net_addr HIDDEN *
+	net_iface_find_addr(const struct net_iface *iface, int family,
+			    const uint8_t *addr);
+
 extern ssize_t HIDDEN make_mac_path(uint8_t *buf, ssize_t size,
 				    const char * const ifname);
 
-#define read_sysfs_file(buf, fmt, args...)				\
+extern void HIDDEN sysfs_cache_hold(void);
+extern void HIDDEN sysfs_cache_release(void);
+extern unsigned int HIDDEN sysfs_cache_generation(void);
+extern ssize_t HIDDEN sysfs_readlinkat(struct arena *arena, const char *path,
+				       char **linkbuf);
+extern ssize_t HIDDEN sysfs_read_fileat(struct arena *arena, const char *path,
+					uint8_t **result);
+extern int HIDDEN sysfs_accessat(const char *path, int mode);
+extern int HIDDEN sysfs_statat(struct arena *arena, const char *path,
+			       struct stat *statbuf);
+
+/*
+ * These all take the arena to allocate from first; what they hand back
+ * lives until that arena is freed.
+ */
+#define read_sysfs_file(arena, buf, fmt, args...)			\
 	({								\
 		uint8_t *buf_ = NULL;					\
 		ssize_t bufsize_ = -1;					\
-		int error_;						\
+		char *pn_;						\
 									\
-		bufsize_ = get_file(&buf_, "/sys/" fmt, ## args);	\
-		if (bufsize_ > 0) {					\
-			uint8_t *buf2_ = alloca(bufsize_);		\
-			error_ = errno;					\
-			if (buf2_)					\
-				memcpy(buf2_, buf_, bufsize_);		\
-			free(buf_);					\
-			*(buf) = (__typeof__(*(buf)))buf2_;		\
-			errno = error_;					\
-		} else if (buf_) {					\
-			/* covscan is _sure_ we leak buf_ if bufsize_ */\
-			/* is <= 0, which is wrong, but appease it.   */\
-			free(buf_);					\
-			buf_ = NULL;					\
-		}							\
+		if (arena_asprintf(arena, &pn_, fmt, ## args) >= 0)	\
+			bufsize_ = sysfs_read_fileat(arena, pn_, &buf_);\
+		else							\
+			efi_error("could not allocate memory");		\
+		if (bufsize_ > 0)					\
+			*(buf) = (__typeof__(*(buf)))buf_;		\
 		bufsize_;						\
 	})
 
-#define sysfs_readlink(linkbuf, fmt, args...)				\
+#define sysfs_readlink(arena, linkbuf, fmt, args...)			\
 	({								\
-		char *_lb = alloca(PATH_MAX+1);				\
 		char *_pn;						\
 		int _rc;						\
 									\
 		*(linkbuf) = NULL;					\
-		_rc = asprintfa(&_pn, "/sys/" fmt, ## args);		\
+		_rc = arena_asprintf(arena, &_pn, fmt, ## args);	\
 		if (_rc >= 0) {						\
-			ssize_t _linksz;				\
-			_rc = _linksz = readlink(_pn, _lb, PATH_MAX);   \
-			if (_linksz >= 0)				\
-				_lb[_linksz] = '\0';			\
-			else						\
-				efi_error("readlink of %s failed", _pn);\
-			*(linkbuf) = _lb;				\
+			_rc = sysfs_readlinkat(arena, _pn, linkbuf);	\
+			if (_rc < 0)					\
+				efi_error("readlink of /sys/%s failed",	\
+					  _pn);				\
 		} else {						\
 			efi_error("could not allocate memory");		\
 		}							\
 		_rc;							\
 	})
 
-#define sysfs_access(mode, fmt, args...)				\
+#define sysfs_access(arena, mode, fmt, args...)				\
 	({								\
 		int rc_;						\
 		char *pn_;						\
 									\
-		rc_ = asprintfa(&pn_, "/sys/" fmt, ## args);		\
+		rc_ = arena_asprintf(arena, &pn_, fmt, ## args);	\
 		if (rc_ >= 0) {						\
-			rc_ = access(pn_, mode);			\
+			rc_ = sysfs_accessat(pn_, mode);		\
 			if (rc_ < 0)					\
-				efi_error("could not access %s", pn_);  \
+				efi_error("could not access /sys/%s",	\
+					  pn_);				\
 		} else {						\
 			efi_error("could not allocate memory");		\
 		}							\
 		rc_;							\
 	})
 
-#define sysfs_stat(statbuf, fmt, args...)				\
+#define sysfs_stat(arena, statbuf, fmt, args...)			\
 	({								\
 		int rc_;						\
 		char *pn_;						\
 									\
-		rc_ = asprintfa(&pn_, "/sys/" fmt, ## args);		\
+		rc_ = arena_asprintf(arena, &pn_, fmt, ## args);	\
 		if (rc_ >= 0) {						\
-			rc_ = stat(pn_, statbuf);			\
+			rc_ = sysfs_statat(arena, pn_, statbuf);	\
 			if (rc_ < 0)					\
-				efi_error("could not stat %s", pn_);    \
+				efi_error("could not stat /sys/%s",	\
+					  pn_);				\
 		} else {						\
 			efi_error("could not allocate memory");		\
 		}							\
 		rc_;							\
 	})
 
-#define sysfs_opendir(fmt, args...)					\
+#define sysfs_opendir(arena, fmt, args...)				\
 	({								\
 		int rc_;						\
 		char *pn_;						\
 		DIR *dir_ = NULL;					\
 									\
-		rc_ = asprintfa(&pn_, "/sys/" fmt, ## args);		\
+		rc_ = arena_asprintf(arena, &pn_, "/sys/" fmt, ## args);\
 		if (rc_ >= 0) {						\
 			dir_ = opendir(pn_);				\
 			if (dir_ == NULL)				\
@@ -273,15 +337,15 @@ extern ssize_t HIDDEN make_mac_path(uint8_t *buf, ssize_t size,
  * Iterate a /sys/block directory looking for device/foo, device/device/foo,
  * etc.  I'm not proud of this method.
  */
-#define find_device_file(result, name, fmt, args...)				\
+#define find_device_file(arena, result, name, fmt, args...)		\
 	({									\
 		int rc_ = 0;							\
-		debug("searching for %s from in %s", name, dev->disk_name);	\
+		debug("searching for %s in /sys/" fmt, name, ## args);	\
 		for (unsigned int try_ = 0; true; try_++) {			\
 			char *slashdev_;					\
 										\
-			slashdev_ = alloca(sizeof("device")			\
-					   + try_ * strlen("/device"));		\
+			slashdev_ = arena_alloc(arena, sizeof("device")		\
+						+ try_ * strlen("/device"));	\
 			if (!slashdev_) {					\
 				rc_ = -1;					\
 				efi_error("cannot allocate memory: %s",		\
@@ -296,7 +360,8 @@ extern ssize_t HIDDEN make_mac_path(uint8_t *buf, ssize_t size,
 			debug("trying /sys/" fmt "/%s/%s",			\
 			      ## args, slashdev_, name);			\
 										\
-			rc_ = sysfs_access(F_OK, fmt "/%s", ## args, slashdev_);\
+			rc_ = sysfs_access(arena, F_OK, fmt "/%s",		\
+					   ## args, slashdev_);		\
 			if (rc_ < 0) {						\
 				if (errno == ENOENT) {				\
 					efi_error_pop();			\
@@ -307,7 +372,7 @@ extern ssize_t HIDDEN make_mac_path(uint8_t *buf, ssize_t size,
 				goto find_device_link_err_;			\
 			}							\
 										\
-			rc_ = sysfs_access(F_OK, fmt "/%s/%s",			\
+			rc_ = sysfs_access(arena, F_OK, fmt "/%s/%s",	\
 					   ## args, slashdev_, name);		\
 			if (rc_ < 0) {						\
 				if (errno == ENOENT) {				\
@@ -320,8 +385,9 @@ extern ssize_t HIDDEN make_mac_path(uint8_t *buf, ssize_t size,
 				goto find_device_link_err_;			\
 			}							\
 										\
-			rc_ = asprintfa(result, fmt "/%s/%s",			\
-					## args, slashdev_, name);		\
+			rc_ = arena_asprintf(arena, result,			\
+					     fmt "/%s/%s",			\
+					     ## args, slashdev_, name);		\
 			if (rc_ < 0) {						\
 				efi_error("cannot allocate memory: %s",		\
 					  strerror(errno));			\
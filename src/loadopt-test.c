@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * loadopt-test.c - check the indices an efi_loadopt_builder_t hands out
+ */
+
+#include "fix_coverity.h"
+
+#include <efiboot.h>
+#include <efivar.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROGRAM_NAME "loadopt-test"
+
+/* LOAD_OPTION_ACTIVE in the UEFI spec */
+#define LOADOPT_ACTIVE 0x00000001
+
+static int
+check_option(efi_loadopt_builder_t *builder, size_t n, const char *desc)
+{
+	efi_load_option *opt;
+	const unsigned char *text;
+	size_t size = 0;
+
+	opt = efi_loadopt_builder_get(builder, n, &size);
+	if (!opt) {
+		warnx("option %zu is missing", n);
+		return -1;
+	}
+	text = efi_loadopt_desc(opt, size);
+	if (!text || strcmp((const char *)text, desc)) {
+		warnx("option %zu is \"%s\", not \"%s\"", n,
+		      text ? (const char *)text : "(null)", desc);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+check_index(const char *what, ssize_t index, ssize_t expected)
+{
+	if (index != expected) {
+		warnx("%s returned %zd, not %zd", what, index, expected);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Each of the _add() calls returns the index of the first option it
+ * added, and a call that fails leaves the builder as it was.  Files given
+ * on the command line are added with efi_loadopt_builder_add_files() as
+ * well, if device paths can be made for them here.
+ */
+int main(int argc, char *argv[])
+{
+	efi_loadopt_builder_t *builder = NULL;
+	const char *missing = "/nonexistent/" PROGRAM_NAME;
+	const unsigned char *desc = (const unsigned char *)"missing";
+	uint8_t dp[1024];
+	ssize_t off, sz, index;
+	size_t count;
+	int rc = 0;
+
+	if (efi_loadopt_builder_new(&builder) < 0)
+		err(1, "could not make a load option builder");
+
+	off = efidp_make_file(dp, sizeof(dp), "\\EFI\\test\\test.efi");
+	if (off < 0)
+		err(1, "could not make File() node");
+	sz = efidp_make_end_entire(dp + off, sizeof(dp) - off);
+	if (sz < 0)
+		err(1, "could not make End node");
+	off += sz;
+
+	for (int i = 0; i < 2; i++) {
+		char name[] = "option0";
+
+		name[6] += i;
+		index = efi_loadopt_builder_add(builder, LOADOPT_ACTIVE,
+						(const_efidp)dp, off,
+						(unsigned char *)name, NULL, 0);
+		if (check_index("efi_loadopt_builder_add()", index, i) < 0 ||
+		    check_option(builder, i, name) < 0)
+			rc = 1;
+	}
+
+	index = efi_loadopt_builder_add_files(builder, 0, &missing, &desc,
+					      LOADOPT_ACTIVE, NULL, NULL,
+					      EFIBOOT_ABBREV_FILE);
+	if (check_index("efi_loadopt_builder_add_files() with no files",
+			index, 2) < 0)
+		rc = 1;
+
+	index = efi_loadopt_builder_add_files(builder, 1, &missing, &desc,
+					      LOADOPT_ACTIVE, NULL, NULL,
+					      EFIBOOT_ABBREV_FILE);
+	efi_error_clear();
+	if (check_index("efi_loadopt_builder_add_files() with a missing file",
+			index, -1) < 0 ||
+	    check_index("efi_loadopt_builder_count()",
+			efi_loadopt_builder_count(builder), 2) < 0)
+		rc = 1;
+
+	index = efi_loadopt_builder_add_file(builder, LOADOPT_ACTIVE,
+					     missing, desc, NULL, 0,
+					     EFIBOOT_ABBREV_FILE);
+	efi_error_clear();
+	if (check_index("efi_loadopt_builder_add_file() with a missing file",
+			index, -1) < 0)
+		rc = 1;
+
+	if (argc > 1) {
+		size_t n = argc - 1;
+		const char **files = (const char **)argv + 1;
+
+		count = efi_loadopt_builder_count(builder);
+		index = efi_loadopt_builder_add_files(builder, n, files,
+				(const unsigned char * const *)files,
+				LOADOPT_ACTIVE, NULL, NULL,
+				EFIBOOT_ABBREV_FILE);
+		if (index < 0) {
+			efi_error_clear();
+			printf("skipping files: could not make device paths for them here\n");
+		} else if (check_index("efi_loadopt_builder_add_files()",
+				       index, count) < 0) {
+			rc = 1;
+		} else {
+			for (size_t i = 0; i < n; i++) {
+				if (check_option(builder, index + i,
+						 files[i]) < 0)
+					rc = 1;
+			}
+		}
+	}
+
+	efi_loadopt_builder_free(builder);
+	return rc;
+}
+
+// vim:fenc=utf-8:tw=75:noet
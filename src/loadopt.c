@@ -7,6 +7,8 @@
 
 #include "fix_coverity.h"
 
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 
 #include "efiboot.h"
@@ -22,15 +24,27 @@ typedef struct efi_load_option_s {
 	// uint8_t optional_data[];
 } PACKED efi_load_option;
 
+static inline ssize_t
+loadopt_desc_len(const unsigned char *description)
+{
+	return utf8len(description, 1024) * 2 + 2;
+}
+
+static inline ssize_t
+loadopt_size(ssize_t desc_len, ssize_t dp_size, size_t optional_data_size)
+{
+	return sizeof (uint32_t)
+	       + sizeof (uint16_t) + desc_len
+	       + dp_size + optional_data_size;
+}
+
 ssize_t NONNULL(6) PUBLIC
 efi_loadopt_create(uint8_t *buf, ssize_t size, uint32_t attributes,
 		   efidp dp, ssize_t dp_size, unsigned char *description,
 		   uint8_t *optional_data, size_t optional_data_size)
 {
-	ssize_t desc_len = utf8len((uint8_t *)description, 1024) * 2 + 2;
-	ssize_t sz = sizeof (attributes)
-		     + sizeof (uint16_t) + desc_len
-		     + dp_size + optional_data_size;
+	ssize_t desc_len = loadopt_desc_len(description);
+	ssize_t sz = loadopt_size(desc_len, dp_size, optional_data_size);
 
 	debug("entry buf:%p size:%zd dp:%p dp_size:%zd",
 	      buf, size, dp, dp_size);
@@ -98,6 +112,261 @@ invalid:
 	return sz;
 }
 
+/*
+ * Load options are written back to back into one buffer, each starting
+ * on a 4-byte boundary so the attributes can be stored directly.
+ */
+struct loadopt_builder_entry {
+	size_t offset;
+	size_t size;
+};
+
+struct efi_loadopt_builder {
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+
+	struct loadopt_builder_entry *entries;
+	size_t n_entries;
+	size_t n_entries_allocated;
+};
+
+int NONNULL(1) PUBLIC
+efi_loadopt_builder_new(efi_loadopt_builder_t **builder)
+{
+	efi_loadopt_builder_t *new;
+
+	new = calloc(1, sizeof(*new));
+	if (!new) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	*builder = new;
+	return 0;
+}
+
+static int
+loadopt_builder_grow(efi_loadopt_builder_t *builder, size_t need)
+{
+	size_t newsize;
+	uint8_t *newbuf;
+
+	if (need > builder->size) {
+		newsize = builder->size ? builder->size : 1024;
+		while (newsize < need) {
+			if (MUL(newsize, 2, &newsize)) {
+				errno = EOVERFLOW;
+				efi_error("arithmetic overflow computing allocation size");
+				return -1;
+			}
+		}
+
+		newbuf = realloc(builder->buf, newsize);
+		if (!newbuf) {
+			efi_error("could not allocate %zu bytes", newsize);
+			return -1;
+		}
+		builder->buf = newbuf;
+		builder->size = newsize;
+	}
+
+	if (builder->n_entries == builder->n_entries_allocated) {
+		size_t n = builder->n_entries_allocated ?
+			   builder->n_entries_allocated * 2 : 16;
+		struct loadopt_builder_entry *entries;
+
+		entries = reallocarray(builder->entries, n, sizeof(*entries));
+		if (!entries) {
+			efi_error("could not allocate %zu entries", n);
+			return -1;
+		}
+		builder->entries = entries;
+		builder->n_entries_allocated = n;
+	}
+	return 0;
+}
+
+ssize_t NONNULL(1, 5) PUBLIC
+efi_loadopt_builder_add(efi_loadopt_builder_t *builder, uint32_t attributes,
+			const_efidp dp, ssize_t dp_size,
+			const unsigned char *description,
+			const uint8_t *optional_data,
+			size_t optional_data_size)
+{
+	struct loadopt_builder_entry *entry;
+	size_t offset, need;
+	ssize_t sz;
+
+	if (dp_size < 0 || dp_size > UINT16_MAX ||
+	    optional_data_size > SSIZE_MAX / 2) {
+		errno = EINVAL;
+		efi_error("device path or optional data is too long for a load option");
+		return -1;
+	}
+
+	sz = loadopt_size(loadopt_desc_len(description), dp_size,
+			  optional_data_size);
+	offset = ALIGN_UP(builder->len, sizeof(uint32_t));
+	if (ADD(offset, sz, &need)) {
+		errno = EOVERFLOW;
+		efi_error("arithmetic overflow computing allocation size");
+		return -1;
+	}
+	if (loadopt_builder_grow(builder, need) < 0)
+		return -1;
+
+	sz = efi_loadopt_create(builder->buf + offset, sz, attributes,
+				(efidp)dp, dp_size,
+				(unsigned char *)description,
+				(uint8_t *)optional_data, optional_data_size);
+	if (sz < 0) {
+		efi_error("efi_loadopt_create() failed");
+		return -1;
+	}
+
+	entry = &builder->entries[builder->n_entries];
+	entry->offset = offset;
+	entry->size = sz;
+	builder->len = offset + sz;
+	return builder->n_entries++;
+}
+
+/*
+ * The device paths are all generated before anything is added, so that
+ * files on the same disk share the work of finding it, and a failure
+ * leaves the builder the way it was.
+ */
+static int
+loadopt_builder_add_files(efi_loadopt_builder_t *builder, size_t n,
+			  const char * const *filepaths,
+			  const unsigned char * const *descriptions,
+			  uint32_t attributes,
+			  const uint8_t * const *optional_data,
+			  const size_t *optional_data_sizes,
+			  uint32_t options, va_list ap)
+{
+	size_t n_entries = builder->n_entries;
+	size_t len = builder->len;
+	uint8_t **dps;
+	ssize_t *dp_sizes;
+	int rc;
+
+	dps = calloc(n ? n : 1, sizeof(*dps));
+	dp_sizes = calloc(n ? n : 1, sizeof(*dp_sizes));
+	if (!dps || !dp_sizes) {
+		free(dps);
+		free(dp_sizes);
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	rc = va_generate_file_device_paths(filepaths, n, dps, dp_sizes,
+					   options, ap);
+	if (rc < 0)
+		efi_error("could not generate device paths");
+
+	for (size_t i = 0; rc >= 0 && i < n; i++) {
+		if (efi_loadopt_builder_add(builder, attributes,
+					    (const_efidp)dps[i], dp_sizes[i],
+					    descriptions[i],
+					    optional_data ? optional_data[i]
+							  : NULL,
+					    optional_data_sizes
+						? optional_data_sizes[i] : 0)
+		    < 0)
+			rc = -1;
+	}
+
+	if (rc < 0) {
+		builder->n_entries = n_entries;
+		builder->len = len;
+	}
+
+	for (size_t i = 0; i < n; i++)
+		free(dps[i]);
+	free(dps);
+	free(dp_sizes);
+	return rc;
+}
+
+ssize_t NONNULL(1, 3, 4) PUBLIC
+efi_loadopt_builder_add_files(efi_loadopt_builder_t *builder, size_t n,
+			      const char * const *filepaths,
+			      const unsigned char * const *descriptions,
+			      uint32_t attributes,
+			      const uint8_t * const *optional_data,
+			      const size_t *optional_data_sizes,
+			      uint32_t options, ...)
+{
+	va_list ap;
+	int rc;
+
+	va_start(ap, options);
+	rc = loadopt_builder_add_files(builder, n, filepaths, descriptions,
+				       attributes, optional_data,
+				       optional_data_sizes, options, ap);
+	va_end(ap);
+	if (rc < 0)
+		return -1;
+	return builder->n_entries - n;
+}
+
+ssize_t NONNULL(1, 3, 4) PUBLIC
+efi_loadopt_builder_add_file(efi_loadopt_builder_t *builder,
+			     uint32_t attributes, const char *filepath,
+			     const unsigned char *description,
+			     const uint8_t *optional_data,
+			     size_t optional_data_size, uint32_t options, ...)
+{
+	va_list ap;
+	int rc;
+
+	va_start(ap, options);
+	rc = loadopt_builder_add_files(builder, 1, &filepath, &description,
+				       attributes, &optional_data,
+				       &optional_data_size, options, ap);
+	va_end(ap);
+	if (rc < 0)
+		return -1;
+	return builder->n_entries - 1;
+}
+
+size_t NONNULL(1) PUBLIC
+efi_loadopt_builder_count(efi_loadopt_builder_t *builder)
+{
+	return builder->n_entries;
+}
+
+efi_load_option NONNULL(1, 3) PUBLIC *
+efi_loadopt_builder_get(efi_loadopt_builder_t *builder, size_t n,
+			size_t *size)
+{
+	if (n >= builder->n_entries) {
+		errno = ENOENT;
+		return NULL;
+	}
+	*size = builder->entries[n].size;
+	return (efi_load_option *)(builder->buf + builder->entries[n].offset);
+}
+
+void NONNULL(1) PUBLIC
+efi_loadopt_builder_reset(efi_loadopt_builder_t *builder)
+{
+	builder->n_entries = 0;
+	builder->len = 0;
+}
+
+void PUBLIC
+efi_loadopt_builder_free(efi_loadopt_builder_t *builder)
+{
+	if (!builder)
+		return;
+
+	free(builder->buf);
+	free(builder->entries);
+	free(builder);
+}
+
 ssize_t NONNULL(1) PUBLIC
 efi_loadopt_optional_data_size(efi_load_option *opt, size_t size)
 {
@@ -363,4 +632,476 @@ efi_loadopt_desc(efi_load_option *opt, ssize_t limit)
 	return last_desc;
 }
 
+ssize_t NONNULL(1) PUBLIC
+efi_loadopt_desc_r(efi_load_option *opt, ssize_t limit, unsigned char *buf,
+		   size_t bufsz)
+{
+	if (!buf && bufsz) {
+		errno = EINVAL;
+		efi_error("invalid buffer");
+		return -1;
+	}
+
+	return ucs2_to_utf8_buf(buf, bufsz, opt->description, limit);
+}
+
+const void NONNULL(1, 3) PUBLIC *
+efi_loadopt_desc_ucs2(efi_load_option *opt, ssize_t limit, size_t *len)
+{
+	*len = ucs2len(opt->description, limit);
+	return opt->description;
+}
+
+/*
+ * Most of the time spent listing boot entries is waiting on one variable
+ * read after another, so a few threads read them at once.  They'd all
+ * queue up on libefivar's rate limiter anyway when we're not root, so
+ * there's no point in more than a handful.
+ */
+#define LOADOPT_READ_THREADS	8
+
+struct loadopt_reader {
+	const char *kind;
+	efi_loadopt_entry_t *entries;
+	size_t n_entries;
+	size_t next;
+};
+
+static void *
+loadopt_read_entries(void *arg)
+{
+	struct loadopt_reader *reader = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&reader->next, 1, __ATOMIC_RELAXED))
+	       < reader->n_entries) {
+		efi_loadopt_entry_t *entry = &reader->entries[i];
+		char name[32];
+		uint8_t *data = NULL;
+		size_t data_size = 0;
+		uint32_t attributes = 0;
+
+		snprintf(name, sizeof(name), "%s%04X", reader->kind,
+			 entry->number);
+		if (efi_get_variable(efi_guid_global, name, &data, &data_size,
+				     &attributes) < 0) {
+			entry->error = errno;
+			continue;
+		}
+		entry->data = (efi_load_option *)data;
+		entry->data_size = data_size;
+	}
+	return NULL;
+}
+
+static int
+loadopt_decode_entry(efi_loadopt_entry_t *entry)
+{
+	efi_load_option *opt = entry->data;
+	size_t size = entry->data_size;
+	unsigned char *optional_data = NULL;
+	unsigned char *path = NULL;
+	size_t optional_data_size = 0;
+	unsigned char *desc;
+	efidp dp;
+
+	if (!efi_loadopt_is_valid(opt, size))
+		return 0;
+
+	desc = ucs2_to_utf8(opt->description, size);
+	if (!desc)
+		return -1;
+
+	dp = efi_loadopt_path(opt, size);
+	if (dp && efidp_format_device_path_alloc(&path, dp,
+			efi_loadopt_pathlen(opt, size)) < 0) {
+		free(desc);
+		return -1;
+	}
+
+	if (efi_loadopt_optional_data(opt, size, &optional_data,
+				      &optional_data_size) < 0) {
+		optional_data = NULL;
+		optional_data_size = 0;
+	}
+
+	entry->valid = 1;
+	entry->attributes = opt->attributes;
+	entry->description = desc;
+	entry->path = path;
+	entry->optional_data = optional_data;
+	entry->optional_data_size = optional_data_size;
+	return 0;
+}
+
+int NONNULL(1, 2, 3) PUBLIC
+efi_loadopt_entries(const char *kind, efi_loadopt_entry_t **entriesp,
+		    size_t *n_entriesp)
+{
+	pthread_t threads[LOADOPT_READ_THREADS - 1];
+	struct loadopt_reader reader = { .kind = kind, };
+	efi_loadopt_entry_t *entries = NULL;
+	uint16_t *order = NULL;
+	size_t order_size = 0;
+	uint32_t attributes = 0;
+	char name[32];
+	size_t n, nthreads;
+	int rc;
+
+	if (strlen(kind) > sizeof(name) - sizeof("Order")) {
+		errno = EINVAL;
+		efi_error("invalid load option type \"%s\"", kind);
+		return -1;
+	}
+
+	snprintf(name, sizeof(name), "%sOrder", kind);
+	rc = efi_get_variable(efi_guid_global, name, (uint8_t **)&order,
+			      &order_size, &attributes);
+	if (rc < 0 && errno == ENOENT) {
+		efi_error_clear();
+		*entriesp = NULL;
+		*n_entriesp = 0;
+		return 0;
+	}
+	if (rc < 0) {
+		efi_error("could not read %s", name);
+		return -1;
+	}
+
+	n = order_size / sizeof(uint16_t);
+	if (n > 0) {
+		entries = calloc(n, sizeof(*entries));
+		if (!entries) {
+			efi_error("could not allocate memory");
+			free(order);
+			return -1;
+		}
+	}
+	for (size_t i = 0; i < n; i++)
+		entries[i].number = order[i];
+	free(order);
+
+	reader.entries = entries;
+	reader.n_entries = n;
+	nthreads = n < LOADOPT_READ_THREADS ? n : LOADOPT_READ_THREADS;
+
+	/* the last reader is us */
+	for (n = 0; n + 1 < nthreads; n++) {
+		if (pthread_create(&threads[n], NULL, loadopt_read_entries,
+				   &reader) != 0)
+			break;
+	}
+	loadopt_read_entries(&reader);
+	while (n-- > 0)
+		pthread_join(threads[n], NULL);
+
+	for (size_t i = 0; i < reader.n_entries; i++) {
+		if (!entries[i].data)
+			continue;
+		if (loadopt_decode_entry(&entries[i]) < 0) {
+			efi_error("could not decode %s%04X", kind,
+				  entries[i].number);
+			efi_loadopt_entries_free(entries, reader.n_entries);
+			return -1;
+		}
+	}
+
+	efi_error_clear();
+	*entriesp = entries;
+	*n_entriesp = reader.n_entries;
+	return 0;
+}
+
+void PUBLIC
+efi_loadopt_entries_free(efi_loadopt_entry_t *entries, size_t n_entries)
+{
+	if (!entries)
+		return;
+
+	for (size_t i = 0; i < n_entries; i++) {
+		free((void *)entries[i].description);
+		free((void *)entries[i].path);
+		free(entries[i].data);
+	}
+	free(entries);
+}
+
+/*
+ * Which of the 65536 <kind>#### numbers are taken, as a bitmap.  Numbers
+ * listed in <kind>Order count as taken even if the variable is missing,
+ * so a new entry never turns up in the order by accident.
+ */
+#define LOADOPT_SLOT_WORDS	(65536 / 64)
+#define LOADOPT_ORDER_ATTRS	(EFI_VARIABLE_NON_VOLATILE |		\
+				 EFI_VARIABLE_BOOTSERVICE_ACCESS |	\
+				 EFI_VARIABLE_RUNTIME_ACCESS)
+
+struct efi_loadopt_slots {
+	uint64_t used[LOADOPT_SLOT_WORDS];
+	size_t first_free;	/* word; nothing before it has room */
+};
+
+static int
+loadopt_order_name(const char *kind, char *name, size_t namesz)
+{
+	if (strlen(kind) > namesz - sizeof("Order")) {
+		errno = EINVAL;
+		efi_error("invalid load option type \"%s\"", kind);
+		return -1;
+	}
+	snprintf(name, namesz, "%sOrder", kind);
+	return 0;
+}
+
+/*
+ * Read <kind>Order; if it doesn't exist, it's empty, and *attributes is
+ * what a new one gets.
+ */
+static int
+loadopt_order_read(const char *name, uint16_t **order, size_t *n,
+		   uint32_t *attributes)
+{
+	size_t order_size = 0;
+	int rc;
+
+	*order = NULL;
+	rc = efi_get_variable(efi_guid_global, name, (uint8_t **)order,
+			      &order_size, attributes);
+	if (rc < 0 && errno == ENOENT) {
+		efi_error_clear();
+		*n = 0;
+		*attributes = LOADOPT_ORDER_ATTRS;
+		return 0;
+	}
+	if (rc < 0) {
+		efi_error("could not read %s", name);
+		return -1;
+	}
+	*n = order_size / sizeof(uint16_t);
+	return 0;
+}
+
+/*
+ * Returns the number from a name like Boot0001, or -1 if it isn't one.
+ * The spec has the digits in upper case, and so does firmware.
+ */
+static int
+loadopt_slot_number(const char *kind, size_t kindlen, const char *name)
+{
+	int number = 0;
+
+	if (strncmp(name, kind, kindlen))
+		return -1;
+	name += kindlen;
+
+	for (size_t i = 0; i < 4; i++) {
+		char c = name[i];
+
+		if (c >= '0' && c <= '9')
+			number = number << 4 | (c - '0');
+		else if (c >= 'A' && c <= 'F')
+			number = number << 4 | (c - 'A' + 10);
+		else
+			return -1;
+	}
+	return name[4] == '\0' ? number : -1;
+}
+
+static inline void
+loadopt_slot_mark(efi_loadopt_slots_t *slots, uint16_t number)
+{
+	slots->used[number / 64] |= 1ull << (number % 64);
+}
+
+int NONNULL(1, 2) PUBLIC
+efi_loadopt_slots_scan(const char *kind, efi_loadopt_slots_t **slotsp)
+{
+	efi_loadopt_slots_t *slots;
+	efi_varname_iter_t *iter = NULL;
+	efi_guid_t *guid = NULL;
+	char *name = NULL;
+	uint16_t *order = NULL;
+	uint32_t attributes;
+	char order_name[32];
+	size_t kindlen = strlen(kind);
+	size_t n;
+	int rc;
+
+	if (loadopt_order_name(kind, order_name, sizeof(order_name)) < 0)
+		return -1;
+
+	slots = calloc(1, sizeof(*slots));
+	if (!slots) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	if (efi_varname_iter_new(&iter) < 0) {
+		efi_error("could not list variables");
+		free(slots);
+		return -1;
+	}
+	while ((rc = efi_varname_iter_next(iter, &guid, &name)) > 0) {
+		int number;
+
+		if (efi_guid_cmp(guid, &efi_guid_global))
+			continue;
+		number = loadopt_slot_number(kind, kindlen, name);
+		if (number >= 0)
+			loadopt_slot_mark(slots, number);
+	}
+	efi_varname_iter_free(iter);
+	if (rc < 0) {
+		efi_error("could not list variables");
+		free(slots);
+		return -1;
+	}
+
+	if (loadopt_order_read(order_name, &order, &n, &attributes) < 0) {
+		free(slots);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++)
+		loadopt_slot_mark(slots, order[i]);
+	free(order);
+
+	*slotsp = slots;
+	return 0;
+}
+
+int NONNULL(1) PUBLIC
+efi_loadopt_slot_used(efi_loadopt_slots_t *slots, uint16_t number)
+{
+	return !!(slots->used[number / 64] & (1ull << (number % 64)));
+}
+
+int NONNULL(1, 2) PUBLIC
+efi_loadopt_slot_alloc(efi_loadopt_slots_t *slots, uint16_t *number)
+{
+	for (size_t i = slots->first_free; i < LOADOPT_SLOT_WORDS; i++) {
+		uint64_t free_bits = ~slots->used[i];
+
+		if (!free_bits)
+			continue;
+
+		*number = i * 64 + __builtin_ctzll(free_bits);
+		loadopt_slot_mark(slots, *number);
+		slots->first_free = i;
+		return 0;
+	}
+	slots->first_free = LOADOPT_SLOT_WORDS;
+	errno = ENOSPC;
+	efi_error("no free load option numbers");
+	return -1;
+}
+
+void NONNULL(1) PUBLIC
+efi_loadopt_slot_release(efi_loadopt_slots_t *slots, uint16_t number)
+{
+	slots->used[number / 64] &= ~(1ull << (number % 64));
+	if (number / 64 < slots->first_free)
+		slots->first_free = number / 64;
+}
+
+void PUBLIC
+efi_loadopt_slots_free(efi_loadopt_slots_t *slots)
+{
+	free(slots);
+}
+
+int NONNULL(1) PUBLIC
+efi_loadopt_order_set(const char *kind, const uint16_t *order, size_t n)
+{
+	char name[32];
+	int rc;
+
+	if (loadopt_order_name(kind, name, sizeof(name)) < 0)
+		return -1;
+
+	if (n && !order) {
+		errno = EINVAL;
+		efi_error("order cannot be NULL");
+		return -1;
+	}
+
+	rc = efi_set_variable_if_changed(efi_guid_global, name,
+					 (const uint8_t *)order,
+					 n * sizeof(uint16_t),
+					 LOADOPT_ORDER_ATTRS, 0644);
+	if (rc < 0)
+		efi_error("could not write %s", name);
+	return rc;
+}
+
+/*
+ * Take number out of <kind>Order, and then put it back at position if
+ * that isn't SIZE_MAX.  Nothing is written if that leaves the order as
+ * it was, and the write fails with EAGAIN if someone else changed the
+ * order since it was read.
+ */
+static int
+loadopt_order_edit(const char *kind, uint16_t number, size_t position)
+{
+	uint16_t *order = NULL, *new_order;
+	uint32_t attributes;
+	char name[32];
+	size_t n, new_n = 0;
+	int rc;
+
+	if (loadopt_order_name(kind, name, sizeof(name)) < 0 ||
+	    loadopt_order_read(name, &order, &n, &attributes) < 0)
+		return -1;
+
+	new_order = calloc(n + 1, sizeof(*new_order));
+	if (!new_order) {
+		efi_error("could not allocate memory");
+		free(order);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (order[i] != number)
+			new_order[new_n++] = order[i];
+	}
+	if (position != SIZE_MAX) {
+		if (position > new_n)
+			position = new_n;
+		memmove(&new_order[position + 1], &new_order[position],
+			(new_n - position) * sizeof(*new_order));
+		new_order[position] = number;
+		new_n++;
+	}
+
+	if (new_n == n &&
+	    (n == 0 || !memcmp(order, new_order, n * sizeof(*order)))) {
+		rc = 0;
+	} else {
+		rc = efi_set_variable_cas(efi_guid_global, name,
+					  (uint8_t *)order,
+					  n * sizeof(uint16_t), attributes,
+					  (uint8_t *)new_order,
+					  new_n * sizeof(uint16_t),
+					  attributes, 0644);
+		if (rc < 0)
+			efi_error("could not write %s", name);
+	}
+
+	free(order);
+	free(new_order);
+	return rc;
+}
+
+int NONNULL(1) PUBLIC
+efi_loadopt_order_insert(const char *kind, uint16_t number, size_t position)
+{
+	return loadopt_order_edit(kind, number,
+				  position == SIZE_MAX ? SIZE_MAX - 1
+						       : position);
+}
+
+int NONNULL(1) PUBLIC
+efi_loadopt_order_remove(const char *kind, uint16_t number)
+{
+	return loadopt_order_edit(kind, number, SIZE_MAX);
+}
+
 // vim:fenc=utf-8:tw=75:noet
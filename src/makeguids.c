@@ -109,6 +109,271 @@ write_guidnames(FILE *out, const char *listname,
 	fprintf(out, "};\n");
 }
 
+struct hash_key {
+	const void *data;
+	size_t len;
+	uint32_t bucket;
+};
+
+static int
+cmpbucketsizep(const void *p1, const void *p2, void *state)
+{
+	const uint32_t *sizes = state;
+	uint32_t b1 = *(const uint32_t *)p1;
+	uint32_t b2 = *(const uint32_t *)p2;
+
+	if (sizes[b1] != sizes[b2])
+		return sizes[b1] > sizes[b2] ? -1 : 1;
+	return b1 < b2 ? -1 : (b1 > b2);
+}
+
+/*
+ * Find a seed for every bucket so that all the keys land in different
+ * slots, doing the biggest buckets first while there's the most room.
+ * With twice as many slots as keys this takes a handful of tries per
+ * bucket.
+ */
+static void
+build_hash(const char *listname, struct hash_key *keys, size_t n,
+	   uint32_t *nbucketsp, uint32_t *nslotsp,
+	   uint16_t **seedsp, uint16_t **slotsp)
+{
+	uint32_t nbuckets = n / 2 + 1;
+	uint32_t nslots = n * 2 + 1;
+	uint32_t *sizes, *order, *tried;
+	uint16_t *seeds, *slots;
+
+	if (n >= UINT16_MAX)
+		errx(1, "too many guids for a 16-bit hash index");
+
+	sizes = calloc(nbuckets, sizeof(*sizes));
+	order = calloc(nbuckets, sizeof(*order));
+	seeds = calloc(nbuckets, sizeof(*seeds));
+	slots = calloc(nslots, sizeof(*slots));
+	tried = calloc(n, sizeof(*tried));
+	if (!sizes || !order || !seeds || !slots || !tried)
+		err(1, "could not allocate memory");
+
+	for (size_t i = 0; i < n; i++) {
+		keys[i].bucket = efivar_guidname_hash_key(keys[i].data,
+							  keys[i].len, 0)
+				 % nbuckets;
+		sizes[keys[i].bucket] += 1;
+	}
+	for (uint32_t b = 0; b < nbuckets; b++)
+		order[b] = b;
+	qsort_r(order, nbuckets, sizeof(*order), cmpbucketsizep, sizes);
+
+	for (uint32_t o = 0; o < nbuckets && sizes[order[o]]; o++) {
+		uint32_t b = order[o];
+		uint32_t seed;
+
+		for (seed = 1; seed < UINT16_MAX; seed++) {
+			size_t nkeys = 0;
+			size_t i;
+
+			for (i = 0; i < n; i++) {
+				uint32_t slot;
+
+				if (keys[i].bucket != b)
+					continue;
+				slot = efivar_guidname_hash_key(keys[i].data,
+								keys[i].len,
+								seed) % nslots;
+				if (slots[slot])
+					break;
+				slots[slot] = i + 1;
+				tried[nkeys++] = slot;
+			}
+			if (i == n)
+				break;
+			while (nkeys)
+				slots[tried[--nkeys]] = 0;
+		}
+		if (seed == UINT16_MAX)
+			errx(1, "could not build a perfect hash for %s",
+			     listname);
+		seeds[b] = seed;
+	}
+
+	free(tried);
+	free(order);
+	free(sizes);
+
+	*nbucketsp = nbuckets;
+	*nslotsp = nslots;
+	*seedsp = seeds;
+	*slotsp = slots;
+}
+
+static void
+write_hash(FILE *out, const char *listname, struct hash_key *keys, size_t n)
+{
+	uint32_t nbuckets, nslots;
+	uint16_t *seeds, *slots;
+
+	build_hash(listname, keys, n, &nbuckets, &nslots, &seeds, &slots);
+
+	fprintf(out,
+		"static const uint16_t %s_seeds_[%u] = {",
+		listname, nbuckets);
+	for (uint32_t b = 0; b < nbuckets; b++)
+		fprintf(out, "%s%u,", b % 12 ? " " : "\n\t", seeds[b]);
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out,
+		"static const uint16_t %s_slots_[%u] = {",
+		listname, nslots);
+	for (uint32_t i = 0; i < nslots; i++)
+		fprintf(out, "%s%u,", i % 12 ? " " : "\n\t", slots[i]);
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out,
+		"const struct efivar_guidname_hash\n"
+			"\t__attribute__((__visibility__ (\"hidden\")))\n"
+			"\t%s_hash = {\n"
+			"\t\t.nbuckets = %u,\n"
+			"\t\t.nslots = %u,\n"
+			"\t\t.seeds = %s_seeds_,\n"
+			"\t\t.slots = %s_slots_,\n"
+			"\t};\n\n",
+		listname, nbuckets, nslots, listname, listname);
+
+	free(slots);
+	free(seeds);
+}
+
+static void
+write_db_hash(uint8_t *db, uint32_t seedsoff, uint32_t slotsoff,
+	      const uint16_t *seeds, uint32_t nbuckets,
+	      const uint16_t *slots, uint32_t nslots)
+{
+	uint16_t *dbseeds = (uint16_t *)(db + seedsoff);
+	uint16_t *dbslots = (uint16_t *)(db + slotsoff);
+
+	for (uint32_t b = 0; b < nbuckets; b++)
+		dbseeds[b] = cpu_to_le16(seeds[b]);
+	for (uint32_t i = 0; i < nslots; i++)
+		dbslots[i] = cpu_to_le16(slots[i]);
+}
+
+/*
+ * Write guids.txt style input out as a database libefivar can map at
+ * runtime, for vendor guids that aren't worth building in.
+ */
+static int
+write_guid_db(const char *inpath, const char *outpath)
+{
+	struct guidname_index *guidnames = NULL;
+	struct efivar_guid_db_header *hdr;
+	struct efivar_guid_db_entry *entries;
+	struct hash_key *keys;
+	uint32_t nbuckets, nslots, n = 0;
+	uint16_t *guid_seeds, *guid_slots, *name_seeds, *name_slots;
+	size_t off, dbsz;
+	uint8_t *db;
+	FILE *out;
+	int rc;
+
+	rc = read_guids_at(AT_FDCWD, inpath, &guidnames);
+	if (rc < 0)
+		err(1, "could not read \"%s\"", inpath);
+	if (guidnames->strsz > UINT32_MAX)
+		errx(1, "\"%s\" is too big", inpath);
+
+	keys = calloc(guidnames->nguids + 1, sizeof(*keys));
+	entries = calloc(guidnames->nguids + 1, sizeof(*entries));
+	if (!keys || !entries)
+		err(1, "could not allocate memory");
+
+	for (size_t i = 0; i < guidnames->nguids; i++) {
+		struct guidname_offset *gno = &guidnames->offsets[i];
+
+		if (!strcmp(&guidnames->strtab[gno->symoff],
+			    "efi_guid_zzignore-this-guid"))
+			continue;
+		entries[n].guid = gno->guid;
+		entries[n].symbol = cpu_to_le32(gno->symoff);
+		entries[n].name = cpu_to_le32(gno->nameoff);
+		entries[n].description = cpu_to_le32(gno->descoff);
+		n++;
+	}
+
+	for (uint32_t i = 0; i < n; i++) {
+		keys[i].data = &entries[i].guid;
+		keys[i].len = sizeof(entries[i].guid);
+	}
+	build_hash("guid database", keys, n, &nbuckets, &nslots,
+		   &guid_seeds, &guid_slots);
+	for (uint32_t i = 0; i < n; i++) {
+		keys[i].data = &guidnames->strtab[le32_to_cpu(entries[i].name)];
+		keys[i].len = strlen(keys[i].data);
+	}
+	build_hash("guid database names", keys, n, &nbuckets, &nslots,
+		   &name_seeds, &name_slots);
+
+	off = sizeof(*hdr);
+	dbsz = off + n * sizeof(*entries);
+	dbsz += ALIGN_UP(nbuckets * sizeof(uint16_t), 4) * 2;
+	dbsz += ALIGN_UP(nslots * sizeof(uint16_t), 4) * 2;
+	dbsz += guidnames->strsz;
+	db = calloc(1, dbsz);
+	if (!db)
+		err(1, "could not allocate memory");
+
+	hdr = (struct efivar_guid_db_header *)db;
+	memcpy(hdr->magic, EFIVAR_GUID_DB_MAGIC, sizeof(hdr->magic));
+	hdr->version = cpu_to_le32(EFIVAR_GUID_DB_VERSION);
+	hdr->nguids = cpu_to_le32(n);
+	hdr->nbuckets = cpu_to_le32(nbuckets);
+	hdr->nslots = cpu_to_le32(nslots);
+
+	hdr->entries = cpu_to_le32(off);
+	memcpy(db + off, entries, n * sizeof(*entries));
+	off += n * sizeof(*entries);
+
+	hdr->guid_seeds = cpu_to_le32(off);
+	off += ALIGN_UP(nbuckets * sizeof(uint16_t), 4);
+	hdr->guid_slots = cpu_to_le32(off);
+	off += ALIGN_UP(nslots * sizeof(uint16_t), 4);
+	write_db_hash(db, le32_to_cpu(hdr->guid_seeds),
+		      le32_to_cpu(hdr->guid_slots),
+		      guid_seeds, nbuckets, guid_slots, nslots);
+
+	hdr->name_seeds = cpu_to_le32(off);
+	off += ALIGN_UP(nbuckets * sizeof(uint16_t), 4);
+	hdr->name_slots = cpu_to_le32(off);
+	off += ALIGN_UP(nslots * sizeof(uint16_t), 4);
+	write_db_hash(db, le32_to_cpu(hdr->name_seeds),
+		      le32_to_cpu(hdr->name_slots),
+		      name_seeds, nbuckets, name_slots, nslots);
+
+	hdr->strtab = cpu_to_le32(off);
+	hdr->strsz = cpu_to_le32(guidnames->strsz);
+	memcpy(db + off, guidnames->strtab, guidnames->strsz);
+
+	out = fopen(outpath, "w");
+	if (out == NULL)
+		err(1, "could not open \"%s\"", outpath);
+	if (fwrite(db, 1, dbsz, out) != dbsz || fclose(out) == EOF)
+		err(1, "could not write \"%s\"", outpath);
+	rc = chmod(outpath, 0644);
+	if (rc < 0)
+		warn("chmod(%s, 0644)", outpath);
+
+	free(db);
+	free(name_slots);
+	free(name_seeds);
+	free(guid_slots);
+	free(guid_seeds);
+	free(entries);
+	free(keys);
+	free(guidnames->strtab);
+	free(guidnames);
+
+	return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -117,6 +382,9 @@ main(int argc, char *argv[])
 	FILE *symout, *header, *ldsout;
 	int dash_t = 0;
 
+	if (argc == 4 && !strcmp(argv[1], "-D"))
+		return write_guid_db(argv[2], argv[3]);
+
 	if (argc < 5) {
 		errx(1, "Not enough arguments.\n");
 	} else if (argc > 5 && !strcmp(argv[1],"-T")) {
@@ -302,11 +570,37 @@ struct efivar_guidname {\n\
 		"\tchar description[256];\n"
 		"} __attribute__((__aligned__(16)));\n\n");
 
+	fprintf(symout,
+		"struct efivar_guidname_hash {\n"
+		"\tuint32_t nbuckets;\n"
+		"\tuint32_t nslots;\n"
+		"\tconst uint16_t *seeds;\n"
+		"\tconst uint16_t *slots;\n"
+		"};\n\n");
+
+	/* the hashes leave out zzignore-this-guid, same as the counts */
+	unsigned int nhashed = line ? line - 1 : 0;
+	struct hash_key *keys = calloc(nhashed + 1, sizeof(*keys));
+	if (!keys)
+		err(1, "could not allocate memory");
+
 	qsort(outbuf, line, sizeof(struct efivar_guidname), cmpguidp);
 	write_guidnames(symout, "efi_well_known_guids", outbuf, line, "libefivar.so.0");
+	for (unsigned int j = 0; j < nhashed; j++) {
+		keys[j].data = &outbuf[j].guid;
+		keys[j].len = sizeof(outbuf[j].guid);
+	}
+	write_hash(symout, "efi_well_known_guids", keys, nhashed);
 
 	qsort(outbuf, line, sizeof(struct efivar_guidname), cmpnamep);
 	write_guidnames(symout, "efi_well_known_names", outbuf, line, "LIBEFIVAR_1.38");
+	for (unsigned int j = 0; j < nhashed; j++) {
+		keys[j].data = outbuf[j].name;
+		keys[j].len = strlen(outbuf[j].name);
+	}
+	write_hash(symout, "efi_well_known_names", keys, nhashed);
+
+	free(keys);
 
 	fclose(symout);
 
@@ -35,6 +35,104 @@ struct guidname_index {
 	struct guidname_offset offsets[];
 };
 
+/*
+ * makeguids also emits a perfect hash index for each of the well known
+ * guid tables: a key is hashed with seed 0 to pick its bucket, and then
+ * hashed again with that bucket's seed to find its slot.  Each slot holds
+ * the index of its entry plus one, or 0 if it's empty.  The seeds are
+ * chosen when the tables are generated so that no two keys share a slot.
+ *
+ * efi_guid_ts are hashed as they're laid out in memory, which is the same
+ * on either endianness, so it doesn't matter that makeguids runs on the
+ * build machine.
+ */
+struct efivar_guidname_hash {
+	uint32_t nbuckets;
+	uint32_t nslots;
+	const uint16_t *seeds;
+	const uint16_t *slots;
+};
+
+static inline uint32_t UNUSED
+efivar_guidname_hash_key(const void *key, size_t len, uint32_t seed)
+{
+	const uint8_t *p = key;
+	uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+
+	/* FNV doesn't mix its last few bytes into the low bits well, and we
+	 * only keep the low bits, so finish it off */
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+/*
+ * Returns the index of the entry key would be at, or -1 if it can't be
+ * in the table at all.  The caller still has to check that the entry
+ * there is really key.
+ */
+static inline ssize_t UNUSED
+efivar_guidname_hash_find(const struct efivar_guidname_hash *hash,
+			  const void *key, size_t len)
+{
+	uint32_t bucket, slot;
+
+	if (hash->nbuckets == 0)
+		return -1;
+
+	bucket = efivar_guidname_hash_key(key, len, 0) % hash->nbuckets;
+	slot = efivar_guidname_hash_key(key, len, hash->seeds[bucket])
+	       % hash->nslots;
+	return (ssize_t)hash->slots[slot] - 1;
+}
+
+extern const struct efivar_guidname_hash efi_well_known_guids_hash HIDDEN;
+extern const struct efivar_guidname_hash efi_well_known_names_hash HIDDEN;
+
+/*
+ * "makeguids -D guids.txt file" writes the same tables, plus a string
+ * table, to a file that libefivar can map and look guids up in when
+ * they're not built in; see LIBEFIVAR_GUID_DB.  Everything is little
+ * endian and aligned to 4 bytes, and offsets are from the start of the
+ * file.  Both hashes use nbuckets and nslots, and their slots hold
+ * indices into the entry table, which is sorted by guid.  Entries' string
+ * offsets are into the string table, and each string is NUL terminated.
+ */
+#define EFIVAR_GUID_DB_MAGIC	"EFIGUIDS"
+#define EFIVAR_GUID_DB_VERSION	1
+
+struct efivar_guid_db_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nguids;
+	uint32_t nbuckets;
+	uint32_t nslots;
+	uint32_t entries;
+	uint32_t guid_seeds;
+	uint32_t guid_slots;
+	uint32_t name_seeds;
+	uint32_t name_slots;
+	uint32_t strtab;
+	uint32_t strsz;
+	uint32_t reserved;
+};
+
+struct efivar_guid_db_entry {
+	efi_guid_t guid;
+	uint32_t symbol;
+	uint32_t name;
+	uint32_t description;
+	uint32_t reserved;
+};
+
 static int
 gnopguidcmp(const void *p1, const void *p2)
 {
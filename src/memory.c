@@ -0,0 +1,694 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * memory.c - variables that only live in this process
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "efivar.h"
+
+/*
+ * LIBEFIVAR_OPS=memory keeps every variable in a hash table in this
+ * process, so tests and benchmarks can drive the whole public API without
+ * touching the firmware, and without their numbers being all about the
+ * filesystem.  It starts out empty, or with whatever is in the
+ * efivarfs-style directory LIBEFIVAR_MEMORY_SEED names; nothing is ever
+ * written back.
+ *
+ * Real firmware is slow, and the kernel only lets one caller into it at a
+ * time.  LIBEFIVAR_MEMORY_LATENCY=<read us>[,<write us>] makes each read,
+ * and each write or delete, take that long with the table locked, so a
+ * benchmark can see what serialized firmware calls do to it.  Reads are
+ * paced by LIBEFIVAR_RATELIMIT exactly as they are with efivarfs.
+ */
+struct memory_var {
+	struct memory_var *next;
+	uint32_t hash;
+	efi_guid_t guid;
+	char *name;
+	uint8_t *data;
+	size_t data_size;
+	uint32_t attributes;
+};
+
+#define MEMORY_MIN_BUCKETS	64
+
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t memory_once = PTHREAD_ONCE_INIT;
+static struct memory_var **memory_buckets;
+static size_t memory_n_buckets;
+static size_t memory_n_vars;
+static long memory_read_latency;
+static long memory_write_latency;
+
+/* FNV-1a over the guid and then the name */
+static uint32_t
+memory_hash(const efi_guid_t *guid, const char *name)
+{
+	const uint8_t *p = (const uint8_t *)guid;
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < sizeof(*guid); i++)
+		hash = (hash ^ p[i]) * 16777619u;
+	for (p = (const uint8_t *)name; *p; p++)
+		hash = (hash ^ *p) * 16777619u;
+	return hash;
+}
+
+static struct memory_var **
+memory_find(const efi_guid_t *guid, const char *name, uint32_t hash)
+{
+	struct memory_var **varp;
+
+	if (!memory_n_buckets)
+		return NULL;
+
+	varp = &memory_buckets[hash & (memory_n_buckets - 1)];
+	for (; *varp; varp = &(*varp)->next) {
+		if ((*varp)->hash == hash &&
+		    !memcmp(&(*varp)->guid, guid, sizeof(*guid)) &&
+		    !strcmp((*varp)->name, name))
+			return varp;
+	}
+	return NULL;
+}
+
+static int
+memory_grow(void)
+{
+	struct memory_var **buckets;
+	size_t n_buckets;
+
+	if (memory_n_vars < memory_n_buckets)
+		return 0;
+
+	n_buckets = memory_n_buckets ? memory_n_buckets * 2
+				     : MEMORY_MIN_BUCKETS;
+	buckets = calloc(n_buckets, sizeof(*buckets));
+	if (!buckets) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	for (size_t i = 0; i < memory_n_buckets; i++) {
+		struct memory_var *var, *next;
+
+		for (var = memory_buckets[i]; var; var = next) {
+			size_t bucket = var->hash & (n_buckets - 1);
+
+			next = var->next;
+			var->next = buckets[bucket];
+			buckets[bucket] = var;
+		}
+	}
+
+	free(memory_buckets);
+	memory_buckets = buckets;
+	memory_n_buckets = n_buckets;
+	return 0;
+}
+
+static void
+memory_var_free(struct memory_var *var)
+{
+	free(var->name);
+	free(var->data);
+	free(var);
+}
+
+/*
+ * Replaces the data of the variable if it exists and creates it if it
+ * doesn't, or appends to it if append is set.  Call with memory_lock
+ * held.
+ */
+static int
+memory_store(const efi_guid_t *guid, const char *name, const uint8_t *data,
+	     size_t data_size, uint32_t attributes, bool append)
+{
+	uint32_t hash = memory_hash(guid, name);
+	struct memory_var **varp = memory_find(guid, name, hash);
+	struct memory_var *var;
+	uint8_t *buf;
+	size_t size = data_size;
+
+	if (varp && append) {
+		var = *varp;
+		if (ADD(var->data_size, data_size, &size)) {
+			errno = EOVERFLOW;
+			efi_error("arithmetic overflow computing variable size");
+			return -1;
+		}
+		buf = realloc(var->data, size ? size : 1);
+		if (!buf) {
+			efi_error("could not allocate memory");
+			return -1;
+		}
+		if (data_size)
+			memcpy(buf + var->data_size, data, data_size);
+		var->data = buf;
+		var->data_size = size;
+		return 0;
+	}
+
+	buf = malloc(size ? size : 1);
+	if (!buf) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	if (size)
+		memcpy(buf, data, size);
+
+	if (varp) {
+		var = *varp;
+		free(var->data);
+		var->data = buf;
+		var->data_size = size;
+		var->attributes = attributes;
+		return 0;
+	}
+
+	if (memory_grow() < 0)
+		goto err;
+
+	var = calloc(1, sizeof(*var));
+	if (!var) {
+		efi_error("could not allocate memory");
+		goto err;
+	}
+	var->name = strdup(name);
+	if (!var->name) {
+		efi_error("could not allocate memory");
+		free(var);
+		goto err;
+	}
+	var->hash = hash;
+	var->guid = *guid;
+	var->data = buf;
+	var->data_size = size;
+	var->attributes = attributes;
+
+	varp = &memory_buckets[hash & (memory_n_buckets - 1)];
+	var->next = *varp;
+	*varp = var;
+	memory_n_vars++;
+	return 0;
+err:
+	free(buf);
+	return -1;
+}
+
+static long
+memory_parse_latency(const char *str, char **end)
+{
+	long val;
+
+	errno = 0;
+	val = strtol(str, end, 10);
+	if (errno || *end == str || val < 0)
+		return -1;
+	return val;
+}
+
+static void
+memory_load_latency(void)
+{
+	const char *str = getenv("LIBEFIVAR_MEMORY_LATENCY");
+	char *end = NULL;
+	long val;
+
+	if (!str)
+		return;
+
+	val = memory_parse_latency(str, &end);
+	if (val < 0)
+		return;
+	if (*end == ',') {
+		const char *write_str = end + 1;
+		long write_val;
+
+		write_val = memory_parse_latency(write_str, &end);
+		if (write_val < 0 || *end != '\0')
+			return;
+		memory_write_latency = write_val;
+	} else if (*end != '\0') {
+		return;
+	} else {
+		memory_write_latency = val;
+	}
+	memory_read_latency = val;
+}
+
+static void
+memory_load_seed(void)
+{
+	const char *path = getenv("LIBEFIVAR_MEMORY_SEED");
+	struct efi_varname_iter iter = { .dfd = -1, };
+	ssize_t namelen;
+
+	if (!path || !*path)
+		return;
+
+	if (generic_varname_iter_open(path, &iter) < 0) {
+		efi_error("could not open memory seed directory \"%s\"", path);
+		return;
+	}
+
+	while ((namelen = generic_varname_iter_next_entry(&iter)) > 0) {
+		uint8_t *buf = NULL;
+		size_t bufsize = 0;
+		uint32_t attributes;
+		int fd;
+		int rc;
+
+		fd = openat(iter.dfd, iter.entry, O_RDONLY|O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		rc = read_file(fd, &buf, &bufsize);
+		close(fd);
+		/* read_file() pads out one extra byte to NUL it */
+		if (rc < 0 || bufsize < sizeof(attributes) + 1) {
+			free(buf);
+			continue;
+		}
+
+		memcpy(iter.name, iter.entry, namelen);
+		iter.name[namelen] = '\0';
+		memcpy(&attributes, buf, sizeof(attributes));
+		memory_store(&iter.guid, iter.name, buf + sizeof(attributes),
+			     bufsize - 1 - sizeof(attributes), attributes,
+			     false);
+		free(buf);
+	}
+
+	generic_varname_iter_close(&iter);
+}
+
+static void
+memory_init(void)
+{
+	memory_load_latency();
+	memory_load_seed();
+}
+
+static void
+memory_enter(void)
+{
+	pthread_once(&memory_once, memory_init);
+	pthread_mutex_lock(&memory_lock);
+}
+
+static void
+memory_leave(void)
+{
+	__typeof__(errno) errno_value = errno;
+	pthread_mutex_unlock(&memory_lock);
+	errno = errno_value;
+}
+
+/* Pretend to be in the firmware for a while.  Call with memory_lock held. */
+static void
+memory_firmware_call(long latency)
+{
+	struct timespec ts;
+	__typeof__(errno) errno_value;
+
+	if (latency <= 0)
+		return;
+
+	errno_value = errno;
+	ts.tv_sec = latency / 1000000;
+	ts.tv_nsec = (latency % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+	errno = errno_value;
+}
+
+static void
+memory_read_call(void)
+{
+	efi_ratelimit();
+	memory_enter();
+	memory_firmware_call(memory_read_latency);
+}
+
+static int
+memory_probe(void)
+{
+	/* only ever used when LIBEFIVAR_OPS asks for it */
+	return 0;
+}
+
+static int
+memory_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
+		    size_t *data_size, uint32_t *attributes)
+{
+	struct memory_var **varp;
+	uint8_t *buf;
+	int ret = -1;
+
+	memory_read_call();
+	varp = memory_find(&guid, name, memory_hash(&guid, name));
+	if (!varp) {
+		errno = ENOENT;
+		efi_error("variable not found");
+		goto err;
+	}
+
+	/* the other backends always hand back a buffer, and NUL it */
+	buf = malloc((*varp)->data_size + 1);
+	if (!buf) {
+		efi_error("could not allocate memory");
+		goto err;
+	}
+	memcpy(buf, (*varp)->data, (*varp)->data_size);
+	buf[(*varp)->data_size] = '\0';
+
+	*data = buf;
+	*data_size = (*varp)->data_size;
+	*attributes = (*varp)->attributes;
+	ret = 0;
+err:
+	memory_leave();
+	return ret;
+}
+
+static int
+memory_get_variable_into(efi_guid_t guid, const char *name, uint8_t *buf,
+			 size_t bufsz, size_t *data_size,
+			 uint32_t *attributes)
+{
+	struct memory_var **varp;
+	int ret = -1;
+
+	memory_read_call();
+	varp = memory_find(&guid, name, memory_hash(&guid, name));
+	if (!varp) {
+		errno = ENOENT;
+		efi_error("variable not found");
+		goto err;
+	}
+
+	*data_size = (*varp)->data_size;
+	if ((*varp)->data_size > bufsz) {
+		errno = ENOSPC;
+		goto err;
+	}
+	if ((*varp)->data_size)
+		memcpy(buf, (*varp)->data, (*varp)->data_size);
+	*attributes = (*varp)->attributes;
+	ret = 0;
+err:
+	memory_leave();
+	return ret;
+}
+
+/*
+ * efivarfs keeps the attributes and size in the inode, so these don't
+ * cost a firmware call there, and they don't here either.
+ */
+static int
+memory_get_variable_attributes(efi_guid_t guid, const char *name,
+			       uint32_t *attributes)
+{
+	struct memory_var **varp;
+	int ret = -1;
+
+	memory_enter();
+	varp = memory_find(&guid, name, memory_hash(&guid, name));
+	if (!varp) {
+		errno = ENOENT;
+		efi_error("variable not found");
+	} else {
+		*attributes = (*varp)->attributes;
+		ret = 0;
+	}
+	memory_leave();
+	return ret;
+}
+
+static int
+memory_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
+{
+	struct memory_var **varp;
+	int ret = -1;
+
+	memory_enter();
+	varp = memory_find(&guid, name, memory_hash(&guid, name));
+	if (!varp) {
+		errno = ENOENT;
+		efi_error("variable not found");
+	} else {
+		*size = (*varp)->data_size;
+		ret = 0;
+	}
+	memory_leave();
+	return ret;
+}
+
+static int
+memory_del_variable(efi_guid_t guid, const char *name)
+{
+	struct memory_var **varp;
+	struct memory_var *var;
+	int ret = -1;
+
+	memory_enter();
+	memory_firmware_call(memory_write_latency);
+	varp = memory_find(&guid, name, memory_hash(&guid, name));
+	if (!varp) {
+		errno = ENOENT;
+		efi_error("variable not found");
+		goto err;
+	}
+
+	var = *varp;
+	*varp = var->next;
+	memory_n_vars--;
+	memory_var_free(var);
+	ret = 0;
+err:
+	memory_leave();
+	return ret;
+}
+
+static int
+memory_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
+		    size_t data_size, uint32_t attributes,
+		    mode_t mode UNUSED)
+{
+	bool append = attributes & EFI_VARIABLE_APPEND_WRITE;
+	int ret;
+
+	/* efivarfs couldn't make a file for it, so don't let it in here */
+	if (strlen(name) > NAME_MAX - 37) {
+		errno = ENAMETOOLONG;
+		efi_error("name too long (%zd)", strlen(name));
+		return -1;
+	}
+
+	memory_enter();
+	memory_firmware_call(memory_write_latency);
+	ret = memory_store(&guid, name, data, data_size,
+			   attributes & ~EFI_VARIABLE_APPEND_WRITE, append);
+	memory_leave();
+	return ret;
+}
+
+static int
+memory_append_variable(efi_guid_t guid, const char *name, uint8_t *data,
+		       size_t data_size, uint32_t attributes)
+{
+	attributes |= EFI_VARIABLE_APPEND_WRITE;
+	return memory_set_variable(guid, name, data, data_size, attributes, 0);
+}
+
+static int
+memory_snapshot_variables(efi_variable_snapshot_t *snapshot)
+{
+	int ret = -1;
+
+	memory_enter();
+	for (size_t i = 0; i < memory_n_buckets; i++) {
+		for (struct memory_var *var = memory_buckets[i]; var;
+		     var = var->next) {
+			memory_firmware_call(memory_read_latency);
+			if (snapshot_add_variable(snapshot, &var->guid,
+						  var->name, var->attributes,
+						  var->data,
+						  var->data_size) < 0)
+				goto err;
+		}
+	}
+	ret = 0;
+err:
+	memory_leave();
+	return ret;
+}
+
+/*
+ * Iterators copy the names out when they're opened, the way getdents()
+ * would, so they don't hold the lock between calls and don't care what
+ * gets created or deleted while they run.
+ */
+struct memory_names {
+	size_t n_names;
+	size_t pos;
+	struct {
+		efi_guid_t guid;
+		char *name;
+	} names[];
+};
+
+static void
+memory_varname_iter_close(struct efi_varname_iter *iter)
+{
+	struct memory_names *names = iter->priv;
+
+	if (!names)
+		return;
+	for (size_t i = 0; i < names->n_names; i++)
+		free(names->names[i].name);
+	free(names);
+	iter->priv = NULL;
+}
+
+static int
+memory_varname_iter_next(struct efi_varname_iter *iter, efi_guid_t **guid,
+			 char **name)
+{
+	struct memory_names *names = iter->priv;
+	size_t pos;
+
+	if (!names)
+		return 0;
+	if (names->pos >= names->n_names) {
+		memory_varname_iter_close(iter);
+		return 0;
+	}
+
+	pos = names->pos++;
+	iter->guid = names->names[pos].guid;
+	strncpy(iter->name, names->names[pos].name, sizeof(iter->name) - 1);
+	iter->name[sizeof(iter->name) - 1] = '\0';
+
+	*guid = &iter->guid;
+	*name = iter->name;
+	return 1;
+}
+
+static int
+memory_varname_iter_open(struct efi_varname_iter *iter)
+{
+	struct memory_names *names;
+	size_t n = 0;
+
+	memory_enter();
+	names = calloc(1, sizeof(*names) +
+			  memory_n_vars * sizeof(names->names[0]));
+	if (!names) {
+		efi_error("could not allocate memory");
+		memory_leave();
+		return -1;
+	}
+
+	for (size_t i = 0; i < memory_n_buckets; i++) {
+		for (struct memory_var *var = memory_buckets[i]; var;
+		     var = var->next) {
+			names->names[n].name = strdup(var->name);
+			if (!names->names[n].name) {
+				efi_error("could not allocate memory");
+				names->n_names = n;
+				memory_leave();
+				iter->priv = names;
+				memory_varname_iter_close(iter);
+				return -1;
+			}
+			names->names[n].guid = var->guid;
+			n++;
+		}
+	}
+	names->n_names = n;
+	memory_leave();
+
+	iter->dfd = -1;
+	iter->priv = names;
+	iter->next = memory_varname_iter_next;
+	iter->close = memory_varname_iter_close;
+	return 0;
+}
+
+static struct efi_varname_iter next_variable_name_iter;
+
+static int
+memory_get_next_variable_name(efi_guid_t **guid, char **name)
+{
+	if (!guid || !name) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+
+	if ((*guid == NULL && *name != NULL) ||
+	    (*guid != NULL && *name == NULL)) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+
+	if (!next_variable_name_iter.priv) {
+		if (memory_varname_iter_open(&next_variable_name_iter) < 0)
+			return -1;
+		*guid = NULL;
+		*name = NULL;
+	}
+
+	return memory_varname_iter_next(&next_variable_name_iter, guid, name);
+}
+
+static void DESTRUCTOR
+memory_fini(void)
+{
+	memory_varname_iter_close(&next_variable_name_iter);
+	for (size_t i = 0; i < memory_n_buckets; i++) {
+		struct memory_var *var, *next;
+
+		for (var = memory_buckets[i]; var; var = next) {
+			next = var->next;
+			memory_var_free(var);
+		}
+	}
+	free(memory_buckets);
+	memory_buckets = NULL;
+	memory_n_buckets = 0;
+	memory_n_vars = 0;
+}
+
+struct efi_var_operations memory_ops = {
+	.name = "memory",
+	.probe = memory_probe,
+	.set_variable = memory_set_variable,
+	.append_variable = memory_append_variable,
+	.del_variable = memory_del_variable,
+	.get_variable = memory_get_variable,
+	.get_variable_into = memory_get_variable_into,
+	.get_variable_attributes = memory_get_variable_attributes,
+	.get_variable_size = memory_get_variable_size,
+	.get_next_variable_name = memory_get_next_variable_name,
+	.chmod_variable = NULL,
+	.snapshot_variables = memory_snapshot_variables,
+	.varname_iter_open = memory_varname_iter_open,
+	.watch_variables = NULL,
+	.apply_transaction = NULL,
+};
+
+// vim:fenc=utf-8:tw=75:noet
@@ -7,154 +7,128 @@
 
 #include "efivar.h"
 
-static bool
-cinpat(const char c, const char *pat)
-{
-	for (unsigned int i = 0; pat[i]; i++)
-	        if (pat[i] == c)
-	                return true;
-	return false;
-}
-
-static unsigned int
-strxcspn(const char *s, const char *pattern)
-{
-	unsigned int i;
-	for (i = 0; s[i]; i++) {
-	        if (!cinpat(s[i], pattern))
-	                break;
-	}
-	return i;
-}
-
-struct span {
-	const char *pos;
-	size_t len;
-};
-
 /*
- * count how many parts of a path there are, with some caveats:
- * a leading / is one because it's a directory, but all other slashes are
- * treated as separators, so i.e.:
+ * Segments are split with some caveats: a leading / is one because it's
+ * a directory, but all other slashes are treated as separators, so i.e.:
  * 1: /
  * 2: /foo foo/bar foo/bar/
  * 3: /foo/bar /foo/bar/ foo/bar/baz
  *
- * the usage model here is 1 pass to count, one allocation, one pass to
- * separate.
+ * Both directions work straight off the string, one segment at a time,
+ * so finding the last few parts of a sysfs link doesn't mean splitting
+ * the whole thing up first.
  */
-unsigned int HIDDEN
-count_spans(const char *str, const char *reject, unsigned int *chars)
+bool HIDDEN
+path_iter_next(struct path_iter *iter)
 {
-	unsigned int s = 0, c = 0, pos = 0;
-
-	if (str[0] == '/') {
-	        s += 1;
-	        c += 2;
-	        pos += 1;
+	const char *p;
+
+	if (!iter->seg.pos) {
+		p = iter->path;
+		if (p[0] == '/') {
+			iter->seg.pos = p;
+			iter->seg.len = 1;
+			return true;
+		}
+	} else {
+		p = iter->seg.pos + iter->seg.len;
 	}
 
-	while (str[pos]) {
-	        unsigned int n;
-
-	        n = strcspn(str + pos, reject);
-	        if (n) {
-	                s += 1;
-	                c += n + 1;
-	                pos += n;
-	        }
+	while (*p == '/')
+		p++;
+	if (!*p)
+		return false;
 
-	        pos += strxcspn(str + pos, reject);
-	}
-
-	if (chars)
-	        *chars = c;
-	return s;
+	iter->seg.pos = p;
+	iter->seg.len = strcspn(p, "/");
+	return true;
 }
 
-void HIDDEN
-fill_spans(const char *str, const char *reject, void *spanbuf)
+bool HIDDEN
+path_iter_prev(struct path_iter *iter)
 {
-	struct span *spans = (struct span *)spanbuf;
-	struct span *span = spans;
-	unsigned int pos = 0;
-
-	if (str[0] == '/') {
-	        span->pos = str;
-	        span->len = 1;
-	        span++;
-	        pos += 1;
+	const char *path = iter->path;
+	const char *p, *end;
+
+	if (!iter->seg.pos)
+		p = path + strlen(path);
+	else if (iter->seg.pos == path)
+		return false;
+	else
+		p = iter->seg.pos;
+
+	while (p > path && p[-1] == '/')
+		p--;
+	if (p == path) {
+		if (path[0] != '/')
+			return false;
+		iter->seg.pos = path;
+		iter->seg.len = 1;
+		return true;
 	}
 
-	while (str[pos]) {
-	        unsigned int n;
+	end = p;
+	while (p > path && p[-1] != '/')
+		p--;
+	iter->seg.pos = p;
+	iter->seg.len = end - p;
+	return true;
+}
 
-	        n = strcspn(str + pos, reject);
-	        if (n) {
-	                span->pos = str + pos;
-	                span->len = n;
-	                span++;
-	                pos += n;
-	        }
+/*
+ * Fill segs[0] with the last segment of path, segs[1] with the one before
+ * it, and so on, for up to n of them; any there aren't enough segments
+ * for get a NULL pos.  Returns how many there were.
+ */
+unsigned int HIDDEN
+path_last_segments(const char *path, struct path_seg *segs, unsigned int n)
+{
+	struct path_iter iter = PATH_ITER_INIT(path);
+	unsigned int i;
 
-	        pos += strxcspn(str + pos, reject);
+	for (i = 0; i < n && path_iter_prev(&iter); i++)
+		segs[i] = iter.seg;
+	for (unsigned int j = i; j < n; j++) {
+		segs[j].pos = NULL;
+		segs[j].len = 0;
 	}
-	span->pos = NULL;
-	span->len = 0;
+	return i;
 }
 
-#define split_spans(str, reject)                                        \
-	({                                                              \
-	        struct span *ret_ = NULL;                               \
-	        unsigned int s_, c_;                                    \
-	                                                                \
-	        s_ = count_spans(str, "/", &c_);                        \
-	        if (s_) {                                               \
-	                ret_ = alloca(sizeof(struct span[s_+1]));       \
-	                if (ret_)                                       \
-	                        fill_spans(str, reject, ret_);          \
-	        } else {                                                \
-	                errno = 0;                                      \
-	        }                                                       \
-	        ret_;                                                   \
-	})
-
 int HIDDEN
 find_path_segment(const char *path, int segment, const char **pos, size_t *len)
 {
-	struct span *span, *last;
-	int nspans = 0;
+	struct path_iter iter = PATH_ITER_INIT(path);
+	bool found;
 
 	if (!pos || !len) {
 	        errno = EINVAL;
 	        return -1;
 	}
 
-	span = split_spans(path, "/");
-	if (!span) {
-	        if (errno)
-	                return -1;
+	if (!path[0]) {
 	        *pos = NULL;
 	        *len = 0;
 	        return 0;
 	}
 
-	for (last = span; last->pos; last++)
-	        nspans += 1;
-
-	if (segment < 0)
-	        segment = nspans + segment;
+	if (segment >= 0) {
+	        do
+	                found = path_iter_next(&iter);
+	        while (found && segment--);
+	} else {
+	        do
+	                found = path_iter_prev(&iter);
+	        while (found && ++segment);
+	}
 
-	if (nspans < 1 || segment < 0 || segment >= nspans) {
+	if (!found) {
 	        errno = ENOENT;
 	        return -1;
 	}
 
-	for (int i = 0; i < segment; i++)
-	        span++;
-
-	*pos = span->pos;
-	*len = span->len;
+	*pos = iter.seg.pos;
+	*len = iter.seg.len;
 	return 0;
 }
 
@@ -7,8 +7,42 @@
 #ifndef PATH_HELPER_H_
 #define PATH_HELPER_H_
 
-void HIDDEN fill_spans(const char *str, const char *reject, void *spanbuf);
-unsigned int HIDDEN count_spans(const char *str, const char *reject, unsigned int *chars);
+/*
+ * One part of a path, not NUL-terminated; print it with
+ * PATH_SEG_FMT and PATH_SEG_ARG(seg).
+ */
+struct path_seg {
+	const char *pos;
+	size_t len;
+};
+
+#define PATH_SEG_FMT "%.*s"
+#define PATH_SEG_ARG(seg) (int)(seg)->len, (seg)->pos
+
+static inline bool UNUSED
+path_seg_is(const struct path_seg *seg, const char *str)
+{
+	return seg->pos && strlen(str) == seg->len &&
+	       !memcmp(seg->pos, str, seg->len);
+}
+
+/*
+ * Iterate over a path's segments in place.  Starting from
+ * PATH_ITER_INIT(), path_iter_next() goes from the front and
+ * path_iter_prev() from the back; each returns false when there aren't
+ * any more, and otherwise leaves the segment in iter->seg.
+ */
+struct path_iter {
+	const char *path;
+	struct path_seg seg;
+};
+
+#define PATH_ITER_INIT(p) { .path = (p), .seg = { NULL, 0 } }
+
+bool HIDDEN path_iter_next(struct path_iter *iter);
+bool HIDDEN path_iter_prev(struct path_iter *iter);
+unsigned int HIDDEN path_last_segments(const char *path, struct path_seg *segs,
+				       unsigned int n);
 int HIDDEN find_path_segment(const char *path, int segment, const char **pos, size_t *len);
 
 #define pathseg(path, seg)						\
@@ -0,0 +1,188 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * pe-hash.c - Authenticode digests of PE images
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "efisec.h"
+#include "pe-hash.h"
+#include "sha256.h"
+
+/*
+ * The bits of the PE/COFF headers Authenticode cares about.  Offsets in
+ * the optional header are the same for PE32 and PE32+ up through
+ * CheckSum; NumberOfRvaAndSizes and the data directories that follow it
+ * move by the 16 bytes PE32+ spends on widening the stack and heap
+ * sizes.
+ */
+#define PE_DOS_MAGIC			0x5a4d
+#define PE_DOS_LFANEW			0x3c
+#define PE_NT_SIGNATURE			0x00004550
+#define PE_COFF_HEADER_SIZE		20
+#define PE_COFF_NSECTIONS		2
+#define PE_COFF_OPTHDR_SIZE		16
+#define PE_OPT_MAGIC_PE32		0x10b
+#define PE_OPT_MAGIC_PE32PLUS		0x20b
+#define PE_OPT_SIZE_OF_HEADERS		60
+#define PE_OPT_CHECKSUM			64
+#define PE_OPT_NUM_DATA_DIRS_PE32	92
+#define PE_OPT_NUM_DATA_DIRS_PE32PLUS	108
+#define PE_DATA_DIR_SECURITY		4
+#define PE_SECTION_HEADER_SIZE		40
+#define PE_SECTION_RAW_SIZE		16
+#define PE_SECTION_RAW_OFFSET		20
+
+static inline uint16_t
+get16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le16_to_cpu(v);
+}
+
+static inline uint32_t
+get32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32_to_cpu(v);
+}
+
+struct pe_section {
+	uint32_t offset;
+	uint32_t size;
+};
+
+static int
+pe_section_cmp(const void *a, const void *b)
+{
+	const struct pe_section *sa = a, *sb = b;
+
+	if (sa->offset != sb->offset)
+		return sa->offset < sb->offset ? -1 : 1;
+	return 0;
+}
+
+int
+pe_hash_sha256(const uint8_t *buf, size_t bufsz,
+	       uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	struct sha256_ctx ctx;
+	struct pe_section *sections = NULL;
+	size_t nt, opt, opt_size, ndirs_off, secdir = 0, sectab;
+	size_t checksum, headers_size, hashed, cert_size = 0;
+	uint16_t nsections, magic;
+	uint32_t ndirs;
+	int ret = -1;
+
+	if (bufsz < PE_DOS_LFANEW + 4 || get16(buf) != PE_DOS_MAGIC)
+		goto inval;
+	nt = get32(buf + PE_DOS_LFANEW);
+	if (nt > bufsz || bufsz - nt < 4 + PE_COFF_HEADER_SIZE ||
+	    get32(buf + nt) != PE_NT_SIGNATURE)
+		goto inval;
+
+	nsections = get16(buf + nt + 4 + PE_COFF_NSECTIONS);
+	opt_size = get16(buf + nt + 4 + PE_COFF_OPTHDR_SIZE);
+	opt = nt + 4 + PE_COFF_HEADER_SIZE;
+	if (bufsz - opt < opt_size || opt_size < 2)
+		goto inval;
+
+	magic = get16(buf + opt);
+	if (magic == PE_OPT_MAGIC_PE32)
+		ndirs_off = PE_OPT_NUM_DATA_DIRS_PE32;
+	else if (magic == PE_OPT_MAGIC_PE32PLUS)
+		ndirs_off = PE_OPT_NUM_DATA_DIRS_PE32PLUS;
+	else
+		goto inval;
+	if (opt_size < ndirs_off + 4)
+		goto inval;
+
+	ndirs = get32(buf + opt + ndirs_off);
+	if (ndirs > (opt_size - ndirs_off - 4) / 8)
+		goto inval;
+	if (ndirs > PE_DATA_DIR_SECURITY) {
+		uint32_t cert_offset;
+
+		secdir = opt + ndirs_off + 4 + PE_DATA_DIR_SECURITY * 8;
+		cert_offset = get32(buf + secdir);
+		cert_size = get32(buf + secdir + 4);
+		if (cert_size &&
+		    (cert_offset > bufsz || bufsz - cert_offset < cert_size))
+			goto inval;
+	}
+
+	checksum = opt + PE_OPT_CHECKSUM;
+	headers_size = get32(buf + opt + PE_OPT_SIZE_OF_HEADERS);
+	sectab = opt + opt_size;
+	if (headers_size > bufsz || headers_size < sectab ||
+	    (bufsz - sectab) / PE_SECTION_HEADER_SIZE < nsections)
+		goto inval;
+
+	/*
+	 * The headers are hashed minus the checksum and the security
+	 * directory entry, since signing changes both of them.
+	 */
+	sha256_init(&ctx);
+	sha256_update(&ctx, buf, checksum);
+	if (secdir) {
+		sha256_update(&ctx, buf + checksum + 4, secdir - checksum - 4);
+		sha256_update(&ctx, buf + secdir + 8,
+			      headers_size - secdir - 8);
+	} else {
+		sha256_update(&ctx, buf + checksum + 4,
+			      headers_size - checksum - 4);
+	}
+	hashed = headers_size;
+
+	/* then each section's raw data, in the order it sits in the file */
+	if (nsections) {
+		sections = calloc(nsections, sizeof(*sections));
+		if (!sections)
+			goto out;
+	}
+	for (unsigned int i = 0; i < nsections; i++) {
+		const uint8_t *sh = buf + sectab + i * PE_SECTION_HEADER_SIZE;
+
+		sections[i].size = get32(sh + PE_SECTION_RAW_SIZE);
+		sections[i].offset = get32(sh + PE_SECTION_RAW_OFFSET);
+		if (sections[i].offset > bufsz ||
+		    bufsz - sections[i].offset < sections[i].size)
+			goto inval;
+	}
+	if (nsections)
+		qsort(sections, nsections, sizeof(*sections), pe_section_cmp);
+	for (unsigned int i = 0; i < nsections; i++) {
+		if (sections[i].size == 0)
+			continue;
+		sha256_update(&ctx, buf + sections[i].offset,
+			      sections[i].size);
+		hashed += sections[i].size;
+	}
+
+	/*
+	 * and finally anything after the sections that isn't the
+	 * certificate table.
+	 */
+	if (bufsz > hashed && bufsz - hashed > cert_size)
+		sha256_update(&ctx, buf + hashed, bufsz - hashed - cert_size);
+
+	sha256_final(&ctx, digest);
+	ret = 0;
+	goto out;
+inval:
+	errno = EINVAL;
+out:
+	free(sections);
+	return ret;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * pe-hash.h - Authenticode digests of PE images
+ */
+
+#ifndef _EFIVAR_PE_HASH_H
+#define _EFIVAR_PE_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/*
+ * Compute the SHA-256 Authenticode digest of the PE/COFF image in
+ * buf, which is what goes in db or dbx to allow or forbid that image.
+ * Returns 0 on success, or -1 with errno set to EINVAL if the image
+ * isn't one we can make sense of.
+ */
+extern int pe_hash_sha256(const uint8_t *buf, size_t bufsz,
+			  uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif /* !_EFIVAR_PE_HASH_H */
+
+// vim:fenc=utf-8:tw=75:noet
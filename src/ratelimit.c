@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * ratelimit.c - pacing for unprivileged variable reads
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "efivar.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * The kernel rate limiter hits us if we go faster than 100 efi variable
+ * reads per second as non-root, and it allows bursts of up to 100.  So
+ * rather than sleeping before every read, keep a process-wide token
+ * bucket with the same shape, and only sleep when it's empty.
+ *
+ * Tokens are kept in millionths so that refilling at "rate" per second
+ * is just rate tokens per microsecond-of-a-million.  The count is allowed
+ * to go negative: a reader that finds the bucket empty takes its token
+ * anyway and sleeps off the debt, so concurrent readers queue up behind
+ * each other instead of all waking at once.
+ *
+ * LIBEFIVAR_RATELIMIT=<reads per second> overrides the default; 0 turns
+ * pacing off entirely.
+ */
+#define DEFAULT_RATELIMIT	100
+#define TOKEN			1000000ll
+
+static pthread_mutex_t ratelimit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ratelimit_initialized;
+static int64_t ratelimit_rate;
+static int64_t ratelimit_tokens;
+static int64_t ratelimit_last;
+
+static int64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+ratelimit_init(void)
+{
+	char *rate;
+
+	if (ratelimit_initialized)
+		return;
+
+	ratelimit_rate = DEFAULT_RATELIMIT;
+	rate = getenv("LIBEFIVAR_RATELIMIT");
+	if (rate) {
+		char *end = NULL;
+		long val;
+
+		errno = 0;
+		val = strtol(rate, &end, 10);
+		if (errno == 0 && end != rate && *end == '\0' &&
+		    val >= 0 && val <= INT32_MAX)
+			ratelimit_rate = val;
+	}
+
+	ratelimit_tokens = ratelimit_rate * TOKEN;
+	ratelimit_last = now_us();
+	ratelimit_initialized = 1;
+}
+
+static void
+ratelimit_refill(void)
+{
+	int64_t now = now_us();
+	int64_t elapsed = now - ratelimit_last;
+
+	ratelimit_last = now;
+	if (elapsed <= 0)
+		return;
+
+	ratelimit_tokens += elapsed * ratelimit_rate;
+	if (ratelimit_tokens > ratelimit_rate * TOKEN)
+		ratelimit_tokens = ratelimit_rate * TOKEN;
+}
+
+static inline int
+ratelimit_applies(void)
+{
+	return geteuid() != 0 && ratelimit_rate > 0;
+}
+
+void HIDDEN
+efi_ratelimit(void)
+{
+	int64_t debt = 0;
+
+	pthread_mutex_lock(&ratelimit_lock);
+	ratelimit_init();
+	if (!ratelimit_applies()) {
+		pthread_mutex_unlock(&ratelimit_lock);
+		return;
+	}
+
+	ratelimit_refill();
+	ratelimit_tokens -= TOKEN;
+	if (ratelimit_tokens < 0)
+		debt = -ratelimit_tokens;
+	pthread_mutex_unlock(&ratelimit_lock);
+
+	if (debt > 0) {
+		__typeof__(errno) errno_value = errno;
+		int64_t us = (debt + ratelimit_rate - 1) / ratelimit_rate;
+
+		tracepoint(libefivar, ratelimit_sleep_entry, us);
+		stats_inc(ratelimit_sleeps);
+		stats_add(ratelimit_sleep_us, us);
+		usleep(us);
+		tracepoint(libefivar, ratelimit_sleep_return, us);
+		errno = errno_value;
+	}
+}
+
+int NONNULL(1, 2) PUBLIC
+efi_get_variable_read_budget(unsigned int *available, unsigned int *burst)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&ratelimit_lock);
+	ratelimit_init();
+	if (!ratelimit_applies()) {
+		*available = *burst = UINT32_MAX;
+		ret = 1;
+	} else {
+		ratelimit_refill();
+		*available = ratelimit_tokens > 0 ? ratelimit_tokens / TOKEN : 0;
+		*burst = ratelimit_rate;
+	}
+	pthread_mutex_unlock(&ratelimit_lock);
+
+	return ret;
+}
+
+// vim:fenc=utf-8:tw=75:noet
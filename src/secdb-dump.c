@@ -11,122 +11,147 @@
 #define DEBUG_LEVEL LOG_DEBUG_DUMPER
 
 static bool annotate = false;
-static char *buf = NULL;
-static size_t bufsz = 0;
-static size_t start = 0;
+
+/*
+ * A dump of a big dbx is tens of thousands of lines, so they're all
+ * rendered into one buffer that's written out whenever it fills up,
+ * instead of going through stdio a piece at a time.
+ */
+static char outbuf[65536];
+static size_t outlen;
+
+static void
+secdb_dump_flush(void)
+{
+	if (outlen)
+		fwrite(outbuf, 1, outlen, stdout);
+	outlen = 0;
+}
+
+static inline char *
+secdb_dump_reserve(size_t len)
+{
+	if (outlen + len > sizeof(outbuf))
+		secdb_dump_flush();
+	return outbuf + outlen;
+}
+
+static void
+secdb_dump_vprintf(const char *fmt, va_list ap)
+{
+	size_t space = sizeof(outbuf) - outlen;
+	va_list aq;
+	int rc;
+
+	va_copy(aq, ap);
+	rc = vsnprintf(outbuf + outlen, space, fmt, aq);
+	va_end(aq);
+	if (rc < 0)
+		return;
+	if ((size_t)rc < space) {
+		outlen += rc;
+		return;
+	}
+
+	secdb_dump_flush();
+	space = sizeof(outbuf);
+	va_copy(aq, ap);
+	rc = vsnprintf(outbuf, space, fmt, aq);
+	va_end(aq);
+	if (rc < 0)
+		return;
+	if ((size_t)rc < space) {
+		outlen = rc;
+		return;
+	}
+	vprintf(fmt, ap);
+}
+
+/*
+ * Without annotations the dump is one plain hexdump of the whole
+ * database, so bytes are gathered a line at a time, and each line is
+ * rendered as soon as it's full.
+ */
+static uint8_t line_data[16];
+static size_t line_datasz;
+static size_t line_offset;
+
+static void
+secdb_dump_line(void)
+{
+	unsigned long used;
+	char *p = secdb_dump_reserve(HEXDUMP_LINE_MAX + 1);
+
+	outlen += hexdump_line(p, line_data, line_datasz, 0, line_offset,
+			       false, &used);
+	outbuf[outlen++] = '\n';
+	line_offset += line_datasz;
+	line_datasz = 0;
+}
 
 static inline void
 secdb_dump_finish(void)
 {
-	if (buf && bufsz) {
-		hexdumpat((uint8_t *)buf, bufsz, start);
-		free(buf);
-	}
-	buf = NULL;
-	bufsz = 0;
+	if (line_datasz)
+		secdb_dump_line();
 }
 
 static inline ssize_t
-secdb_buffer(char *val, size_t valsz, ssize_t offset)
+secdb_buffer(const uint8_t *val, size_t valsz, ssize_t offset)
 {
-	char *nbuf;
-	size_t nbufsz, allocsz;
-
-	if (!buf) {
-		// just because valgrind is annoying about realloc(NULL, ...)
-		buf = calloc(1, page_size);
-		if (!buf)
-			return -1;
+	size_t done = 0;
+
+	while (done < valsz) {
+		size_t n = MIN(valsz - done, sizeof(line_data) - line_datasz);
+
+		if (val)
+			memcpy(line_data + line_datasz, val + done, n);
+		else
+			memset(line_data + line_datasz, 0, n);
+		line_datasz += n;
+		done += n;
+		if (line_datasz == sizeof(line_data))
+			secdb_dump_line();
 	}
-
-	nbufsz = offset + valsz;
-	allocsz = ALIGN_UP(nbufsz, page_size);
-	nbuf = realloc(buf, allocsz);
-	if (!nbuf) {
-		free(buf);
-		buf = NULL;
-		bufsz = 0;
-		return -1;
-	}
-	memset(nbuf + bufsz, '\0', allocsz - bufsz);
-	memcpy(nbuf + offset, val, valsz);
-	buf = nbuf;
-	bufsz = nbufsz;
-	return nbufsz;
+	return offset + valsz;
 }
 
 static inline ssize_t
 secdb_dump_value(char *val, size_t size, ssize_t offset, char *fmt, ...)
 {
-	char posbuf[9];
-	char hexbuf[49];
-	char textbuf[19];
-
 	size_t printed = 0;
 	va_list ap;
 	bool once = false;
-	unsigned int i;
-
-	posbuf[sizeof(posbuf)-1] = '\0';
-	hexbuf[sizeof(hexbuf)-1] = '\0';
-	textbuf[sizeof(textbuf)-1] = '\0';
 
 	if (!annotate) {
 		if (size == 0)
 			return offset;
-		return secdb_buffer(val, size, offset);
+		return secdb_buffer((uint8_t *)val, size, offset);
 	}
-	if (size == 0 && strlen(fmt) == 0)
+	if (size == 0 && fmt[0] == '\0')
 		return offset;
 
-	if (size == 0) {
-		memset(posbuf, ' ', sizeof(posbuf)-1);
-		memset(hexbuf, ' ', sizeof(hexbuf)-1);
-		memset(textbuf, ' ', sizeof(textbuf)-1);
-
-		sprintf(posbuf, "%08zx", offset + printed);
-		prepare_text("", 0, textbuf, offset + printed);
-
-		for (i = strlen(textbuf); annotate && i < sizeof(textbuf)-1; i++)
-			textbuf[i] = ' ';
-		textbuf[sizeof(textbuf)-1] = '\0';
-		printf("%s  %s  %s", posbuf, hexbuf, textbuf);
-		if (annotate) {
-			printf("  ");
-			va_start(ap, fmt);
-			vprintf(fmt, ap);
-			va_end(ap);
-		}
-		printf("\n");
-	}
-	while (size - printed) {
-		size_t sz;
-
-		memset(posbuf, ' ', sizeof(posbuf)-1);
-		memset(hexbuf, ' ', sizeof(hexbuf)-1);
-		memset(textbuf, ' ', sizeof(textbuf)-1);
-
-		sprintf(posbuf, "%08zx", offset + printed);
-		debug("size:%zd printed:%zd", size, printed);
-		sz = prepare_hex(val+printed, size-printed, hexbuf, offset+printed);
-		prepare_text(val+printed, size-printed, textbuf, offset+printed);
-
-		for (i = strlen(textbuf); annotate && i < sizeof(textbuf)-1; i++)
-			textbuf[i] = ' ';
-		textbuf[sizeof(textbuf)-1] = '\0';
+	do {
+		unsigned long sz;
+		char *p;
 
+		p = secdb_dump_reserve(HEXDUMP_LINE_MAX + 2);
+		outlen += hexdump_line(p, (uint8_t *)val + printed,
+				       size - printed, offset + printed,
+				       offset + printed, true, &sz);
 		printed += sz;
 
-		printf("%s  %s  %s", posbuf, hexbuf, textbuf);
-		if (!once && annotate) {
-			printf("  ");
+		if (!once) {
+			outbuf[outlen++] = ' ';
+			outbuf[outlen++] = ' ';
 			va_start(ap, fmt);
-			vprintf(fmt, ap);
+			secdb_dump_vprintf(fmt, ap);
 			va_end(ap);
 			once = true;
 		}
-		printf("\n");
-	}
+		*secdb_dump_reserve(1) = '\n';
+		outlen++;
+	} while (size - printed);
 
 	return offset + printed;
 }
@@ -175,21 +200,31 @@ secdb_dump_esl(efi_secdb_t *secdb, int esl, ssize_t offset)
 	return offset;
 }
 
+/*
+ * Nearly every signature in a database has the same owner, so the last
+ * owner's name is kept rather than looked up again for each one.
+ */
+static efi_guid_t owner_guid;
+static char *owner_id_guid;
+
 static inline ssize_t
-secdb_dump_esd(secdb_entry_t *entry, int esl, int esd, size_t data_size,
+secdb_dump_esd(efi_signature_data_t *sig, int esl, int esd, size_t data_size,
                ssize_t offset)
 {
-	char *id_guid = NULL;
-
-	efi_guid_to_id_guid(&entry->owner, &id_guid);
-	offset = secdb_dump_value((char *)&entry->owner,
+	if (annotate && (!owner_id_guid ||
+			 memcmp(&owner_guid, &sig->signature_owner,
+				sizeof(owner_guid)))) {
+		xfree(owner_id_guid);
+		efi_guid_to_id_guid(&sig->signature_owner, &owner_id_guid);
+		owner_guid = sig->signature_owner;
+	}
+	offset = secdb_dump_value((char *)&sig->signature_owner,
 				  sizeof(efi_guid_t), offset,
 				  "esl[%d].signature[%d].owner = %s",
-				  esl, esd, id_guid);
-	xfree(id_guid);
+				  esl, esd, owner_id_guid);
 	if (offset < 0)
 		return offset;
-	offset = secdb_dump_value((char *)&entry->data, data_size, offset,
+	offset = secdb_dump_value((char *)sig->signature_data, data_size, offset,
 				  "esl[%d].signature[%d].data (end:0x%08zx)",
 				  esl, esd, offset+data_size);
 	return offset;
@@ -199,11 +234,14 @@ void
 secdb_dump(efi_secdb_t *secdb, bool annotations)
 {
 	int esln = 0;
-	list_t *pos0, *pos1;
+	list_t *pos0;
 	ssize_t offset = 0;
 
-	start = offset;
 	annotate = annotations;
+	line_datasz = 0;
+	line_offset = offset;
+
+	efi_secdb_compact_(secdb);
 
 	for_each_secdb(pos0, &secdb->list) {
 		efi_secdb_t *esl;
@@ -216,28 +254,17 @@ secdb_dump(efi_secdb_t *secdb, bool annotations)
 		if (offset < 0)
 			break;
 
-		for_each_secdb_entry(pos1, &esl->entries) {
-			secdb_entry_t *esd;
-			bool has_owner = true;
-			size_t datasz = esl->sigsz;
-			int rc;
-
-			rc = secdb_entry_has_owner_from_type(esl->algorithm,
-							     &has_owner);
-			if (rc < 0) {
-				int saved_errno = errno;
-				secdb_dump_finish();
-				errno = saved_errno;
-				efi_error("could not determine signature type");
-				return;
-			}
-			if (has_owner)
-				datasz -= sizeof(efi_guid_t);
-
-			esd = list_entry(pos1, secdb_entry_t, list);
-			debug("esl[%d].esd[%d]:%p owner:%p data:%p-%p datasz:%zd",
-			      esln, esdn, esd, &esd->owner,
-			      &esd->data, &esd->data+datasz, datasz);
+		for (size_t n = 0; n < esl->nsigs; n++) {
+			efi_signature_data_t *esd = secdb_sig(esl, n);
+			size_t datasz = secdb_sig_datasz(esl);
+
+			/* a dbx has a lot of these; don't format them for
+			 * nobody */
+			if (efi_get_verbose() >= DEBUG_LEVEL)
+				debug("esl[%d].esd[%d]:%p owner:%p data:%p-%p datasz:%zd",
+				      esln, esdn, esd, &esd->signature_owner,
+				      esd->signature_data,
+				      esd->signature_data+datasz, datasz);
 			offset = secdb_dump_esd(esd, esln, esdn, datasz, offset);
 			esdn += 1;
 			if (offset < 0)
@@ -248,6 +275,8 @@ secdb_dump(efi_secdb_t *secdb, bool annotations)
 		esln += 1;
 	}
 	secdb_dump_finish();
+	secdb_dump_flush();
+	xfree(owner_id_guid);
 	printf("%08zx\n", offset);
 
 	fflush(stdout);
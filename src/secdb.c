@@ -7,6 +7,9 @@
 
 #include "efisec.h"
 #include "efivar/efisec-secdb.h"
+#include "trace.h"
+
+#include <pthread.h>
 
 /*
  * create a new in-memory signature list
@@ -21,7 +24,6 @@ efi_secdb_new(void)
 		return NULL;
 	}
 	INIT_LIST_HEAD(&secdb->list);
-	INIT_LIST_HEAD(&secdb->entries);
 
 	efi_secdb_set_bool(secdb, EFI_SECDB_SORT, true);
 	efi_secdb_set_bool(secdb, EFI_SECDB_SORT_DATA, false);
@@ -30,6 +32,33 @@ efi_secdb_new(void)
 	return secdb;
 }
 
+/*
+ * Forget an empty sublist's signature array.  It's sized for sigsz, and
+ * the sublist may be reused for signatures of some other size.
+ */
+static inline void
+secdb_drop_sigs(efi_secdb_t *secdb)
+{
+	if (!secdb->borrowed)
+		xfree(secdb->sigs);
+	secdb->sigs = NULL;
+	secdb->borrowed = false;
+	secdb->sigs_used = 0;
+	secdb->sigs_allocated = 0;
+	xfree(secdb->deleted);
+}
+
+/*
+ * An empty sublist takes on whatever size of signature goes in it next.
+ */
+static inline void
+secdb_set_sigsz(efi_secdb_t *secdb, size_t sigsz)
+{
+	if (secdb->sigsz != sigsz)
+		secdb_drop_sigs(secdb);
+	secdb->sigsz = sigsz;
+}
+
 /*
  * find the secdb entry for a given size and algorithm, or return NULL and set
  * errno to ENOENT if there aren't any.
@@ -45,10 +74,14 @@ find_secdb_entry(efi_secdb_t *top, efi_secdb_type_t algorithm, size_t datasz)
 	if (algorithm != X509_CERT)
 		sigsz = secdb_entry_size_from_type(algorithm);
 
-	efi_guid_to_id_guid(secdb_guid_from_type(algorithm), &algstr);
-	debug("searching for entry with type:%s sz:%zd(0x%zx) datasz:%zd(0x%zx)",
-	      algstr, sigsz, sigsz, datasz, datasz);
-	xfree(algstr);
+	/* this gets called for every entry we add, so don't format the guid
+	 * just to throw it away */
+	if (efi_get_verbose() >= DEBUG_LEVEL) {
+		efi_guid_to_id_guid(secdb_guid_from_type(algorithm), &algstr);
+		debug("searching for entry with type:%s sz:%zd(0x%zx) datasz:%zd(0x%zx)",
+		      algstr, sigsz, sigsz, datasz, datasz);
+		xfree(algstr);
+	}
 
 	for_each_secdb_prev(pos, &top->list) {
 		efi_secdb_t *candidate = list_entry(pos, efi_secdb_t, list);
@@ -83,7 +116,6 @@ alloc_secdb_entry(efi_secdb_t *top,
 	if (!secdb)
 		return NULL;
 
-	INIT_LIST_HEAD(&secdb->entries);
 	INIT_LIST_HEAD(&secdb->list);
 	secdb->algorithm = algorithm;
 	secdb->hdrsz = secdb_header_size_from_type(algorithm);
@@ -119,12 +151,507 @@ find_or_alloc_secdb_entry(efi_secdb_t *top,
 		if (!secdb)
 			return NULL;
 	}
-	secdb->algorithm = algorithm;
-	secdb->sigsz = sigsz;
+	if (secdb->nsigs == 0) {
+		secdb->algorithm = algorithm;
+		secdb_set_sigsz(secdb, sigsz);
+	}
 
 	return secdb;
 }
 
+/*
+ * Each sublist keeps its signatures hashed by data, since a dbx with tens
+ * of thousands of hashes in it makes walking the sublist on every add and
+ * delete quadratic.  Lookups the index can't answer (a shorter comparison
+ * than the whole signature, or a sublist we couldn't allocate an index
+ * for) walk the array the way they always did.
+ */
+#define SECDB_INDEX_MIN_SLOTS	64
+#define SECDB_INDEX_TOMBSTONE	SIZE_MAX
+#define SECDB_MIN_SIGS		16
+
+static inline bool
+secdb_sig_deleted(efi_secdb_t *secdb, size_t n)
+{
+	return secdb->deleted && (secdb->deleted[n / 8] & (1u << (n % 8)));
+}
+
+static inline size_t
+secdb_index_first_slot(efi_secdb_t *secdb, size_t nslots, const void *data)
+{
+	return efivar_guidname_hash_key(data, secdb_sig_datasz(secdb), 0)
+	       & (nslots - 1);
+}
+
+static void
+secdb_index_place(efi_secdb_t *secdb, size_t *slots, size_t nslots,
+		  size_t n)
+{
+	size_t slot = secdb_index_first_slot(secdb, nslots,
+					     secdb_sig(secdb, n)->signature_data);
+
+	while (slots[slot])
+		slot = (slot + 1) & (nslots - 1);
+	slots[slot] = n + 1;
+}
+
+/*
+ * Build the table over from the array, big enough to stay under half full
+ * with one more signature in it.  If we can't, there's no index, and
+ * lookups walk the array.
+ */
+static void
+secdb_index_rebuild(efi_secdb_t *secdb)
+{
+	struct secdb_index *index = &secdb->index;
+	size_t nslots = SECDB_INDEX_MIN_SLOTS;
+
+	xfree(index->slots);
+	index->nslots = 0;
+	index->nused = 0;
+
+	while (nslots < (secdb->nsigs + 1) * 4)
+		nslots <<= 1;
+	index->slots = calloc(nslots, sizeof(*index->slots));
+	if (!index->slots)
+		return;
+	index->nslots = nslots;
+
+	for (size_t n = 0; n < secdb->sigs_used; n++) {
+		if (secdb_sig_deleted(secdb, n))
+			continue;
+		secdb_index_place(secdb, index->slots, nslots, n);
+		index->nused += 1;
+	}
+}
+
+static void
+secdb_index_add(efi_secdb_t *secdb, size_t n)
+{
+	struct secdb_index *index = &secdb->index;
+
+	if ((index->nused + 1) * 2 > index->nslots) {
+		/* this puts n in too */
+		secdb_index_rebuild(secdb);
+		return;
+	}
+
+	secdb_index_place(secdb, index->slots, index->nslots, n);
+	index->nused += 1;
+}
+
+static void
+secdb_index_del(efi_secdb_t *secdb, size_t n)
+{
+	struct secdb_index *index = &secdb->index;
+	size_t slot;
+
+	if (!index->slots)
+		return;
+
+	slot = secdb_index_first_slot(secdb, index->nslots,
+				      secdb_sig(secdb, n)->signature_data);
+	while (index->slots[slot]) {
+		if (index->slots[slot] == n + 1) {
+			index->slots[slot] = SECDB_INDEX_TOMBSTONE;
+			return;
+		}
+		slot = (slot + 1) & (index->nslots - 1);
+	}
+}
+
+static inline bool
+secdb_sig_matches(efi_secdb_t *secdb, size_t n, const efi_secdb_data_t *data,
+		  size_t cmpsz, const efi_guid_t *owner)
+{
+	efi_signature_data_t *sig = secdb_sig(secdb, n);
+
+	return !memcmp(data, sig->signature_data, cmpsz) &&
+	       (!owner || !efi_guid_cmp(owner, &sig->signature_owner));
+}
+
+/*
+ * find the signature whose first cmpsz bytes of data match data, and whose
+ * owner matches owner if there is one.  Returns its number, or -1.
+ */
+static ssize_t
+secdb_find_data(efi_secdb_t *secdb, const efi_secdb_data_t *data,
+		size_t cmpsz, const efi_guid_t *owner)
+{
+	struct secdb_index *index = &secdb->index;
+
+	if (cmpsz > secdb_sig_datasz(secdb))
+		return -1;
+
+	if (index->slots && cmpsz == secdb_sig_datasz(secdb)) {
+		size_t slot = secdb_index_first_slot(secdb, index->nslots,
+						     data);
+
+		while (index->slots[slot]) {
+			size_t n = index->slots[slot] - 1;
+
+			if (index->slots[slot] != SECDB_INDEX_TOMBSTONE &&
+			    secdb_sig_matches(secdb, n, data, cmpsz, owner))
+				return n;
+			slot = (slot + 1) & (index->nslots - 1);
+		}
+		return -1;
+	}
+
+	for (size_t n = 0; n < secdb->sigs_used; n++) {
+		if (!secdb_sig_deleted(secdb, n) &&
+		    secdb_sig_matches(secdb, n, data, cmpsz, owner))
+			return n;
+	}
+	return -1;
+}
+
+/*
+ * Sublists from efi_secdb_parse_view() point into the caller's buffer, so
+ * they get their own copy before anything changes them.
+ */
+static int
+secdb_own_sigs(efi_secdb_t *secdb)
+{
+	uint8_t *sigs;
+	size_t allocsz;
+
+	if (!secdb->borrowed)
+		return 0;
+
+	allocsz = secdb->sigs_used * secdb->sigsz;
+	sigs = malloc(allocsz ? allocsz : 1);
+	if (!sigs) {
+		efi_error("could not allocate %zd bytes", allocsz);
+		return -1;
+	}
+	memcpy(sigs, secdb->sigs, allocsz);
+	secdb->sigs = sigs;
+	secdb->sigs_allocated = secdb->sigs_used;
+	secdb->borrowed = false;
+	return 0;
+}
+
+typedef int (secdb_sig_cmp_t)(const void *, const void *);
+
+/*
+ * Compare sz bytes the way memcmp() would, but eight at a time as
+ * big-endian words, so that a sha256 is four compares instead of up to
+ * 32.  When sz is a constant the compiler unrolls all of it.
+ */
+static inline int
+bytecmp(const void *ap, const void *bp, size_t sz)
+{
+	const uint8_t *a = (const uint8_t *)ap;
+	const uint8_t *b = (const uint8_t *)bp;
+	size_t i;
+
+	for (i = 0; i + sizeof(uint64_t) <= sz; i += sizeof(uint64_t)) {
+		uint64_t wa, wb;
+
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		if (wa != wb)
+			return be64_to_cpu(wa) < be64_to_cpu(wb) ? -1 : 1;
+	}
+	for (; i < sz; i++) {
+		if (a[i] != b[i])
+			return a[i] - b[i];
+	}
+	return 0;
+}
+
+static inline int
+secdb_entry_cmp_sz(const void *ap, const void *bp, size_t datasz)
+{
+	const efi_signature_data_t *a = ap;
+	const efi_signature_data_t *b = bp;
+	int rc;
+
+	rc = efi_guid_cmp_(&a->signature_owner, &b->signature_owner);
+	if (rc != 0)
+		return rc;
+
+	return bytecmp(a->signature_data, b->signature_data, datasz);
+}
+
+/*
+ * compare secdb_entry_t items
+ */
+int
+secdb_entry_cmp(const void *ap, const void *bp)
+{
+	return secdb_entry_cmp_sz(ap, bp, *(size_t *)list_sort_state);
+}
+
+int
+secdb_entry_cmp_descending(const void *ap, const void *bp)
+{
+	return secdb_entry_cmp(bp, ap);
+}
+
+/*
+ * Comparators for the data sizes our hash and x509 hash types actually
+ * use, with the size built in.
+ */
+#define define_secdb_entry_cmp(sz)					\
+	static int							\
+	secdb_entry_cmp_##sz(const void *ap, const void *bp)		\
+	{								\
+		return secdb_entry_cmp_sz(ap, bp, sz);			\
+	}								\
+	static int							\
+	secdb_entry_cmp_descending_##sz(const void *ap, const void *bp)\
+	{								\
+		return secdb_entry_cmp_sz(bp, ap, sz);			\
+	}
+
+define_secdb_entry_cmp(20)
+define_secdb_entry_cmp(28)
+define_secdb_entry_cmp(32)
+define_secdb_entry_cmp(48)
+define_secdb_entry_cmp(64)
+define_secdb_entry_cmp(80)
+
+#define secdb_entry_cmp_entry(sz)					\
+	{ sz, secdb_entry_cmp_##sz, secdb_entry_cmp_descending_##sz }
+
+static const struct {
+	size_t datasz;
+	secdb_sig_cmp_t *cmp;
+	secdb_sig_cmp_t *cmp_descending;
+} secdb_entry_cmps[] = {
+	secdb_entry_cmp_entry(20),	/* sha1 */
+	secdb_entry_cmp_entry(28),	/* sha224 */
+	secdb_entry_cmp_entry(32),	/* sha256 */
+	secdb_entry_cmp_entry(48),	/* sha384, x509_sha256 */
+	secdb_entry_cmp_entry(64),	/* sha512, x509_sha384 */
+	secdb_entry_cmp_entry(80),	/* x509_sha512 */
+};
+
+/*
+ * Pick the comparator for signatures with datasz bytes of data.  The
+ * generic one needs list_sort_state pointed at the size.
+ */
+static secdb_sig_cmp_t *
+secdb_entry_cmp_for(size_t datasz, bool descending)
+{
+	size_t n = sizeof(secdb_entry_cmps) / sizeof(secdb_entry_cmps[0]);
+
+	for (size_t i = 0; i < n; i++) {
+		if (secdb_entry_cmps[i].datasz == datasz)
+			return descending ? secdb_entry_cmps[i].cmp_descending
+					  : secdb_entry_cmps[i].cmp;
+	}
+	return descending ? secdb_entry_cmp_descending : secdb_entry_cmp;
+}
+
+/*
+ * Sorting is most of what efisecdb --sort spends its time on for a big
+ * dbx.  Signatures usually show up as a few lists that are each sorted
+ * already, so first we look for the runs the array is already in order
+ * in, and if there aren't many, just merge them.  Otherwise, big arrays
+ * get cut into a shard per CPU, each shard is sorted on its own thread,
+ * and the shards are merged.
+ */
+#define SECDB_MAX_MERGE_RUNS	64
+#define SECDB_PARALLEL_SORT_MIN	32768
+#define SECDB_MAX_SORT_THREADS	8
+
+struct secdb_sort_shard {
+	uint8_t *base;
+	size_t nmemb;
+	size_t size;
+	secdb_sig_cmp_t *cmp;
+};
+
+static void *
+secdb_sort_shard(void *arg)
+{
+	struct secdb_sort_shard *shard = arg;
+
+	qsort(shard->base, shard->nmemb, shard->size, shard->cmp);
+	return NULL;
+}
+
+/*
+ * Merge the sorted runs of sigs that start at runs[0..nruns-1], where
+ * runs[nruns] is the end of the array, till there's only one.
+ */
+static int
+secdb_merge_runs(uint8_t *sigs, size_t size, size_t *runs, size_t nruns,
+		 secdb_sig_cmp_t *cmp)
+{
+	uint8_t *src = sigs, *dst, *tmp, *swap;
+	size_t nmemb = runs[nruns];
+
+	tmp = dst = malloc(nmemb * size);
+	if (!dst)
+		return -1;
+
+	while (nruns > 1) {
+		size_t i, j;
+
+		for (i = 0, j = 0; i < nruns; i += 2, j++) {
+			uint8_t *a = src + runs[i] * size;
+			uint8_t *out = dst + runs[i] * size;
+			uint8_t *aend, *b, *bend;
+
+			if (i + 1 == nruns) {
+				memcpy(out, a, (runs[i + 1] - runs[i]) * size);
+				runs[j] = runs[i];
+				continue;
+			}
+
+			aend = b = src + runs[i + 1] * size;
+			bend = src + runs[i + 2] * size;
+			while (a < aend && b < bend) {
+				if (cmp(b, a) < 0) {
+					memcpy(out, b, size);
+					b += size;
+				} else {
+					memcpy(out, a, size);
+					a += size;
+				}
+				out += size;
+			}
+			memcpy(out, a, aend - a);
+			out += aend - a;
+			memcpy(out, b, bend - b);
+			runs[j] = runs[i];
+		}
+		runs[j] = nmemb;
+		nruns = j;
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != sigs)
+		memcpy(sigs, src, nmemb * size);
+	free(tmp);
+	return 0;
+}
+
+static void
+secdb_sort_sigs(efi_secdb_t *secdb, secdb_sig_cmp_t *cmp)
+{
+	struct secdb_sort_shard shards[SECDB_MAX_SORT_THREADS];
+	pthread_t threads[SECDB_MAX_SORT_THREADS];
+	bool started[SECDB_MAX_SORT_THREADS] = { false, };
+	size_t runs[SECDB_MAX_MERGE_RUNS + 2];
+	size_t nmemb = secdb->nsigs, size = secdb->sigsz;
+	size_t nruns = 1;
+	long nthreads;
+
+	runs[0] = 0;
+	for (size_t n = 1; n < nmemb; n++) {
+		if (cmp(secdb_sig(secdb, n - 1), secdb_sig(secdb, n)) <= 0)
+			continue;
+		if (nruns == SECDB_MAX_MERGE_RUNS) {
+			nruns += 1;
+			break;
+		}
+		runs[nruns++] = n;
+	}
+	if (nruns == 1) {
+		debug("secdb:%p is already sorted", secdb);
+		return;
+	}
+	if (nruns <= SECDB_MAX_MERGE_RUNS) {
+		debug("merging %zd sorted runs in secdb:%p", nruns, secdb);
+		runs[nruns] = nmemb;
+		if (secdb_merge_runs(secdb->sigs, size, runs, nruns, cmp) == 0)
+			return;
+	}
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > SECDB_MAX_SORT_THREADS)
+		nthreads = SECDB_MAX_SORT_THREADS;
+	if (nmemb < SECDB_PARALLEL_SORT_MIN || nthreads < 2) {
+		qsort(secdb->sigs, nmemb, size, cmp);
+		return;
+	}
+
+	debug("sorting secdb:%p in %ld shards", secdb, nthreads);
+	for (long i = 0; i < nthreads; i++) {
+		runs[i] = nmemb * i / nthreads;
+		shards[i].base = secdb->sigs + runs[i] * size;
+		shards[i].nmemb = nmemb * (i + 1) / nthreads - runs[i];
+		shards[i].size = size;
+		shards[i].cmp = cmp;
+		/* the last one's ours */
+		if (i + 1 < nthreads)
+			started[i] = pthread_create(&threads[i], NULL,
+						    secdb_sort_shard,
+						    &shards[i]) == 0;
+	}
+	runs[nthreads] = nmemb;
+
+	for (long i = 0; i < nthreads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			secdb_sort_shard(&shards[i]);
+	}
+
+	if (secdb_merge_runs(secdb->sigs, size, runs, nthreads, cmp) < 0)
+		qsort(secdb->sigs, nmemb, size, cmp);
+}
+
+/*
+ * Squeeze the deleted signatures out of the array, sort it if it's been
+ * added to, and index what's left.
+ */
+static void
+secdb_compact(efi_secdb_t *secdb)
+{
+	bool sort_data = secdb->flags & (1ul << EFI_SECDB_SORT_DATA);
+	bool sort_descending = secdb->flags & (1ul << EFI_SECDB_SORT_DESCENDING);
+	bool reindex = false;
+
+	if (secdb->deleted) {
+		size_t used = 0;
+
+		for (size_t n = 0; n < secdb->sigs_used; n++) {
+			if (secdb_sig_deleted(secdb, n))
+				continue;
+			if (used != n)
+				memcpy(secdb_sig(secdb, used),
+				       secdb_sig(secdb, n), secdb->sigsz);
+			used += 1;
+		}
+		secdb->sigs_used = used;
+		xfree(secdb->deleted);
+		reindex = true;
+	}
+
+	if (secdb->unsorted && sort_data && secdb->nsigs > 1 &&
+	    secdb_own_sigs(secdb) == 0) {
+		size_t datasz = secdb_sig_datasz(secdb);
+
+		debug("sorting data %s", sort_descending ? "desc" : "asc");
+		list_sort_state = &datasz;
+		secdb_sort_sigs(secdb, secdb_entry_cmp_for(datasz,
+							   sort_descending));
+		reindex = true;
+	}
+	secdb->unsorted = false;
+
+	if (reindex)
+		secdb_index_rebuild(secdb);
+}
+
+void PUBLIC
+efi_secdb_compact_(efi_secdb_t *top)
+{
+	list_t *pos;
+
+	for_each_secdb(pos, &top->list)
+		secdb_compact(list_entry(pos, efi_secdb_t, list));
+}
+
 /*
  * delete an entry from our internal representation
  */
@@ -137,15 +664,18 @@ efi_secdb_del_entry(efi_secdb_t *top,
 {
 	efi_secdb_t *secdb;
 	list_t *pos;
-	size_t sigsz = datasz;
+	ssize_t n;
+	size_t listsigsz = datasz + sizeof(efi_guid_t);
+	size_t sigsz;
 	bool has_owner = false;
 
 	if (algorithm != X509_CERT)
-		sigsz = secdb_entry_size_from_type(algorithm);
+		listsigsz = secdb_entry_size_from_type(algorithm);
 
 	if (secdb_entry_has_owner_from_type(algorithm, &has_owner) < 0)
 		return -1;
 
+	sigsz = listsigsz;
 	if (has_owner)
 		sigsz -= sizeof(efi_guid_t);
 
@@ -153,22 +683,59 @@ efi_secdb_del_entry(efi_secdb_t *top,
 		errno = EINVAL;
 		return -1;
 	}
+	secdb_certs_free(top);
+
+	/*
+	 * Every X509_CERT gets a list of its own, so the signature can be in
+	 * any of the lists of this type and size, not just the last one.
+	 */
+	secdb = NULL;
+	n = -1;
+	for_each_secdb_prev(pos, &top->list) {
+		efi_secdb_t *candidate = list_entry(pos, efi_secdb_t, list);
 
-	secdb = find_secdb_entry(top, algorithm, datasz);
-	if (!secdb)
-		return -1;
+		if (candidate->algorithm != algorithm ||
+		    candidate->sigsz != listsigsz)
+			continue;
+		n = secdb_find_data(candidate, data, sigsz,
+				    has_owner ? owner : NULL);
+		if (n >= 0) {
+			secdb = candidate;
+			break;
+		}
+	}
+	if (n < 0)
+		return 0;
 
-	for_each_secdb_entry(pos, &secdb->entries) {
-		secdb_entry_t *entry = list_entry(pos, secdb_entry_t, list);
+	debug("deleting signature %zd from secdb:%p", n, secdb);
+	secdb->nsigs -= 1;
+	secdb->listsz = secdb_entry_size(secdb);
+	if (secdb->nsigs == 0) {
+		secdb_drop_sigs(secdb);
+		secdb_index_rebuild(secdb);
+		return 0;
+	}
 
-		if (!memcmp(data, &entry->data, sigsz) &&
-		    (!has_owner || !efi_guid_cmp(owner, &entry->owner))) {
-			debug("deleting entry at %p\n", &entry);
-			list_del(&entry->list);
-			free(entry);
-			break;
+	if (secdb_own_sigs(secdb) < 0)
+		return -1;
+
+	if (!secdb->deleted) {
+		secdb->deleted = calloc(1, (secdb->sigs_allocated + 7) / 8);
+		if (!secdb->deleted) {
+			/* do it the slow way */
+			memmove(secdb_sig(secdb, n), secdb_sig(secdb, n + 1),
+				(secdb->sigs_used - n - 1) * secdb->sigsz);
+			secdb->sigs_used -= 1;
+			secdb_index_rebuild(secdb);
+			return 0;
 		}
 	}
+	secdb_index_del(secdb, n);
+	secdb->deleted[n / 8] |= 1u << (n % 8);
+
+	/* don't let the array fill up with dead signatures */
+	if (secdb->sigs_used > secdb->nsigs * 2)
+		secdb_compact(secdb);
 
 	return 0;
 }
@@ -178,35 +745,56 @@ secdb_add_entry_data(efi_secdb_t *secdb,
 		     const efi_guid_t * const owner,
 		     efi_secdb_data_t *data, uint32_t datasz)
 {
-	secdb_entry_t *new;
-	size_t allocsz;
+	efi_signature_data_t *sig;
 
-	if (!secdb || !owner || !data || !datasz) {
+	if (!secdb || !owner || !data || !datasz ||
+	    datasz != secdb_sig_datasz(secdb)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	allocsz = offsetof(secdb_entry_t, data) + datasz;
-	new = calloc(1, allocsz);
-	if (!new)
+	if (secdb_own_sigs(secdb) < 0)
 		return -1;
 
-	INIT_LIST_HEAD(&new->list);
-	memcpy(&new->data, data, datasz);
-	memcpy(&new->owner, owner, sizeof(efi_guid_t));
-	debug("Adding to secdb:%p entry:%p owner:%p data:%p datasz:%"PRIu32"(0x%"PRIx32")",
-	      secdb, new, &new->owner, &new->data, datasz, datasz);
-	list_add_tail(&new->list, &secdb->entries);
+	if (secdb->sigs_used == secdb->sigs_allocated) {
+		size_t n = secdb->sigs_allocated ? secdb->sigs_allocated * 2
+						 : SECDB_MIN_SIGS;
+		size_t allocsz;
+		uint8_t *sigs;
+
+		if (MUL(n, secdb->sigsz, &allocsz)) {
+			errno = EOVERFLOW;
+			return -1;
+		}
+		sigs = realloc(secdb->sigs, allocsz);
+		if (!sigs)
+			return -1;
+		secdb->sigs = sigs;
+
+		if (secdb->deleted) {
+			uint8_t *deleted;
+			size_t oldsz = (secdb->sigs_allocated + 7) / 8;
+
+			deleted = realloc(secdb->deleted, (n + 7) / 8);
+			if (!deleted)
+				return -1;
+			memset(deleted + oldsz, 0, (n + 7) / 8 - oldsz);
+			secdb->deleted = deleted;
+		}
+		secdb->sigs_allocated = n;
+	}
+
+	sig = secdb_sig(secdb, secdb->sigs_used);
+	memcpy(&sig->signature_owner, owner, sizeof(efi_guid_t));
+	memcpy(sig->signature_data, data, datasz);
+	debug("Adding to secdb:%p signature[%zd]:%p owner:%p data:%p datasz:%"PRIu32"(0x%"PRIx32")",
+	      secdb, secdb->sigs_used, sig, &sig->signature_owner,
+	      sig->signature_data, datasz, datasz);
+	secdb->sigs_used += 1;
 	debug("nsigs:%zd -> %zd", secdb->nsigs, secdb->nsigs+1);
 	secdb->nsigs += 1;
-	if (secdb->nsigs == 1 &&
-	    secdb->algorithm == X509_CERT &&
-	    secdb->sigsz == sizeof(efi_guid_t)) {
-		debug("secdb->sigsz:%"PRIu32"(0x%"PRIx32") -> %"PRIu32"(0x%"PRIx32") datasz:%"PRIu32"(0x%"PRIx32")",
-		      secdb->sigsz, secdb->sigsz, secdb->sigsz + datasz,
-		      secdb->sigsz + datasz, datasz, datasz);
-		secdb->sigsz += datasz;
-	}
+	secdb->unsorted = true;
+	secdb_index_add(secdb, secdb->sigs_used - 1);
 
 	secdb->listsz = secdb_entry_size(secdb);
 
@@ -221,12 +809,10 @@ efi_secdb_add_entry_or_secdb(efi_secdb_t *top,
 			     size_t datasz,
 			     bool force_new_secdb)
 {
-	list_t *pos;
 	efi_secdb_t *secdb = NULL;
 	bool has_owner = false;
 	size_t sigsz;
 	bool sort = false;
-	bool sort_data = false;
 	bool sort_descending = false;
 	int (*cmp)(const void *, const void *);
 
@@ -235,43 +821,45 @@ efi_secdb_add_entry_or_secdb(efi_secdb_t *top,
 		efi_error("invalid efi_secdb_t %p", top);
 		return -1;
 	}
+	secdb_certs_free(top);
 
 	if (secdb_entry_has_owner_from_type(algorithm, &has_owner) < 0)
 		return -1;
 
 	sigsz = datasz + (has_owner ? sizeof(*owner) : 0);
 
+	if (!force_new_secdb) {
+		debug("finding secdb alg:%d datasz:%zd(0x%zx) sigsz:%zd(0x%zx) has_owner:%d",
+		      algorithm, datasz, datasz, sigsz, sigsz, has_owner);
+		secdb = find_or_alloc_secdb_entry(top, algorithm, sigsz);
+		if (!secdb)
+			return -1;
+		/*
+		 * a sublist's signatures are all one size, so something
+		 * that doesn't match the algorithm's size can't go in it
+		 */
+		if (secdb->nsigs == 0)
+			secdb_set_sigsz(secdb, sigsz);
+		else if (secdb->sigsz != sigsz)
+			force_new_secdb = true;
+	}
 	if (force_new_secdb) {
 		debug("forcing new secdb entry (has_owner:%d)", has_owner);
 		secdb = alloc_secdb_entry(top, algorithm, sigsz);
+		if (!secdb)
+			return -1;
 		secdb->algorithm = algorithm;
 		secdb->sigsz = sigsz;
-	} else {
-		debug("finding secdb alg:%d datasz:%zd(0x%zx) sigsz:%zd(0x%zx) has_owner:%d",
-		      algorithm, datasz, datasz, sigsz, sigsz, has_owner);
-		secdb = find_or_alloc_secdb_entry(top, algorithm, sigsz);
 	}
-	if (!secdb)
-		return -1;
 
 	sort = secdb->flags & (1ul << EFI_SECDB_SORT);
-	sort_data = secdb->flags & (1ul << EFI_SECDB_SORT_DATA);
 	sort_descending = secdb->flags & (1ul << EFI_SECDB_SORT_DESCENDING);
 
-	for_each_secdb_entry(pos, &secdb->entries) {
-		secdb_entry_t *entry = list_entry(pos, secdb_entry_t, list);
-		if (!memcmp(data, &entry->data, datasz))
-			return 0;
-	}
+	if (secdb_find_data(secdb, data, datasz, NULL) >= 0)
+		return 0;
 
 	debug("adding %zd(0x%zd) bytes of data", datasz, datasz);
 	secdb_add_entry_data(secdb, owner, data, datasz);
-	if (sort_data && secdb->sigsz) {
-		debug("sorting data %s", sort_descending ? "desc" : "asc");
-		cmp = sort_descending ? secdb_entry_cmp_descending
-				      : secdb_entry_cmp;
-		list_sort(&secdb->entries, cmp, &datasz);
-	}
 	if (sort) {
 		debug("sorting lists %s", sort_descending ? "desc" : "asc");
 		cmp = sort_descending ? secdb_cmp_descending
@@ -320,51 +908,29 @@ efi_secdb_set_bool(efi_secdb_t *secdb, efi_secdb_flag_t flag, bool value)
 }
 
 /*
- * parse a signature list file into our internal representation
+ * add everything iter has to *secdbp, making it if it's NULL
  */
-PUBLIC int
-efi_secdb_parse(uint8_t *data, size_t datasz, efi_secdb_t **secdbp)
+static int
+secdb_parse_iter_(esl_iter *iter, efi_secdb_t **secdbp)
 {
-	esl_iter *iter = NULL;
 	int rc;
 	efi_secdb_t *secdb;
 	bool new_secdb = false;
 	bool sort = false;
 	bool sort_descending = true;
 
-	if (!data || !datasz) {
-		efi_error("Invalid secdb data (data=%p datasz=%zd(0x%zx))",
-			  data, datasz, datasz);
-		errno = EINVAL;
-		return -1;
-	}
-
-	if (!secdbp) {
-		efi_error("Invalid secdb pointer");
-		errno = EINVAL;
-		return -1;
-	}
-
 	secdb = *secdbp;
 	if (!secdb) {
 		secdb = efi_secdb_new();
-		if (!secdb)
+		if (!secdb) {
+			esl_iter_end(iter);
 			return -1;
+		}
 		new_secdb = true;
 	}
 	sort = secdb->flags & (1ul << EFI_SECDB_SORT);
 	sort_descending = secdb->flags & (1ul << EFI_SECDB_SORT_DESCENDING);
 
-	debug("adding %zd(0x%zx) bytes to secdb %p", datasz, datasz, secdb);
-
-	rc = esl_iter_new(&iter, data, datasz);
-	if (rc < 0) {
-		efi_error("Could not iterate security database");
-		if (new_secdb)
-			efi_secdb_free(secdb);
-		return rc;
-	}
-
 	do {
 		uint8_t *sig = NULL;
 		size_t sigsz = 0;
@@ -388,8 +954,8 @@ efi_secdb_parse(uint8_t *data, size_t datasz, efi_secdb_t **secdbp)
 		if (rc < 0) {
 			efi_error("Could not get next security database entry");
 			esl_iter_end(iter);
-			if (new_secdb)
-				free(secdb);
+			if (!*secdbp)
+				efi_secdb_free(secdb);
 			return rc;
 		}
 		if (rc == ESL_ITER_DONE)
@@ -436,116 +1002,442 @@ efi_secdb_parse(uint8_t *data, size_t datasz, efi_secdb_t **secdbp)
 	return 0;
 }
 
-struct visitor_state {
-	/* listnum from the previous invocation */
-	unsigned int listnum;
+static int
+secdb_parse_iter(esl_iter *iter, efi_secdb_t **secdbp)
+{
+	int rc;
 
-	efi_signature_list_t *esl;
+	tracepoint(libefisec, secdb_parse_entry, *secdbp);
+	rc = secdb_parse_iter_(iter, secdbp);
+	tracepoint(libefisec, secdb_parse_return, rc, *secdbp);
+	return rc;
+}
 
-	char *buf;
-	size_t pos;
-};
+/*
+ * parse a signature list file into our internal representation
+ */
+PUBLIC int
+efi_secdb_parse(uint8_t *data, size_t datasz, efi_secdb_t **secdbp)
+{
+	esl_iter *iter = NULL;
+	int rc;
+
+	if (!data || !datasz) {
+		efi_error("Invalid secdb data (data=%p datasz=%zd(0x%zx))",
+			  data, datasz, datasz);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!secdbp) {
+		efi_error("Invalid secdb pointer");
+		errno = EINVAL;
+		return -1;
+	}
+
+	debug("adding %zd(0x%zx) bytes to secdb %p", datasz, datasz, *secdbp);
+
+	rc = esl_iter_new(&iter, data, datasz);
+	if (rc < 0) {
+		efi_error("Could not iterate security database");
+		return rc;
+	}
+
+	return secdb_parse_iter(iter, secdbp);
+}
 
 /*
- * realize a signature list file from our internal representation into
+ * parse a signature list file into our internal representation, reading
+ * it from fd a signature at a time
  */
-static efi_secdb_visitor_status_t
-secdb_realize_visitor(unsigned int listnum,
-		      unsigned int signum,
-		      const efi_guid_t * const owner,
-		      const efi_secdb_type_t algorithm,
-		      const void * const header,
-		      const size_t headersz,
-		      const efi_secdb_data_t * const data,
-		      const size_t datasz,
-		      void *closure)
-{
-	struct visitor_state *state = closure;
-	const efi_guid_t *alg = secdb_guid_from_type(algorithm);
-	char *buf;
-	size_t allocsz, esdsz;
-	ptrdiff_t skew;
-	efi_signature_list_t *esl;
-	efi_signature_data_t *esd;
-	bool has_owner = true;
+PUBLIC int
+efi_secdb_parse_fd(int fd, efi_secdb_t **secdbp)
+{
+	esl_iter *iter = NULL;
 	int rc;
 
-	rc = secdb_entry_has_owner_from_type(algorithm, &has_owner);
-	if (rc < 0)
-		efi_error("could not determine signature type");
+	if (!secdbp) {
+		efi_error("Invalid secdb pointer");
+		errno = EINVAL;
+		return -1;
+	}
 
-	esdsz = datasz + (has_owner ? sizeof(efi_guid_t) : 0);
+	debug("adding fd %d to secdb %p", fd, *secdbp);
 
-	debug("listnum:%d signum:%d has_owner:%d", listnum, signum, has_owner);
-	if (listnum > state->listnum || signum == 0) {
-		allocsz = state->pos + sizeof(state->esl) + headersz + esdsz;
-		allocsz = ALIGN_UP(allocsz, page_size);
-		buf = realloc(state->buf, allocsz);
-		if (!buf) {
-			efi_error("could not allocate %zd bytes", allocsz);
-			return ERROR;
+	rc = esl_iter_new_fd(&iter, fd);
+	if (rc < 0) {
+		efi_error("Could not iterate security database");
+		return rc;
+	}
+
+	return secdb_parse_iter(iter, secdbp);
+}
+
+/*
+ * parse a signature list file into our internal representation without
+ * copying any of it
+ */
+static int
+secdb_parse_view(const uint8_t *data, size_t datasz, efi_secdb_t **secdbp)
+{
+	static const efi_signature_list_t zero_esl;
+	efi_secdb_t *top;
+	bool new_secdb = false;
+	bool sort, sort_data, sort_descending;
+	size_t offset = 0;
+
+	if (!data || !datasz || !secdbp) {
+		efi_error("Invalid secdb data (data=%p datasz=%zd(0x%zx) secdbp=%p)",
+			  data, datasz, datasz, secdbp);
+		errno = EINVAL;
+		return -1;
+	}
+
+	top = *secdbp;
+	if (!top) {
+		top = efi_secdb_new();
+		if (!top)
+			return -1;
+		new_secdb = true;
+	}
+	secdb_certs_free(top);
+	sort = top->flags & (1ul << EFI_SECDB_SORT);
+	sort_data = top->flags & (1ul << EFI_SECDB_SORT_DATA);
+	sort_descending = top->flags & (1ul << EFI_SECDB_SORT_DESCENDING);
+
+	while (datasz - offset >= sizeof(efi_signature_list_t)) {
+		const efi_signature_list_t *esl;
+		efi_secdb_type_t secdb_type;
+		efi_secdb_t *secdb;
+		size_t hdrsz, sigsz, nsigs, listsz;
+
+		esl = (const efi_signature_list_t *)(data + offset);
+		/* a buffer bigger than its lists is zero-filled at the end */
+		if (!memcmp(esl, &zero_esl, sizeof(zero_esl)))
+			break;
+
+		listsz = esl->signature_list_size;
+		hdrsz = sizeof(*esl) + esl->signature_header_size;
+		sigsz = esl->signature_size;
+		if (listsz > datasz - offset || listsz < hdrsz ||
+		    sigsz <= sizeof(efi_guid_t) ||
+		    (listsz - hdrsz) % sigsz != 0) {
+			efi_error("EFI_SIGNATURE_LIST at 0x%zx is malformed",
+				  offset);
+			if (new_secdb)
+				efi_secdb_free(top);
+			errno = EOVERFLOW;
+			return -1;
+		}
+		nsigs = (listsz - hdrsz) / sigsz;
+
+		secdb_type = secdb_entry_type_from_guid(&esl->signature_type);
+		if (secdb_type < 0 || nsigs == 0) {
+			debug("skipping ESL at 0x%zx (type:%d nsigs:%zd)",
+			      offset, secdb_type, nsigs);
+			offset += listsz;
+			continue;
 		}
-		esl = (efi_signature_list_t *)(buf + state->pos);
-		state->buf = buf;
-		state->esl = esl;
-		memset(buf + state->pos, 0, allocsz - state->pos);
 
-		memcpy(&esl->signature_type, alg, sizeof(efi_guid_t));
-		esl->signature_list_size = sizeof(efi_signature_list_t) + headersz;
-		esl->signature_header_size = headersz;
-		esl->signature_size = esdsz;
-		state->pos += sizeof(*esl);
-		if (header && headersz > 0)
-			memcpy(buf+state->pos, header, headersz);
-		state->pos += headersz;
-		esd = (efi_signature_data_t *)(buf + state->pos);
-	} else {
-		allocsz = ALIGN_UP(state->pos + esdsz, page_size);
-		buf = realloc(state->buf, allocsz);
-		skew = buf - state->buf;
-		if (!buf) {
-			efi_error("could not allocate %zd bytes", allocsz);
-			return ERROR;
+		secdb = alloc_secdb_entry(top, secdb_type, sigsz);
+		if (!secdb) {
+			if (new_secdb)
+				efi_secdb_free(top);
+			return -1;
 		}
-		memset(buf + state->pos, 0, allocsz - state->pos);
-		esl = (efi_signature_list_t *)((char *)state->esl + skew);
-		state->buf = buf;
-		state->esl = esl;
-		esd = (efi_signature_data_t *)(buf + state->pos);
+		secdb->sigsz = sigsz;
+		secdb->sigs = (uint8_t *)data + offset + hdrsz;
+		secdb->sigs_used = nsigs;
+		secdb->nsigs = nsigs;
+		secdb->borrowed = true;
+		secdb->unsorted = sort_data;
+		secdb->listsz = secdb_entry_size(secdb);
+		debug("secdb:%p is a view of %zd signatures at 0x%zx",
+		      secdb, nsigs, offset + hdrsz);
+
+		offset += listsz;
+	}
+
+	if (sort) {
+		debug("sorting lists %s", sort_descending ? "desc" : "asc");
+		list_sort(&top->list,
+			  sort_descending ? secdb_cmp_descending : secdb_cmp,
+			  NULL);
 	}
-	debug("esl[%u]:%p esd[%u]:%p", listnum, esl, signum, esd);
 
-	memcpy(&esd->signature_owner, owner, sizeof(efi_guid_t));
-	memcpy(&esd->signature_data[0], data, datasz);
-	esl->signature_list_size += esdsz;
+	*secdbp = top;
+	return 0;
+}
 
-	state->pos += esdsz;
-	state->listnum = listnum;
+PUBLIC int
+efi_secdb_parse_view(const uint8_t *data, size_t datasz, efi_secdb_t **secdbp)
+{
+	int rc;
 
-	return CONTINUE;
+	tracepoint(libefisec, secdb_parse_entry, secdbp ? *secdbp : NULL);
+	rc = secdb_parse_view(data, datasz, secdbp);
+	tracepoint(libefisec, secdb_parse_return, rc,
+		   secdbp ? *secdbp : NULL);
+	return rc;
 }
 
 /*
- * realize a signature list file from our internal representation
+ * is there an entry matching data, and owner if that isn't NULL, in any
+ * sublist of this algorithm?
  */
 PUBLIC int
-efi_secdb_realize(efi_secdb_t *secdb, void **out, size_t *outsize)
+efi_secdb_has_entry(efi_secdb_t *top,
+		    const efi_guid_t *owner,
+		    efi_secdb_type_t algorithm,
+		    efi_secdb_data_t *data,
+		    size_t datasz)
 {
+	list_t *pos;
 
-	struct visitor_state state = { 0, };
+	if (!top || !data || !datasz ||
+	    algorithm < 0 || algorithm >= MAX_SECDB_TYPE) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	state.buf = calloc(1, page_size);
-	state.esl = (efi_signature_list_t *)state.buf;
-	if (!state.buf) {
-		efi_error("could not allocate %zd bytes", page_size);
-		return ERROR;
+	for_each_secdb(pos, &top->list) {
+		efi_secdb_t *secdb = list_entry(pos, efi_secdb_t, list);
+
+		if (secdb->algorithm != algorithm || secdb->nsigs == 0 ||
+		    secdb_sig_datasz(secdb) != datasz)
+			continue;
+		/*
+		 * views don't get an index until somebody asks, since plenty
+		 * of them just get realized or visited
+		 */
+		if (!secdb->index.slots)
+			secdb_index_rebuild(secdb);
+		if (secdb_find_data(secdb, data, datasz, owner) >= 0)
+			return 1;
 	}
+	return 0;
+}
 
-	efi_secdb_visit_entries(secdb, secdb_realize_visitor, &state);
+PUBLIC int
+efi_secdb_contains(efi_secdb_t *top, efi_secdb_type_t algorithm,
+		   efi_secdb_data_t *data, size_t datasz)
+{
+	return efi_secdb_has_entry(top, NULL, algorithm, data, datasz);
+}
+
+/*
+ * Find the signatures in from that aren't in to, adding each to missing
+ * if it isn't NULL.  Returns how many there were, or -1 on error.
+ */
+static ssize_t
+secdb_missing(efi_secdb_t *from, efi_secdb_t *to, efi_secdb_t *missing)
+{
+	ssize_t nmissing = 0;
+	list_t *pos;
+
+	efi_secdb_compact_(from);
+
+	for_each_secdb(pos, &from->list) {
+		efi_secdb_t *secdb = list_entry(pos, efi_secdb_t, list);
+		size_t datasz;
+
+		if (secdb->nsigs == 0)
+			continue;
+		datasz = secdb_sig_datasz(secdb);
+		for (size_t n = 0; n < secdb->sigs_used; n++) {
+			efi_signature_data_t *sig = secdb_sig(secdb, n);
+			efi_secdb_data_t *data;
+			int rc;
+
+			data = (efi_secdb_data_t *)sig->signature_data;
+			rc = efi_secdb_has_entry(to, &sig->signature_owner,
+						 secdb->algorithm, data, datasz);
+			if (rc < 0)
+				return -1;
+			if (rc)
+				continue;
+			nmissing += 1;
+			if (missing &&
+			    efi_secdb_add_entry(missing, &sig->signature_owner,
+						secdb->algorithm, data,
+						datasz) < 0)
+				return -1;
+		}
+	}
+	return nmissing;
+}
+
+PUBLIC int
+efi_secdb_diff(efi_secdb_t *current, efi_secdb_t *target,
+	       efi_secdb_t **updatep)
+{
+	efi_secdb_t *update;
+	ssize_t nadded, nremoved;
+
+	if (!current || !target || !updatep) {
+		errno = EINVAL;
+		efi_error("invalid argument");
+		return -1;
+	}
+
+	update = efi_secdb_new();
+	if (!update)
+		return -1;
+	update->flags = target->flags;
+
+	nadded = secdb_missing(target, current, update);
+	if (nadded < 0)
+		goto err;
+	nremoved = secdb_missing(current, target, NULL);
+	if (nremoved < 0)
+		goto err;
+
+	debug("update adds %zd signatures; target lacks %zd of current's",
+	      nadded, nremoved);
+	*updatep = update;
+	return nremoved ? 1 : 0;
+err:
+	efi_error("could not compute secdb update");
+	efi_secdb_free(update);
+	return -1;
+}
+
+/*
+ * Add everything in src to dst the way parsing src's lists into dst
+ * would have: in order, deduplicated against what's in dst, and, when
+ * dst isn't sorted, starting a new sublist wherever src does so the
+ * lists come out in the same order they went in.
+ */
+PUBLIC int
+efi_secdb_merge(efi_secdb_t *dst, efi_secdb_t *src)
+{
+	bool sort;
+	list_t *pos;
+
+	if (!dst || !src || dst == src) {
+		errno = EINVAL;
+		efi_error("invalid argument");
+		return -1;
+	}
+	sort = dst->flags & (1ul << EFI_SECDB_SORT);
+
+	for_each_secdb(pos, &src->list) {
+		efi_secdb_t *secdb = list_entry(pos, efi_secdb_t, list);
+		bool force = !sort;
+		size_t datasz;
+
+		if (secdb->nsigs == 0)
+			continue;
+		datasz = secdb_sig_datasz(secdb);
+		for (size_t n = 0; n < secdb->sigs_used; n++) {
+			efi_signature_data_t *sig = secdb_sig(secdb, n);
+
+			if (secdb_sig_deleted(secdb, n))
+				continue;
+			if (efi_secdb_add_entry_or_secdb(dst,
+					&sig->signature_owner,
+					secdb->algorithm,
+					(efi_secdb_data_t *)sig->signature_data,
+					datasz, force) < 0) {
+				efi_error("could not merge secdb");
+				return -1;
+			}
+			force = false;
+		}
+	}
+	return 0;
+}
+
+/*
+ * realize a signature list file from our internal representation into a
+ * buffer we were given.  Since each sublist is already laid out the way it
+ * is in the ESL, that just means sticking a header on each of them.
+ */
+static int
+secdb_realize_into(efi_secdb_t *top, void *buf, size_t bufsz,
+		   size_t *outsize)
+{
+	list_t *pos;
+	size_t offset = 0;
+
+	efi_secdb_compact_(top);
+
+	*outsize = secdb_size(top);
+	if (*outsize > bufsz) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	for_each_secdb(pos, &top->list) {
+		efi_secdb_t *secdb = list_entry(pos, efi_secdb_t, list);
+		efi_signature_list_t *esl;
+		const efi_guid_t *alg;
+
+		if (secdb->nsigs == 0)
+			continue;
+
+		alg = secdb_guid_from_type(secdb->algorithm);
+		if (!alg) {
+			efi_error("could not determine signature type");
+			return -1;
+		}
+
+		esl = (efi_signature_list_t *)((uint8_t *)buf + offset);
+		memcpy(&esl->signature_type, alg, sizeof(efi_guid_t));
+		esl->signature_list_size = secdb->listsz;
+		esl->signature_header_size = secdb->hdrsz;
+		esl->signature_size = secdb->sigsz;
+		offset += sizeof(*esl);
+
+		memset((uint8_t *)buf + offset, 0, secdb->hdrsz);
+		offset += secdb->hdrsz;
+
+		debug("esl:%p nsigs:%zd sigsz:%"PRIu32, esl, secdb->nsigs,
+		      secdb->sigsz);
+		memcpy((uint8_t *)buf + offset, secdb->sigs,
+		       secdb->nsigs * secdb->sigsz);
+		offset += secdb->nsigs * secdb->sigsz;
+	}
+
+	return 0;
+}
+
+PUBLIC int
+efi_secdb_realize_into(efi_secdb_t *top, void *buf, size_t bufsz,
+		       size_t *outsize)
+{
+	int rc;
+
+	tracepoint(libefisec, secdb_realize_entry, top, bufsz);
+	rc = secdb_realize_into(top, buf, bufsz, outsize);
+	tracepoint(libefisec, secdb_realize_return, rc, *outsize);
+	return rc;
+}
+
+/*
+ * realize a signature list file from our internal representation
+ */
+PUBLIC int
+efi_secdb_realize(efi_secdb_t *top, void **out, size_t *outsize)
+{
+	size_t allocsz;
+	void *buf;
+	int rc;
+
+	allocsz = secdb_size(top);
+	buf = malloc(allocsz ? allocsz : 1);
+	if (!buf) {
+		efi_error("could not allocate %zd bytes", allocsz);
+		return ERROR;
+	}
 
-	*out = state.buf;
-	*outsize = state.pos;
+	rc = efi_secdb_realize_into(top, buf, allocsz, outsize);
+	if (rc < 0) {
+		free(buf);
+		return rc;
+	}
 
+	*out = buf;
 	return 0;
 }
 
@@ -556,23 +1448,13 @@ efi_secdb_realize(efi_secdb_t *secdb, void **out, size_t *outsize)
 void
 secdb_free_entry(efi_secdb_t *secdb)
 {
-	list_t *pos = NULL, *tmp = NULL;
-
 	if (!secdb)
 		return;
 
-	for_each_secdb_entry_safe(pos, tmp, &secdb->entries) {
-		secdb_entry_t *entry = list_entry(pos, secdb_entry_t, list);
-		bool has_owner = true;
-		int rc;
-
-		rc = secdb_entry_has_owner_from_type(secdb->algorithm, &has_owner);
-		if (rc < 0)
-			efi_error("could not determine signature type");
-
-		list_del(&entry->list);
-		xfree(entry);
-	}
+	if (!secdb->borrowed)
+		xfree(secdb->sigs);
+	xfree(secdb->deleted);
+	xfree(secdb->index.slots);
 
 	memset(secdb, 0, sizeof(*secdb));
 	xfree(secdb);
@@ -589,6 +1471,7 @@ efi_secdb_free(efi_secdb_t *top)
 	if (!top)
 		return;
 
+	secdb_certs_free(top);
 	for_each_secdb_safe(pos, tmp, &top->list) {
 		efi_secdb_t *secdb = list_entry(pos, efi_secdb_t, list);
 		list_del(&secdb->list);
@@ -602,31 +1485,19 @@ secdb_visit_entries(efi_secdb_t *secdb, int i,
 		    efi_secdb_visitor_t *visitor,
 		    void *closure)
 {
-	int j = 0;
-	list_t *pos;
-	size_t datasz;
-	bool has_owner = true;
-	int rc;
-
-	rc = secdb_entry_has_owner_from_type(secdb->algorithm, &has_owner);
-	if (rc < 0) {
-		efi_error("could not determine signature type");
-		return ERROR;
-	}
-	datasz = secdb->sigsz - (has_owner ? sizeof(efi_guid_t) : 0);
+	size_t datasz = secdb_sig_datasz(secdb);
 
-	for_each_secdb_entry(pos, &secdb->entries) {
-		secdb_entry_t *entry = list_entry(pos, secdb_entry_t, list);
+	for (size_t j = 0; j < secdb->nsigs; j++) {
+		efi_signature_data_t *sig = secdb_sig(secdb, j);
 		efi_secdb_visitor_status_t status;
 
-		debug("secdb[%d]:%p entry[%d]:%p pos:%p = {%p, %p}",
-		      i, secdb, j, entry, pos,
-		      pos ? pos->prev : 0, pos ? pos->next : 0);
-		debug("secdb[%d]:%p entry[%d]:%p owner:"GUID_FORMAT" data:%p-%p datasz:%zd",
-		      i, secdb, j, entry, GUID_FORMAT_ARGS(&entry->owner),
-		      &entry->data, &entry->data+datasz, datasz);
-		status = visitor(i, j++, &entry->owner, secdb->algorithm, NULL,
-		                 0, &entry->data, datasz, closure);
+		debug("secdb[%d]:%p signature[%zd]:%p owner:"GUID_FORMAT" data:%p-%p datasz:%zd",
+		      i, secdb, j, sig, GUID_FORMAT_ARGS(&sig->signature_owner),
+		      sig->signature_data, sig->signature_data+datasz, datasz);
+		status = visitor(i, j, &sig->signature_owner, secdb->algorithm,
+				 NULL, 0,
+				 (efi_secdb_data_t *)sig->signature_data,
+				 datasz, closure);
 		if (status == ERROR)
 			return ERROR;
 		if (status == BREAK)
@@ -644,6 +1515,8 @@ efi_secdb_visit_entries(efi_secdb_t *top,
 	list_t *pos = NULL, *tmp = NULL;
 	int i = 0;
 
+	efi_secdb_compact_(top);
+
 	for_each_secdb_safe(pos, tmp, &top->list) {
 		efi_secdb_t *secdb = list_entry(pos, efi_secdb_t, list);
 
@@ -660,52 +1533,6 @@ efi_secdb_visit_entries(efi_secdb_t *top,
 	return 0;
 }
 
-static inline int
-bytecmp(const void *ap, const void *bp, size_t sz)
-{
-	const uint8_t *a = (const uint8_t *)ap;
-	const uint8_t *b = (const uint8_t *)bp;
-
-	for (size_t i = 0; i < sz; i++) {
-		int sub = a[i] - b[i];
-		if (sub != 0) {
-			debug("byte %zu differs: a=0x%02hhx %c b=0x%02hhx",
-			      i, a[i], LEGR(sub), b[i]);
-			return sub;
-		}
-	}
-	return 0;
-}
-
-/*
- * compare secdb_entry_t items
- */
-int
-secdb_entry_cmp(const void *ap, const void *bp)
-{
-	const secdb_entry_t *a = *(const secdb_entry_t **)ap;
-	const secdb_entry_t *b = *(const secdb_entry_t **)bp;
-	size_t sigsz = *(size_t *)list_sort_state;
-	int rc;
-
-	rc = efi_guid_cmp(&a->owner, &b->owner);
-	if (rc != 0) {
-		debug("owner guids differ: "GUID_FORMAT" %c "GUID_FORMAT,
-		      GUID_FORMAT_ARGS(&a->owner),
-		      LEGR(rc),
-		      GUID_FORMAT_ARGS(&b->owner));
-		return rc;
-	}
-
-	return bytecmp(a->data.raw, b->data.raw, sigsz);
-}
-
-int
-secdb_entry_cmp_descending(const void *ap, const void *bp)
-{
-	return secdb_entry_cmp(bp, ap);
-}
-
 /*
  * compare efi_secdb_t items
  */
@@ -27,18 +27,29 @@ typedef struct {
 	const size_t size;
 } secdb_alg_t;
 
-struct secdb_entry {
-	list_t list;
-	efi_guid_t owner;
-	efi_secdb_data_t data;
+/*
+ * An open-addressed hash of a sublist's signatures by their data, so
+ * adding and deleting don't have to walk the whole sublist.
+ */
+struct secdb_index {
+	size_t *slots;			// 0, 1 + a signature number, or SIZE_MAX
+	size_t nslots;			// always a power of two
+	size_t nused;			// live signatures plus tombstones
 };
-typedef struct secdb_entry secdb_entry_t;
 
 /*****************************************************************************
  * our internal representation.  Each entry in secdb represents one distinct *
  * {owner, algorithm, size}; i.e. all efi_guid_x509_sha512 with the same     *
  * owner can go on the same entry, but each efi_guid_x509_cert of a          *
  * different size needs its own                                              *
+ *                                                                           *
+ * Since every signature in a sublist is the same size, they're kept packed  *
+ * in one array laid out exactly as they are in the ESL: each one is an      *
+ * efi_signature_data_t of sigsz bytes.  Deleting only marks a signature,    *
+ * and sorting is put off until something looks at the sublist;              *
+ * efi_secdb_compact_() takes care of both.                                  *
+ * Sublists made by efi_secdb_parse_view() point straight into its input     *
+ * until something changes them.                                             *
  *****************************************************************************/
 struct efi_secdb {
 	list_t list;			// link to our next signature sublist
@@ -50,17 +61,43 @@ struct efi_secdb {
 	uint32_t sigsz;			// size of each signature
 	size_t nsigs;			// number of signatures
 	void *header;			// unused
-	list_t entries;			// list of signature data entries
+	uint8_t *sigs;			// the signatures, sigsz bytes apiece
+	size_t sigs_used;		// nsigs plus deleted signatures
+	size_t sigs_allocated;		// signatures there's room for in sigs
+	uint8_t *deleted;		// bitmap of deleted signatures in sigs
+	bool unsorted;			// added to since we last sorted
+	bool borrowed;			// sigs is in efi_secdb_parse_view()'s input
+	struct secdb_index index;	// signatures, by data
+	struct secdb_certs *certs;	// X509_CERTs by field; top one only
 };
 
 #define for_each_secdb(pos, head) list_for_each(pos, head)
 #define for_each_secdb_safe(pos, n, head) list_for_each_safe(pos, n, head)
 #define for_each_secdb_prev(pos, head) list_for_each_prev(pos, head)
-#define for_each_secdb_entry(pos, head) list_for_each(pos, head)
-#define for_each_secdb_entry_safe(pos, n, head) list_for_each_safe(pos, n, head)
 
 extern const secdb_alg_t PUBLIC efi_secdb_algs_[MAX_SECDB_TYPE];
 
+/*
+ * the nth signature in a sublist, and the size of its signature_data
+ */
+static inline efi_signature_data_t *
+secdb_sig(efi_secdb_t *secdb, size_t n)
+{
+	return (efi_signature_data_t *)(secdb->sigs + n * secdb->sigsz);
+}
+
+static inline size_t
+secdb_sig_datasz(efi_secdb_t *secdb)
+{
+	return secdb->sigsz - sizeof(efi_guid_t);
+}
+
+/*
+ * get rid of deleted signatures and do any sorting that's been put off, in
+ * every sublist
+ */
+extern void PUBLIC efi_secdb_compact_(efi_secdb_t *top);
+
 /*********************************************************
  * some helpers to look up sizes for each algorithm type *
  *********************************************************/
@@ -208,7 +245,7 @@ secdb_size(efi_secdb_t *secdb)
 }
 
 /*
- * compare secdb_entry_t items
+ * compare packed signatures; list_sort_state points to the data size
  */
 extern int secdb_entry_cmp(const void *a, const void *b);
 extern int secdb_entry_cmp_descending(const void *a, const void *b);
@@ -219,6 +256,12 @@ extern int secdb_entry_cmp_descending(const void *a, const void *b);
 extern int secdb_cmp(const void *a, const void *b);
 extern int secdb_cmp_descending(const void *a, const void *b);
 
+/*
+ * throw away the certificate index efi_secdb_find_cert() made, since
+ * something's about to change under it
+ */
+extern void secdb_certs_free(efi_secdb_t *top);
+
 /*
  * hexdump with annotations
  */
@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * sha256.h - a small SHA-256
+ */
+
+#ifndef _EFIVAR_SHA256_H
+#define _EFIVAR_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+/*
+ * Just enough SHA-256 (FIPS 180-4) for hashing images and certificate
+ * keys; nothing here otherwise links against a crypto library, and this
+ * isn't anywhere near worth adding one for.  It's all in the header so
+ * libefisec and efisecdb can each have a copy without either exporting
+ * it.
+ */
+struct sha256_ctx {
+	uint32_t h[8];
+	uint64_t len;
+	uint8_t buf[64];
+	size_t buflen;
+};
+
+static const uint32_t __attribute__((unused)) sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t
+ror32(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline void
+sha256_block(struct sha256_ctx *ctx, const uint8_t *p)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+
+	for (int i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+		       (uint32_t)p[i * 4 + 2] << 8 | (uint32_t)p[i * 4 + 3];
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^
+			      (w[i - 15] >> 3);
+		uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^
+			      (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+	e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+
+	for (int i = 0; i < 64; i++) {
+		uint32_t s1 = ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+		uint32_t s0 = ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = s0 + maj;
+
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+	ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+static inline void
+sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memset(ctx, 0, sizeof(*ctx));
+	memcpy(ctx->h, iv, sizeof(iv));
+}
+
+static inline void
+sha256_update(struct sha256_ctx *ctx, const uint8_t *p, size_t len)
+{
+	ctx->len += len;
+
+	if (ctx->buflen) {
+		size_t n = MIN(len, sizeof(ctx->buf) - ctx->buflen);
+
+		memcpy(ctx->buf + ctx->buflen, p, n);
+		ctx->buflen += n;
+		p += n;
+		len -= n;
+		if (ctx->buflen < sizeof(ctx->buf))
+			return;
+		sha256_block(ctx, ctx->buf);
+		ctx->buflen = 0;
+	}
+
+	/* the bulk of an image goes straight from the mapping */
+	while (len >= sizeof(ctx->buf)) {
+		sha256_block(ctx, p);
+		p += sizeof(ctx->buf);
+		len -= sizeof(ctx->buf);
+	}
+
+	memcpy(ctx->buf, p, len);
+	ctx->buflen = len;
+}
+
+static inline void
+sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	uint64_t bits = ctx->len * 8;
+
+	ctx->buf[ctx->buflen++] = 0x80;
+	if (ctx->buflen > sizeof(ctx->buf) - 8) {
+		memset(ctx->buf + ctx->buflen, 0,
+		       sizeof(ctx->buf) - ctx->buflen);
+		sha256_block(ctx, ctx->buf);
+		ctx->buflen = 0;
+	}
+	memset(ctx->buf + ctx->buflen, 0, sizeof(ctx->buf) - 8 - ctx->buflen);
+	for (int i = 0; i < 8; i++)
+		ctx->buf[56 + i] = bits >> (56 - i * 8);
+	sha256_block(ctx, ctx->buf);
+
+	for (int i = 0; i < 8; i++) {
+		digest[i * 4] = ctx->h[i] >> 24;
+		digest[i * 4 + 1] = ctx->h[i] >> 16;
+		digest[i * 4 + 2] = ctx->h[i] >> 8;
+		digest[i * 4 + 3] = ctx->h[i];
+	}
+}
+
+#endif /* !_EFIVAR_SHA256_H */
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * stats.c - per-process performance counters
+ */
+
+#include "fix_coverity.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "efivar.h"
+#include "stats.h"
+
+/*
+ * Every thread counts into its own block, so counting is a plain add with
+ * no lock and no shared cache line; efi_get_stats() walks all the blocks
+ * and adds them up.  When a thread exits, its counts are folded into
+ * stats_retired and its block goes away; nothing else frees a block.
+ */
+#define STATS_NCOUNTERS (sizeof(efi_stats_t) / sizeof(uint64_t))
+
+struct stats_block {
+	uint64_t counters[STATS_NCOUNTERS];
+	struct stats_block *next;
+};
+
+static _Thread_local struct stats_block *thread_stats;
+static struct stats_block *stats_blocks;
+static uint64_t stats_retired[STATS_NCOUNTERS];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static bool stats_key_valid;
+
+static void
+stats_block_retire(void *arg)
+{
+	struct stats_block *block = arg;
+	struct stats_block **pos;
+
+	pthread_mutex_lock(&stats_lock);
+	for (pos = &stats_blocks; *pos; pos = &(*pos)->next) {
+		if (*pos == block) {
+			*pos = block->next;
+			break;
+		}
+	}
+	for (size_t i = 0; i < STATS_NCOUNTERS; i++)
+		stats_retired[i] += block->counters[i];
+	pthread_mutex_unlock(&stats_lock);
+
+	free(block);
+}
+
+static void
+stats_key_init(void)
+{
+	stats_key_valid = !pthread_key_create(&stats_key, stats_block_retire);
+}
+
+static struct stats_block *
+get_thread_stats(void)
+{
+	struct stats_block *block;
+
+	block = calloc(1, sizeof(*block));
+	if (!block)
+		return NULL;
+
+	pthread_once(&stats_once, stats_key_init);
+	if (stats_key_valid)
+		pthread_setspecific(stats_key, block);
+
+	pthread_mutex_lock(&stats_lock);
+	block->next = stats_blocks;
+	stats_blocks = block;
+	pthread_mutex_unlock(&stats_lock);
+
+	thread_stats = block;
+	return block;
+}
+
+void PUBLIC
+efi_stats_add_(unsigned int counter, uint64_t n)
+{
+	struct stats_block *block = thread_stats;
+	uint64_t *value;
+
+	if (!block && !(block = get_thread_stats()))
+		return;
+	if (counter >= STATS_NCOUNTERS)
+		return;
+
+	/* only this thread writes it, but efi_get_stats() reads it */
+	value = &block->counters[counter];
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+int NONNULL(1) PUBLIC
+efi_get_stats(efi_stats_t *stats, size_t size)
+{
+	uint64_t totals[STATS_NCOUNTERS];
+	struct stats_block *block;
+
+	if (size > sizeof(*stats))
+		size = sizeof(*stats);
+
+	pthread_mutex_lock(&stats_lock);
+	memcpy(totals, stats_retired, sizeof(totals));
+	for (block = stats_blocks; block; block = block->next) {
+		for (size_t i = 0; i < STATS_NCOUNTERS; i++)
+			totals[i] += __atomic_load_n(&block->counters[i],
+						     __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	memcpy(stats, totals, size);
+	return 0;
+}
+
+/*
+ * Other threads may still be running, and their thread_stats still point
+ * at their blocks, so those are left alone; a block only goes away from
+ * the key destructor, when its own thread exits.  Deleting the key means
+ * that can't call into us after we're unloaded; any blocks left then are
+ * leaked.
+ */
+static void DESTRUCTOR
+stats_fini(void)
+{
+	if (stats_key_valid) {
+		pthread_key_delete(stats_key);
+		stats_key_valid = false;
+	}
+}
+
+// vim:fenc=utf-8:tw=75:noet
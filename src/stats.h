@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * stats.h - per-process performance counters
+ */
+#ifndef _EFIVAR_STATS_H
+#define _EFIVAR_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * efi_stats_add_() is exported from libefivar so libefiboot can count
+ * things too, but it isn't part of the public API; use stats_add().
+ */
+extern void efi_stats_add_(unsigned int counter, uint64_t n)
+	__attribute__((__visibility__ ("default")));
+
+#define stats_add(field, n)						\
+	efi_stats_add_(offsetof(efi_stats_t, field) / sizeof(uint64_t), (n))
+#define stats_inc(field) stats_add(field, 1)
+
+#endif /* _EFIVAR_STATS_H */
+
+// vim:fenc=utf-8:tw=75:noet
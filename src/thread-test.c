@@ -6,16 +6,20 @@
 
 #include "fix_coverity.h"
 
+#include <efiboot.h>
 #include <efivar.h>
 #include <err.h>
 #include <errno.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <inttypes.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define LOOP_COUNT 100
@@ -98,6 +102,74 @@ static void *loop_get_variable_size_test(void *_ __attribute__((__unused__)))
 	return TEST_SUCCESS;
 }
 
+#define ITER_TEST_GUID EFI_GUID(0x84be9c3e,0x8a32,0x42c0,0x891c,0x4c,0xd3,0xb0,0x72,0xbe,0xcc)
+#define ITER_TEST_VARS 16
+
+static size_t
+count_test_variables(void)
+{
+	efi_guid_t test_guid = ITER_TEST_GUID;
+	efi_varname_iter_t *iter = NULL;
+	efi_guid_t *guid = NULL;
+	char *name = NULL;
+	size_t found = 0;
+	int rc;
+
+	if (efi_varname_iter_new(&iter) < 0)
+		err(1, "efi_varname_iter_new failed");
+	while ((rc = efi_varname_iter_next(iter, &guid, &name)) > 0) {
+		if (!efi_guid_cmp(guid, &test_guid))
+			found++;
+	}
+	efi_varname_iter_free(iter);
+	if (rc < 0)
+		err(1, "efi_varname_iter_next failed");
+	return found;
+}
+
+static void *loop_varname_iter_test(void *_ __attribute__((__unused__)))
+{
+	if (verbosity >= 2)
+		printf("[DEBUG] iterator test running on new thread!\n");
+	for (unsigned i = 0; i < LOOP_COUNT / 10; i++) {
+		size_t found = count_test_variables();
+
+		if (found != ITER_TEST_VARS) {
+			warnx("fail, iteration=%u, found %zu variables, expected %d",
+			      i, found, ITER_TEST_VARS);
+			return TEST_FAIL;
+		} else if (verbosity >= 2) {
+			printf("[DEBUG] iteration=%u, found=%zu\n", i, found);
+		}
+	}
+	return TEST_SUCCESS;
+}
+
+static void
+make_test_variables(bool create)
+{
+	for (unsigned i = 0; i < ITER_TEST_VARS; i++) {
+		char name[] = "IterTest00";
+		uint8_t data = i;
+		int rc;
+
+		name[8] = '0' + i / 10;
+		name[9] = '0' + i % 10;
+		if (create)
+			rc = efi_set_variable(ITER_TEST_GUID, name, &data,
+					      sizeof(data),
+					      EFI_VARIABLE_NON_VOLATILE |
+					      EFI_VARIABLE_BOOTSERVICE_ACCESS |
+					      EFI_VARIABLE_RUNTIME_ACCESS,
+					      0600);
+		else
+			rc = efi_del_variable(ITER_TEST_GUID, name);
+		if (rc < 0)
+			err(1, "could not %s test variable %s",
+			    create ? "create" : "delete", name);
+	}
+}
+
 static int multithreaded_test(size_t count, void *(*test_func)(void *))
 {
 	pthread_t *threads = alloca(sizeof(pthread_t) * count);
@@ -115,6 +187,424 @@ static int multithreaded_test(size_t count, void *(*test_func)(void *))
 	return (worst_result == TEST_SUCCESS) ? 0 : -1;
 }
 
+/*
+ * Benchmark mode: instead of a fixed number of loops, every thread runs
+ * one operation over and over for a fixed time, recording how long each
+ * call took, and we report throughput and latency at each thread count.
+ *
+ * The "-global" operations are the ones that keep state in the library
+ * rather than with the caller: efi_get_next_variable_name() has one
+ * directory iterator per process, and efi_loadopt_desc() one result
+ * buffer.  Neither can be called from two threads at once, so, as any
+ * real caller would have to, we serialize them with a lock and report
+ * how much time went to waiting for it next to the per-caller
+ * equivalents.
+ */
+#define BENCH_SET_GUID EFI_GUID(0x1f0c3a5e,0x63b2,0x4e0f,0x9a4d,0x7e,0x21,0x58,0xc6,0x0b,0x94)
+
+#define LOAD_OPTION_ACTIVE	0x00000001
+
+#define HIST_SUB_BITS	3
+#define HIST_BUCKETS	(64 << HIST_SUB_BITS)
+
+struct bench_op {
+	const char *name;
+	int (*run)(unsigned int thread);
+	bool serialized;
+};
+
+struct bench_worker {
+	pthread_t thread;
+	unsigned int id;
+	const struct bench_op *op;
+	uint64_t ops;
+	uint64_t elapsed_ns;
+	uint64_t lock_wait_ns;
+	uint64_t hist[HIST_BUCKETS];
+	bool failed;
+};
+
+static bool bench_stop;
+static pthread_barrier_t bench_barrier;
+static pthread_mutex_t bench_global_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *bench_loadopt;
+static ssize_t bench_loadopt_size;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Buckets are powers of two split into 2^HIST_SUB_BITS linear steps, so
+ * any value is at most 12.5% more than the bucket it lands in says.
+ */
+static unsigned int
+hist_bucket(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < (1u << HIST_SUB_BITS))
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+	       ((ns >> (msb - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t
+hist_bucket_value(unsigned int bucket)
+{
+	unsigned int shift = bucket >> HIST_SUB_BITS;
+	uint64_t sub = bucket & ((1u << HIST_SUB_BITS) - 1);
+
+	if (shift == 0)
+		return sub;
+	return (sub | (1u << HIST_SUB_BITS)) << (shift - 1);
+}
+
+static uint64_t
+hist_percentile(const uint64_t *hist, uint64_t count, double pct)
+{
+	uint64_t want = (uint64_t)(count * pct / 100.0);
+	uint64_t seen = 0;
+
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > want)
+			return hist_bucket_value(i);
+	}
+	return hist_bucket_value(HIST_BUCKETS - 1);
+}
+
+static int
+bench_get(unsigned int thread)
+{
+	char name[] = "IterTest00";
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	uint32_t attributes = 0;
+	static _Thread_local unsigned int n;
+
+	n = (n + thread + 1) % ITER_TEST_VARS;
+	name[8] = '0' + n / 10;
+	name[9] = '0' + n % 10;
+	if (efi_get_variable(ITER_TEST_GUID, name, &data, &data_size,
+			     &attributes) < 0)
+		return -1;
+	free(data);
+	return 0;
+}
+
+static int
+bench_set(unsigned int thread)
+{
+	char name[] = "BenchThread0000";
+	uint8_t data[64] = { 0, };
+
+	snprintf(name, sizeof(name), "BenchThread%04u", thread % 10000);
+	data[0] = thread & 0xff;
+	return efi_set_variable(BENCH_SET_GUID, name, data, sizeof(data),
+				EFI_VARIABLE_NON_VOLATILE |
+				EFI_VARIABLE_BOOTSERVICE_ACCESS |
+				EFI_VARIABLE_RUNTIME_ACCESS, 0600);
+}
+
+static int
+bench_enumerate(unsigned int thread __attribute__((__unused__)))
+{
+	return count_test_variables() == ITER_TEST_VARS ? 0 : -1;
+}
+
+static int
+bench_enumerate_global(unsigned int thread __attribute__((__unused__)))
+{
+	efi_guid_t test_guid = ITER_TEST_GUID;
+	efi_guid_t *guid = NULL;
+	char *name = NULL;
+	size_t found = 0;
+	int rc;
+
+	while ((rc = efi_get_next_variable_name(&guid, &name)) > 0) {
+		if (!efi_guid_cmp(guid, &test_guid))
+			found++;
+	}
+	return rc < 0 || found != ITER_TEST_VARS ? -1 : 0;
+}
+
+static int
+bench_desc(unsigned int thread __attribute__((__unused__)))
+{
+	unsigned char buf[128];
+
+	return efi_loadopt_desc_r((efi_load_option *)bench_loadopt,
+				  bench_loadopt_size, buf, sizeof(buf)) < 0
+	       ? -1 : 0;
+}
+
+static int
+bench_desc_global(unsigned int thread __attribute__((__unused__)))
+{
+	unsigned char buf[128];
+	const unsigned char *desc;
+
+	desc = efi_loadopt_desc((efi_load_option *)bench_loadopt,
+				bench_loadopt_size);
+	if (!desc)
+		return -1;
+	/* the caller has to copy it out before anyone else calls it */
+	strncpy((char *)buf, (const char *)desc, sizeof(buf) - 1);
+	return 0;
+}
+
+static const struct bench_op bench_ops[] = {
+	{ "get", bench_get, false },
+	{ "set", bench_set, false },
+	{ "enumerate", bench_enumerate, false },
+	{ "enumerate-global", bench_enumerate_global, true },
+	{ "desc", bench_desc, false },
+	{ "desc-global", bench_desc_global, true },
+};
+#define N_BENCH_OPS (sizeof(bench_ops) / sizeof(bench_ops[0]))
+
+static void *
+bench_worker(void *arg)
+{
+	struct bench_worker *worker = arg;
+	uint64_t start, end, locked;
+
+	pthread_barrier_wait(&bench_barrier);
+	worker->elapsed_ns = now_ns();
+	while (!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED)) {
+		int rc;
+
+		start = now_ns();
+		if (worker->op->serialized) {
+			pthread_mutex_lock(&bench_global_lock);
+			locked = now_ns();
+			worker->lock_wait_ns += locked - start;
+		}
+		rc = worker->op->run(worker->id);
+		if (worker->op->serialized)
+			pthread_mutex_unlock(&bench_global_lock);
+		end = now_ns();
+		if (rc < 0) {
+			warn("%s failed on thread %u", worker->op->name,
+			     worker->id);
+			worker->failed = true;
+			break;
+		}
+		worker->hist[hist_bucket(end - start)] += 1;
+		worker->ops += 1;
+	}
+	worker->elapsed_ns = now_ns() - worker->elapsed_ns;
+	return worker->failed ? TEST_FAIL : TEST_SUCCESS;
+}
+
+static void
+print_ns(const char *label, uint64_t ns)
+{
+	if (ns < 10000)
+		printf(" %s %5"PRIu64"ns", label, ns);
+	else if (ns < 10000000)
+		printf(" %s %5"PRIu64"us", label, ns / 1000);
+	else
+		printf(" %s %5"PRIu64"ms", label, ns / 1000000);
+}
+
+// returns: aggregate operations per second, or negative on failure
+static double
+bench_run(const struct bench_op *op, unsigned int nthreads,
+	  unsigned long duration_ms, double baseline)
+{
+	struct bench_worker *workers;
+	uint64_t hist[HIST_BUCKETS] = { 0, };
+	uint64_t ops = 0, lock_wait = 0, elapsed = 0;
+	double total = 0.0;
+	bool failed = false;
+	struct timespec ts = {
+		.tv_sec = duration_ms / 1000,
+		.tv_nsec = (duration_ms % 1000) * 1000000,
+	};
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers)
+		err(1, "could not allocate memory");
+	if (pthread_barrier_init(&bench_barrier, NULL, nthreads + 1))
+		errx(1, "pthread_barrier_init failed");
+
+	__atomic_store_n(&bench_stop, false, __ATOMIC_RELAXED);
+	for (unsigned int i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		workers[i].op = op;
+		if (pthread_create(&workers[i].thread, NULL, bench_worker,
+				   &workers[i]))
+			errx(1, "pthread_create failed");
+	}
+	pthread_barrier_wait(&bench_barrier);
+	nanosleep(&ts, NULL);
+	__atomic_store_n(&bench_stop, true, __ATOMIC_RELAXED);
+
+	for (unsigned int i = 0; i < nthreads; i++) {
+		struct bench_worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		failed |= w->failed;
+		ops += w->ops;
+		lock_wait += w->lock_wait_ns;
+		elapsed += w->elapsed_ns;
+		if (w->elapsed_ns)
+			total += w->ops * 1e9 / w->elapsed_ns;
+		for (unsigned int j = 0; j < HIST_BUCKETS; j++)
+			hist[j] += w->hist[j];
+		if (verbosity >= 1)
+			printf("  [%s thread %u] %"PRIu64" ops, %.0f ops/s\n",
+			       op->name, i, w->ops,
+			       w->elapsed_ns ? w->ops * 1e9 / w->elapsed_ns
+					     : 0.0);
+	}
+	pthread_barrier_destroy(&bench_barrier);
+	free(workers);
+	if (failed)
+		return -1.0;
+
+	printf("%-17s %4u %10.0f %10.0f %7.2f", op->name, nthreads, total,
+	       total / nthreads,
+	       baseline > 0.0 ? total / baseline : (double)nthreads);
+	if (ops) {
+		print_ns("p50", hist_percentile(hist, ops, 50.0));
+		print_ns("p99", hist_percentile(hist, ops, 99.0));
+		print_ns("p99.9", hist_percentile(hist, ops, 99.9));
+	}
+	if (op->serialized && elapsed)
+		printf(" lock wait %3.0f%%", 100.0 * lock_wait / elapsed);
+	printf("\n");
+	fflush(stdout);
+	return total;
+}
+
+static void
+bench_setup(void)
+{
+	static char filename[] = "\\EFI\\bench\\grubx64.efi";
+	uint8_t dp[256];
+	ssize_t dpsz, sz;
+
+	dpsz = efidp_make_file(dp, sizeof(dp), filename);
+	if (dpsz < 0)
+		err(1, "could not make file device path");
+	sz = efidp_make_end_entire(dp + dpsz, sizeof(dp) - dpsz);
+	if (sz < 0)
+		err(1, "could not make end device path");
+	dpsz += sz;
+
+	bench_loadopt_size = efi_loadopt_create(NULL, 0, LOAD_OPTION_ACTIVE,
+			(efidp)dp, dpsz,
+			(unsigned char *)"Linux Boot Manager", NULL, 0);
+	if (bench_loadopt_size < 0)
+		err(1, "could not size load option");
+	bench_loadopt = malloc(bench_loadopt_size);
+	if (!bench_loadopt)
+		err(1, "could not allocate memory");
+	if (efi_loadopt_create(bench_loadopt, bench_loadopt_size,
+			       LOAD_OPTION_ACTIVE, (efidp)dp, dpsz,
+			       (unsigned char *)"Linux Boot Manager",
+			       NULL, 0) < 0)
+		err(1, "could not create load option");
+
+	make_test_variables(true);
+}
+
+static void
+bench_teardown(unsigned int max_threads)
+{
+	for (unsigned int i = 0; i < max_threads; i++) {
+		char name[] = "BenchThread0000";
+
+		snprintf(name, sizeof(name), "BenchThread%04u", i % 10000);
+		efi_del_variable(BENCH_SET_GUID, name);
+	}
+	make_test_variables(false);
+	free(bench_loadopt);
+	bench_loadopt = NULL;
+}
+
+// returns: 0 on success
+static int
+run_benchmarks(const char *ops, const char *thread_counts,
+	       unsigned long duration_ms)
+{
+	unsigned int counts[32];
+	unsigned int ncounts = 0, max_threads = 1;
+	int rc = 0;
+
+	if (thread_counts) {
+		char *copy = strdup(thread_counts), *tok, *save = NULL;
+
+		if (!copy)
+			err(1, "could not allocate memory");
+		for (tok = strtok_r(copy, ",", &save); tok && ncounts < 32;
+		     tok = strtok_r(NULL, ",", &save)) {
+			unsigned long n = strtoul(tok, NULL, 0);
+
+			if (n == 0 || n > 4096)
+				errx(1, "invalid thread count: %s", tok);
+			counts[ncounts++] = n;
+		}
+		free(copy);
+	} else {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		for (unsigned int n = 1; ncounts < 32; n *= 2) {
+			counts[ncounts++] = n;
+			if (n >= ncpus)
+				break;
+		}
+	}
+	for (unsigned int i = 0; i < ncounts; i++)
+		if (counts[i] > max_threads)
+			max_threads = counts[i];
+
+	bench_setup();
+	printf("%-17s %4s %10s %10s %7s\n", "op", "thr", "ops/s",
+	       "ops/s/thr", "speedup");
+	for (size_t i = 0; i < N_BENCH_OPS; i++) {
+		const struct bench_op *op = &bench_ops[i];
+		double baseline = 0.0;
+		size_t len = strlen(op->name);
+		const char *pos = ops;
+
+		/* ops is a comma separated list, or "all" */
+		if (strcmp(ops, "all")) {
+			while ((pos = strstr(pos, op->name)) != NULL) {
+				if ((pos == ops || pos[-1] == ',') &&
+				    (pos[len] == ',' || pos[len] == '\0'))
+					break;
+				pos += len;
+			}
+			if (!pos)
+				continue;
+		}
+
+		for (unsigned int j = 0; j < ncounts; j++) {
+			double total = bench_run(op, counts[j], duration_ms,
+						 baseline);
+			if (total < 0.0) {
+				rc = -1;
+				break;
+			}
+			/* speedup is against the first count's per-thread rate */
+			if (j == 0 && total > 0.0)
+				baseline = total / counts[j];
+		}
+	}
+	bench_teardown(max_threads);
+	return rc;
+}
+
 static void __attribute__((__noreturn__))
 usage(int ret)
 {
@@ -123,6 +613,13 @@ usage(int ret)
 		"Usage: %s [OPTION...]\n"
 		"  -v, --verbose                     be more verbose\n"
 		"  -t, --thread-count N              use N threads\n"
+		"  -b, --bench OP[,OP...]            benchmark OPs instead of testing:\n"
+		"                                    get, set, enumerate, enumerate-global,\n"
+		"                                    desc, desc-global, or all\n"
+		"  -T, --bench-threads N[,N...]      benchmark with each of these thread\n"
+		"                                    counts (default: 1, 2, 4... up to\n"
+		"                                    the number of CPUs)\n"
+		"  -d, --duration MS                 run each benchmark for MS milliseconds\n"
 		"Help options:\n"
 		"  -?, --help                        Show this help message\n"
 		"      --usage                       Display brief usage message\n",
@@ -133,11 +630,17 @@ usage(int ret)
 int main(int argc, char *argv[])
 {
 	unsigned long thread_count = 64;
-	char *sopts = "vt:?";
+	unsigned long duration_ms = 1000;
+	const char *bench_ops_arg = NULL;
+	const char *bench_threads = NULL;
+	char *sopts = "b:d:T:vt:?";
 	struct option lopts[] = {
+		{"bench", required_argument, 0, 'b'},
+		{"bench-threads", required_argument, 0, 'T'},
+		{"duration", required_argument, 0, 'd'},
 		{"help", no_argument, 0, '?'},
 		{"quiet", no_argument, 0, 'q'},
-		{"thread-count", no_argument, 0, 't'},
+		{"thread-count", required_argument, 0, 't'},
 		{"usage", no_argument, 0, 0},
 		{"verbose", no_argument, 0, 'v'},
 		{0, 0, 0, 0},
@@ -148,6 +651,18 @@ int main(int argc, char *argv[])
 
 	while ((c = getopt_long(argc, argv, sopts, lopts, &i)) != -1) {
 		switch (c) {
+		case 'b':
+			bench_ops_arg = optarg;
+			break;
+		case 'd':
+			errno = 0;
+			duration_ms = strtoul(optarg, NULL, 0);
+			if (errno || duration_ms == 0)
+				errx(1, "invalid argument for -d: %s", optarg);
+			break;
+		case 'T':
+			bench_threads = optarg;
+			break;
 		case 'q':
 			verbosity -= 1;
 			break;
@@ -169,9 +684,18 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (bench_ops_arg)
+		return run_benchmarks(bench_ops_arg, bench_threads,
+				      duration_ms) == 0 ? 0 : 1;
+
 	if (verbosity >= 1)
 		printf("thread count %lu\n", thread_count);
 	rc = multithreaded_test(thread_count, loop_get_variable_size_test);
+	if (rc == 0) {
+		make_test_variables(true);
+		rc = multithreaded_test(thread_count, loop_varname_iter_test);
+		make_test_variables(false);
+	}
 	if (verbosity >= 0)
 		printf("thread test %s\n", rc == 0 ? "passed" : "failed");
 	return rc;
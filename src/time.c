@@ -30,6 +30,29 @@ efi_time_to_tm(const efi_time_t * const s, struct tm *d)
 	return 0;
 }
 
+/*
+ * EFI_TIME's timezone is minutes west of UTC, which is what the C
+ * library's timezone is in seconds, and its EFI_TIME_IN_DAYLIGHT means
+ * the clock has been put forward an hour on top of that.
+ */
+static void
+gmtoff_to_efi_time(long gmtoff, bool isdst, efi_time_t *d)
+{
+	if (isdst)
+		gmtoff -= 60 * 60;
+	d->timezone = -gmtoff / 60;
+}
+
+static long
+efi_time_gmtoff(const efi_time_t * const s)
+{
+	long gmtoff = -(long)s->timezone * 60;
+
+	if (s->daylight & EFI_TIME_IN_DAYLIGHT)
+		gmtoff += 60 * 60;
+	return gmtoff;
+}
+
 int
 tm_to_efi_time(const struct tm * const s, efi_time_t *d, bool tzadj)
 {
@@ -39,7 +62,7 @@ tm_to_efi_time(const struct tm * const s, efi_time_t *d, bool tzadj)
 	}
 
 	d->pad2 = 0;
-	d->daylight = s->tm_isdst ? EFI_TIME_IN_DAYLIGHT : 0;
+	d->daylight = s->tm_isdst > 0 ? EFI_TIME_IN_DAYLIGHT : 0;
 	d->timezone = 0;
 	d->nanosecond = 0;
 	d->pad1 = 0;
@@ -50,68 +73,58 @@ tm_to_efi_time(const struct tm * const s, efi_time_t *d, bool tzadj)
 	d->month = s->tm_mon + 1;
 	d->year = s->tm_year + 1900;
 
+	/*
+	 * Ask mktime() what the local zone's offset is at that time,
+	 * rather than reading the timezone global, which needs a tzset()
+	 * that isn't safe against other threads.
+	 */
 	if (tzadj) {
-		tzset();
-		d->timezone = timezone / 60;
+		struct tm tm = *s;
+
+		if (mktime(&tm) != (time_t)-1) {
+			d->daylight = tm.tm_isdst > 0 ? EFI_TIME_IN_DAYLIGHT : 0;
+			gmtoff_to_efi_time(tm.tm_gmtoff, tm.tm_isdst > 0, d);
+		}
 	}
 
 	return 0;
 }
 
-static char *otz_;
-static char *ntz_;
-
-static const char *
-newtz(int16_t timezone_)
+/*
+ * Set the offset and zone name of a struct tm made from an EFI_TIME the
+ * way localtime_r() would have in that zone, so strftime() doesn't have
+ * to look at TZ for them.  A time with no zone is in the local one.
+ */
+static void
+efi_time_to_tm_zone(const efi_time_t * const s, struct tm *d)
 {
-	if (!otz_)
-		otz_ = strdup(getenv("TZ"));
-
-	if (ntz_) {
-		free(ntz_);
-		ntz_ = NULL;
-	}
-
-	if (timezone_ == EFI_UNSPECIFIED_TIMEZONE) {
-		unsetenv("TZ");
-	} else {
-		char tzsign = timezone_ >= 0 ? '+' : '-';
-		int tzabs = tzsign == '+' ? timezone_ : -timezone_;
-		int16_t tzhours = tzabs / 60;
-		int16_t tzminutes = tzabs % 60;
-		int rc;
-
-		/*
-		 * I have no idea what the right thing to do with DST is
-		 * here, so I'm going to ignore it.
-		 */
-		rc = asprintf(&ntz_, "UTC%c%"PRId16":%"PRId16":00",
-			  tzsign, tzhours, tzminutes);
-		if (rc < 1)
-			return NULL;
-
-		setenv("TZ", ntz_, 1);
+	if (s->timezone == EFI_UNSPECIFIED_TIMEZONE) {
+		struct tm tm = *d;
+
+		if (mktime(&tm) != (time_t)-1) {
+			d->tm_gmtoff = tm.tm_gmtoff;
+			d->tm_zone = tm.tm_zone;
+		}
+		return;
 	}
-	tzset();
 
-	return ntz_;
+	d->tm_gmtoff = efi_time_gmtoff(s);
+	d->tm_zone = "UTC";
 }
 
-static const char *
-oldtz(void) {
-	if (ntz_) {
-		free(ntz_);
-		ntz_ = NULL;
-
-		if (otz_)
-			setenv("TZ", otz_, 1);
-		else
-			unsetenv("TZ");
-	}
-
-	tzset();
-
-	return otz_;
+/* days since 1970-01-01 in the proleptic Gregorian calendar */
+static int64_t
+days_from_civil(int64_t y, unsigned int m, unsigned int d)
+{
+	int64_t era;
+	unsigned int yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int64_t)doe - 719468;
 }
 
 efi_time_t *
@@ -156,7 +169,8 @@ efi_localtime_r(const time_t *time, efi_time_t *result)
 	}
 
 	localtime_r(time, &tm);
-	tm_to_efi_time(&tm, result, true);
+	tm_to_efi_time(&tm, result, false);
+	gmtoff_to_efi_time(tm.tm_gmtoff, tm.tm_isdst > 0, result);
 
 	return result;
 }
@@ -180,19 +194,30 @@ time_t
 efi_mktime(const efi_time_t * const time)
 {
 	struct tm tm = { 0 };
-	time_t ret;
+	int64_t ret;
 
 	if (!time) {
 		errno = EINVAL;
 		return (time_t)-1;
 	}
 
-	newtz(time->timezone);
+	if (time->timezone == EFI_UNSPECIFIED_TIMEZONE) {
+		efi_time_to_tm(time, &tm);
+		return mktime(&tm);
+	}
 
-	efi_time_to_tm(time, &tm);
-	ret = mktime(&tm);
+	if (time->month < 1 || time->month > 12) {
+		errno = EINVAL;
+		return (time_t)-1;
+	}
 
-	oldtz();
+	ret = days_from_civil(time->year, time->month, time->day) * 86400;
+	ret += time->hour * 3600 + time->minute * 60 + time->second;
+	ret -= efi_time_gmtoff(time);
+	if ((time_t)ret != ret) {
+		errno = EOVERFLOW;
+		return (time_t)-1;
+	}
 
 	return ret;
 }
@@ -225,13 +250,9 @@ efi_asctime_r(const efi_time_t * const time, char *buf)
 	struct tm tm = { 0, };
 	char *ret;
 
-	newtz(time->timezone);
-
 	efi_time_to_tm(time, &tm);
 	ret = asctime_r(&tm, buf);
 
-	oldtz();
-
 	return ret;
 }
 
@@ -241,13 +262,9 @@ efi_asctime(const efi_time_t * const time)
 	struct tm tm;
 	char *ret;
 
-	newtz(time->timezone);
-
 	efi_time_to_tm(time, &tm);
 	ret = asctime(&tm);
 
-	oldtz();
-
 	return ret;
 }
 
@@ -262,13 +279,10 @@ efi_strftime(char *s, size_t max, const char *format, const efi_time_t *time)
 		return ret;
 	}
 
-	newtz(time->timezone);
-
 	efi_time_to_tm(time, &tm);
+	efi_time_to_tm_zone(time, &tm);
 	ret = strftime(s, max, format, &tm);
 
-	oldtz();
-
 	return ret;
 }
 
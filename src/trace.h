@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * trace.h - static tracepoints
+ */
+#ifndef _EFIVAR_TRACE_H
+#define _EFIVAR_TRACE_H
+
+/*
+ * USDT probes, for SystemTap or bpftrace.  With <sys/sdt.h> around, each
+ * tracepoint() is a nop and an ELF note saying where its arguments are,
+ * so it costs nothing until something attaches to it, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/lib64/libefivar.so.1:libefivar:get_variable_return
+ *                { @rc[arg2] = count(); }'
+ *
+ * Without <sys/sdt.h>, or with EFIVAR_NO_SDT defined, they go away
+ * entirely.  Arguments have to be integers or pointers.
+ */
+#if !defined(EFIVAR_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define tracepoint(provider, name, args...) \
+	STAP_PROBEV(provider, name, ## args)
+#endif
+#endif
+
+#ifndef tracepoint
+#define tracepoint(provider, name, args...)
+#endif
+
+#endif /* _EFIVAR_TRACE_H */
+
+// vim:fenc=utf-8:tw=75:noet
@@ -5,9 +5,30 @@
 #ifndef _EFIVAR_UCS2_H
 #define _EFIVAR_UCS2_H
 
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define ev_bits(val, mask, shift) \
 	(((val) & ((mask) << (shift))) >> (shift))
 
+/*
+ * Nearly every name and description we see is plain ASCII, so where SSE2
+ * is available the conversions below look at 16 characters at a time and
+ * only fall back to one at a time for the parts that aren't.  Code units
+ * are loaded with memcpy() so unaligned strings in packed structures are
+ * fine.
+ */
+static inline uint16_t UNUSED
+ucs2_char(const uint8_t *s8, size_t i)
+{
+	uint16_t c;
+
+	memcpy(&c, s8 + i * sizeof(c), sizeof(c));
+	return c;
+}
+
 /*
  * ucs2len(): Count the number of characters in a UCS-2 string.
  * s: a UCS-2 string
@@ -20,12 +41,24 @@
 static inline size_t UNUSED
 ucs2len(const void *s, ssize_t limit)
 {
-	ssize_t i;
+	ssize_t i = 0;
 	const uint8_t *s8 = s;
 
-	for (i = 0;
-	     i < (limit >= 0 ? limit : i+1) && !(s8[0] == 0 && s8[1] == 0);
-	     i++, s8 += 2)
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	int mask;
+
+	if (limit >= 0) {
+		for (; i + 8 <= limit; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(s8 + i * 2));
+
+			mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+			if (mask)
+				return i + __builtin_ctz(mask) / 2;
+		}
+	}
+#endif
+	for (; i < (limit >= 0 ? limit : i+1) && ucs2_char(s8, i); i++)
 		;
 	return i;
 }
@@ -65,15 +98,34 @@ ucs2size(const void *s, ssize_t limit)
 static inline size_t UNUSED NONNULL(1)
 utf8len(const unsigned char *s, ssize_t limit)
 {
-	ssize_t i, j;
-	for (i = 0, j = 0; i < (limit >= 0 ? limit : i+1) && s[i] != '\0';
-	     j++, i++) {
-		if (!(s[i] & 0x80)) {
-			;
-		} else if ((s[i] & 0xc0) == 0xc0 && !(s[i] & 0x20)) {
-			i += 1;
-		} else if ((s[i] & 0xe0) == 0xe0 && !(s[i] & 0x10)) {
-			i += 2;
+	size_t n, i = 0, j = 0;
+
+	n = limit >= 0 ? strnlen((const char *)s, limit)
+		       : strlen((const char *)s);
+	while (i < n) {
+		size_t end = n;
+#if defined(__SSE2__)
+		if (i + 16 <= n) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+
+			if (!_mm_movemask_epi8(v)) {
+				i += 16;
+				j += 16;
+				continue;
+			}
+			end = i + 16;
+		}
+#endif
+		for (; i < end; j++) {
+			if (!(s[i] & 0x80)) {
+				i += 1;
+			} else if ((s[i] & 0xc0) == 0xc0 && !(s[i] & 0x20)) {
+				i += 2;
+			} else if ((s[i] & 0xe0) == 0xe0 && !(s[i] & 0x10)) {
+				i += 3;
+			} else {
+				i += 1;
+			}
 		}
 	}
 	return j;
@@ -97,6 +149,78 @@ utf8size(const unsigned char *s, ssize_t limit)
 	return ret;
 }
 
+/*
+ * ucs2_to_utf8_buf(): convert UCS-2 to UTF-8 in a caller's buffer
+ * buf: where to put the UTF-8, or NULL if size is 0
+ * size: the size of buf
+ * s: the UCS-2 string
+ * limit: the maximum number of characters to convert from s, or -1 for
+ *	  no limit.
+ *
+ * returns the length of the whole UTF-8 string, not counting the NUL, as
+ * snprintf() does.  If that's size or more, only the characters that fit
+ * completely are written.  Unless size is 0, buf is always NUL-terminated.
+ */
+static inline ssize_t UNUSED
+ucs2_to_utf8_buf(unsigned char *buf, size_t size, const void * const s,
+		 ssize_t limit)
+{
+	const uint8_t *s8 = s;
+	size_t room = size ? size - 1 : 0;
+	size_t i = 0, j = 0, n;
+
+	n = ucs2len(s, limit);
+	while (i < n) {
+		size_t end = n;
+#if defined(__SSE2__)
+		if (i + 16 <= n) {
+			const __m128i high = _mm_set1_epi16((short)0xff80);
+			__m128i lo, hi;
+
+			lo = _mm_loadu_si128((const __m128i *)(s8 + i * 2));
+			hi = _mm_loadu_si128((const __m128i *)(s8 + i * 2 + 16));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(
+					_mm_and_si128(_mm_or_si128(lo, hi), high),
+					_mm_setzero_si128())) == 0xffff &&
+			    (j + 16 <= room || j >= room)) {
+				if (j + 16 <= room)
+					_mm_storeu_si128((__m128i *)(buf + j),
+							 _mm_packus_epi16(lo, hi));
+				i += 16;
+				j += 16;
+				continue;
+			}
+			end = i + 16;
+		}
+#endif
+		for (; i < end; i++) {
+			uint16_t c = ucs2_char(s8, i);
+			size_t len = c <= 0x7f ? 1 : c <= 0x7ff ? 2 : 3;
+
+			/* nothing goes after a character that didn't fit */
+			if (j + len > room && j < room)
+				room = j;
+
+			if (j + len > room) {
+				;
+			} else if (len == 1) {
+				buf[j] = c;
+			} else if (len == 2) {
+				buf[j]   = 0xc0 | ev_bits(c, 0x1f, 6);
+				buf[j+1] = 0x80 | ev_bits(c, 0x3f, 0);
+			} else {
+				buf[j]   = 0xe0 | ev_bits(c, 0xf, 12);
+				buf[j+1] = 0x80 | ev_bits(c, 0x3f, 6);
+				buf[j+2] = 0x80 | ev_bits(c, 0x3f, 0);
+			}
+			j += len;
+		}
+	}
+	if (size)
+		buf[j < room ? j : room] = '\0';
+	return j;
+}
+
 /*
  * ucs2_to_utf8(): convert UCS-2 to UTF-8
  * s: the UCS-2 string
@@ -110,62 +234,15 @@ utf8size(const unsigned char *s, ssize_t limit)
 static inline unsigned char * UNUSED
 ucs2_to_utf8(const void * const s, ssize_t limit)
 {
-	ssize_t i, j;
-	unsigned char *out, *ret;
-	const uint16_t * const chars = s;
+	unsigned char *out;
+	ssize_t len;
 
-	if (limit < 0)
-		limit = ucs2len(chars, -1);
-	out = malloc(limit * 6 + 1);
+	len = ucs2_to_utf8_buf(NULL, 0, s, limit);
+	out = malloc(len + 1);
 	if (!out)
 		return NULL;
-	memset(out, 0, limit * 6 +1);
-
-	for (i=0, j=0; chars[i] && i < (limit >= 0 ? limit : i+1); i++,j++) {
-		if (chars[i] <= 0x7f) {
-			out[j] = chars[i];
-		} else if (chars[i] > 0x7f && chars[i] <= 0x7ff) {
-			out[j++] = 0xc0 | ev_bits(chars[i], 0x1f, 6);
-			out[j]   = 0x80 | ev_bits(chars[i], 0x3f, 0);
-#if 1
-		} else if (chars[i] > 0x7ff) {
-			out[j++] = 0xe0 | ev_bits(chars[i], 0xf, 12);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 6);
-			out[j]   = 0x80| ev_bits(chars[i], 0x3f, 0);
-		}
-#else
-		} else if (chars[i] > 0x7ff && chars[i] < 0x10000) {
-			out[j++] = 0xe0 | ev_bits(chars[i], 0xf, 12);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 6);
-			out[j]   = 0x80| ev_bits(chars[i], 0x3f, 0);
-		} else if (chars[i] > 0xffff && chars[i] < 0x200000) {
-			out[j++] = 0xf0 | ev_bits(chars[i], 0x7, 18);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 12);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 6);
-			out[j]   = 0x80| ev_bits(chars[i], 0x3f, 0);
-		} else if (chars[i] > 0x1fffff && chars[i] < 0x4000000) {
-			out[j++] = 0xf8 | ev_bits(chars[i], 0x3, 24);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 18);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 12);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 6);
-			out[j]   = 0x80 | ev_bits(chars[i], 0x3f, 0);
-		} else if (chars[i] > 0x3ffffff) {
-			out[j++] = 0xfc | ev_bits(chars[i], 0x1, 30);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 24);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 18);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 12);
-			out[j++] = 0x80 | ev_bits(chars[i], 0x3f, 6);
-			out[j]   = 0x80 | ev_bits(chars[i], 0x3f, 0);
-		}
-#endif
-	}
-	out[j++] = '\0';
-	ret = realloc(out, j);
-	if (!ret) {
-		free(out);
-		return NULL;
-	}
-	return ret;
+	ucs2_to_utf8_buf(out, len + 1, s, limit);
+	return out;
 }
 
 /*
@@ -183,7 +260,7 @@ static inline ssize_t UNUSED NONNULL(4)
 utf8_to_ucs2(void *s, ssize_t size, bool terminate, const unsigned char *utf8)
 {
 	ssize_t req;
-	ssize_t i, j;
+	ssize_t i, j, n;
 	uint16_t *ucs2 = s;
 	uint16_t val16;
 
@@ -204,9 +281,28 @@ utf8_to_ucs2(void *s, ssize_t size, bool terminate, const unsigned char *utf8)
 		return -1;
 	}
 
-	for (i=0, j=0; i < (size >= 0 ? size : i+1) && utf8[i] != '\0'; j++) {
+	n = strnlen((const char *)utf8, size);
+	for (i=0, j=0; i < n; ) {
 		uint32_t val = 0;
 
+#if defined(__SSE2__)
+		if (i + 16 <= n) {
+			const __m128i zero = _mm_setzero_si128();
+			__m128i v;
+
+			v = _mm_loadu_si128((const __m128i *)(utf8 + i));
+			if (!_mm_movemask_epi8(v)) {
+				_mm_storeu_si128((__m128i *)&ucs2[j],
+						 _mm_unpacklo_epi8(v, zero));
+				_mm_storeu_si128((__m128i *)&ucs2[j + 8],
+						 _mm_unpackhi_epi8(v, zero));
+				i += 16;
+				j += 16;
+				continue;
+			}
+		}
+#endif
+
 		if ((utf8[i] & 0xe0) == 0xe0 && !(utf8[i] & 0x10)) {
 			val = ((utf8[i+0] & 0x0f) << 12)
 			     |((utf8[i+1] & 0x3f) << 6)
@@ -221,7 +317,7 @@ utf8_to_ucs2(void *s, ssize_t size, bool terminate, const unsigned char *utf8)
 			i += 1;
 		}
 		val16 = val;
-		ucs2[j] = val16;
+		ucs2[j++] = val16;
 	}
 	if (terminate) {
 		val16 = 0;
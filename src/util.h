@@ -32,29 +32,52 @@
 #include "compiler.h"
 #include "list.h"
 
+/*
+ * Read everything left in fd into *buf, which is *bufsize bytes long (or
+ * NULL and 0) and is grown with realloc() as needed, so that one buffer
+ * can be handed back in for every file in a loop.  The data is always
+ * followed by a NUL, which isn't counted in *filesize.
+ *
+ * When fstat() gives us a size we start there, so regular files and
+ * efivarfs variables are normally read without growing the buffer at
+ * all; otherwise we double it each time it fills.  On failure *buf is
+ * left allocated for the caller to reuse or free.
+ */
 static inline int UNUSED
-read_file(int fd, uint8_t **result, size_t *bufsize)
+read_file_reuse(int fd, uint8_t **buf, size_t *bufsize, size_t *filesize)
 {
-	uint8_t *p;
-	size_t size = 4096;
-	size_t filesize = 0;
-	ssize_t s = 0;
-	uint8_t *buf, *newbuf;
-
-	if (!(newbuf = calloc(size, sizeof (uint8_t)))) {
-		efi_error("could not allocate memory");
-		*result = buf = NULL;
-		*bufsize = 0;
-		return -1;
+	struct stat statbuf;
+	size_t want = 4096;
+	size_t len = 0;
+
+	if (fstat(fd, &statbuf) == 0 && statbuf.st_size > 0 &&
+	    (uintmax_t)statbuf.st_size < SSIZE_MAX)
+		want = (size_t)statbuf.st_size + 1;
+
+	if (*bufsize < want || !*buf) {
+		uint8_t *newbuf = realloc(*buf, want);
+		if (!newbuf) {
+			efi_error("could not allocate memory");
+			return -1;
+		}
+		*buf = newbuf;
+		*bufsize = want;
 	}
-	buf = newbuf;
-
-	do {
-		p = buf + filesize;
-		/* size - filesize shouldn't exceed SSIZE_MAX because we're
-		 * only allocating 4096 bytes at a time and we're checking that
-		 * before doing so. */
-		s = read(fd, p, size - filesize);
+
+	while (1) {
+		uint8_t probe;
+		uint8_t *p = *buf + len;
+		size_t room = *bufsize - len - 1;
+		ssize_t s;
+
+		/* once it's full, see if there's anything more before we go
+		 * and make it bigger */
+		if (room == 0) {
+			p = &probe;
+			room = 1;
+		}
+
+		s = read(fd, p, room);
 		if (s < 0 && errno == EAGAIN) {
 			/*
 			 * if we got EAGAIN, there's a good chance we've hit
@@ -64,55 +87,66 @@ read_file(int fd, uint8_t **result, size_t *bufsize)
 			sched_yield();
 			continue;
 		} else if (s < 0) {
-			int saved_errno = errno;
-			free(buf);
-			*result = buf = NULL;
-			*bufsize = 0;
-			errno = saved_errno;
 			efi_error("could not read from file");
 			return -1;
 		}
-		filesize += s;
+
 		/* only exit for empty reads */
 		if (s == 0)
 			break;
-		if (filesize >= size) {
+
+		if (p == &probe) {
+			uint8_t *newbuf;
+
 			/* See if we're going to overrun and return an error
 			 * instead. */
-			if (size > (size_t)-1 - 4096) {
-				free(buf);
-				*result = buf = NULL;
-				*bufsize = 0;
+			if (*bufsize > SSIZE_MAX / 2) {
 				errno = ENOMEM;
 				efi_error("could not read from file");
 				return -1;
 			}
-			newbuf = realloc(buf, size + 4096);
-			if (newbuf == NULL) {
-				int saved_errno = errno;
-				free(buf);
-				*result = buf = NULL;
-				*bufsize = 0;
-				errno = saved_errno;
+			newbuf = realloc(*buf, *bufsize * 2);
+			if (!newbuf) {
 				efi_error("could not allocate memory");
 				return -1;
 			}
-			buf = newbuf;
-			memset(buf + size, '\0', 4096);
-			size += 4096;
+			*buf = newbuf;
+			*bufsize *= 2;
+			(*buf)[len] = probe;
 		}
-	} while (1);
+		len += s;
+	}
+
+	(*buf)[len] = '\0';
+	*filesize = len;
+	return 0;
+}
+
+static inline int UNUSED
+read_file(int fd, uint8_t **result, size_t *bufsize)
+{
+	uint8_t *buf = NULL;
+	size_t size = 0;
+	size_t filesize = 0;
+	uint8_t *newbuf;
 
-	newbuf = realloc(buf, filesize+1);
-	if (!newbuf) {
+	if (read_file_reuse(fd, &buf, &size, &filesize) < 0) {
+		__typeof__(errno) errno_value = errno;
 		free(buf);
-		*result = buf = NULL;
-		efi_error("could not allocate memory");
+		*result = NULL;
+		*bufsize = 0;
+		errno = errno_value;
 		return -1;
 	}
-	newbuf[filesize] = '\0';
-	*result = newbuf;
-	*bufsize = filesize+1;
+
+	/* hand back only what we used if we had to guess */
+	if (size > filesize + 1) {
+		newbuf = realloc(buf, filesize + 1);
+		if (newbuf)
+			buf = newbuf;
+	}
+	*result = buf;
+	*bufsize = filesize + 1;
 	return 0;
 }
 
@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * varindex.c - small records of every variable, for finding out later
+ *		whether anything changed
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "efivar.h"
+#include "sha256.h"
+
+#define EFIVAR_INDEX_MAGIC 0xf3df159au
+#define EFIVAR_INDEX_VERSION 2
+
+/*
+ * The file is:
+ * struct {
+ *	uint32_t magic;
+ *	uint32_t version;
+ *	uint32_t n_entries;
+ *	uint32_t reserved;
+ *	struct {
+ *		efi_guid_t guid;
+ *		uint32_t attributes;
+ *		uint32_t data_size;
+ *		uint8_t sha256[32];	// of the data
+ *		uint16_t name_size;	// in bytes, with the NUL
+ *		char name[];		// UTF-8
+ *	} entries[];
+ *	uint32_t crc32;			// of everything before it
+ * }
+ * in the host's byte order, like exported variables.  Version 1 had the
+ * CRC32 of the data instead of its SHA-256, which two different values
+ * of the same size can share just by chance.  The CRC32 at the end is
+ * only there to catch a damaged file.
+ */
+struct index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_entries;
+	uint32_t reserved;
+};
+
+struct index_entry {
+	efi_guid_t guid;
+	uint32_t attributes;
+	uint32_t data_size;
+	uint8_t sha256[SHA256_DIGEST_SIZE];
+	uint16_t name_size;
+} PACKED;
+
+static void
+data_sha256(const uint8_t *data, size_t size,
+	    uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	struct sha256_ctx ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, size);
+	sha256_final(&ctx, digest);
+}
+
+static int
+write_all(int fd, const uint8_t *buf, size_t size)
+{
+	while (size) {
+		ssize_t rc = write(fd, buf, size);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			efi_error("write failed");
+			return -1;
+		}
+		buf += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+int PUBLIC
+efi_variables_index_save(int fd)
+{
+	efi_variable_snapshot_t *snapshot = NULL;
+	struct index_header *hdr;
+	uint8_t *buf = NULL, *ptr;
+	size_t n, size;
+	uint32_t crc;
+	int rc = -1;
+
+	if (efi_variables_snapshot(&snapshot) < 0) {
+		efi_error("could not read variables");
+		return -1;
+	}
+	n = efi_variables_snapshot_count(snapshot);
+
+	size = sizeof(*hdr) + sizeof(crc);
+	for (size_t i = 0; i < n; i++) {
+		efi_variable_t *var = efi_variables_snapshot_get(snapshot, i);
+		size_t namesz = strlen((char *)var->name) + 1;
+
+		if (namesz > UINT16_MAX || var->data_size > UINT32_MAX) {
+			errno = EOVERFLOW;
+			efi_error("variable \"%s\" is too big to index",
+				  var->name);
+			goto err;
+		}
+		size += sizeof(struct index_entry) + namesz;
+	}
+
+	ptr = buf = malloc(size);
+	if (!buf) {
+		efi_error("could not allocate %zu bytes", size);
+		goto err;
+	}
+
+	hdr = (struct index_header *)ptr;
+	hdr->magic = EFIVAR_INDEX_MAGIC;
+	hdr->version = EFIVAR_INDEX_VERSION;
+	hdr->n_entries = n;
+	hdr->reserved = 0;
+	ptr += sizeof(*hdr);
+
+	for (size_t i = 0; i < n; i++) {
+		efi_variable_t *var = efi_variables_snapshot_get(snapshot, i);
+		struct index_entry entry = {
+			.guid = *var->guid,
+			.attributes = var->attrs,
+			.data_size = var->data_size,
+			.name_size = strlen((char *)var->name) + 1,
+		};
+
+		data_sha256(var->data, var->data_size, entry.sha256);
+
+		memcpy(ptr, &entry, sizeof(entry));
+		ptr += sizeof(entry);
+		memcpy(ptr, var->name, entry.name_size);
+		ptr += entry.name_size;
+	}
+
+	crc = efi_crc32(buf, ptr - buf);
+	memcpy(ptr, &crc, sizeof(crc));
+
+	rc = write_all(fd, buf, size);
+err:
+	free(buf);
+	efi_variables_snapshot_free(snapshot);
+	return rc;
+}
+
+/*
+ * Check the file over and put every entry in map, keyed the way the
+ * variable is, pointing at the entry in buf.  The names are already
+ * NUL-terminated where they are.
+ */
+static int
+index_parse(uint8_t *buf, size_t size, efi_guid_map_t *map)
+{
+	struct index_header hdr;
+	uint8_t *ptr, *end;
+	uint32_t crc;
+
+	if (size < sizeof(hdr) + sizeof(crc))
+		goto bad;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != EFIVAR_INDEX_MAGIC)
+		goto bad;
+	if (hdr.version != EFIVAR_INDEX_VERSION) {
+		errno = ENOTSUP;
+		efi_error("unsupported variable index version %u",
+			  hdr.version);
+		return -1;
+	}
+
+	end = buf + size - sizeof(crc);
+	memcpy(&crc, end, sizeof(crc));
+	if (crc != efi_crc32(buf, end - buf))
+		goto bad;
+
+	ptr = buf + sizeof(hdr);
+	for (uint32_t i = 0; i < hdr.n_entries; i++) {
+		struct index_entry entry;
+		const char *name;
+
+		if ((size_t)(end - ptr) < sizeof(entry))
+			goto bad;
+		memcpy(&entry, ptr, sizeof(entry));
+		name = (const char *)ptr + sizeof(entry);
+		if (entry.name_size == 0 ||
+		    (size_t)(end - ptr) < sizeof(entry) + entry.name_size ||
+		    name[entry.name_size - 1] != '\0')
+			goto bad;
+
+		if (efi_guid_map_set(map, &entry.guid, name, ptr) < 0)
+			return -1;
+		ptr += sizeof(entry) + entry.name_size;
+	}
+	if (ptr != end)
+		goto bad;
+	return 0;
+bad:
+	errno = EINVAL;
+	efi_error("not a valid variable index");
+	return -1;
+}
+
+/*
+ * Whether the variable is different now from what entry says.  The
+ * size and attributes are enough to tell most of the time, and they
+ * don't need the data read.
+ */
+static int
+index_entry_changed(const efi_guid_t *guid, const char *name,
+		    const uint8_t *ptr)
+{
+	struct index_entry entry;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	uint8_t *data = NULL;
+	size_t size = 0;
+	uint32_t attributes = 0;
+	int rc;
+
+	memcpy(&entry, ptr, sizeof(entry));
+
+	rc = efi_get_variable_info(*guid, name, &size, &attributes);
+	if (rc < 0)
+		return -1;
+	if (size != entry.data_size || attributes != entry.attributes)
+		return 1;
+
+	rc = efi_get_variable(*guid, name, &data, &size, &attributes);
+	if (rc < 0)
+		return -1;
+	data_sha256(data, size, digest);
+	rc = size != entry.data_size || attributes != entry.attributes ||
+	     memcmp(digest, entry.sha256, sizeof(digest));
+	free(data);
+	return rc;
+}
+
+int PUBLIC
+efi_variables_index_compare(int fd, efi_variable_index_cb_t *cb,
+			    void *closure)
+{
+	efi_guid_map_t *map = NULL;
+	efi_varname_iter_t *iter = NULL;
+	efi_guid_t *guid = NULL;
+	char *name = NULL;
+	uint8_t *buf = NULL;
+	size_t bufsize = 0;
+	int changes = 0;
+	int rc;
+
+	rc = read_file(fd, &buf, &bufsize);
+	if (rc < 0) {
+		efi_error("could not read variable index");
+		return -1;
+	}
+	/* read_file() counts the NUL it adds */
+	bufsize -= 1;
+
+	map = efi_guid_map_new();
+	if (!map || index_parse(buf, bufsize, map) < 0)
+		goto err;
+
+	if (efi_varname_iter_new(&iter) < 0) {
+		efi_error("could not list variables");
+		goto err;
+	}
+	while ((rc = efi_varname_iter_next(iter, &guid, &name)) > 0) {
+		efi_variable_index_change_t change;
+		void *entry = NULL;
+
+		if (efi_guid_map_del(map, guid, name, &entry) < 0) {
+			change = EFI_VARIABLE_INDEX_ADDED;
+		} else {
+			rc = index_entry_changed(guid, name, entry);
+			if (rc < 0 && errno == ENOENT) {
+				/* it went away while we were looking */
+				efi_error_clear();
+				change = EFI_VARIABLE_INDEX_DELETED;
+			} else if (rc < 0) {
+				efi_error("could not read variable");
+				goto err;
+			} else if (rc == 0) {
+				continue;
+			} else {
+				change = EFI_VARIABLE_INDEX_CHANGED;
+			}
+		}
+
+		changes++;
+		if (!cb || cb(change, guid, name, closure))
+			goto done;
+	}
+	if (rc < 0) {
+		efi_error("could not list variables");
+		goto err;
+	}
+
+	for (size_t pos = 0;
+	     efi_guid_map_next(map, &pos, (const efi_guid_t **)&guid,
+			       (const char **)&name, NULL) > 0; ) {
+		changes++;
+		if (!cb || cb(EFI_VARIABLE_INDEX_DELETED, guid, name, closure))
+			break;
+	}
+done:
+	efi_varname_iter_free(iter);
+	efi_guid_map_free(map);
+	free(buf);
+	return changes;
+err:
+	efi_varname_iter_free(iter);
+	efi_guid_map_free(map);
+	free(buf);
+	return -1;
+}
+
+// vim:fenc=utf-8:tw=75:noet
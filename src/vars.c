@@ -9,7 +9,9 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,22 +20,52 @@
 #include <sys/utsname.h>
 
 #include "efivar.h"
+#include "stats.h"
+#include "trace.h"
 
 static const char default_vars_path[] = "/sys/firmware/efi/vars/";
 
+/*
+ * What only needs finding out about the vars directory once: where it
+ * is, a descriptor for it that everything else is opened relative to,
+ * and which raw_var layout the kernel uses.  vars_init() does all of it
+ * the first time any of it is wanted, from whichever thread gets there
+ * first.
+ */
+static const char *vars_path;
+static int vars_dfd = -1;
+static int vars_dfd_errno;
+static int sixtyfour_bit = -1;
+static pthread_once_t vars_once = PTHREAD_ONCE_INIT;
+
+static void vars_init(void);
+
 static const char *
 get_vars_path(void)
 {
-	static const char *path;
-	if (path)
-		return path;
-
-	path = getenv("VARS_PATH");
-	if (!path)
-		path = default_vars_path;
-	return path;
+	pthread_once(&vars_once, vars_init);
+	return vars_path;
 }
 
+static int
+get_vars_dfd(void)
+{
+	pthread_once(&vars_once, vars_init);
+	if (vars_dfd < 0) {
+		errno = vars_dfd_errno;
+		efi_error("could not open %s", vars_path);
+	}
+	return vars_dfd;
+}
+
+static void DESTRUCTOR
+vars_fini(void)
+{
+	if (vars_dfd >= 0) {
+		close(vars_dfd);
+		vars_dfd = -1;
+	}
+}
 
 typedef struct efi_kernel_variable_32_t {
 	uint16_t	VariableName[1024/sizeof(uint16_t)];
@@ -113,25 +145,18 @@ get_file_data_size(int dfd, char *name)
  * Submit your patch here today!
  */
 static int
-is_64bit(void)
+detect_64bit(void)
 {
-	static int sixtyfour_bit = -1;
-	DIR *dir = NULL;
-	int dfd = -1;
-	int saved_errno;
-
-	if (sixtyfour_bit != -1)
-		return sixtyfour_bit;
+	DIR *dir;
+	int dfd;
+	int ret = -1;
 
-	dir = opendir(get_vars_path());
+	dir = opendir(vars_path);
 	if (!dir)
-		goto err;
+		return -1;
 
 	dfd = dirfd(dir);
-	if (dfd < 0)
-		goto err;
-
-	while (1) {
+	while (dfd >= 0) {
 		struct dirent *entry = readdir(dir);
 		if (entry == NULL)
 			break;
@@ -140,189 +165,171 @@ is_64bit(void)
 			continue;
 
 		ssize_t size = get_file_data_size(dfd, entry->d_name);
-		if (size < 0) {
+		if (size < 0)
 			continue;
-		} else if (size == 2084) {
-			sixtyfour_bit = 1;
-		} else {
-			sixtyfour_bit = 0;
-		}
-
-		errno = 0;
+		ret = size == 2084;
 		break;
 	}
-	if (sixtyfour_bit == -1)
-		sixtyfour_bit = __SIZEOF_POINTER__ == 4 ? 0 : 1;
-err:
-	saved_errno = errno;
+	if (dfd >= 0 && ret == -1)
+		ret = __SIZEOF_POINTER__ == 4 ? 0 : 1;
 
-	if (dir)
-		closedir(dir);
-
-	errno = saved_errno;
-	return sixtyfour_bit;
+	closedir(dir);
+	return ret;
 }
 
-static int
-get_size_from_file(const char *filename, size_t *retsize)
+static void
+vars_init(void)
 {
-	uint8_t *buf = NULL;
-	size_t bufsize = -1;
-	int errno_value;
-	int ret = -1;
-	int fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		efi_error("open(%s, O_RDONLY) failed", filename);
-		goto err;
-	}
+	int saved_errno = errno;
 
-	int rc = read_file(fd, &buf, &bufsize);
-	if (rc < 0) {
-		efi_error("read_file(%s) failed", filename);
-		goto err;
-	}
+	vars_path = getenv("VARS_PATH");
+	if (!vars_path)
+		vars_path = default_vars_path;
 
-	long long size = strtoll((char *)buf, NULL, 0);
-	if ((size == LLONG_MIN || size == LLONG_MAX) && errno == ERANGE) {
-		*retsize = -1;
-	} else if (size < 0) {
-		*retsize = -1;
+	vars_dfd = open(vars_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (vars_dfd < 0) {
+		vars_dfd_errno = errno;
 	} else {
-		*retsize = (size_t)size;
-		ret = 0;
+		sixtyfour_bit = detect_64bit();
+		debug("%s has %d-bit variables", vars_path,
+		      sixtyfour_bit ? 64 : 32);
 	}
-err:
-	errno_value = errno;
-
-	if (fd >= 0)
-		close(fd);
-
-	if (buf != NULL)
-		free(buf);
+	errno = saved_errno;
+}
 
-	errno = errno_value;
-	return ret;
+static inline int
+is_64bit(void)
+{
+	pthread_once(&vars_once, vars_init);
+	return sixtyfour_bit;
 }
 
+/* longest "$name-$guid/$file" there can be under the vars directory */
+#define VARS_FILE_NAME_MAX	(NAME_MAX + sizeof("/attributes"))
 
 static int
-vars_probe(void)
+vars_file_name(char *buf, size_t bufsize, efi_guid_t *guid,
+	       const char *name, const char *file)
 {
-	char *newvar;
+	int rc;
 
-	/* If we can't tell if it's 64bit or not, this interface is no good. */
-	if (is_64bit() < 0) {
-		efi_error("is_64bit() failed");
-		return 0;
-	}
-	if (asprintfa(&newvar, "%s%s", get_vars_path(), "new_var") < 0) {
-		efi_error("asprintfa failed");
-		return 0;
+	rc = snprintf(buf, bufsize, "%s-" GUID_FORMAT "%s%s", name,
+		      GUID_FORMAT_ARGS(guid), file[0] ? "/" : "", file);
+	if (rc < 0 || (size_t)rc >= bufsize) {
+		errno = ENAMETOOLONG;
+		efi_error("variable name \"%s\" is too long", name);
+		return -1;
 	}
-	if (!access(newvar, F_OK))
-		return 1;
-	efi_error("access(%s, F_OK) failed", newvar);
 	return 0;
 }
 
+/* open one of a variable's files, or "" for its directory */
 static int
-vars_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
+vars_open(efi_guid_t *guid, const char *name, const char *file, int flags)
 {
-	int errno_value;
-	int ret = -1;
+	char fname[VARS_FILE_NAME_MAX];
+	int dfd, fd;
 
-	char *path = NULL;
-	int rc = asprintf(&path, "%s%s-"GUID_FORMAT"/size", get_vars_path(),
-			  name, GUID_FORMAT_ARGS(&guid));
-	if (rc < 0) {
-		efi_error("asprintf failed");
-		goto err;
-	}
+	dfd = get_vars_dfd();
+	if (dfd < 0)
+		return -1;
+	if (vars_file_name(fname, sizeof(fname), guid, name, file) < 0)
+		return -1;
 
-	size_t retsize = 0;
-	rc = get_size_from_file(path, &retsize);
-	if (rc >= 0) {
-		ret = 0;
-		*size = retsize;
-	} else if (rc < 0) {
-		efi_error("get_size_from_file(%s) failed", path);
-	}
-err:
-	errno_value = errno;
+	fd = openat(dfd, fname, flags | O_CLOEXEC);
+	if (fd < 0)
+		efi_error("openat(%s%s) failed", vars_path, fname);
+	return fd;
+}
 
-	if (path)
-		free(path);
+/* read up to bufsize bytes of fd, and close it */
+static ssize_t
+read_raw_var(int fd, uint8_t *buf, size_t bufsize)
+{
+	size_t total = 0;
+	int saved_errno;
 
-	errno = errno_value;
-	return ret;
+	while (total < bufsize) {
+		ssize_t sz = read(fd, buf + total, bufsize - total);
+		if (sz < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (sz < 0) {
+			saved_errno = errno;
+			close(fd);
+			errno = saved_errno;
+			return -1;
+		}
+		if (sz == 0)
+			break;
+		total += sz;
+	}
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return total;
 }
 
 static int
-vars_get_variable_attributes(efi_guid_t guid, const char *name,
-			    uint32_t *attributes)
+vars_probe(void)
 {
-	int ret = -1;
+	int dfd;
 
-	uint8_t *data;
-	size_t data_size;
-	uint32_t attribs;
+	dfd = get_vars_dfd();
+	if (dfd < 0)
+		return 0;
 
-	ret = efi_get_variable(guid, name, &data, &data_size, &attribs);
-	if (ret < 0) {
-		efi_error("efi_get_variable() failed");
-		return ret;
+	/* If we can't tell if it's 64bit or not, this interface is no good. */
+	if (is_64bit() < 0) {
+		efi_error("is_64bit() failed");
+		return 0;
 	}
-
-	*attributes = attribs;
-	if (data)
-		free(data);
-	return ret;
+	if (!faccessat(dfd, "new_var", F_OK, 0))
+		return 1;
+	efi_error("access(%snew_var, F_OK) failed", vars_path);
+	return 0;
 }
 
 static int
-vars_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
-		  size_t *data_size, uint32_t *attributes)
+vars_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
 {
-	int errno_value;
-	int ret = -1;
-	uint8_t *buf = NULL;
-	size_t bufsize = -1;
-	char *path = NULL;
-	int rc;
-	int fd = -1;
-	int ratelimit;
-
-	/*
-	 * The kernel rate limiter hits us if we go faster than 100 efi
-	 * variable reads per second as non-root.  So if we're not root, just
-	 * delay this long after each read.  The user is not going to notice.
-	 *
-	 * 1s / 100 = 10000us.
-	 */
-	ratelimit = geteuid() == 0 ? 0 : 10000;
-
-	rc = asprintf(&path, "%s%s-" GUID_FORMAT "/raw_var", get_vars_path(),
-		      name, GUID_FORMAT_ARGS(&guid));
-	if (rc < 0) {
-		efi_error("asprintf failed");
-		goto err;
-	}
+	char buf[32];
+	unsigned long long value;
+	char *end;
+	ssize_t sz;
+	int fd;
+
+	fd = vars_open(&guid, name, "size", O_RDONLY);
+	if (fd < 0)
+		return -1;
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		efi_error("open(%s, O_RDONLY) failed", path);
-		goto err;
+	sz = read_raw_var(fd, (uint8_t *)buf, sizeof(buf) - 1);
+	if (sz < 0) {
+		efi_error("could not read %s-"GUID_FORMAT"/size", name,
+			  GUID_FORMAT_ARGS(&guid));
+		return -1;
 	}
+	buf[sz] = '\0';
 
-	usleep(ratelimit);
-	rc = read_file(fd, &buf, &bufsize);
-	if (rc < 0) {
-		efi_error("read_file(%s) failed", path);
-		goto err;
+	errno = 0;
+	value = strtoull(buf, &end, 0);
+	if (end == buf || errno == ERANGE || value > SSIZE_MAX) {
+		errno = EINVAL;
+		efi_error("could not parse %s-"GUID_FORMAT"/size", name,
+			  GUID_FORMAT_ARGS(&guid));
+		return -1;
 	}
+	*size = value;
+	return 0;
+}
 
-	bufsize -= 1; /* read_file pads out 1 extra byte to NUL it */
-
+/*
+ * Find the data, size, and attributes inside a raw_var buffer, without
+ * copying anything.
+ */
+static int
+parse_raw_var(uint8_t *buf, size_t bufsize, uint8_t **data,
+	      size_t *data_size, uint32_t *attributes)
+{
 	if (is_64bit()) {
 		efi_kernel_variable_64_t *var64;
 
@@ -330,16 +337,17 @@ vars_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 			errno = EFBIG;
 			efi_error("file size is wrong for 64-bit variable (%zd of %zd)",
 				  bufsize, sizeof(efi_kernel_variable_64_t));
-			goto err;
+			return -1;
 		}
 
 		var64 = (void *)buf;
-		*data = malloc(var64->DataSize);
-		if (!*data) {
-			efi_error("malloc failed");
-			goto err;
+		if (var64->DataSize > sizeof(var64->Data)) {
+			errno = EFBIG;
+			efi_error("variable data size is too large (%"PRIu64" of %zd)",
+				  var64->DataSize, sizeof(var64->Data));
+			return -1;
 		}
-		memcpy(*data, var64->Data, var64->DataSize);
+		*data = var64->Data;
 		*data_size = var64->DataSize;
 		*attributes = var64->Attributes;
 	} else {
@@ -349,66 +357,129 @@ vars_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
 			efi_error("file size is wrong for 32-bit variable (%zd of %zd)",
 				  bufsize, sizeof(efi_kernel_variable_32_t));
 			errno = EFBIG;
-			goto err;
+			return -1;
 		}
 
 		var32 = (void *)buf;
-		*data = malloc(var32->DataSize);
-		if (!*data) {
-			efi_error("malloc failed");
-			goto err;
+		if (var32->DataSize > sizeof(var32->Data)) {
+			errno = EFBIG;
+			efi_error("variable data size is too large (%"PRIu32" of %zd)",
+				  var32->DataSize, sizeof(var32->Data));
+			return -1;
 		}
-		memcpy(*data, var32->Data, var32->DataSize);
+		*data = var32->Data;
 		*data_size = var32->DataSize;
 		*attributes = var32->Attributes;
 	}
+	return 0;
+}
 
-	ret = 0;
-err:
-	errno_value = errno;
+/*
+ * Reading any of a variable's files is a GetVariable() call in the
+ * kernel, so raw_var, which has everything in it, is the one to read.
+ * This reads it from fd, which it closes.  buf needs to be big enough
+ * for either ABI plus a byte, to notice if it's neither; data points
+ * into it.
+ */
+static int
+vars_read_variable(int fd, efi_guid_t *guid, const char *name, uint8_t *buf,
+		   size_t *bufsize, uint8_t **data, size_t *data_size,
+		   uint32_t *attributes)
+{
+	ssize_t sz;
 
-	if (buf)
-		free(buf);
+	efi_ratelimit();
+	sz = read_raw_var(fd, buf, *bufsize);
+	if (sz < 0) {
+		efi_error("could not read %s-"GUID_FORMAT"/raw_var", name,
+			  GUID_FORMAT_ARGS(guid));
+		return -1;
+	}
+	*bufsize = sz;
 
-	if (fd >= 0)
-		close(fd);
+	if (parse_raw_var(buf, sz, data, data_size, attributes) < 0) {
+		efi_error("parse_raw_var(%s-"GUID_FORMAT"/raw_var) failed",
+			  name, GUID_FORMAT_ARGS(guid));
+		return -1;
+	}
+	return 0;
+}
 
-	if (path)
-		free(path);
+static int
+vars_get_variable_attributes(efi_guid_t guid, const char *name,
+			    uint32_t *attributes)
+{
+	uint8_t buf[sizeof(efi_kernel_variable_64_t) + 1];
+	size_t bufsize = sizeof(buf);
+	uint8_t *data;
+	size_t data_size;
+	int fd;
 
-	errno = errno_value;
+	fd = vars_open(&guid, name, "raw_var", O_RDONLY);
+	if (fd < 0)
+		return -1;
+	return vars_read_variable(fd, &guid, name, buf, &bufsize, &data,
+				  &data_size, attributes);
+}
+
+static int
+vars_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
+		  size_t *data_size, uint32_t *attributes)
+{
+	uint8_t buf[sizeof(efi_kernel_variable_64_t) + 1];
+	size_t bufsize = sizeof(buf);
+	uint8_t *var_data = NULL;
+	size_t var_data_size = 0;
+	uint32_t var_attributes = 0;
+	int ret = -1;
+	int fd;
+
+	tracepoint(libefivar, get_variable_entry, &guid, name);
+
+	fd = vars_open(&guid, name, "raw_var", O_RDONLY);
+	if (fd < 0 ||
+	    vars_read_variable(fd, &guid, name, buf, &bufsize, &var_data,
+			       &var_data_size, &var_attributes) < 0)
+		goto err;
+
+	*data = malloc(var_data_size ? var_data_size : 1);
+	if (!*data) {
+		efi_error("malloc failed");
+		goto err;
+	}
+	memcpy(*data, var_data, var_data_size);
+	*data_size = var_data_size;
+	*attributes = var_attributes;
+	stats_inc(vars_reads);
+	stats_add(vars_read_bytes, var_data_size);
+
+	ret = 0;
+err:
+	tracepoint(libefivar, get_variable_return, &guid, name, ret,
+		   ret < 0 ? 0 : var_data_size);
 	return ret;
 }
 
 static int
 vars_del_variable(efi_guid_t guid, const char *name)
 {
+	uint8_t buf[sizeof(efi_kernel_variable_64_t) + 1];
+	ssize_t buf_size;
 	int errno_value;
 	int ret = -1;
-	char *path = NULL;
 	int rc;
-	int fd = -1;
-	uint8_t *buf = NULL;
-	size_t buf_size = 0;
-	char *delvar;
-
-	rc = asprintf(&path, "%s%s-" GUID_FORMAT "/raw_var", get_vars_path(),
-		      name, GUID_FORMAT_ARGS(&guid));
-	if (rc < 0) {
-		efi_error("asprintf failed");
-		goto err;
-	}
+	int fd;
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		efi_error("open(%s, O_RDONLY) failed", path);
+	tracepoint(libefivar, del_variable_entry, &guid, name);
+
+	fd = vars_open(&guid, name, "raw_var", O_RDONLY);
+	if (fd < 0)
 		goto err;
-	}
 
-	rc = read_file(fd, &buf, &buf_size);
-	buf_size -= 1; /* read_file pads out 1 extra byte to NUL it */
-	if (rc < 0) {
-		efi_error("read_file(%s) failed", path);
+	buf_size = read_raw_var(fd, buf, sizeof(buf));
+	if (buf_size < 0) {
+		efi_error("could not read %s-"GUID_FORMAT"/raw_var", name,
+			  GUID_FORMAT_ARGS(&guid));
 		goto err;
 	}
 
@@ -422,61 +493,47 @@ vars_del_variable(efi_guid_t guid, const char *name)
 		goto err;
 	}
 
-	if (asprintfa(&delvar, "%s%s", get_vars_path(), "del_var") < 0) {
-		efi_error("asprintfa() failed");
-		goto err;
-	}
-
-	close(fd);
-	fd = open(delvar, O_WRONLY);
+	fd = openat(vars_dfd, "del_var", O_WRONLY|O_CLOEXEC);
 	if (fd < 0) {
-		efi_error("open(%s, O_WRONLY) failed", delvar);
+		efi_error("open(%sdel_var, O_WRONLY) failed", vars_path);
 		goto err;
 	}
 
 	rc = write(fd, buf, buf_size);
-	if (rc >= 0)
+	if (rc >= 0) {
+		stats_inc(vars_deletes);
 		ret = 0;
-	else
+	} else {
 		efi_error("write() failed");
-err:
+	}
 	errno_value = errno;
-
-	if (buf)
-		free(buf);
-
-	if (fd >= 0)
-		close(fd);
-
-	if (path)
-		free(path);
-
+	close(fd);
 	errno = errno_value;
+err:
+	tracepoint(libefivar, del_variable_return, &guid, name, ret);
 	return ret;
 }
 
 static int
-_vars_chmod_variable(char *path, mode_t mode)
+_vars_chmod_variable(efi_guid_t *guid, const char *name, mode_t mode)
 {
 	mode_t mask = umask(umask(0));
 	char *files[] = {
 		"", "attributes", "data", "guid", "raw_var", "size", NULL
 		};
+	char fname[VARS_FILE_NAME_MAX];
 
 	int saved_errno = 0;
 	int ret = 0;
+	int dfd = get_vars_dfd();
+	if (dfd < 0)
+		return -1;
 	for (int i = 0; files[i] != NULL; i++) {
-		char *new_path = NULL;
-		int rc = asprintf(&new_path, "%s/%s", path, files[i]);
-		if (rc > 0) {
-			rc = chmod(new_path, mode & ~mask);
-			if (rc < 0) {
-				if (saved_errno == 0)
-					saved_errno = errno;
-				ret = -1;
-			}
-			free(new_path);
-		} else if (rc < 0) {
+		int rc = vars_file_name(fname, sizeof(fname), guid, name,
+					files[i]);
+		if (rc >= 0)
+			rc = fchmodat(dfd, fname, mode & ~mask, 0);
+		if (rc < 0) {
 			if (saved_errno == 0)
 				saved_errno = errno;
 			ret = -1;
@@ -494,19 +551,9 @@ vars_chmod_variable(efi_guid_t guid, const char *name, mode_t mode)
 		return -1;
 	}
 
-	char *path;
-	int rc = asprintf(&path, "%s%s-" GUID_FORMAT, get_vars_path(),
-			  name, GUID_FORMAT_ARGS(&guid));
-	if (rc < 0) {
-		efi_error("asprintf failed");
-		return -1;
-	}
-
-	rc = _vars_chmod_variable(path, mode);
-	int saved_errno = errno;
-	efi_error("_vars_chmod_variable() failed");
-	free(path);
-	errno = saved_errno;
+	int rc = _vars_chmod_variable(&guid, name, mode);
+	if (rc < 0)
+		efi_error("_vars_chmod_variable() failed");
 	return rc;
 }
 
@@ -514,10 +561,11 @@ static int
 vars_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 		 size_t data_size, uint32_t attributes, mode_t mode)
 {
+	char fname[VARS_FILE_NAME_MAX];
 	int errno_value;
-	size_t len;
 	int ret = -1;
 	int fd = -1;
+	int dfd;
 
 	if (strlen(name) > 1024) {
 		efi_error("variable name size is too large (%zd of 1024)",
@@ -532,26 +580,28 @@ vars_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 		return -1;
 	}
 
-	char *path;
-	int rc = asprintf(&path, "%s%s-" GUID_FORMAT "/data", get_vars_path(),
-			  name, GUID_FORMAT_ARGS(&guid));
-	if (rc < 0) {
-		efi_error("asprintf failed");
+	tracepoint(libefivar, set_variable_entry, &guid, name, data_size,
+		   attributes);
+
+	dfd = get_vars_dfd();
+	if (dfd < 0)
 		goto err;
-	}
 
-	len = rc;
+	int rc = vars_file_name(fname, sizeof(fname), &guid, name, "data");
+	if (rc < 0)
+		goto err;
 
-	if (!access(path, F_OK)) {
+	if (!faccessat(dfd, fname, F_OK, 0)) {
 		rc = efi_del_variable(guid, name);
 		if (rc < 0) {
 			efi_error("efi_del_variable failed");
 			goto err;
 		}
 	}
-	char *newvar;
-	if (asprintfa(&newvar, "%s%s", get_vars_path(), "new_var") < 0) {
-		efi_error("asprintfa failed");
+
+	fd = openat(dfd, "new_var", O_WRONLY|O_CLOEXEC);
+	if (fd < 0) {
+		efi_error("open(%snew_var, O_WRONLY) failed", vars_path);
 		goto err;
 	}
 
@@ -567,12 +617,6 @@ vars_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 			var64.VariableName[i] = name[i];
 		memcpy(var64.Data, data, data_size);
 
-		fd = open(newvar, O_WRONLY);
-		if (fd < 0) {
-			efi_error("open(%s, O_WRONLY) failed", newvar);
-			goto err;
-		}
-
 		rc = write(fd, &var64, sizeof(var64));
 	} else {
 		efi_kernel_variable_32_t var32 = {
@@ -585,30 +629,26 @@ vars_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
 			var32.VariableName[i] = name[i];
 		memcpy(var32.Data, data, data_size);
 
-		fd = open(newvar, O_WRONLY);
-		if (fd < 0) {
-			efi_error("open(%s, O_WRONLY) failed", newvar);
-			goto err;
-		}
-
 		rc = write(fd, &var32, sizeof(var32));
 	}
 
-	if (rc >= 0)
+	if (rc >= 0) {
+		stats_inc(vars_writes);
+		stats_add(vars_write_bytes, data_size);
 		ret = 0;
-	else
+	} else {
 		efi_error("write() failed");
+	}
 
 	/* this is inherently racy, but there's no way to do it correctly with
 	 * this kernel API.  Fortunately, all directory contents get created
 	 * with root.root ownership and an effective umask of 177 */
-	path[len-5] = '\0';
-	_vars_chmod_variable(path, mode);
+	errno_value = errno;
+	_vars_chmod_variable(&guid, name, mode);
+	errno = errno_value;
 err:
 	errno_value = errno;
-
-	if (path)
-		free(path);
+	tracepoint(libefivar, set_variable_return, &guid, name, ret);
 
 	if (fd >= 0)
 		close(fd);
@@ -617,6 +657,117 @@ err:
 	return ret;
 }
 
+/*
+ * The kernel hands whatever attributes are written to a variable's
+ * raw_var straight to SetVariable(), EFI_VARIABLE_APPEND_WRITE included,
+ * so an append is just the existing entry written back with only the new
+ * data in it.  Kernels that refuse that say EINVAL, and for those we fall
+ * back to reading, deleting, and rewriting the whole thing.
+ */
+static int
+vars_append_variable(efi_guid_t guid, const char *name, uint8_t *data,
+		     size_t data_size, uint32_t attributes)
+{
+	uint8_t buf[sizeof(efi_kernel_variable_64_t) + 1];
+	size_t bufsize = sizeof(buf);
+	uint8_t *old_data = NULL;
+	size_t old_data_size = 0;
+	uint32_t old_attributes = 0;
+	char fname[VARS_FILE_NAME_MAX];
+	int errno_value;
+	int ret = -1;
+	int fd;
+	int rc;
+
+	if (get_vars_dfd() < 0 ||
+	    vars_file_name(fname, sizeof(fname), &guid, name, "raw_var") < 0)
+		return -1;
+
+	fd = openat(vars_dfd, fname, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return vars_set_variable(guid, name, data, data_size,
+					attributes & ~EFI_VARIABLE_APPEND_WRITE,
+					0600);
+		efi_error("openat(%s%s) failed", vars_path, fname);
+		goto err;
+	}
+
+	rc = vars_read_variable(fd, &guid, name, buf, &bufsize, &old_data,
+				&old_data_size, &old_attributes);
+	if (rc < 0)
+		goto err;
+
+	if ((old_attributes | EFI_VARIABLE_APPEND_WRITE) !=
+	    (attributes | EFI_VARIABLE_APPEND_WRITE)) {
+		errno = EINVAL;
+		efi_error("attributes don't match existing variable");
+		goto err;
+	}
+
+	attributes |= EFI_VARIABLE_APPEND_WRITE;
+	if (is_64bit()) {
+		efi_kernel_variable_64_t *var64 = (void *)buf;
+
+		if (data_size > sizeof(var64->Data)) {
+			errno = ENOSPC;
+			efi_error("variable data size is too large (%zd of %zd)",
+				  data_size, sizeof(var64->Data));
+			goto err;
+		}
+		var64->DataSize = data_size;
+		var64->Attributes = attributes;
+		memcpy(var64->Data, data, data_size);
+		bufsize = sizeof(*var64);
+	} else {
+		efi_kernel_variable_32_t *var32 = (void *)buf;
+
+		if (data_size > sizeof(var32->Data)) {
+			errno = ENOSPC;
+			efi_error("variable data size is too large (%zd of %zd)",
+				  data_size, sizeof(var32->Data));
+			goto err;
+		}
+		var32->DataSize = data_size;
+		var32->Attributes = attributes;
+		memcpy(var32->Data, data, data_size);
+		bufsize = sizeof(*var32);
+	}
+
+	fd = openat(vars_dfd, fname, O_WRONLY|O_CLOEXEC);
+	if (fd < 0) {
+		efi_error("openat(%s%s) failed", vars_path, fname);
+		goto err;
+	}
+	rc = write(fd, buf, bufsize);
+	errno_value = errno;
+	close(fd);
+	errno = errno_value;
+
+	if (rc < 0 && errno == EINVAL) {
+		rc = generic_append_variable(guid, name, data, data_size,
+					     attributes);
+		if (rc < 0)
+			efi_error("generic_append_variable() failed");
+	} else if (rc < 0) {
+		efi_error("write() failed");
+	}
+	if (rc >= 0)
+		ret = 0;
+err:
+	return ret;
+}
+
+static int
+vars_varname_iter_open(struct efi_varname_iter *iter)
+{
+	int rc;
+	rc = generic_varname_iter_open(get_vars_path(), iter);
+	if (rc < 0)
+		efi_error("generic_varname_iter_open failed");
+	return rc;
+}
+
 static int
 vars_get_next_variable_name(efi_guid_t **guid, char **name)
 {
@@ -628,16 +779,81 @@ vars_get_next_variable_name(efi_guid_t **guid, char **name)
 	return rc;
 }
 
+static int
+vars_snapshot_variables(efi_variable_snapshot_t *snapshot)
+{
+	const char *path = get_vars_path();
+	struct efi_varname_iter iter = { .dfd = -1, };
+	int ret = -1;
+
+	if (generic_varname_iter_open(path, &iter) < 0)
+		return -1;
+
+	while (1) {
+		uint8_t buf[sizeof(efi_kernel_variable_64_t) + 1];
+		char raw_var[NAME_MAX + sizeof("/raw_var")];
+		ssize_t namelen;
+		size_t bufsize = sizeof(buf);
+		uint8_t *data = NULL;
+		size_t data_size = 0;
+		uint32_t attributes = 0;
+		int fd;
+		int rc;
+
+		namelen = generic_varname_iter_next_entry(&iter);
+		if (namelen == 0)
+			break;
+		if (namelen < 0)
+			goto err;
+
+		snprintf(raw_var, sizeof(raw_var), "%s/raw_var", iter.entry);
+		fd = openat(iter.dfd, raw_var, O_RDONLY|O_CLOEXEC);
+		if (fd < 0) {
+			if (errno == ENOENT)
+				continue;
+			efi_error("openat(%s) failed", raw_var);
+			goto err;
+		}
+
+		rc = vars_read_variable(fd, &iter.guid, iter.entry, buf,
+					&bufsize, &data, &data_size,
+					&attributes);
+		if (rc < 0)
+			goto err;
+
+		rc = snapshot_entry_start(snapshot, &iter.guid, iter.entry,
+					  namelen);
+		if (rc < 0)
+			goto err;
+
+		uint8_t *dest = snapshot_entry_reserve(snapshot, data_size);
+		if (!dest) {
+			snapshot_entry_abort(snapshot);
+			goto err;
+		}
+		memcpy(dest, data, data_size);
+		snapshot_entry_commit(snapshot, attributes, 0, data_size);
+	}
+
+	ret = 0;
+err:
+	generic_varname_iter_close(&iter);
+	return ret;
+}
+
 struct efi_var_operations vars_ops = {
 	.name = "vars",
 	.probe = vars_probe,
 	.set_variable = vars_set_variable,
 	.del_variable = vars_del_variable,
+	.append_variable = vars_append_variable,
 	.get_variable = vars_get_variable,
 	.get_variable_attributes = vars_get_variable_attributes,
 	.get_variable_size = vars_get_variable_size,
 	.get_next_variable_name = vars_get_next_variable_name,
 	.chmod_variable = vars_chmod_variable,
+	.snapshot_variables = vars_snapshot_variables,
+	.varname_iter_open = vars_varname_iter_open,
 };
 
 // vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,560 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * varstore-test.c - check the varstore backend against synthetic stores
+ */
+
+#include "fix_coverity.h"
+
+#include <efivar.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PROGRAM_NAME "varstore-test"
+
+/*
+ * These follow the layouts in varstore.c, which follow edk2's; the test
+ * builds its stores by hand so it doesn't rely on the code it checks.
+ */
+#define FV_SIGNATURE		0x4856465f
+#define FV_HEADER_LENGTH	0x48
+#define VARSTORE_FORMATTED	0x5a
+#define VARSTORE_HEALTHY	0xfe
+#define VARIABLE_START_ID	0x55aa
+
+#define VAR_HEADER_VALID_ONLY	0x7f
+#define VAR_ADDED		0x3f
+#define VAR_REPLACING		0x3e	/* VAR_ADDED & VAR_IN_DELETED_TRANSITION */
+#define VAR_REPLACED		0x3c	/* ... & VAR_DELETED */
+#define VAR_REMOVED		0x3d	/* VAR_ADDED & VAR_DELETED */
+
+#define ATTRS (EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS | \
+	       EFI_VARIABLE_RUNTIME_ACCESS)
+
+struct fv_header {
+	uint8_t zero_vector[16];
+	efi_guid_t filesystem_guid;
+	uint64_t length;
+	uint32_t signature;
+	uint32_t attributes;
+	uint16_t header_length;
+	uint16_t checksum;
+	uint16_t ext_header_offset;
+	uint8_t reserved;
+	uint8_t revision;
+} __attribute__((__packed__));
+
+struct varstore_header {
+	efi_guid_t signature;
+	uint32_t size;
+	uint8_t format;
+	uint8_t state;
+	uint16_t reserved;
+	uint32_t reserved1;
+} __attribute__((__packed__));
+
+struct variable_header {
+	uint16_t start_id;
+	uint8_t state;
+	uint8_t reserved;
+	uint32_t attributes;
+	uint32_t name_size;
+	uint32_t data_size;
+	efi_guid_t vendor_guid;
+} __attribute__((__packed__));
+
+struct auth_variable_header {
+	uint16_t start_id;
+	uint8_t state;
+	uint8_t reserved;
+	uint32_t attributes;
+	uint64_t monotonic_count;
+	efi_time_t timestamp;
+	uint32_t pubkey_index;
+	uint32_t name_size;
+	uint32_t data_size;
+	efi_guid_t vendor_guid;
+} __attribute__((__packed__));
+
+struct auth2_header {
+	efi_time_t timestamp;
+	uint32_t length;
+	uint16_t revision;
+	uint16_t cert_type;
+	efi_guid_t cert_guid;
+} __attribute__((__packed__));
+
+static const efi_guid_t auth_guid =
+	EFI_GUID(0xaaf32c78,0x947b,0x439a,0xa180,0x2e,0x14,0x4e,0xc3,0x77,0x92);
+static const efi_guid_t plain_guid =
+	EFI_GUID(0xddcf3616,0x3275,0x4164,0x98b6,0xfe,0x85,0x70,0x7f,0xfe,0x7d);
+static const efi_guid_t test_guid =
+	EFI_GUID(0x0a2f256e,0x5e4c,0x4fa1,0x9a5b,0x13,0x94,0xdc,0x06,0x0b,0x8e);
+
+static const char *store_path;
+static bool store_auth;
+
+/* a store under construction, before it's written out */
+struct store {
+	uint8_t *buf;
+	size_t size;
+	size_t used;
+	bool auth;
+};
+
+static size_t
+record_header_size(bool auth)
+{
+	return auth ? sizeof(struct auth_variable_header)
+		    : sizeof(struct variable_header);
+}
+
+static uint8_t *
+store_base(uint8_t *buf)
+{
+	return buf + FV_HEADER_LENGTH + sizeof(struct varstore_header);
+}
+
+static void
+store_new(struct store *store, bool auth, size_t store_size)
+{
+	struct fv_header *fv;
+	struct varstore_header *hdr;
+	size_t size = FV_HEADER_LENGTH + store_size;
+
+	store->buf = malloc(size);
+	if (!store->buf)
+		err(1, "could not allocate memory");
+	memset(store->buf, 0xff, size);
+	memset(store->buf, 0, FV_HEADER_LENGTH + sizeof(*hdr));
+
+	fv = (struct fv_header *)store->buf;
+	fv->length = size;
+	fv->signature = FV_SIGNATURE;
+	fv->header_length = FV_HEADER_LENGTH;
+	fv->revision = 2;
+
+	hdr = (struct varstore_header *)(store->buf + FV_HEADER_LENGTH);
+	hdr->signature = auth ? auth_guid : plain_guid;
+	hdr->size = store_size;
+	hdr->format = VARSTORE_FORMATTED;
+	hdr->state = VARSTORE_HEALTHY;
+
+	store->size = size;
+	store->used = 0;
+	store->auth = auth;
+}
+
+static void
+store_add(struct store *store, uint8_t state, const char *name,
+	  const char *data)
+{
+	size_t hdr_size = record_header_size(store->auth);
+	size_t name_size = (strlen(name) + 1) * 2;
+	size_t data_size = strlen(data);
+	uint8_t *rec = store_base(store->buf) + store->used;
+	struct variable_header plain = {
+		.start_id = VARIABLE_START_ID,
+		.state = state,
+		.attributes = ATTRS,
+		.name_size = name_size,
+		.data_size = data_size,
+		.vendor_guid = test_guid,
+	};
+	struct auth_variable_header auth = {
+		.start_id = VARIABLE_START_ID,
+		.state = state,
+		.attributes = ATTRS,
+		.name_size = name_size,
+		.data_size = data_size,
+		.vendor_guid = test_guid,
+	};
+	uint8_t *ucs2;
+
+	if (store->auth)
+		memcpy(rec, &auth, sizeof(auth));
+	else
+		memcpy(rec, &plain, sizeof(plain));
+	ucs2 = rec + hdr_size;
+	memset(ucs2, 0, name_size);
+	for (size_t i = 0; name[i]; i++)
+		ucs2[i * 2] = name[i];
+	memcpy(ucs2 + name_size, data, data_size);
+	store->used += (hdr_size + name_size + data_size + 3) & ~(size_t)3;
+}
+
+static void
+store_write(struct store *store, const char *path)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, store->buf, store->size) != (ssize_t)store->size)
+		err(1, "could not write \"%s\"", path);
+	close(fd);
+	free(store->buf);
+	store->buf = NULL;
+}
+
+/*
+ * Print every record in the store file as it is on disk, dead ones too,
+ * so the state bits each operation leaves behind can be checked.  The
+ * library maps the file shared, so reading it sees what it's done.
+ */
+static void
+dump_store(void)
+{
+	size_t hdr_size = record_header_size(store_auth);
+	struct stat sb;
+	uint8_t *buf, *base;
+	size_t len, off = 0;
+	int fd;
+
+	fd = open(store_path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &sb) < 0)
+		err(1, "could not open \"%s\"", store_path);
+	buf = malloc(sb.st_size);
+	if (!buf || read(fd, buf, sb.st_size) != sb.st_size)
+		err(1, "could not read \"%s\"", store_path);
+	close(fd);
+
+	base = store_base(buf);
+	len = ((struct varstore_header *)(buf + FV_HEADER_LENGTH))->size -
+	      sizeof(struct varstore_header);
+	while (off <= len && len - off >= hdr_size) {
+		struct variable_header *plain = (void *)(base + off);
+		struct auth_variable_header *auth = (void *)(base + off);
+		uint32_t name_size, data_size, attributes;
+		uint8_t state;
+		uint8_t *name;
+
+		if (plain->start_id != VARIABLE_START_ID)
+			break;
+		if (store_auth) {
+			state = auth->state;
+			attributes = auth->attributes;
+			name_size = auth->name_size;
+			data_size = auth->data_size;
+		} else {
+			state = plain->state;
+			attributes = plain->attributes;
+			name_size = plain->name_size;
+			data_size = plain->data_size;
+		}
+		name = base + off + hdr_size;
+
+		printf("  %04zx %02hhx %08x ", off, state, attributes);
+		for (uint32_t i = 0; i + 1 < name_size && name[i]; i += 2)
+			putchar(name[i]);
+		printf(" \"%.*s\"", (int)data_size, name + name_size);
+		if (store_auth && auth->timestamp.year)
+			printf(" %04hu-%02hhu-%02hhu", auth->timestamp.year,
+			       auth->timestamp.month, auth->timestamp.day);
+		printf("\n");
+		off += (hdr_size + name_size + data_size + 3) & ~(size_t)3;
+	}
+	free(buf);
+}
+
+static void
+check(const char *what, int rc, int expected_errno)
+{
+	if (rc >= 0)
+		printf("%s: ok\n", what);
+	else
+		printf("%s: %s\n", what, strerror(errno));
+	if ((rc >= 0) != !expected_errno ||
+	    (rc < 0 && errno != expected_errno))
+		errx(1, "%s did not do what it should have", what);
+	efi_error_clear();
+}
+
+static void
+set_var(const char *name, const char *data, int expected_errno)
+{
+	char what[64];
+
+	snprintf(what, sizeof(what), "set %s \"%s\"", name, data);
+	check(what, efi_set_variable(test_guid, name, (uint8_t *)data,
+				     strlen(data), ATTRS, 0600),
+	      expected_errno);
+	dump_store();
+}
+
+static void
+append_var(const char *name, const char *data, int expected_errno)
+{
+	char what[64];
+
+	snprintf(what, sizeof(what), "append %s \"%s\"", name, data);
+	check(what, efi_append_variable(test_guid, name, (uint8_t *)data,
+					strlen(data), ATTRS),
+	      expected_errno);
+	dump_store();
+}
+
+static void
+del_var(const char *name, int expected_errno)
+{
+	char what[64];
+
+	snprintf(what, sizeof(what), "delete %s", name);
+	check(what, efi_del_variable(test_guid, name), expected_errno);
+	dump_store();
+}
+
+static void
+get_var(const char *name, int expected_errno)
+{
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	uint32_t attributes = 0;
+	char what[64];
+	int rc;
+
+	snprintf(what, sizeof(what), "get %s", name);
+	rc = efi_get_variable(test_guid, name, &data, &data_size, &attributes);
+	if (rc >= 0)
+		printf("%s: \"%.*s\" %08x\n", what, (int)data_size, data,
+		       attributes);
+	else
+		check(what, rc, expected_errno);
+	if ((rc >= 0) != !expected_errno)
+		errx(1, "%s did not do what it should have", what);
+	free(data);
+}
+
+static void
+list_vars(void)
+{
+	efi_guid_t *guid = NULL;
+	char *name = NULL;
+	int rc;
+
+	printf("names:");
+	while ((rc = efi_get_next_variable_name(&guid, &name)) > 0)
+		printf(" %s", name);
+	printf("\n");
+	if (rc < 0)
+		err(1, "could not list variables");
+}
+
+static void
+test_operations(void)
+{
+	set_var("Test", "one", 0);
+	get_var("Test", 0);
+	set_var("Test", "two", 0);
+	/* the same data again doesn't add a record */
+	set_var("Test", "two", 0);
+	append_var("Test", "+three", 0);
+	append_var("Test", "", EINVAL);
+	append_var("Other", "new", 0);
+	list_vars();
+	del_var("Other", 0);
+	get_var("Other", ENOENT);
+	del_var("Other", ENOENT);
+	/* an empty write is a delete */
+	set_var("Test", "", 0);
+	get_var("Test", ENOENT);
+	list_vars();
+}
+
+static void
+test_authenticated(void)
+{
+	struct {
+		struct auth2_header hdr;
+		char payload[8];
+	} __attribute__((__packed__)) buf = {
+		.hdr = {
+			.timestamp = { .year = 2024, .month = 3, .day = 14 },
+			.length = sizeof(struct auth2_header) -
+				  sizeof(efi_time_t),
+			.revision = 0x0200,
+			.cert_type = 0x0ef1,
+		},
+		.payload = "payload",
+	};
+	uint32_t attributes = ATTRS |
+		EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS;
+
+	/* without payload's NUL */
+	check("set Auth with a timestamp",
+	      efi_set_variable(test_guid, "Auth", (uint8_t *)&buf,
+			       sizeof(buf) - 1, attributes, 0600), 0);
+	dump_store();
+	get_var("Auth", 0);
+	check("set Auth with a truncated header",
+	      efi_set_variable(test_guid, "Auth", (uint8_t *)&buf,
+			       sizeof(buf.hdr) - 1, attributes, 0600), EINVAL);
+}
+
+/* each copy fills a quarter of the store, so this has to reclaim */
+static void
+test_reclaim(void)
+{
+	static const char * const values[] = {
+		"aaaaaaaaaaaaaaaa", "bbbbbbbbbbbbbbbb", "cccccccccccccccc",
+		"dddddddddddddddd", "eeeeeeeeeeeeeeee",
+	};
+	uint8_t huge[256];
+
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+		set_var("Test", values[i], 0);
+	get_var("Keep", 0);
+	get_var("Test", 0);
+
+	memset(huge, 'h', sizeof(huge));
+	check("set Huge", efi_set_variable(test_guid, "Huge", huge,
+					   sizeof(huge), ATTRS, 0600), ENOSPC);
+	dump_store();
+}
+
+/*
+ * Records left behind by a write that stopped partway: the old copy is
+ * only given up on once the new one is all there.
+ */
+static void
+test_recovery(void)
+{
+	get_var("Torn", 0);
+	get_var("Done", 0);
+	get_var("Gone", ENOENT);
+	list_vars();
+	set_var("Torn", "fixed", 0);
+	get_var("Torn", 0);
+}
+
+static void
+test_headers(void)
+{
+	get_var("Test", EINVAL);
+}
+
+static const char *scratch_dir;
+
+static const char *
+scratch(const char *name)
+{
+	static char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s", scratch_dir, name);
+	return path;
+}
+
+/*
+ * Run test in a process of its own, so the library opens the store for
+ * the first time and indexes it from scratch.
+ */
+static int
+run(const char *title, const char *path, bool auth, void (*test)(void))
+{
+	pid_t pid;
+	int status;
+
+	printf("%s:\n", title);
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		err(1, "could not fork");
+	if (pid == 0) {
+		store_path = path;
+		store_auth = auth;
+		setenv("LIBEFIVAR_OPS", "varstore", 1);
+		setenv("LIBEFIVAR_VARSTORE", path, 1);
+		test();
+		fflush(stdout);
+		exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		err(1, "could not wait for the test");
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		warnx("%s failed", title);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct store store;
+	const char *path;
+	int rc = 0;
+
+	if (argc != 2)
+		errx(1, "usage: %s <scratch directory>", PROGRAM_NAME);
+	scratch_dir = argv[1];
+
+	for (int auth = 0; auth < 2; auth++) {
+		store_new(&store, auth, 4096);
+		store_write(&store, path = scratch("operations.fd"));
+		if (run(auth ? "authenticated store" : "plain store", path,
+			auth, test_operations) < 0)
+			rc = 1;
+	}
+
+	store_new(&store, true, 4096);
+	store_write(&store, path = scratch("authenticated.fd"));
+	if (run("time based authenticated writes", path, true,
+		test_authenticated) < 0)
+		rc = 1;
+
+	store_new(&store, false, sizeof(struct varstore_header) + 240);
+	store_add(&store, VAR_REPLACED, "Test", "xxxxxxxxxxxxxxxx");
+	store_add(&store, VAR_ADDED, "Keep", "kept");
+	store_write(&store, path = scratch("reclaim.fd"));
+	if (run("reclaiming deleted space", path, false, test_reclaim) < 0)
+		rc = 1;
+
+	for (int auth = 0; auth < 2; auth++) {
+		store_new(&store, auth, 4096);
+		store_add(&store, VAR_REPLACING, "Torn", "old");
+		store_add(&store, VAR_HEADER_VALID_ONLY, "Torn", "new");
+		store_add(&store, VAR_REPLACING, "Done", "old");
+		store_add(&store, VAR_ADDED, "Done", "new");
+		store_add(&store, VAR_REMOVED, "Gone", "old");
+		store_write(&store, path = scratch("recovery.fd"));
+		if (run(auth ? "interrupted writes, authenticated"
+			     : "interrupted writes, plain",
+			path, auth, test_recovery) < 0)
+			rc = 1;
+	}
+
+	store_new(&store, false, 4096);
+	((struct varstore_header *)(store.buf + FV_HEADER_LENGTH))->state = 0xff;
+	store_write(&store, path = scratch("unhealthy.fd"));
+	if (run("store not marked healthy", path, false, test_headers) < 0)
+		rc = 1;
+
+	store_new(&store, false, 4096);
+	((struct varstore_header *)(store.buf + FV_HEADER_LENGTH))->format = 0xff;
+	store_write(&store, path = scratch("unformatted.fd"));
+	if (run("store not formatted", path, false, test_headers) < 0)
+		rc = 1;
+
+	store_new(&store, false, 4096);
+	((struct fv_header *)store.buf)->signature = 0;
+	store_write(&store, path = scratch("nofv.fd"));
+	if (run("not a firmware volume", path, false, test_headers) < 0)
+		rc = 1;
+
+	store_new(&store, false, 4096);
+	((struct fv_header *)store.buf)->length = store.size * 2;
+	store_write(&store, path = scratch("short.fd"));
+	if (run("firmware volume longer than the file", path, false,
+		test_headers) < 0)
+		rc = 1;
+
+	return rc;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,1149 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * varstore.c - variables in an edk2 variable store file, like OVMF_VARS.fd
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "efivar.h"
+#include "ucs2.h"
+
+/*
+ * LIBEFIVAR_VARSTORE=<path> points the library at a firmware volume
+ * holding an edk2 variable store, the way OVMF keeps its NVRAM, rather
+ * than at the running system's variables.  The file is mapped shared and
+ * edited as edk2 itself would edit flash: a write marks the old copy of
+ * a variable as going away, adds the new copy at the end of the used
+ * space, and then marks the old one deleted, so a firmware that finds
+ * the file half written still sees one good copy.  When the end is
+ * reached the live variables are packed down over the deleted ones.
+ * Unlike edk2 that happens in place, without a spare block to recover
+ * from, so a crash during a reclaim can leave the store unreadable.
+ *
+ * Time based authenticated writes have their EFI_VARIABLE_AUTHENTICATION_2
+ * header stripped and its timestamp kept, but the signature isn't checked
+ * against anything; whoever can write the file can change the keys.
+ */
+
+#define FV_SIGNATURE		0x4856465f	/* "_FVH" */
+
+struct fv_header {
+	uint8_t zero_vector[16];
+	efi_guid_t filesystem_guid;
+	uint64_t length;
+	uint32_t signature;
+	uint32_t attributes;
+	uint16_t header_length;
+	uint16_t checksum;
+	uint16_t ext_header_offset;
+	uint8_t reserved;
+	uint8_t revision;
+} PACKED;
+
+#define VARSTORE_FORMATTED	0x5a
+#define VARSTORE_HEALTHY	0xfe
+
+struct varstore_header {
+	efi_guid_t signature;
+	uint32_t size;
+	uint8_t format;
+	uint8_t state;
+	uint16_t reserved;
+	uint32_t reserved1;
+} PACKED;
+
+#define VARSTORE_AUTH_GUID \
+	EFI_GUID(0xaaf32c78,0x947b,0x439a,0xa180,0x2e,0x14,0x4e,0xc3,0x77,0x92)
+#define VARSTORE_PLAIN_GUID \
+	EFI_GUID(0xddcf3616,0x3275,0x4164,0x98b6,0xfe,0x85,0x70,0x7f,0xfe,0x7d)
+
+#define VARIABLE_START_ID	0x55aa
+
+/*
+ * A variable's state only ever has bits cleared, since that's all flash
+ * can do without an erase, so these get ANDed into it.
+ */
+#define VAR_IN_DELETED_TRANSITION	0xfe
+#define VAR_DELETED			0xfd
+#define VAR_HEADER_VALID_ONLY		0x7f
+#define VAR_ADDED			0x3f
+
+struct variable_header {
+	uint16_t start_id;
+	uint8_t state;
+	uint8_t reserved;
+	uint32_t attributes;
+	uint32_t name_size;
+	uint32_t data_size;
+	efi_guid_t vendor_guid;
+} PACKED;
+
+struct auth_variable_header {
+	uint16_t start_id;
+	uint8_t state;
+	uint8_t reserved;
+	uint32_t attributes;
+	uint64_t monotonic_count;
+	efi_time_t timestamp;
+	uint32_t pubkey_index;
+	uint32_t name_size;
+	uint32_t data_size;
+	efi_guid_t vendor_guid;
+} PACKED;
+
+/* what's in front of the data in a time based authenticated write */
+struct auth2_header {
+	efi_time_t timestamp;
+	uint32_t length;
+	uint16_t revision;
+	uint16_t cert_type;
+	efi_guid_t cert_guid;
+} PACKED;
+
+/* where a variable's pieces are, whichever header it has */
+struct varstore_rec {
+	uint8_t *state;
+	uint32_t attributes;
+	efi_time_t *timestamp;
+	efi_guid_t guid;
+	uint16_t *name;
+	uint32_t name_size;
+	uint8_t *data;
+	uint32_t data_size;
+	size_t size;
+};
+
+struct varstore_var {
+	struct varstore_var *next;
+	uint32_t hash;
+	efi_guid_t guid;
+	char *name;
+	size_t offset;
+};
+
+#define VARSTORE_MIN_BUCKETS	64
+
+static pthread_mutex_t varstore_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t varstore_once = PTHREAD_ONCE_INIT;
+static int varstore_errno = ENOENT;
+static int varstore_fd = -1;
+static bool varstore_readonly;
+static uint8_t *varstore_map;
+static size_t varstore_map_size;
+static uint8_t *varstore_base;
+static size_t varstore_len;
+static size_t varstore_used;
+static bool varstore_auth;
+static struct varstore_var **varstore_buckets;
+static size_t varstore_n_buckets;
+static size_t varstore_n_vars;
+
+static size_t
+varstore_header_size(void)
+{
+	return varstore_auth ? sizeof(struct auth_variable_header)
+			     : sizeof(struct variable_header);
+}
+
+/*
+ * Fill in rec for the header at offset, if there is one and it fits in
+ * the store.
+ */
+static int
+varstore_parse(size_t offset, struct varstore_rec *rec)
+{
+	size_t hdr_size = varstore_header_size();
+	uint8_t *hdr = varstore_base + offset;
+	size_t size;
+
+	if (offset > varstore_len || varstore_len - offset < hdr_size)
+		return -1;
+
+	if (varstore_auth) {
+		struct auth_variable_header *var = (void *)hdr;
+
+		if (var->start_id != VARIABLE_START_ID)
+			return -1;
+		rec->state = &var->state;
+		rec->attributes = var->attributes;
+		rec->timestamp = &var->timestamp;
+		rec->guid = var->vendor_guid;
+		rec->name_size = var->name_size;
+		rec->data_size = var->data_size;
+	} else {
+		struct variable_header *var = (void *)hdr;
+
+		if (var->start_id != VARIABLE_START_ID)
+			return -1;
+		rec->state = &var->state;
+		rec->attributes = var->attributes;
+		rec->timestamp = NULL;
+		rec->guid = var->vendor_guid;
+		rec->name_size = var->name_size;
+		rec->data_size = var->data_size;
+	}
+
+	size = (size_t)rec->name_size + rec->data_size;
+	if (size > varstore_len - offset - hdr_size)
+		return -1;
+	if (rec->name_size < sizeof(uint16_t) || rec->name_size % 2)
+		return -1;
+
+	rec->name = (uint16_t *)(hdr + hdr_size);
+	rec->data = hdr + hdr_size + rec->name_size;
+	size += hdr_size;
+	rec->size = ALIGN_UP(size, 4);
+	return 0;
+}
+
+static bool
+varstore_live(uint8_t state)
+{
+	return state == VAR_ADDED ||
+	       state == (VAR_ADDED & VAR_IN_DELETED_TRANSITION);
+}
+
+/* FNV-1a over the guid and then the name */
+static uint32_t
+varstore_hash(const efi_guid_t *guid, const char *name)
+{
+	const uint8_t *p = (const uint8_t *)guid;
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < sizeof(*guid); i++)
+		hash = (hash ^ p[i]) * 16777619u;
+	for (p = (const uint8_t *)name; *p; p++)
+		hash = (hash ^ *p) * 16777619u;
+	return hash;
+}
+
+static struct varstore_var **
+varstore_find(const efi_guid_t *guid, const char *name, uint32_t hash)
+{
+	struct varstore_var **varp;
+
+	if (!varstore_n_buckets)
+		return NULL;
+
+	varp = &varstore_buckets[hash & (varstore_n_buckets - 1)];
+	for (; *varp; varp = &(*varp)->next) {
+		if ((*varp)->hash == hash &&
+		    !memcmp(&(*varp)->guid, guid, sizeof(*guid)) &&
+		    !strcmp((*varp)->name, name))
+			return varp;
+	}
+	return NULL;
+}
+
+static int
+varstore_grow(void)
+{
+	struct varstore_var **buckets;
+	size_t n_buckets;
+
+	if (varstore_n_vars < varstore_n_buckets)
+		return 0;
+
+	n_buckets = varstore_n_buckets ? varstore_n_buckets * 2
+				       : VARSTORE_MIN_BUCKETS;
+	buckets = calloc(n_buckets, sizeof(*buckets));
+	if (!buckets) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	for (size_t i = 0; i < varstore_n_buckets; i++) {
+		struct varstore_var *var, *next;
+
+		for (var = varstore_buckets[i]; var; var = next) {
+			size_t bucket = var->hash & (n_buckets - 1);
+
+			next = var->next;
+			var->next = buckets[bucket];
+			buckets[bucket] = var;
+		}
+	}
+
+	free(varstore_buckets);
+	varstore_buckets = buckets;
+	varstore_n_buckets = n_buckets;
+	return 0;
+}
+
+static struct varstore_var *
+varstore_index_add(const efi_guid_t *guid, const char *name, uint32_t hash,
+		   size_t offset)
+{
+	struct varstore_var **varp;
+	struct varstore_var *var;
+
+	if (varstore_grow() < 0)
+		return NULL;
+
+	var = calloc(1, sizeof(*var));
+	if (!var) {
+		efi_error("could not allocate memory");
+		return NULL;
+	}
+	var->name = strdup(name);
+	if (!var->name) {
+		efi_error("could not allocate memory");
+		free(var);
+		return NULL;
+	}
+	var->hash = hash;
+	var->guid = *guid;
+	var->offset = offset;
+
+	varp = &varstore_buckets[hash & (varstore_n_buckets - 1)];
+	var->next = *varp;
+	*varp = var;
+	varstore_n_vars++;
+	return var;
+}
+
+static void
+varstore_index_del(struct varstore_var **varp)
+{
+	struct varstore_var *var = *varp;
+
+	*varp = var->next;
+	varstore_n_vars--;
+	free(var->name);
+	free(var);
+}
+
+/*
+ * Walk the store from the top, indexing every variable that's live and
+ * finding where the used space ends.  A variable that was in the middle
+ * of being replaced only counts if its replacement never got finished.
+ */
+static int
+varstore_index(void)
+{
+	struct varstore_rec rec;
+	size_t offset = 0;
+
+	while (varstore_parse(offset, &rec) == 0) {
+		struct varstore_var **varp;
+		uint32_t hash;
+		char *name;
+
+		if (!varstore_live(*rec.state))
+			goto next;
+
+		name = (char *)ucs2_to_utf8(rec.name, rec.name_size / 2);
+		if (!name) {
+			efi_error("could not allocate memory");
+			return -1;
+		}
+		hash = varstore_hash(&rec.guid, name);
+		varp = varstore_find(&rec.guid, name, hash);
+		if (!varp) {
+			if (!varstore_index_add(&rec.guid, name, hash, offset)) {
+				free(name);
+				return -1;
+			}
+		} else if (*rec.state == VAR_ADDED) {
+			(*varp)->offset = offset;
+		}
+		free(name);
+next:
+		offset += rec.size;
+	}
+
+	varstore_used = offset < varstore_len ? offset : varstore_len;
+	return 0;
+}
+
+static int
+varstore_check_headers(void)
+{
+	struct fv_header *fv = (void *)varstore_map;
+	efi_guid_t auth_guid = VARSTORE_AUTH_GUID;
+	efi_guid_t plain_guid = VARSTORE_PLAIN_GUID;
+	struct varstore_header *store;
+
+	if (varstore_map_size < sizeof(*fv) || fv->signature != FV_SIGNATURE) {
+		efi_error("not a firmware volume");
+		return -1;
+	}
+	if (fv->length > varstore_map_size ||
+	    fv->header_length < sizeof(*fv) ||
+	    fv->length < (uint64_t)fv->header_length + sizeof(*store)) {
+		efi_error("firmware volume header is corrupt");
+		return -1;
+	}
+
+	store = (void *)(varstore_map + fv->header_length);
+	if (!efi_guid_cmp(&store->signature, &auth_guid)) {
+		varstore_auth = true;
+	} else if (!efi_guid_cmp(&store->signature, &plain_guid)) {
+		varstore_auth = false;
+	} else {
+		efi_error("firmware volume has no variable store");
+		return -1;
+	}
+	if (store->format != VARSTORE_FORMATTED ||
+	    store->state != VARSTORE_HEALTHY ||
+	    store->size < sizeof(*store) ||
+	    store->size > fv->length - fv->header_length) {
+		efi_error("variable store header is corrupt");
+		return -1;
+	}
+
+	varstore_base = (uint8_t *)store + sizeof(*store);
+	varstore_len = store->size - sizeof(*store);
+	return 0;
+}
+
+static void
+varstore_init(void)
+{
+	const char *path = getenv("LIBEFIVAR_VARSTORE");
+	struct stat sb;
+	int prot = PROT_READ|PROT_WRITE;
+
+	if (!path || !*path)
+		return;
+
+	varstore_fd = open(path, O_RDWR|O_CLOEXEC);
+	if (varstore_fd < 0 &&
+	    (errno == EACCES || errno == EROFS || errno == EPERM)) {
+		varstore_fd = open(path, O_RDONLY|O_CLOEXEC);
+		varstore_readonly = true;
+		prot = PROT_READ;
+	}
+	if (varstore_fd < 0) {
+		varstore_errno = errno;
+		efi_error("could not open \"%s\"", path);
+		return;
+	}
+
+	if (fstat(varstore_fd, &sb) < 0 || sb.st_size <= 0) {
+		varstore_errno = errno ? errno : EINVAL;
+		efi_error("could not stat \"%s\"", path);
+		goto err;
+	}
+	varstore_map_size = sb.st_size;
+	varstore_map = mmap(NULL, varstore_map_size, prot, MAP_SHARED,
+			    varstore_fd, 0);
+	if (varstore_map == MAP_FAILED) {
+		varstore_map = NULL;
+		varstore_errno = errno;
+		efi_error("could not map \"%s\"", path);
+		goto err;
+	}
+
+	if (varstore_check_headers() < 0) {
+		varstore_errno = EINVAL;
+		goto err;
+	}
+	if (varstore_index() < 0) {
+		varstore_errno = ENOMEM;
+		goto err;
+	}
+	return;
+err:
+	if (varstore_map)
+		munmap(varstore_map, varstore_map_size);
+	varstore_map = NULL;
+	close(varstore_fd);
+	varstore_fd = -1;
+}
+
+static int
+varstore_enter(void)
+{
+	pthread_once(&varstore_once, varstore_init);
+	if (!varstore_map) {
+		errno = varstore_errno;
+		efi_error("no variable store is open");
+		return -1;
+	}
+	pthread_mutex_lock(&varstore_lock);
+	return 0;
+}
+
+static void
+varstore_leave(void)
+{
+	__typeof__(errno) errno_value = errno;
+	pthread_mutex_unlock(&varstore_lock);
+	errno = errno_value;
+}
+
+static int
+varstore_probe(void)
+{
+	/* only when LIBEFIVAR_VARSTORE names a store we can use */
+	pthread_once(&varstore_once, varstore_init);
+	return varstore_map ? 1 : 0;
+}
+
+/* Look a variable up and parse its header.  Call with varstore_lock held. */
+static struct varstore_var **
+varstore_lookup(const efi_guid_t *guid, const char *name,
+		struct varstore_rec *rec)
+{
+	struct varstore_var **varp;
+
+	varp = varstore_find(guid, name, varstore_hash(guid, name));
+	if (!varp || varstore_parse((*varp)->offset, rec) < 0) {
+		errno = ENOENT;
+		efi_error("variable not found");
+		return NULL;
+	}
+	return varp;
+}
+
+static int
+varstore_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
+		      size_t *data_size, uint32_t *attributes)
+{
+	struct varstore_rec rec;
+	uint8_t *buf;
+	int ret = -1;
+
+	if (varstore_enter() < 0)
+		return -1;
+	if (!varstore_lookup(&guid, name, &rec))
+		goto err;
+
+	/* the other backends always hand back a buffer, and NUL it */
+	buf = malloc(rec.data_size + 1);
+	if (!buf) {
+		efi_error("could not allocate memory");
+		goto err;
+	}
+	memcpy(buf, rec.data, rec.data_size);
+	buf[rec.data_size] = '\0';
+
+	*data = buf;
+	*data_size = rec.data_size;
+	*attributes = rec.attributes;
+	ret = 0;
+err:
+	varstore_leave();
+	return ret;
+}
+
+static int
+varstore_get_variable_into(efi_guid_t guid, const char *name, uint8_t *buf,
+			   size_t bufsz, size_t *data_size,
+			   uint32_t *attributes)
+{
+	struct varstore_rec rec;
+	int ret = -1;
+
+	if (varstore_enter() < 0)
+		return -1;
+	if (!varstore_lookup(&guid, name, &rec))
+		goto err;
+
+	*data_size = rec.data_size;
+	if (rec.data_size > bufsz) {
+		errno = ENOSPC;
+		goto err;
+	}
+	memcpy(buf, rec.data, rec.data_size);
+	*attributes = rec.attributes;
+	ret = 0;
+err:
+	varstore_leave();
+	return ret;
+}
+
+static int
+varstore_get_variable_info(efi_guid_t guid, const char *name, size_t *size,
+			   uint32_t *attributes)
+{
+	struct varstore_rec rec;
+	int ret = -1;
+
+	if (varstore_enter() < 0)
+		return -1;
+	if (varstore_lookup(&guid, name, &rec)) {
+		if (size)
+			*size = rec.data_size;
+		if (attributes)
+			*attributes = rec.attributes;
+		ret = 0;
+	}
+	varstore_leave();
+	return ret;
+}
+
+static int
+varstore_get_variable_attributes(efi_guid_t guid, const char *name,
+				 uint32_t *attributes)
+{
+	return varstore_get_variable_info(guid, name, NULL, attributes);
+}
+
+static int
+varstore_get_variable_size(efi_guid_t guid, const char *name, size_t *size)
+{
+	return varstore_get_variable_info(guid, name, size, NULL);
+}
+
+static int
+varstore_cmp_offset(const void *a, const void *b)
+{
+	const struct varstore_var *va = *(const struct varstore_var **)a;
+	const struct varstore_var *vb = *(const struct varstore_var **)b;
+
+	return va->offset < vb->offset ? -1 : va->offset > vb->offset;
+}
+
+/*
+ * Pack the live variables down to the top of the store, in the order
+ * they were in, and erase everything after them.  Call with
+ * varstore_lock held.
+ */
+static int
+varstore_reclaim(void)
+{
+	struct varstore_var **vars;
+	uint8_t *buf;
+	size_t n = 0;
+	size_t used = 0;
+
+	buf = malloc(varstore_len);
+	vars = calloc(varstore_n_vars ? varstore_n_vars : 1, sizeof(*vars));
+	if (!buf || !vars) {
+		free(buf);
+		free(vars);
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	for (size_t i = 0; i < varstore_n_buckets; i++)
+		for (struct varstore_var *var = varstore_buckets[i]; var;
+		     var = var->next)
+			vars[n++] = var;
+	qsort(vars, n, sizeof(*vars), varstore_cmp_offset);
+
+	memset(buf, 0xff, varstore_len);
+	for (size_t i = 0; i < n; i++) {
+		struct varstore_rec rec;
+		size_t len;
+
+		if (varstore_parse(vars[i]->offset, &rec) < 0)
+			continue;
+		len = varstore_header_size() + rec.name_size + rec.data_size;
+		memcpy(buf + used, varstore_base + vars[i]->offset, len);
+		buf[used + offsetof(struct variable_header, state)] = VAR_ADDED;
+		vars[i]->offset = used;
+		used += rec.size;
+	}
+
+	memcpy(varstore_base, buf, varstore_len);
+	varstore_used = used;
+	free(buf);
+	free(vars);
+	return 0;
+}
+
+static bool
+varstore_erased(size_t offset, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		if (varstore_base[offset + i] != 0xff)
+			return false;
+	return true;
+}
+
+static int
+varstore_time_cmp(const efi_time_t *a, const efi_time_t *b)
+{
+	uint64_t ta, tb;
+
+	ta = (uint64_t)a->year << 40 | (uint64_t)a->month << 32 |
+	     (uint64_t)a->day << 24 | a->hour << 16 | a->minute << 8 |
+	     a->second;
+	tb = (uint64_t)b->year << 40 | (uint64_t)b->month << 32 |
+	     (uint64_t)b->day << 24 | b->hour << 16 | b->minute << 8 |
+	     b->second;
+	if (ta != tb)
+		return ta < tb ? -1 : 1;
+	if (a->nanosecond != b->nanosecond)
+		return a->nanosecond < b->nanosecond ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write a new copy of the variable at the end of the used space, and
+ * retire the old one.  Call with varstore_lock held.
+ */
+static int
+varstore_write(const efi_guid_t *guid, const char *name, uint32_t hash,
+	       const uint16_t *ucs2_name, size_t name_size,
+	       const uint8_t *data, size_t data_size, uint32_t attributes,
+	       const efi_time_t *timestamp)
+{
+	size_t hdr_size = varstore_header_size();
+	struct varstore_var **varp;
+	struct varstore_var *var;
+	struct varstore_rec old;
+	uint8_t *hdr;
+	size_t size;
+
+	size = hdr_size + name_size + data_size;
+	size = ALIGN_UP(size, 4);
+	if (size > varstore_len) {
+		errno = ENOSPC;
+		efi_error("variable is larger than the store");
+		return -1;
+	}
+
+	if (size > varstore_len - varstore_used ||
+	    !varstore_erased(varstore_used, size)) {
+		if (varstore_reclaim() < 0)
+			return -1;
+		if (size > varstore_len - varstore_used) {
+			errno = ENOSPC;
+			efi_error("variable store is full");
+			return -1;
+		}
+	}
+
+	varp = varstore_find(guid, name, hash);
+	if (varp && varstore_parse((*varp)->offset, &old) == 0)
+		*old.state &= VAR_IN_DELETED_TRANSITION;
+	else
+		varp = NULL;
+
+	hdr = varstore_base + varstore_used;
+	if (varstore_auth) {
+		struct auth_variable_header auth = {
+			.start_id = VARIABLE_START_ID,
+			.state = VAR_HEADER_VALID_ONLY,
+			.reserved = 0,
+			.attributes = attributes,
+			.name_size = name_size,
+			.data_size = data_size,
+			.vendor_guid = *guid,
+		};
+
+		if (timestamp)
+			auth.timestamp = *timestamp;
+		memcpy(hdr, &auth, sizeof(auth));
+	} else {
+		struct variable_header plain = {
+			.start_id = VARIABLE_START_ID,
+			.state = VAR_HEADER_VALID_ONLY,
+			.reserved = 0,
+			.attributes = attributes,
+			.name_size = name_size,
+			.data_size = data_size,
+			.vendor_guid = *guid,
+		};
+
+		memcpy(hdr, &plain, sizeof(plain));
+	}
+	memcpy(hdr + hdr_size, ucs2_name, name_size);
+	if (data_size)
+		memcpy(hdr + hdr_size + name_size, data, data_size);
+	hdr[offsetof(struct variable_header, state)] = VAR_ADDED;
+
+	if (varp) {
+		*old.state &= VAR_DELETED;
+		(*varp)->offset = varstore_used;
+	} else {
+		var = varstore_index_add(guid, name, hash, varstore_used);
+		if (!var) {
+			/* leave the variable out rather than unindexed */
+			hdr[offsetof(struct variable_header, state)] &=
+				VAR_DELETED;
+			varstore_used += size;
+			return -1;
+		}
+	}
+	varstore_used += size;
+	return 0;
+}
+
+static int
+varstore_del_variable(efi_guid_t guid, const char *name)
+{
+	struct varstore_var **varp;
+	struct varstore_rec rec;
+	int ret = -1;
+
+	if (varstore_enter() < 0)
+		return -1;
+	varp = varstore_lookup(&guid, name, &rec);
+	if (!varp)
+		goto err;
+	if (varstore_readonly) {
+		errno = EROFS;
+		efi_error("variable store is read-only");
+		goto err;
+	}
+
+	*rec.state &= VAR_DELETED;
+	varstore_index_del(varp);
+	ret = 0;
+err:
+	varstore_leave();
+	return ret;
+}
+
+static int
+varstore_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
+		      size_t data_size, uint32_t attributes,
+		      mode_t mode UNUSED)
+{
+	bool append = attributes & EFI_VARIABLE_APPEND_WRITE;
+	efi_time_t *timestamp = NULL;
+	efi_time_t stamp;
+	uint16_t *ucs2_name = NULL;
+	uint8_t *buf = NULL;
+	ssize_t name_chars;
+	size_t name_size;
+	struct varstore_var **varp;
+	struct varstore_rec rec;
+	uint32_t hash;
+	int ret = -1;
+
+	/* varstore_auth is looked at below, before varstore_enter() */
+	pthread_once(&varstore_once, varstore_init);
+
+	attributes &= ~EFI_VARIABLE_APPEND_WRITE;
+	if (attributes & EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS) {
+		errno = EINVAL;
+		efi_error("count based authenticated variables are not supported");
+		return -1;
+	}
+	if (attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) {
+		struct auth2_header *auth = (void *)data;
+		size_t skip;
+
+		if (!varstore_auth) {
+			errno = EINVAL;
+			efi_error("variable store doesn't hold authenticated variables");
+			return -1;
+		}
+		if (data_size < sizeof(*auth) ||
+		    auth->length < sizeof(*auth) - sizeof(auth->timestamp) ||
+		    auth->length > data_size - sizeof(auth->timestamp)) {
+			errno = EINVAL;
+			efi_error("invalid authentication header");
+			return -1;
+		}
+		memcpy(&stamp, &auth->timestamp, sizeof(stamp));
+		timestamp = &stamp;
+		skip = sizeof(auth->timestamp) + auth->length;
+		data += skip;
+		data_size -= skip;
+	}
+	/* there's nothing to write, and edk2 would leave the store alone */
+	if (append && data_size == 0) {
+		errno = EINVAL;
+		efi_error("nothing to append");
+		return -1;
+	}
+
+	name_size = strlen(name) * 2 + 2;
+	ucs2_name = malloc(name_size);
+	if (!ucs2_name) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+	name_chars = utf8_to_ucs2(ucs2_name, name_size, true,
+				  (const unsigned char *)name);
+	if (name_chars < 0) {
+		efi_error("could not convert variable name to UCS-2");
+		free(ucs2_name);
+		return -1;
+	}
+	name_size = name_chars * sizeof(uint16_t);
+
+	if (varstore_enter() < 0) {
+		free(ucs2_name);
+		return -1;
+	}
+	if (varstore_readonly) {
+		errno = EROFS;
+		efi_error("variable store is read-only");
+		goto err;
+	}
+
+	hash = varstore_hash(&guid, name);
+	varp = varstore_find(&guid, name, hash);
+	if (varp && varstore_parse((*varp)->offset, &rec) < 0)
+		varp = NULL;
+
+	/* as with SetVariable(), an empty write is a delete */
+	if (!append && data_size == 0) {
+		if (!varp) {
+			errno = ENOENT;
+			efi_error("variable not found");
+			goto err;
+		}
+		*rec.state &= VAR_DELETED;
+		varstore_index_del(varp);
+		ret = 0;
+		goto err;
+	}
+
+	if (varp && append) {
+		size_t size;
+
+		if (ADD((size_t)rec.data_size, data_size, &size)) {
+			errno = EOVERFLOW;
+			efi_error("arithmetic overflow computing variable size");
+			goto err;
+		}
+		/* the old data may move when the store is reclaimed */
+		buf = malloc(size);
+		if (!buf) {
+			efi_error("could not allocate memory");
+			goto err;
+		}
+		memcpy(buf, rec.data, rec.data_size);
+		memcpy(buf + rec.data_size, data, data_size);
+		data = buf;
+		data_size = size;
+		if (rec.timestamp &&
+		    (!timestamp || varstore_time_cmp(timestamp,
+						     rec.timestamp) < 0)) {
+			memcpy(&stamp, rec.timestamp, sizeof(stamp));
+			timestamp = &stamp;
+		}
+	} else if (varp && rec.attributes == attributes &&
+		   rec.data_size == data_size &&
+		   !memcmp(rec.data, data, data_size) &&
+		   (!timestamp || !rec.timestamp ||
+		    !varstore_time_cmp(timestamp, rec.timestamp))) {
+		/* flash wears out; edk2 doesn't rewrite identical data */
+		ret = 0;
+		goto err;
+	}
+
+	ret = varstore_write(&guid, name, hash, ucs2_name, name_size, data,
+			     data_size, attributes, timestamp);
+err:
+	varstore_leave();
+	free(ucs2_name);
+	free(buf);
+	return ret;
+}
+
+static int
+varstore_append_variable(efi_guid_t guid, const char *name, uint8_t *data,
+			 size_t data_size, uint32_t attributes)
+{
+	attributes |= EFI_VARIABLE_APPEND_WRITE;
+	return varstore_set_variable(guid, name, data, data_size, attributes,
+				     0);
+}
+
+static int
+varstore_snapshot_variables(efi_variable_snapshot_t *snapshot)
+{
+	int ret = -1;
+
+	if (varstore_enter() < 0)
+		return -1;
+	for (size_t i = 0; i < varstore_n_buckets; i++) {
+		for (struct varstore_var *var = varstore_buckets[i]; var;
+		     var = var->next) {
+			struct varstore_rec rec;
+
+			if (varstore_parse(var->offset, &rec) < 0)
+				continue;
+			if (snapshot_add_variable(snapshot, &var->guid,
+						  var->name, rec.attributes,
+						  rec.data, rec.data_size) < 0)
+				goto err;
+		}
+	}
+	ret = 0;
+err:
+	varstore_leave();
+	return ret;
+}
+
+/*
+ * Iterators copy the names out when they're opened, as the memory
+ * backend's do, so they don't hold the lock between calls.
+ */
+struct varstore_names {
+	size_t n_names;
+	size_t pos;
+	struct {
+		efi_guid_t guid;
+		char *name;
+	} names[];
+};
+
+static void
+varstore_varname_iter_close(struct efi_varname_iter *iter)
+{
+	struct varstore_names *names = iter->priv;
+
+	if (!names)
+		return;
+	for (size_t i = 0; i < names->n_names; i++)
+		free(names->names[i].name);
+	free(names);
+	iter->priv = NULL;
+}
+
+static int
+varstore_varname_iter_next(struct efi_varname_iter *iter, efi_guid_t **guid,
+			   char **name)
+{
+	struct varstore_names *names = iter->priv;
+	size_t pos;
+
+	if (!names)
+		return 0;
+	if (names->pos >= names->n_names) {
+		varstore_varname_iter_close(iter);
+		return 0;
+	}
+
+	pos = names->pos++;
+	iter->guid = names->names[pos].guid;
+	strncpy(iter->name, names->names[pos].name, sizeof(iter->name) - 1);
+	iter->name[sizeof(iter->name) - 1] = '\0';
+
+	*guid = &iter->guid;
+	*name = iter->name;
+	return 1;
+}
+
+static int
+varstore_varname_iter_open(struct efi_varname_iter *iter)
+{
+	struct varstore_names *names;
+	size_t n = 0;
+
+	if (varstore_enter() < 0)
+		return -1;
+	names = calloc(1, sizeof(*names) +
+			  varstore_n_vars * sizeof(names->names[0]));
+	if (!names) {
+		efi_error("could not allocate memory");
+		varstore_leave();
+		return -1;
+	}
+
+	for (size_t i = 0; i < varstore_n_buckets; i++) {
+		for (struct varstore_var *var = varstore_buckets[i]; var;
+		     var = var->next) {
+			names->names[n].name = strdup(var->name);
+			if (!names->names[n].name) {
+				efi_error("could not allocate memory");
+				names->n_names = n;
+				varstore_leave();
+				iter->priv = names;
+				varstore_varname_iter_close(iter);
+				return -1;
+			}
+			names->names[n].guid = var->guid;
+			n++;
+		}
+	}
+	names->n_names = n;
+	varstore_leave();
+
+	iter->dfd = -1;
+	iter->priv = names;
+	iter->next = varstore_varname_iter_next;
+	iter->close = varstore_varname_iter_close;
+	return 0;
+}
+
+static struct efi_varname_iter next_variable_name_iter;
+
+static int
+varstore_get_next_variable_name(efi_guid_t **guid, char **name)
+{
+	if (!guid || !name) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+
+	if ((*guid == NULL && *name != NULL) ||
+	    (*guid != NULL && *name == NULL)) {
+		errno = EINVAL;
+		efi_error("invalid arguments");
+		return -1;
+	}
+
+	if (!next_variable_name_iter.priv) {
+		if (varstore_varname_iter_open(&next_variable_name_iter) < 0)
+			return -1;
+		*guid = NULL;
+		*name = NULL;
+	}
+
+	return varstore_varname_iter_next(&next_variable_name_iter, guid,
+					  name);
+}
+
+static void DESTRUCTOR
+varstore_fini(void)
+{
+	varstore_varname_iter_close(&next_variable_name_iter);
+	for (size_t i = 0; i < varstore_n_buckets; i++) {
+		struct varstore_var *var, *next;
+
+		for (var = varstore_buckets[i]; var; var = next) {
+			next = var->next;
+			free(var->name);
+			free(var);
+		}
+	}
+	free(varstore_buckets);
+	varstore_buckets = NULL;
+	varstore_n_buckets = 0;
+	varstore_n_vars = 0;
+
+	if (varstore_map) {
+		if (!varstore_readonly)
+			msync(varstore_map, varstore_map_size, MS_SYNC);
+		munmap(varstore_map, varstore_map_size);
+		varstore_map = NULL;
+	}
+	if (varstore_fd >= 0) {
+		close(varstore_fd);
+		varstore_fd = -1;
+	}
+}
+
+struct efi_var_operations varstore_ops = {
+	.name = "varstore",
+	.probe = varstore_probe,
+	.set_variable = varstore_set_variable,
+	.append_variable = varstore_append_variable,
+	.del_variable = varstore_del_variable,
+	.get_variable = varstore_get_variable,
+	.get_variable_into = varstore_get_variable_into,
+	.get_variable_attributes = varstore_get_variable_attributes,
+	.get_variable_size = varstore_get_variable_size,
+	.get_variable_info = varstore_get_variable_info,
+	.get_next_variable_name = varstore_get_next_variable_name,
+	.chmod_variable = NULL,
+	.snapshot_variables = varstore_snapshot_variables,
+	.varname_iter_open = varstore_varname_iter_open,
+	.watch_variables = NULL,
+	.apply_transaction = NULL,
+};
+
+// vim:fenc=utf-8:tw=75:noet
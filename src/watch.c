@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * watch.c - notification of variable changes
+ */
+
+#include "fix_coverity.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "efivar.h"
+
+/*
+ * A watch is an inotify instance pointed at wherever the backend keeps its
+ * variables, the same as the read cache uses.  Events only say which
+ * variable was touched; each dispatch collapses everything that's queued
+ * into one read per variable, so a variable that was rewritten ten times
+ * since the last look is read, and reported, once.  Whatever can be read
+ * at that point is what the caller gets, and a variable that can't be
+ * found any more was deleted.
+ *
+ * The backend's watch also sees files being created, truncated, and
+ * written to, but a variable isn't really there until whoever is writing
+ * it closes the file, so only that, deletes, and renames count.
+ *
+ * As with the cache, nothing here can see the firmware changing a
+ * variable behind the kernel's back.
+ */
+#ifdef __linux__
+#define WATCH_EVENTS	(IN_CLOSE_WRITE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)
+#endif
+
+struct watch_entry {
+	efi_guid_t guid;
+	char name[NAME_MAX + 1];
+};
+
+struct efi_variable_watch {
+	int fd;
+	bool overflow;
+	bool gone;
+	struct watch_entry *pending;
+	size_t npending;
+	size_t allocated;
+};
+
+static int
+watch_queue(efi_variable_watch_t *watch, const efi_guid_t *guid,
+	    const char *name)
+{
+	struct watch_entry *entry;
+
+	for (size_t i = 0; i < watch->npending; i++) {
+		entry = &watch->pending[i];
+		if (!memcmp(&entry->guid, guid, sizeof(*guid)) &&
+		    !strcmp(entry->name, name))
+			return 0;
+	}
+
+	if (watch->npending == watch->allocated) {
+		size_t n = watch->allocated ? watch->allocated * 2 : 16;
+
+		entry = reallocarray(watch->pending, n, sizeof(*entry));
+		if (!entry) {
+			efi_error("could not allocate memory");
+			return -1;
+		}
+		watch->pending = entry;
+		watch->allocated = n;
+	}
+
+	entry = &watch->pending[watch->npending++];
+	memcpy(&entry->guid, guid, sizeof(*guid));
+	strcpy(entry->name, name);
+	return 0;
+}
+
+#ifdef __linux__
+static int
+watch_drain_events(efi_variable_watch_t *watch)
+{
+	uint8_t buf[4096]
+		__attribute__((__aligned__(__alignof__(struct inotify_event))));
+
+	while (1) {
+		ssize_t len = read(watch->fd, buf, sizeof(buf));
+		size_t pos = 0;
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			return 0;
+		if (len < 0) {
+			efi_error("could not read inotify events");
+			return -1;
+		}
+		if (len == 0)
+			return 0;
+
+		while (pos + sizeof(struct inotify_event) <= (size_t)len) {
+			struct inotify_event *ev = (void *)(buf + pos);
+			efi_guid_t guid;
+			ssize_t namelen;
+
+			pos += sizeof(*ev) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				watch->overflow = true;
+				continue;
+			}
+			if (ev->mask & (IN_DELETE_SELF|IN_UNMOUNT|IN_IGNORED)) {
+				watch->gone = true;
+				continue;
+			}
+			if (ev->len == 0 || !(ev->mask & WATCH_EVENTS))
+				continue;
+
+			namelen = generic_parse_variable_entry(ev->name, &guid);
+			if (namelen <= 0)
+				continue;
+			ev->name[namelen] = '\0';
+			if (watch_queue(watch, &guid, ev->name) < 0)
+				return -1;
+		}
+	}
+}
+#endif
+
+/*
+ * Start watching, using watch_variables() to point an inotify instance at
+ * wherever the backend keeps its variables.
+ */
+int HIDDEN
+efi_watch_new(int (*watch_variables)(int inotify_fd),
+	      efi_variable_watch_t **watchp)
+{
+#ifdef __linux__
+	efi_variable_watch_t *watch;
+
+	watch = calloc(1, sizeof(*watch));
+	if (!watch) {
+		efi_error("could not allocate memory");
+		return -1;
+	}
+
+	watch->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (watch->fd < 0) {
+		efi_error("inotify_init1() failed");
+		free(watch);
+		return -1;
+	}
+
+	if (watch_variables(watch->fd) < 0) {
+		__typeof__(errno) errno_value = errno;
+		efi_error("watch_variables() failed");
+		close(watch->fd);
+		free(watch);
+		errno = errno_value;
+		return -1;
+	}
+
+	*watchp = watch;
+	return 0;
+#else
+	(void)watch_variables;
+	(void)watchp;
+	efi_error("variable watching is not implemented");
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int NONNULL(1) PUBLIC
+efi_variable_watch_fd(efi_variable_watch_t *watch)
+{
+	return watch->fd;
+}
+
+int NONNULL(1, 3) PUBLIC
+efi_variable_watch_dispatch(efi_variable_watch_t *watch, int timeout,
+			    efi_variable_watch_cb_t *cb, void *closure)
+{
+	struct pollfd pfd = {
+		.fd = watch->fd,
+		.events = POLLIN,
+	};
+	size_t done = 0;
+	int calls = 0;
+	int rc = 0;
+
+	/* anything left over from a callback stopping us goes first */
+	if (watch->npending || watch->overflow)
+		timeout = 0;
+
+	rc = poll(&pfd, 1, timeout);
+	if (rc < 0 && errno != EINTR) {
+		efi_error("poll() failed");
+		return -1;
+	}
+#ifdef __linux__
+	if (rc > 0 && watch_drain_events(watch) < 0)
+		return -1;
+#endif
+
+	if (watch->overflow) {
+		/*
+		 * Events were lost, so what we've got isn't the whole
+		 * story either; the caller has to look at everything.
+		 */
+		watch->overflow = false;
+		watch->npending = 0;
+		calls++;
+		rc = cb(EFI_VARIABLE_WATCH_OVERFLOW, NULL, NULL, NULL, 0, 0,
+			closure);
+		if (rc != 0)
+			return calls;
+	}
+
+	while (done < watch->npending) {
+		struct watch_entry *entry = &watch->pending[done++];
+		efi_variable_watch_event_t event = EFI_VARIABLE_WATCH_CHANGED;
+		uint8_t *data = NULL;
+		size_t data_size = 0;
+		uint32_t attributes = 0;
+
+		if (efi_get_variable(entry->guid, entry->name, &data,
+				     &data_size, &attributes) < 0) {
+			if (errno == ENOENT)
+				event = EFI_VARIABLE_WATCH_DELETED;
+			data = NULL;
+			data_size = 0;
+			efi_error_clear();
+		}
+
+		calls++;
+		rc = cb(event, &entry->guid, entry->name, data, data_size,
+			attributes, closure);
+		free(data);
+		if (rc != 0)
+			break;
+	}
+	memmove(watch->pending, watch->pending + done,
+		(watch->npending - done) * sizeof(*watch->pending));
+	watch->npending -= done;
+
+	if (watch->gone && watch->npending == 0) {
+		efi_error("variable store is no longer being watched");
+		errno = ENODEV;
+		return -1;
+	}
+
+	return calls;
+}
+
+void PUBLIC
+efi_variable_watch_free(efi_variable_watch_t *watch)
+{
+	if (!watch)
+		return;
+	if (watch->fd >= 0)
+		close(watch->fd);
+	free(watch->pending);
+	free(watch);
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * x509-test.c - check parsing certificates and finding them in a secdb
+ */
+
+#include "fix_coverity.h"
+
+#include <efivar.h>
+#include <efisec.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PROGRAM_NAME "x509-test"
+
+static const char * const field_names[] = {
+	[EFI_X509_SUBJECT] = "subject",
+	[EFI_X509_ISSUER] = "issuer",
+	[EFI_X509_SERIAL] = "serial",
+	[EFI_X509_SPKI_SHA256] = "spki_sha256",
+};
+
+static uint8_t *
+read_cert(const char *path, size_t *size)
+{
+	struct stat sb;
+	uint8_t *buf;
+	ssize_t rc;
+	size_t off = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &sb) < 0)
+		err(1, "could not open \"%s\"", path);
+	buf = malloc(sb.st_size ? sb.st_size : 1);
+	if (!buf)
+		err(1, "could not allocate memory");
+	while (off < (size_t)sb.st_size) {
+		rc = read(fd, buf + off, sb.st_size - off);
+		if (rc <= 0)
+			err(1, "could not read \"%s\"", path);
+		off += rc;
+	}
+	close(fd);
+	*size = off;
+	return buf;
+}
+
+static void
+print_hex(const char *label, const uint8_t *data, size_t size)
+{
+	printf("%s:", label);
+	for (size_t i = 0; i < size; i++)
+		printf("%02hhx", data[i]);
+	printf("\n");
+}
+
+static void
+field_value(const efi_x509_cert_t *cert, efi_x509_field_t field,
+	    const uint8_t **data, size_t *size)
+{
+	switch (field) {
+	case EFI_X509_SUBJECT:
+		*data = cert->subject;
+		*size = cert->subject_size;
+		break;
+	case EFI_X509_ISSUER:
+		*data = cert->issuer;
+		*size = cert->issuer_size;
+		break;
+	case EFI_X509_SERIAL:
+		*data = cert->serial;
+		*size = cert->serial_size;
+		break;
+	case EFI_X509_SPKI_SHA256:
+	default:
+		*data = cert->spki_sha256;
+		*size = sizeof(cert->spki_sha256);
+		break;
+	}
+}
+
+/*
+ * Print the owner of every certificate in secdb whose field is the same
+ * as cert's, and check that each one really is.
+ */
+static int
+find_all(efi_secdb_t *secdb, const efi_x509_cert_t *cert,
+	 efi_x509_field_t field)
+{
+	const efi_x509_cert_t *found = NULL;
+	const uint8_t *value, *data;
+	size_t valuesz, size, pos = 0;
+	int n = 0, rc;
+
+	field_value(cert, field, &value, &valuesz);
+	printf("%s:", field_names[field]);
+	while ((rc = efi_secdb_find_cert(secdb, field, value, valuesz, &pos,
+					 &found)) > 0) {
+		char *owner = NULL;
+
+		field_value(found, field, &data, &size);
+		if (size != valuesz || memcmp(data, value, size) ||
+		    found->der_size != cert->der_size ||
+		    memcmp(found->der, cert->der, cert->der_size)) {
+			warnx("%s lookup found the wrong certificate",
+			      field_names[field]);
+			return -1;
+		}
+		if (efi_guid_to_str(found->owner, &owner) < 0)
+			err(1, "could not format owner");
+		printf(" %s", owner);
+		free(owner);
+		n++;
+	}
+	printf("%s\n", n ? "" : " none");
+	if (rc < 0) {
+		warn("%s lookup failed", field_names[field]);
+		return -1;
+	}
+	return n;
+}
+
+static int
+find_every_field(efi_secdb_t *secdb, const efi_x509_cert_t *cert)
+{
+	int rc = 0;
+
+	for (int field = 0; field < MAX_EFI_X509_FIELD; field++)
+		if (find_all(secdb, cert, field) < 0)
+			rc = -1;
+	return rc;
+}
+
+/*
+ * Parse the certificate in argv[1] and print its fields, then look it up
+ * by each of them in a secdb that has it twice under different owners,
+ * and again after each copy is deleted.
+ */
+int main(int argc, char *argv[])
+{
+	static const char * const owners[] = {
+		"0223eddb-9079-4388-af77-2d65b1c35d3b",
+		"8be4df61-93ca-11d2-aa0d-00e098032b8c",
+	};
+	efi_guid_t owner_guids[2];
+	efi_sha256_hash_t hash = { 0, };
+	efi_x509_cert_t cert, other;
+	efi_secdb_t *secdb;
+	uint8_t *der;
+	size_t dersz;
+	int rc = 0;
+
+	if (argc != 2)
+		errx(1, "usage: %s <certificate.der>", PROGRAM_NAME);
+
+	der = read_cert(argv[1], &dersz);
+	if (efi_x509_parse(der, dersz, &cert) < 0)
+		err(1, "could not parse \"%s\"", argv[1]);
+	if (cert.owner) {
+		warnx("a parsed certificate has an owner");
+		rc = 1;
+	}
+	print_hex("subject", cert.subject, cert.subject_size);
+	print_hex("issuer", cert.issuer, cert.issuer_size);
+	print_hex("serial", cert.serial, cert.serial_size);
+	print_hex("spki_sha256", cert.spki_sha256, sizeof(cert.spki_sha256));
+
+	errno = 0;
+	if (efi_x509_parse(der, dersz - 1, &other) >= 0 || errno != EINVAL) {
+		warnx("a truncated certificate parsed");
+		rc = 1;
+	}
+	efi_error_clear();
+
+	secdb = efi_secdb_new();
+	if (!secdb)
+		err(1, "could not allocate memory");
+	for (int i = 0; i < 2; i++) {
+		if (efi_str_to_guid(owners[i], &owner_guids[i]) < 0)
+			err(1, "could not parse \"%s\"", owners[i]);
+		if (efi_secdb_add_entry(secdb, &owner_guids[i], X509_CERT,
+					(efi_secdb_data_t *)der, dersz) < 0)
+			err(1, "could not add certificate");
+	}
+	/* something that isn't a certificate at all */
+	hash[0] = 1;
+	if (efi_secdb_add_entry(secdb, &owner_guids[0], SHA256,
+				(efi_secdb_data_t *)hash, sizeof(hash)) < 0)
+		err(1, "could not add hash");
+
+	printf("both copies:\n");
+	if (find_every_field(secdb, &cert) < 0)
+		rc = 1;
+
+	for (int i = 0; i < 2; i++) {
+		if (efi_secdb_del_entry(secdb, &owner_guids[i], X509_CERT,
+					(efi_secdb_data_t *)der, dersz) < 0)
+			err(1, "could not delete certificate");
+		printf("deleted %s:\n", owners[i]);
+		if (find_every_field(secdb, &cert) < 0)
+			rc = 1;
+	}
+
+	efi_secdb_free(secdb);
+	free(der);
+	return rc;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * x509.c - picking X.509 certificates apart, and finding them in a secdb
+ */
+
+#include "efisec.h"
+#include "sha256.h"
+
+#define ASN1_INTEGER		0x02
+#define ASN1_SEQUENCE		0x30
+#define ASN1_CONTEXT_0		0xa0
+
+/*
+ * Step over the next element, which has to be a tag, leaving *elem and
+ * *elemsz covering the whole thing and *contents and *contentsz just
+ * what's inside.  Either pair may be NULL.
+ */
+static int
+der_next(const uint8_t **p, const uint8_t *end, uint8_t tag,
+	 const uint8_t **elem, size_t *elemsz,
+	 const uint8_t **contents, size_t *contentsz)
+{
+	const uint8_t *q = *p;
+	uint8_t t;
+	size_t len;
+
+	if (der_get_tlv(&q, end, &t, &len) < 0 || t != tag)
+		return -1;
+
+	if (elem) {
+		*elem = *p;
+		*elemsz = q + len - *p;
+	}
+	if (contents) {
+		*contents = q;
+		*contentsz = len;
+	}
+	*p = q + len;
+	return 0;
+}
+
+/*
+ * Certificate ::= SEQUENCE {
+ *	tbsCertificate SEQUENCE {
+ *		version [0] EXPLICIT INTEGER OPTIONAL,
+ *		serialNumber INTEGER,
+ *		signature AlgorithmIdentifier,
+ *		issuer Name,
+ *		validity Validity,
+ *		subject Name,
+ *		subjectPublicKeyInfo SubjectPublicKeyInfo,
+ *		...
+ *	},
+ *	...
+ * }
+ * and everything after the key is of no interest here.
+ */
+int PUBLIC
+efi_x509_parse(const uint8_t *der, size_t dersz, efi_x509_cert_t *cert)
+{
+	const uint8_t *p = der, *end = der + dersz;
+	const uint8_t *tbs;
+	size_t tbssz;
+	struct sha256_ctx ctx;
+
+	if (!der || !cert) {
+		errno = EINVAL;
+		efi_error("invalid argument");
+		return -1;
+	}
+	memset(cert, 0, sizeof(*cert));
+
+	if (der_next(&p, end, ASN1_SEQUENCE, &cert->der, &cert->der_size,
+		     &tbs, &tbssz) < 0)
+		goto bad;
+	p = tbs;
+	if (der_next(&p, tbs + tbssz, ASN1_SEQUENCE, NULL, NULL,
+		     &tbs, &tbssz) < 0)
+		goto bad;
+	p = tbs;
+	end = tbs + tbssz;
+
+	if (p < end && *p == ASN1_CONTEXT_0 &&
+	    der_next(&p, end, ASN1_CONTEXT_0, NULL, NULL, NULL, NULL) < 0)
+		goto bad;
+	if (der_next(&p, end, ASN1_INTEGER, NULL, NULL,
+		     &cert->serial, &cert->serial_size) < 0 ||
+	    der_next(&p, end, ASN1_SEQUENCE, NULL, NULL, NULL, NULL) < 0 ||
+	    der_next(&p, end, ASN1_SEQUENCE, &cert->issuer,
+		     &cert->issuer_size, NULL, NULL) < 0 ||
+	    der_next(&p, end, ASN1_SEQUENCE, NULL, NULL, NULL, NULL) < 0 ||
+	    der_next(&p, end, ASN1_SEQUENCE, &cert->subject,
+		     &cert->subject_size, NULL, NULL) < 0 ||
+	    der_next(&p, end, ASN1_SEQUENCE, &cert->spki,
+		     &cert->spki_size, NULL, NULL) < 0)
+		goto bad;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, cert->spki, cert->spki_size);
+	sha256_final(&ctx, cert->spki_sha256);
+	return 0;
+bad:
+	memset(cert, 0, sizeof(*cert));
+	errno = EINVAL;
+	efi_error("not an X.509 certificate");
+	return -1;
+}
+
+/*
+ * One open-addressed table of certificate numbers per field, each with
+ * at least twice as many slots as there are certificates.  Fields repeat
+ * (one issuer signs lots of certificates), so matches are found by
+ * probing until an empty slot rather than stopping at the first one.
+ */
+#define SECDB_CERTS_MIN_SLOTS	16
+
+struct secdb_certs {
+	efi_x509_cert_t *certs;
+	size_t ncerts;
+	size_t nslots;			// per field, always a power of two
+	size_t *slots;			// 0, or 1 + a certificate number
+};
+
+static void
+cert_field(const efi_x509_cert_t *cert, efi_x509_field_t field,
+	   const uint8_t **data, size_t *size)
+{
+	switch (field) {
+	case EFI_X509_SUBJECT:
+		*data = cert->subject;
+		*size = cert->subject_size;
+		break;
+	case EFI_X509_ISSUER:
+		*data = cert->issuer;
+		*size = cert->issuer_size;
+		break;
+	case EFI_X509_SERIAL:
+		*data = cert->serial;
+		*size = cert->serial_size;
+		break;
+	case EFI_X509_SPKI_SHA256:
+	default:
+		*data = cert->spki_sha256;
+		*size = sizeof(cert->spki_sha256);
+		break;
+	}
+}
+
+/*
+ * FNV-1a; Names run a couple of hundred bytes at most, and this only
+ * happens once per lookup.
+ */
+static size_t
+cert_field_hash(const uint8_t *data, size_t size)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	for (size_t i = 0; i < size; i++)
+		h = (h ^ data[i]) * 0x100000001b3ull;
+	return h ^ (h >> 32);
+}
+
+void
+secdb_certs_free(efi_secdb_t *top)
+{
+	if (!top->certs)
+		return;
+
+	xfree(top->certs->certs);
+	xfree(top->certs->slots);
+	xfree(top->certs);
+}
+
+static int
+secdb_certs_build(efi_secdb_t *top)
+{
+	struct secdb_certs *certs;
+	size_t ncerts = 0;
+	list_t *pos;
+
+	/* after this, sublists' first nsigs signatures are all live */
+	efi_secdb_compact_(top);
+
+	for_each_secdb(pos, &top->list) {
+		efi_secdb_t *secdb = list_entry(pos, efi_secdb_t, list);
+
+		if (secdb->algorithm == X509_CERT)
+			ncerts += secdb->nsigs;
+	}
+
+	certs = calloc(1, sizeof(*certs));
+	if (!certs)
+		goto err;
+	certs->nslots = SECDB_CERTS_MIN_SLOTS;
+	while (certs->nslots < ncerts * 2)
+		certs->nslots <<= 1;
+	certs->certs = calloc(ncerts ? ncerts : 1, sizeof(*certs->certs));
+	certs->slots = calloc(certs->nslots * MAX_EFI_X509_FIELD,
+			      sizeof(*certs->slots));
+	if (!certs->certs || !certs->slots)
+		goto err;
+
+	for_each_secdb(pos, &top->list) {
+		efi_secdb_t *secdb = list_entry(pos, efi_secdb_t, list);
+
+		if (secdb->algorithm != X509_CERT)
+			continue;
+
+		for (size_t i = 0; i < secdb->nsigs; i++) {
+			efi_signature_data_t *sig = secdb_sig(secdb, i);
+			efi_x509_cert_t *cert = &certs->certs[certs->ncerts];
+
+			if (efi_x509_parse(sig->signature_data,
+					   secdb_sig_datasz(secdb), cert) < 0) {
+				debug("secdb:%p signature %zd isn't a certificate",
+				      secdb, i);
+				efi_error_clear();
+				continue;
+			}
+			cert->owner = &sig->signature_owner;
+			certs->ncerts += 1;
+		}
+	}
+
+	for (size_t n = 0; n < certs->ncerts; n++) {
+		for (efi_x509_field_t f = 0; f < MAX_EFI_X509_FIELD; f++) {
+			size_t *slots = certs->slots + f * certs->nslots;
+			size_t mask = certs->nslots - 1;
+			const uint8_t *data;
+			size_t size, slot;
+
+			cert_field(&certs->certs[n], f, &data, &size);
+			slot = cert_field_hash(data, size) & mask;
+			while (slots[slot])
+				slot = (slot + 1) & mask;
+			slots[slot] = n + 1;
+		}
+	}
+
+	top->certs = certs;
+	return 0;
+err:
+	if (certs) {
+		xfree(certs->certs);
+		xfree(certs->slots);
+		xfree(certs);
+	}
+	efi_error("could not allocate memory");
+	return -1;
+}
+
+PUBLIC int
+efi_secdb_find_cert(efi_secdb_t *top, efi_x509_field_t field,
+		    const void *value, size_t valuesz, size_t *pos,
+		    const efi_x509_cert_t **cert)
+{
+	struct secdb_certs *certs;
+	size_t *slots, mask, start, i;
+
+	if (!top || !value || !pos || !cert ||
+	    field < 0 || field >= MAX_EFI_X509_FIELD) {
+		errno = EINVAL;
+		efi_error("invalid argument");
+		return -1;
+	}
+
+	if (!top->certs && secdb_certs_build(top) < 0)
+		return -1;
+	certs = top->certs;
+
+	slots = certs->slots + field * certs->nslots;
+	mask = certs->nslots - 1;
+	start = cert_field_hash(value, valuesz) & mask;
+	for (i = *pos; i < certs->nslots && slots[(start + i) & mask]; i++) {
+		const efi_x509_cert_t *candidate;
+		const uint8_t *data;
+		size_t size;
+
+		candidate = &certs->certs[slots[(start + i) & mask] - 1];
+		cert_field(candidate, field, &data, &size);
+		if (size == valuesz && !memcmp(data, value, size)) {
+			*pos = i + 1;
+			*cert = candidate;
+			return 1;
+		}
+	}
+	*pos = i;
+	return 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -71,5 +71,40 @@ get_asn1_seq_size(uint8_t *location, uint32_t size)
 
 #undef SMALLEST_POSSIBLE_DER_SEQ
 
+/*
+ * Read the DER tag and length at *p, leaving *p at the contents and *len
+ * set to their size.  DER only has definite lengths, and nothing in a
+ * certificate needs a tag number past 30, so anything else is an error,
+ * as is contents that would run past end.
+ */
+static inline int __attribute__((unused))
+der_get_tlv(const uint8_t **p, const uint8_t *end, uint8_t *tag, size_t *len)
+{
+	const uint8_t *q = *p;
+	size_t l = 0;
+
+	if (end - q < 2 || (q[0] & 0x1f) == 0x1f)
+		return -1;
+	*tag = *q++;
+
+	if (!(*q & 0x80)) {
+		l = *q++;
+	} else {
+		uint8_t octets = *q++ & 0x7f;
+
+		if (octets == 0 || octets > sizeof(uint32_t) ||
+		    end - q < octets)
+			return -1;
+		while (octets--)
+			l = (l << 8) | *q++;
+	}
+
+	if ((size_t)(end - q) < l)
+		return -1;
+	*p = q;
+	*len = l;
+	return 0;
+}
+
 #endif
 // vim:fenc=utf-8:tw=75:noet